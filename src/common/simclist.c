@@ -248,6 +248,10 @@ int list_init(list_t *restrict l) {
     l->iter_pos = 0;
     l->iter_curentry = NULL;
 
+    /* no array of the entries */
+    l->index = NULL;
+    l->index_size = 0;
+
     /* free-list attributes */
     l->spareels = (struct list_entry_s **)malloc(SIMCLIST_MAX_SPARE_ELEMS * sizeof(struct list_entry_s *));
     l->spareelsnum = 0;
@@ -272,6 +276,7 @@ void list_destroy(list_t *restrict l) {
         free(l->spareels[i]);
     }
     free(l->spareels);
+    free(l->index);
     free(l->head_sentinel);
     free(l->tail_sentinel);
 }
@@ -350,6 +355,29 @@ int list_attributes_unserializer(list_t *restrict l, element_unserializer unseri
     return 0;
 }
 
+int list_attributes_indexed(list_t *restrict l, int indexed) {
+    struct list_entry_s *s;
+    unsigned int i;
+
+    if (l == NULL || l->iter_active) return -1;
+
+    free(l->index);
+    l->index = NULL;
+    l->index_size = 0;
+    if (! indexed) return 0;
+
+    l->index_size = l->numels > 8 ? l->numels : 8;
+    l->index = (struct list_entry_s **)malloc(l->index_size * sizeof(struct list_entry_s *));
+    if (l->index == NULL) {
+        l->index_size = 0;
+        return -1;
+    }
+    for (i = 0, s = l->head_sentinel->next; s != l->tail_sentinel; s = s->next, i++)
+        l->index[i] = s;
+
+    return 0;
+}
+
 int list_append(list_t *restrict l, const void *data) {
     return list_insert_at(l, data, l->numels);
 }
@@ -405,6 +433,12 @@ static inline struct list_entry_s *list_findpos(const list_t *restrict l, int po
     /* accept 1 slot overflow for fetching head and tail sentinels */
     if (posstart < -1 || posstart > (int)l->numels) return NULL;
 
+    if (l->index != NULL) {
+        if (posstart == -1) return l->head_sentinel;
+        if (posstart == (int)l->numels) return l->tail_sentinel;
+        return l->index[posstart];
+    }
+
     x = (float)(posstart+1) / l->numels;
     if (x <= 0.25) {
         /* first quarter: get to posstart from head */
@@ -446,6 +480,16 @@ int list_insert_at(list_t *restrict l, const void *data, unsigned int pos) {
 
     if (l->iter_active || pos > l->numels) return -1;
 
+    if (l->index != NULL && l->numels == l->index_size) {
+        struct list_entry_s **index;
+
+        index = (struct list_entry_s **)realloc(l->index, 2 * l->index_size * sizeof(struct list_entry_s *));
+        if (index == NULL)
+            return -1;
+        l->index = index;
+        l->index_size *= 2;
+    }
+
     /* this code optimizes malloc() with a free-list */
     if (l->spareelsnum > 0) {
         lent = l->spareels[l->spareelsnum-1];
@@ -474,6 +518,11 @@ int list_insert_at(list_t *restrict l, const void *data, unsigned int pos) {
     lent->next = succ;
     succ->prev = lent;
 
+    if (l->index != NULL) {
+        memmove(l->index + pos + 1, l->index + pos, (l->numels - pos) * sizeof(struct list_entry_s *));
+        l->index[pos] = lent;
+    }
+
     l->numels++;
 
     /* fix mid pointer */
@@ -579,6 +628,9 @@ int list_delete_range(list_t *restrict l, unsigned int posstart, unsigned int po
     lastvalid->next = tmp;
     tmp->prev = lastvalid;
 
+    if (l->index != NULL)
+        memmove(l->index + posstart, l->index + posend + 1, (l->numels - posend - 1) * sizeof(struct list_entry_s *));
+
     l->numels -= posend - posstart + 1;
 
     assert(list_repOk(l));
@@ -1364,6 +1416,9 @@ static int list_drop_elem(list_t *restrict l, struct list_entry_s *tmp, unsigned
     tmp->prev->next = tmp->next;
     tmp->next->prev = tmp->prev;
 
+    if (l->index != NULL)
+        memmove(l->index + pos, l->index + pos + 1, (l->numels - pos - 1) * sizeof(struct list_entry_s *));
+
     /* free what's to be freed */
     if (l->attrs.copy_data && tmp->data != NULL)
         free(tmp->data);
@@ -203,6 +203,10 @@ typedef struct {
     unsigned int iter_pos;
     struct list_entry_s *iter_curentry;
 
+    /* entries in list order, for list_attributes_indexed() */
+    struct list_entry_s **index;
+    unsigned int index_size;
+
     /* list attributes */
     struct list_attributes_s attrs;
 } list_t;
@@ -349,6 +353,19 @@ int list_attributes_serializer(list_t *restrict l, element_serializer serializer
  */
 int list_attributes_unserializer(list_t *restrict l, element_unserializer unserializer_fun);
 
+/**
+ * keep an array of the elements along the list.
+ *
+ * With the array, list_get_at() and the positional operations take
+ * constant time, and a loop over the positions of the list is linear.
+ * Inserting or deleting in the middle moves the rest of the array.
+ *
+ * @param l         list to operate
+ * @param indexed   1 to keep the array, 0 to drop it
+ * @return          0 if the attribute was successfully set; -1 otherwise
+ */
+int list_attributes_indexed(list_t *restrict l, int indexed);
+
 /**
  * append data at the end of the list.
  *
@@ -24,6 +24,21 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#endif
 
 #include "internal.h"
 #include "asn1.h"
@@ -172,7 +187,11 @@ static int sc_apdu2bytes(sc_context_t *ctx, const sc_apdu_t *apdu,
 void sc_apdu_log(sc_context_t *ctx, int level, const u8 *data, size_t len, int is_out)
 {
 	size_t blen = len * 5 + 128;
-	char   *buf = malloc(blen);
+	char   *buf;
+
+	if (!SC_LOG_ENABLED(ctx, level))
+		return;
+	buf = malloc(blen);
 	if (buf == NULL)
 		return;
 
@@ -203,14 +222,43 @@ int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	if (nbuf == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 	/* encode the APDU in the buffer */
-	if (sc_apdu2bytes(ctx, apdu, proto, nbuf, nlen) != SC_SUCCESS)
+	if (sc_apdu2bytes(ctx, apdu, proto, nbuf, nlen) != SC_SUCCESS) {
+		free(nbuf);
 		return SC_ERROR_INTERNAL;
+	}
 	*buf = nbuf;
 	*len = nlen;
 
 	return SC_SUCCESS;
 }
 
+size_t sc_apdu_get_octets_len(const sc_apdu_t *apdu, unsigned int proto)
+{
+	if (apdu == NULL)
+		return 0;
+	return sc_apdu_get_length(apdu, proto);
+}
+
+int sc_apdu_get_octets_buf(sc_context_t *ctx, const sc_apdu_t *apdu, u8 *buf,
+	size_t buflen, size_t *len, unsigned int proto)
+{
+	size_t	nlen;
+
+	if (apdu == NULL || buf == NULL || len == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	nlen = sc_apdu_get_length(apdu, proto);
+	if (nlen == 0)
+		return SC_ERROR_INTERNAL;
+	if (nlen > buflen)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	if (sc_apdu2bytes(ctx, apdu, proto, buf, nlen) != SC_SUCCESS)
+		return SC_ERROR_INTERNAL;
+	*len = nlen;
+
+	return SC_SUCCESS;
+}
+
 int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 	size_t len)
 {
@@ -371,6 +419,828 @@ sc_detect_apdu_cse(const sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
+unsigned long long
+_sc_time_us(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0 && !QueryPerformanceFrequency(&freq))
+		return 0;
+	QueryPerformanceCounter(&now);
+	return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000
+		+ (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void
+sc_transmit_count(struct sc_transmit_counter *counter, size_t sent, size_t received,
+		unsigned long long time_us, int rv)
+{
+	unsigned int bucket = 0;
+
+	counter->count++;
+	if (rv < 0)
+		counter->errors++;
+	counter->bytes_sent += sent;
+	counter->bytes_received += received;
+	counter->time_us += time_us;
+
+	while (time_us > 1 && bucket < SC_TRANSMIT_STATS_BUCKETS - 1) {
+		time_us >>= 1;
+		bucket++;
+	}
+	counter->histogram[bucket]++;
+}
+
+#define SC_APDU_TRACE_CHUNK		(1024 * 1024)
+#define SC_APDU_TRACE_MAX_READERS	16
+#define SC_APDU_TRACE_NO_READER		0xFFFF
+#define SC_APDU_TRACE_PAD(len)		(((len) + 7) & ~(size_t)7)
+
+struct sc_apdu_trace {
+	void *mutex;
+#ifdef HAVE_SYS_MMAN_H
+	/* The records are written into a shared mapping of the end of the
+	 * file, which is grown by SC_APDU_TRACE_CHUNK at a time */
+	int fd;
+	size_t page_size;
+	off_t map_off;
+	u8 *map;
+	size_t map_len;
+	size_t pos;
+#else
+	FILE *file;
+	u8 *buf;
+	size_t buf_len;
+#endif
+	size_t reader_count;
+	char *readers[SC_APDU_TRACE_MAX_READERS];
+};
+
+static void
+sc_apdu_trace_put(u8 *p, unsigned long long x, size_t n)
+{
+	while (n--) {
+		p[n] = (u8)(x & 0xff);
+		x >>= 8;
+	}
+}
+
+/* Returns room for a record of 'len' bytes at the end of the trace */
+static u8 *
+sc_apdu_trace_reserve(struct sc_apdu_trace *trace, size_t len)
+{
+#ifdef HAVE_SYS_MMAN_H
+	size_t keep, map_len;
+	off_t map_off;
+	void *map;
+
+	if (trace->map != NULL && trace->pos + len <= trace->map_len)
+		return trace->map + trace->pos;
+
+	/* Map again from the page of the current end */
+	keep = trace->pos % trace->page_size;
+	map_off = trace->map_off + (trace->pos - keep);
+	map_len = SC_APDU_TRACE_CHUNK;
+	while (map_len < keep + len)
+		map_len += SC_APDU_TRACE_CHUNK;
+	if (trace->map != NULL)
+		munmap(trace->map, trace->map_len);
+	trace->map = NULL;
+	trace->map_off = map_off;
+	trace->pos = keep;
+	if (ftruncate(trace->fd, map_off + map_len) < 0)
+		return NULL;
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, trace->fd, map_off);
+	if (map == MAP_FAILED)
+		return NULL;
+	trace->map = map;
+	trace->map_len = map_len;
+	return trace->map + trace->pos;
+#else
+	u8 *buf;
+
+	if (len > trace->buf_len) {
+		buf = realloc(trace->buf, len);
+		if (buf == NULL)
+			return NULL;
+		trace->buf = buf;
+		trace->buf_len = len;
+	}
+	return trace->buf;
+#endif
+}
+
+static void
+sc_apdu_trace_commit(struct sc_apdu_trace *trace, size_t len)
+{
+#ifdef HAVE_SYS_MMAN_H
+	trace->pos += len;
+#else
+	fwrite(trace->buf, 1, len, trace->file);
+#endif
+}
+
+static unsigned int
+sc_apdu_trace_reader_id(struct sc_apdu_trace *trace, const struct sc_reader *reader)
+{
+	size_t id, name_len, len;
+	u8 *p;
+
+	for (id = 0; id < trace->reader_count; id++)
+		if (strcmp(trace->readers[id], reader->name) == 0)
+			return id;
+	if (id == SC_APDU_TRACE_MAX_READERS)
+		return SC_APDU_TRACE_NO_READER;
+
+	name_len = strlen(reader->name) + 1;
+	len = SC_APDU_TRACE_PAD(SC_APDU_TRACE_HEADER_LEN + name_len);
+	trace->readers[id] = strdup(reader->name);
+	if (trace->readers[id] == NULL)
+		return SC_APDU_TRACE_NO_READER;
+	p = sc_apdu_trace_reserve(trace, len);
+	if (p == NULL) {
+		free(trace->readers[id]);
+		return SC_APDU_TRACE_NO_READER;
+	}
+	memset(p, 0, len);
+	p[0] = SC_APDU_TRACE_READER;
+	sc_apdu_trace_put(p + 2, id, 2);
+	sc_apdu_trace_put(p + 4, len, 4);
+	memcpy(p + SC_APDU_TRACE_HEADER_LEN, reader->name, name_len);
+	sc_apdu_trace_commit(trace, len);
+	trace->reader_count++;
+	return id;
+}
+
+static void
+sc_apdu_trace_write(struct sc_reader *reader, const struct sc_apdu *apdu,
+		unsigned long long start, unsigned long long time_us, int rv)
+{
+	struct sc_context *ctx = reader->ctx;
+	struct sc_apdu_trace *trace = ctx->apdu_trace;
+	size_t cmd_len, resp_len, len;
+	unsigned int id;
+	u8 *p;
+
+	cmd_len = sc_apdu_get_length(apdu, reader->active_protocol);
+	resp_len = (rv < 0 || apdu->resp == NULL) ? 0 : apdu->resplen;
+	len = SC_APDU_TRACE_PAD(SC_APDU_TRACE_APDU_HEADER_LEN + cmd_len + resp_len);
+
+	sc_mutex_lock(ctx, trace->mutex);
+	id = sc_apdu_trace_reader_id(trace, reader);
+	p = sc_apdu_trace_reserve(trace, len);
+	if (p != NULL) {
+		p[0] = SC_APDU_TRACE_APDU;
+		p[1] = 0;
+		sc_apdu_trace_put(p + 2, id, 2);
+		sc_apdu_trace_put(p + 4, len, 4);
+		sc_apdu_trace_put(p + 8, start, 8);
+		sc_apdu_trace_put(p + 16, time_us, 4);
+		sc_apdu_trace_put(p + 20, (unsigned int)rv, 4);
+		sc_apdu_trace_put(p + 24, rv < 0 ? 0 : (apdu->sw1 << 8) | apdu->sw2, 2);
+		sc_apdu_trace_put(p + 26, cmd_len, 2);
+		sc_apdu_trace_put(p + 28, resp_len, 4);
+		p += SC_APDU_TRACE_APDU_HEADER_LEN;
+		if (sc_apdu2bytes(ctx, apdu, reader->active_protocol, p, cmd_len) != SC_SUCCESS)
+			memset(p, 0, cmd_len);
+		if (resp_len)
+			memcpy(p + cmd_len, apdu->resp, resp_len);
+		memset(p + cmd_len + resp_len, 0,
+				len - SC_APDU_TRACE_APDU_HEADER_LEN - cmd_len - resp_len);
+		sc_apdu_trace_commit(trace, len);
+	}
+	sc_mutex_unlock(ctx, trace->mutex);
+}
+
+void
+_sc_apdu_trace_atr(struct sc_reader *reader)
+{
+	struct sc_context *ctx = reader->ctx;
+	struct sc_apdu_trace *trace = ctx->apdu_trace;
+	size_t len;
+	unsigned int id;
+	u8 *p;
+
+	if (trace == NULL)
+		return;
+	len = SC_APDU_TRACE_PAD(SC_APDU_TRACE_HEADER_LEN + 1 + reader->atr.len);
+
+	sc_mutex_lock(ctx, trace->mutex);
+	id = sc_apdu_trace_reader_id(trace, reader);
+	p = sc_apdu_trace_reserve(trace, len);
+	if (p != NULL) {
+		memset(p, 0, len);
+		p[0] = SC_APDU_TRACE_ATR;
+		sc_apdu_trace_put(p + 2, id, 2);
+		sc_apdu_trace_put(p + 4, len, 4);
+		p[SC_APDU_TRACE_HEADER_LEN] = (u8)reader->atr.len;
+		memcpy(p + SC_APDU_TRACE_HEADER_LEN + 1, reader->atr.value, reader->atr.len);
+		sc_apdu_trace_commit(trace, len);
+	}
+	sc_mutex_unlock(ctx, trace->mutex);
+}
+
+static void
+sc_apdu_trace_free(struct sc_context *ctx, struct sc_apdu_trace *trace)
+{
+	size_t ii;
+
+	for (ii = 0; ii < trace->reader_count; ii++)
+		free(trace->readers[ii]);
+	if (trace->mutex != NULL)
+		sc_mutex_destroy(ctx, trace->mutex);
+	free(trace);
+}
+
+int
+_sc_apdu_trace_open(struct sc_context *ctx, const char *filename)
+{
+	struct sc_apdu_trace *trace;
+	size_t len;
+	u8 *p;
+	int r;
+#ifdef HAVE_SYS_MMAN_H
+	off_t size;
+#else
+	long size;
+#endif
+
+	if (ctx->apdu_trace != NULL)
+		return SC_SUCCESS;
+
+	trace = calloc(1, sizeof(struct sc_apdu_trace));
+	if (trace == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = sc_mutex_create(ctx, &trace->mutex);
+	if (r != SC_SUCCESS) {
+		free(trace);
+		return r;
+	}
+
+#ifdef HAVE_SYS_MMAN_H
+	trace->fd = open(filename, O_RDWR | O_CREAT, 0600);
+	if (trace->fd < 0)
+		goto err;
+	size = lseek(trace->fd, 0, SEEK_END);
+	if (size < 0)
+		goto err;
+	trace->page_size = sysconf(_SC_PAGESIZE);
+	trace->map_off = size - size % trace->page_size;
+	trace->pos = SC_APDU_TRACE_PAD((size_t)(size - trace->map_off));
+#else
+	trace->file = fopen(filename, "ab");
+	if (trace->file == NULL)
+		goto err;
+	fseek(trace->file, 0, SEEK_END);
+	size = ftell(trace->file);
+	for (; size >= 0 && size % 8; size++)
+		fputc(0, trace->file);
+#endif
+
+	len = SC_APDU_TRACE_MAGIC_LEN;
+	p = sc_apdu_trace_reserve(trace, len);
+	if (p == NULL)
+		goto err;
+	memcpy(p, SC_APDU_TRACE_MAGIC, len);
+	sc_apdu_trace_commit(trace, len);
+
+	ctx->apdu_trace = trace;
+	return SC_SUCCESS;
+
+err:
+	sc_log(ctx, "cannot open APDU trace file '%s'", filename);
+#ifdef HAVE_SYS_MMAN_H
+	if (trace->map != NULL)
+		munmap(trace->map, trace->map_len);
+	if (trace->fd >= 0)
+		close(trace->fd);
+#else
+	if (trace->file != NULL)
+		fclose(trace->file);
+	free(trace->buf);
+#endif
+	sc_apdu_trace_free(ctx, trace);
+	return SC_ERROR_FILE_NOT_FOUND;
+}
+
+void
+_sc_apdu_trace_close(struct sc_context *ctx)
+{
+	struct sc_apdu_trace *trace = ctx->apdu_trace;
+
+	if (trace == NULL)
+		return;
+	ctx->apdu_trace = NULL;
+
+#ifdef HAVE_SYS_MMAN_H
+	if (trace->map != NULL)
+		munmap(trace->map, trace->map_len);
+	if (trace->fd >= 0) {
+		/* Cut the unused part of the last chunk */
+		if (ftruncate(trace->fd, trace->map_off + trace->pos) < 0)
+			sc_log(ctx, "cannot truncate APDU trace file");
+		close(trace->fd);
+	}
+#else
+	if (trace->file != NULL)
+		fclose(trace->file);
+	free(trace->buf);
+#endif
+	sc_apdu_trace_free(ctx, trace);
+}
+
+void
+_sc_apdu_trace_forked(struct sc_context *ctx)
+{
+	struct sc_apdu_trace *trace = ctx->apdu_trace;
+
+	if (trace == NULL)
+		return;
+	ctx->apdu_trace = NULL;
+
+	/* The parent goes on writing at the end of the file: the child lets
+	 * the file alone. The mutex may have been held by a thread of the
+	 * parent, so it is dropped as it is. */
+#ifdef HAVE_SYS_MMAN_H
+	if (trace->map != NULL)
+		munmap(trace->map, trace->map_len);
+	if (trace->fd >= 0)
+		close(trace->fd);
+#else
+	/* Closing the FILE would write the parent's buffered records again */
+	free(trace->buf);
+#endif
+	trace->mutex = NULL;
+	sc_apdu_trace_free(ctx, trace);
+}
+
+void
+sc_trace_span(struct sc_context *ctx, int phase, const char *name, long value)
+{
+	sc_trace_callback_t cb = ctx->trace_cb;
+
+	if (cb != NULL)
+		cb(ctx->trace_arg, phase, name, value, _sc_time_us());
+}
+
+int
+sc_set_trace_callback(sc_context_t *ctx, sc_trace_callback_t cb, void *arg)
+{
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	/* The callback of the application replaces the file */
+	_sc_span_trace_close(ctx);
+	ctx->trace_arg = arg;
+	ctx->trace_cb = cb;
+	return SC_SUCCESS;
+}
+
+/* The spans are written as the "B" and "E" events of the Chrome trace
+ * format, one per line, which chrome://tracing and Perfetto read even
+ * without the closing bracket. The file is appended to by every process. */
+struct sc_span_trace {
+	struct sc_context *ctx;
+	void *mutex;
+	FILE *file;
+	unsigned long pid;
+};
+
+static void
+sc_span_trace_write(void *arg, int phase, const char *name, long value,
+		unsigned long long time_us)
+{
+	struct sc_span_trace *trace = arg;
+	unsigned long tid;
+	char line[256];
+	int len;
+
+#ifdef _WIN32
+	tid = GetCurrentThreadId();
+#elif defined(HAVE_PTHREAD)
+	tid = (unsigned long)pthread_self();
+#else
+	tid = 0;
+#endif
+	len = snprintf(line, sizeof(line),
+			"{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%llu,\"pid\":%lu,\"tid\":%lu,\"args\":{\"value\":%ld}},\n",
+			name, phase == SC_TRACE_SPAN_BEGIN ? "B" : "E", time_us,
+			trace->pid, tid, value);
+	if (len < 0 || (size_t)len >= sizeof(line))
+		return;
+
+	sc_mutex_lock(trace->ctx, trace->mutex);
+	fwrite(line, 1, len, trace->file);
+	fflush(trace->file);
+	sc_mutex_unlock(trace->ctx, trace->mutex);
+}
+
+int
+_sc_span_trace_open(struct sc_context *ctx, const char *filename)
+{
+	struct sc_span_trace *trace;
+	int r;
+
+	if (ctx->trace_cb != NULL)
+		return SC_SUCCESS;
+
+	trace = calloc(1, sizeof(struct sc_span_trace));
+	if (trace == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = sc_mutex_create(ctx, &trace->mutex);
+	if (r != SC_SUCCESS) {
+		free(trace);
+		return r;
+	}
+	trace->file = fopen(filename, "a");
+	if (trace->file == NULL) {
+		sc_log(ctx, "cannot open span trace file '%s'", filename);
+		sc_mutex_destroy(ctx, trace->mutex);
+		free(trace);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	fseek(trace->file, 0, SEEK_END);
+	if (ftell(trace->file) == 0) {
+		fputs("[\n", trace->file);
+		fflush(trace->file);
+	}
+	trace->ctx = ctx;
+#ifdef _WIN32
+	trace->pid = GetCurrentProcessId();
+#else
+	trace->pid = (unsigned long)getpid();
+#endif
+
+	ctx->span_trace = trace;
+	ctx->trace_arg = trace;
+	ctx->trace_cb = sc_span_trace_write;
+	return SC_SUCCESS;
+}
+
+void
+_sc_span_trace_close(struct sc_context *ctx)
+{
+	struct sc_span_trace *trace = ctx->span_trace;
+
+	if (trace == NULL)
+		return;
+	ctx->trace_cb = NULL;
+	ctx->trace_arg = NULL;
+	ctx->span_trace = NULL;
+
+	fclose(trace->file);
+	if (trace->mutex != NULL)
+		sc_mutex_destroy(ctx, trace->mutex);
+	free(trace);
+}
+
+void
+_sc_span_trace_forked(struct sc_context *ctx)
+{
+	struct sc_span_trace *trace = ctx->span_trace;
+
+	if (trace == NULL)
+		return;
+
+	/* The child appends its own events, under its own pid, to the same
+	 * file; the parent's mutex may be held, so a new one is taken */
+#ifndef _WIN32
+	trace->pid = (unsigned long)getpid();
+#endif
+	trace->mutex = NULL;
+	if (sc_mutex_create(ctx, &trace->mutex) != SC_SUCCESS)
+		_sc_span_trace_close(ctx);
+}
+
+/* The spans summed up by name for sc_trace_profile_start(). The spans of
+ * a thread nest, so a stack of the open ones is enough; the APDUs are
+ * taken from the counters of the readers when a span begins and ends. */
+#define SC_TRACE_PROFILE_NAMES	64
+#define SC_TRACE_PROFILE_DEPTH	32
+
+struct sc_trace_profile_counter {
+	unsigned long calls;
+	unsigned long long time_us;
+	unsigned long long apdus;
+	unsigned long long bytes;
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+};
+
+struct sc_trace_profile {
+	struct sc_context *ctx;
+	struct sc_trace_profile_counter start;	/* when the profile started */
+	unsigned long cache_hits, cache_misses;
+	size_t count;
+	struct sc_trace_profile_entry {
+		const char *name;
+		size_t depth;		/* where it was first seen */
+		struct sc_trace_profile_counter counter;
+	} entries[SC_TRACE_PROFILE_NAMES];
+	size_t depth, lost;		/* open spans, those beyond the stack */
+	struct sc_trace_profile_open {
+		struct sc_trace_profile_entry *entry;	/* NULL if the table was full */
+		struct sc_trace_profile_counter start;
+	} stack[SC_TRACE_PROFILE_DEPTH];
+};
+
+/* time_us, the APDUs and bytes of all the readers and the cache counts */
+static void
+sc_trace_profile_now(struct sc_trace_profile *profile, unsigned long long time_us,
+		struct sc_trace_profile_counter *now)
+{
+	unsigned int i, count = sc_ctx_get_reader_count(profile->ctx);
+
+	memset(now, 0, sizeof(*now));
+	now->time_us = time_us;
+	for (i = 0; i < count; i++) {
+		struct sc_reader *reader = sc_ctx_get_reader(profile->ctx, i);
+
+		if (reader == NULL || reader->stats == NULL)
+			continue;
+		now->apdus += reader->stats->total.count;
+		now->bytes += reader->stats->total.bytes_sent + reader->stats->total.bytes_received;
+	}
+	now->cache_hits = profile->cache_hits;
+	now->cache_misses = profile->cache_misses;
+}
+
+static void
+sc_trace_profile_add(struct sc_trace_profile_counter *counter,
+		const struct sc_trace_profile_counter *start, const struct sc_trace_profile_counter *now)
+{
+	counter->calls++;
+	counter->time_us += now->time_us - start->time_us;
+	counter->apdus += now->apdus - start->apdus;
+	counter->bytes += now->bytes - start->bytes;
+	counter->cache_hits += now->cache_hits - start->cache_hits;
+	counter->cache_misses += now->cache_misses - start->cache_misses;
+}
+
+static void
+sc_trace_profile_span(void *arg, int phase, const char *name, long value,
+		unsigned long long time_us)
+{
+	struct sc_trace_profile *profile = arg;
+	struct sc_trace_profile_open *open;
+	struct sc_trace_profile_counter now;
+	size_t i;
+
+	if (phase == SC_TRACE_SPAN_BEGIN) {
+		if (profile->depth == SC_TRACE_PROFILE_DEPTH) {
+			profile->lost++;
+			return;
+		}
+		open = &profile->stack[profile->depth];
+		for (i = 0; i < profile->count; i++)
+			if (!strcmp(profile->entries[i].name, name))
+				break;
+		if (i == profile->count && i < SC_TRACE_PROFILE_NAMES) {
+			/* the names are literals of the library */
+			profile->entries[i].name = name;
+			profile->entries[i].depth = profile->depth;
+			profile->count++;
+		}
+		open->entry = i < SC_TRACE_PROFILE_NAMES ? &profile->entries[i] : NULL;
+		profile->depth++;
+		sc_trace_profile_now(profile, time_us, &open->start);
+		return;
+	}
+
+	if (profile->lost) {
+		profile->lost--;
+		return;
+	}
+	if (profile->depth == 0)
+		return;
+	open = &profile->stack[--profile->depth];
+	/* the lookups of the file cache end with 0 on a hit */
+	if (!strcmp(name, "file cache")) {
+		if (value == 0)
+			profile->cache_hits++;
+		else
+			profile->cache_misses++;
+	}
+	if (open->entry != NULL) {
+		sc_trace_profile_now(profile, time_us, &now);
+		sc_trace_profile_add(&open->entry->counter, &open->start, &now);
+	}
+}
+
+int
+sc_trace_profile_start(sc_context_t *ctx, struct sc_trace_profile **profile_out)
+{
+	struct sc_trace_profile *profile;
+	int r;
+
+	if (ctx == NULL || profile_out == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	profile = calloc(1, sizeof(struct sc_trace_profile));
+	if (profile == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	profile->ctx = ctx;
+	sc_trace_profile_now(profile, _sc_time_us(), &profile->start);
+	r = sc_set_trace_callback(ctx, sc_trace_profile_span, profile);
+	if (r != SC_SUCCESS) {
+		free(profile);
+		return r;
+	}
+	*profile_out = profile;
+	return SC_SUCCESS;
+}
+
+void
+sc_trace_profile_print(struct sc_trace_profile *profile, FILE *f)
+{
+	struct sc_trace_profile_counter now, total;
+	size_t i;
+
+	if (profile == NULL || f == NULL)
+		return;
+	memset(&total, 0, sizeof(total));
+	sc_trace_profile_now(profile, _sc_time_us(), &now);
+	sc_trace_profile_add(&total, &profile->start, &now);
+
+	fprintf(f, "%-40s %6s %10s %6s %8s %6s %6s\n",
+			"span", "calls", "ms", "APDUs", "bytes", "hits", "misses");
+	for (i = 0; i < profile->count; i++) {
+		const struct sc_trace_profile_entry *e = &profile->entries[i];
+		int indent = (int)(e->depth < 8 ? 2 * e->depth : 16);
+
+		fprintf(f, "%*s%-*s %6lu %10.1f %6llu %8llu %6lu %6lu\n",
+				indent, "", 40 - indent, e->name, e->counter.calls,
+				e->counter.time_us / 1000.0, e->counter.apdus, e->counter.bytes,
+				e->counter.cache_hits, e->counter.cache_misses);
+	}
+	fprintf(f, "%-40s %6s %10.1f %6llu %8llu %6lu %6lu\n", "total", "",
+			total.time_us / 1000.0, total.apdus, total.bytes,
+			total.cache_hits, total.cache_misses);
+}
+
+void
+sc_trace_profile_stop(struct sc_trace_profile *profile)
+{
+	if (profile == NULL)
+		return;
+	if (profile->ctx->trace_arg == profile)
+		sc_set_trace_callback(profile->ctx, NULL, NULL);
+	free(profile);
+}
+
+/* The time after which an APDU is much slower than this reader usually is:
+ * 16 times the 99th percentile of its histogram, but at least
+ * transmit_timeout_min. 0 while there are too few APDUs to tell. */
+static unsigned long long
+sc_reader_slow_threshold_us(const struct sc_reader *reader)
+{
+	const struct sc_transmit_counter *total;
+	unsigned long long threshold, min_us;
+	unsigned long seen = 0;
+	int i;
+
+	if (reader->stats == NULL || reader->stats->total.count < 32)
+		return 0;
+	total = &reader->stats->total;
+	for (i = 0; i < SC_TRANSMIT_STATS_BUCKETS - 1; i++) {
+		seen += total->histogram[i];
+		if (seen * 100 >= total->count * 99)
+			break;
+	}
+	threshold = (2ULL << i) * 16;
+	min_us = reader->ctx->transmit_timeout_min * 1000ULL;
+	return threshold < min_us ? min_us : threshold;
+}
+
+int
+_sc_reader_quarantined(struct sc_reader *reader)
+{
+	if (reader->quarantine_end_us == 0)
+		return 0;
+	if (_sc_time_us() < reader->quarantine_end_us)
+		return 1;
+	sc_log(reader->ctx, "reader '%s' is used again", reader->name);
+	reader->quarantine_end_us = 0;
+	return 0;
+}
+
+struct sc_transmit_job {
+	struct sc_reader *reader;
+	struct sc_apdu *apdu;
+};
+
+static int
+sc_transmit_job(void *arg)
+{
+	struct sc_transmit_job *job = arg;
+
+	return job->reader->ops->transmit(job->reader, job->apdu);
+}
+
+int
+_sc_reader_transmit(struct sc_reader *reader, struct sc_apdu *apdu)
+{
+	struct sc_transmit_job job;
+	struct sc_transmit_stats *stats;
+	unsigned long long start, time_us, threshold;
+	size_t ii, sent, received;
+	int rv;
+
+	if (_sc_reader_quarantined(reader)) {
+		sc_log(reader->ctx, "reader '%s' is quarantined", reader->name);
+		return SC_ERROR_CARD_UNRESPONSIVE;
+	}
+
+	SC_TRACE_BEGIN(reader->ctx, "transmit", apdu->ins);
+	start = _sc_time_us();
+	/* by the worker thread of the reader, if it has one */
+	job.reader = reader;
+	job.apdu = apdu;
+	rv = _sc_reader_worker_run(reader, sc_transmit_job, &job);
+	time_us = _sc_time_us() - start;
+	SC_TRACE_END(reader->ctx, "transmit", rv);
+
+	/* A reader that hangs is not asked again for a while, so that the
+	 * callers fail at once instead of waiting for it one after another */
+	if (reader->ctx->reader_quarantine_time
+			&& time_us > reader->ctx->transmit_timeout_min * 1000ULL) {
+		threshold = sc_reader_slow_threshold_us(reader);
+		if (threshold && time_us > threshold) {
+			sc_log(reader->ctx, "reader '%s' took %llu ms (limit %llu ms), quarantined for %u ms",
+					reader->name, time_us / 1000, threshold / 1000,
+					reader->ctx->reader_quarantine_time);
+			reader->quarantine_end_us = start + time_us
+				+ reader->ctx->reader_quarantine_time * 1000ULL;
+		}
+	}
+
+	if (reader->ctx->apdu_trace != NULL)
+		sc_apdu_trace_write(reader, apdu, start, time_us, rv);
+
+	if (reader->stats == NULL)
+		reader->stats = calloc(1, sizeof(struct sc_transmit_stats));
+	stats = reader->stats;
+	if (stats == NULL)
+		return rv;
+
+	sent = 4 + apdu->datalen;
+	received = rv < 0 ? 0 : apdu->resplen + 2;
+	sc_transmit_count(&stats->total, sent, received, time_us, rv);
+
+	for (ii = 0; ii < stats->ins_count; ii++)
+		if (stats->ins[ii].cla == apdu->cla && stats->ins[ii].ins == apdu->ins)
+			break;
+	if (ii == stats->ins_count) {
+		if (ii == SC_TRANSMIT_STATS_MAX_INS) {
+			stats->ins_overflow++;
+			return rv;
+		}
+		stats->ins[ii].cla = apdu->cla;
+		stats->ins[ii].ins = apdu->ins;
+		stats->ins_count++;
+	}
+	sc_transmit_count(&stats->ins[ii].counter, sent, received, time_us, rv);
+
+	return rv;
+}
+
+int
+sc_get_transmit_stats(struct sc_reader *reader, struct sc_transmit_stats *stats)
+{
+	if (reader == NULL || stats == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	if (reader->stats)
+		memcpy(stats, reader->stats, sizeof(*stats));
+	else
+		memset(stats, 0, sizeof(*stats));
+	return SC_SUCCESS;
+}
+
+void
+sc_reset_transmit_stats(struct sc_reader *reader)
+{
+	if (reader != NULL && reader->stats != NULL)
+		memset(reader->stats, 0, sizeof(*reader->stats));
+}
+
+void
+sc_count_lock_wait(struct sc_reader *reader, int prio, unsigned long long time_us)
+{
+	if (reader == NULL || prio < 0 || prio >= SC_LOCK_PRIO_COUNT)
+		return;
+	if (reader->stats == NULL)
+		reader->stats = calloc(1, sizeof(struct sc_transmit_stats));
+	if (reader->stats != NULL)
+		sc_transmit_count(&reader->stats->lock_wait[prio], 0, 0, time_us, 0);
+}
+
 static int
 sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
@@ -389,7 +1259,7 @@ sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 #endif
 
 	/* send APDU to the reader driver */
-	rv = card->reader->ops->transmit(card->reader, apdu);
+	rv = _sc_reader_transmit(card->reader, apdu);
 	LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
 
 	LOG_FUNC_RETURN(ctx, rv);
@@ -428,6 +1298,24 @@ sc_set_le_and_transmit(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 }
 
 
+/* Largest GET RESPONSE for 'buflen' wanted bytes when the card announced
+ * 256 or more: the whole rest if the card and reader do extended length
+ * on T=1, otherwise the usual 256. */
+static size_t
+sc_get_response_max_le(struct sc_card *card, size_t buflen)
+{
+	size_t max_le = card->max_recv_size;
+
+	if (!(card->caps & SC_CARD_CAP_APDU_EXT) || card->reader->active_protocol == SC_PROTO_T0)
+		return 256;
+	if (max_le == 0 || max_le > 65536)
+		max_le = 65536;
+	if (buflen < max_le)
+		max_le = buflen;
+
+	return max_le > 256 ? max_le : 256;
+}
+
 static int
 sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 {
@@ -463,18 +1351,33 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 	minlen = le;
 
 	do {
-		unsigned char resp[256];
-		size_t resp_len = le;
+		unsigned char resp[256], *rbuf;
+		size_t resp_len;
+
+		/* 0x6100: when extended length is usable ask for all the rest at once */
+		if (le == 256)
+			le = sc_get_response_max_le(card, buflen);
+
+		/* read straight into the caller's buffer if the response fits there,
+		 * only bounce through 'resp' when the card has more data than requested */
+		if (buflen >= le)   {
+			rbuf = buf;
+		}
+		else   {
+			rbuf = resp;
+			if (le > sizeof(resp))
+				le = sizeof(resp);
+		}
+		resp_len = le;
 
 		/* call GET RESPONSE to get more date from the card;
 		 * note: GET RESPONSE returns the left amount of data (== SW2) */
-		memset(resp, 0, sizeof(resp));
-		rv = card->ops->get_response(card, &resp_len, resp);
+		rv = card->ops->get_response(card, &resp_len, rbuf);
 		if (rv < 0)   {
 #ifdef ENABLE_SM
 			if (resp_len)   {
-				sc_log(ctx, "SM response data %s", sc_dump_hex(resp, resp_len));
-				sc_sm_update_apdu_response(card, resp, resp_len, rv, apdu);
+				sc_log(ctx, "SM response data %s", sc_dump_hex(rbuf, resp_len));
+				sc_sm_update_apdu_response(card, rbuf, resp_len, rv, apdu);
 			}
 #endif
 			LOG_TEST_RET(ctx, rv, "GET RESPONSE error");
@@ -485,7 +1388,8 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 		if (buflen < le)
 			le = buflen;
 
-		memcpy(buf, resp, le);
+		if (rbuf != buf)
+			memcpy(buf, rbuf, le);
 		buf    += le;
 		buflen -= le;
 
@@ -493,7 +1397,7 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 		if (buflen == 0)
 			break;
 
-		minlen -= le;
+		minlen = minlen > le ? minlen - le : 0;
 		if (rv != 0)
 			le = minlen = (size_t)rv;
 		else
@@ -527,6 +1431,7 @@ sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
 
 	r = sc_single_transmit(card, apdu);
 	LOG_TEST_RET(ctx, r, "transmit APDU failed");
+	card->last_sw = (apdu->sw1 << 8) | apdu->sw2;
 
 	/* ok, the APDU was successfully transmitted. Now we have two special cases:
 	 * 1. the card returned 0x6Cxx: in this case APDU will be re-trasmitted with Le set to SW2
@@ -545,10 +1450,272 @@ sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
 		r = sc_get_response(card, apdu, olen);
 	LOG_TEST_RET(ctx, r, "cannot get all data with 'GET RESPONSE'");
 
+	card->last_sw = (apdu->sw1 << 8) | apdu->sw2;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
 
+/* Interindustry commands known not to change the current DF and EF */
+static int
+sc_apdu_keeps_selection(const struct sc_apdu *apdu)
+{
+	if (apdu->cla & 0x80)
+		return 0;
+
+	switch (apdu->ins) {
+	case 0xB0: case 0xD6:
+		/* READ/UPDATE BINARY with a short EF identifier selects that EF */
+		return !(apdu->p1 & 0x80);
+	case 0xB2: case 0xDC: case 0xE2:
+		/* READ/UPDATE/APPEND RECORD of the current EF */
+		return (apdu->p2 >> 3) == 0;
+	case 0x20: case 0x22: case 0x24: case 0x2A: case 0x2C:
+	case 0x82: case 0x84: case 0x86: case 0x88:
+	case 0xC0: case 0xCA: case 0xCB:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Can the command change the FCI of the current file (0) or of any file (-1)?
+ * Returns 1 if it leaves all files as they are. */
+static int
+sc_apdu_keeps_fci(const struct sc_apdu *apdu)
+{
+	switch (apdu->ins) {
+	case 0xD0: case 0xD6: case 0x0E:
+		/* WRITE/UPDATE/ERASE BINARY, of another EF with a short EF identifier */
+		return (apdu->cla & 0x80) || (apdu->p1 & 0x80) ? -1 : 0;
+	case 0xD2: case 0xDC: case 0xE2: case 0x0C:
+		/* WRITE/UPDATE/APPEND/ERASE RECORD */
+		return (apdu->cla & 0x80) || (apdu->p2 >> 3) != 0 ? -1 : 0;
+	case 0xE0: case 0xE4: case 0x44: case 0x04: case 0xE6: case 0xE8:
+		/* CREATE/DELETE FILE, ACTIVATE/DEACTIVATE, TERMINATE */
+	case 0xDA: case 0xDB:
+		/* PUT DATA: the objects of PIV, OpenPGP and others are selected
+		 * as files, with the size of the data */
+	case 0x46: case 0x47:
+		/* GENERATE ASYMMETRIC KEY PAIR */
+		return -1;
+	default:
+		return 1;
+	}
+}
+
+/* Responses of SC_APDU_FLAGS_CACHEABLE APDUs that ended with 9000. The
+ * cache is only used with card->mutex held: sc_lock() does not keep it
+ * held, so it excludes nothing from the lookups done without the card
+ * lock. */
+#define SC_APDU_CACHE_SIZE	16
+
+struct sc_apdu_cache_entry {
+	/* CLA INS P1 P2, Le and the data of the command */
+	u8 *command;
+	size_t command_len;
+	u8 *response;
+	size_t response_len;
+};
+
+struct sc_apdu_cache {
+	struct sc_apdu_cache_entry entry[SC_APDU_CACHE_SIZE];
+	size_t next;
+	/* see cache_memory_max_size */
+	struct sc_memcache_account account;
+};
+
+static size_t
+sc_apdu_cache_key(const struct sc_apdu *apdu, u8 *buf, size_t buflen)
+{
+	size_t len = 8 + apdu->datalen;
+
+	if (len > buflen)
+		return 0;
+	buf[0] = apdu->cla;
+	buf[1] = apdu->ins;
+	buf[2] = apdu->p1;
+	buf[3] = apdu->p2;
+	buf[4] = (apdu->le >> 24) & 0xFF;
+	buf[5] = (apdu->le >> 16) & 0xFF;
+	buf[6] = (apdu->le >> 8) & 0xFF;
+	buf[7] = apdu->le & 0xFF;
+	if (apdu->datalen)
+		memcpy(buf + 8, apdu->data, apdu->datalen);
+	return len;
+}
+
+static void
+sc_apdu_cache_drop(struct sc_card *card, struct sc_apdu_cache_entry *e, int evicted)
+{
+	size_t size = e->command_len + e->response_len;
+
+	if (e->command == NULL)
+		return;
+	if (evicted)
+		_sc_memcache_evicted(card->ctx, &card->apdu_cache->account, size);
+	else
+		_sc_memcache_add(card->ctx, &card->apdu_cache->account, -(long) size, -1);
+	free(e->command);
+	free(e->response);
+	memset(e, 0, sizeof(*e));
+}
+
+/* Drops the oldest responses while cache_memory_max_size asks for it */
+static void
+sc_apdu_cache_trim(struct sc_card *card)
+{
+	struct sc_apdu_cache *cache = card->apdu_cache;
+	size_t i, n;
+
+	for (n = 0; n < SC_APDU_CACHE_SIZE; n++) {
+		if (_sc_memcache_trim(card->ctx, &cache->account) == 0)
+			return;
+		i = (cache->next + n) % SC_APDU_CACHE_SIZE;
+		sc_apdu_cache_drop(card, &cache->entry[i], 1);
+	}
+}
+
+void
+_sc_free_apdu_cache(struct sc_card *card)
+{
+	size_t i;
+
+	if (card->apdu_cache == NULL)
+		return;
+	for (i = 0; i < SC_APDU_CACHE_SIZE; i++)
+		sc_apdu_cache_drop(card, &card->apdu_cache->entry[i], 0);
+	free(card->apdu_cache);
+	card->apdu_cache = NULL;
+}
+
+/* Serves 'apdu' from the cache. Returns SC_SUCCESS on a hit. */
+static int
+sc_apdu_cache_get(struct sc_card *card, struct sc_apdu *apdu)
+{
+	u8 key[8 + SC_MAX_APDU_BUFFER_SIZE];
+	size_t i, key_len;
+
+	if (card->apdu_cache == NULL)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	key_len = sc_apdu_cache_key(apdu, key, sizeof(key));
+	if (key_len == 0)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	sc_apdu_cache_trim(card);
+
+	for (i = 0; i < SC_APDU_CACHE_SIZE; i++) {
+		const struct sc_apdu_cache_entry *e = &card->apdu_cache->entry[i];
+
+		if (e->command == NULL || e->command_len != key_len
+				|| memcmp(e->command, key, key_len))
+			continue;
+		if (e->response_len > apdu->resplen)
+			break;
+		if (e->response_len)
+			memcpy(apdu->resp, e->response, e->response_len);
+		apdu->resplen = e->response_len;
+		apdu->sw1 = 0x90;
+		apdu->sw2 = 0x00;
+		_sc_memcache_lookup(card->ctx, &card->apdu_cache->account, 1);
+		return SC_SUCCESS;
+	}
+	_sc_memcache_lookup(card->ctx, &card->apdu_cache->account, 0);
+	return SC_ERROR_OBJECT_NOT_FOUND;
+}
+
+static void
+sc_apdu_cache_put(struct sc_card *card, const struct sc_apdu *apdu)
+{
+	u8 key[8 + SC_MAX_APDU_BUFFER_SIZE];
+	struct sc_apdu_cache_entry *e;
+	size_t key_len;
+
+	if (apdu->sw1 != 0x90 || apdu->sw2 != 0x00)
+		return;
+	key_len = sc_apdu_cache_key(apdu, key, sizeof(key));
+	if (key_len == 0)
+		return;
+	if (card->apdu_cache == NULL) {
+		card->apdu_cache = calloc(1, sizeof(struct sc_apdu_cache));
+		if (card->apdu_cache == NULL)
+			return;
+		_sc_memcache_init(&card->apdu_cache->account, "apdu", 1);
+	}
+
+	/* overwrite the oldest entry once the cache is full */
+	e = &card->apdu_cache->entry[card->apdu_cache->next];
+	sc_apdu_cache_drop(card, e, 0);
+	e->command = malloc(key_len);
+	e->response = malloc(apdu->resplen ? apdu->resplen : 1);
+	if (e->command == NULL || e->response == NULL) {
+		free(e->command);
+		free(e->response);
+		memset(e, 0, sizeof(*e));
+		return;
+	}
+	memcpy(e->command, key, key_len);
+	e->command_len = key_len;
+	if (apdu->resplen)
+		memcpy(e->response, apdu->resp, apdu->resplen);
+	e->response_len = apdu->resplen;
+	card->apdu_cache->next = (card->apdu_cache->next + 1) % SC_APDU_CACHE_SIZE;
+	_sc_memcache_add(card->ctx, &card->apdu_cache->account, (long) (key_len + apdu->resplen), 1);
+	sc_apdu_cache_trim(card);
+}
+
+/* Could the command change data that a cacheable APDU returns? */
+static int
+sc_apdu_drops_cached_responses(const struct sc_apdu *apdu)
+{
+	if (apdu->flags & SC_APDU_FLAGS_CACHEABLE)
+		return 0;
+	if (apdu->cla & 0x80)
+		return 1;
+	return sc_apdu_keeps_fci(apdu) < 0;
+}
+
+/* Sends a chained APDU as one extended APDU when the reader does the chaining
+ * at the T=1 level, SC_ERROR_NOT_SUPPORTED when it must be chained here. */
+static int
+sc_transmit_unchained(sc_card_t *card, sc_apdu_t *apdu)
+{
+	struct sc_reader *reader = card->reader;
+	size_t max_send_size = card->max_send_size > 0 ? card->max_send_size : 255;
+	sc_apdu_t tapdu;
+	int r;
+
+	if (apdu->datalen <= max_send_size || apdu->datalen > 65535)
+		return SC_ERROR_NOT_SUPPORTED;
+	if (!(reader->capabilities & SC_READER_CAP_EXT_APDU)
+			|| reader->active_protocol == SC_PROTO_T0
+			|| (reader->max_send_size != 0 && apdu->datalen > reader->max_send_size))
+		return SC_ERROR_NOT_SUPPORTED;
+	if (!(card->caps & SC_CARD_CAP_APDU_EXT) || (card->caps & SC_CARD_CAP_NO_EXT_CHAINING))
+		return SC_ERROR_NOT_SUPPORTED;
+#ifdef ENABLE_SM
+	if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT)
+		return SC_ERROR_NOT_SUPPORTED;
+#endif
+
+	tapdu = *apdu;
+	tapdu.flags &= ~SC_APDU_FLAGS_CHAINING;
+	tapdu.cse = (tapdu.cse & SC_APDU_SHORT_MASK) | SC_APDU_EXT;
+	if (sc_check_apdu(card, &tapdu) != SC_SUCCESS)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	r = sc_transmit(card, &tapdu);
+	if (r == SC_SUCCESS && !(tapdu.sw1 == 0x67 && tapdu.sw2 == 0x00)) {
+		apdu->sw1 = tapdu.sw1;
+		apdu->sw2 = tapdu.sw2;
+		apdu->resplen = tapdu.resplen;
+		return SC_SUCCESS;
+	}
+
+	sc_log(card->ctx, "extended APDU not accepted (%d, %02X%02X), using command chaining",
+			r, tapdu.sw1, tapdu.sw2);
+	card->caps |= SC_CARD_CAP_NO_EXT_CHAINING;
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
 int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 {
 	int r = SC_SUCCESS;
@@ -566,19 +1733,53 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 	if (r != SC_SUCCESS)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
+	if ((apdu->flags & SC_APDU_FLAGS_CACHEABLE) && !(apdu->flags & SC_APDU_FLAGS_CHAINING)) {
+		sc_mutex_lock(card->ctx, card->mutex);
+		r = sc_apdu_cache_get(card, apdu);
+		sc_mutex_unlock(card->ctx, card->mutex);
+		if (r == SC_SUCCESS) {
+			sc_log(card->ctx, "response of %02X %02X %02X %02X from cache",
+					apdu->cla, apdu->ins, apdu->p1, apdu->p2);
+			LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+		}
+	}
+
 	r = sc_lock(card);	/* acquire card lock*/
 	if (r != SC_SUCCESS) {
 		sc_log(card->ctx, "unable to acquire lock");
 		return r;
 	}
 
-	if ((apdu->flags & SC_APDU_FLAGS_CHAINING) != 0) {
+	if (sc_apdu_drops_cached_responses(apdu)) {
+		sc_mutex_lock(card->ctx, card->mutex);
+		_sc_free_apdu_cache(card);
+		sc_mutex_unlock(card->ctx, card->mutex);
+	}
+
+	/* SELECT, or anything else that could change the current file */
+	switch (sc_apdu_keeps_fci(apdu)) {
+	case 0:
+		if (card->cache.selected) {
+			sc_invalidate_fci_cache(card, &card->cache.selected_path);
+			break;
+		}
+		/* fall through */
+	case -1:
+		sc_invalidate_fci_cache(card, NULL);
+		break;
+	}
+	if (card->cache.selected && !sc_apdu_keeps_selection(apdu))
+		sc_invalidate_select_cache(card);
+
+	if ((apdu->flags & SC_APDU_FLAGS_CHAINING) != 0
+			&& (r = sc_transmit_unchained(card, apdu)) == SC_ERROR_NOT_SUPPORTED) {
 		/* divide et impera: transmit APDU in chunks with Lc <= max_send_size
 		 * bytes using command chaining */
 		size_t    len  = apdu->datalen;
 		const u8  *buf = apdu->data;
 		size_t    max_send_size = card->max_send_size > 0 ? card->max_send_size : 255;
 
+		r = SC_SUCCESS;
 		while (len != 0) {
 			size_t    plen;
 			sc_apdu_t tapdu;
@@ -632,9 +1833,15 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 			len -= plen;
 			buf += plen;
 		}
-	} else
+	} else if ((apdu->flags & SC_APDU_FLAGS_CHAINING) == 0) {
 		/* transmit single APDU */
 		r = sc_transmit(card, apdu);
+		if (r == SC_SUCCESS && (apdu->flags & SC_APDU_FLAGS_CACHEABLE)) {
+			sc_mutex_lock(card->ctx, card->mutex);
+			sc_apdu_cache_put(card, apdu);
+			sc_mutex_unlock(card->ctx, card->mutex);
+		}
+	}
 	/* all done => release lock */
 	if (sc_unlock(card) != SC_SUCCESS)
 		sc_log(card->ctx, "sc_unlock failed");
@@ -643,6 +1850,58 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
+int
+sc_transmit_apdu_batch(struct sc_card *card, struct sc_apdu *apdus, size_t count,
+		unsigned int stop_sw, int *results)
+{
+	struct sc_context *ctx;
+	size_t ii, sent = 0;
+	int r;
+
+	if (card == NULL || (apdus == NULL && count != 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+	ctx = card->ctx;
+	LOG_FUNC_CALLED(ctx);
+
+	if (results)
+		for (ii = 0; ii < count; ii++)
+			results[ii] = SC_ERROR_NOT_ALLOWED;
+
+	/* one lock for the whole sequence, sc_transmit_apdu() will only
+	 * increase the lock counter */
+	r = sc_lock(card);
+	LOG_TEST_RET(ctx, r, "sc_lock() failed");
+
+	for (ii = 0; ii < count; ii++)   {
+		struct sc_apdu *apdu = &apdus[ii];
+		unsigned int sw;
+
+		r = sc_transmit_apdu(card, apdu);
+		sent++;
+		if (r != SC_SUCCESS)   {
+			if (results)
+				results[ii] = r;
+			sc_log(ctx, "batch: APDU #%lu (INS:%X) transmit failed: %s", (unsigned long) ii, apdu->ins, sc_strerror(r));
+			break;
+		}
+
+		sw = (apdu->sw1 << 8) | apdu->sw2;
+		if (results)
+			results[ii] = sc_check_sw(card, apdu->sw1, apdu->sw2);
+
+		if (stop_sw && sw != stop_sw)   {
+			sc_log(ctx, "batch: APDU #%lu (INS:%X) returned %04X, stop", (unsigned long) ii, apdu->ins, sw);
+			break;
+		}
+	}
+
+	if (sc_unlock(card) != SC_SUCCESS)
+		sc_log(ctx, "sc_unlock failed");
+
+	LOG_FUNC_RETURN(ctx, (int)sent);
+}
+
+
 int
 sc_bytes2apdu(sc_context_t *ctx, const u8 *buf, size_t len, sc_apdu_t *apdu)
 {
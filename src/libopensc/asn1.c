@@ -372,53 +372,85 @@ const u8 *sc_asn1_find_tag(sc_context_t *ctx, const u8 * buf,
 	return NULL;
 }
 
-const u8 *sc_asn1_skip_tag(sc_context_t *ctx, const u8 ** buf, size_t *buflen,
-			   unsigned int tag_in, size_t *taglen_out)
+/* Does a tag read with sc_asn1_read_tag() match the SC_ASN1_* tag_in? */
+static int asn1_tag_matches(unsigned int cla, unsigned int tag, unsigned int tag_in)
 {
-	const u8 *p = *buf;
-	size_t len = *buflen, taglen;
-	unsigned int cla, tag;
-
-	if (sc_asn1_read_tag((const u8 **) &p, len, &cla, &tag, &taglen) != SC_SUCCESS)
-		return NULL;
 	switch (cla & 0xC0) {
 	case SC_ASN1_TAG_UNIVERSAL:
 		if ((tag_in & SC_ASN1_CLASS_MASK) != SC_ASN1_UNI)
-			return NULL;
+			return 0;
 		break;
 	case SC_ASN1_TAG_APPLICATION:
 		if ((tag_in & SC_ASN1_CLASS_MASK) != SC_ASN1_APP)
-			return NULL;
+			return 0;
 		break;
 	case SC_ASN1_TAG_CONTEXT:
 		if ((tag_in & SC_ASN1_CLASS_MASK) != SC_ASN1_CTX)
-			return NULL;
+			return 0;
 		break;
 	case SC_ASN1_TAG_PRIVATE:
 		if ((tag_in & SC_ASN1_CLASS_MASK) != SC_ASN1_PRV)
-			return NULL;
+			return 0;
 		break;
 	}
 	if (cla & SC_ASN1_TAG_CONSTRUCTED) {
 		if ((tag_in & SC_ASN1_CONS) == 0)
-			return NULL;
+			return 0;
 	} else
 		if (tag_in & SC_ASN1_CONS)
-			return NULL;
-	if ((tag_in & SC_ASN1_TAG_MASK) != tag)
+			return 0;
+	return (tag_in & SC_ASN1_TAG_MASK) == tag;
+}
+
+/*
+ * The header of the TLV at 'pos', as read by sc_asn1_read_tag(). The
+ * decoder keeps the last one it read, so that the entries of a template
+ * that are tried at the same position do not read it again.
+ */
+struct asn1_header {
+	const u8 *pos;
+	const u8 *value;	/* NULL if there is no valid TLV at pos */
+	unsigned int cla, tag;
+	size_t len;
+};
+
+static void asn1_read_header(struct asn1_header *hdr, const u8 *buf, size_t buflen)
+{
+	hdr->pos = buf;
+	hdr->value = buf;
+	if (sc_asn1_read_tag(&hdr->value, buflen, &hdr->cla, &hdr->tag, &hdr->len) != SC_SUCCESS)
+		hdr->value = NULL;
+}
+
+static const u8 *asn1_skip_header(sc_context_t *ctx, const struct asn1_header *hdr,
+		const u8 **buf, size_t *buflen, unsigned int tag_in, size_t *taglen_out)
+{
+	const u8 *p = hdr->value;
+	size_t len = *buflen;
+
+	if (p == NULL || !asn1_tag_matches(hdr->cla, hdr->tag, tag_in))
 		return NULL;
 	len -= (p - *buf);	/* header size */
-	if (taglen > len) {
+	if (hdr->len > len) {
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "too long ASN.1 object (size %d while only %d available)\n",
-		      taglen, len);
+		      hdr->len, len);
 		return NULL;
 	}
-	*buflen -= (p - *buf) + taglen;
-	*buf = p + taglen;	/* point to next tag */
-	*taglen_out = taglen;
+	*buflen -= (p - *buf) + hdr->len;
+	*buf = p + hdr->len;	/* point to next tag */
+	*taglen_out = hdr->len;
 	return p;
 }
 
+const u8 *sc_asn1_skip_tag(sc_context_t *ctx, const u8 ** buf, size_t *buflen,
+			   unsigned int tag_in, size_t *taglen_out)
+{
+	struct asn1_header hdr;
+
+	asn1_read_header(&hdr, *buf, *buflen);
+	return asn1_skip_header(ctx, &hdr, buf, buflen, tag_in, taglen_out);
+}
+
 const u8 *sc_asn1_verify_tag(sc_context_t *ctx, const u8 * buf, size_t buflen,
 			     unsigned int tag_in, size_t *taglen_out)
 {
@@ -1386,6 +1418,7 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 	int r, idx = 0;
 	const u8 *p = in, *obj;
 	struct sc_asn1_entry *entry = asn1;
+	struct asn1_header hdr;
 	size_t left = len, objlen;
 
 	sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*scalled, left=%u, depth %d%s\n",
@@ -1408,6 +1441,7 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 	if (p[0] == 0 || p[0] == 0xFF || len == 0)
 		return SC_ERROR_ASN1_END_OF_CONTENTS;
 
+	hdr.pos = NULL;
 	for (idx = 0; asn1[idx].name != NULL; idx++) {
 		entry = &asn1[idx];
 
@@ -1425,7 +1459,11 @@ static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 			goto decode_ok;
 		}
 
-		obj = sc_asn1_skip_tag(ctx, &p, &left, entry->tag, &objlen);
+		/* optional and CHOICE entries are tried at the same
+		 * position until one matches */
+		if (hdr.pos != p)
+			asn1_read_header(&hdr, p, left);
+		obj = asn1_skip_header(ctx, &hdr, &p, &left, entry->tag, &objlen);
 		if (obj == NULL) {
 			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "not present\n");
 			if (choice)
@@ -103,12 +103,14 @@ int sc_base64_encode(const u8 *in, size_t len, u8 *out, size_t outlen, size_t li
 
 	linelength -= linelength & 0x03;
 	while (len >= 3) {
-		i = in[2] + (in[1] << 8) + (in[0] << 16);
-		in += 3;
-		len -= 3;
 		if (outlen < 4)
 			return SC_ERROR_BUFFER_TOO_SMALL;
-		to_base64(i, out, 0);
+		out[0] = base64_table[in[0] >> 2];
+		out[1] = base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+		out[2] = base64_table[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+		out[3] = base64_table[in[2] & 0x3f];
+		in += 3;
+		len -= 3;
 		out += 4;
 		outlen -= 4;
 		chars += 4;
@@ -151,6 +153,32 @@ int sc_base64_decode(const char *in, u8 *out, size_t outlen)
 	int len = 0, r, skip;
 	unsigned int i;
 
+	for (;;) {
+		u8 b[4];
+		int n;
+
+		/* four characters of the alphabet, nothing to skip */
+		for (n = 0; n < 4; n++) {
+			int k = in[n];
+
+			if (k <= 0 || bin_table[k] > 0x3f)
+				break;
+			b[n] = bin_table[k];
+		}
+		/* the loop below fills a short buffer as far as it goes */
+		if (n < 4 || outlen < 3)
+			break;
+		out[0] = (b[0] << 2) | (b[1] >> 4);
+		out[1] = (b[1] << 4) | (b[2] >> 2);
+		out[2] = (b[2] << 6) | b[3];
+		out += 3;
+		outlen -= 3;
+		len += 3;
+		in += 4;
+	}
+	if (*in == 0 && len)
+		return len;
+
 	while ((r = from_base64(in, &i, &skip)) > 0) {
 		int finished = 0, s = 16;
 
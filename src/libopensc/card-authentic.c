@@ -2275,20 +2275,18 @@ authentic_sm_free_wrapped_apdu(struct sc_card *card, struct sc_apdu *plain, stru
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 
         if (plain)   {
-		if (plain->resplen < (*sm_apdu)->resplen)
+		if (plain->resplen < (*sm_apdu)->resplen)   {
+			sc_sm_free_apdu(card, *sm_apdu);
+			*sm_apdu = NULL;
 			LOG_TEST_RET(ctx, SC_ERROR_BUFFER_TOO_SMALL, "Unsufficient plain APDU response size");
+		}
 		memcpy(plain->resp, (*sm_apdu)->resp, (*sm_apdu)->resplen);
 		plain->resplen = (*sm_apdu)->resplen;
 		plain->sw1 = (*sm_apdu)->sw1;
 		plain->sw2 = (*sm_apdu)->sw2;
 	}
 
-	if ((*sm_apdu)->data)
-		free((*sm_apdu)->data);
-	if ((*sm_apdu)->resp)
-		free((*sm_apdu)->resp);
-
-	free(*sm_apdu);
+	sc_sm_free_apdu(card, *sm_apdu);
 	*sm_apdu = NULL;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
@@ -2298,6 +2296,7 @@ authentic_sm_get_wrapped_apdu(struct sc_card *card, struct sc_apdu *plain, struc
 {
 	struct sc_context *ctx = card->ctx;
 	struct sc_apdu *apdu = NULL;
+	unsigned char *data, *resp;
 	int rv  = 0;
 
 	LOG_FUNC_CALLED(ctx);
@@ -2328,25 +2327,31 @@ authentic_sm_get_wrapped_apdu(struct sc_card *card, struct sc_apdu *plain, struc
 	if (!card->sm_ctx.module.ops.get_apdus)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 
-        apdu = calloc(1, sizeof(struct sc_apdu));
-        if (!apdu)
+	if (plain->datalen + 24 > SC_MAX_EXT_APDU_BUFFER_SIZE
+			|| plain->resplen + 32 > SC_MAX_EXT_APDU_BUFFER_SIZE)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_BUFFER_TOO_SMALL);
+
+	apdu = sc_sm_alloc_apdu(card);
+	if (!apdu)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	data = (unsigned char *)apdu->data;
+	resp = apdu->resp;
 	memcpy((void *)apdu, (void *)plain, sizeof(struct sc_apdu));
 
-        apdu->data = calloc (1, plain->datalen + 24);
-        if (!apdu->data)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	memset(data, 0, plain->datalen + 24);
 	if (plain->data && plain->datalen)
-		memcpy(apdu->data, plain->data, plain->datalen);
+		memcpy(data, plain->data, plain->datalen);
+	apdu->data = data;
 
-        apdu->resp = calloc (1, plain->resplen + 32);
-        if (!apdu->resp)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	memset(resp, 0, plain->resplen + 32);
+	apdu->resp = resp;
 
 	card->sm_ctx.info.cmd = SM_CMD_APDU_TRANSMIT;
 	card->sm_ctx.info.cmd_data = (void *)apdu;
 
 	rv = card->sm_ctx.module.ops.get_apdus(ctx, &card->sm_ctx.info, NULL, 0, NULL);
+	if (rv < 0)
+		sc_sm_free_apdu(card, apdu);
 	LOG_TEST_RET(ctx, rv, "SM: GET_APDUS failed");
 
 	*sm_apdu = apdu;
@@ -177,6 +177,11 @@ static int cardos_init(sc_card_t *card)
 	_sc_card_add_rsa_alg(card,  768, flags, 0);
 	_sc_card_add_rsa_alg(card, 1024, flags, 0);
 
+	/* see parse_sec_attr() */
+	card->caps |= SC_CARD_CAP_FCI_READ_ACL;
+	/* DELETE FILE removes a DF together with its contents */
+	card->caps |= SC_CARD_CAP_DELETE_DF_RECURSIVE;
+
 	if (card->type == SC_CARD_TYPE_CARDOS_M4_2) {
 		int r = cardos_have_2048bit_package(card);
 		if (r < 0)
@@ -58,6 +58,8 @@ extern int dnie_read_file(
 #define DNIE_CHIP_NAME "DNIe: Spanish eID card"
 #define DNIE_CHIP_SHORTNAME "dnie"
 #define DNIE_MF_NAME "Master.File"
+/* bytes read beyond those asked for by read_binary() */
+#define DNIE_READ_AHEAD 512
 
 /* default user consent program (if required) */
 #define USER_CONSENT_CMD "/usr/bin/pinentry"
@@ -476,6 +478,8 @@ static void dnie_clear_cache(dnie_private_data_t * data)
 		free(data->cache);
 	data->cache = NULL;
 	data->cachelen = 0;
+	data->cacheoff = 0;
+	data->cacheeof = 0;
 }
 
 static inline void init_flags(struct sc_card *card)
@@ -535,6 +539,7 @@ static int dnie_init(struct sc_card *card)
 	int res = SC_SUCCESS;
 	sc_context_t *ctx = card->ctx;
 	cwa_provider_t *provider = NULL;
+	scconf_block *blk;
 
 	LOG_FUNC_CALLED(ctx);
 
@@ -579,6 +584,11 @@ static int dnie_init(struct sc_card *card)
 
 	GET_DNIE_PRIV_DATA(card)->cwa_provider = provider;
 
+	blk = sc_get_conf_block(ctx, "card_driver", "dnie", 1);
+	if (blk)
+		GET_DNIE_PRIV_DATA(card)->keep_secure_channel =
+		    scconf_get_bool(blk, "keep_secure_channel", 0);
+
 	LOG_FUNC_RETURN(card->ctx, res);
 }
 
@@ -658,18 +668,16 @@ static u8 *dnie_uncompress(sc_card_t * card, u8 * from, size_t *len)
 		goto compress_exit;
 
 	sc_log(card->ctx, "Data seems to be compressed. calling uncompress");
-	/* ok: data seems to be compressed */
-	upt = calloc(uncompressed, sizeof(u8));
-	if (!upt) {
-		sc_log(card->ctx, "alloc() for uncompressed buffer failed");
-		return NULL;
-	}
-	res = sc_decompress(upt,	/* try to uncompress by calling sc_xx routine */
-			    (size_t *) & uncompressed,
+	/* ok: data seems to be compressed, the header gives the size */
+	upt = NULL;
+	res = sc_decompress_cached(card->ctx, &upt,	/* try to uncompress by calling sc_xx routine */
+			    &uncompressed,
 			    from + 8, (size_t) compressed, COMPRESSION_ZLIB);
 	/* TODO: check that returned uncompressed size matches expected */
 	if (res != SC_SUCCESS) {
 		sc_log(card->ctx, "Uncompress() failed or data not compressed");
+		free(upt);
+		upt = from;
 		goto compress_exit;	/* assume not need uncompression */
 	}
 	/* Done; update buffer len and return pt to uncompressed data */
@@ -690,62 +698,50 @@ static u8 *dnie_uncompress(sc_card_t * card, u8 * from, size_t *len)
 }
 
 /**
- * Fill file cache for read_binary() operation.
+ * Read a range of the current file.
  *
- * Fill a temporary buffer by mean of consecutive calls to read_binary()
- * until card sends eof
- *
- * DNIe card stores user certificates in compressed format. so we need
- * some way to detect and uncompress on-the-fly compressed files, to
- * let read_binary() work transparently. 
- * This is the main goal of this routine: create an in-memory buffer 
- * for read_binary operation, filling this buffer on first read_binary() 
- * call, and uncompress data if compression detected. Further 
- * read_binary() calls then make use of cached data, instead
- * of accessing the card
+ * Append data from file offset 'offset' to buffer by mean of
+ * consecutive read_binary() calls, until buffer holds at least 'want'
+ * bytes or card sends eof. Files are never longer than 32767 bytes
  *
  * @param card Pointer to card structure
- * @return SC_SUCCESS if OK; else error code
+ * @param offset file offset of buffer
+ * @param want number of bytes wanted in buffer
+ * @param buffer pointer to realloc()'able buffer
+ * @param len pointer to buffer length
+ * @return 1 on eof, 0 if more data available; else error code
  */
-static int dnie_fill_cache(sc_card_t * card)
+static int dnie_read_range(sc_card_t * card, size_t offset, size_t want,
+			   u8 ** buffer, size_t * len)
 {
 	u8 tmp[SC_MAX_APDU_BUFFER_SIZE];
 	sc_apdu_t apdu;
 	size_t count = 0;
-	size_t len = 0;
-	u8 *buffer = NULL;
+	size_t pos = 0;
 	u8 *pt = NULL;
-	sc_context_t *ctx = NULL;
-
-	if (!card || !card->ctx)
-		return SC_ERROR_INVALID_ARGUMENTS;
-	ctx = card->ctx;
-
-	LOG_FUNC_CALLED(ctx);
-
-	/* mark cache empty */
-	dnie_clear_cache(GET_DNIE_PRIV_DATA(card));
+	sc_context_t *ctx = card->ctx;
 
 	/* initialize apdu */
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0xB0, 0x00, 0x00);
 
 	/* try to read_binary while data available but never long than 32767 */
 	count = card->max_recv_size;
-	for (len = 0; len < 0x7fff;) {
+	while (*len < want) {
 		int r = SC_SUCCESS;
+		pos = offset + *len;
+		if (pos >= 0x7fff)
+			return 1;
 		/* fill apdu */
-		apdu.p1 = 0xff & (len >> 8);
-		apdu.p2 = 0xff & len;
+		apdu.p1 = 0xff & (pos >> 8);
+		apdu.p2 = 0xff & pos;
 		apdu.le = count;
 		apdu.resplen = count;
 		apdu.resp = tmp;
 		/* transmit apdu */
 		r = dnie_transmit_apdu(card, &apdu);
 		if (r != SC_SUCCESS) {
-			if (buffer)
-				free(buffer);
 			sc_log(ctx, "read_binary() APDU transmit failed");
-			LOG_FUNC_RETURN(ctx, r);
+			return r;
 		}
 		if (apdu.resplen == 0) {
 			/* on no data received, check if requested len is longer than
@@ -755,41 +751,134 @@ static int dnie_fill_cache(sc_card_t * card)
 				count = 0xff & apdu.sw2;
 				if (count != 0)
 					continue;	/* read again with correct size */
-				goto read_done;	/* no more data to read */
+				return 1;	/* no more data to read */
 			}
 			if (r == SC_ERROR_INCORRECT_PARAMETERS)
-				goto read_done;
-			LOG_FUNC_RETURN(ctx, r);	/* arriving here means response error */
+				return 1;
+			return r;	/* arriving here means response error */
 		}
 		/* copy received data into buffer. realloc() if not enought space */
 		count = apdu.resplen;
-		buffer = realloc(buffer, len + count);
-		if (!buffer)
-			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-		memcpy(buffer + len, apdu.resp, count);
-		len += count;
+		pt = realloc(*buffer, *len + count);
+		if (!pt)
+			return SC_ERROR_OUT_OF_MEMORY;
+		*buffer = pt;
+		memcpy(*buffer + *len, apdu.resp, count);
+		*len += count;
 		if (count != card->max_recv_size)
-			goto read_done;
+			return 1;
 	}
+	return 0;
+}
 
- read_done:
-	/* no more data to read: check if data is compressed */
-	pt = dnie_uncompress(card, buffer, &len);
-	if (pt == NULL) {
-		sc_log(ctx, "Uncompress proccess failed");
-		if (buffer)
-			free(buffer);
-		LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
+/**
+ * Check for a compression header.
+ *
+ * Compressed files start with the uncompressed and compressed sizes,
+ * the compressed data filling up the rest of the file
+ *
+ * @param buffer data read from file offset 0
+ * @param len buffer length
+ * @return 1 if data may be compressed, else 0
+ */
+static int dnie_compressed_header(u8 * buffer, size_t len)
+{
+	unsigned long uncompressed = 0L;
+	unsigned long compressed = 0L;
+
+	if (len < 8)
+		return 0;
+	uncompressed = le2ulong(buffer);
+	compressed = le2ulong(buffer + 4);
+	return compressed + 8 >= len && compressed < 0x7fff
+	    && uncompressed >= compressed;
+}
+
+/**
+ * Fill file cache for read_binary() operation.
+ *
+ * Read the bytes asked for plus DNIE_READ_AHEAD ones into a temporary
+ * buffer, or add them to the buffer when they follow the cached ones.
+ * A new file is read from offset 0, to look for compression
+ *
+ * DNIe card stores user certificates in compressed format. so we need
+ * some way to detect and uncompress on-the-fly compressed files, to
+ * let read_binary() work transparently. 
+ * So when the start of a file looks like a compression header the
+ * whole file is read and uncompressed into the buffer, and further
+ * read_binary() calls make use of cached data. Uncompressed files are
+ * read by parts, so that small reads do not transfer the whole file
+ * through the secure channel
+ *
+ * @param card Pointer to card structure
+ * @param idx file offset asked for
+ * @param count number of bytes asked for
+ * @return number of bytes cached if OK; else error code
+ */
+static int dnie_fill_cache(sc_card_t * card, size_t idx, size_t count)
+{
+	dnie_private_data_t *priv = NULL;
+	size_t len = 0;
+	u8 *buffer = NULL;
+	u8 *pt = NULL;
+	sc_context_t *ctx = NULL;
+	int eof = 0;
+
+	if (!card || !card->ctx)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	ctx = card->ctx;
+	priv = GET_DNIE_PRIV_DATA(card);
+
+	LOG_FUNC_CALLED(ctx);
+
+	if (priv->cache == NULL) {
+		/* new file: start at offset 0 */
+		dnie_clear_cache(priv);
+	} else if (idx < priv->cacheoff || idx > priv->cacheoff + priv->cachelen) {
+		/* not following cached data: start over at idx */
+		dnie_clear_cache(priv);
+		priv->cacheoff = idx;
+	}
+	/* take cached data over */
+	buffer = priv->cache;
+	len = priv->cachelen;
+	priv->cache = NULL;
+	priv->cachelen = 0;
+
+	eof = dnie_read_range(card, priv->cacheoff,
+			      idx + count + DNIE_READ_AHEAD - priv->cacheoff,
+			      &buffer, &len);
+	if (eof >= 0 && priv->cacheoff == 0
+	    && dnie_compressed_header(buffer, len)) {
+		/* whole file is needed for uncompression */
+		if (eof == 0)
+			eof = dnie_read_range(card, 0, 0x7fff, &buffer, &len);
+		if (eof >= 0) {
+			pt = dnie_uncompress(card, buffer, &len);
+			if (pt == NULL) {
+				sc_log(ctx, "Uncompress proccess failed");
+				eof = SC_ERROR_INTERNAL;
+			} else if (pt != buffer) {
+				free(buffer);
+				buffer = pt;
+			}
+		}
 	}
-	if (pt != buffer)
+	if (eof < 0) {
 		if (buffer)
 			free(buffer);
+		dnie_clear_cache(priv);
+		LOG_FUNC_RETURN(ctx, eof);
+	}
 
 	/* ok: as final step, set correct cache data into dnie_priv structures */
-	GET_DNIE_PRIV_DATA(card)->cache = pt;
-	GET_DNIE_PRIV_DATA(card)->cachelen = len;
-	sc_log(ctx, "fill_cache() done. length '%d' bytes", len);
-	LOG_FUNC_RETURN(ctx,len);
+	priv->cache = buffer;
+	priv->cachelen = len;
+	priv->cacheeof = eof;
+	sc_log(ctx, "fill_cache() done. offset '%lu' length '%lu' bytes%s",
+	       (unsigned long)priv->cacheoff, (unsigned long)len,
+	       eof ? " up to eof" : "");
+	LOG_FUNC_RETURN(ctx, len);
 }
 
 /**
@@ -811,15 +900,21 @@ static int dnie_read_binary(struct sc_card *card,
 {
 	int res = 0;
 	sc_context_t *ctx = NULL;
+	dnie_private_data_t *priv = NULL;
 	/* preliminary checks */
 	if (!card || !card->ctx || !buf || (count <= 0))
 		return SC_ERROR_INVALID_ARGUMENTS;
 	ctx = card->ctx;
+	priv = GET_DNIE_PRIV_DATA(card);
 
 	LOG_FUNC_CALLED(ctx);
-	if (idx == 0 || GET_DNIE_PRIV_DATA(card)->cache == NULL) {
-		/* on first block or no cache, try to fill */
-		res = dnie_fill_cache(card);
+	if (idx == 0)
+		/* on first block start over: may be a new file */
+		dnie_clear_cache(priv);
+	if (priv->cache == NULL || idx < priv->cacheoff
+	    || (!priv->cacheeof && idx + count > priv->cacheoff + priv->cachelen)) {
+		/* no cache or not enought cached data, try to fill */
+		res = dnie_fill_cache(card, idx, count);
 		if (res < 0) {
 			sc_log(ctx,
 			       "Cannot fill cache. using iso_read_binary()");
@@ -827,10 +922,10 @@ static int dnie_read_binary(struct sc_card *card,
 						    flags);
 		}
 	}
-	if (idx >= GET_DNIE_PRIV_DATA(card)->cachelen)
+	if (idx < priv->cacheoff || idx >= priv->cacheoff + priv->cachelen)
 		return 0;	/* at eof */
-	res = MIN(count, GET_DNIE_PRIV_DATA(card)->cachelen - idx);	/* eval how many bytes to read */
-	memcpy(buf, GET_DNIE_PRIV_DATA(card)->cache + idx, res);	/* copy data from buffer */
+	res = MIN(count, priv->cacheoff + priv->cachelen - idx);	/* eval how many bytes to read */
+	memcpy(buf, priv->cache + (idx - priv->cacheoff), res);	/* copy data from buffer */
 	sc_log(ctx, "dnie_read_binary() '%d' bytes", res);
 	LOG_FUNC_RETURN(ctx, res);
 }
@@ -844,8 +939,9 @@ static int dnie_read_binary(struct sc_card *card,
  * @param card pointer to card structure
  */
 static inline void dnie_invalidate_path(sc_card_t *card) {
-	memset(&card->cache, 0, sizeof(card->cache));
-        card->cache.valid = 0;
+	sc_mutex_lock(card->ctx, card->mutex);
+	sc_invalidate_cache(card);
+	sc_mutex_unlock(card->ctx, card->mutex);
 }
 
 /**
@@ -1986,8 +2082,11 @@ static int dnie_pin_verify(struct sc_card *card,
 	int padding = 0;
 
 	LOG_FUNC_CALLED(card->ctx);
-	/* ensure that secure channel is established from reset */
-	res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider, CWA_SM_COLD);
+	/* ensure that secure channel is established from reset, unless
+	 * asked to keep the one still open: an SM error establishes it
+	 * again anyway, see dnie_wrap_apdu() */
+	res = cwa_create_secure_channel(card, GET_DNIE_PRIV_DATA(card)->cwa_provider,
+			GET_DNIE_PRIV_DATA(card)->keep_secure_channel ? CWA_SM_WARM : CWA_SM_COLD);
 	LOG_TEST_RET(card->ctx, res, "Establish SM failed");
 
 	data->apdu = &apdu;	/* prepare apdu struct */
@@ -116,6 +116,7 @@ static int iasecc_pin_get_policy (struct sc_card *card, struct sc_pin_cmd_data *
 static int iasecc_pin_is_verified(struct sc_card *card, struct sc_pin_cmd_data *pin_cmd, int *tries_left);
 static int iasecc_get_free_reference(struct sc_card *card, struct iasecc_ctl_get_free_reference *ctl_data);
 static int iasecc_sdo_put_data(struct sc_card *card, struct iasecc_sdo_update *update);
+static void iasecc_sdo_cache_clear(struct sc_card *card);
 
 #ifdef ENABLE_SM
 static int _iasecc_sm_read_binary(struct sc_card *card, unsigned int offs, unsigned char *buf, size_t count);
@@ -1333,6 +1334,7 @@ iasecc_finish(struct sc_card *card)
 		se_info = next;
 	}
 
+	iasecc_sdo_cache_clear(card);
 	free(card->drv_data);
 	card->drv_data = NULL;
 
@@ -2517,6 +2519,7 @@ iasecc_sdo_create(struct sc_card *card, struct iasecc_sdo *sdo)
 	int rv = SC_ERROR_NOT_SUPPORTED, data_len;
 
 	LOG_FUNC_CALLED(ctx);
+	iasecc_sdo_cache_clear(card);
 	if (sdo->magic != SC_CARDCTL_IASECC_SDO_MAGIC)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "Invalid SDO data");
 
@@ -2582,6 +2585,7 @@ iasecc_sdo_delete(struct sc_card *card, struct iasecc_sdo *sdo)
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
+	iasecc_sdo_cache_clear(card);
 	if (sdo->magic != SC_CARDCTL_IASECC_SDO_MAGIC)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "Invalid SDO data");
 
@@ -2613,6 +2617,7 @@ iasecc_sdo_put_data(struct sc_card *card, struct iasecc_sdo_update *update)
 	int ii, rv;
 
 	LOG_FUNC_CALLED(ctx);
+	iasecc_sdo_cache_clear(card);
 	if (update->magic != SC_CARDCTL_IASECC_SDO_MAGIC_PUT_DATA)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "Invalid SDO update data");
 
@@ -2651,6 +2656,7 @@ iasecc_sdo_key_rsa_put_data(struct sc_card *card, struct iasecc_sdo_rsa_update *
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
+	iasecc_sdo_cache_clear(card);
 
 	if (update->sdo_prv_key)   {
 		sc_log(ctx, "encode private rsa in %p", &update->update_prv);
@@ -2733,10 +2739,79 @@ iasecc_sdo_tag_from_class(unsigned sdo_class)
 }
 
 
+/*
+ * The GET DATA answers of the key and keyset SDOs are kept for the card
+ * session: the bind and the PKCS#11 attributes ask for the same ones over
+ * and over. The PIN SDOs are always asked for, their DOCP has the tries
+ * left. Any SDO creation, update or key generation drops them all.
+ */
+static void
+iasecc_sdo_cache_clear(struct sc_card *card)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct iasecc_sdo_cache *entry;
+
+	if (!prv)
+		return;
+	while (prv->sdo_cache)   {
+		entry = prv->sdo_cache;
+		prv->sdo_cache = entry->next;
+		free(entry->data);
+		free(entry);
+	}
+}
+
+
+static struct iasecc_sdo_cache *
+iasecc_sdo_cache_find(struct sc_card *card, int sdo_tag, struct iasecc_sdo *sdo)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct iasecc_sdo_cache *entry;
+
+	for (entry = prv->sdo_cache; entry; entry = entry->next)
+		if (entry->sdo_class == (sdo->sdo_class & ~IASECC_OBJECT_REF_LOCAL)
+				&& entry->sdo_ref == (sdo->sdo_ref & 0x9F) && entry->sdo_tag == sdo_tag)
+			return entry;
+	return NULL;
+}
+
+
+static void
+iasecc_sdo_cache_add(struct sc_card *card, int sdo_tag, struct iasecc_sdo *sdo,
+		int rv, const unsigned char *data, size_t data_len)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *) card->drv_data;
+	struct iasecc_sdo_cache *entry;
+
+	if ((sdo->sdo_class & ~IASECC_OBJECT_REF_LOCAL) == IASECC_SDO_CLASS_CHV)
+		return;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return;
+	if (data_len)   {
+		entry->data = malloc(data_len);
+		if (!entry->data)   {
+			free(entry);
+			return;
+		}
+		memcpy(entry->data, data, data_len);
+	}
+	entry->sdo_class = sdo->sdo_class & ~IASECC_OBJECT_REF_LOCAL;
+	entry->sdo_ref = sdo->sdo_ref & 0x9F;
+	entry->sdo_tag = sdo_tag;
+	entry->rv = rv;
+	entry->data_len = data_len;
+	entry->next = prv->sdo_cache;
+	prv->sdo_cache = entry;
+}
+
+
 static int
 iasecc_sdo_get_tagged_data(struct sc_card *card, int sdo_tag, struct iasecc_sdo *sdo)
 {
 	struct sc_context *ctx = card->ctx;
+	struct iasecc_sdo_cache *cached;
 	struct sc_apdu apdu;
 	unsigned char sbuf[0x100];
 	size_t offs = sizeof(sbuf) - 1;
@@ -2745,6 +2820,15 @@ iasecc_sdo_get_tagged_data(struct sc_card *card, int sdo_tag, struct iasecc_sdo
 
 	LOG_FUNC_CALLED(ctx);
 
+	cached = iasecc_sdo_cache_find(card, sdo_tag, sdo);
+	if (cached)   {
+		sc_log(ctx, "SDO %X:%X tag %X from cache", sdo->sdo_class, sdo->sdo_ref, sdo_tag);
+		LOG_TEST_RET(ctx, cached->rv, "SDO get data error");
+		rv = iasecc_sdo_parse(card, cached->data, cached->data_len, sdo);
+		LOG_TEST_RET(ctx, rv, "cannot parse SDO data");
+		LOG_FUNC_RETURN(ctx, rv);
+	}
+
 	sbuf[offs--] = 0x80;
 	sbuf[offs--] = sdo_tag & 0xFF;
 	if ((sdo_tag >> 8) & 0xFF)
@@ -2775,10 +2859,14 @@ iasecc_sdo_get_tagged_data(struct sc_card *card, int sdo_tag, struct iasecc_sdo
 	rv = sc_transmit_apdu(card, &apdu);
 	LOG_TEST_RET(ctx, rv, "APDU transmit failed");
 	rv = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	/* the SDO being absent, or without public data, is an answer too */
+	if (rv == SC_ERROR_INCORRECT_PARAMETERS || rv == SC_ERROR_DATA_OBJECT_NOT_FOUND)
+		iasecc_sdo_cache_add(card, sdo_tag, sdo, rv, NULL, 0);
 	LOG_TEST_RET(ctx, rv, "SDO get data error");
 
 	rv = iasecc_sdo_parse(card, apdu.resp, apdu.resplen, sdo);
 	LOG_TEST_RET(ctx, rv, "cannot parse SDO data");
+	iasecc_sdo_cache_add(card, sdo_tag, sdo, SC_SUCCESS, apdu.resp, apdu.resplen);
 
 	LOG_FUNC_RETURN(ctx, rv);
 }
@@ -2816,6 +2904,7 @@ iasecc_sdo_generate(struct sc_card *card, struct iasecc_sdo *sdo)
 	int offs = 0, rv = SC_ERROR_NOT_SUPPORTED;
 
 	LOG_FUNC_CALLED(ctx);
+	iasecc_sdo_cache_clear(card);
 
 	if (sdo->sdo_class != IASECC_SDO_CLASS_RSA_PRIVATE)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_DATA, "For a moment, only RSA_PRIVATE class can be accepted for the SDO generation");
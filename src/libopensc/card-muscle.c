@@ -57,9 +57,13 @@ typedef struct muscle_private {
 	unsigned short verifiedPins;
 	mscfs_t *fs;
 	int rsa_key_ref;
+	size_t readUnit; /* Largest READ OBJECT length the applet takes, 0 until known */
 	
 } muscle_private_t;
 
+/* Objects anyone may read are kept in the directory cache up to this size */
+#define MUSCLE_MAX_CACHED_OBJECT (16 * 1024)
+
 static int muscle_finish(sc_card_t *card)
 {
 	muscle_private_t *priv = MUSCLE_DATA(card);
@@ -192,6 +196,7 @@ static int muscle_create_file(sc_card_t *card, sc_file_t *file)
 
 static int muscle_read_binary(sc_card_t *card, unsigned int idx, u8* buf, size_t count, unsigned long flags)
 {
+	muscle_private_t* priv = MUSCLE_DATA(card);
 	mscfs_t *fs = MUSCLE_FS(card);
 	int r;
 	msc_id objectId;
@@ -208,12 +213,32 @@ static int muscle_read_binary(sc_card_t *card, unsigned int idx, u8* buf, size_t
 		oid[1] = oid[3];
 		oid[2] = oid[3] = 0;
 	}
-	r = msc_read_object(card, objectId, idx, buf, count);
+	/* Read public objects once, as a whole */
+	if(fs->currentFileIndex >= 0 && file->read == 0
+			&& file->size > 0 && file->size <= MUSCLE_MAX_CACHED_OBJECT) {
+		if(!file->data) {
+			u8 *data = malloc(file->size);
+			if(data == NULL) SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY);
+			r = msc_read_object_unit(card, objectId, 0, data, file->size, &priv->readUnit);
+			if(r < 0) {
+				free(data);
+				SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
+			}
+			file->data = data;
+		}
+		if(idx >= file->size)
+			return 0;
+		r = MIN(count, file->size - idx);
+		memcpy(buf, file->data + idx, r);
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
+	}
+	r = msc_read_object_unit(card, objectId, idx, buf, count, &priv->readUnit);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
 }
 
 static int muscle_update_binary(sc_card_t *card, unsigned int idx, const u8* buf, size_t count, unsigned long flags)
 {
+	muscle_private_t* priv = MUSCLE_DATA(card);
 	mscfs_t *fs = MUSCLE_FS(card);
 	int r;
 	mscfs_file_t *file;
@@ -231,12 +256,17 @@ static int muscle_update_binary(sc_card_t *card, unsigned int idx, const u8* buf
 		oid[1] = oid[3];
 		oid[2] = oid[3] = 0;
 	}
+	/* The cached contents are read again next time */
+	if(fs->currentFileIndex >= 0) {
+		free(file->data);
+		file->data = NULL;
+	}
 	if(file->size < idx + count) {
 		int newFileSize = idx + count;
 		u8* buffer = malloc(newFileSize);
 		if(buffer == NULL) SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY);
 		
-		r = msc_read_object(card, objectId, 0, buffer, file->size);
+		r = msc_read_object_unit(card, objectId, 0, buffer, file->size, &priv->readUnit);
 		/* TODO: RETREIVE ACLS */
 		if(r < 0) goto update_bin_free_buffer;
 		r = msc_delete_object(card, objectId, 0);
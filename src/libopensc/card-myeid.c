@@ -126,6 +126,7 @@ static int myeid_init(struct sc_card *card)
         
 	/* State that we have an RNG */
 	card->caps |= SC_CARD_CAP_RNG;
+	card->caps |= SC_CARD_CAP_FCI_READ_ACL;
 
 	card->max_recv_size = 255;
 	card->max_send_size = 255;
@@ -1125,7 +1126,7 @@ static int myeid_get_info(struct sc_card *card, u8 *rbuf, size_t buflen)
 {
 	sc_apdu_t apdu;
 	int r;
-	char nameBuf[100];
+	static char nameBuf[100];
 
 	LOG_FUNC_CALLED(card->ctx);
 
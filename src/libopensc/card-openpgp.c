@@ -27,10 +27,12 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <limits.h>
 
 #include "internal.h"
 #include "asn1.h"
@@ -140,6 +142,8 @@ struct do_info {
 
 static int		pgp_get_card_features(sc_card_t *card);
 static int		pgp_finish(sc_card_t *card);
+static int		pgp_set_blob(struct blob *blob, const u8 *data, size_t len);
+static int		pgp_read_blob(sc_card_t *card, struct blob *blob);
 static void		pgp_iterate_blobs(struct blob *, int, void (*func)());
 
 static int		pgp_get_blob(sc_card_t *card, struct blob *blob,
@@ -279,6 +283,8 @@ struct pgp_priv_data {
 	size_t			max_cert_size;
 
 	sc_security_env_t	sec_env;
+
+	char			*do_cache_file;	/* see pgp_load_do_cache() */
 };
 
 /* ABI: check if card's ATR matches one of driver's */
@@ -296,6 +302,151 @@ pgp_match_card(sc_card_t *card)
 }
 
 
+/*
+ * Copy of the DOs that only PUT DATA changes, the ones pgp_get_data()
+ * marks as cacheable, in "<cache_dir>/openpgp-<AID>.dos" so that a new
+ * process does not read them again. The AID holds the serial number.
+ * It holds "OSCPGP01", then u16 tag, u16 len and the content of each DO,
+ * big endian. A PUT DATA removes it. Needs use_file_caching.
+ * 006E and 007A are always read from the card, as they have the PIN
+ * retry counters, the fingerprints and the signature counter.
+ */
+#define PGP_DO_FILE_MAGIC	"OSCPGP01"
+#define PGP_DO_FILE_MAGIC_LEN	8
+
+static const unsigned int pgp_cached_dos[] = { 0x004f, 0x0065, 0x5f52, 0 };
+
+static struct blob *
+pgp_cached_do_blob(struct blob *mf, unsigned int id)
+{
+	struct blob *child;
+	int i;
+
+	for (i = 0; pgp_cached_dos[i] && pgp_cached_dos[i] != id; i++)
+		;
+	if (pgp_cached_dos[i] == 0)
+		return NULL;
+	for (child = mf->files; child; child = child->next)
+		if (child->id == id)
+			return child;
+	return NULL;
+}
+
+static void
+pgp_load_do_cache(sc_card_t *card)
+{
+	struct pgp_priv_data *priv = DRVDATA(card);
+	sc_file_t *file = priv->mf->file;
+	char dir[PATH_MAX], fname[PATH_MAX];
+	char aid[SC_MAX_AID_STRING_SIZE];
+	u8 buf[4096];
+	size_t size, off, len;
+	unsigned int id;
+	struct blob *blob;
+	FILE *f;
+	int count = 0;
+
+	if (!_sc_card_use_file_cache(card->ctx) || file->namelen != 16)
+		return;
+	if (sc_get_cache_dir(card->ctx, dir, sizeof(dir)) != SC_SUCCESS
+			|| sc_bin_to_hex(file->name, file->namelen, aid, sizeof(aid), 0) != SC_SUCCESS)
+		return;
+	len = snprintf(fname, sizeof(fname), "%s/openpgp-%s.dos", dir, aid);
+	if (len >= sizeof(fname))
+		return;
+	priv->do_cache_file = strdup(fname);
+	if (priv->do_cache_file == NULL)
+		return;
+
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return;
+	size = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	if (size < PGP_DO_FILE_MAGIC_LEN || memcmp(buf, PGP_DO_FILE_MAGIC, PGP_DO_FILE_MAGIC_LEN))
+		return;
+	_sc_cache_used(card->ctx, fname);
+
+	for (off = PGP_DO_FILE_MAGIC_LEN; off + 4 <= size; off += len) {
+		id = bebytes2ushort(buf + off);
+		len = bebytes2ushort(buf + off + 2);
+		off += 4;
+		if (len > size - off)
+			break;
+		blob = pgp_cached_do_blob(priv->mf, id);
+		if (blob != NULL && blob->data == NULL && pgp_set_blob(blob, buf + off, len) == SC_SUCCESS)
+			count++;
+	}
+	sc_log(card->ctx, "%d DOs loaded from '%s'", count, fname);
+}
+
+static void
+pgp_store_do_cache(sc_card_t *card)
+{
+	struct pgp_priv_data *priv = DRVDATA(card);
+	struct blob *blob;
+	u8 num[2];
+	FILE *f;
+	int i;
+
+	f = fopen(priv->do_cache_file, "wb");
+	if (f == NULL && sc_make_cache_dir(card->ctx) == SC_SUCCESS)
+		f = fopen(priv->do_cache_file, "wb");
+	if (f == NULL) {
+		sc_log(card->ctx, "cannot write '%s'", priv->do_cache_file);
+		return;
+	}
+	fwrite(PGP_DO_FILE_MAGIC, 1, PGP_DO_FILE_MAGIC_LEN, f);
+	for (i = 0; pgp_cached_dos[i]; i++) {
+		blob = pgp_cached_do_blob(priv->mf, pgp_cached_dos[i]);
+		if (blob == NULL || blob->data == NULL)
+			continue;
+		fwrite(ushort2bebytes(num, blob->id), 1, 2, f);
+		fwrite(ushort2bebytes(num, blob->len), 1, 2, f);
+		fwrite(blob->data, 1, blob->len, f);
+	}
+	if (fclose(f) != 0) {
+		remove(priv->do_cache_file);
+		return;
+	}
+	_sc_cache_used(card->ctx, priv->do_cache_file);
+}
+
+static void
+pgp_remove_do_cache(sc_card_t *card)
+{
+	struct pgp_priv_data *priv = DRVDATA(card);
+
+	if (priv->do_cache_file == NULL)
+		return;
+	remove(priv->do_cache_file);
+	free(priv->do_cache_file);
+	priv->do_cache_file = NULL;
+}
+
+/*
+ * Read the DOs the PKCS#15 emulation needs at init, the ones that are not
+ * in the file cache yet, and keep them there.
+ */
+static void
+pgp_prefetch_dos(sc_card_t *card)
+{
+	struct pgp_priv_data *priv = DRVDATA(card);
+	struct blob *blob;
+	int i, read = 0;
+
+	for (i = 0; pgp_cached_dos[i]; i++) {
+		blob = pgp_cached_do_blob(priv->mf, pgp_cached_dos[i]);
+		if (blob == NULL || blob->data != NULL || blob->status != 0)
+			continue;
+		if (pgp_read_blob(card, blob) == SC_SUCCESS && blob->data != NULL)
+			read++;
+	}
+	if (read && priv->do_cache_file != NULL)
+		pgp_store_do_cache(card);
+}
+
+
 /* ABI: initialize driver */
 static int
 pgp_init(sc_card_t *card)
@@ -366,9 +517,13 @@ pgp_init(sc_card_t *card)
 		}
 	}
 
+	pgp_load_do_cache(card);
+
 	/* get card_features from ATR & DOs */
 	pgp_get_card_features(card);
 
+	pgp_prefetch_dos(card);
+
 	return SC_SUCCESS;
 }
 
@@ -505,6 +660,8 @@ pgp_finish(sc_card_t *card)
 			/* delete fake file hierarchy */
 			pgp_iterate_blobs(priv->mf, 99, pgp_free_blob);
 
+			free(priv->do_cache_file);
+
 			/* delete private data */
 			free(priv);
 		}
@@ -1133,6 +1290,14 @@ pgp_get_data(sc_card_t *card, unsigned int tag, u8 *buf, size_t buf_len)
 	apdu.le = ((buf_len >= 256) && !(card->caps & SC_CARD_CAP_APDU_EXT)) ? 256 : buf_len;
 	apdu.resp = buf;
 	apdu.resplen = buf_len;
+	switch (tag) {
+	case 0x004f: case 0x5f52: case 0x7f66:
+		/* AID, historical bytes and extended length information:
+		 * fixed for the life of the card. The cardholder data and
+		 * the keys can be changed by another process. */
+		apdu.flags |= SC_APDU_FLAGS_CACHEABLE;
+		break;
+	}
 
 	r = sc_transmit_apdu(card, &apdu);
 	LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
@@ -1221,6 +1386,8 @@ pgp_put_data(sc_card_t *card, unsigned int tag, const u8 *buf, size_t buf_len)
 	}
 	LOG_TEST_RET(card->ctx, r, "PUT DATA returned error");
 
+	pgp_remove_do_cache(card);
+
 	if (affected_blob) {
 		/* Update the corresponding file */
 		sc_log(card->ctx, "Updating the corresponding blob data");
@@ -2253,6 +2420,27 @@ pgp_update_binary(sc_card_t *card, unsigned int idx,
 }
 
 
+/* ABI: restore the selected application after a card reset */
+static int
+pgp_card_reader_lock_obtained(sc_card_t *card, int was_reset)
+{
+	sc_path_t	aid;
+	int		r = SC_SUCCESS;
+
+	LOG_FUNC_CALLED(card->ctx);
+
+	if (was_reset && card->drv_data != NULL) {
+		/* the file tree in drv_data is still valid, only the
+		 * application has to be selected again */
+		sc_format_path("D276:0001:2401", &aid);
+		aid.type = SC_PATH_TYPE_DF_NAME;
+		r = iso_ops->select_file(card, &aid, NULL);
+	}
+
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
+
 /* ABI: driver binding stuff */
 static struct sc_card_driver *
 sc_get_driver(void)
@@ -2265,6 +2453,7 @@ sc_get_driver(void)
 	pgp_ops.match_card	= pgp_match_card;
 	pgp_ops.init		= pgp_init;
 	pgp_ops.finish		= pgp_finish;
+	pgp_ops.card_reader_lock_obtained = pgp_card_reader_lock_obtained;
 	pgp_ops.select_file	= pgp_select_file;
 	pgp_ops.list_files	= pgp_list_files;
 	pgp_ops.read_binary	= pgp_read_binary;
@@ -117,9 +117,13 @@ enum {
  * If the file lilsted in the history object offCardCertURL was found,
  * its certs will be read into the cache and PIV_OBJ_CACHE_VALID set
  * and PIV_OBJ_CACHE_NOT_PRESENT unset.
+ * PIV_OBJ_CACHE_READ means the data, or its absence, comes from the card
+ * (or from the copy of the cache in the file cache), and can be kept in
+ * the file cache.
  */
 
 #define PIV_OBJ_CACHE_VALID			1
+#define PIV_OBJ_CACHE_READ			2	/* read from the card */
 #define PIV_OBJ_CACHE_NOT_PRESENT	8
 
 typedef struct piv_obj_cache {
@@ -148,10 +152,38 @@ typedef struct piv_private_data {
 	int keysWithOffCardCerts;
 	char * offCardCertURL;
 	int pin_preference; /* set from Discovery object */
+	char * obj_cache_file; /* file cache copy of obj_cache, see piv_load_obj_cache */
+	int obj_cache_dirty; /* objects were read that are not in it */
+	struct sc_memcache_account obj_cache_account; /* see piv_account_obj_cache */
 } piv_private_data_t;
 
 #define PIV_DATA(card) ((piv_private_data_t*)card->drv_data)
 
+/*
+ * The memory of obj_cache counts against cache_memory_max_size, but the
+ * objects are handed out by reference and are never evicted for it.
+ */
+static void piv_account_obj_cache(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	struct sc_memcache_account *acc = &priv->obj_cache_account;
+	size_t bytes = 0;
+	long entries = 0;
+	int i;
+
+	for (i = 0; i < PIV_OBJ_LAST_ENUM - 1; i++) {
+		if (priv->obj_cache[i].obj_data)
+			bytes += priv->obj_cache[i].obj_len;
+		if (priv->obj_cache[i].internal_obj_data)
+			bytes += priv->obj_cache[i].internal_obj_len;
+		if (priv->obj_cache[i].obj_data || priv->obj_cache[i].internal_obj_data)
+			entries++;
+	}
+	if (bytes != acc->bytes || (unsigned long) entries != acc->entries)
+		_sc_memcache_add(card->ctx, acc, (long) bytes - (long) acc->bytes,
+				entries - (long) acc->entries);
+}
+
 struct piv_aid {
 	int enumtag;
 	size_t len_short;	/* min lenght without version */
@@ -964,6 +996,7 @@ static int piv_get_cached_data(sc_card_t * card, int enumtag,
 		*buf = priv->obj_cache[enumtag].obj_data;
 		*buf_len = priv->obj_cache[enumtag].obj_len;
 		r = *buf_len;
+		_sc_memcache_lookup(card->ctx, &priv->obj_cache_account, 1);
 		goto ok;
 	}
 
@@ -981,12 +1014,15 @@ static int piv_get_cached_data(sc_card_t * card, int enumtag,
 
 	/* Not cached, try to get it, piv_get_data will allocate a buf */
 	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"get #%d",  enumtag);
+	_sc_memcache_lookup(card->ctx, &priv->obj_cache_account, 0);
 	rbuflen = 1;
 	r = piv_get_data(card, enumtag, &rbuf, &rbuflen);
 	if (r > 0) {
-		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
+		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_READ;
 		priv->obj_cache[enumtag].obj_len = r;
 		priv->obj_cache[enumtag].obj_data = rbuf;
+		priv->obj_cache_dirty = 1;
+		piv_account_obj_cache(card);
 		*buf = rbuf;
 		*buf_len = r;
 
@@ -999,8 +1035,9 @@ static int piv_get_cached_data(sc_card_t * card, int enumtag,
 
 	} else if (r == 0 || r == SC_ERROR_FILE_NOT_FOUND) {
 		r = SC_ERROR_FILE_NOT_FOUND;
-		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
+		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_READ;
 		priv->obj_cache[enumtag].obj_len = 0;
+		priv->obj_cache_dirty = 1;
 	} else if ( r < 0) {
 		goto err;
 	}
@@ -1053,9 +1090,9 @@ static int piv_cache_internal_data(sc_card_t *card, int enumtag)
 
 			if(compressed) {
 #ifdef ENABLE_ZLIB
-			size_t len;
+			size_t len = 0;
 			u8* newBuf = NULL;
-			if(SC_SUCCESS != sc_decompress_alloc(&newBuf, &len, tag, taglen, COMPRESSION_AUTO)) {
+			if(SC_SUCCESS != sc_decompress_cached(card->ctx, &newBuf, &len, tag, taglen, COMPRESSION_AUTO)) {
 				SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OBJECT_NOT_VALID);
 			}
 			priv->obj_cache[enumtag].internal_obj_data = newBuf;
@@ -1095,11 +1132,228 @@ static int piv_cache_internal_data(sc_card_t *card, int enumtag)
 	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"added #%d internal %p:%d", enumtag,
 		priv->obj_cache[enumtag].internal_obj_data,
 		priv->obj_cache[enumtag].internal_obj_len);
+	piv_account_obj_cache(card);
 
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, 0);
 }
 
 
+/*
+ * The serial number of the card from its CHUID: the GUID, else the FASC-N
+ */
+static int piv_parse_chuid_serial(sc_card_t *card, const u8 *rbuf, size_t rbuflen,
+		sc_serial_number_t *serial)
+{
+	int r;
+	int i;
+	u8 gbits;
+	const u8 *body;
+	const u8 *fascn;
+	const u8 *guid;
+	size_t bodylen, fascnlen, guidlen;
+
+	r = SC_ERROR_INTERNAL;
+	if (rbuflen != 0) {
+		body = sc_asn1_find_tag(card->ctx, rbuf, rbuflen, 0x53, &bodylen); /* Pass the outer wrapper asn1 */
+		if (body != NULL && bodylen != 0) {
+			fascn = sc_asn1_find_tag(card->ctx, body, bodylen, 0x30, &fascnlen); /* Find the FASC-N data */
+			guid = sc_asn1_find_tag(card->ctx, body, bodylen, 0x34, &guidlen);
+
+			gbits = 0; /* if guid is valid, gbits will not be zero */
+			if (guid && guidlen == 16) {
+				for (i = 0; i < 16; i++) {
+					gbits = gbits | guid[i]; /* if all are zero, gbits will be zero */
+				}
+			}
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"fascn=%p,fascnlen=%d,guid=%p,guidlen=%d,gbits=%2.2x\n",
+					fascn, fascnlen, guid, guidlen, gbits);
+
+			if (fascn && fascnlen == 25) {
+				/* test if guid and the fascn starts with ;9999 (in ISO 4bit + partiy code) */
+				if (!(gbits && fascn[0] == 0xD4 && fascn[1] == 0xE7
+						    && fascn[2] == 0x39 && (fascn[3] | 0x7F) == 0xFF)) {
+					serial->len = fascnlen < SC_MAX_SERIALNR ? fascnlen : SC_MAX_SERIALNR;
+					memcpy (serial->value, fascn, serial->len);
+					r = SC_SUCCESS;
+					gbits = 0; /* set to skip using guid below */
+				}
+			}
+			if (guid && gbits) {
+				serial->len = guidlen < SC_MAX_SERIALNR ? guidlen : SC_MAX_SERIALNR;
+				memcpy (serial->value, guid, serial->len);
+				r = SC_SUCCESS;
+			}
+		}
+	}
+	return r;
+}
+
+/*
+ * Copy of the object cache in the file cache, "<cache_dir>/piv-<id>.objs"
+ * where <id> is the GUID or FASC-N of the CHUID, so that a new process
+ * does not read the discovery, history and certificate objects again.
+ * It holds
+ *   "OSCPIV01"		magic and version
+ *   u32 len, bytes	the CHUID the objects were read with
+ *   for each object read from the card, or found missing:
+ *     u8 enumtag, u32 len, bytes	0 length if not on the card
+ * All numbers are big endian. The CHUID is read from the card at each
+ * init, and the file is only used when it is the same. A write to the
+ * card removes it. Needs use_file_caching.
+ */
+#define PIV_OBJ_FILE_MAGIC	"OSCPIV01"
+#define PIV_OBJ_FILE_MAGIC_LEN	8
+
+static size_t piv_obj_file_get_num(const u8 **p, const u8 *end, size_t n, int *err)
+{
+	size_t val = 0;
+
+	if ((size_t)(end - *p) < n) {
+		*err = 1;
+		return 0;
+	}
+	while (n--)
+		val = (val << 8) | *(*p)++;
+	return val;
+}
+
+static void piv_obj_file_put_num(FILE *f, size_t val, size_t n)
+{
+	while (n--)
+		fputc((int)((val >> (8 * n)) & 0xFF), f);
+}
+
+static void piv_load_obj_cache(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	sc_serial_number_t serial;
+	char dir[PATH_MAX], fname[PATH_MAX];
+	char id[SC_MAX_SERIALNR * 2 + 1];
+	u8 *chuid = NULL, *buf = NULL;
+	size_t chuidlen = 0, len;
+	const u8 *p, *end;
+	long size = 0;
+	int enumtag, count = 0, err = 0;
+	FILE *f;
+
+	if (!_sc_card_use_file_cache(card->ctx))
+		return;
+	if (piv_get_cached_data(card, PIV_OBJ_CHUI, &chuid, &chuidlen) <= 0
+			|| piv_parse_chuid_serial(card, chuid, chuidlen, &serial) != SC_SUCCESS)
+		return;
+	if (sc_get_cache_dir(card->ctx, dir, sizeof(dir)) != SC_SUCCESS
+			|| sc_bin_to_hex(serial.value, serial.len, id, sizeof(id), 0) != SC_SUCCESS)
+		return;
+	len = snprintf(fname, sizeof(fname), "%s/piv-%s.objs", dir, id);
+	if (len >= sizeof(fname))
+		return;
+	priv->obj_cache_file = strdup(fname);
+	if (priv->obj_cache_file == NULL)
+		return;
+	/* until it is known to be valid */
+	priv->obj_cache_dirty = 1;
+
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return;
+	if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0)
+		buf = malloc(size);
+	if (buf && fread(buf, 1, size, f) != (size_t)size) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	if (buf == NULL)
+		return;
+	_sc_cache_used(card->ctx, fname);
+
+	p = buf;
+	end = buf + size;
+	if (size < PIV_OBJ_FILE_MAGIC_LEN || memcmp(p, PIV_OBJ_FILE_MAGIC, PIV_OBJ_FILE_MAGIC_LEN))
+		goto out;
+	p += PIV_OBJ_FILE_MAGIC_LEN;
+	len = piv_obj_file_get_num(&p, end, 4, &err);
+	if (err || (size_t)(end - p) < len || len != chuidlen || memcmp(p, chuid, len)) {
+		sc_log(card->ctx, "PIV objects in '%s' are for another CHUID", fname);
+		goto out;
+	}
+	p += len;
+
+	while (p < end) {
+		enumtag = piv_obj_file_get_num(&p, end, 1, &err);
+		len = piv_obj_file_get_num(&p, end, 4, &err);
+		if (err || (size_t)(end - p) < len || enumtag >= PIV_OBJ_LAST_ENUM - 1)
+			break;
+		/* what this process has already read stays */
+		if (!(priv->obj_cache[enumtag].flags & PIV_OBJ_CACHE_VALID)) {
+			if (len) {
+				priv->obj_cache[enumtag].obj_data = malloc(len);
+				if (priv->obj_cache[enumtag].obj_data == NULL)
+					break;
+				memcpy(priv->obj_cache[enumtag].obj_data, p, len);
+			}
+			priv->obj_cache[enumtag].obj_len = len;
+			priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_READ;
+			count++;
+		}
+		p += len;
+	}
+	if (p == end)
+		priv->obj_cache_dirty = 0;
+	piv_account_obj_cache(card);
+	sc_log(card->ctx, "%d PIV objects loaded from '%s'", count, fname);
+out:
+	free(buf);
+}
+
+static void piv_store_obj_cache(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	piv_obj_cache_t *chuid = &priv->obj_cache[PIV_OBJ_CHUI];
+	FILE *f;
+	int i;
+
+	if (priv->obj_cache_file == NULL || !priv->obj_cache_dirty
+			|| !(chuid->flags & PIV_OBJ_CACHE_READ) || chuid->obj_len == 0)
+		return;
+
+	f = fopen(priv->obj_cache_file, "wb");
+	if (f == NULL && sc_make_cache_dir(card->ctx) == SC_SUCCESS)
+		f = fopen(priv->obj_cache_file, "wb");
+	if (f == NULL) {
+		sc_log(card->ctx, "cannot write '%s'", priv->obj_cache_file);
+		return;
+	}
+	fwrite(PIV_OBJ_FILE_MAGIC, 1, PIV_OBJ_FILE_MAGIC_LEN, f);
+	piv_obj_file_put_num(f, chuid->obj_len, 4);
+	fwrite(chuid->obj_data, 1, chuid->obj_len, f);
+	for (i = 0; i < PIV_OBJ_LAST_ENUM - 1; i++) {
+		if (i == PIV_OBJ_CHUI || !(priv->obj_cache[i].flags & PIV_OBJ_CACHE_READ))
+			continue;
+		piv_obj_file_put_num(f, i, 1);
+		piv_obj_file_put_num(f, priv->obj_cache[i].obj_len, 4);
+		if (priv->obj_cache[i].obj_len)
+			fwrite(priv->obj_cache[i].obj_data, 1, priv->obj_cache[i].obj_len, f);
+	}
+	if (fclose(f) != 0) {
+		remove(priv->obj_cache_file);
+		return;
+	}
+	priv->obj_cache_dirty = 0;
+	_sc_cache_used(card->ctx, priv->obj_cache_file);
+}
+
+static void piv_remove_obj_cache(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+
+	if (priv->obj_cache_file == NULL)
+		return;
+	remove(priv->obj_cache_file);
+	free(priv->obj_cache_file);
+	priv->obj_cache_file = NULL;
+}
+
 /*
  * Callers of this may be expecting a certificate,
  * select file will have saved the object type for us
@@ -1298,6 +1552,9 @@ static int piv_write_binary(sc_card_t *card, unsigned int idx,
 
 	if (priv->rwb_state == -1) {
 
+		/* the objects of the card change: drop the file cache copy */
+		piv_remove_obj_cache(card);
+
 		/* if  cached, remove old entry */
 		if (priv->obj_cache[enumtag].flags & PIV_OBJ_CACHE_VALID) {
 			priv->obj_cache[enumtag].flags = 0;
@@ -1311,6 +1568,7 @@ static int piv_write_binary(sc_card_t *card, unsigned int idx,
 				priv->obj_cache[enumtag].internal_obj_data = NULL;
 				priv->obj_cache[enumtag].internal_obj_len = 0;
 			}
+			piv_account_obj_cache(card);
 		}
 
 		if (idx != 0)
@@ -1357,6 +1615,7 @@ static int piv_write_binary(sc_card_t *card, unsigned int idx,
 		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
 		priv->obj_cache[enumtag].obj_data = priv->w_buf;
 		priv->obj_cache[enumtag].obj_len = priv->w_buf_len;
+		piv_account_obj_cache(card);
 	} else {
 		if (priv->w_buf)
 			free(priv->w_buf);
@@ -1681,13 +1940,8 @@ err:
 static int piv_get_serial_nr_from_CHUI(sc_card_t* card, sc_serial_number_t* serial)
 {
 	int r;
-	int i;
-	u8 gbits;
 	u8 *rbuf = NULL;
-	const u8 *body;
-	const u8 *fascn;
-	const u8 *guid;
-	size_t rbuflen = 0, bodylen, fascnlen, guidlen;
+	size_t rbuflen = 0;
 	u8 temp[2000];
 	size_t templen = sizeof(temp);
 
@@ -1710,39 +1964,7 @@ static int piv_get_serial_nr_from_CHUI(sc_card_t* card, sc_serial_number_t* seri
 	r = piv_get_cached_data(card, PIV_OBJ_CHUI, &rbuf, &rbuflen);
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "Failure retrieving CHUI");
 
-	r = SC_ERROR_INTERNAL;
-	if (rbuflen != 0) {
-		body = sc_asn1_find_tag(card->ctx, rbuf, rbuflen, 0x53, &bodylen); /* Pass the outer wrapper asn1 */
-		if (body != NULL && bodylen != 0) {
-			fascn = sc_asn1_find_tag(card->ctx, body, bodylen, 0x30, &fascnlen); /* Find the FASC-N data */
-			guid = sc_asn1_find_tag(card->ctx, body, bodylen, 0x34, &guidlen);
-
-			gbits = 0; /* if guid is valid, gbits will not be zero */
-			if (guid && guidlen == 16) {
-				for (i = 0; i < 16; i++) {
-					gbits = gbits | guid[i]; /* if all are zero, gbits will be zero */
-				}
-			}
-			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"fascn=%p,fascnlen=%d,guid=%p,guidlen=%d,gbits=%2.2x\n",
-					fascn, fascnlen, guid, guidlen, gbits);
-
-			if (fascn && fascnlen == 25) {
-				/* test if guid and the fascn starts with ;9999 (in ISO 4bit + partiy code) */
-				if (!(gbits && fascn[0] == 0xD4 && fascn[1] == 0xE7
-						    && fascn[2] == 0x39 && (fascn[3] | 0x7F) == 0xFF)) {
-					serial->len = fascnlen < SC_MAX_SERIALNR ? fascnlen : SC_MAX_SERIALNR;
-					memcpy (serial->value, fascn, serial->len);
-					r = SC_SUCCESS;
-					gbits = 0; /* set to skip using guid below */
-				}
-			}
-			if (guid && gbits) {
-				serial->len = guidlen < SC_MAX_SERIALNR ? guidlen : SC_MAX_SERIALNR;
-				memcpy (serial->value, guid, serial->len);
-				r = SC_SUCCESS;
-			}
-		}
-	}
+	r = piv_parse_chuid_serial(card, rbuf, rbuflen, serial);
 
 	card->serialnr = *serial;
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
@@ -1751,7 +1973,7 @@ static int piv_get_serial_nr_from_CHUI(sc_card_t* card, sc_serial_number_t* seri
 /*
  * If the object can not be present on the card, because the History
  * object is not present or the History object says its not present,
- * return 1. If object may be present return 0.
+ * or it was already looked for and not found, return 1. If object may be present return 0.
  * Cuts down on overhead, by not showing non existent objects to pkcs11
  * The path for the object is passed in and the first 2 bytes are used.
  * Note: If the History or Discovery object is not found the
@@ -1768,6 +1990,10 @@ static int piv_is_object_present(sc_card_t *card, u8 *ptr)
 	enumtag = piv_find_obj_by_containerid(card, ptr);
 	if (enumtag >= 0 && priv->obj_cache[enumtag].flags & PIV_OBJ_CACHE_NOT_PRESENT)
 		r = 1;
+	/* known to be missing, from this process or from the file cache */
+	else if (enumtag >= 0 && priv->obj_cache[enumtag].flags & PIV_OBJ_CACHE_VALID
+			&& priv->obj_cache[enumtag].obj_len == 0)
+		r = 1;
 
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
 }
@@ -2479,6 +2705,38 @@ err:
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
 }
 
+/*
+ * With the file cache, find out once which of the certificate objects
+ * that may be on the card are really there, in one transaction, so that
+ * the map of present and absent objects is in the file cache and a later
+ * bind does not try the missing ones with a GET DATA each.
+ * Data objects are not read here, some need the PIN and some are large;
+ * their absence is kept when they are read by the application.
+ */
+static void piv_map_objects(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	u8 *rbuf;
+	size_t rbuflen;
+	int i, count = 0;
+
+	if (priv->obj_cache_file == NULL)
+		return;
+	for (i = 0; i < PIV_OBJ_LAST_ENUM - 1; i++) {
+		if (!(piv_objects[i].flags & PIV_OBJECT_TYPE_CERT)
+				|| priv->obj_cache[i].flags & (PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_NOT_PRESENT))
+			continue;
+		if (count++ == 0 && sc_lock(card) != SC_SUCCESS)
+			return;
+		piv_get_cached_data(card, i, &rbuf, &rbuflen);
+	}
+	if (count == 0)
+		return;
+	sc_unlock(card);
+	sc_log(card->ctx, "%d PIV objects looked for", count);
+	piv_store_obj_cache(card);
+}
+
 
 static int piv_finish(sc_card_t *card)
 {
@@ -2493,6 +2751,9 @@ static int piv_finish(sc_card_t *card)
 			free(priv->w_buf);
 		if (priv->offCardCertURL)
 			free(priv->offCardCertURL);
+		piv_store_obj_cache(card);
+		if (priv->obj_cache_file)
+			free(priv->obj_cache_file);
 		for (i = 0; i < PIV_OBJ_LAST_ENUM - 1; i++) {
 			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"DEE freeing #%d, 0x%02x %p:%d %p:%d", i,
 				priv->obj_cache[i].flags,
@@ -2503,6 +2764,9 @@ static int piv_finish(sc_card_t *card)
 			if (priv->obj_cache[i].internal_obj_data)
 				free(priv->obj_cache[i].internal_obj_data);
 		}
+		_sc_memcache_add(card->ctx, &priv->obj_cache_account,
+				-(long) priv->obj_cache_account.bytes,
+				-(long) priv->obj_cache_account.entries);
 		free(priv);
 	}
 	return 0;
@@ -2537,6 +2801,7 @@ static int piv_init(sc_card_t *card)
 	if (!priv)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY);
 	priv->aid_file = sc_file_new();
+	_sc_memcache_init(&priv->obj_cache_account, "piv", 0);
 	priv->selected_obj = -1;
 	priv->pin_preference = 0x80; /* 800-73-3 part 1, table 3 */
 
@@ -2583,11 +2848,16 @@ static int piv_init(sc_card_t *card)
 	 * 800-73-3 cards may have a history object and/or a discovery object
 	 * We want to process them now as this has information on what
 	 * keys and certs the card has and how the pin might be used.
+	 * They may be in the file cache already.
 	 */
+	piv_load_obj_cache(card);
+
 	r = piv_process_history(card);
 
 	r = piv_process_discovery(card);
 
+	piv_map_objects(card);
+
 	if (r > 0)
 		r = 0;
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
@@ -227,6 +227,68 @@ static int sc_hsm_read_binary(sc_card_t *card,
 
 
 
+/*
+ * Read an EF without selecting it first: READ BINARY with odd INS takes
+ * the file identifier in P1/P2. Extended length APDUs are used when the
+ * card takes them, so that most files need a single APDU.
+ */
+int sc_hsm_read_ef(sc_card_t *card, int fid, unsigned int idx, u8 *buf, size_t count)
+{
+	sc_context_t *ctx = card->ctx;
+	sc_hsm_private_data_t *priv = (sc_hsm_private_data_t *) card->drv_data;
+	sc_apdu_t apdu;
+	u8 cmdbuff[4];
+	size_t chunk, total = 0;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+
+	while (total < count) {
+		if (idx + total > 0xffff) {
+			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "invalid EF offset: 0x%X > 0xFFFF", (unsigned int)(idx + total));
+			return SC_ERROR_OFFSET_TOO_LARGE;
+		}
+
+		cmdbuff[0] = 0x54;
+		cmdbuff[1] = 0x02;
+		cmdbuff[2] = ((idx + total) >> 8) & 0xFF;
+		cmdbuff[3] = (idx + total) & 0xFF;
+
+		chunk = count - total;
+		if (priv->noExtLength) {
+			if (chunk > 256)
+				chunk = 256;
+			sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0xB1, (fid >> 8) & 0xFF, fid & 0xFF);
+		} else {
+			if (chunk > MAX_EXT_APDU_LENGTH)
+				chunk = MAX_EXT_APDU_LENGTH;
+			sc_format_apdu(card, &apdu, SC_APDU_CASE_4_EXT, 0xB1, (fid >> 8) & 0xFF, fid & 0xFF);
+		}
+		apdu.data = cmdbuff;
+		apdu.datalen = 4;
+		apdu.lc = 4;
+		apdu.le = chunk;
+		apdu.resplen = chunk;
+		apdu.resp = buf + total;
+
+		r = sc_transmit_apdu(card, &apdu);
+		LOG_TEST_RET(ctx, r, "APDU transmit failed");
+
+		r =  sc_check_sw(card, apdu.sw1, apdu.sw2);
+		if (r != SC_ERROR_FILE_END_REACHED) {
+			LOG_TEST_RET(ctx, r, "Check SW error");
+		}
+
+		total += apdu.resplen;
+		if (r == SC_ERROR_FILE_END_REACHED || apdu.resplen < chunk)
+			break;
+	}
+
+	LOG_FUNC_RETURN(ctx, total);
+}
+
+
+
 static int sc_hsm_update_binary(sc_card_t *card,
 			       unsigned int idx, const u8 *buf, size_t count,
 			       unsigned long flags)
@@ -180,6 +180,7 @@ static int setcos_init(sc_card_t *card)
 	case SC_CARD_TYPE_SETCOS_EID_V2_1:
 		card->cla = 0x00;
 		card->caps |= SC_CARD_CAP_USE_FCI_AC;
+		card->caps |= SC_CARD_CAP_FCI_READ_ACL;
 		card->caps |= SC_CARD_CAP_RNG;
 		card->caps |= SC_CARD_CAP_APDU_EXT;
 		break;
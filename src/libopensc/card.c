@@ -21,14 +21,17 @@
 #include "config.h"
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 #include <string.h>
+#include <limits.h>
 
 #include "internal.h"
 #include "asn1.h"
+#include "iso7816.h"
 
 /*
 #define INVALIDATE_CARD_CACHE_IN_UNLOCK
@@ -61,6 +64,36 @@ void sc_format_apdu(sc_card_t *card, sc_apdu_t *apdu,
 	apdu->p2 = (u8) p2;
 }
 
+/* Never split WRITE/UPDATE BINARY below this when the card refuses a length */
+#define SC_MIN_WRITE_SIZE	16
+
+/* A read queued by sc_read_binary_async() */
+struct sc_pending_read {
+	unsigned int idx;
+	size_t count;
+	sc_read_binary_cb_t cb;
+	void *userdata;
+	struct sc_pending_read *next;
+};
+
+/* A read sent to the worker of the reader by sc_read_binary_async() */
+struct sc_async_read {
+	sc_card_t *card;
+	unsigned int idx;
+	size_t count;
+	sc_read_binary_cb_t cb;
+	void *userdata;
+	u8 *buf;
+};
+
+/* The reads of sc_read_binary_async() are for the current file: they are
+ * done before it may change */
+static void sc_card_finish_reads(sc_card_t *card)
+{
+	if (card->pending_reads != NULL || card->async_reads)
+		sc_complete_reads(card);
+}
+
 static sc_card_t * sc_card_new(sc_context_t *ctx)
 {
 	sc_card_t *card;
@@ -86,6 +119,7 @@ static sc_card_t * sc_card_new(sc_context_t *ctx)
 
 	card->type = -1;
 	card->app_count = -1;
+	_sc_memcache_init(&card->cache.fci_account, "fci", 1);
 
 	return card;
 }
@@ -103,6 +137,14 @@ static void sc_card_free(sc_card_t *card)
 		sc_file_free(card->cache.current_ef);
 	if (card->cache.current_df)
 		sc_file_free(card->cache.current_df);
+	sc_invalidate_fci_cache(card, NULL);
+	_sc_free_apdu_cache(card);
+	while (card->pending_reads != NULL) {
+		struct sc_pending_read *req = card->pending_reads;
+
+		card->pending_reads = req->next;
+		free(req);
+	}
 	if (card->mutex != NULL) {
 		int r = sc_mutex_destroy(card->ctx, card->mutex);
 		if (r != SC_SUCCESS)
@@ -112,12 +154,386 @@ static void sc_card_free(sc_card_t *card)
 	free(card);
 }
 
+/* Extended length support announced by the card itself: the card
+ * capabilities of the historical bytes and of EF.ATR, and the extended
+ * length information DO of EF.ATR. Returns max. Le, 0 if not supported. */
+static size_t sc_card_get_ext_le(sc_card_t *card)
+{
+	struct sc_reader *reader = card->reader;
+	const u8 *hb = reader->atr_info.hist_bytes;
+	size_t hb_len = reader->atr_info.hist_bytes_len;
+	size_t ii, max_le = 0;
+	int ext_le = 0, have_ef_atr = 0;
+
+	/* compact-TLV objects, the category indicator 0x00 has a status indicator at the end */
+	if (hb_len > 0 && (hb[0] == 0x00 || hb[0] == 0x80))   {
+		if (hb[0] == 0x00)
+			hb_len = hb_len > 3 ? hb_len - 3 : 0;
+		for (ii = 1; ii < hb_len; )   {
+			unsigned tag = hb[ii] >> 4, len = hb[ii] & 0x0F;
+
+			if (ii + 1 + len > hb_len)
+				break;
+			if (tag == ISO7816_HIST_TAG_CARD_SERVICE && len >= 1)
+				have_ef_atr = (hb[ii + 1] & ISO7816_CARD_SERVICE_EF_ATR) ? 1 : 0;
+			else if (tag == ISO7816_HIST_TAG_CARD_CAPABILITIES && len >= 3)
+				ext_le = (hb[ii + 3] & ISO7816_CARD_CAP_EXTENDED_LENGTH) ? 1 : 0;
+			ii += 1 + len;
+		}
+	}
+
+	if (have_ef_atr && card->ef_atr == NULL)   {
+		if (sc_parse_ef_atr(card) != SC_SUCCESS)
+			sc_log(card->ctx, "cannot parse EF.ATR");
+	}
+
+	if (card->ef_atr)   {
+		if (card->ef_atr->card_capabilities & ISO7816_CARD_CAP_EXTENDED_LENGTH)
+			ext_le = 1;
+		max_le = card->ef_atr->max_response_apdu;
+	}
+
+	if (!ext_le)
+		return 0;
+	return max_le ? max_le : 65536;
+}
+
+
+/* Per-ATR cache file "<cache_dir>/<ATR>.<suffix>" */
+int _sc_card_cache_filename(sc_card_t *card, const char *suffix,
+		char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	char atr[SC_MAX_ATR_SIZE * 2 + 1];
+	int r;
+
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	r = sc_bin_to_hex(card->atr.value, card->atr.len, atr, sizeof(atr), 0);
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/%s.%s", dir, atr, suffix);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/* The per-ATR files share the switch of the PKCS#15 file cache */
+int _sc_card_use_file_cache(sc_context_t *ctx)
+{
+	scconf_block *conf_block;
+
+	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
+	return conf_block ? scconf_get_bool(conf_block, "use_file_caching", 0) : 0;
+}
+
+/* Data size of WRITE/UPDATE BINARY the card has taken, from "<ATR>.wr" */
+static void sc_card_load_max_write_size(sc_card_t *card)
+{
+	char fname[PATH_MAX];
+	unsigned long value;
+	FILE *f;
+
+	if (!_sc_card_use_file_cache(card->ctx)
+			|| _sc_card_cache_filename(card, "wr", fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return;
+	if (fscanf(f, "%lu", &value) == 1 && value > 0 && value <= 65535)   {
+		card->max_write_size = value;
+		sc_log(card->ctx, "max_write_size %lu (cached)", value);
+	}
+	fclose(f);
+	_sc_cache_used(card->ctx, fname);
+}
+
+static void sc_card_store_max_write_size(sc_card_t *card)
+{
+	char fname[PATH_MAX];
+	FILE *f;
+
+	if (!_sc_card_use_file_cache(card->ctx)
+			|| _sc_card_cache_filename(card, "wr", fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	f = fopen(fname, "w");
+	if (f == NULL && sc_make_cache_dir(card->ctx) == SC_SUCCESS)
+		f = fopen(fname, "w");
+	if (f)   {
+		fprintf(f, "%lu\n", (unsigned long)card->max_write_size);
+		fclose(f);
+		_sc_cache_used(card->ctx, fname);
+	}
+}
+
+static size_t sc_card_get_max_write_size(sc_card_t *card)
+{
+	size_t max_lc = card->max_send_size > 0 ? card->max_send_size : 255;
+
+	if (card->max_write_size > 0 && card->max_write_size < max_lc)
+		max_lc = card->max_write_size;
+	return max_lc;
+}
+
+/* Was a write refused for its length alone? Other errors mapped to
+ * SC_ERROR_INCORRECT_PARAMETERS, like an offset past the end of the EF or
+ * missing SM objects, must not be retried. */
+static int sc_card_write_too_long(sc_card_t *card, int r)
+{
+	return r == SC_ERROR_WRONG_LENGTH
+		|| (r == SC_ERROR_INCORRECT_PARAMETERS && card->last_sw == 0x6A80);
+}
+
+/* Writes 'count' bytes at 'idx' with 'write' (card->ops->write_binary or
+ * update_binary) in pieces of at most the max write size, with the card
+ * locked. When the first piece is refused for its length nothing was
+ * written yet: it is tried again in halves at the same offset until the
+ * card takes one, and that size is kept for the next writes. A later
+ * piece is never retried. */
+static int sc_card_write_pieces(sc_card_t *card, unsigned int idx,
+		const u8 *buf, size_t count, unsigned long flags,
+		int (*write)(sc_card_t *, unsigned int, const u8 *, size_t, unsigned long))
+{
+	size_t written = 0, max_lc = sc_card_get_max_write_size(card);
+	int probing = 0, r;
+
+	while (written < count) {
+		size_t n = count - written > max_lc ? max_lc : count - written;
+
+		r = write(card, idx + (unsigned int) written, buf + written, n, flags);
+		if (r < 0 && written == 0 && n / 2 >= SC_MIN_WRITE_SIZE
+				&& sc_card_write_too_long(card, r)) {
+			max_lc = n / 2;
+			probing = 1;
+			sc_log(card->ctx, "write of %lu bytes refused, trying %lu",
+					(unsigned long)n, (unsigned long)max_lc);
+			continue;
+		}
+		if (r < 0)
+			return r;
+		if (probing) {
+			card->max_write_size = max_lc;
+			sc_card_store_max_write_size(card);
+			probing = 0;
+		}
+		if (r == 0)
+			break;
+		written += r;
+	}
+	return (int) written;
+}
+
+/* Enable extended length READ BINARY etc. for the drivers that did not set
+ * max_recv_size themselves. What the card supports is cached per ATR in the
+ * file cache, what the reader supports is asked every time. */
+static void sc_card_detect_max_le(sc_card_t *card)
+{
+	struct sc_context *ctx = card->ctx;
+	struct sc_reader *reader = card->reader;
+	char fname[PATH_MAX];
+	int use_cache = 0, cached = 0;
+	size_t max_le = 0;
+	FILE *f;
+
+	if (card->max_recv_size != 0 || (card->caps & SC_CARD_CAP_NO_EXT_LE_PROBE))
+		return;
+	/* only readers that tell their buffer size, and no T=0 envelopes */
+	if (reader->max_recv_size <= 256 || reader->active_protocol != SC_PROTO_T1)
+		return;
+
+	use_cache = _sc_card_use_file_cache(ctx);
+	if (use_cache && _sc_card_cache_filename(card, "le", fname, sizeof(fname)) != SC_SUCCESS)
+		use_cache = 0;
+
+	if (use_cache)   {
+		f = fopen(fname, "r");
+		if (f)   {
+			unsigned long value;
+
+			if (fscanf(f, "%lu", &value) == 1 && value <= 65536)   {
+				max_le = value;
+				cached = 1;
+			}
+			fclose(f);
+			_sc_cache_used(ctx, fname);
+		}
+	}
+
+	if (!cached)   {
+		max_le = sc_card_get_ext_le(card);
+		if (use_cache)   {
+			f = fopen(fname, "w");
+			if (f == NULL && sc_make_cache_dir(ctx) == SC_SUCCESS)
+				f = fopen(fname, "w");
+			if (f)   {
+				fprintf(f, "%lu\n", (unsigned long)max_le);
+				fclose(f);
+				_sc_cache_used(ctx, fname);
+			}
+		}
+	}
+
+	if (max_le > reader->max_recv_size)
+		max_le = reader->max_recv_size;
+	if (max_le <= 256)
+		return;
+
+	card->caps |= SC_CARD_CAP_APDU_EXT;
+	card->max_recv_size = max_le;
+	sc_log(ctx, "extended length supported by card and reader, max_recv_size %i%s",
+			card->max_recv_size, cached ? " (cached)" : "");
+}
+
+/* The driver that took the ATR the last time, from "<cache_dir>/<ATR>.drv" */
+static struct sc_card_driver *sc_card_get_cached_driver(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	char fname[PATH_MAX];
+	char name[64];
+	FILE *f;
+	int i;
+
+	if (!ctx->use_driver_cache
+			|| _sc_card_cache_filename(card, "drv", fname, sizeof(fname)) != SC_SUCCESS)
+		return NULL;
+
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return NULL;
+	if (fscanf(f, "%63s", name) != 1)
+		name[0] = '\0';
+	fclose(f);
+	_sc_cache_used(ctx, fname);
+
+	for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		struct sc_card_driver *drv = ctx->card_drivers[i];
+
+		if (drv->ops == NULL || drv->ops->match_card == NULL)
+			continue;
+		if (!strcmp(drv->short_name, "default"))
+			continue;
+		if (!strcmp(drv->short_name, name))
+			return drv;
+	}
+	return NULL;
+}
+
+static void sc_card_set_cached_driver(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	char fname[PATH_MAX];
+	FILE *f;
+
+	/* the default driver is not enabled for every application */
+	if (!ctx->use_driver_cache || !strcmp(card->driver->short_name, "default")
+			|| _sc_card_cache_filename(card, "drv", fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+
+	f = fopen(fname, "w");
+	if (f == NULL && sc_make_cache_dir(ctx) == SC_SUCCESS)
+		f = fopen(fname, "w");
+	if (f == NULL) {
+		sc_log(ctx, "cannot write '%s'", fname);
+		return;
+	}
+	fprintf(f, "%s\n", card->driver->short_name);
+	fclose(f);
+	_sc_cache_used(ctx, fname);
+}
+
+/* A card left unreset for the next process (SC_READER_CAP_WARM_HANDOFF) is
+ * recorded in "<ATR>.hnd" with the card events count of the reader, the
+ * card type, the driver and the reader. The next process that finds the
+ * same count in the same reader takes the card over with that driver. */
+static struct sc_card_driver *sc_card_get_handoff_driver(sc_card_t *card, int *type)
+{
+	sc_context_t *ctx = card->ctx;
+	sc_reader_t *reader = card->reader;
+	char fname[PATH_MAX];
+	char name[64], reader_name[256];
+	unsigned int events;
+	FILE *f;
+	int i, n;
+
+	if (!(reader->capabilities & SC_READER_CAP_WARM_HANDOFF) || reader->card_events == 0
+			|| !ctx->use_driver_cache
+			|| _sc_card_cache_filename(card, "hnd", fname, sizeof(fname)) != SC_SUCCESS)
+		return NULL;
+
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return NULL;
+	n = fscanf(f, "%u %d %63s %255[^\n]", &events, type, name, reader_name);
+	fclose(f);
+	if (n != 4 || events != reader->card_events || strcmp(reader_name, reader->name))
+		return NULL;
+
+	for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		struct sc_card_driver *drv = ctx->card_drivers[i];
+
+		if (drv->ops != NULL && drv->ops->init != NULL && !strcmp(drv->short_name, name))
+			return drv;
+	}
+	return NULL;
+}
+
+static void sc_card_set_handoff(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	sc_reader_t *reader = card->reader;
+	char fname[PATH_MAX];
+	FILE *f;
+
+	if (!(reader->capabilities & SC_READER_CAP_WARM_HANDOFF) || reader->card_events == 0
+			|| !ctx->use_driver_cache || card->driver == NULL
+			|| !strcmp(card->driver->short_name, "default")
+			|| _sc_card_cache_filename(card, "hnd", fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+
+	f = fopen(fname, "w");
+	if (f == NULL && sc_make_cache_dir(ctx) == SC_SUCCESS)
+		f = fopen(fname, "w");
+	if (f == NULL) {
+		sc_log(ctx, "cannot write '%s'", fname);
+		return;
+	}
+	fprintf(f, "%u %d %s %s\n", reader->card_events, card->type,
+			card->driver->short_name, reader->name);
+	fclose(f);
+	_sc_cache_used(ctx, fname);
+}
+
+/* Calls match_card() of a driver and logs how many APDUs it took */
+static int sc_card_probe_driver(sc_card_t *card, struct sc_card_driver *drv)
+{
+	struct sc_reader *reader = card->reader;
+	unsigned long count = 0;
+	unsigned long long time_us = 0;
+	int r;
+
+	if (reader->stats) {
+		count = reader->stats->total.count;
+		time_us = reader->stats->total.time_us;
+	}
+
+	/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
+	*card->ops = *drv->ops;
+	r = drv->ops->match_card(card);
+
+	if (reader->stats && reader->stats->total.count != count)
+		sc_log(card->ctx, "driver '%s' probe cost: %lu APDUs, %llu us",
+				drv->short_name, reader->stats->total.count - count,
+				reader->stats->total.time_us - time_us);
+	return r;
+}
+
 int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 {
 	sc_card_t *card;
 	sc_context_t *ctx;
 	struct sc_card_driver *driver;
-	int i, r = 0, idx, connected = 0;
+	int i, r = 0, idx, connected = 0, matching = 0;
 
 	if (card_out == NULL || reader == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -126,10 +542,25 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	if (reader->ops->connect == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 
+	if (ctx->flags & SC_CTX_FLAG_SHARED) {
+		sc_mutex_lock(ctx, ctx->mutex);
+		card = reader->shared_card;
+		if (card != NULL)
+			card->shared_refs++;
+		sc_mutex_unlock(ctx, ctx->mutex);
+		if (card != NULL) {
+			sc_log(ctx, "sharing card in reader '%s'", reader->name);
+			*card_out = card;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+	}
+
 	card = sc_card_new(ctx);
 	if (card == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	SC_TRACE_BEGIN(ctx, "reader connect", 0);
 	r = reader->ops->connect(reader);
+	SC_TRACE_END(ctx, "reader connect", r);
 	if (r)
 		goto err;
 
@@ -138,9 +569,14 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	card->ctx = ctx;
 
 	memcpy(&card->atr, &reader->atr, sizeof(card->atr));
+	_sc_apdu_trace_atr(reader);
 
 	_sc_parse_atr(reader);
 
+	/* up to the init() of the driver taking the card */
+	SC_TRACE_BEGIN(ctx, "driver match", 0);
+	matching = 1;
+
 	/* See if the ATR matches any ATR specified in the config file */
 	if ((driver = ctx->forced_driver) == NULL) {
 		sc_log(ctx, "matching configured ATRs");
@@ -158,6 +594,12 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 				struct sc_atr_table *src = &driver->atr_map[idx];
 
 				sc_log(ctx, "matched driver '%s'", driver->name);
+				if (driver->ops == NULL) {
+					driver = _sc_load_lazy_driver(ctx, i);
+					if (driver == NULL)
+						continue;
+					src = &driver->atr_map[idx];
+				}
 				/* It's up to card driver to notice these correctly */
 				card->name = src->name;
 				card->type = src->type;
@@ -182,37 +624,77 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 		}
 	}
 	else {
-		sc_log(ctx, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			struct sc_card_driver *drv = ctx->card_drivers[i];
-			const struct sc_card_operations *ops = drv->ops;
-
-			sc_log(ctx, "trying driver '%s'", drv->short_name);
-			if (ops == NULL || ops->match_card == NULL)   {
-				continue;
-			}
-			else if (!ctx->enable_default_driver && !strcmp("default", drv->short_name))   {
-				sc_log(ctx , "ignore 'default' card driver");
-				continue;
+		int type;
+
+		/* A card handed over by our last process keeps its driver */
+		driver = sc_card_get_handoff_driver(card, &type);
+		if (driver != NULL) {
+			sc_log(ctx, "card handed over to driver '%s'", driver->short_name);
+			card->driver = driver;
+			card->type = type;
+			card->flags |= SC_CARD_FLAG_HANDED_OVER;
+			memcpy(card->ops, driver->ops, sizeof(struct sc_card_operations));
+			r = driver->ops->init(card);
+			if (r) {
+				sc_log(ctx, "driver '%s' init() failed: %s", driver->name, sc_strerror(r));
+				if (r != SC_ERROR_INVALID_CARD)
+					goto err;
+				card->driver = NULL;
+				card->type = 0;
+				card->flags &= ~SC_CARD_FLAG_HANDED_OVER;
 			}
+		}
 
-			/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
-			*card->ops = *ops;
-			if (ops->match_card(card) != 1)
-				continue;
-			sc_log(ctx, "matched: %s", drv->name);
-			memcpy(card->ops, ops, sizeof(struct sc_card_operations));
-			card->driver = drv;
-			r = ops->init(card);
-			if (r) {
-				sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
-				if (r == SC_ERROR_INVALID_CARD) {
+		/* Try the driver that took this ATR the last time first */
+		driver = card->driver == NULL ? sc_card_get_cached_driver(card) : NULL;
+		if (driver != NULL) {
+			sc_log(ctx, "trying cached driver '%s'", driver->short_name);
+			if (sc_card_probe_driver(card, driver) == 1) {
+				sc_log(ctx, "matched: %s", driver->name);
+				card->driver = driver;
+				r = driver->ops->init(card);
+				if (r) {
+					sc_log(ctx, "driver '%s' init() failed: %s", driver->name, sc_strerror(r));
+					if (r != SC_ERROR_INVALID_CARD)
+						goto err;
 					card->driver = NULL;
+				}
+			}
+		}
+
+		if (card->driver == NULL) {
+			sc_log(ctx, "matching built-in ATRs");
+			for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+				struct sc_card_driver *drv = ctx->card_drivers[i];
+				const struct sc_card_operations *ops = drv->ops;
+
+				sc_log(ctx, "trying driver '%s'", drv->short_name);
+				if (ops == NULL || ops->match_card == NULL)   {
 					continue;
 				}
-				goto err;
+				else if (!ctx->enable_default_driver && !strcmp("default", drv->short_name))   {
+					sc_log(ctx , "ignore 'default' card driver");
+					continue;
+				}
+
+				if (sc_card_probe_driver(card, drv) != 1)
+					continue;
+				sc_log(ctx, "matched: %s", drv->name);
+				memcpy(card->ops, ops, sizeof(struct sc_card_operations));
+				card->driver = drv;
+				r = ops->init(card);
+				if (r) {
+					sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
+					if (r == SC_ERROR_INVALID_CARD) {
+						card->driver = NULL;
+						continue;
+					}
+					goto err;
+				}
+				break;
 			}
-			break;
+			if (card->driver != NULL)
+				sc_card_set_cached_driver(card);
 		}
 	}
 	if (card->driver == NULL) {
@@ -220,6 +702,8 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 		r = SC_ERROR_INVALID_CARD;
 		goto err;
 	}
+	SC_TRACE_END(ctx, "driver match", SC_SUCCESS);
+	matching = 0;
 	if (card->name == NULL)
 		card->name = card->driver->name;
 	*card_out = card;
@@ -235,6 +719,9 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
            ((reader->driver->max_send_size != 0) && (reader->driver->max_send_size < card->max_send_size)))
                 card->max_send_size = reader->driver->max_send_size;
 
+	sc_card_detect_max_le(card);
+	sc_card_load_max_write_size(card);
+
 	sc_log(ctx, "card info name:'%s', type:%i, flags:0x%X, max_send/recv_size:%i/%i",
 		card->name, card->type, card->flags, card->max_send_size, card->max_recv_size);
 
@@ -247,8 +734,18 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	}
 #endif
 
+	if (ctx->flags & SC_CTX_FLAG_SHARED) {
+		sc_mutex_lock(ctx, ctx->mutex);
+		card->shared_refs = 1;
+		if (reader->shared_card == NULL)
+			reader->shared_card = card;
+		sc_mutex_unlock(ctx, ctx->mutex);
+	}
+
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 err:
+	if (matching)
+		SC_TRACE_END(ctx, "driver match", r);
 	if (connected)
 		reader->ops->disconnect(reader);
 	if (card != NULL)
@@ -266,7 +763,23 @@ int sc_disconnect_card(sc_card_t *card)
 	ctx = card->ctx;
 	LOG_FUNC_CALLED(ctx);
 
+	if (ctx->flags & SC_CTX_FLAG_SHARED) {
+		int in_use;
+
+		sc_mutex_lock(ctx, ctx->mutex);
+		in_use = card->shared_refs > 1;
+		if (in_use)
+			card->shared_refs--;
+		else if (card->reader->shared_card == card)
+			card->reader->shared_card = NULL;
+		sc_mutex_unlock(ctx, ctx->mutex);
+		if (in_use)
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
 	assert(card->lock_count == 0);
+	sc_card_finish_reads(card);
+	sc_card_set_handoff(card);
 	if (card->ops->finish) {
 		int r = card->ops->finish(card);
 		if (r)
@@ -282,6 +795,7 @@ int sc_disconnect_card(sc_card_t *card)
 #ifdef ENABLE_SM
 	/* release SM related resources */
 	sc_card_sm_unload(card);
+	free(card->sm_ctx.apdu_buffer);
 #endif
 
 	sc_card_free(card);
@@ -302,9 +816,7 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 		return r;
 
 	r = card->reader->ops->reset(card->reader, do_cold_reset);
-	/* invalidate cache */
-	memset(&card->cache, 0, sizeof(card->cache));
-	card->cache.valid = 0;
+	sc_invalidate_cache(card);
 
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -318,27 +830,36 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 int sc_lock(sc_card_t *card)
 {
 	int r = 0, r2 = 0;
+	int reader_lock_obtained = 0, was_reset = 0;
 
 	if (card == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	LOG_FUNC_CALLED(card->ctx);
 
+	/* The span shows the wait for the other threads and processes */
+	SC_TRACE_BEGIN(card->ctx, "lock", card->lock_count);
 	r = sc_mutex_lock(card->ctx, card->mutex);
-	if (r != SC_SUCCESS)
+	if (r != SC_SUCCESS) {
+		SC_TRACE_END(card->ctx, "lock", r);
 		return r;
+	}
 	if (card->lock_count == 0) {
-		if (card->reader->ops->lock != NULL) {
+		if (_sc_reader_quarantined(card->reader)) {
+			sc_log(card->ctx, "reader '%s' is quarantined", card->reader->name);
+			r = SC_ERROR_CARD_UNRESPONSIVE;
+		} else if (card->reader->ops->lock != NULL) {
 			r = card->reader->ops->lock(card->reader);
 			if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
-				/* invalidate cache */
-				memset(&card->cache, 0, sizeof(card->cache));
-				card->cache.valid = 0;
+				sc_invalidate_cache(card);
+				was_reset = 1;
 				r = card->reader->ops->lock(card->reader);
 			}
 		}
-		if (r == 0)
+		if (r == 0) {
 			card->cache.valid = 1;
+			reader_lock_obtained = 1;
+		}
 	}
 	if (r == 0)
 		card->lock_count++;
@@ -348,6 +869,25 @@ int sc_lock(sc_card_t *card)
 		r = r != SC_SUCCESS ? r : r2;
 	}
 
+	/* The card may have lost its state to someone else meanwhile:
+	 * let the driver restore what it needs. The card lock is already
+	 * held, so the driver can send APDUs. */
+	if (r == 0 && was_reset) {
+		sc_log(card->ctx, "card was reset, restoring the session");
+#ifdef ENABLE_SM
+		if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT && card->sm_ctx.ops.open) {
+			r = card->sm_ctx.ops.open(card);
+			if (r != SC_SUCCESS)
+				sc_log(card->ctx, "cannot reopen SM session: %s", sc_strerror(r));
+		}
+#endif
+	}
+	if (r == 0 && reader_lock_obtained && card->ops->card_reader_lock_obtained != NULL)
+		r = card->ops->card_reader_lock_obtained(card, was_reset);
+	if (r != 0 && reader_lock_obtained)
+		sc_unlock(card);
+
+	SC_TRACE_END(card->ctx, "lock", r);
 	return r;
 }
 
@@ -360,6 +900,9 @@ int sc_unlock(sc_card_t *card)
 
 	LOG_FUNC_CALLED(card->ctx);
 
+	if (card->lock_count == 1 && card->pending_reads != NULL)
+		sc_complete_reads(card);
+
 	r = sc_mutex_lock(card->ctx, card->mutex);
 	if (r != SC_SUCCESS)
 		return r;
@@ -367,10 +910,12 @@ int sc_unlock(sc_card_t *card)
 	assert(card->lock_count >= 1);
 	if (--card->lock_count == 0) {
 #ifdef INVALIDATE_CARD_CACHE_IN_UNLOCK
-		/* invalidate cache */
-		memset(&card->cache, 0, sizeof(card->cache));
-		card->cache.valid = 0;
+		sc_invalidate_cache(card);
 		sc_log(card->ctx, "cache invalidated");
+#else
+		/* others can select and change files until the next lock */
+		sc_invalidate_select_cache(card);
+		sc_invalidate_fci_cache(card, NULL);
 #endif
 		/* release reader lock */
 		if (card->reader->ops->unlock != NULL)
@@ -420,7 +965,10 @@ int sc_create_file(sc_card_t *card, sc_file_t *file)
 	if (card->ops->create_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 
+	sc_card_finish_reads(card);
 	r = card->ops->create_file(card, file);
+	/* the parent DF has changed too */
+	sc_invalidate_fci_cache(card, NULL);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -438,7 +986,9 @@ int sc_delete_file(sc_card_t *card, const sc_path_t *path)
 	sc_log(card->ctx, "called; type=%d, path=%s", path->type, pbuf);
 	if (card->ops->delete_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	sc_card_finish_reads(card);
 	r = card->ops->delete_file(card, path);
+	sc_invalidate_fci_cache(card, NULL);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
@@ -470,9 +1020,10 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 
 		r = sc_lock(card);
 		LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+		/* the SM hook has already declined the whole range */
 		while (count > 0) {
 			size_t n = count > max_le ? max_le : count;
-			r = sc_read_binary(card, idx, p, n, flags);
+			r = card->ops->read_binary(card, idx, p, n, flags);
 			if (r < 0) {
 				sc_unlock(card);
 				LOG_TEST_RET(card->ctx, r, "sc_read_binary() failed");
@@ -493,57 +1044,190 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+static int sc_async_read_job(void *arg)
+{
+	struct sc_async_read *job = arg;
+
+	return sc_read_binary(job->card, job->idx, job->buf, job->count, 0);
+}
+
+static void sc_async_read_done(void *arg, int r)
+{
+	struct sc_async_read *job = arg;
+
+	job->cb(job->card, job->idx, r < 0 ? NULL : job->buf, r, job->userdata);
+	free(job->buf);
+	free(job);
+}
+
+int sc_read_binary_async(sc_card_t *card, unsigned int idx, size_t count,
+		sc_read_binary_cb_t cb, void *userdata)
+{
+	struct sc_pending_read *req, **pp;
+
+	if (card == NULL || cb == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(card->ctx);
+
+	if (card->lock_count == 0) {
+		/* the current file may change before the next lock: the read is
+		 * sent to the worker of the reader, or done at once */
+		struct sc_async_read *job = calloc(1, sizeof(*job));
+		u8 *buf = malloc(count ? count : 1);
+		int r;
+
+		if (job == NULL || buf == NULL) {
+			free(job);
+			free(buf);
+			LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+		}
+		job->card = card;
+		job->idx = idx;
+		job->count = count;
+		job->cb = cb;
+		job->userdata = userdata;
+		job->buf = buf;
+		r = _sc_reader_worker_submit(card->reader, sc_async_read_job,
+				sc_async_read_done, job);
+		if (r == SC_SUCCESS) {
+			card->async_reads = 1;
+			LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+		}
+		sc_async_read_done(job, sc_async_read_job(job));
+		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+	}
+
+	req = calloc(1, sizeof(*req));
+	if (req == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+	req->idx = idx;
+	req->count = count;
+	req->cb = cb;
+	req->userdata = userdata;
+
+	/* keep the queue sorted by index */
+	for (pp = &card->pending_reads; *pp != NULL && (*pp)->idx <= idx; pp = &(*pp)->next)
+		;
+	req->next = *pp;
+	*pp = req;
+
+	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+}
+
+/* Reads the range covered by the list 'reqs' at once and hands everyone
+ * their part. Returns the result of the read. */
+static int sc_complete_read_range(sc_card_t *card, struct sc_pending_read *reqs,
+		unsigned int start, size_t len)
+{
+	struct sc_pending_read *req;
+	u8 *buf;
+	int r;
+
+	buf = malloc(len ? len : 1);
+	if (buf == NULL)
+		r = SC_ERROR_OUT_OF_MEMORY;
+	else
+		r = sc_read_binary(card, start, buf, len, 0);
+
+	if (r < 0 && reqs->next != NULL) {
+		/* one of the merged reads may go past the end of the file */
+		free(buf);
+		for (req = reqs; req != NULL; req = req->next) {
+			struct sc_pending_read *next = req->next;
+
+			req->next = NULL;
+			sc_complete_read_range(card, req, req->idx, req->count);
+			req->next = next;
+		}
+		return r;
+	}
+
+	for (req = reqs; req != NULL; req = req->next) {
+		size_t off = req->idx - start, n = 0;
+
+		if (r < 0) {
+			req->cb(card, req->idx, NULL, r, req->userdata);
+			continue;
+		}
+		if ((size_t)r > off)
+			n = MIN(req->count, (size_t)r - off);
+		req->cb(card, req->idx, buf + MIN(off, (size_t)r), (int)n, req->userdata);
+	}
+	free(buf);
+	return r;
+}
+
+int sc_complete_reads(sc_card_t *card)
+{
+	int r = SC_SUCCESS;
+
+	if (card == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(card->ctx);
+
+	/* the callbacks of the reads sent to the worker of the reader run in
+	 * that thread: they cannot wait for the reads behind them */
+	if (card->async_reads && _sc_reader_worker_wait(card->reader) == SC_SUCCESS)
+		card->async_reads = 0;
+
+	/* callbacks may queue more reads */
+	while (card->pending_reads != NULL) {
+		struct sc_pending_read *first = card->pending_reads, *last, *req;
+		unsigned int start = first->idx;
+		size_t end = first->idx + first->count;
+		int rv;
+
+		/* merge the reads that overlap or touch */
+		for (last = first; last->next != NULL && last->next->idx <= end; last = last->next)
+			if (last->next->idx + last->next->count > end)
+				end = last->next->idx + last->next->count;
+		card->pending_reads = last->next;
+		last->next = NULL;
+
+		if (first->next != NULL)
+			sc_log(card->ctx, "merged reads of %lu bytes at index %u",
+					(unsigned long)(end - start), start);
+		rv = sc_complete_read_range(card, first, start, end - start);
+		while (first != NULL) {
+			req = first;
+			first = first->next;
+			free(req);
+		}
+		if (rv < 0 && r == SC_SUCCESS)
+			r = rv;
+	}
+
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
 int sc_write_binary(sc_card_t *card, unsigned int idx,
 		    const u8 *buf, size_t count, unsigned long flags)
 {
-	size_t max_lc = card->max_send_size > 0 ? card->max_send_size : 255;
 	int r;
 
 	assert(card != NULL && card->ops != NULL && buf != NULL);
 	sc_log(card->ctx, "called; %d bytes at index %d", count, idx);
+	sc_card_finish_reads(card);
 	if (count == 0)
 		LOG_FUNC_RETURN(card->ctx, 0);
 	if (card->ops->write_binary == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 
-	if (count > max_lc) {
-		int bytes_written = 0;
-		const u8 *p = buf;
-
-		r = sc_lock(card);
-		LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
-		while (count > 0) {
-			size_t n = count > max_lc? max_lc : count;
-			r = sc_write_binary(card, idx, p, n, flags);
-			if (r < 0) {
-				sc_unlock(card);
-				LOG_TEST_RET(card->ctx, r, "sc_write_binary() failed");
-			}
-			p += r;
-			idx += r;
-			bytes_written += r;
-			count -= r;
-			if (r == 0) {
-				sc_unlock(card);
-				LOG_FUNC_RETURN(card->ctx, bytes_written);
-			}
-		}
-		sc_unlock(card);
-		LOG_FUNC_RETURN(card->ctx, bytes_written);
-	}
-
-	r = card->ops->write_binary(card, idx, buf, count, flags);
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+	r = sc_card_write_pieces(card, idx, buf, count, flags, card->ops->write_binary);
+	sc_unlock(card);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
 int sc_update_binary(sc_card_t *card, unsigned int idx,
 		     const u8 *buf, size_t count, unsigned long flags)
 {
-	size_t max_lc = card->max_send_size > 0 ? card->max_send_size : 255;
 	int r;
 
 	assert(card != NULL && card->ops != NULL && buf != NULL);
 	sc_log(card->ctx, "called; %d bytes at index %d", count, idx);
+	sc_card_finish_reads(card);
 	if (count == 0)
 		return 0;
 
@@ -558,33 +1242,10 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 	if (card->ops->update_binary == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 
-	if (count > max_lc) {
-		int bytes_written = 0;
-		const u8 *p = buf;
-
-		r = sc_lock(card);
-		LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
-		while (count > 0) {
-			size_t n = count > max_lc? max_lc : count;
-			r = sc_update_binary(card, idx, p, n, flags);
-			if (r < 0) {
-				sc_unlock(card);
-				LOG_TEST_RET(card->ctx, r, "sc_update_binary() failed");
-			}
-			p += r;
-			idx += r;
-			bytes_written += r;
-			count -= r;
-			if (r == 0) {
-				sc_unlock(card);
-				LOG_FUNC_RETURN(card->ctx, bytes_written);
-			}
-		}
-		sc_unlock(card);
-		LOG_FUNC_RETURN(card->ctx, bytes_written);
-	}
-
-	r = card->ops->update_binary(card, idx, buf, count, flags);
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+	r = sc_card_write_pieces(card, idx, buf, count, flags, card->ops->update_binary);
+	sc_unlock(card);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -595,6 +1256,7 @@ int sc_erase_binary(struct sc_card *card, unsigned int offs, size_t count,  unsi
 
 	assert(card != NULL && card->ops != NULL);
 	sc_log(card->ctx, "called; erase %d bytes from offset %d", count, offs);
+	sc_card_finish_reads(card);
 
 	if (card->ops->erase_binary == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
@@ -604,10 +1266,131 @@ int sc_erase_binary(struct sc_card *card, unsigned int offs, size_t count,  unsi
 }
 
 
+static int sc_select_cache_match(const sc_path_t *cached, const sc_path_t *path)
+{
+	return cached->type == path->type
+		&& sc_compare_path(cached, path)
+		&& cached->aid.len == path->aid.len
+		&& !memcmp(cached->aid.value, path->aid.value, path->aid.len);
+}
+
+static int sc_fci_cache_usable(sc_card_t *card, const sc_path_t *path)
+{
+	return !(card->caps & SC_CARD_CAP_NO_SELECT_CACHE)
+		&& (path->type == SC_PATH_TYPE_PATH || path->type == SC_PATH_TYPE_DF_NAME);
+}
+
+static size_t sc_fci_cache_size(const struct sc_file *fci)
+{
+	return sizeof(*fci) + fci->sec_attr_len + fci->prop_attr_len
+		+ fci->type_attr_len + fci->encoded_content_len;
+}
+
+static void sc_fci_cache_drop(sc_card_t *card, size_t i, int evicted)
+{
+	struct sc_file *fci = card->cache.fci[i];
+
+	if (fci == NULL)
+		return;
+	if (evicted)
+		_sc_memcache_evicted(card->ctx, &card->cache.fci_account, sc_fci_cache_size(fci));
+	else
+		_sc_memcache_add(card->ctx, &card->cache.fci_account, -(long) sc_fci_cache_size(fci), -1);
+	sc_file_free(fci);
+	card->cache.fci[i] = NULL;
+}
+
+/* Drops the oldest entries while cache_memory_max_size asks for it */
+static void sc_fci_cache_trim(sc_card_t *card)
+{
+	size_t n;
+
+	for (n = 0; n < SC_CARD_FCI_CACHE_SIZE; n++) {
+		if (_sc_memcache_trim(card->ctx, &card->cache.fci_account) == 0)
+			return;
+		sc_fci_cache_drop(card, (card->cache.fci_next + n) % SC_CARD_FCI_CACHE_SIZE, 1);
+	}
+}
+
+static struct sc_file *sc_fci_cache_find(sc_card_t *card, const sc_path_t *path)
+{
+	size_t i;
+
+	for (i = 0; i < SC_CARD_FCI_CACHE_SIZE; i++) {
+		struct sc_file *fci = card->cache.fci[i];
+
+		if (fci != NULL && sc_select_cache_match(&fci->path, path))
+			return fci;
+	}
+	return NULL;
+}
+
+static struct sc_file *sc_fci_cache_lookup(sc_card_t *card, const sc_path_t *path)
+{
+	struct sc_file *fci = sc_fci_cache_find(card, path);
+
+	_sc_memcache_lookup(card->ctx, &card->cache.fci_account, fci != NULL);
+	return fci;
+}
+
+static void sc_fci_cache_store(sc_card_t *card, const struct sc_file *file)
+{
+	struct sc_file *fci = NULL;
+	size_t i;
+
+	sc_invalidate_fci_cache(card, &file->path);
+	sc_file_dup(&fci, file);
+	if (fci == NULL)
+		return;
+
+	/* overwrite the oldest entry once the cache is full */
+	i = card->cache.fci_next;
+	sc_fci_cache_drop(card, i, 0);
+	card->cache.fci[i] = fci;
+	card->cache.fci_next = (i + 1) % SC_CARD_FCI_CACHE_SIZE;
+	_sc_memcache_add(card->ctx, &card->cache.fci_account, (long) sc_fci_cache_size(fci), 1);
+	sc_fci_cache_trim(card);
+}
+
+void sc_invalidate_fci_cache(sc_card_t *card, const sc_path_t *path)
+{
+	size_t i;
+
+	if (card == NULL)
+		return;
+	for (i = 0; i < SC_CARD_FCI_CACHE_SIZE; i++) {
+		struct sc_file *fci = card->cache.fci[i];
+
+		if (fci != NULL && (path == NULL || sc_select_cache_match(&fci->path, path)))
+			sc_fci_cache_drop(card, i, 0);
+	}
+}
+
+/* Is 'path' a direct child of the selected DF, and can the card driver
+ * select it by file ID? Only the ISO 7816 SELECT is known to handle that. */
+static int sc_select_cache_is_child(sc_card_t *card, const sc_path_t *path)
+{
+	const sc_path_t *cached = &card->cache.selected_path;
+	const struct sc_file *df;
+
+	if (!card->cache.selected)
+		return 0;
+	df = sc_fci_cache_find(card, cached);
+	if (df == NULL || df->type != SC_FILE_TYPE_DF)
+		return 0;
+	if (card->ops->select_file != sc_get_iso7816_driver()->ops->select_file)
+		return 0;
+	if (path->type != SC_PATH_TYPE_PATH || cached->type != SC_PATH_TYPE_PATH
+			|| path->aid.len || cached->aid.len)
+		return 0;
+	return path->len == cached->len + 2 && !memcmp(path->value, cached->value, cached->len);
+}
+
 int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 {
-	int r;
+	int r, use_cache, use_fci;
 	char pbuf[SC_MAX_PATH_STRING_SIZE];
+	const struct sc_file *fci = NULL;
 
 	assert(card != NULL && in_path != NULL);
 
@@ -636,12 +1419,93 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 	}
 	if (card->ops->select_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
-	r = card->ops->select_file(card, in_path, file);
-	LOG_TEST_RET(card->ctx, r, "'SELECT' error");
+
+	/* queued reads are for the current file */
+	sc_card_finish_reads(card);
+
+	use_fci = sc_fci_cache_usable(card, in_path);
+	use_cache = use_fci && card->lock_count > 0;
+	if (use_fci)
+		sc_fci_cache_trim(card);
+	if (use_fci && file)
+		fci = sc_fci_cache_lookup(card, in_path);
+
+	if (use_cache && card->cache.selected && sc_select_cache_match(&card->cache.selected_path, in_path)
+			&& (file == NULL || fci != NULL)) {
+		sc_log(card->ctx, "already selected");
+		r = SC_SUCCESS;
+	}
+	else if (use_cache && sc_select_cache_is_child(card, in_path)) {
+		/* the parent DF is the current one: select by file ID only */
+		sc_path_t fid;
+
+		memset(&fid, 0, sizeof(fid));
+		fid.type = SC_PATH_TYPE_FILE_ID;
+		fid.len = 2;
+		memcpy(fid.value, in_path->value + in_path->len - 2, 2);
+		fid.index = in_path->index;
+		fid.count = in_path->count;
+		r = card->ops->select_file(card, &fid, fci ? NULL : file);
+		LOG_TEST_RET(card->ctx, r, "'SELECT' error");
+	}
+	else if (fci != NULL && card->ops->select_file == sc_get_iso7816_driver()->ops->select_file) {
+		/* the FCI is known: do not ask the card for it again */
+		sc_log(card->ctx, "using cached FCI");
+		r = card->ops->select_file(card, in_path, NULL);
+		LOG_TEST_RET(card->ctx, r, "'SELECT' error");
+	}
+	else {
+		fci = NULL;
+		r = card->ops->select_file(card, in_path, file);
+		LOG_TEST_RET(card->ctx, r, "'SELECT' error");
+	}
+
+	if (file && fci) {
+		sc_file_dup(file, fci);
+		if (*file == NULL)
+			LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+	}
 
 	/* Remember file path */
-	if (file && *file)
+	if (file && *file) {
 		(*file)->path = *in_path;
+		if (use_fci && fci == NULL)
+			sc_fci_cache_store(card, *file);
+	}
+
+	if (use_cache) {
+		sc_invalidate_select_cache(card);
+		card->cache.selected_path = *in_path;
+		card->cache.selected = 1;
+	}
+	else {
+		card->cache.sec_env_serial++;
+	}
+
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
+int sc_get_file_info(sc_card_t *card, const sc_path_t *path, sc_file_t **file)
+{
+	const struct sc_file *fci = NULL;
+	int r;
+
+	if (card == NULL || path == NULL || file == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(card->ctx);
+
+	/* the cached FCIs are only kept while the card is locked */
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+	if (sc_fci_cache_usable(card, path))
+		fci = sc_fci_cache_lookup(card, path);
+	if (fci != NULL) {
+		sc_file_dup(file, fci);
+		r = *file == NULL ? SC_ERROR_OUT_OF_MEMORY : SC_SUCCESS;
+	} else {
+		r = sc_select_file(card, path, file);
+	}
+	sc_unlock(card);
 
 	LOG_FUNC_RETURN(card->ctx, r);
 }
@@ -701,6 +1565,56 @@ int sc_read_record(sc_card_t *card, unsigned int rec_nr, u8 *buf,
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+int sc_read_records(sc_card_t *card, unsigned int rec_nr, u8 *buf,
+		   size_t count, unsigned long flags,
+		   size_t *lengths, size_t *nrecords)
+{
+	size_t max_le = card->max_recv_size > 0 ? card->max_recv_size : 256;
+	size_t done = 0, n = 0, max_records;
+	int r;
+
+	assert(card != NULL && buf != NULL && lengths != NULL && nrecords != NULL);
+	LOG_FUNC_CALLED(card->ctx);
+
+	max_records = *nrecords;
+	*nrecords = 0;
+	if (rec_nr == 0)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+	flags |= SC_RECORD_BY_REC_NR;
+
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+
+	if (card->ops->read_records != NULL) {
+		*nrecords = max_records;
+		r = card->ops->read_records(card, rec_nr, buf, count, flags, lengths, nrecords);
+		if (r != SC_ERROR_NOT_SUPPORTED) {
+			sc_unlock(card);
+			LOG_FUNC_RETURN(card->ctx, r);
+		}
+		*nrecords = 0;
+	}
+
+	/* one record per command */
+	for (; done < count && n < max_records; rec_nr++) {
+		size_t todo = MIN(count - done, max_le);
+
+		r = sc_read_record(card, rec_nr, buf + done, todo, flags);
+		if (r == SC_ERROR_RECORD_NOT_FOUND || r == 0)
+			break;
+		if (r < 0) {
+			sc_unlock(card);
+			LOG_FUNC_RETURN(card->ctx, r);
+		}
+		lengths[n++] = r;
+		done += r;
+	}
+	*nrecords = n;
+	sc_unlock(card);
+
+	LOG_FUNC_RETURN(card->ctx, (int)done);
+}
+
 int sc_write_record(sc_card_t *card, unsigned int rec_nr, const u8 * buf,
 		    size_t count, unsigned long flags)
 {
@@ -862,65 +1776,167 @@ sc_algorithm_info_t * sc_card_find_gostr3410_alg(sc_card_t *card,
 	return sc_card_find_alg(card, SC_ALGORITHM_GOSTR3410, key_length);
 }
 
+/* An ATR table entry converted to binary. 'atr' and 'atrmask' are the
+ * strings it was made from, to notice when the table has changed. */
+struct sc_atr_compiled_entry {
+	const char *atr;
+	const char *atrmask;
+	size_t len;
+	u8 value[SC_MAX_ATR_SIZE];
+	u8 mask[SC_MAX_ATR_SIZE];
+};
+
+struct sc_atr_compiled {
+	const struct sc_atr_table *table;
+	size_t count;
+	struct sc_atr_compiled_entry *entries;
+	struct sc_atr_compiled *next;
+};
+
+static void compile_atr_entry(sc_context_t *ctx, const struct sc_atr_table *src,
+		struct sc_atr_compiled_entry *dst)
+{
+	size_t atr_len = strlen(src->atr);
+	size_t len, mask_len;
+
+	memset(dst, 0, sizeof(*dst));
+	dst->atr = src->atr;
+	dst->atrmask = src->atrmask;
+
+	/* only "xx:xx:..." ATRs have ever matched */
+	len = sizeof(dst->value);
+	if (sc_hex_to_bin(src->atr, dst->value, &len) != SC_SUCCESS
+			|| len == 0 || atr_len != 3 * len - 1)
+		return;
+
+	if (src->atrmask != NULL) {
+		mask_len = sizeof(dst->mask);
+		if (strlen(src->atrmask) != atr_len
+				|| sc_hex_to_bin(src->atrmask, dst->mask, &mask_len) != SC_SUCCESS
+				|| mask_len != len) {
+			sc_log(ctx, "length of atr and atr mask do not match - ignored: %s - %s",
+					src->atr, src->atrmask);
+			return;
+		}
+	}
+	else {
+		memset(dst->mask, 0xFF, len);
+	}
+	dst->len = len;
+}
+
+static int compiled_atrs_valid(const struct sc_atr_compiled *c, const struct sc_atr_table *table)
+{
+	size_t i;
+
+	for (i = 0; i < c->count; i++)
+		if (table[i].atr != c->entries[i].atr || table[i].atrmask != c->entries[i].atrmask)
+			return 0;
+	return table[i].atr == NULL;
+}
+
+static void free_compiled_atrs(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_compiled **pc = &ctx->compiled_atrs;
+
+	while (*pc != NULL) {
+		struct sc_atr_compiled *c = *pc;
+
+		if (table == NULL || c->table == table) {
+			*pc = c->next;
+			free(c->entries);
+			free(c);
+		}
+		else {
+			pc = &c->next;
+		}
+	}
+}
+
+void _sc_free_compiled_atrs(sc_context_t *ctx)
+{
+	free_compiled_atrs(ctx, NULL);
+}
+
+/* Returns the binary form of 'table' if it is up to date, NULL otherwise */
+static struct sc_atr_compiled *find_compiled_atrs(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_compiled *c;
+
+	for (c = ctx->compiled_atrs; c != NULL; c = c->next)
+		if (c->table == table)
+			break;
+	if (c != NULL && compiled_atrs_valid(c, table))
+		return c;
+	return NULL;
+}
+
+/* Returns the binary form of 'table', converting it on first use */
+static struct sc_atr_compiled *get_compiled_atrs(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_compiled *c;
+	size_t i, count;
+
+	c = find_compiled_atrs(ctx, table);
+	if (c != NULL)
+		return c;
+	free_compiled_atrs(ctx, table);
+
+	for (count = 0; table[count].atr != NULL; count++)
+		;
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	c->entries = calloc(count ? count : 1, sizeof(*c->entries));
+	if (c->entries == NULL) {
+		free(c);
+		return NULL;
+	}
+	for (i = 0; i < count; i++)
+		compile_atr_entry(ctx, &table[i], &c->entries[i]);
+	c->table = table;
+	c->count = count;
+	c->next = ctx->compiled_atrs;
+	ctx->compiled_atrs = c;
+	return c;
+}
+
 static int match_atr_table(sc_context_t *ctx, struct sc_atr_table *table, struct sc_atr *atr)
 {
-	u8 *card_atr_bin = atr->value;
-	size_t card_atr_bin_len = atr->len;
-	char card_atr_hex[3 * SC_MAX_ATR_SIZE];
-	size_t card_atr_hex_len;
-	unsigned int i = 0;
+	struct sc_atr_compiled *c;
+	size_t i, s;
+	int res = -1, exclusive = 0;
 
 	if (ctx == NULL || table == NULL || atr == NULL)
 		return -1;
-	sc_bin_to_hex(card_atr_bin, card_atr_bin_len, card_atr_hex, sizeof(card_atr_hex), ':');
-	card_atr_hex_len = strlen(card_atr_hex);
-
-	sc_log(ctx, "ATR     : %s", card_atr_hex);
 
-	for (i = 0; table[i].atr != NULL; i++) {
-		const char *tatr = table[i].atr;
-		const char *matr = table[i].atrmask;
-		size_t tatr_len = strlen(tatr);
-		u8 mbin[SC_MAX_ATR_SIZE], tbin[SC_MAX_ATR_SIZE];
-		size_t mbin_len, tbin_len, s, matr_len;
-		size_t fix_hex_len = card_atr_hex_len;
-		size_t fix_bin_len = card_atr_bin_len;
+	sc_log(ctx, "ATR     : %s", sc_dump_hex(atr->value, atr->len));
 
-		sc_log(ctx, "ATR try : %s", tatr);
+	/* the tables are compiled once, the drivers match them concurrently */
+	sc_rwlock_lock(ctx, ctx->drivers_lock, exclusive);
+	c = find_compiled_atrs(ctx, table);
+	if (c == NULL) {
+		sc_rwlock_unlock(ctx, ctx->drivers_lock, exclusive);
+		exclusive = 1;
+		sc_rwlock_lock(ctx, ctx->drivers_lock, exclusive);
+		c = get_compiled_atrs(ctx, table);
+	}
+	for (i = 0; c != NULL && i < c->count; i++) {
+		const struct sc_atr_compiled_entry *e = &c->entries[i];
 
-		if (tatr_len != fix_hex_len) {
-			sc_log(ctx, "ignored - wrong length");
+		if (e->len != atr->len)
 			continue;
+		for (s = 0; s < e->len; s++)
+			if ((atr->value[s] ^ e->value[s]) & e->mask[s])
+				break;
+		if (s == e->len) {
+			sc_log(ctx, "ATR matched: %s", table[i].atr);
+			res = (int)i;
+			break;
 		}
-		if (matr != NULL) {
-			sc_log(ctx, "ATR mask: %s", matr);
-
-			matr_len = strlen(matr);
-			if (tatr_len != matr_len)
-				continue;
-			tbin_len = sizeof(tbin);
-			sc_hex_to_bin(tatr, tbin, &tbin_len);
-			mbin_len = sizeof(mbin);
-			sc_hex_to_bin(matr, mbin, &mbin_len);
-			if (mbin_len != fix_bin_len) {
-				sc_log(ctx, "length of atr and atr mask do not match - ignored: %s - %s", tatr, matr);
-				continue;
-			}
-			for (s = 0; s < tbin_len; s++) {
-				/* reduce tatr with mask */
-				tbin[s] = (tbin[s] & mbin[s]);
-				/* create copy of card_atr_bin masked) */
-				mbin[s] = (card_atr_bin[s] & mbin[s]);
-			}
-			if (memcmp(tbin, mbin, tbin_len) != 0)
-				continue;
-		} else {
-			if (strncasecmp(tatr, card_atr_hex, tatr_len) != 0)
-				continue;
-		}
-		return i;
 	}
-	return -1;
+	sc_rwlock_unlock(ctx, ctx->drivers_lock, exclusive);
+	return res;
 }
 
 int _sc_match_atr(sc_card_t *card, struct sc_atr_table *table, int *type_out)
@@ -971,6 +1987,10 @@ int _sc_add_atr(sc_context_t *ctx, struct sc_card_driver *driver, struct sc_atr_
 {
 	struct sc_atr_table *map, *dst;
 
+	sc_rwlock_lock(ctx, ctx->drivers_lock, 1);
+	free_compiled_atrs(ctx, driver->atr_map);
+	sc_rwlock_unlock(ctx, ctx->drivers_lock, 1);
+
 	map = (struct sc_atr_table *) realloc(driver->atr_map,
 			(driver->natrs + 2) * sizeof(struct sc_atr_table));
 	if (!map)
@@ -1014,6 +2034,10 @@ int _sc_free_atr(sc_context_t *ctx, struct sc_card_driver *driver)
 {
 	unsigned int i;
 
+	sc_rwlock_lock(ctx, ctx->drivers_lock, 1);
+	free_compiled_atrs(ctx, driver->atr_map);
+	sc_rwlock_unlock(ctx, ctx->drivers_lock, 1);
+
 	for (i = 0; i < driver->natrs; i++) {
 		struct sc_atr_table *src = &driver->atr_map[i];
 
@@ -1054,6 +2078,30 @@ scconf_block *sc_get_conf_block(sc_context_t *ctx, const char *name1, const char
 	return conf_block;
 }
 
+void sc_invalidate_select_cache(struct sc_card *card)
+{
+	card->cache.selected = 0;
+	card->cache.sec_env_serial++;
+}
+
+void sc_invalidate_cache(struct sc_card *card)
+{
+	unsigned int sec_env_serial = card->cache.sec_env_serial;
+	unsigned int security_serial = card->cache.security_serial;
+
+	sc_invalidate_fci_cache(card, NULL);
+	_sc_free_apdu_cache(card);
+	if (card->cache.current_ef)
+		sc_file_free(card->cache.current_ef);
+	if (card->cache.current_df)
+		sc_file_free(card->cache.current_df);
+	memset(&card->cache, 0, sizeof(card->cache));
+	_sc_memcache_init(&card->cache.fci_account, "fci", 1);
+	card->cache.valid = 0;
+	card->cache.sec_env_serial = sec_env_serial + 1;
+	card->cache.security_serial = security_serial + 1;
+}
+
 void sc_print_cache(struct sc_card *card)   {
 	struct sc_context *ctx = NULL;
 
@@ -22,8 +22,10 @@
 
 #ifdef ENABLE_ZLIB	/* empty file without zlib */
 #include <zlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include "internal.h"
 #include "errors.h"
@@ -109,18 +111,40 @@ int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int metho
 	}
 }
 
-static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int gzip) {
-	/* Since uncompress does not offer a way to make it uncompress gzip... manually set it up */
+/* The largest ratio deflate reaches, to tell a bogus size hint */
+#define MAX_INFLATE_RATIO	1032
+
+/* ISIZE, the uncompressed size in the last 4 bytes of a gzip member */
+static size_t gzip_size_hint(const u8* in, size_t inLen) {
+	if(inLen < 18)
+		return 0;
+	in += inLen - 4;
+	return in[0] | in[1] << 8 | in[2] << 16 | (size_t)in[3] << 24;
+}
+
+/*
+ * Inflates in one stream into a buffer of the hinted size, and only grows
+ * it, doubling, when the hint is missing or wrong.
+ */
+static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen,
+		int gzip, size_t hint) {
 	z_stream gz;
 	int err;
 	int window_size = 15;
-	const int startSize = inLen < 1024 ? 2048 : inLen * 2;
-	const int blockSize = inLen < 1024 ? 512 : inLen / 2;
-	int bufferSize = startSize;
-	if(gzip)
+	size_t bufferSize;
+	u8* buf;
+
+	if(gzip) {
 		window_size += 0x20;
+		if(hint == 0)
+			hint = gzip_size_hint(in, inLen);
+	}
+	if(hint == 0 || hint / MAX_INFLATE_RATIO > inLen)
+		bufferSize = inLen < 1024 ? 2048 : inLen * 2;
+	else
+		bufferSize = hint;
 	memset(&gz, 0, sizeof(gz));
-	
+
 	gz.next_in = (u8*)in;
 	gz.avail_in = inLen;
 
@@ -130,43 +154,42 @@ static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size
 	*outLen = 0;
 
 	while(1) {
-		/* Setup buffer... */
-		int num;
-		u8* buf = realloc(*out, bufferSize);
+		buf = realloc(*out, bufferSize);
 		if(!buf) {
-			if(*out)
-				free(*out);
-			*out = NULL;
-			return Z_MEM_ERROR;
+			err = Z_MEM_ERROR;
+			break;
 		}
 		*out = buf;
-		gz.next_out = buf + *outLen;
-		gz.avail_out = bufferSize - *outLen;
-
-		err = inflate(&gz, Z_FULL_FLUSH);
-		if(err != Z_STREAM_END && err != Z_OK) {
-			if(*out)
-				free(*out);
-			*out = NULL;
+		gz.next_out = buf + gz.total_out;
+		gz.avail_out = bufferSize - gz.total_out;
+
+		err = inflate(&gz, Z_NO_FLUSH);
+		if(err != Z_OK)
+			break;
+		if(gz.avail_out != 0) {
+			/* all the input is used, but the stream did not end */
+			err = Z_DATA_ERROR;
 			break;
 		}
-		num = bufferSize - *outLen - gz.avail_out;
-		if(num > 0) {
-			*outLen += num;
-			bufferSize += num + blockSize;
-		}
-		if(err == Z_STREAM_END) {
-			buf = realloc(buf, *outLen); /* Shrink it down, if it fails, just use old data */
-			if(buf) {
+		bufferSize *= 2;
+	}
+	if(err == Z_STREAM_END) {
+		*outLen = gz.total_out;
+		if(*outLen < bufferSize) {
+			buf = realloc(*out, *outLen ? *outLen : 1); /* Shrink it down, if it fails, just use old data */
+			if(buf)
 				*out = buf;
-			}
-			break;
 		}
+	} else {
+		free(*out);
+		*out = NULL;
 	}
 	inflateEnd(&gz);
 	return zerr_to_opensc(err);
 }
-int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method) {
+
+static int decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method,
+		size_t hint) {
 	if(method == COMPRESSION_AUTO) {
 		method = detect_method(in, inLen);
 		if(method == COMPRESSION_UNKNOWN) {
@@ -175,11 +198,101 @@ int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, in
 	}
 	switch(method) {
 	case COMPRESSION_ZLIB:
-		return sc_decompress_zlib_alloc(out, outLen, in, inLen, 0);
+		return sc_decompress_zlib_alloc(out, outLen, in, inLen, 0, hint);
 	case COMPRESSION_GZIP:
-		return sc_decompress_zlib_alloc(out, outLen, in, inLen, 1);
+		return sc_decompress_zlib_alloc(out, outLen, in, inLen, 1, hint);
 	default:
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 }
+
+int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method) {
+	return decompress_alloc(out, outLen, in, inLen, method, 0);
+}
+
+/*
+ * The output is kept in "<cache_dir>/inflate-<crc32>-<inLen>" after a copy
+ * of the compressed data, which has to match for the file to be used.
+ */
+static int decompress_cache_filename(sc_context_t* ctx, const u8* in, size_t inLen,
+		char* buf, size_t bufsize) {
+	char dir[PATH_MAX];
+	int r;
+
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if(r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/inflate-%08x-%lu", dir,
+			sc_crc32((unsigned char*)in, inLen), (unsigned long)inLen);
+	if(r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int decompress_cache_load(sc_context_t* ctx, const char* fname, u8** out, size_t* outLen,
+		const u8* in, size_t inLen) {
+	FILE* f;
+	u8* buf = NULL;
+	long size = 0;
+
+	f = fopen(fname, "rb");
+	if(f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if(fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > (long)inLen
+			&& fseek(f, 0, SEEK_SET) == 0)
+		buf = malloc(size);
+	if(buf && fread(buf, 1, size, f) != (size_t)size) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	if(buf == NULL || memcmp(buf, in, inLen)) {
+		free(buf);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	memmove(buf, buf + inLen, size - inLen);
+	free(*out);
+	*out = buf;
+	*outLen = size - inLen;
+	_sc_cache_used(ctx, fname);
+	return SC_SUCCESS;
+}
+
+static void decompress_cache_store(sc_context_t* ctx, const char* fname, const u8* out, size_t outLen,
+		const u8* in, size_t inLen) {
+	FILE* f;
+
+	f = fopen(fname, "wb");
+	if(f == NULL && sc_make_cache_dir(ctx) == SC_SUCCESS)
+		f = fopen(fname, "wb");
+	if(f == NULL)
+		return;
+	if(fwrite(in, 1, inLen, f) != inLen || fwrite(out, 1, outLen, f) != outLen) {
+		fclose(f);
+		remove(fname);
+		return;
+	}
+	if(fclose(f) != 0) {
+		remove(fname);
+		return;
+	}
+	_sc_cache_used(ctx, fname);
+}
+
+int sc_decompress_cached(sc_context_t* ctx, u8** out, size_t* outLen, const u8* in, size_t inLen,
+		int method) {
+	char fname[PATH_MAX];
+	int cache, r;
+
+	cache = _sc_card_use_file_cache(ctx)
+		&& decompress_cache_filename(ctx, in, inLen, fname, sizeof(fname)) == SC_SUCCESS;
+	if(cache && decompress_cache_load(ctx, fname, out, outLen, in, inLen) == SC_SUCCESS) {
+		sc_log(ctx, "%lu bytes inflated from '%s'", (unsigned long)*outLen, fname);
+		return SC_SUCCESS;
+	}
+	r = decompress_alloc(out, outLen, in, inLen, method, *outLen);
+	if(r == SC_SUCCESS && cache && *outLen > 0)
+		decompress_cache_store(ctx, fname, *out, *outLen, in, inLen);
+	return r;
+}
 #endif /* ENABLE_ZLIB */
@@ -30,6 +30,11 @@
 
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method);
 int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int method);
+/* Like sc_decompress_alloc(), with the output kept in the file cache when
+ * use_file_caching is set. *outLen is the uncompressed size if the format
+ * gives it, or 0, and *out NULL or a buffer that may be reallocated. */
+int sc_decompress_cached(sc_context_t* ctx, u8** out, size_t* outLen, const u8* in, size_t inLen,
+		int method);
 
 #endif
 
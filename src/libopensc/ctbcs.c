@@ -80,11 +80,11 @@ ctbcs_build_output_apdu(sc_apdu_t *apdu, const char *message)
 #endif
 
 static int
-ctbcs_build_perform_verification_apdu(sc_apdu_t *apdu, struct sc_pin_cmd_data *data)
+ctbcs_build_perform_verification_apdu(sc_apdu_t *apdu, struct sc_pin_cmd_data *data,
+		u8 *buf, size_t buflen)
 {
 	const char *prompt;
-	size_t buflen, count = 0, j = 0, len;
-	static u8 buf[254];
+	size_t count = 0, j = 0, len;
 	u8 control;
 
 	ctbcs_init_apdu(apdu,
@@ -93,7 +93,6 @@ ctbcs_build_perform_verification_apdu(sc_apdu_t *apdu, struct sc_pin_cmd_data *d
 			CTBCS_P1_INTERFACE1,
 			0);
 
-	buflen = sizeof(buf);
 	prompt = data->pin1.prompt;
 	if (prompt && *prompt) {
 		len = strlen(prompt);
@@ -143,16 +142,18 @@ ctbcs_build_perform_verification_apdu(sc_apdu_t *apdu, struct sc_pin_cmd_data *d
 
 	apdu->lc = apdu->datalen = count;
 	apdu->data = buf;
+	if (count > 255)
+		apdu->cse = SC_APDU_CASE_3_EXT;
 
 	return 0;
 }
 
 static int
-ctbcs_build_modify_verification_apdu(sc_apdu_t *apdu, struct sc_pin_cmd_data *data)
+ctbcs_build_modify_verification_apdu(sc_apdu_t *apdu, struct sc_pin_cmd_data *data,
+		u8 *buf, size_t buflen)
 {
 	const char *prompt;
-	size_t buflen, count = 0, j = 0, len;
-	static u8 buf[254];
+	size_t count = 0, j = 0, len;
 	u8 control;
 
 	ctbcs_init_apdu(apdu,
@@ -161,7 +162,6 @@ ctbcs_build_modify_verification_apdu(sc_apdu_t *apdu, struct sc_pin_cmd_data *da
 			CTBCS_P1_INTERFACE1,
 			0);
 
-	buflen = sizeof(buf);
 	prompt = data->pin1.prompt;
 	if (prompt && *prompt) {
 		len = strlen(prompt);
@@ -212,6 +212,8 @@ ctbcs_build_modify_verification_apdu(sc_apdu_t *apdu, struct sc_pin_cmd_data *da
 
 	apdu->lc = apdu->datalen = count;
 	apdu->data = buf;
+	if (count > 255)
+		apdu->cse = SC_APDU_CASE_3_EXT;
 
 	return 0;
 }
@@ -222,17 +224,22 @@ ctbcs_pin_cmd(sc_reader_t *reader, struct sc_pin_cmd_data *data)
 	sc_card_t dummy_card, *card;
 	sc_apdu_t apdu;
 	struct sc_card_operations ops;
+	u8 buf[CTBCS_MAX_DATA_SIZE];
+	size_t buflen;
 	int r, s;
 
+	/* longer prompts and paddings need an extended length command */
+	buflen = reader->max_send_size > 255 ? sizeof(buf) : 254;
+
 	switch (data->cmd) {
 	case SC_PIN_CMD_VERIFY:
-		r = ctbcs_build_perform_verification_apdu(&apdu, data);
+		r = ctbcs_build_perform_verification_apdu(&apdu, data, buf, buflen);
 		if (r != SC_SUCCESS)
 			return r;
 		break;
 	case SC_PIN_CMD_CHANGE:
 	case SC_PIN_CMD_UNBLOCK:
-		r = ctbcs_build_modify_verification_apdu(&apdu, data);
+		r = ctbcs_build_modify_verification_apdu(&apdu, data, buf, buflen);
 		if (r != SC_SUCCESS)
 			return r;
 		break;
@@ -249,6 +256,10 @@ ctbcs_pin_cmd(sc_reader_t *reader, struct sc_pin_cmd_data *data)
 	if (r != SC_SUCCESS)
 		return r;
 	dummy_card.ops   = &ops;
+	dummy_card.max_send_size = reader->max_send_size;
+	dummy_card.max_recv_size = reader->max_recv_size;
+	if (reader->max_send_size > 255)
+		dummy_card.caps |= SC_CARD_CAP_APDU_EXT;
 	card = &dummy_card;
 
 	r = sc_transmit_apdu(card, &apdu);
@@ -183,6 +183,12 @@
 #define CTBCS_DATA_STATUS_CARD		0x01	/* Card present */
 #define CTBCS_DATA_STATUS_CARD_CONNECT	0x05	/* Card present */
 
+/*
+ * Largest data of the PERFORM/MODIFY VERIFICATION commands built here:
+ * prompt (2 + 255), verify command (10) and padding (256)
+ */
+#define CTBCS_MAX_DATA_SIZE		523
+
 /*
  * Functions for building CTBCS commands
  */
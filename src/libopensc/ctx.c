@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <time.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -36,80 +37,195 @@
 #include "common/libscdl.h"
 #include "internal.h"
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+static pthread_mutex_t shared_contexts_lock = PTHREAD_MUTEX_INITIALIZER;
+#define SHARED_CONTEXTS_LOCK()	pthread_mutex_lock(&shared_contexts_lock)
+#define SHARED_CONTEXTS_UNLOCK()	pthread_mutex_unlock(&shared_contexts_lock)
+#else
+#define SHARED_CONTEXTS_LOCK()
+#define SHARED_CONTEXTS_UNLOCK()
+#endif
+
+/* Contexts created with SC_CTX_FLAG_SHARED */
+static sc_context_t *shared_contexts = NULL;
+
 int _sc_add_reader(sc_context_t *ctx, sc_reader_t *reader)
 {
 	assert(reader != NULL);
 	reader->ctx = ctx;
+	if (ctx->reader_workers && _sc_reader_worker_start(reader) != SC_SUCCESS)
+		sc_log(ctx, "no worker thread for reader '%s'", reader->name);
+	sc_rwlock_lock(ctx, ctx->readers_lock, 1);
 	list_append(&ctx->readers, reader);
+	sc_rwlock_unlock(ctx, ctx->readers_lock, 1);
 	return SC_SUCCESS;
 }
 
 int _sc_delete_reader(sc_context_t *ctx, sc_reader_t *reader)
 {
 	assert(reader != NULL);
+	sc_rwlock_lock(ctx, ctx->readers_lock, 1);
+	list_delete(&ctx->readers, reader);
+	sc_rwlock_unlock(ctx, ctx->readers_lock, 1);
+	_sc_reader_worker_stop(reader);
 	if (reader->ops->release)
 			reader->ops->release(reader);
 	if (reader->name)
 		free(reader->name);
-	list_delete(&ctx->readers, reader);
+	if (reader->apdu_buf) {
+		sc_mem_clear(reader->apdu_buf, reader->apdu_buf_len);
+		free(reader->apdu_buf);
+	}
+	if (reader->stats)
+		free(reader->stats);
 	free(reader);
 	return SC_SUCCESS;
 }
 
+unsigned char *_sc_reader_get_apdu_buf(sc_reader_t *reader, size_t len)
+{
+	unsigned char *buf;
+
+	assert(reader != NULL);
+	if (reader->apdu_buf != NULL && reader->apdu_buf_len >= len)
+		return reader->apdu_buf;
+
+	/* the buffer only grows, the old content is not needed */
+	buf = malloc(len);
+	if (buf == NULL)
+		return NULL;
+	if (reader->apdu_buf) {
+		sc_mem_clear(reader->apdu_buf, reader->apdu_buf_len);
+		free(reader->apdu_buf);
+	}
+	reader->apdu_buf = buf;
+	reader->apdu_buf_len = len;
+	return buf;
+}
+
 struct _sc_driver_entry {
 	const char *name;
 	void *(*func)(void);
 };
 
 static const struct _sc_driver_entry internal_card_drivers[] = {
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_cardos)
 	{ "cardos",	(void *(*)(void)) sc_get_cardos_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_flex)
 	{ "flex",	(void *(*)(void)) sc_get_cryptoflex_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_cyberflex)
 	{ "cyberflex",	(void *(*)(void)) sc_get_cyberflex_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_gpk)
 	{ "gpk",	(void *(*)(void)) sc_get_gpk_driver },
 #endif
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_gemsafeV1)
 	{ "gemsafeV1",	(void *(*)(void)) sc_get_gemsafeV1_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_miocos)
 	{ "miocos",	(void *(*)(void)) sc_get_miocos_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_mcrd)
 	{ "mcrd",	(void *(*)(void)) sc_get_mcrd_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_asepcos)
 	{ "asepcos",	(void *(*)(void)) sc_get_asepcos_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_starcos)
 	{ "starcos",	(void *(*)(void)) sc_get_starcos_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_tcos)
 	{ "tcos",	(void *(*)(void)) sc_get_tcos_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_openpgp)
 	{ "openpgp",	(void *(*)(void)) sc_get_openpgp_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_jcop)
 	{ "jcop",	(void *(*)(void)) sc_get_jcop_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_oberthur)
 	{ "oberthur",	(void *(*)(void)) sc_get_oberthur_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_authentic)
 	{ "authentic",	(void *(*)(void)) sc_get_authentic_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_iasecc)
 	{ "iasecc",	(void *(*)(void)) sc_get_iasecc_driver },
 #endif
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_belpic)
 	{ "belpic",	(void *(*)(void)) sc_get_belpic_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_ias)
 	{ "ias",		(void *(*)(void)) sc_get_ias_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_incrypto34)
 	{ "incrypto34", (void *(*)(void)) sc_get_incrypto34_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_acos5)
 	{ "acos5",	(void *(*)(void)) sc_get_acos5_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_akis)
 	{ "akis",	(void *(*)(void)) sc_get_akis_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_entersafe)
 	{ "entersafe",(void *(*)(void)) sc_get_entersafe_driver },
+#endif
 #ifdef ENABLE_SM
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_epass2003)
 	{ "epass2003",(void *(*)(void)) sc_get_epass2003_driver },
 #endif
 #endif
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_rutoken)
 	{ "rutoken",	(void *(*)(void)) sc_get_rutoken_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_rutoken_ecp)
 	{ "rutoken_ecp",(void *(*)(void)) sc_get_rtecp_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_westcos)
 	{ "westcos",	(void *(*)(void)) sc_get_westcos_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_myeid)
 	{ "myeid",      (void *(*)(void)) sc_get_myeid_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_sc_hsm)
 	{ "sc-hsm",		(void *(*)(void)) sc_get_sc_hsm_driver },
+#endif
 #ifdef ENABLE_OPENSSL
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_dnie)
 	{ "dnie",       (void *(*)(void)) sc_get_dnie_driver },
 #endif
+#endif
 
 /* Here should be placed drivers that need some APDU transactions to
  * recognise its cards. */
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_setcos)
 	{ "setcos",	(void *(*)(void)) sc_get_setcos_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_muscle)
 	{ "muscle",	(void *(*)(void)) sc_get_muscle_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_atrust_acos)
 	{ "atrust-acos",(void *(*)(void)) sc_get_atrust_acos_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_PIV_II)
 	{ "PIV-II",	(void *(*)(void)) sc_get_piv_driver },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_itacns)
 	{ "itacns",	(void *(*)(void)) sc_get_itacns_driver },
+#endif
 	/* javacard without supported applet - last before default */
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_javacard)
 	{ "javacard",	(void *(*)(void)) sc_get_javacard_driver },
+#endif
 	/* The default driver should be last, as it handles all the
 	 * unrecognized cards. */
 	{ "default",	(void *(*)(void)) sc_get_default_driver },
@@ -120,6 +236,8 @@ struct _sc_ctx_options {
 	struct _sc_driver_entry cdrv[SC_MAX_CARD_DRIVERS];
 	int ccount;
 	char *forced_card_driver;
+	int debug_async;
+	int debug_queue_size;
 };
 
 
@@ -186,6 +304,10 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	ctx->debug_file = stderr;
 	ctx->paranoid_memory = 0;
 	ctx->enable_default_driver = 0;
+	ctx->use_driver_cache = 0;
+	ctx->transmit_timeout_min = 5000;
+	opts->debug_async = 0;
+	opts->debug_queue_size = 256;
 
 #ifdef __APPLE__
 	/* Override the default debug log for OpenSC.tokend to be different from PKCS#11.
@@ -203,6 +325,9 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
  */
 int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 {
+	/* Queued messages go to the old file */
+	_sc_log_queue_flush(ctx);
+
 	/* Close any existing handles */
 	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))   {
 		fclose(ctx->debug_file);
@@ -231,6 +356,7 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 	const char *val, *s_internal = "internal";
 	int debug;
 	int reopen;
+	int memory_max;
 #ifdef _WIN32
 	char expanded_val[PATH_MAX];
 	DWORD expanded_len;
@@ -256,12 +382,40 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 		sc_ctx_log_to_file(ctx, val);
 	}
 
+	val = scconf_get_str(block, "apdu_trace_file", NULL);
+	if (val)
+		_sc_apdu_trace_open(ctx, val);
+
+	val = scconf_get_str(block, "span_trace_file", NULL);
+	if (val)
+		_sc_span_trace_open(ctx, val);
+
+	opts->debug_async = scconf_get_bool(block, "debug_async", opts->debug_async);
+	opts->debug_queue_size = scconf_get_int(block, "debug_queue_size", opts->debug_queue_size);
+
 	ctx->paranoid_memory = scconf_get_bool (block, "paranoid-memory",
 		ctx->paranoid_memory);
 
 	ctx->enable_default_driver = scconf_get_bool (block, "enable_default_driver",
 			ctx->enable_default_driver);
 
+	ctx->use_driver_cache = scconf_get_bool (block, "use_driver_cache",
+			ctx->use_driver_cache);
+
+	ctx->cache_max_size = scconf_get_int(block, "cache_max_size",
+			ctx->cache_max_size);
+	ctx->cache_max_age = scconf_get_int(block, "cache_max_age",
+			ctx->cache_max_age);
+	memory_max = scconf_get_int(block, "cache_memory_max_size", (int) (ctx->cache_memory_max / 1024));
+	ctx->cache_memory_max = memory_max > 0 ? (size_t) memory_max * 1024 : 0;
+
+	ctx->reader_quarantine_time = scconf_get_int(block, "reader_quarantine_time",
+			ctx->reader_quarantine_time);
+	ctx->transmit_timeout_min = scconf_get_int(block, "transmit_timeout_min",
+			ctx->transmit_timeout_min);
+	ctx->reader_workers = scconf_get_bool(block, "reader_workers",
+			ctx->reader_workers);
+
 	val = scconf_get_str(block, "force_card_driver", NULL);
 	if (val) {
 		if (opts->forced_card_driver)
@@ -403,6 +557,100 @@ static int load_card_driver_options(sc_context_t *ctx,
 	return SC_SUCCESS;
 }
 
+/*
+ * An external driver with 'lazy_load = true' is registered as a placeholder
+ * without card operations: its ATR table comes from the card_atr blocks that
+ * name it, and the module is only loaded when one of them matches a card.
+ * The loaded driver replaces it in card_drivers[], but the placeholder is
+ * kept until sc_release_context(): sc_connect_card() and the other walks of
+ * card_drivers[] read the entries without drivers_lock.
+ */
+struct lazy_card_driver {
+	struct sc_card_driver drv;
+	struct lazy_card_driver *next_loaded;
+	int failed;
+	char name[1];
+};
+
+static int is_lazy_driver(sc_context_t *ctx, const char *name)
+{
+	scconf_block **blocks, *blk;
+	int i, lazy = 0;
+
+	for (i = 0; ctx->conf_blocks[i]; i++) {
+		blocks = scconf_find_blocks(ctx->conf, ctx->conf_blocks[i],
+				"card_driver", name);
+		if (!blocks)
+			continue;
+		blk = blocks[0];
+		free(blocks);
+		if (blk == NULL)
+			continue;
+		lazy = scconf_get_bool(blk, "lazy_load", 0);
+		break;
+	}
+	return lazy;
+}
+
+static struct sc_card_driver *new_lazy_driver(const char *name)
+{
+	struct lazy_card_driver *lazy;
+
+	lazy = calloc(1, sizeof(*lazy) + strlen(name));
+	if (lazy == NULL)
+		return NULL;
+	strcpy(lazy->name, name);
+	lazy->drv.name = lazy->name;
+	lazy->drv.short_name = lazy->name;
+	return &lazy->drv;
+}
+
+static struct sc_card_driver *load_lazy_driver(sc_context_t *ctx, int idx)
+{
+	struct sc_card_driver *placeholder = ctx->card_drivers[idx], *drv;
+	struct lazy_card_driver *lazy = (struct lazy_card_driver *) placeholder;
+	struct sc_card_driver *(*func)(void) = NULL;
+	struct sc_card_driver *(**tfunc)(void) = &func;
+	void *dll = NULL;
+
+	if (placeholder->ops != NULL)
+		return placeholder;
+	if (lazy->failed)
+		return NULL;
+
+	*(void **)(tfunc) = load_dynamic_driver(ctx, &dll, lazy->name);
+	if (func == NULL || (drv = func()) == NULL) {
+		sc_log(ctx, "Unable to load '%s'.", lazy->name);
+		if (dll)
+			sc_dlclose(dll);
+		lazy->failed = 1;
+		return NULL;
+	}
+
+	/* The ATR table read from the configuration moves to the driver */
+	drv->dll = dll;
+	drv->atr_map = placeholder->atr_map;
+	drv->natrs = placeholder->natrs;
+	load_card_driver_options(ctx, drv);
+
+	if (ctx->forced_driver == placeholder)
+		ctx->forced_driver = drv;
+	ctx->card_drivers[idx] = drv;
+	lazy->next_loaded = ctx->loaded_lazy_drivers;
+	ctx->loaded_lazy_drivers = lazy;
+	return drv;
+}
+
+struct sc_card_driver *_sc_load_lazy_driver(sc_context_t *ctx, int idx)
+{
+	struct sc_card_driver *drv;
+
+	sc_rwlock_lock(ctx, ctx->drivers_lock, 1);
+	drv = load_lazy_driver(ctx, idx);
+	sc_rwlock_unlock(ctx, ctx->drivers_lock, 1);
+	return drv;
+}
+
 static int load_card_drivers(sc_context_t *ctx,
 			     struct _sc_ctx_options *opts)
 {
@@ -431,6 +679,15 @@ static int load_card_drivers(sc_context_t *ctx,
 				break;
 			}
 		/* if not initialized assume external module */
+		if (func == NULL && is_lazy_driver(ctx, ent->name)) {
+			ctx->card_drivers[drv_count] = new_lazy_driver(ent->name);
+			if (ctx->card_drivers[drv_count] == NULL)
+				break;
+			sc_log(ctx, "card driver '%s' is loaded on demand", ent->name);
+			ctx->card_drivers[drv_count + 1] = NULL;
+			drv_count++;
+			continue;
+		}
 		if (func == NULL)
 			*(void **)(tfunc) = load_dynamic_driver(ctx, &dll, ent->name);
 		/* if still null, assume driver not found */
@@ -531,12 +788,17 @@ static int load_card_atrs(sc_context_t *ctx)
 	return SC_SUCCESS;
 }
 
+/* Parsed configuration, in the cache directory, see use_config_cache */
+#define SC_CONF_IMAGE_NAME	"/opensc.conf.image"
+
 static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 {
 	int i, r, count = 0;
+	int from_file = 0, use_image = 0;
 	scconf_block **blocks;
 	const char *conf_path = NULL;
-	const char *debug = NULL;
+	const char *debug = NULL, *trace = NULL;
+	char image_path[PATH_MAX];
 #ifdef _WIN32
 	char temp_path[PATH_MAX];
 	DWORD temp_len;
@@ -548,6 +810,13 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	debug = getenv("OPENSC_DEBUG");
 	if (debug)
 		ctx->debug = atoi(debug);
+	/* Opened first, so it wins over apdu_trace_file */
+	trace = getenv("OPENSC_APDU_TRACE");
+	if (trace && *trace)
+		_sc_apdu_trace_open(ctx, trace);
+	trace = getenv("OPENSC_SPAN_TRACE");
+	if (trace && *trace)
+		_sc_span_trace_open(ctx, trace);
 
 	memset(ctx->conf_blocks, 0, sizeof(ctx->conf_blocks));
 #ifdef _WIN32
@@ -587,7 +856,23 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	ctx->conf = scconf_new(conf_path);
 	if (ctx->conf == NULL)
 		return;
-	r = scconf_parse(ctx->conf);
+	/* The image is only there if use_config_cache was set */
+	if (sc_get_cache_dir(ctx, image_path, sizeof(image_path)) == SC_SUCCESS
+			&& strlen(image_path) + sizeof(SC_CONF_IMAGE_NAME) < sizeof(image_path)) {
+		strcat(image_path, SC_CONF_IMAGE_NAME);
+		r = scconf_parse_image(ctx->conf, image_path);
+	}
+	else {
+		image_path[0] = '\0';
+		r = -1;
+	}
+	if (r == 1) {
+		sc_log(ctx, "configuration loaded from %s", image_path);
+	}
+	else {
+		from_file = 1;
+		r = scconf_parse(ctx->conf);
+	}
 #ifdef OPENSC_CONFIG_STRING
 	/* Parse the string if config file didn't exist */
 	if (r < 0)
@@ -617,8 +902,15 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	}
 	/* Above we add 2 blocks at most, but conf_blocks has 3 elements,
 	 * so at least one is NULL */
-	for (i = 0; ctx->conf_blocks[i]; i++)
+	for (i = 0; ctx->conf_blocks[i]; i++) {
 		load_parameters(ctx, ctx->conf_blocks[i], opts);
+		if (scconf_get_bool(ctx->conf_blocks[i], "use_config_cache", 0))
+			use_image = 1;
+	}
+
+	if (from_file && use_image && image_path[0] && sc_make_cache_dir(ctx) == SC_SUCCESS
+			&& scconf_write_image(ctx->conf, image_path) != 0)
+		sc_log(ctx, "cannot write configuration image %s", image_path);
 }
 
 int sc_ctx_detect_readers(sc_context_t *ctx)
@@ -638,22 +930,37 @@ int sc_ctx_detect_readers(sc_context_t *ctx)
 
 sc_reader_t *sc_ctx_get_reader(sc_context_t *ctx, unsigned int i)
 {
-	return list_get_at(&ctx->readers, i);
+	sc_reader_t *reader;
+
+	sc_rwlock_lock(ctx, ctx->readers_lock, 0);
+	reader = list_get_at(&ctx->readers, i);
+	sc_rwlock_unlock(ctx, ctx->readers_lock, 0);
+	return reader;
 }
 
 sc_reader_t *sc_ctx_get_reader_by_id(sc_context_t *ctx, unsigned int id)
 {
-	return list_get_at(&ctx->readers, id);
+	return sc_ctx_get_reader(ctx, id);
 }
 
 sc_reader_t *sc_ctx_get_reader_by_name(sc_context_t *ctx, const char * name)
 {
-	return list_seek(&ctx->readers, name);
+	sc_reader_t *reader;
+
+	sc_rwlock_lock(ctx, ctx->readers_lock, 0);
+	reader = list_seek(&ctx->readers, name);
+	sc_rwlock_unlock(ctx, ctx->readers_lock, 0);
+	return reader;
 }
 
 unsigned int sc_ctx_get_reader_count(sc_context_t *ctx)
 {
-	return list_size(&ctx->readers);
+	unsigned int count;
+
+	sc_rwlock_lock(ctx, ctx->readers_lock, 0);
+	count = list_size(&ctx->readers);
+	sc_rwlock_unlock(ctx, ctx->readers_lock, 0);
+	return count;
 }
 
 int sc_establish_context(sc_context_t **ctx_out, const char *app_name)
@@ -684,19 +991,115 @@ int sc_context_repair(sc_context_t **ctx_out)
 	return SC_SUCCESS;
 }
 
+int sc_ctx_forked(sc_context_t *ctx)
+{
+	unsigned int i;
+	int r;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	/* Only the PC/SC driver gets all of its state from init() and
+	 * detect_readers() */
+	if (ctx->reader_driver == NULL || strcmp(ctx->reader_driver->short_name, "pcsc") != 0)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	_sc_log_queue_forked(ctx);
+	_sc_apdu_trace_forked(ctx);
+	_sc_span_trace_forked(ctx);
+
+	/* The parent's locks may have been held by one of its threads */
+	ctx->mutex = NULL;
+	ctx->memcache_mutex = NULL;
+	ctx->readers_lock = NULL;
+	ctx->drivers_lock = NULL;
+	r = sc_mutex_create(ctx, &ctx->mutex);
+	if (r == SC_SUCCESS)
+		r = sc_mutex_create(ctx, &ctx->memcache_mutex);
+	if (r == SC_SUCCESS)
+		r = sc_rwlock_create(ctx, &ctx->readers_lock);
+	if (r == SC_SUCCESS)
+		r = sc_rwlock_create(ctx, &ctx->drivers_lock);
+	if (r != SC_SUCCESS)
+		return r;
+
+	/* The readers and the driver data reference the parent's PC/SC
+	 * context and card handles: releasing them from here would release
+	 * them for the parent, so they are left alone. */
+	for (i = 0; i < list_size(&ctx->readers); i++)
+		_sc_reader_worker_forked((sc_reader_t *) list_get_at(&ctx->readers, i));
+	list_destroy(&ctx->readers);
+	list_init(&ctx->readers);
+	list_attributes_seeker(&ctx->readers, reader_list_seeker);
+	ctx->reader_drv_data = NULL;
+
+	r = ctx->reader_driver->ops->init(ctx);
+	if (r != SC_SUCCESS)
+		return r;
+	sc_log(ctx, "reinitialized after fork()");
+	sc_ctx_detect_readers(ctx);
+	return SC_SUCCESS;
+}
+
+/* A caller can use a shared context when it asks for the same application,
+ * and either brings no mutex functions or the ones the context uses */
+static sc_context_t *find_shared_context(const sc_context_param_t *parm)
+{
+	const char *app_name = parm->app_name ? parm->app_name : "default";
+	sc_context_t *ctx;
+
+	for (ctx = shared_contexts; ctx != NULL; ctx = ctx->shared_next) {
+		if (strcmp(ctx->app_name, app_name) != 0)
+			continue;
+		if (parm->thread_ctx != NULL && parm->thread_ctx != ctx->thread_ctx)
+			continue;
+		return ctx;
+	}
+	return NULL;
+}
+
+static int context_create(sc_context_t **ctx_out, const sc_context_param_t *parm);
+
 int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 {
-	sc_context_t		*ctx;
-	struct _sc_ctx_options	opts;
-	int			r;
+	sc_context_t *ctx;
+	int r;
 
 	if (ctx_out == NULL || parm == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
+	if (!(parm->flags & SC_CTX_FLAG_SHARED))
+		return context_create(ctx_out, parm);
+
+	SHARED_CONTEXTS_LOCK();
+	ctx = find_shared_context(parm);
+	if (ctx != NULL) {
+		ctx->shared_refs++;
+		sc_log(ctx, "sharing context with %u users", ctx->shared_refs);
+		*ctx_out = ctx;
+		r = SC_SUCCESS;
+	} else {
+		r = context_create(&ctx, parm);
+		if (r == SC_SUCCESS) {
+			ctx->shared_refs = 1;
+			ctx->shared_next = shared_contexts;
+			shared_contexts = ctx;
+			*ctx_out = ctx;
+		}
+	}
+	SHARED_CONTEXTS_UNLOCK();
+	return r;
+}
+
+static int context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
+{
+	sc_context_t		*ctx;
+	struct _sc_ctx_options	opts;
+	int			r;
 
 	ctx = calloc(1, sizeof(sc_context_t));
 	if (ctx == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 	memset(&opts, 0, sizeof(opts));
+	ctx->flags = parm->flags;
 
 	/* set the application name if set in the parameter options */
 	if (parm->app_name != NULL)
@@ -715,12 +1118,20 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	if (parm->thread_ctx != NULL)
 		ctx->thread_ctx = parm->thread_ctx;
 	r = sc_mutex_create(ctx, &ctx->mutex);
+	if (r == SC_SUCCESS)
+		r = sc_mutex_create(ctx, &ctx->memcache_mutex);
+	if (r == SC_SUCCESS)
+		r = sc_rwlock_create(ctx, &ctx->readers_lock);
+	if (r == SC_SUCCESS)
+		r = sc_rwlock_create(ctx, &ctx->drivers_lock);
 	if (r != SC_SUCCESS) {
 		sc_release_context(ctx);
 		return r;
 	}
 
 	process_config_file(ctx, &opts);
+	if (opts.debug_async && opts.debug_queue_size > 0 && ctx->debug)
+		_sc_log_queue_start(ctx, opts.debug_queue_size);
 	sc_log(ctx, "==================================="); /* first thing in the log */
 	sc_log(ctx, "opensc version: %s", sc_get_version());
 
@@ -736,6 +1147,31 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 #elif defined(ENABLE_OPENCT)
 	ctx->reader_driver = sc_get_openct_driver();
 #endif
+#ifdef ENABLE_NET_READER
+	/* a server in the 'reader_driver net' block takes the place of the local readers */
+	{
+		scconf_block *net_block = sc_get_conf_block(ctx, "reader_driver", "net", 1);
+
+		if (net_block && scconf_get_str(net_block, "server", NULL))
+			ctx->reader_driver = sc_get_net_driver();
+	}
+#endif
+#ifdef ENABLE_CCID
+	/* the USB CCID readers may be used without pcscd */
+	{
+		scconf_block *ccid_block = sc_get_conf_block(ctx, "reader_driver", "ccid", 1);
+
+		if (ccid_block && scconf_get_bool(ccid_block, "enable", 0))
+			ctx->reader_driver = sc_get_ccid_driver();
+	}
+#endif
+	/* so does a trace file in the 'reader_driver replay' block */
+	{
+		scconf_block *replay_block = sc_get_conf_block(ctx, "reader_driver", "replay", 1);
+
+		if (replay_block && scconf_get_str(replay_block, "trace_file", NULL))
+			ctx->reader_driver = sc_get_replay_driver();
+	}
 
 	load_reader_driver_options(ctx);
 	r = ctx->reader_driver->ops->init(ctx);
@@ -795,6 +1231,22 @@ int sc_release_context(sc_context_t *ctx)
 
 	assert(ctx != NULL);
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+	if (ctx->flags & SC_CTX_FLAG_SHARED) {
+		sc_context_t **p;
+
+		SHARED_CONTEXTS_LOCK();
+		if (ctx->shared_refs > 1) {
+			ctx->shared_refs--;
+			SHARED_CONTEXTS_UNLOCK();
+			return SC_SUCCESS;
+		}
+		for (p = &shared_contexts; *p != NULL; p = &(*p)->shared_next)
+			if (*p == ctx) {
+				*p = ctx->shared_next;
+				break;
+			}
+		SHARED_CONTEXTS_UNLOCK();
+	}
 	while (list_size(&ctx->readers)) {
 		sc_reader_t *rdr = (sc_reader_t *) list_get_at(&ctx->readers, 0);
 		_sc_delete_reader(ctx, rdr);
@@ -803,6 +1255,9 @@ int sc_release_context(sc_context_t *ctx)
 	if (ctx->reader_driver->ops->finish != NULL)
 		ctx->reader_driver->ops->finish(ctx);
 
+	_sc_apdu_trace_close(ctx);
+	_sc_span_trace_close(ctx);
+
 	for (i = 0; ctx->card_drivers[i]; i++) {
 		struct sc_card_driver *drv = ctx->card_drivers[i];
 
@@ -810,9 +1265,23 @@ int sc_release_context(sc_context_t *ctx)
 			_sc_free_atr(ctx, drv);
 		if (drv->dll)
 			sc_dlclose(drv->dll);
+		/* a driver that was never loaded is still its placeholder */
+		if (drv->ops == NULL)
+			free(drv);
+	}
+	while (ctx->loaded_lazy_drivers != NULL) {
+		struct lazy_card_driver *lazy = ctx->loaded_lazy_drivers;
+
+		ctx->loaded_lazy_drivers = lazy->next_loaded;
+		free(lazy);
 	}
+	_sc_free_compiled_atrs(ctx);
 	if (ctx->preferred_language != NULL)
 		free(ctx->preferred_language);
+	sc_rwlock_destroy(ctx, ctx->readers_lock);
+	sc_rwlock_destroy(ctx, ctx->drivers_lock);
+	if (ctx->memcache_mutex != NULL)
+		sc_mutex_destroy(ctx, ctx->memcache_mutex);
 	if (ctx->mutex != NULL) {
 		int r = sc_mutex_destroy(ctx, ctx->mutex);
 		if (r != SC_SUCCESS) {
@@ -822,6 +1291,7 @@ int sc_release_context(sc_context_t *ctx)
 	}
 	if (ctx->conf != NULL)
 		scconf_free(ctx->conf);
+	_sc_log_queue_stop(ctx);
 	if (ctx->debug_file && (ctx->debug_file != stdout && ctx->debug_file != stderr))
 		fclose(ctx->debug_file);
 	if (ctx->debug_filename != NULL)
@@ -838,7 +1308,7 @@ int sc_set_card_driver(sc_context_t *ctx, const char *short_name)
 {
 	int i = 0, match = 0;
 
-	sc_mutex_lock(ctx, ctx->mutex);
+	sc_rwlock_lock(ctx, ctx->drivers_lock, 1);
 	if (short_name == NULL) {
 		ctx->forced_driver = NULL;
 		match = 1;
@@ -846,13 +1316,17 @@ int sc_set_card_driver(sc_context_t *ctx, const char *short_name)
 		struct sc_card_driver *drv = ctx->card_drivers[i];
 
 		if (strcmp(short_name, drv->short_name) == 0) {
+			if (drv->ops == NULL)
+				drv = load_lazy_driver(ctx, i);
+			if (drv == NULL)
+				break;
 			ctx->forced_driver = drv;
 			match = 1;
 			break;
 		}
 		i++;
 	}
-	sc_mutex_unlock(ctx, ctx->mutex);
+	sc_rwlock_unlock(ctx, ctx->drivers_lock, 1);
 	if (match == 0)
 		return SC_ERROR_OBJECT_NOT_FOUND; /* FIXME: invent error */
 	return SC_SUCCESS;
@@ -904,6 +1378,11 @@ int sc_make_cache_dir(sc_context_t *ctx)
 #endif
 			break;
 
+		/* Only the complete name can exist, components are
+		 * stripped when they are missing */
+		if (errno == EEXIST)
+			break;
+
 		if (errno != ENOENT || (sp = strrchr(dirname, '/')) == NULL
 				|| sp == dirname)
 			goto failed;
@@ -931,3 +1410,360 @@ failed:
 	sc_log(ctx, "failed to create cache directory");
 	return SC_ERROR_INTERNAL;
 }
+
+/*
+ * The files of the cache directory that count against cache_max_size and
+ * cache_max_age are listed in "<cache_dir>/cache.idx", one line per file:
+ * the time it was last used, its size and its name. Entries are refreshed
+ * at most once a day, so that reading a cached file rarely writes the index.
+ */
+#define SC_CACHE_INDEX_NAME	"cache.idx"
+#define SC_CACHE_TOUCH_INTERVAL	(24 * 60 * 60)
+
+struct cache_entry {
+	unsigned long used;
+	unsigned long size;
+	char name[256];
+};
+
+static int cache_index_load(const char *fname, struct cache_entry **entries, size_t *count)
+{
+	struct cache_entry e, *tmp;
+	size_t alloc = 0;
+	FILE *f;
+
+	*entries = NULL;
+	*count = 0;
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return SC_SUCCESS;
+	while (fscanf(f, "%lu %lu %255[^\n]\n", &e.used, &e.size, e.name) == 3) {
+		if (*count == alloc) {
+			alloc = alloc ? 2 * alloc : 32;
+			tmp = realloc(*entries, alloc * sizeof(e));
+			if (tmp == NULL) {
+				fclose(f);
+				free(*entries);
+				*entries = NULL;
+				return SC_ERROR_OUT_OF_MEMORY;
+			}
+			*entries = tmp;
+		}
+		(*entries)[(*count)++] = e;
+	}
+	fclose(f);
+	return SC_SUCCESS;
+}
+
+static void cache_index_store(const char *fname, const struct cache_entry *entries, size_t count)
+{
+	char tmpname[PATH_MAX];
+	size_t i;
+	FILE *f;
+	int r;
+
+	r = snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+	if (r < 0 || (size_t)r >= sizeof(tmpname))
+		return;
+	f = fopen(tmpname, "w");
+	if (f == NULL)
+		return;
+	for (i = 0; i < count; i++)
+		fprintf(f, "%lu %lu %s\n", entries[i].used, entries[i].size, entries[i].name);
+	r = ferror(f);
+	if (fclose(f) != 0 || r) {
+		remove(tmpname);
+		return;
+	}
+#ifdef _WIN32
+	remove(fname);
+#endif
+	if (rename(tmpname, fname) != 0)
+		remove(tmpname);
+}
+
+static void cache_evict(sc_context_t *ctx, const char *dir, struct cache_entry *entries,
+		size_t *count, size_t keep, unsigned long now)
+{
+	char path[PATH_MAX];
+	unsigned long long total = 0;
+	size_t i, oldest;
+
+	for (i = 0; i < *count; i++)
+		total += entries[i].size;
+
+	while (*count > 1) {
+		oldest = keep == 0 ? 1 : 0;
+		for (i = 0; i < *count; i++)
+			if (i != keep && entries[i].used < entries[oldest].used)
+				oldest = i;
+		if (!(ctx->cache_max_age && now - entries[oldest].used > ctx->cache_max_age * 86400UL)
+				&& !(ctx->cache_max_size && total > ctx->cache_max_size * 1024ULL))
+			break;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, entries[oldest].name);
+		sc_log(ctx, "evicting '%s' from the cache", entries[oldest].name);
+		remove(path);
+		total -= entries[oldest].size;
+		entries[oldest] = entries[--(*count)];
+		if (keep == *count)
+			keep = oldest;
+	}
+}
+
+void _sc_cache_used(sc_context_t *ctx, const char *fname)
+{
+	char dir[PATH_MAX], index[PATH_MAX];
+	struct cache_entry *entries;
+	struct stat st;
+	const char *name;
+	unsigned long now = (unsigned long) time(NULL);
+	size_t count, i, len;
+	int exists;
+
+	if (!ctx->cache_max_size && !ctx->cache_max_age)
+		return;
+	if (sc_get_cache_dir(ctx, dir, sizeof(dir)) != SC_SUCCESS)
+		return;
+	len = strlen(dir);
+	if (strncmp(fname, dir, len) != 0 || (fname[len] != '/' && fname[len] != '\\'))
+		return;
+	name = fname + len + 1;
+	if (strlen(name) >= sizeof(entries->name) || strchr(name, '\n') != NULL)
+		return;
+	if (snprintf(index, sizeof(index), "%s/%s", dir, SC_CACHE_INDEX_NAME) >= (int)sizeof(index))
+		return;
+	exists = stat(fname, &st) == 0;
+
+	if (cache_index_load(index, &entries, &count) != SC_SUCCESS)
+		return;
+	for (i = 0; i < count; i++)
+		if (!strcmp(entries[i].name, name))
+			break;
+
+	if (i < count && exists && entries[i].size == (unsigned long) st.st_size
+			&& now - entries[i].used < SC_CACHE_TOUCH_INTERVAL) {
+		free(entries);
+		return;
+	}
+
+	if (i == count && exists) {
+		struct cache_entry *tmp = realloc(entries, (count + 1) * sizeof(*entries));
+
+		if (tmp == NULL) {
+			free(entries);
+			return;
+		}
+		entries = tmp;
+		strcpy(entries[count].name, name);
+		count++;
+	}
+	if (exists) {
+		entries[i].used = now;
+		entries[i].size = st.st_size;
+		cache_evict(ctx, dir, entries, &count, i, now);
+	} else if (i < count) {
+		entries[i] = entries[--count];
+	}
+
+	cache_index_store(index, entries, count);
+	free(entries);
+}
+
+/*
+ * Caches kept in memory, see _sc_memcache_add(). Their counters are kept
+ * per kind of cache, by name; the accounts of the caches holding entries
+ * are listed in ctx->memcache_accounts.
+ */
+static struct sc_cache_stats *memcache_stats(sc_context_t *ctx, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < SC_CACHE_STATS_MAX; i++) {
+		struct sc_cache_stats *st = &ctx->cache_stats[i];
+
+		if (st->name == NULL) {
+			st->name = name;
+			return st;
+		}
+		if (!strcmp(st->name, name))
+			return st;
+	}
+	return NULL;
+}
+
+/* Hit rate in 1/1000, 1/2 for a kind of cache not used yet */
+static unsigned long memcache_hit_rate(const struct sc_cache_stats *st)
+{
+	if (st == NULL)
+		return 0;
+	return (st->hits * 1000 + 500) / (st->hits + st->misses + 1);
+}
+
+static void memcache_sub(size_t *value, size_t n)
+{
+	*value = *value > n ? *value - n : 0;
+}
+
+/* Called with memcache_mutex held */
+static void memcache_update(sc_context_t *ctx, struct sc_memcache_account *acc,
+		long bytes, long entries)
+{
+	struct sc_cache_stats *st = memcache_stats(ctx, acc->name);
+	struct sc_memcache_account **pa;
+	size_t n;
+
+	if (acc->entries == 0 && entries > 0) {
+		acc->next = ctx->memcache_accounts;
+		ctx->memcache_accounts = acc;
+	}
+	if (bytes >= 0) {
+		acc->bytes += bytes;
+		ctx->cache_memory_used += bytes;
+		if (st != NULL)
+			st->bytes += bytes;
+	} else {
+		memcache_sub(&acc->bytes, -bytes);
+		memcache_sub(&ctx->cache_memory_used, -bytes);
+		if (st != NULL)
+			memcache_sub(&st->bytes, -bytes);
+	}
+	if (entries < 0 && (unsigned long) -entries > acc->entries)
+		entries = -(long) acc->entries;
+	acc->entries += entries;
+	if (st != NULL)
+		st->entries += entries;
+	if (acc->trim > acc->bytes)
+		acc->trim = acc->bytes;
+	if (acc->entries != 0)
+		return;
+
+	/* empty: whatever was not given back is gone too */
+	n = acc->bytes;
+	memcache_sub(&ctx->cache_memory_used, n);
+	if (st != NULL)
+		memcache_sub(&st->bytes, n);
+	acc->bytes = 0;
+	acc->trim = 0;
+	for (pa = &ctx->memcache_accounts; *pa != NULL; pa = &(*pa)->next)
+		if (*pa == acc) {
+			*pa = acc->next;
+			break;
+		}
+	acc->next = NULL;
+}
+
+/* Asks the evictable caches of the kinds with the lowest hit rate, the
+ * largest first, to drop what is beyond the budget. Called with
+ * memcache_mutex held. */
+static void memcache_enforce(sc_context_t *ctx)
+{
+	struct sc_memcache_account *a, *victim;
+	size_t pending = 0, excess, take;
+	unsigned long rate, victim_rate = 0;
+
+	for (a = ctx->memcache_accounts; a != NULL; a = a->next)
+		pending += a->trim;
+	if (ctx->cache_memory_used <= ctx->cache_memory_max + pending)
+		return;
+	excess = ctx->cache_memory_used - ctx->cache_memory_max - pending;
+
+	while (excess > 0) {
+		victim = NULL;
+		for (a = ctx->memcache_accounts; a != NULL; a = a->next) {
+			if (!a->evictable || a->bytes <= a->trim)
+				continue;
+			rate = memcache_hit_rate(memcache_stats(ctx, a->name));
+			if (victim == NULL || rate < victim_rate || (rate == victim_rate
+					&& a->bytes - a->trim > victim->bytes - victim->trim)) {
+				victim = a;
+				victim_rate = rate;
+			}
+		}
+		if (victim == NULL)
+			break;
+		take = victim->bytes - victim->trim;
+		if (take > excess)
+			take = excess;
+		victim->trim += take;
+		excess -= take;
+	}
+}
+
+void _sc_memcache_init(struct sc_memcache_account *acc, const char *name, int evictable)
+{
+	memset(acc, 0, sizeof(*acc));
+	acc->name = name;
+	acc->evictable = evictable;
+}
+
+void _sc_memcache_add(sc_context_t *ctx, struct sc_memcache_account *acc,
+		long bytes, long entries)
+{
+	if (ctx == NULL || acc == NULL || acc->name == NULL)
+		return;
+	sc_mutex_lock(ctx, ctx->memcache_mutex);
+	memcache_update(ctx, acc, bytes, entries);
+	if (bytes > 0 && ctx->cache_memory_max)
+		memcache_enforce(ctx);
+	sc_mutex_unlock(ctx, ctx->memcache_mutex);
+}
+
+void _sc_memcache_evicted(sc_context_t *ctx, struct sc_memcache_account *acc,
+		size_t bytes)
+{
+	struct sc_cache_stats *st;
+
+	if (ctx == NULL || acc == NULL || acc->name == NULL)
+		return;
+	sc_mutex_lock(ctx, ctx->memcache_mutex);
+	memcache_sub(&acc->trim, bytes);
+	memcache_update(ctx, acc, -(long) bytes, -1);
+	st = memcache_stats(ctx, acc->name);
+	if (st != NULL)
+		st->evictions++;
+	sc_mutex_unlock(ctx, ctx->memcache_mutex);
+}
+
+void _sc_memcache_lookup(sc_context_t *ctx, struct sc_memcache_account *acc, int hit)
+{
+	struct sc_cache_stats *st;
+
+	if (ctx == NULL || acc == NULL || acc->name == NULL)
+		return;
+	sc_mutex_lock(ctx, ctx->memcache_mutex);
+	st = memcache_stats(ctx, acc->name);
+	if (st != NULL) {
+		if (hit)
+			st->hits++;
+		else
+			st->misses++;
+	}
+	sc_mutex_unlock(ctx, ctx->memcache_mutex);
+}
+
+size_t _sc_memcache_trim(sc_context_t *ctx, struct sc_memcache_account *acc)
+{
+	size_t trim;
+
+	if (ctx == NULL || acc == NULL)
+		return 0;
+	sc_mutex_lock(ctx, ctx->memcache_mutex);
+	trim = acc->trim;
+	sc_mutex_unlock(ctx, ctx->memcache_mutex);
+	return trim;
+}
+
+int sc_get_cache_stats(sc_context_t *ctx, struct sc_cache_stats *stats, size_t *count)
+{
+	size_t i;
+
+	if (ctx == NULL || stats == NULL || count == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	sc_mutex_lock(ctx, ctx->memcache_mutex);
+	for (i = 0; i < *count && i < SC_CACHE_STATS_MAX && ctx->cache_stats[i].name != NULL; i++)
+		stats[i] = ctx->cache_stats[i];
+	sc_mutex_unlock(ctx, ctx->memcache_mutex);
+	*count = i;
+	return SC_SUCCESS;
+}
@@ -326,6 +326,85 @@ static int dnie_read_certificate(sc_card_t * card, char *certpath, X509 ** cert)
 	LOG_FUNC_RETURN(card->ctx, res);
 }
 
+/**
+ * Compose an RSA key from the static data published by DGP.
+ *
+ * @param n modulus
+ * @param e public exponent
+ * @param d private exponent, or NULL for a public key
+ * @return composed key, or NULL on error
+ */
+static EVP_PKEY *dnie_compose_rsa_key(u8 * n, size_t n_len, u8 * e,
+				      size_t e_len, u8 * d, size_t d_len)
+{
+	EVP_PKEY *key = EVP_PKEY_new();
+	RSA *rsa = RSA_new();
+
+	if (!key || !rsa)
+		goto compose_error;
+	rsa->n = BN_bin2bn(n, n_len, rsa->n);
+	rsa->e = BN_bin2bn(e, e_len, rsa->e);
+	if (d)
+		rsa->d = BN_bin2bn(d, d_len, rsa->d);
+	if (!rsa->n || !rsa->e || (d && !rsa->d))
+		goto compose_error;
+	if (!EVP_PKEY_assign_RSA(key, rsa))
+		goto compose_error;
+	return key;
+
+ compose_error:
+	if (rsa)
+		RSA_free(rsa);
+	if (key)
+		EVP_PKEY_free(key);
+	return NULL;
+}
+
+/**
+ * Return a new reference to a key composed once per process.
+ *
+ * The keys handed out by this provider are built from static data, so
+ * they are composed on first use and then shared read-only by every
+ * secure channel. Each caller gets its own reference and releases it
+ * with EVP_PKEY_free() as before.
+ *
+ * @param card Pointer to card driver structure
+ * @param cache where the shared key is kept
+ * @param key where to store the new reference
+ * @param private compose the IFD private key instead of the root CA key
+ * @return SC_SUCCESS if ok; else error code
+ */
+static int dnie_get_cached_key(sc_card_t * card, EVP_PKEY ** cache,
+			       EVP_PKEY ** key, int private)
+{
+	int res = SC_SUCCESS;
+
+	sc_mutex_lock(card->ctx, card->ctx->mutex);
+	if (!*cache) {
+		if (private)
+			*cache = dnie_compose_rsa_key(ifd_modulus,
+					sizeof(ifd_modulus),
+					ifd_public_exponent,
+					sizeof(ifd_public_exponent),
+					ifd_private_exponent,
+					sizeof(ifd_private_exponent));
+		else
+			*cache = dnie_compose_rsa_key(icc_root_ca_modulus,
+					sizeof(icc_root_ca_modulus),
+					icc_root_ca_public_exponent,
+					sizeof(icc_root_ca_public_exponent),
+					NULL, 0);
+	}
+	if (*cache) {
+		CRYPTO_add(&(*cache)->references, 1, CRYPTO_LOCK_EVP_PKEY);
+		*key = *cache;
+	} else {
+		res = SC_ERROR_INTERNAL;
+	}
+	sc_mutex_unlock(card->ctx, card->ctx->mutex);
+	return res;
+}
+
 /************ implementation of cwa provider methods **************/
 
 /**
@@ -338,29 +417,13 @@ static int dnie_read_certificate(sc_card_t * card, char *certpath, X509 ** cert)
  */
 static int dnie_get_root_ca_pubkey(sc_card_t * card, EVP_PKEY ** root_ca_key)
 {
-	int res=SC_SUCCESS;
-	RSA *root_ca_rsa=NULL;
-	LOG_FUNC_CALLED(card->ctx);
+	static EVP_PKEY *cached_root_ca_key = NULL;
+	int res = SC_SUCCESS;
 
+	LOG_FUNC_CALLED(card->ctx);
 	/* compose root_ca_public key with data provided by Dnie Manual */
-	*root_ca_key = EVP_PKEY_new();
-	root_ca_rsa = RSA_new();
-	if (!*root_ca_key || !root_ca_rsa) {
-		sc_log(card->ctx, "Cannot create data for root CA public key");
-		return SC_ERROR_OUT_OF_MEMORY;
-	}
-	root_ca_rsa->n = BN_bin2bn(icc_root_ca_modulus,
-				   sizeof(icc_root_ca_modulus), root_ca_rsa->n);
-	root_ca_rsa->e = BN_bin2bn(icc_root_ca_public_exponent,
-				   sizeof(icc_root_ca_public_exponent),
-				   root_ca_rsa->e);
-	res = EVP_PKEY_assign_RSA(*root_ca_key, root_ca_rsa);
-	if (!res) {
-		if (*root_ca_key)
-			EVP_PKEY_free(*root_ca_key);	/*implies root_ca_rsa free() */
-		sc_log(card->ctx, "Cannot compose root CA public key");
-		return SC_ERROR_INTERNAL;
-	}
+	res = dnie_get_cached_key(card, &cached_root_ca_key, root_ca_key, 0);
+	LOG_TEST_RET(card->ctx, res, "Cannot compose root CA public key");
 	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 }
 
@@ -414,8 +477,8 @@ static int dnie_get_cvc_ifd_cert(sc_card_t * card, u8 ** cert, size_t * length)
  * As this is a local (in memory) provider, just get data specified in
  * DNIe's manual and compose an OpenSSL private key structure
  *
- * Notice that resulting data should be keept in memory as little as possible
- * Erasing them once used
+ * The key is composed once and shared; it only holds the static data
+ * that is compiled into this file anyway
  *
  * @param card pointer to card driver structure
  * @param ifd_privkey where to store IFD private key
@@ -423,32 +486,13 @@ static int dnie_get_cvc_ifd_cert(sc_card_t * card, u8 ** cert, size_t * length)
  */
 static int dnie_get_ifd_privkey(sc_card_t * card, EVP_PKEY ** ifd_privkey)
 {
-	RSA *ifd_rsa=NULL;
-	int res=SC_SUCCESS;
+	static EVP_PKEY *cached_ifd_privkey = NULL;
+	int res = SC_SUCCESS;
 
 	LOG_FUNC_CALLED(card->ctx);
-
 	/* compose ifd_private key with data provided in Annex 3 of DNIe Manual */
-	*ifd_privkey = EVP_PKEY_new();
-	ifd_rsa = RSA_new();
-	if (!*ifd_privkey || !ifd_rsa) {
-		sc_log(card->ctx, "Cannot create data for IFD private key");
-		return SC_ERROR_OUT_OF_MEMORY;
-	}
-	ifd_rsa->n = BN_bin2bn(ifd_modulus, sizeof(ifd_modulus), ifd_rsa->n);
-	ifd_rsa->e =
-	    BN_bin2bn(ifd_public_exponent, sizeof(ifd_public_exponent),
-		      ifd_rsa->e);
-	ifd_rsa->d =
-	    BN_bin2bn(ifd_private_exponent, sizeof(ifd_private_exponent),
-		      ifd_rsa->d);
-	res = EVP_PKEY_assign_RSA(*ifd_privkey, ifd_rsa);
-	if (!res) {
-		if (*ifd_privkey)
-			EVP_PKEY_free(*ifd_privkey);	/* implies ifd_rsa free() */
-		sc_log(card->ctx, "Cannot compose IFD private key");
-		return SC_ERROR_INTERNAL;
-	}
+	res = dnie_get_cached_key(card, &cached_ifd_privkey, ifd_privkey, 1);
+	LOG_TEST_RET(card->ctx, res, "Cannot compose IFD private key");
 	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 }
 
@@ -836,6 +880,11 @@ static int dnie_wrap_apdu(sc_card_t * card, sc_apdu_t * apdu)
 		}
 		/* send apdu via envelope() cmd if needed */
 		res = dnie_transmit_apdu_internal(card, &wrapped);
+		/* the encoded data was allocated by cwa_encode_apdu() */
+		if (wrapped.data != apdu->data) {
+			free((u8 *)wrapped.data);
+			wrapped.data = apdu->data;
+		}
 		/* check for tx errors */
 		LOG_TEST_RET(ctx, res, "Error in dnie_transmit_apdu process");
 
@@ -41,7 +41,10 @@
      int rsa_key_ref;    /**< Key id reference being used in sec operation */
      u8 *cache;      /**< Cache buffer for read_binary() operation */
      size_t cachelen;    /**< length of cache buffer */
+     size_t cacheoff;    /**< file offset of cache buffer */
+     int cacheeof;       /**< cache buffer reaches end of file */
      cwa_provider_t *cwa_provider;
+     int keep_secure_channel;    /**< Do not establish SM again from reset on each PIN verify */
 #ifdef ENABLE_DNIE_UI
 	 struct ui_context ui_ctx;
 #endif
@@ -29,9 +29,11 @@
 
 #ifdef ENABLE_OPENSSL		/* empty file without openssl */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 
 #include "opensc.h"
 #include "cardctl.h"
@@ -39,6 +41,7 @@
 #include <openssl/x509.h>
 #include <openssl/des.h>
 #include <openssl/rand.h>
+#include <openssl/evp.h>
 #include "cwa-dnie.h"
 
 #include "cwa14890.h"
@@ -260,14 +263,15 @@ static int cwa_parse_tlv(sc_card_t * card,
 	if (!data || !tlv_array)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 
-	/* create buffer and copy data into */
-	buffer = calloc(datalen, sizeof(u8));
-	if (!buffer)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-	memcpy(buffer, data, datalen);
+	/* the TLVs point into the response itself */
+	buffer = data;
 	for (n = 0; n < datalen; n += next) {
 		cwa_tlv_t *tlv = NULL;	/* pointer to TLV structure to store info */
 		size_t j = 2;	/* TLV has at least two bytes */
+		/* tag, length byte and the length bytes that follow it */
+		if (n + 2 > datalen || ((buffer[n + 1] & 0x80)
+				&& n + 2 + MAX(buffer[n + 1] & 0x0F, 1) > datalen))
+			LOG_FUNC_RETURN(ctx, SC_ERROR_WRONG_LENGTH);
 		switch (*(buffer + n)) {
 		case CWA_SM_PLAIN_TAG:
 			tlv = &tlv_array[0];
@@ -317,6 +321,8 @@ static int cwa_parse_tlv(sc_card_t * card,
 				LOG_FUNC_RETURN(ctx, SC_ERROR_WRONG_LENGTH);
 			}
 		}
+		if (n + j + tlv->len > datalen)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_WRONG_LENGTH);
 		tlv->data = buffer + n + j;
 		tlv->buflen = j + tlv->len;;
 		sc_log(ctx, "Found Tag: '0x%02X': Length: '%d 'Value:\n%s",
@@ -1008,6 +1014,100 @@ static int cwa_verify_internal_auth(sc_card_t * card,
 	LOG_FUNC_RETURN(ctx, res);
 }
 
+/* size of a record of the "<ATR>.cwa" cache file: ICC serial number and
+ * SHA-256 digest of the ICC certificate chain */
+#define CWA_CHAIN_RECORD_LEN	(8 + 32)
+
+/**
+ * Compose the record of a verified ICC certificate chain.
+ *
+ * @param sn_icc card serial number, 8 bytes
+ * @param sub_ca_cert icc intermediate CA certificate
+ * @param icc_cert icc certificate
+ * @param record where to store CWA_CHAIN_RECORD_LEN bytes
+ * @return SC_SUCCESS if ok; else error code
+ */
+static int cwa_icc_chain_record(u8 * sn_icc,
+				X509 * sub_ca_cert, X509 * icc_cert, u8 * record)
+{
+	X509 *certs[2];
+	EVP_MD_CTX *md_ctx;
+	unsigned int len = 0;
+	int i, res = SC_SUCCESS;
+
+	certs[0] = sub_ca_cert;
+	certs[1] = icc_cert;
+	md_ctx = EVP_MD_CTX_create();
+	if (!md_ctx)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (!EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL))
+		res = SC_ERROR_INTERNAL;
+	for (i = 0; i < 2 && res == SC_SUCCESS; i++) {
+		unsigned char *der = NULL;
+		int derlen = i2d_X509(certs[i], &der);
+
+		if (derlen <= 0 || !EVP_DigestUpdate(md_ctx, der, derlen))
+			res = SC_ERROR_INTERNAL;
+		if (der)
+			OPENSSL_free(der);
+	}
+	if (res == SC_SUCCESS && !EVP_DigestFinal_ex(md_ctx, record + 8, &len))
+		res = SC_ERROR_INTERNAL;
+	EVP_MD_CTX_destroy(md_ctx);
+	memcpy(record, sn_icc, 8);
+	return res;
+}
+
+/**
+ * Tell whether the ICC certificate chain is the one verified the last time.
+ *
+ * The last chain verified for the ATR is recorded in the file cache, so
+ * that the RSA verification is only done when the card or its certificates
+ * change.
+ *
+ * @param card pointer to card data
+ * @param record record of the chain, as made by cwa_icc_chain_record()
+ * @return 1 if the chain was verified before; else 0
+ */
+static int cwa_icc_chain_verified(sc_card_t * card, const u8 * record)
+{
+	char fname[PATH_MAX];
+	u8 cached[CWA_CHAIN_RECORD_LEN];
+	size_t len = 0;
+	FILE *f;
+
+	if (!_sc_card_use_file_cache(card->ctx)
+	    || _sc_card_cache_filename(card, "cwa", fname, sizeof(fname)) != SC_SUCCESS)
+		return 0;
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return 0;
+	len = fread(cached, 1, sizeof(cached), f);
+	fclose(f);
+	_sc_cache_used(card->ctx, fname);
+	return len == sizeof(cached) && !memcmp(cached, record, sizeof(cached));
+}
+
+static void cwa_icc_chain_store(sc_card_t * card, const u8 * record)
+{
+	char fname[PATH_MAX];
+	FILE *f;
+
+	if (!_sc_card_use_file_cache(card->ctx)
+	    || _sc_card_cache_filename(card, "cwa", fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	f = fopen(fname, "wb");
+	if (f == NULL && sc_make_cache_dir(card->ctx) == SC_SUCCESS)
+		f = fopen(fname, "wb");
+	if (f == NULL) {
+		sc_log(card->ctx, "cannot write '%s'", fname);
+		return;
+	}
+	fwrite(record, 1, CWA_CHAIN_RECORD_LEN, f);
+	fclose(f);
+	_sc_cache_used(card->ctx, fname);
+}
+
 /**
  * Create Secure Messaging channel.
  *
@@ -1154,14 +1254,25 @@ int cwa_create_secure_channel(sc_card_t * card,
 	/* Notice that Some implementations doesn't verify cert chain
 	 * but simply verifies that icc_cert is a valid certificate */
 	if (ca_cert) {
-		sc_log(ctx, "Verifying ICC certificate chain");
-		res =
-		    cwa_verify_icc_certificates(card, provider, ca_cert,
-						icc_cert);
-		if (res != SC_SUCCESS) {
-			res = SC_ERROR_SM_AUTHENTICATION_FAILED;
-			msg = "Icc Certificates verification failed";
-			goto csc_end;
+		u8 record[CWA_CHAIN_RECORD_LEN];
+		int have_record =
+		    cwa_icc_chain_record(sn_icc, ca_cert, icc_cert,
+					 record) == SC_SUCCESS;
+
+		if (have_record && cwa_icc_chain_verified(card, record)) {
+			sc_log(ctx, "ICC certificate chain verified before");
+		} else {
+			sc_log(ctx, "Verifying ICC certificate chain");
+			res =
+			    cwa_verify_icc_certificates(card, provider, ca_cert,
+							icc_cert);
+			if (res != SC_SUCCESS) {
+				res = SC_ERROR_SM_AUTHENTICATION_FAILED;
+				msg = "Icc Certificates verification failed";
+				goto csc_end;
+			}
+			if (have_record)
+				cwa_icc_chain_store(card, record);
 		}
 	} else {
 		sc_log(ctx, "Cannot verify Certificate chain. skip step");
@@ -1418,9 +1529,9 @@ int cwa_create_secure_channel(sc_card_t * card,
 int cwa_encode_apdu(sc_card_t * card,
 		    cwa_provider_t * provider, sc_apdu_t * from, sc_apdu_t * to)
 {
-	u8 *apdubuf;		/* to store resulting apdu */
+	u8 *apdubuf = NULL;	/* to store resulting apdu */
 	size_t apdulen;
-	u8 *ccbuf;		/* where to store data to eval cryptographic checksum CC */
+	u8 *ccbuf = NULL;	/* where to store data to eval cryptographic checksum CC */
 	size_t cclen = 0;
 	u8 macbuf[8];		/* to store and compute CC */
 	DES_key_schedule k1;
@@ -1434,10 +1545,6 @@ int cwa_encode_apdu(sc_card_t * card,
 	u8 *msgbuf = NULL;	/* to encrypt apdu data */
 	u8 *cryptbuf = NULL;
 
-	/* reserve extra bytes for padding and tlv header */
-	msgbuf = calloc(12 + from->lc, sizeof(u8));	/* to encrypt apdu data */
-	cryptbuf = calloc(12 + from->lc, sizeof(u8));
-
 	/* mandatory check */
 	if (!card || !card->ctx || !provider)
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -1450,8 +1557,6 @@ int cwa_encode_apdu(sc_card_t * card,
 		LOG_FUNC_RETURN(ctx, SC_ERROR_SM_NOT_INITIALIZED);
 	if (sm_session->state != CWA_SM_ACTIVE)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_SM_INVALID_LEVEL);
-	if (!msgbuf || !cryptbuf)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 
 	/* check if APDU is already encoded */
 	if ((from->cla & 0x0C) != 0) {
@@ -1478,6 +1583,14 @@ int cwa_encode_apdu(sc_card_t * card,
 	/* para debugging end */
 #endif
 
+	/* reserve extra bytes for padding and tlv header */
+	msgbuf = calloc(12 + from->lc, sizeof(u8));	/* to encrypt apdu data */
+	cryptbuf = calloc(12 + from->lc, sizeof(u8));
+	if (!msgbuf || !cryptbuf) {
+		res = SC_ERROR_OUT_OF_MEMORY;
+		goto encode_end;
+	}
+
 	/* call provider pre-operation method */
 	if (provider->cwa_encode_pre_ops) {
 		res = provider->cwa_encode_pre_ops(card, provider, from, to);
@@ -1498,8 +1611,10 @@ int cwa_encode_apdu(sc_card_t * card,
 	ccbuf =
 	    calloc(MAX(SC_MAX_APDU_BUFFER_SIZE, 20 + from->datalen),
 		   sizeof(u8));
-	if (!apdubuf || !ccbuf)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	if (!apdubuf || !ccbuf) {
+		res = SC_ERROR_OUT_OF_MEMORY;
+		goto encode_end;
+	}
 
 	/* set up data on destination apdu */
 	to->cse = SC_APDU_CASE_3_SHORT;
@@ -1610,6 +1725,15 @@ int cwa_encode_apdu(sc_card_t * card,
 	res = SC_SUCCESS;
 
  encode_end:
+	/* only apdubuf is handed over, as the data of the encoded APDU */
+	if (res != SC_SUCCESS && apdubuf)
+		free(apdubuf);
+	if (ccbuf)
+		free(ccbuf);
+	if (cryptbuf)
+		free(cryptbuf);
+	if (msgbuf)
+		free(msgbuf);
 	if (msg)
 		sc_log(ctx, msg);
 	LOG_FUNC_RETURN(ctx, res);
@@ -1792,7 +1916,7 @@ int cwa_decode_response(sc_card_t * card,
 
 	/* check evaluated mac with provided by apdu response */
 
-	res = memcmp(m_tlv->data, macbuf, 4);	/* check first 4 bytes */
+	res = sc_mem_cmp_ct(m_tlv->data, macbuf, 4);	/* check first 4 bytes */
 	if (res != 0) {
 		msg = "Error in MAC CC checking: value doesn't match";
 		res = SC_ERROR_SM_ENCRYPT_FAILED;
@@ -61,7 +61,7 @@
  * are not supported (tag 0x84)
  */
 typedef struct cwa_tlv_st {
-	u8 *buf;		/** local copy of TLV byte array */
+	u8 *buf;		/** TLV byte array, within the parsed data */
 	size_t buflen;		/** lengt of buffer */
 	unsigned int tag;	/** tag ID */
 	size_t len;		/** lenght of data field */
@@ -21,8 +21,10 @@
 #include "config.h"
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "internal.h"
 #include "asn1.h"
@@ -129,12 +131,187 @@ parse_dir_record(sc_card_t *card, u8 ** buf, size_t *buflen, int rec_nr)
 }
 
 
-int sc_enum_apps(sc_card_t *card)
+/*
+ * The content of EF(DIR) is kept in the file cache, in
+ * "<cache_dir>/<ATR>.<serial>.dir":
+ *
+ *   "OSCDIR1"           magic and version
+ *   u8                  EF structure
+ *   u32                 size of the EF as given by the SELECT
+ *   then until the end: the records, or the whole transparent content
+ *     u16 len, bytes
+ *
+ * Numbers are big endian. The cache is only used when the serial number
+ * is already known to the driver, and when the structure and the size of
+ * the EF still match; sc_update_dir() removes it.
+ */
+#define DIR_CACHE_MAGIC		"OSCDIR1"
+#define DIR_CACHE_MAGIC_LEN	7
+#define DIR_CACHE_HDR_LEN	(DIR_CACHE_MAGIC_LEN + 5)
+
+static int dir_cache_filename(sc_card_t *card, char *buf, size_t bufsize)
+{
+	char suffix[SC_MAX_SERIALNR * 2 + 5];
+	int r;
+
+	if (!_sc_card_use_file_cache(card->ctx) || card->serialnr.len == 0)
+		return SC_ERROR_NOT_SUPPORTED;
+	r = sc_bin_to_hex(card->serialnr.value, card->serialnr.len, suffix, sizeof(suffix) - 4, 0);
+	if (r != SC_SUCCESS)
+		return r;
+	strcat(suffix, ".dir");
+	return _sc_card_cache_filename(card, suffix, buf, bufsize);
+}
+
+/* Parses the cached content of EF(DIR); fails if it does not fit the EF */
+static int dir_cache_read(sc_card_t *card)
+{
+	char fname[PATH_MAX];
+	u8 *buf = NULL, *p;
+	size_t len, rec_len, ef_size;
+	long size;
+	int rec_nr = 0, r;
+	FILE *f;
+
+	if (dir_cache_filename(card, fname, sizeof(fname)) != SC_SUCCESS)
+		return SC_ERROR_FILE_NOT_FOUND;
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	r = SC_ERROR_FILE_NOT_FOUND;
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < DIR_CACHE_HDR_LEN
+			|| fseek(f, 0, SEEK_SET) != 0)
+		goto out;
+	len = size;
+	buf = malloc(len);
+	if (buf == NULL || fread(buf, 1, len, f) != len)
+		goto out;
+
+	p = buf + DIR_CACHE_MAGIC_LEN;
+	ef_size = ((size_t)p[1] << 24) | ((size_t)p[2] << 16) | ((size_t)p[3] << 8) | p[4];
+	if (memcmp(buf, DIR_CACHE_MAGIC, DIR_CACHE_MAGIC_LEN) != 0
+			|| p[0] != card->ef_dir->ef_structure || ef_size != card->ef_dir->size)
+		goto out;
+
+	p = buf + DIR_CACHE_HDR_LEN;
+	len -= DIR_CACHE_HDR_LEN;
+	/* check the framing first, so that nothing is parsed from a broken file */
+	while (len >= 2 && (size_t)((p[0] << 8) | p[1]) <= len - 2) {
+		rec_len = (p[0] << 8) | p[1];
+		p += 2 + rec_len;
+		len -= 2 + rec_len;
+	}
+	if (len != 0)
+		goto out;
+
+	p = buf + DIR_CACHE_HDR_LEN;
+	len = size - DIR_CACHE_HDR_LEN;
+	while (len > 0) {
+		u8 *rec = p + 2;
+
+		rec_len = (p[0] << 8) | p[1];
+		p += 2 + rec_len;
+		len -= 2 + rec_len;
+		rec_nr++;
+		while (rec_len > 0) {
+			if (card->app_count == SC_MAX_CARD_APPS) {
+				sc_log(card->ctx, "Too many applications on card");
+				break;
+			}
+			if (parse_dir_record(card, &rec, &rec_len,
+					card->ef_dir->ef_structure == SC_FILE_EF_TRANSPARENT ? -1 : rec_nr))
+				break;
+			/* a record holds a single application */
+			if (card->ef_dir->ef_structure != SC_FILE_EF_TRANSPARENT)
+				break;
+		}
+	}
+	sc_log(card->ctx, "EF(DIR) from the cache, %i applications", card->app_count);
+	_sc_cache_used(card->ctx, fname);
+	r = SC_SUCCESS;
+out:
+	fclose(f);
+	free(buf);
+	return r;
+}
+
+/* Appends a record to the image of the cache file */
+static void dir_cache_add(u8 **cache, size_t *cache_len, const u8 *data, size_t len)
+{
+	u8 *tmp;
+
+	if (*cache == NULL)
+		return;
+	if (len > 0xFFFF || (tmp = realloc(*cache, *cache_len + 2 + len)) == NULL) {
+		free(*cache);
+		*cache = NULL;
+		return;
+	}
+	*cache = tmp;
+	tmp += *cache_len;
+	tmp[0] = (len >> 8) & 0xFF;
+	tmp[1] = len & 0xFF;
+	memcpy(tmp + 2, data, len);
+	*cache_len += 2 + len;
+}
+
+static u8 *dir_cache_new(sc_card_t *card, size_t *cache_len)
+{
+	char fname[PATH_MAX];
+	size_t size = card->ef_dir->size;
+	u8 *cache;
+
+	if (dir_cache_filename(card, fname, sizeof(fname)) != SC_SUCCESS)
+		return NULL;
+	cache = malloc(DIR_CACHE_HDR_LEN);
+	if (cache == NULL)
+		return NULL;
+	memcpy(cache, DIR_CACHE_MAGIC, DIR_CACHE_MAGIC_LEN);
+	cache[DIR_CACHE_MAGIC_LEN] = card->ef_dir->ef_structure;
+	cache[DIR_CACHE_MAGIC_LEN + 1] = (size >> 24) & 0xFF;
+	cache[DIR_CACHE_MAGIC_LEN + 2] = (size >> 16) & 0xFF;
+	cache[DIR_CACHE_MAGIC_LEN + 3] = (size >> 8) & 0xFF;
+	cache[DIR_CACHE_MAGIC_LEN + 4] = size & 0xFF;
+	*cache_len = DIR_CACHE_HDR_LEN;
+	return cache;
+}
+
+static void dir_cache_write(sc_card_t *card, const u8 *cache, size_t cache_len)
+{
+	char fname[PATH_MAX];
+	FILE *f;
+
+	if (cache == NULL || dir_cache_filename(card, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	f = fopen(fname, "wb");
+	if (f == NULL && sc_make_cache_dir(card->ctx) == SC_SUCCESS)
+		f = fopen(fname, "wb");
+	if (f == NULL)
+		return;
+	if (fwrite(cache, 1, cache_len, f) != cache_len) {
+		fclose(f);
+		remove(fname);
+		return;
+	}
+	fclose(f);
+	_sc_cache_used(card->ctx, fname);
+}
+
+static void dir_cache_remove(sc_card_t *card)
+{
+	char fname[PATH_MAX];
+
+	if (dir_cache_filename(card, fname, sizeof(fname)) == SC_SUCCESS)
+		remove(fname);
+}
+
+static int enum_apps(sc_card_t *card)
 {
 	struct sc_context *ctx = card->ctx;
 	sc_path_t path;
 	int ef_structure;
-	size_t file_size, jj;
+	size_t file_size, jj, cache_len = 0;
+	u8 *cache = NULL;
 	int r, ii, idx;
 
 	LOG_FUNC_CALLED(ctx);
@@ -156,24 +333,33 @@ int sc_enum_apps(sc_card_t *card)
 	}
 
 	ef_structure = card->ef_dir->ef_structure;
+	if (ef_structure == SC_FILE_EF_TRANSPARENT && card->ef_dir->size == 0)
+		LOG_FUNC_RETURN(ctx, 0);
+
+	if (dir_cache_read(card) == SC_SUCCESS)
+		goto sort;
+	cache = dir_cache_new(card, &cache_len);
+
 	if (ef_structure == SC_FILE_EF_TRANSPARENT) {
 		u8 *buf = NULL, *p;
 		size_t bufsize;
 
 		file_size = card->ef_dir->size;
-		if (file_size == 0)
-			LOG_FUNC_RETURN(ctx, 0);
 
 		buf = malloc(file_size);
-		if (buf == NULL)
+		if (buf == NULL) {
+			free(cache);
 			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		}
 		p = buf;
 		r = sc_read_binary(card, 0, buf, file_size, 0);
 		if (r < 0) {
 			free(buf);
+			free(cache);
 			LOG_TEST_RET(ctx, r, "sc_read_binary() failed");
 		}
 		bufsize = r;
+		dir_cache_add(&cache, &cache_len, buf, bufsize);
 		while (bufsize > 0) {
 			if (card->app_count == SC_MAX_CARD_APPS) {
 				sc_log(ctx, "Too many applications on card");
@@ -198,6 +384,8 @@ int sc_enum_apps(sc_card_t *card)
 			r = sc_read_record(card, rec_nr, buf, sizeof(buf), SC_RECORD_BY_REC_NR);
 			if (r == SC_ERROR_RECORD_NOT_FOUND)
 				break;
+			if (r < 0)
+				free(cache);
 			LOG_TEST_RET(ctx, r, "read_record() failed");
 
 			if (card->app_count == SC_MAX_CARD_APPS) {
@@ -206,11 +394,15 @@ int sc_enum_apps(sc_card_t *card)
 			}
 
 			rec_size = r;
+			dir_cache_add(&cache, &cache_len, buf, rec_size);
 			p = buf;
 			parse_dir_record(card, &p, &rec_size, (int)rec_nr);
 		}
 	}
+	dir_cache_write(card, cache, cache_len);
+	free(cache);
 
+sort:
 	/* Move known PKCS#15 applications to the head of the list */
 	for (ii=0, idx=0; ii<card->app_count; ii++)   {
 		for (jj=0; jj < sizeof(apps)/sizeof(apps[0]); jj++) {
@@ -233,6 +425,16 @@ int sc_enum_apps(sc_card_t *card)
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
+int sc_enum_apps(sc_card_t *card)
+{
+	int r;
+
+	SC_TRACE_BEGIN(card->ctx, "sc_enum_apps", 0);
+	r = enum_apps(card);
+	SC_TRACE_END(card->ctx, "sc_enum_apps", r);
+	return r;
+}
+
 void sc_free_apps(sc_card_t *card)
 {
 	int	i;
@@ -377,6 +579,7 @@ int sc_update_dir(sc_card_t *card, sc_app_info_t *app)
 	r = sc_select_file(card, &path, &file);
 	LOG_TEST_RET(card->ctx, r, "unable to select EF(DIR)");
 
+	dir_cache_remove(card);
 	if (file->ef_structure == SC_FILE_EF_TRANSPARENT)
 		r = update_transparent(card, file);
 	else if (app == NULL)
@@ -105,6 +105,26 @@ sc_parse_ef_atr_content(struct sc_card *card, unsigned char *buf, size_t buflen)
 		}
 	}
 
+	tag = sc_asn1_find_tag(ctx, buf, buflen, ISO7816_TAG_II_EXTENDED_LENGTH, &taglen);
+	if (tag)   {
+		const unsigned char *num;
+		size_t numlen, left = taglen, ii;
+
+		/* two INTEGERs: max. number of bytes in command and in response APDU */
+		num = sc_asn1_find_tag(ctx, tag, left, SC_ASN1_TAG_INTEGER, &numlen);
+		if (num && numlen <= 3)   {
+			for (ii = 0; ii < numlen; ii++)
+				ef_atr.max_command_apdu = (ef_atr.max_command_apdu << 8) | num[ii];
+			left -= (num + numlen) - tag;
+			num = sc_asn1_find_tag(ctx, num + numlen, left, SC_ASN1_TAG_INTEGER, &numlen);
+			if (num && numlen <= 3)
+				for (ii = 0; ii < numlen; ii++)
+					ef_atr.max_response_apdu = (ef_atr.max_response_apdu << 8) | num[ii];
+		}
+		sc_log(ctx, "EF.ATR: extended length info: command %i, response %i",
+				ef_atr.max_command_apdu, ef_atr.max_response_apdu);
+	}
+
 	if (category == ISO7816_II_CATEGORY_TLV)   {
 		tag = sc_asn1_find_tag(ctx, buf, buflen, ISO7816_TAG_II_STATUS_SW, &taglen);
 		if (tag && taglen == 2)   {
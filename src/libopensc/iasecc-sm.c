@@ -33,6 +33,9 @@
 
 #ifdef ENABLE_SM
 
+/* SM APDUs after which a session is negotiated anew */
+#define IASECC_SM_SESSION_MAX_APDUS	0x400
+
 static int
 sm_save_sc_context (struct sc_card *card, struct sm_info *sm_info)
 {
@@ -117,6 +120,54 @@ iasecc_sm_transmit_apdus(struct sc_card *card, struct sc_remote_data *rdata,
 }
 
 
+/* The card closes the SM session at the first APDU sent without SM. After
+ * an SM command the session is kept together with the APDU counter of the
+ * reader and the security environment serial, and is reused as long as
+ * neither has moved: nothing else was sent, the lock was not released,
+ * the card was not reset and no file or environment was selected. */
+static void
+iasecc_sm_session_invalidate(struct sc_card *card)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *)card->drv_data;
+
+	prv->sm_session.valid = 0;
+}
+
+
+static void
+iasecc_sm_session_keep(struct sc_card *card)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *)card->drv_data;
+
+	if (!prv->sm_session.valid)
+		return;
+	prv->sm_session.sec_env_serial = card->cache.sec_env_serial;
+	if (card->reader->stats)
+		prv->sm_session.apdu_count = card->reader->stats->total.count;
+	else
+		prv->sm_session.valid = 0;
+}
+
+
+static int
+iasecc_sm_session_reusable(struct sc_card *card, unsigned se_num)
+{
+	struct iasecc_private_data *prv = (struct iasecc_private_data *)card->drv_data;
+	struct iasecc_sm_session *session = &prv->sm_session;
+
+	if (!session->valid || session->se_num != se_num)
+		return 0;
+	if (session->apdus >= IASECC_SM_SESSION_MAX_APDUS)
+		return 0;
+	if (session->sec_env_serial != card->cache.sec_env_serial)
+		return 0;
+	if (!card->reader->stats || session->apdu_count != card->reader->stats->total.count)
+		return 0;
+
+	return 1;
+}
+
+
 /* Big TODO: do SM release in all handles, clean the saved card context -- current DF, EF, etc. */
 static int
 sm_release (struct sc_card *card, struct sc_remote_data *rdata,
@@ -132,7 +183,10 @@ sm_release (struct sc_card *card, struct sc_remote_data *rdata,
 
 	rv = card->sm_ctx.module.ops.finalize(ctx, sm_info, rdata, out, out_len);
 
-	sm_restore_sc_context(card, sm_info);
+	if (sm_restore_sc_context(card, sm_info) == SC_SUCCESS)
+		iasecc_sm_session_keep(card);
+	else
+		iasecc_sm_session_invalidate(card);
 	LOG_FUNC_RETURN(ctx, rv);
 }
 #endif
@@ -156,6 +210,8 @@ iasecc_sm_external_authentication(struct sc_card *card, unsigned skey_ref, int *
 	if (card->sm_ctx.sm_mode == SM_MODE_NONE)
 		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Cannot do 'External Authentication' without SM activated ");
 
+	iasecc_sm_session_invalidate(card);
+
 	strncpy(sm_info->config_section, card->sm_ctx.config_section, sizeof(sm_info->config_section));
 	sm_info->cmd = SM_CMD_EXTERNAL_AUTH;
 	sm_info->serialnr = card->serialnr;
@@ -291,6 +347,7 @@ iasecc_sm_initialize(struct sc_card *card, unsigned se_num, unsigned cmd)
 #ifdef ENABLE_SM
 	struct sm_info *sm_info = &card->sm_ctx.info;
 	struct sm_cwa_session *cwa_session = &sm_info->session.cwa;
+	struct iasecc_private_data *prv = (struct iasecc_private_data *)card->drv_data;
 	struct sc_remote_data rdata;
 	int rv;
 
@@ -302,6 +359,17 @@ iasecc_sm_initialize(struct sc_card *card, unsigned se_num, unsigned cmd)
 	sm_info->card_type = card->type;
 	sm_info->sm_type = SM_TYPE_CWA14890;
 
+	if (iasecc_sm_session_reusable(card, se_num))   {
+		sc_log(ctx, "iasecc_sm_initialize() reuse SM session of SE#%i", se_num);
+		rv = sm_save_sc_context(card, sm_info);
+		LOG_TEST_RET(ctx, rv, "iasecc_sm_initialize() cannot save current context");
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	iasecc_sm_session_invalidate(card);
+	prv->sm_session.se_num = se_num;
+	prv->sm_session.apdus = 0;
+
 	rv = iasecc_sm_se_mutual_authentication(card, se_num);
 	LOG_TEST_RET(ctx, rv, "iasecc_sm_initialize() MUTUAL AUTHENTICATION failed");
 
@@ -356,6 +424,7 @@ iasecc_sm_cmd(struct sc_card *card, struct sc_remote_data *rdata)
 	struct sc_context *ctx = card->ctx;
 	struct sm_info *sm_info = &card->sm_ctx.info;
 	struct sm_cwa_session *session = &sm_info->session.cwa;
+	struct iasecc_private_data *prv = (struct iasecc_private_data *)card->drv_data;
 	struct sc_remote_apdu *rapdu = NULL;
 	int rv;
 
@@ -363,7 +432,13 @@ iasecc_sm_cmd(struct sc_card *card, struct sc_remote_data *rdata)
 	if (!card->sm_ctx.module.ops.get_apdus)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 
-	rv =  card->sm_ctx.module.ops.get_apdus(ctx, sm_info, session->mdata, session->mdata_len, rdata);
+	/* without authentication data the module goes on with the session keys and SSC */
+	if (prv->sm_session.valid)
+		rv =  card->sm_ctx.module.ops.get_apdus(ctx, sm_info, NULL, 0, rdata);
+	else
+		rv =  card->sm_ctx.module.ops.get_apdus(ctx, sm_info, session->mdata, session->mdata_len, rdata);
+	if (rv < 0)
+		iasecc_sm_session_invalidate(card);
 	LOG_TEST_RET(ctx, rv, "iasecc_sm_cmd() 'GET APDUS' failed");
 
 	sc_log(ctx, "iasecc_sm_cmd() %i remote APDUs to transmit", rdata->length);
@@ -387,6 +462,8 @@ iasecc_sm_cmd(struct sc_card *card, struct sc_remote_data *rdata)
 		sc_log(ctx, "iasecc_sm_cmd() apdu->resplen %i", apdu->resplen);
 	}
 
+	prv->sm_session.valid = rv >= 0;
+	prv->sm_session.apdus += rdata->length;
 	LOG_FUNC_RETURN(ctx, rv);
 }
 #endif
@@ -615,8 +692,11 @@ iasecc_sm_read_binary(struct sc_card *card, unsigned se_num, size_t offs, unsign
 	rv = iasecc_sm_initialize(card, se_num, SM_CMD_FILE_READ);
 	LOG_TEST_RET(ctx, rv, "iasecc_sm_read_binary() SM INITIALIZE failed");
 
+	/* all the READ BINARY APDUs of the range are wrapped and sent in one batch */
+	memset(&cmd_data, 0, sizeof(cmd_data));
 	cmd_data.offs = offs;
 	cmd_data.count = count;
+	cmd_data.data = buff;
 	sm_info->cmd_data = &cmd_data;
 
 	sc_remote_data_init(&rdata);
@@ -133,5 +133,25 @@ struct iasecc_private_data {
 	unsigned op_method, op_ref;
 
 	struct iasecc_se_info *se_info;
+
+	/* CWA-14890 SM session left open by the last SM command; see
+	 * iasecc_sm_initialize() for when it is reused */
+	struct iasecc_sm_session {
+		int valid;
+		unsigned se_num;
+		unsigned int sec_env_serial;
+		unsigned long apdu_count;
+		unsigned apdus;
+	} sm_session;
+
+	/* GET DATA answers for the key SDOs; see iasecc_sdo_get_tagged_data() */
+	struct iasecc_sdo_cache {
+		unsigned char sdo_class, sdo_ref;
+		int sdo_tag;
+		int rv;
+		unsigned char *data;
+		size_t data_len;
+		struct iasecc_sdo_cache *next;
+	} *sdo_cache;
 };
 #endif
@@ -139,6 +139,16 @@ typedef LONG (PCSC_API *SCardGetAttrib_t)(SCARDHANDLE hCard, DWORD dwAttrId,\
 
 /* Copied from pcsc-lite reader.h */
 
+#ifndef SCARD_ATTR_VALUE
+#define SCARD_ATTR_VALUE(Class, Tag) ((((ULONG)(Class)) << 16) | ((ULONG)(Tag)))
+#endif
+#ifndef SCARD_CLASS_VENDOR_DEFINED
+#define SCARD_CLASS_VENDOR_DEFINED	7
+#endif
+#ifndef SCARD_ATTR_MAXINPUT
+#define SCARD_ATTR_MAXINPUT SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0xA007)
+#endif
+
 #ifndef SCARD_CTL_CODE
 #ifdef _WIN32
 #include <winioctl.h>
@@ -75,11 +75,87 @@ struct sc_atr_table {
 /* Internal use only */
 int _sc_add_reader(struct sc_context *ctx, struct sc_reader *reader);
 int _sc_delete_reader(struct sc_context *ctx, struct sc_reader *reader);
+/* Returns the reader's scratch buffer with at least 'len' bytes, NULL on allocation error */
+unsigned char *_sc_reader_get_apdu_buf(struct sc_reader *reader, size_t len);
 int _sc_parse_atr(struct sc_reader *reader);
+/* Calls the transmit operation of the reader driver and updates the reader's APDU counters */
+int _sc_reader_transmit(struct sc_reader *reader, struct sc_apdu *apdu);
+/* Nonzero while the reader is left alone after a very slow APDU */
+int _sc_reader_quarantined(struct sc_reader *reader);
+
+/* The worker thread of a reader, see reader_workers and worker.c */
+int _sc_reader_worker_start(struct sc_reader *reader);
+void _sc_reader_worker_stop(struct sc_reader *reader);
+void _sc_reader_worker_forked(struct sc_reader *reader);
+/* Runs fn(arg) on the worker of the reader and returns its result; in the
+ * calling thread if the reader has no worker or the caller is the worker */
+int _sc_reader_worker_run(struct sc_reader *reader, int (*fn)(void *), void *arg);
+/* Queues fn(arg) on the worker of the reader and returns at once; the worker
+ * then calls done(arg, result). SC_ERROR_NOT_SUPPORTED without a worker. */
+int _sc_reader_worker_submit(struct sc_reader *reader, int (*fn)(void *),
+		void (*done)(void *, int), void *arg);
+/* Waits until the worker of the reader has done all the queued jobs;
+ * SC_ERROR_NOT_ALLOWED in the worker itself */
+int _sc_reader_worker_wait(struct sc_reader *reader);
+/* Forgets the responses kept for SC_APDU_FLAGS_CACHEABLE APDUs, with
+ * card->mutex held */
+void _sc_free_apdu_cache(struct sc_card *card);
+/* Appends the APDUs sent through _sc_reader_transmit() to a binary trace file */
+int _sc_apdu_trace_open(struct sc_context *ctx, const char *filename);
+void _sc_apdu_trace_close(struct sc_context *ctx);
+/* Records the ATR of the card connected in the reader */
+void _sc_apdu_trace_atr(struct sc_reader *reader);
+/* Stops the trace in a child process without touching the parent's file */
+void _sc_apdu_trace_forked(struct sc_context *ctx);
+/* Writes the spans of sc_trace_span() to a Chrome trace (JSON) file */
+int _sc_span_trace_open(struct sc_context *ctx, const char *filename);
+void _sc_span_trace_close(struct sc_context *ctx);
+void _sc_span_trace_forked(struct sc_context *ctx);
+/* Microseconds from an arbitrary origin, for durations */
+unsigned long long _sc_time_us(void);
 
 /* Add an ATR to the card driver's struct sc_atr_table */
 int _sc_add_atr(struct sc_context *ctx, struct sc_card_driver *driver, struct sc_atr_table *src);
 int _sc_free_atr(struct sc_context *ctx, struct sc_card_driver *driver);
+/* Loads the module of the card driver at ctx->card_drivers[idx] when it is
+ * still the placeholder of a 'lazy_load' driver; NULL if that fails */
+struct sc_card_driver *_sc_load_lazy_driver(struct sc_context *ctx, int idx);
+void _sc_free_compiled_atrs(struct sc_context *ctx);
+
+/* Hand debug messages to a writer thread through a queue of 'size'
+ * records; when the queue is full, messages are dropped */
+int _sc_log_queue_start(struct sc_context *ctx, size_t size);
+/* Wait until the queued messages are written */
+void _sc_log_queue_flush(struct sc_context *ctx);
+void _sc_log_queue_stop(struct sc_context *ctx);
+/* Start a new writer thread in the child process */
+void _sc_log_queue_forked(struct sc_context *ctx);
+
+/* Records that a file of the cache directory was written or read, and
+ * evicts the least recently used files beyond cache_max_size and cache_max_age */
+void _sc_cache_used(struct sc_context *ctx, const char *fname);
+/* Accounting of the caches kept in memory (see cache_memory_max_size):
+ * a cache calls _sc_memcache_add() for the entries it adds and removes,
+ * and _sc_memcache_lookup() for its hits and misses. Beyond the budget
+ * the evictable caches with the lowest hit rate are asked to drop their
+ * oldest entries: an evictable cache drops entries while
+ * _sc_memcache_trim() is not 0, whenever it is used, and reports them
+ * with _sc_memcache_evicted(). An account is in the context only while
+ * it holds entries, so a cache must remove all of them before its
+ * account is freed. */
+void _sc_memcache_init(struct sc_memcache_account *acc, const char *name, int evictable);
+void _sc_memcache_add(struct sc_context *ctx, struct sc_memcache_account *acc,
+		long bytes, long entries);
+void _sc_memcache_evicted(struct sc_context *ctx, struct sc_memcache_account *acc,
+		size_t bytes);
+void _sc_memcache_lookup(struct sc_context *ctx, struct sc_memcache_account *acc, int hit);
+size_t _sc_memcache_trim(struct sc_context *ctx, struct sc_memcache_account *acc);
+/* Per-ATR cache file "<cache_dir>/<ATR>.<suffix>" */
+int _sc_card_cache_filename(struct sc_card *card, const char *suffix,
+		char *buf, size_t bufsize);
+/* Whether the per-ATR files are used: they share the switch of the PKCS#15
+ * file cache */
+int _sc_card_use_file_cache(struct sc_context *ctx);
 
 /**
  * Convert an unsigned long into 4 bytes in big endian order
@@ -199,6 +275,32 @@ int sc_mutex_unlock(const sc_context_t *ctx, void *mutex);
  * @return SC_SUCCESS on success and an error code otherwise
  */
 int sc_mutex_destroy(const sc_context_t *ctx, void *mutex);
+/**
+ * Creates a lock taken shared by the readers of a structure and exclusive
+ * by its writers, with the rwlock functions of the thread context or with
+ * its mutex functions if it has none. Does nothing and returns SC_SUCCESS
+ * without a thread context.
+ * @param  ctx     sc_context_t object with the thread context
+ * @param  rwlock  pointer for the newly created lock
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_rwlock_create(const sc_context_t *ctx, void **rwlock);
+/**
+ * Locks a lock of sc_rwlock_create() shared (exclusive = 0) or exclusive.
+ * @param  ctx        sc_context_t object with the thread context
+ * @param  rwlock     lock to take
+ * @param  exclusive  non-zero to change the protected structure
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_rwlock_lock(const sc_context_t *ctx, void *rwlock, int exclusive);
+/**
+ * Releases a lock taken with sc_rwlock_lock() and the same 'exclusive'.
+ */
+int sc_rwlock_unlock(const sc_context_t *ctx, void *rwlock, int exclusive);
+/**
+ * Destroys a lock of sc_rwlock_create().
+ */
+int sc_rwlock_destroy(const sc_context_t *ctx, void *rwlock);
 /**
  * Returns a unique id for every thread.
  * @param  ctx  sc_context_t object with the thread context
@@ -221,6 +323,26 @@ unsigned long sc_thread_id(const sc_context_t *ctx);
  */
 int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	size_t *len, unsigned int proto);
+/**
+ * Encodes the APDU into a caller supplied buffer.
+ * @param  ctx     sc_context_t object
+ * @param  apdu    sc_apdu_t object with the APDU to encode
+ * @param  buf     output buffer
+ * @param  buflen  size of the output buffer
+ * @param  len     length of encoded APDU
+ * @param  proto   protocol to be used
+ * @return SC_SUCCESS on success, SC_ERROR_BUFFER_TOO_SMALL if @a buf
+ *         cannot hold the encoded APDU and an error code otherwise
+ */
+int sc_apdu_get_octets_buf(sc_context_t *ctx, const sc_apdu_t *apdu, u8 *buf,
+	size_t buflen, size_t *len, unsigned int proto);
+/**
+ * Returns the length of the encoded APDU in octets.
+ * @param  apdu    sc_apdu_t object
+ * @param  proto   protocol to be used
+ * @return length of the encoded APDU or 0 for an invalid APDU case
+ */
+size_t sc_apdu_get_octets_len(const sc_apdu_t *apdu, unsigned int proto);
 /**
  * Sets the status bytes and return data in the APDU
  * @param  ctx     sc_context_t object
@@ -245,6 +367,9 @@ void sc_apdu_log(sc_context_t *ctx, int level, const u8 *data, size_t len,
 extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
+extern struct sc_reader_driver *sc_get_net_driver(void);
+extern struct sc_reader_driver *sc_get_replay_driver(void);
+extern struct sc_reader_driver *sc_get_ccid_driver(void);
 extern struct sc_reader_driver *sc_get_cardmod_driver(void);
 
 #ifdef __cplusplus
@@ -665,7 +665,8 @@ iso7816_get_response(struct sc_card *card, size_t *count, u8 *buf)
 	else
 		rlen = *count;
 
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0xC0, 0x00, 0x00);
+	/* extended Le only when sc_get_response() asked for more than 256 bytes */
+	sc_format_apdu(card, &apdu, rlen > 256 ? SC_APDU_CASE_2_EXT : SC_APDU_CASE_2_SHORT, 0xC0, 0x00, 0x00);
 	apdu.le      = rlen;
 	apdu.resplen = rlen;
 	apdu.resp    = buf;
@@ -731,19 +732,22 @@ static int
 iso7816_set_security_env(struct sc_card *card,
 		const struct sc_security_env *env, int se_num)
 {
-	struct sc_apdu apdu;
+	struct sc_apdu apdus[2];
 	u8 sbuf[SC_MAX_APDU_BUFFER_SIZE];
 	u8 *p;
-	int r, locked = 0;
+	int r, rv[2];
+	size_t count = 0;
 
 	assert(card != NULL && env != NULL);
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0x22, 0x41, 0);
+	sc_format_apdu(card, &apdus[0], SC_APDU_CASE_3_SHORT, 0x22, 0x41, 0);
 	switch (env->operation) {
 	case SC_SEC_OPERATION_DECIPHER:
-		apdu.p2 = 0xB8;
+	case SC_SEC_OPERATION_ENCRYPT_SYM:
+	case SC_SEC_OPERATION_DECRYPT_SYM:
+		apdus[0].p2 = 0xB8;
 		break;
 	case SC_SEC_OPERATION_SIGN:
-		apdu.p2 = 0xB6;
+		apdus[0].p2 = 0xB6;
 		break;
 	default:
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -772,38 +776,27 @@ iso7816_set_security_env(struct sc_card *card,
 		p += env->key_ref_len;
 	}
 	r = p - sbuf;
-	apdu.lc = r;
-	apdu.datalen = r;
-	apdu.data = sbuf;
+	apdus[0].lc = r;
+	apdus[0].datalen = r;
+	apdus[0].data = sbuf;
+	if (apdus[0].datalen != 0)
+		count++;
+
 	if (se_num > 0) {
-		r = sc_lock(card);
-		LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
-		locked = 1;
-	}
-	if (apdu.datalen != 0) {
-		r = sc_transmit_apdu(card, &apdu);
-		if (r) {
-			sc_log(card->ctx, "%s: APDU transmit failed", sc_strerror(r));
-			goto err;
-		}
-		r = sc_check_sw(card, apdu.sw1, apdu.sw2);
-		if (r) {
-			sc_log(card->ctx, "%s: Card returned error", sc_strerror(r));
-			goto err;
-		}
+		/* MSE SET and MSE STORE are sent back to back in one locked sequence */
+		sc_format_apdu(card, &apdus[count], SC_APDU_CASE_1, 0x22, 0xF2, se_num);
+		count++;
 	}
-	if (se_num <= 0)
+
+	if (count == 0)
 		return 0;
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0x22, 0xF2, se_num);
-	r = sc_transmit_apdu(card, &apdu);
-	sc_unlock(card);
+
+	r = sc_transmit_apdu_batch(card, apdus, count, 0x9000, rv);
 	LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
+	for (r = 0; r < (int)count; r++)
+		LOG_TEST_RET(card->ctx, rv[r], "Card returned error");
 
-	return sc_check_sw(card, apdu.sw1, apdu.sw2);
-err:
-	if (locked)
-		sc_unlock(card);
-	return r;
+	return 0;
 }
 
 
@@ -915,6 +908,96 @@ iso7816_decipher(struct sc_card *card,
 }
 
 
+/* Symmetric ciphers work on blocks of 8 or 16 bytes, so the data is cut
+ * in multiples of 16 */
+#define ISO7816_SYM_BLOCK	16
+
+/* PSO ENCIPHER and DECIPHER of the data in the largest pieces a response
+ * can hold, chained when the card takes less in a command. The commands
+ * are built beforehand and sent back to back under one lock. */
+static int
+iso7816_crypt_sym(struct sc_card *card, int encrypt,
+		const u8 *in, size_t inlen, u8 *out, size_t outlen)
+{
+	struct sc_apdu *apdus;
+	int *rv;
+	size_t chunk, max_send, count, ii, done;
+	int r;
+
+	LOG_FUNC_CALLED(card->ctx);
+	if (inlen % 8 != 0 || outlen < inlen)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+	if (inlen == 0)
+		LOG_FUNC_RETURN(card->ctx, 0);
+
+	chunk = card->max_recv_size;
+	if (chunk == 0 || (chunk > 256 && !(card->caps & SC_CARD_CAP_APDU_EXT)))
+		chunk = 256;
+	if (chunk > 0xFFFF)
+		chunk = 0xFFFF;
+	chunk -= chunk % ISO7816_SYM_BLOCK;
+	max_send = card->max_send_size > 0 ? card->max_send_size : 255;
+
+	count = (inlen + chunk - 1) / chunk;
+	apdus = calloc(count, sizeof(struct sc_apdu));
+	rv = calloc(count, sizeof(int));
+	if (apdus == NULL || rv == NULL) {
+		free(apdus);
+		free(rv);
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+	}
+
+	for (ii = 0, done = 0; ii < count; ii++, done += chunk) {
+		size_t len = inlen - done < chunk ? inlen - done : chunk;
+
+		/* INS: 0x2A  PERFORM SECURITY OPERATION
+		 * ENCIPHER P1: 0x84 Resp: Cryptogram  P2: 0x80 Cmd: Plain value
+		 * DECIPHER P1: 0x80 Resp: Plain value P2: 0x84 Cmd: Cryptogram */
+		if (encrypt)
+			sc_format_apdu(card, &apdus[ii], SC_APDU_CASE_4, 0x2A, 0x84, 0x80);
+		else
+			sc_format_apdu(card, &apdus[ii], SC_APDU_CASE_4, 0x2A, 0x80, 0x84);
+		apdus[ii].data = in + done;
+		apdus[ii].lc = len;
+		apdus[ii].datalen = len;
+		apdus[ii].resp = out + done;
+		apdus[ii].resplen = len;
+		apdus[ii].le = len;
+		if (len > max_send)
+			apdus[ii].flags |= SC_APDU_FLAGS_CHAINING;
+	}
+
+	r = sc_transmit_apdu_batch(card, apdus, count, 0x9000, rv);
+	for (ii = 0; r >= 0 && ii < count; ii++) {
+		if (rv[ii] < 0)
+			r = rv[ii];
+		else if (apdus[ii].resplen != apdus[ii].datalen)
+			r = SC_ERROR_WRONG_LENGTH;
+	}
+	free(apdus);
+	free(rv);
+	LOG_TEST_RET(card->ctx, r, "Symmetric cipher operation failed");
+
+	LOG_FUNC_RETURN(card->ctx, (int)inlen);
+}
+
+
+static int
+iso7816_encrypt_sym(struct sc_card *card,
+		const u8 *in, size_t inlen, u8 *out, size_t outlen)
+{
+	return iso7816_crypt_sym(card, 1, in, inlen, out, outlen);
+}
+
+
+static int
+iso7816_decrypt_sym(struct sc_card *card,
+		const u8 *in, size_t inlen, u8 *out, size_t outlen)
+{
+	return iso7816_crypt_sym(card, 0, in, inlen, out, outlen);
+}
+
+
 static int
 iso7816_build_pin_apdu(struct sc_card *card, struct sc_apdu *apdu,
 		struct sc_pin_cmd_data *data, u8 *buf, size_t buf_len)
@@ -1112,7 +1195,11 @@ static struct sc_card_operations iso_ops = {
 	NULL,			/* get_data */
 	NULL,			/* put_data */
 	NULL,			/* delete_record */
-	NULL			/* read_public_key */
+	NULL,			/* read_public_key */
+	NULL,			/* card_reader_lock_obtained */
+	NULL,			/* read_records */
+	iso7816_encrypt_sym,
+	iso7816_decrypt_sym
 };
 
 static struct sc_card_driver iso_driver = {
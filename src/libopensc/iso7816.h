@@ -38,6 +38,16 @@ extern "C" {
 #define ISO7816_TAG_II_STATUS_LCS		0x81
 #define ISO7816_TAG_II_STATUS_SW		0x82
 #define ISO7816_TAG_II_STATUS_LCS_SW		0x83
+#define ISO7816_TAG_II_EXTENDED_LENGTH		0x7F66
+
+/* ISO7816 compact-TLV tags of the historical bytes */
+#define ISO7816_HIST_TAG_CARD_SERVICE		0x3
+#define ISO7816_HIST_TAG_CARD_CAPABILITIES	0x7
+
+/* card service data: BER-TLV data objects available in EF.ATR */
+#define ISO7816_CARD_SERVICE_EF_ATR		0x10
+/* third byte of card capabilities: extended Lc and Le fields */
+#define ISO7816_CARD_CAP_EXTENDED_LENGTH	0x40
 
 /* Other interindustry data tags */
 #define IASECC_TAG_II_IO_BUFFER_SIZES		0xE0
@@ -42,6 +42,215 @@
 
 #include "internal.h"
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define SC_LOG_QUEUE
+#endif
+
+#define SC_LOG_LINE_SIZE	4096
+
+#ifdef SC_LOG_QUEUE
+/* A message waiting for the writer thread. The time and the thread are
+ * taken by the caller, they are formatted by the writer. */
+struct sc_log_record {
+	struct timeval tv;
+	unsigned long thread;
+	size_t len;
+	char text[SC_LOG_LINE_SIZE];
+};
+
+struct sc_log_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t drained;
+	pthread_t writer;
+	int stop;
+	int busy;		/* the writer is printing the head record */
+	unsigned long dropped;	/* records lost since the last one printed */
+	size_t size, head, count;
+	struct sc_log_record *records;
+};
+
+static void sc_log_write_line(FILE *outf, const struct timeval *tv, unsigned long thread,
+		const char *text, size_t len)
+{
+	struct tm tm;
+	char time_string[40];
+
+	localtime_r(&tv->tv_sec, &tm);
+	strftime(time_string, sizeof(time_string), "%H:%M:%S", &tm);
+	fprintf(outf, "0x%lx %s.%03ld ", thread, time_string, (long)tv->tv_usec / 1000);
+	fwrite(text, 1, len, outf);
+	if (len == 0 || text[len-1] != '\n')
+		fputc('\n', outf);
+}
+
+static void *sc_log_writer(void *arg)
+{
+	sc_context_t *ctx = arg;
+	struct sc_log_queue *queue = ctx->log_queue;
+	struct sc_log_record *rec;
+	unsigned long dropped;
+
+	pthread_mutex_lock(&queue->lock);
+	for (;;) {
+		while (queue->count == 0 && !queue->stop)
+			pthread_cond_wait(&queue->not_empty, &queue->lock);
+		if (queue->count == 0)
+			break;
+
+		/* Callers only fill free slots, so the head record can be
+		 * printed without the lock */
+		rec = &queue->records[queue->head];
+		dropped = queue->dropped;
+		queue->dropped = 0;
+		queue->busy = 1;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (ctx->debug_file != NULL) {
+			if (dropped) {
+				char msg[80];
+				int r = snprintf(msg, sizeof(msg), "%lu debug messages dropped", dropped);
+				sc_log_write_line(ctx->debug_file, &rec->tv, rec->thread, msg, r);
+			}
+			sc_log_write_line(ctx->debug_file, &rec->tv, rec->thread, rec->text, rec->len);
+		}
+
+		pthread_mutex_lock(&queue->lock);
+		queue->busy = 0;
+		queue->head = (queue->head + 1) % queue->size;
+		queue->count--;
+		if (queue->count == 0) {
+			if (ctx->debug_file != NULL)
+				fflush(ctx->debug_file);
+			pthread_cond_broadcast(&queue->drained);
+		}
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return NULL;
+}
+
+/* Returns 0 if the message is queued or dropped, -1 if it has to be
+ * written by the caller */
+static int sc_log_queue_push(sc_context_t *ctx, const struct timeval *tv, const char *text, size_t len)
+{
+	struct sc_log_queue *queue = ctx->log_queue;
+	struct sc_log_record *rec;
+
+	if (queue == NULL)
+		return -1;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count == queue->size) {
+		/* Never wait for the disk while holding the card */
+		queue->dropped++;
+		pthread_mutex_unlock(&queue->lock);
+		return 0;
+	}
+	rec = &queue->records[(queue->head + queue->count) % queue->size];
+	rec->tv = *tv;
+	rec->thread = (unsigned long)pthread_self();
+	rec->len = len;
+	memcpy(rec->text, text, len);
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+	return 0;
+}
+#endif
+
+int _sc_log_queue_start(sc_context_t *ctx, size_t size)
+{
+#ifdef SC_LOG_QUEUE
+	struct sc_log_queue *queue;
+
+	if (ctx->log_queue != NULL || size == 0)
+		return SC_SUCCESS;
+
+	queue = calloc(1, sizeof(struct sc_log_queue));
+	if (queue == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	queue->records = malloc(size * sizeof(struct sc_log_record));
+	if (queue->records == NULL) {
+		free(queue);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	queue->size = size;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->drained, NULL);
+
+	ctx->log_queue = queue;
+	if (pthread_create(&queue->writer, NULL, sc_log_writer, ctx) != 0) {
+		ctx->log_queue = NULL;
+		pthread_cond_destroy(&queue->drained);
+		pthread_cond_destroy(&queue->not_empty);
+		pthread_mutex_destroy(&queue->lock);
+		free(queue->records);
+		free(queue);
+		return SC_ERROR_INTERNAL;
+	}
+	return SC_SUCCESS;
+#else
+	return SC_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+void _sc_log_queue_flush(sc_context_t *ctx)
+{
+#ifdef SC_LOG_QUEUE
+	struct sc_log_queue *queue = ctx->log_queue;
+
+	if (queue == NULL)
+		return;
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count != 0 || queue->busy)
+		pthread_cond_wait(&queue->drained, &queue->lock);
+	pthread_mutex_unlock(&queue->lock);
+#endif
+}
+
+void _sc_log_queue_stop(sc_context_t *ctx)
+{
+#ifdef SC_LOG_QUEUE
+	struct sc_log_queue *queue = ctx->log_queue;
+
+	if (queue == NULL)
+		return;
+	pthread_mutex_lock(&queue->lock);
+	queue->stop = 1;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+	/* The writer prints what is left before it exits */
+	pthread_join(queue->writer, NULL);
+
+	ctx->log_queue = NULL;
+	pthread_cond_destroy(&queue->drained);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue->records);
+	free(queue);
+#endif
+}
+
+void _sc_log_queue_forked(sc_context_t *ctx)
+{
+#ifdef SC_LOG_QUEUE
+	struct sc_log_queue *queue = ctx->log_queue;
+	size_t size;
+
+	if (queue == NULL)
+		return;
+	/* The writer thread does not exist in the child and the lock may have
+	 * been held by a thread of the parent: the parent's queue is dropped
+	 * without touching its lock, and a new one is started. */
+	size = queue->size;
+	ctx->log_queue = NULL;
+	free(queue->records);
+	free(queue);
+	_sc_log_queue_start(ctx, size);
+#endif
+}
+
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args);
 
 void sc_do_log(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, ...)
@@ -60,7 +269,7 @@ void sc_do_log_noframe(sc_context_t *ctx, int level, const char *format, va_list
 
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args)
 {
-	char	buf[4096], *p;
+	char	buf[SC_LOG_LINE_SIZE], *p;
 	int	r;
 	size_t	left;
 #ifdef _WIN32
@@ -89,9 +298,17 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 			st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
 #else
 	gettimeofday (&tv, NULL);
-	tm = localtime (&tv.tv_sec);
-	strftime (time_string, sizeof(time_string), "%H:%M:%S", tm);
-	r = snprintf(p, left, "0x%lx %s.%03ld ", (unsigned long)pthread_self(), time_string, tv.tv_usec / 1000);
+#ifdef SC_LOG_QUEUE
+	/* The writer thread formats the time of queued messages */
+	if (ctx->log_queue != NULL)
+		r = 0;
+	else
+#endif
+	{
+		tm = localtime (&tv.tv_sec);
+		strftime (time_string, sizeof(time_string), "%H:%M:%S", tm);
+		r = snprintf(p, left, "0x%lx %s.%03ld ", (unsigned long)pthread_self(), time_string, tv.tv_usec / 1000);
+	}
 #endif
 	p += r;
 	left -= r;
@@ -112,6 +329,13 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	if (r < 0)
 		return;
 
+#ifdef SC_LOG_QUEUE
+	if ((size_t)r >= left)
+		r = left - 1;
+	if (sc_log_queue_push(ctx, &tv, buf, p - buf + r) == 0)
+		return;
+#endif
+
 #ifdef _WIN32
 	if (ctx->debug_filename)   {
 		r = sc_ctx_log_to_file(ctx, ctx->debug_filename);
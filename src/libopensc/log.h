@@ -39,14 +39,26 @@ enum {
 	SC_LOG_DEBUG_MATCH,		/* card matching only */
 };
 
+/* Messages above this level are not compiled in (see --with-max-log-level) */
+#ifndef SC_MAX_LOG_LEVEL
+#define SC_MAX_LOG_LEVEL	SC_LOG_DEBUG_MATCH
+#endif
+
+/* Check the level before any argument of the log message is evaluated */
+#define SC_LOG_ENABLED(ctx, level) \
+	((level) <= SC_MAX_LOG_LEVEL && (ctx) != NULL && (ctx)->debug >= (level))
+
 /* You can't do #ifndef __FUNCTION__ */
 #if !defined(__GNUC__) && !defined(__IBMC__) && !(defined(_MSC_VER) && (_MSC_VER >= 1300))
 #define __FUNCTION__ NULL
 #endif
 
 #if defined(__GNUC__)
-#define sc_debug(ctx, level, format, args...)	sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args)
-#define sc_log(ctx, format, args...)   sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args)
+#define sc_debug(ctx, level, format, args...) do { \
+	if (SC_LOG_ENABLED((ctx), (level))) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args); \
+} while (0)
+#define sc_log(ctx, format, args...) sc_debug(ctx, SC_LOG_DEBUG_NORMAL, format , ## args)
 #else
 #define sc_debug _sc_debug
 #define sc_log _sc_log
@@ -58,17 +70,31 @@ void sc_do_log_noframe(sc_context_t *ctx, int level, const char *format, va_list
 void _sc_debug(struct sc_context *ctx, int level, const char *format, ...);
 void _sc_log(struct sc_context *ctx, const char *format, ...);
 
+/* Spans for sc_set_trace_callback(): a single test while nobody traces */
+#define SC_TRACE_BEGIN(ctx, name, value) do { \
+	if ((ctx)->trace_cb != NULL) \
+		sc_trace_span((ctx), SC_TRACE_SPAN_BEGIN, (name), (long) (value)); \
+} while (0)
+#define SC_TRACE_END(ctx, name, value) do { \
+	if ((ctx)->trace_cb != NULL) \
+		sc_trace_span((ctx), SC_TRACE_SPAN_END, (name), (long) (value)); \
+} while (0)
+
+void sc_trace_span(struct sc_context *ctx, int phase, const char *name, long value);
+
 void sc_hex_dump(struct sc_context *ctx, int level, const u8 * buf, size_t len, char *out, size_t outlen);
 char * sc_dump_hex(const u8 * in, size_t count);
 
 #define SC_FUNC_CALLED(ctx, level) do { \
-	 sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
+	if (SC_LOG_ENABLED((ctx), (level))) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
 } while (0)
 #define LOG_FUNC_CALLED(ctx) SC_FUNC_CALLED((ctx), SC_LOG_DEBUG_NORMAL)
 
 #define SC_FUNC_RETURN(ctx, level, r) do { \
 	int _ret = r; \
-	if (_ret <= 0) { \
+	if (!SC_LOG_ENABLED((ctx), (level))) { \
+	} else if (_ret <= 0) { \
 		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
 			"returning with: %d (%s)\n", _ret, sc_strerror(_ret)); \
 	} else { \
@@ -82,8 +108,9 @@ char * sc_dump_hex(const u8 * in, size_t count);
 #define SC_TEST_RET(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (SC_LOG_ENABLED((ctx), (level))) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		return _ret; \
 	} \
 } while(0)
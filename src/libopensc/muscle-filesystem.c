@@ -52,9 +52,13 @@ void mscfs_free(mscfs_t *fs) {
 }
 
 void mscfs_clear_cache(mscfs_t* fs) {
+	int x;
+	fs->cache.valid = 0;
 	if(!fs->cache.array) {
 		return;
 	}
+	for(x = 0; x < fs->cache.size; x++)
+		free(fs->cache.array[x].data);
 	free(fs->cache.array);
 	fs->cache.array = NULL;
 	fs->cache.totalSize = 0;
@@ -99,11 +103,13 @@ int mscfs_update_cache(mscfs_t* fs) {
 	int r;
 	mscfs_clear_cache(fs);
 	r = fs->listFile(&file, 1, fs->udata);
-	if(r == 0)
+	if(r == 0) {
+		fs->cache.valid = 1;
 		return 0;
-	else if(r < 0)
+	} else if(r < 0)
 		return r;
 	while(1) {
+		file.data = NULL;
 		if(!mscfs_is_ignored(fs, file.objectId)) {
 			/* Check if its a directory in the root */
 			u8* oid = file.objectId.id;
@@ -125,12 +131,13 @@ int mscfs_update_cache(mscfs_t* fs) {
 		else if(r < 0)
 			return r;
 	}
+	fs->cache.valid = 1;
 	return fs->cache.size;
 }
 
 void mscfs_check_cache(mscfs_t* fs)
 {
-	if(!fs->cache.array) {
+	if(!fs->cache.valid) {
 		mscfs_update_cache(fs);
 	}
 }
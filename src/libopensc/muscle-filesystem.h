@@ -34,12 +34,14 @@ typedef struct mscfs_file {
 	size_t size;
 	unsigned short read, write, delete;
 	int ef;
+	u8 *data; /* Object contents read so far, NULL if not cached */
 } mscfs_file_t;
 
 typedef struct mscfs_cache {
 	int size;
 	int totalSize;
 	mscfs_file_t *array;
+	int valid; /* The whole directory was listed */
 } mscfs_cache_t;
 
 typedef struct mscsfs {
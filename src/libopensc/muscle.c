@@ -107,19 +107,42 @@ int msc_partial_read_object(sc_card_t *card, msc_id objectId, int offset, u8 *da
 	
 }
 
-int msc_read_object(sc_card_t *card, msc_id objectId, int offset, u8 *data, size_t dataLength)
+/* Reads in units of *readUnit bytes. When 0, the largest unit the applet
+ * takes is found on the way, starting from MSC_MAX_READ and halving it
+ * while the length is rejected */
+int msc_read_object_unit(sc_card_t *card, msc_id objectId, int offset, u8 *data, size_t dataLength, size_t *readUnit)
 {
 	int r;
-	size_t i;
-	size_t max_read_unit = MSC_MAX_READ;
-
-	for(i = 0; i < dataLength; i += max_read_unit) {
-		r = msc_partial_read_object(card, objectId, offset + i, data + i, MIN(dataLength - i, max_read_unit));
+	size_t i = 0;
+	size_t max_read_unit = *readUnit ? *readUnit : MSC_MAX_READ;
+
+	while(i < dataLength) {
+		size_t len = MIN(dataLength - i, max_read_unit);
+		r = msc_partial_read_object(card, objectId, offset + i, data + i, len);
+		if(!*readUnit && len > 16
+				&& (r == SC_ERROR_INVALID_ARGUMENTS || r == SC_ERROR_WRONG_LENGTH)) {
+			/* Too long for the applet, read again */
+			max_read_unit = len / 2;
+			continue;
+		}
 		SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "Error in partial object read");
+		if(!*readUnit && len == max_read_unit) {
+			*readUnit = max_read_unit;
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,
+				"READ: unit of %lu bytes\n", (unsigned long)max_read_unit);
+		}
+		i += len;
 	}
 	return dataLength;
 }
 
+int msc_read_object(sc_card_t *card, msc_id objectId, int offset, u8 *data, size_t dataLength)
+{
+	size_t readUnit = MSC_MAX_READ;
+
+	return msc_read_object_unit(card, objectId, offset, data, dataLength, &readUnit);
+}
+
 int msc_zero_object(sc_card_t *card, msc_id objectId, size_t dataLength)
 {
 	u8 zeroBuffer[MSC_MAX_APDU];
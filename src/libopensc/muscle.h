@@ -32,12 +32,14 @@
 #define MSC_MAX_PIN_COMMAND_LENGTH ((1 + MSC_MAX_PIN_LENGTH) * 2)
 
 /* Currently max size handled by muscle driver is 255 ... */
-#define MSC_MAX_READ (card->max_recv_size > 0 ? card->max_recv_size : 255)
+/* ... and the length of a READ OBJECT is a single byte */
+#define MSC_MAX_READ (card->max_recv_size > 0 && card->max_recv_size < 255 ? card->max_recv_size : 255)
 #define MSC_MAX_SEND (card->max_send_size > 0 ? card->max_send_size : 255)
 
 int msc_list_objects(sc_card_t* card, u8 next, mscfs_file_t* file);
 int msc_partial_read_object(sc_card_t *card, msc_id objectId, int offset, u8 *data, size_t dataLength);
 int msc_read_object(sc_card_t *card, msc_id objectId, int offset, u8 *data, size_t dataLength);
+int msc_read_object_unit(sc_card_t *card, msc_id objectId, int offset, u8 *data, size_t dataLength, size_t *readUnit);
 int msc_create_object(sc_card_t *card, msc_id objectId, size_t objectSize, unsigned short read, unsigned short write, unsigned short deletion);
 int msc_partial_update_object(sc_card_t *card, msc_id objectId, int offset, const u8 *data, size_t dataLength);
 int msc_update_object(sc_card_t *card, msc_id objectId, int offset, const u8 *data, size_t dataLength);
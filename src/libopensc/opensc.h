@@ -49,6 +49,8 @@ extern "C" {
 #define SC_SEC_OPERATION_SIGN		0x0002
 #define SC_SEC_OPERATION_AUTHENTICATE	0x0003
 #define SC_SEC_OPERATION_DERIVE         0x0004
+#define SC_SEC_OPERATION_ENCRYPT_SYM	0x0005
+#define SC_SEC_OPERATION_DECRYPT_SYM	0x0006
 
 /* sc_security_env flags */
 #define SC_SEC_ENV_ALG_REF_PRESENT	0x0001
@@ -68,6 +70,7 @@ extern "C" {
 #define SC_ALGORITHM_DES		64
 #define SC_ALGORITHM_3DES		65
 #define SC_ALGORITHM_GOST		66
+#define SC_ALGORITHM_AES		67
 
 /* Hash algorithms */
 #define SC_ALGORITHM_MD5		128
@@ -240,8 +243,28 @@ struct sc_ef_atr {
 	struct sc_object_id allocation_oid;
 
 	unsigned status;
+
+	/* extended length information, 0 if not present */
+	size_t max_command_apdu;
+	size_t max_response_apdu;
+};
+
+/* The memory of one cache of a card, counted against cache_memory_max_size
+ * (internal, see _sc_memcache_add()) */
+struct sc_memcache_account {
+	const char *name;
+	/* entries can be dropped at any time between two uses */
+	int evictable;
+	size_t bytes;
+	unsigned long entries;
+	/* bytes the cache is asked to drop on its next use */
+	size_t trim;
+	/* in ctx->memcache_accounts while it holds entries */
+	struct sc_memcache_account *next;
 };
 
+#define SC_CARD_FCI_CACHE_SIZE	32
+
 struct sc_card_cache {
 	struct sc_path current_path;
 
@@ -249,6 +272,27 @@ struct sc_card_cache {
         struct sc_file *current_df;
 
 	int valid;
+
+	/* Last file selected with sc_select_file() while the card stays locked.
+	 * A new SELECT of it is skipped. */
+	struct sc_path selected_path;
+	int selected;
+
+	/* FCI of files selected while the card stays locked, keyed by
+	 * file->path. Entries are dropped when a file is written, created or
+	 * deleted, and when the lock is released. */
+	struct sc_file *fci[SC_CARD_FCI_CACHE_SIZE];
+	size_t fci_next;
+	struct sc_memcache_account fci_account;
+
+	/* Changes whenever a security environment set on the card may be
+	 * gone: the lock was released, the card was reset, or a file was
+	 * selected or another environment set since. */
+	unsigned int sec_env_serial;
+
+	/* Changes whenever the PINs verified on the card may have been
+	 * reset: the card was reset or logged out. */
+	unsigned int security_serial;
 };
 
 #define SC_PROTO_T0		0x00000001
@@ -280,6 +324,96 @@ struct sc_reader_driver {
 #define SC_READER_CAP_PACE_ESIGN           0x00000008
 #define SC_READER_CAP_PACE_DESTROY_CHANNEL 0x00000010
 #define SC_READER_CAP_PACE_GENERIC         0x00000020
+/* the card is left unreset at disconnect for the next process, which may
+ * take it over when card_events did not change (see SC_CARD_FLAG_HANDED_OVER) */
+#define SC_READER_CAP_WARM_HANDOFF         0x00000040
+/* The reader takes a whole extended APDU and does the T=1 chaining itself,
+ * so that a chained APDU can be sent at once (see sc_transmit_apdu()) */
+#define SC_READER_CAP_EXT_APDU             0x00000080
+
+#define SC_TRANSMIT_STATS_BUCKETS	24
+#define SC_TRANSMIT_STATS_MAX_INS	64
+
+/* Priorities of the callers waiting for a card, see sc_count_lock_wait() */
+#define SC_LOCK_PRIO_NORMAL	0
+#define SC_LOCK_PRIO_URGENT	1	/* signatures and decryptions */
+#define SC_LOCK_PRIO_BULK	2	/* object searches and long reads */
+#define SC_LOCK_PRIO_COUNT	3
+
+/* APDU counters, see sc_get_transmit_stats() */
+struct sc_transmit_counter {
+	unsigned long count;
+	unsigned long errors;
+	unsigned long long bytes_sent;
+	unsigned long long bytes_received;
+	/* total time spent in the reader driver, in microseconds */
+	unsigned long long time_us;
+	/* histogram[i]: APDUs that took less than 2^(i+1) microseconds
+	 * (and at least 2^i, for i > 0); the last bucket takes the rest */
+	unsigned long histogram[SC_TRANSMIT_STATS_BUCKETS];
+};
+
+struct sc_transmit_stats {
+	struct sc_transmit_counter total;
+	/* per CLA/INS pair, in order of first use */
+	size_t ins_count;
+	struct sc_transmit_ins_counter {
+		unsigned char cla, ins;
+		struct sc_transmit_counter counter;
+	} ins[SC_TRANSMIT_STATS_MAX_INS];
+	/* APDUs for which the table above was full */
+	unsigned long ins_overflow;
+	/* time waited for the card, per SC_LOCK_PRIO_*; only the count,
+	 * time_us and histogram are used */
+	struct sc_transmit_counter lock_wait[SC_LOCK_PRIO_COUNT];
+};
+
+#define SC_CACHE_STATS_MAX	8
+
+/* Caches kept in memory, see sc_get_cache_stats() */
+struct sc_cache_stats {
+	const char *name;
+	/* memory and entries held now, by all cards */
+	size_t bytes;
+	unsigned long entries;
+	unsigned long hits;
+	unsigned long misses;
+	/* entries dropped for cache_memory_max_size */
+	unsigned long evictions;
+};
+
+/* APDU trace file, see apdu_trace_file in opensc.conf.
+ *
+ * Every process appends a session: the 8 bytes of SC_APDU_TRACE_MAGIC
+ * followed by records. All numbers are big endian and every record is
+ * padded with zeroes to a multiple of 8 bytes. A record starts with
+ *   u8 type, u8 RFU, u16 reader id, u32 record length (with padding).
+ * SC_APDU_TRACE_READER records give the name of a reader id, as a NUL
+ * terminated string after the header. SC_APDU_TRACE_APDU records go on with
+ *   u64 start time, in microseconds since the epoch,
+ *   u32 duration in microseconds, i32 result of the reader driver,
+ *   u16 SW1SW2, u16 command length, u32 response data length,
+ * then the command as sent and the response data without SW1SW2.
+ * SC_APDU_TRACE_ATR records give the ATR of the card connected in the
+ * reader after the header, as u8 length and the bytes of the ATR.
+ * A record length of 0 marks the unused end of a session. */
+#define SC_APDU_TRACE_MAGIC		"OSCTRC\x00\x01"
+#define SC_APDU_TRACE_MAGIC_LEN		8
+#define SC_APDU_TRACE_READER		1
+#define SC_APDU_TRACE_APDU		2
+#define SC_APDU_TRACE_ATR		3
+#define SC_APDU_TRACE_HEADER_LEN	8
+#define SC_APDU_TRACE_APDU_HEADER_LEN	32
+
+/* Tracing spans, see sc_set_trace_callback() and span_trace_file in
+ * opensc.conf. The spans of a thread nest: each one is ended by the
+ * function that began it. 'value' is an attribute of the call, as the
+ * INS of an APDU or the mechanism, at the begin, and the result at the
+ * end. 'time_us' is in microseconds, from an arbitrary origin. */
+#define SC_TRACE_SPAN_END	0
+#define SC_TRACE_SPAN_BEGIN	1
+typedef void (*sc_trace_callback_t)(void *arg, int phase, const char *name,
+		long value, unsigned long long time_us);
 
 typedef struct sc_reader {
 	struct sc_context *ctx;
@@ -292,12 +426,37 @@ typedef struct sc_reader {
 	unsigned int supported_protocols, active_protocol;
 
 	struct sc_atr atr;
+	/* Max Lc/Le supported by the reader itself (0 - unknown) */
+	size_t max_send_size;
+	size_t max_recv_size;
 	struct _atr_info {
 		u8 *hist_bytes;
 		size_t hist_bytes_len;
 		int Fi, f, Di, N;
 		u8 FI, DI;
 	} atr_info;
+
+	/* scratch buffer reused by the reader driver to encode the C-APDU
+	 * and to receive the R-APDU (see _sc_reader_get_apdu_buf()) */
+	unsigned char *apdu_buf;
+	size_t apdu_buf_len;
+
+	/* allocated on the first APDU sent */
+	struct sc_transmit_stats *stats;
+
+	/* Card connected in a shared context, see SC_CTX_FLAG_SHARED */
+	struct sc_card *shared_card;
+
+	/* Count of the card insertions and removals, for SC_READER_CAP_WARM_HANDOFF
+	 * (0 - unknown) */
+	unsigned int card_events;
+
+	/* The reader was much slower than usual: until then (in the time of
+	 * sc_transmit_time_us()), fail without asking it (0 - healthy) */
+	unsigned long long quarantine_end_us;
+
+	/* Thread doing the I/O of the reader, see reader_workers */
+	struct sc_reader_worker *worker;
 } sc_reader_t;
 
 /* This will be the new interface for handling PIN commands.
@@ -474,6 +633,11 @@ struct sc_reader_operations {
 /* Hint SC_CARD_CAP_RNG */
 #define SC_CARD_FLAG_RNG		0x00000002
 
+/* Set before init(): the card was left unreset by the last process using
+ * the same driver and was not removed since, so match_card() was skipped.
+ * Another program may still have used it in between. */
+#define SC_CARD_FLAG_HANDED_OVER	0x00000004
+
 /*
  * Card capabilities
  */
@@ -495,6 +659,26 @@ struct sc_reader_operations {
 #define SC_CARD_CAP_ONLY_RAW_HASH		0x00000040
 #define SC_CARD_CAP_ONLY_RAW_HASH_STRIPPED	0x00000080
 
+/* Do not enable extended length APDUs and larger max_recv_size from
+ * the ATR, EF.ATR and reader capabilities (see sc_connect_card()) */
+#define SC_CARD_CAP_NO_EXT_LE_PROBE		0x00000100
+
+/* Do not skip or shorten SELECTs with the file selection cache (see sc_select_file()) */
+#define SC_CARD_CAP_NO_SELECT_CACHE		0x00000200
+
+/* The READ access condition of the files from select_file() comes from
+ * the FCI, so that files not readable with SC_AC_NONE can be left alone
+ * until after a login (see the PKCS#15 prefetch at bind) */
+#define SC_CARD_CAP_FCI_READ_ACL		0x00000400
+
+/* Always send the APDUs with SC_APDU_FLAGS_CHAINING as command chains, also
+ * to SC_READER_CAP_EXT_APDU readers; set when the card rejected one */
+#define SC_CARD_CAP_NO_EXT_CHAINING		0x00000800
+
+/* DELETE FILE of a DF also deletes everything in it, so that the DF does
+ * not have to be emptied file by file first (see sc_pkcs15init_rmdir()) */
+#define SC_CARD_CAP_DELETE_DF_RECURSIVE		0x00001000
+
 typedef struct sc_card {
 	struct sc_context *ctx;
 	struct sc_reader *reader;
@@ -506,6 +690,11 @@ typedef struct sc_card {
 	int cla;
 	size_t max_send_size; /* Max Lc supported by the card */
 	size_t max_recv_size; /* Max Le supported by the card */
+	/* Max data of WRITE/UPDATE BINARY the card took after refusing
+	 * max_send_size (0 - not limited) */
+	size_t max_write_size;
+	/* SW1-SW2 of the last APDU the card answered, see sc_transmit() */
+	unsigned int last_sw;
 
 	struct sc_app_info *app[SC_MAX_CARD_APPS];
 	int app_count;
@@ -517,6 +706,8 @@ typedef struct sc_card {
 	int algorithm_count;
 
 	int lock_count;
+	/* Number of sc_connect_card() callers in a shared context */
+	unsigned int shared_refs;
 
 	struct sc_card_driver *driver;
 	struct sc_card_operations *ops;
@@ -529,6 +720,14 @@ typedef struct sc_card {
 	struct sc_serial_number serialnr;
 	struct sc_version version;
 
+	/* reads queued by sc_read_binary_async() */
+	struct sc_pending_read *pending_reads;
+	/* reads were sent to the worker of the reader since the last wait */
+	int async_reads;
+
+	/* responses of SC_APDU_FLAGS_CACHEABLE APDUs, see sc_transmit_apdu() */
+	struct sc_apdu_cache *apdu_cache;
+
 	void *mutex;
 #ifdef ENABLE_SM
 	struct sm_context sm_ctx;
@@ -656,6 +855,31 @@ struct sc_card_operations {
 	int (*read_public_key)(struct sc_card *, unsigned,
 			struct sc_path *, unsigned, unsigned,
 			unsigned char **, size_t *);
+
+	/* card_reader_lock_obtained: Called by sc_lock() when the reader
+	 *   lock is taken. <was_reset> is set when the card was reset or
+	 *   the reader reattached since the last lock, so the driver can
+	 *   restore the state it keeps in drv_data (selected application,
+	 *   ...) instead of being reinitialized. */
+	int (*card_reader_lock_obtained)(struct sc_card *, int was_reset);
+
+	/* read_records: Reads the records from <rec_nr> up to the last one
+	 *   of the current EF with as few commands as the card allows, and
+	 *   stores them one after the other in <buf>, and the length of each
+	 *   in <lengths>, for at most *<nrecords> records. Sets *<nrecords>
+	 *   to the number of records and returns the number of bytes stored. */
+	int (*read_records)(struct sc_card *card, unsigned int rec_nr,
+			u8 * buf, size_t count, unsigned long flags,
+			size_t *lengths, size_t *nrecords);
+
+	/* encrypt_sym, decrypt_sym: Enciphers or deciphers <inlen> bytes,
+	 *   a multiple of the block size, with the secret key of the current
+	 *   security environment, sending as much of it per command as the
+	 *   card takes. Returns the number of bytes stored in <out>. */
+	int (*encrypt_sym)(struct sc_card *card, const u8 *in, size_t inlen,
+			u8 *out, size_t outlen);
+	int (*decrypt_sym)(struct sc_card *card, const u8 *in, size_t inlen,
+			u8 *out, size_t outlen);
 };
 
 typedef struct sc_card_driver {
@@ -671,9 +895,22 @@ typedef struct sc_card_driver {
  * @struct sc_thread_context_t
  * Structure for the locking function to use when using libopensc
  * in a multi-threaded application.
+ *
+ * Each sc_card_t gets its own mutex (see sc_lock()), so threads working
+ * with cards in different readers of the same context do not wait for
+ * each other in sc_transmit_apdu(). With reader_workers, the APDUs of
+ * each reader are sent by a thread of that reader (see worker.c).
+ * Changes of the reader list (sc_ctx_detect_readers()) are serialized
+ * with the context mutex.
+ *
+ * The reader list and the card driver table are read far more often than
+ * they change: with version 1 of this structure and the rwlock functions,
+ * the readers take them shared and do not wait for each other. Without
+ * them (or if create_rwlock() returns SC_ERROR_NOT_SUPPORTED) the mutex
+ * functions are used for these locks too.
  */
 typedef struct {
-	/** the version number of this structure (0 for this version) */
+	/** the version number of this structure (0 or 1) */
 	unsigned int ver;
 	/** creates a mutex object */
 	int (*create_mutex)(void **);
@@ -685,6 +922,20 @@ typedef struct {
 	int (*destroy_mutex)(void *);
 	/** returns unique identifier for the thread (can be NULL) */
 	unsigned long (*thread_id)(void);
+	/* version 1 */
+	/** creates a lock with shared and exclusive owners (NULL if the
+	 *  following are NULL too) */
+	int (*create_rwlock)(void **);
+	/** locks it shared (blocks while it is locked exclusive) */
+	int (*lock_shared)(void *);
+	/** releases a shared lock */
+	int (*unlock_shared)(void *);
+	/** locks it exclusive (blocks while it is locked at all) */
+	int (*lock_exclusive)(void *);
+	/** releases an exclusive lock */
+	int (*unlock_exclusive)(void *);
+	/** destroys the lock */
+	int (*destroy_rwlock)(void *);
 } sc_thread_context_t;
 
 typedef struct sc_context {
@@ -694,6 +945,21 @@ typedef struct sc_context {
 	int debug;
 	int paranoid_memory;
 	int enable_default_driver;
+	int use_driver_cache;
+	/* Budget of the cache directory, see cache_max_size and cache_max_age */
+	unsigned long cache_max_size;
+	unsigned int cache_max_age;
+	/* Slow readers, see reader_quarantine_time and transmit_timeout_min */
+	unsigned int reader_quarantine_time;
+	unsigned int transmit_timeout_min;
+	/* Every reader has a worker thread, see reader_workers */
+	int reader_workers;
+	/* Caches in memory, see cache_memory_max_size and sc_get_cache_stats() */
+	size_t cache_memory_max;
+	size_t cache_memory_used;
+	struct sc_memcache_account *memcache_accounts;
+	struct sc_cache_stats cache_stats[SC_CACHE_STATS_MAX];
+	void *memcache_mutex;
 
 	FILE *debug_file;
 	char *debug_filename;
@@ -707,8 +973,33 @@ typedef struct sc_context {
 	struct sc_card_driver *card_drivers[SC_MAX_CARD_DRIVERS];
 	struct sc_card_driver *forced_driver;
 
+	/* ATR tables already converted to binary, see _sc_match_atr() */
+	struct sc_atr_compiled *compiled_atrs;
+
 	sc_thread_context_t	*thread_ctx;
 	void *mutex;
+	/* shared for lookups in readers, exclusive for changes, see sc_rwlock_create() */
+	void *readers_lock;
+	/* the same for card_drivers, forced_driver and compiled_atrs */
+	void *drivers_lock;
+	/* placeholders of the 'lazy_load' drivers replaced in card_drivers */
+	struct lazy_card_driver *loaded_lazy_drivers;
+
+	/* Debug messages waiting for the writer thread, see debug_async */
+	struct sc_log_queue *log_queue;
+	/* see apdu_trace_file */
+	struct sc_apdu_trace *apdu_trace;
+	/* see sc_set_trace_callback(), NULL while the spans are not traced */
+	sc_trace_callback_t trace_cb;
+	void *trace_arg;
+	/* see span_trace_file */
+	struct sc_span_trace *span_trace;
+
+	/* SC_CTX_FLAG_* given to sc_context_create() */
+	unsigned long flags;
+	/* Number of sc_context_create() callers using a shared context */
+	unsigned int shared_refs;
+	struct sc_context *shared_next;
 
 	unsigned int magic;
 } sc_context_t;
@@ -722,6 +1013,87 @@ typedef struct sc_context {
  */
 int sc_transmit_apdu(struct sc_card *, struct sc_apdu *);
 
+/** Sends a sequence of APDUs to the card holding the card lock only once
+ *  @param  card     struct sc_card object to which the APDUs should be send
+ *  @param  apdus    array of sc_apdu_t objects to be send in order
+ *  @param  count    number of APDUs in @a apdus
+ *  @param  stop_sw  if not 0, stop after the first APDU that returns
+ *                   a status word different from @a stop_sw (ex. 0x9000)
+ *  @param  results  optional array of @a count elements, receives the
+ *                   transmit error or the sc_check_sw() value of every APDU;
+ *                   APDUs that were not sent are set to SC_ERROR_NOT_ALLOWED
+ *  @return number of APDUs transmitted or an error code
+ */
+int sc_transmit_apdu_batch(struct sc_card *card, struct sc_apdu *apdus, size_t count,
+		unsigned int stop_sw, int *results);
+
+/** Returns the memory held and the hits and misses of the caches kept in
+ *  memory, one entry per kind of cache for all the cards of the context.
+ *  @param  ctx    OpenSC context
+ *  @param  stats  array that receives the counters
+ *  @param  count  in: size of the array; out: number of entries filled
+ *  @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_get_cache_stats(sc_context_t *ctx, struct sc_cache_stats *stats, size_t *count);
+
+/** Returns the APDU counters of a reader since it was detected or since
+ *  the last sc_reset_transmit_stats(). They are kept for every APDU,
+ *  independently of the debug level.
+ *  @param  reader  reader object
+ *  @param  stats   receives a copy of the counters
+ *  @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_get_transmit_stats(struct sc_reader *reader, struct sc_transmit_stats *stats);
+
+/** Clears the APDU counters of a reader
+ *  @param  reader  reader object
+ */
+void sc_reset_transmit_stats(struct sc_reader *reader);
+
+/** Counts the time a caller waited for the card of a reader, kept with
+ *  the APDU counters. To be called by the holder of the card.
+ *  @param  reader   reader object
+ *  @param  prio     priority of the caller, SC_LOCK_PRIO_*
+ *  @param  time_us  time waited, in microseconds
+ */
+void sc_count_lock_wait(struct sc_reader *reader, int prio, unsigned long long time_us);
+
+/** Passes the begin and the end of the spans of a call, from the PKCS#11
+ *  functions through the PKCS#15 and card operations down to the APDUs,
+ *  to a callback. Replaces the span_trace_file of the configuration.
+ *  To be set while the context is not used by other threads.
+ *  @param  ctx  OpenSC context
+ *  @param  cb   the callback, NULL to stop tracing
+ *  @param  arg  first argument of the callback
+ *  @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_set_trace_callback(sc_context_t *ctx, sc_trace_callback_t cb, void *arg);
+
+struct sc_trace_profile;
+
+/** Sums up the spans of sc_set_trace_callback() by name, as the phases of
+ *  sc_connect_card() and sc_pkcs15_bind(): the calls, the time, the APDUs
+ *  and bytes of the readers and the lookups of the file cache within
+ *  them. Takes the trace callback of the context until
+ *  sc_trace_profile_stop(); for a single thread.
+ *  @param  ctx      OpenSC context
+ *  @param  profile  receives the profile
+ *  @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_trace_profile_start(sc_context_t *ctx, struct sc_trace_profile **profile);
+
+/** Prints a line per span name, in the order they were first seen and
+ *  indented as they nested then, and the total since the start
+ *  @param  profile  profile of sc_trace_profile_start()
+ *  @param  f        where to print it
+ */
+void sc_trace_profile_print(struct sc_trace_profile *profile, FILE *f);
+
+/** Gives the trace callback back and frees the profile
+ *  @param  profile  profile of sc_trace_profile_start()
+ */
+void sc_trace_profile_stop(struct sc_trace_profile *profile);
+
 void sc_format_apdu(struct sc_card *, struct sc_apdu *, int, int, int, int);
 
 int sc_check_apdu(struct sc_card *, const struct sc_apdu *);
@@ -767,12 +1139,20 @@ typedef struct {
 	 *  dependend configuration data). If NULL the name "default"
 	 *  will be used. */
 	const char    *app_name;
-	/** flags, currently unused */
+	/** flags, SC_CTX_FLAG_* */
 	unsigned long flags;
 	/** mutex functions to use (optional) */
 	sc_thread_context_t *thread_ctx;
 } sc_context_param_t;
 
+/** Share the context with the other callers of sc_context_create() in the
+ *  process that give the same application name and this flag. They get the
+ *  same sc_context_t, and so the same readers and logging configuration,
+ *  and each of them has to call sc_release_context(). A card connected in
+ *  a shared context is returned again by sc_connect_card() for the same
+ *  reader until every caller called sc_disconnect_card(). */
+#define SC_CTX_FLAG_SHARED	0x00000001
+
 /**
  * Repairs an already existing sc_context_t object. This may occur if
  * multithreaded issues mean that another context in the same heap is deleted.
@@ -782,6 +1162,19 @@ typedef struct {
  */
 int sc_context_repair(sc_context_t **ctx);
 
+/**
+ * Makes an existing context usable in the child of fork(). The
+ * configuration and the card drivers are kept; the readers, the
+ * connection to the reader driver and the mutex inherited from the
+ * parent are dropped without being released (they are still the
+ * parent's) and the readers are detected again.
+ * @param  ctx   the context created before fork()
+ * @return SC_SUCCESS, or SC_ERROR_NOT_SUPPORTED if the reader driver
+ *         cannot be reinitialized this way and the context has to be
+ *         created again.
+ */
+int sc_ctx_forked(sc_context_t *ctx);
+
 /**
  * Creates a new sc_context_t object.
  * @param  ctx   pointer to a sc_context_t pointer for the newly
@@ -906,6 +1299,8 @@ int sc_detect_card_presence(sc_reader_t *reader);
  * @param event (OUT) the events that occurred. This is also ORed
  *   from the SC_EVENT_CARD_* constants listed above.
  * @param timeout Amount of millisecs to wait; -1 means forever
+ * @param reader_states Not used; the context keeps the reader states
+ *   between the calls, so that a wait only returns new events
  * @retval < 0 if an error occured
  * @retval = 0 if a an event happened
  * @retval = 1 if the timeout occured
@@ -958,6 +1353,17 @@ int sc_unlock(struct sc_card *card);
  */
 int sc_select_file(struct sc_card *card, const sc_path_t *path,
 		   sc_file_t **file);
+/**
+ * Returns the FCI of a file without reading it. The FCI cached by an earlier
+ * sc_select_file() within the same card lock is used when there is one,
+ * else the file is selected.
+ * @param  card  struct sc_card object on which to issue the command
+ * @param  path  The path or name of the desired file
+ * @param  file  Receives a pointer to a new structure
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_get_file_info(struct sc_card *card, const sc_path_t *path,
+		   sc_file_t **file);
 /**
  * List file ids within a DF
  * @param  card    struct sc_card object on which to issue the command
@@ -978,6 +1384,40 @@ int sc_list_files(struct sc_card *card, u8 *buf, size_t buflen);
  */
 int sc_read_binary(struct sc_card *card, unsigned int idx, u8 * buf,
 		   size_t count, unsigned long flags);
+/**
+ * Called when a read queued by sc_read_binary_async() is done
+ * @param  card      struct sc_card object the read was queued on
+ * @param  idx       index within the file of the data
+ * @param  buf       the data read, valid during the call only
+ * @param  result    number of bytes in buf or an error code
+ * @param  userdata  as passed to sc_read_binary_async()
+ */
+typedef void (*sc_read_binary_cb_t)(struct sc_card *card, unsigned int idx,
+		const u8 *buf, int result, void *userdata);
+/**
+ * Queues a read of the current binary EF. While the card is locked, the
+ * queued reads are done before the next sc_select_file() or write to the
+ * card, at the outermost sc_unlock() or by sc_complete_reads(), with
+ * adjacent reads merged into one. Without the card lock the read is sent
+ * to the worker thread of the reader (see reader_workers) and cb is called
+ * in that thread; the next sc_select_file(), write or sc_complete_reads()
+ * waits for it. Without a worker the read is done at once.
+ * @param  card      struct sc_card object on which to issue the command
+ * @param  idx       index within the file with the data to read
+ * @param  count     number of bytes to read
+ * @param  cb        function called with the data
+ * @param  userdata  passed to cb
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_read_binary_async(struct sc_card *card, unsigned int idx, size_t count,
+		sc_read_binary_cb_t cb, void *userdata);
+/**
+ * Does the reads queued by sc_read_binary_async() and calls their callbacks,
+ * after waiting for the reads sent to the worker of the reader
+ * @param  card   struct sc_card object on which to issue the command
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_complete_reads(struct sc_card *card);
 /**
  * Write data to a binary EF
  * @param  card   struct sc_card object on which to issue the command 
@@ -1032,6 +1472,21 @@ int sc_erase_binary(struct sc_card *card, unsigned int idx,
  */
 int sc_read_record(struct sc_card *card, unsigned int rec_nr, u8 * buf,
 		   size_t count, unsigned long flags);
+/**
+ * Reads the records from rec_nr up to the last one of the current (i.e.
+ * selected) file, one after the other in a single buffer.
+ * @param  card    struct sc_card object on which to issue the command
+ * @param  rec_nr  record number of the first record, starting from 1
+ * @param  buf     Pointer to a buffer for storing the data
+ * @param  count   Size of the buffer
+ * @param  flags   flags (may contain a short file id of a file to select)
+ * @param  lengths  Receives the length of each record read
+ * @param  nrecords  Size of lengths; receives the number of records read
+ * @retval number of bytes read or an error value
+ */
+int sc_read_records(struct sc_card *card, unsigned int rec_nr, u8 * buf,
+		   size_t count, unsigned long flags,
+		   size_t *lengths, size_t *nrecords);
 /**
  * Writes data to a record from the current (i.e. selected) file.
  * @param  card    struct sc_card object on which to issue the command
@@ -1090,6 +1545,10 @@ int sc_decipher(struct sc_card *card, const u8 * crgram, size_t crgram_len,
 		u8 * out, size_t outlen);
 int sc_compute_signature(struct sc_card *card, const u8 * data,
 			 size_t data_len, u8 * out, size_t outlen);
+int sc_encrypt_sym(struct sc_card *card, const u8 *in, size_t inlen,
+		u8 *out, size_t outlen);
+int sc_decrypt_sym(struct sc_card *card, const u8 *in, size_t inlen,
+		u8 *out, size_t outlen);
 int sc_verify(struct sc_card *card, unsigned int type, int ref, const u8 *buf,
 	      size_t buflen, int *tries_left);
 /**
@@ -1261,7 +1720,30 @@ int sc_base64_decode(const char *in, u8 *out, size_t outlen);
  * @param  len  length of the memory buffer
  */
 void sc_mem_clear(void *ptr, size_t len);
+/**
+ * Compares two memory buffers in a time that does not depend on their
+ * content, e.g. to check a MAC.
+ * @param  a    first buffer
+ * @param  b    second buffer
+ * @param  len  length of the buffers
+ * @return 0 if the buffers are equal and 1 otherwise
+ */
+int sc_mem_cmp_ct(const void *a, const void *b, size_t len);
+/**
+ * Allocates zeroed memory that is kept out of the swap. Small blocks come
+ * from a pool of locked arenas.
+ * @param  ctx  OpenSC context, for the 'paranoid_memory' option
+ * @param  len  size of the block
+ * @return the block, to be freed with sc_mem_free_secure(), or NULL
+ */
 void *sc_mem_alloc_secure(sc_context_t *ctx, size_t len);
+/**
+ * Wipes and frees a block of sc_mem_alloc_secure(). Blocks of malloc()
+ * are accepted too.
+ * @param  ptr  the block
+ * @param  len  size of the block, as given to sc_mem_alloc_secure()
+ */
+void sc_mem_free_secure(void *ptr, size_t len);
 int sc_mem_reverse(unsigned char *buf, size_t len);
 
 int sc_get_cache_dir(sc_context_t *ctx, char *buf, size_t bufsize);
@@ -1275,6 +1757,14 @@ void sc_free_ef_atr(struct sc_card *card);
 int sc_update_dir(struct sc_card *card, sc_app_info_t *app);
 
 void sc_print_cache(struct sc_card *card);
+/* Forgets everything known about the current file of the card and the
+ * cached APDU responses, with card->mutex held (as sc_lock() and
+ * sc_reset() do when the card was reset) */
+void sc_invalidate_cache(struct sc_card *card);
+/* Forgets the file kept by sc_select_file() to skip duplicate SELECTs */
+void sc_invalidate_select_cache(struct sc_card *card);
+/* Forgets the cached FCI of 'path', or of all files if 'path' is NULL */
+void sc_invalidate_fci_cache(struct sc_card *card, const sc_path_t *path);
 
 struct sc_algorithm_info * sc_card_find_rsa_alg(struct sc_card *card,
 		unsigned int key_length);
@@ -79,30 +79,19 @@ static const struct digest_info_prefix {
       {	0,				NULL,		0,			0	}
 };
 
-/* add/remove pkcs1 BT01 padding */
-
-static int sc_pkcs1_add_01_padding(const u8 *in, size_t in_len,
-	u8 *out, size_t *out_len, size_t mod_length)
+static const struct digest_info_prefix *
+digest_info_find(unsigned int algorithm)
 {
-	size_t i;
+	int i;
 
-	if (*out_len < mod_length)
-		return SC_ERROR_BUFFER_TOO_SMALL;
-	if (in_len + 11 > mod_length)
-		return SC_ERROR_INVALID_ARGUMENTS;
-	i = mod_length - in_len;
-	memmove(out + i, in, in_len);
-	*out++ = 0x00;
-	*out++ = 0x01;
-	
-	memset(out, 0xFF, i - 3);
-	out += i - 3;
-	*out = 0x00;
-
-	*out_len = mod_length;
-	return SC_SUCCESS;
+	for (i = 0; digest_info_prefix[i].algorithm != 0; i++)
+		if (algorithm == digest_info_prefix[i].algorithm)
+			return &digest_info_prefix[i];
+	return NULL;
 }
 
+/* remove pkcs1 BT01 padding */
+
 int
 sc_pkcs1_strip_01_padding(struct sc_context *ctx, const u8 *in_dat, size_t in_len,
 		u8 *out, size_t *out_len)
@@ -136,71 +125,68 @@ sc_pkcs1_strip_01_padding(struct sc_context *ctx, const u8 *in_dat, size_t in_le
 }
 
 
+/* constant time helpers: all ones if true, zero if false */
+static unsigned int ct_is_zero(unsigned int x)
+{
+	return 0U - (((~x & (x - 1)) >> (sizeof(unsigned int) * 8 - 1)) & 1);
+}
+
+static unsigned int ct_eq(unsigned int a, unsigned int b)
+{
+	return ct_is_zero(a ^ b);
+}
+
+static unsigned int ct_lt(unsigned int a, unsigned int b)
+{
+	/* a and b are lengths, far below the top bit */
+	return 0U - ((a - b) >> (sizeof(unsigned int) * 8 - 1));
+}
+
 /* remove pkcs1 BT02 padding (adding BT02 padding is currently not
- * needed/implemented) */
+ * needed/implemented)
+ * Whether the padding is right, and where it ends, do not show in the time
+ * taken: an error oracle would let the plain text be found. */
 int
 sc_pkcs1_strip_02_padding(sc_context_t *ctx, const u8 *data, size_t len, u8 *out, size_t *out_len)
 {
-	unsigned int	n = 0;
+	unsigned int	mask, skip, good, found = 0, zero = 0, is_zero, i;
+	size_t		msg_len;
 
 	LOG_FUNC_CALLED(ctx);
 	if (data == NULL || len < 3)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
 
-	/* skip leading zero byte */
-	if (*data == 0) {
-		data++;
-		len--;
+	/* a leading zero byte is skipped */
+	mask = ct_is_zero(data[0]);
+	skip = mask & 1;
+	good = ct_eq((data[1] & mask) | (data[0] & ~mask), 0x02);
+	/* the end of the padding is the first zero byte after the BT02 byte */
+	for (i = 1; i < len; i++) {
+		is_zero = ct_is_zero(data[i]) & ~found & ct_lt(skip, i);
+		zero = (zero & ~is_zero) | (i & is_zero);
+		found |= is_zero;
 	}
-	if (data[0] != 0x02)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_WRONG_PADDING);
-	/* skip over padding bytes */
-	for (n = 1; n < len && data[n]; n++)
-		;
 	/* Must be at least 8 pad bytes */
-	if (n >= len || n < 9)
+	good &= found & ~ct_lt(zero, skip + 9);
+	if (!good)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_WRONG_PADDING);
-	n++;
+
+	msg_len = len - zero - 1;
 	if (out == NULL)
 		/* just check the padding */
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 
 	/* Now move decrypted contents to head of buffer */
-	if (*out_len < len - n)
+	if (*out_len < msg_len)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
-	*out_len = len - n;
-	memmove(out, data + n, *out_len);
+	*out_len = msg_len;
+	memmove(out, data + zero + 1, msg_len);
 
-	sc_log(ctx, "stripped output(%i): %s", len - n, sc_dump_hex(out, len - n));
-	LOG_FUNC_RETURN(ctx, len - n);
-}
-
-/* add/remove DigestInfo prefix */
-static int sc_pkcs1_add_digest_info_prefix(unsigned int algorithm,
-	const u8 *in, size_t in_len, u8 *out, size_t *out_len)
-{
-	int i;
-
-	for (i = 0; digest_info_prefix[i].algorithm != 0; i++) {
-		if (algorithm == digest_info_prefix[i].algorithm) {
-			const u8 *hdr      = digest_info_prefix[i].hdr;
-			size_t    hdr_len  = digest_info_prefix[i].hdr_len,
-			          hash_len = digest_info_prefix[i].hash_len;
-
-			if (in_len != hash_len || *out_len < (hdr_len + hash_len))
-				return SC_ERROR_INTERNAL;
-
-			memmove(out + hdr_len, in, hash_len);
-			memmove(out, hdr, hdr_len);
-			*out_len = hdr_len + hash_len;
-
-			return SC_SUCCESS;
-		}
-	}
-
-	return SC_ERROR_INTERNAL;
+	sc_log(ctx, "stripped output(%i): %s", msg_len, sc_dump_hex(out, msg_len));
+	LOG_FUNC_RETURN(ctx, msg_len);
 }
 
+/* remove DigestInfo prefix */
 int sc_pkcs1_strip_digest_info_prefix(unsigned int *algorithm,
 	const u8 *in_dat, size_t in_len, u8 *out_dat, size_t *out_len)
 {
@@ -228,13 +214,16 @@ int sc_pkcs1_strip_digest_info_prefix(unsigned int *algorithm,
 	return SC_ERROR_INTERNAL;
 }
 
-/* general PKCS#1 encoding function */
+/* general PKCS#1 encoding function
+ * The input is moved once to its place at the end of the output, which
+ * can be the input buffer, and the DigestInfo and the padding are written
+ * in front of it. */
 int sc_pkcs1_encode(sc_context_t *ctx, unsigned long flags,
 	const u8 *in, size_t in_len, u8 *out, size_t *out_len, size_t mod_len)
 {
-	int    rv, i;
-	size_t tmp_len = *out_len;
-	const u8    *tmp = in;
+	const struct digest_info_prefix *prefix;
+	const u8    *hdr = NULL;
+	size_t       hdr_len = 0, total, offs;
 	unsigned int hash_algo, pad_algo;
 
 	LOG_FUNC_CALLED(ctx);
@@ -244,32 +233,49 @@ int sc_pkcs1_encode(sc_context_t *ctx, unsigned long flags,
 	sc_log(ctx, "hash algorithm 0x%X, pad algorithm 0x%X", hash_algo, pad_algo);
 
 	if (hash_algo != SC_ALGORITHM_RSA_HASH_NONE) {
-		i = sc_pkcs1_add_digest_info_prefix(hash_algo, in, in_len, out, &tmp_len);
-		if (i != SC_SUCCESS) {
+		prefix = digest_info_find(hash_algo);
+		if (prefix == NULL || in_len != prefix->hash_len
+				|| *out_len < prefix->hdr_len + in_len) {
 			sc_log(ctx, "Unable to add digest info 0x%x", hash_algo);
-			LOG_FUNC_RETURN(ctx, i);
+			LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
 		}
-		tmp = out;
-	} else   {
-		tmp_len = in_len;
+		hdr = prefix->hdr;
+		hdr_len = prefix->hdr_len;
 	}
+	total = hdr_len + in_len;
 
 	switch(pad_algo) {
 	case SC_ALGORITHM_RSA_PAD_NONE:
 		/* padding done by card => nothing to do */
-		if (out != tmp)
-			memcpy(out, tmp, tmp_len);
-		*out_len = tmp_len;
-		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		if (*out_len < total)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_BUFFER_TOO_SMALL);
+		offs = 0;
+		break;
 	case SC_ALGORITHM_RSA_PAD_PKCS1:
 		/* add pkcs1 bt01 padding */
-		rv = sc_pkcs1_add_01_padding(tmp, tmp_len, out, out_len, mod_len);
-		LOG_FUNC_RETURN(ctx, rv);
+		if (*out_len < mod_len)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_BUFFER_TOO_SMALL);
+		if (total + 11 > mod_len)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+		offs = mod_len - total;
+		break;
 	default:
 		/* currently only pkcs1 padding is supported */
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Unsupported padding algorithm 0x%x", pad_algo);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 	}
+
+	memmove(out + offs + hdr_len, in, in_len);
+	if (hdr_len)
+		memcpy(out + offs, hdr, hdr_len);
+	if (offs) {
+		out[0] = 0x00;
+		out[1] = 0x01;
+		memset(out + 2, 0xFF, offs - 3);
+		out[offs - 1] = 0x00;
+	}
+	*out_len = offs + total;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
 int sc_get_encoding_flags(sc_context_t *ctx,
@@ -0,0 +1,252 @@
+/*
+ * part10.c: PIN verification and modification blocks of PC/SC v2 Part 10,
+ * used by the pcsc and ccid readers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef ENABLE_PCSC	/* empty file without pcsc */
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "internal-winscard.h"
+#include "part10.h"
+
+/* Local definitions */
+#define SC_CCID_PIN_TIMEOUT	30
+
+/* CCID definitions */
+#define SC_CCID_PIN_ENCODING_BIN   0x00
+#define SC_CCID_PIN_ENCODING_BCD   0x01
+#define SC_CCID_PIN_ENCODING_ASCII 0x02
+
+#define SC_CCID_PIN_UNITS_BYTES    0x80
+
+/* Build a PIN verification block + APDU */
+int part10_build_verify_pin_block(struct sc_reader *reader, u8 * buf, size_t * size, struct sc_pin_cmd_data *data)
+{
+	int offset = 0, count = 0;
+	sc_apdu_t *apdu = data->apdu;
+	u8 tmp;
+	unsigned int tmp16;
+	PIN_VERIFY_STRUCTURE *pin_verify  = (PIN_VERIFY_STRUCTURE *)buf;
+
+	/* PIN verification control message */
+	pin_verify->bTimerOut = SC_CCID_PIN_TIMEOUT;
+	pin_verify->bTimerOut2 = SC_CCID_PIN_TIMEOUT;
+
+	/* bmFormatString */
+	tmp = 0x00;
+	if (data->pin1.encoding == SC_PIN_ENCODING_ASCII) {
+		tmp |= SC_CCID_PIN_ENCODING_ASCII;
+
+		/* if the effective PIN length offset is specified, use it */
+		if (data->pin1.length_offset > 4) {
+			tmp |= SC_CCID_PIN_UNITS_BYTES;
+			tmp |= (data->pin1.length_offset - 5) << 3;
+		}
+	} else if (data->pin1.encoding == SC_PIN_ENCODING_BCD) {
+		tmp |= SC_CCID_PIN_ENCODING_BCD;
+		tmp |= SC_CCID_PIN_UNITS_BYTES;
+	} else if (data->pin1.encoding == SC_PIN_ENCODING_GLP) {
+		/* see comment about GLP PINs in sec.c */
+		tmp |= SC_CCID_PIN_ENCODING_BCD;
+		tmp |= 0x08 << 3;
+	} else
+		return SC_ERROR_NOT_SUPPORTED;
+
+	pin_verify->bmFormatString = tmp;
+
+	/* bmPINBlockString */
+	tmp = 0x00;
+	if (data->pin1.encoding == SC_PIN_ENCODING_GLP) {
+		/* GLP PIN length is encoded in 4 bits and block size is always 8 bytes */
+		tmp |= 0x40 | 0x08;
+	} else if (data->pin1.encoding == SC_PIN_ENCODING_ASCII && data->flags & SC_PIN_CMD_NEED_PADDING) {
+		tmp |= data->pin1.pad_length;
+	}
+	pin_verify->bmPINBlockString = tmp;
+
+	/* bmPINLengthFormat */
+	tmp = 0x00;
+	if (data->pin1.encoding == SC_PIN_ENCODING_GLP) {
+		/* GLP PINs expect the effective PIN length from bit 4 */
+		tmp |= 0x04;
+	}
+	pin_verify->bmPINLengthFormat = tmp;	/* bmPINLengthFormat */
+
+	if (!data->pin1.min_length || !data->pin1.max_length)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	tmp16 = (data->pin1.min_length << 8 ) + data->pin1.max_length;
+	pin_verify->wPINMaxExtraDigit = HOST_TO_CCID_16(tmp16); /* Min Max */
+
+	pin_verify->bEntryValidationCondition = 0x02; /* Keypress only */
+
+	if (reader->capabilities & SC_READER_CAP_DISPLAY)
+		pin_verify->bNumberMessage = 0xFF; /* Default message */
+	else
+		pin_verify->bNumberMessage = 0x00; /* No messages */
+
+	/* Ignore language and T=1 parameters. */
+	pin_verify->wLangId = HOST_TO_CCID_16(0x0000);
+	pin_verify->bMsgIndex = 0x00;
+	pin_verify->bTeoPrologue[0] = 0x00;
+	pin_verify->bTeoPrologue[1] = 0x00;
+	pin_verify->bTeoPrologue[2] = 0x00;
+
+	/* APDU itself */
+	pin_verify->abData[offset++] = apdu->cla;
+	pin_verify->abData[offset++] = apdu->ins;
+	pin_verify->abData[offset++] = apdu->p1;
+	pin_verify->abData[offset++] = apdu->p2;
+
+	/* Copy data if not Case 1 */
+	if (data->pin1.length_offset != 4) {
+		pin_verify->abData[offset++] = apdu->lc;
+		memcpy(&pin_verify->abData[offset], apdu->data, apdu->datalen);
+		offset += apdu->datalen;
+	}
+
+	pin_verify->ulDataLength = HOST_TO_CCID_32(offset); /* APDU size */
+
+	count = sizeof(PIN_VERIFY_STRUCTURE) + offset -1;
+	*size = count;
+	return SC_SUCCESS;
+}
+
+
+
+/* Build a PIN modification block + APDU */
+int part10_build_modify_pin_block(struct sc_reader *reader, u8 * buf, size_t * size, struct sc_pin_cmd_data *data)
+{
+	int offset = 0, count = 0;
+	sc_apdu_t *apdu = data->apdu;
+	u8 tmp;
+	unsigned int tmp16;
+	PIN_MODIFY_STRUCTURE *pin_modify  = (PIN_MODIFY_STRUCTURE *)buf;
+	struct sc_pin_cmd_pin *pin_ref =
+	   	data->flags & SC_PIN_CMD_IMPLICIT_CHANGE ?
+	   	&data->pin2 : &data->pin1;
+
+	/* PIN verification control message */
+	pin_modify->bTimerOut = SC_CCID_PIN_TIMEOUT;	/* bTimeOut */
+	pin_modify->bTimerOut2 = SC_CCID_PIN_TIMEOUT;	/* bTimeOut2 */
+
+	/* bmFormatString */
+	tmp = 0x00;
+	if (pin_ref->encoding == SC_PIN_ENCODING_ASCII) {
+		tmp |= SC_CCID_PIN_ENCODING_ASCII;
+
+		/* if the effective PIN length offset is specified, use it */
+		if (pin_ref->length_offset > 4) {
+			tmp |= SC_CCID_PIN_UNITS_BYTES;
+			tmp |= (pin_ref->length_offset - 5) << 3;
+		}
+	} else if (pin_ref->encoding == SC_PIN_ENCODING_BCD) {
+		tmp |= SC_CCID_PIN_ENCODING_BCD;
+		tmp |= SC_CCID_PIN_UNITS_BYTES;
+	} else if (pin_ref->encoding == SC_PIN_ENCODING_GLP) {
+		/* see comment about GLP PINs in sec.c */
+		tmp |= SC_CCID_PIN_ENCODING_BCD;
+		tmp |= 0x08 << 3;
+	} else
+		return SC_ERROR_NOT_SUPPORTED;
+
+	pin_modify->bmFormatString = tmp;	/* bmFormatString */
+
+	/* bmPINBlockString */
+	tmp = 0x00;
+	if (pin_ref->encoding == SC_PIN_ENCODING_GLP) {
+		/* GLP PIN length is encoded in 4 bits and block size is always 8 bytes */
+		tmp |= 0x40 | 0x08;
+	} else if (pin_ref->encoding == SC_PIN_ENCODING_ASCII && pin_ref->pad_length) {
+		tmp |= pin_ref->pad_length;
+	}
+	pin_modify->bmPINBlockString = tmp; /* bmPINBlockString */
+
+	/* bmPINLengthFormat */
+	tmp = 0x00;
+	if (pin_ref->encoding == SC_PIN_ENCODING_GLP) {
+		/* GLP PINs expect the effective PIN length from bit 4 */
+		tmp |= 0x04;
+	}
+	pin_modify->bmPINLengthFormat = tmp;	/* bmPINLengthFormat */
+
+	/* Set offsets if not Case 1 APDU */
+	if (pin_ref->length_offset != 4) {
+		pin_modify->bInsertionOffsetOld = data->pin1.offset - 5;
+		pin_modify->bInsertionOffsetNew = data->pin2.offset - 5;
+	} else {
+		pin_modify->bInsertionOffsetOld = 0x00;
+		pin_modify->bInsertionOffsetNew = 0x00;
+	}
+
+	if (!pin_ref->min_length || !pin_ref->max_length)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	tmp16 = (pin_ref->min_length << 8 ) + pin_ref->max_length;
+	pin_modify->wPINMaxExtraDigit = HOST_TO_CCID_16(tmp16); /* Min Max */
+
+	/* bConfirmPIN flags
+	 * 0x01: New Pin, Confirm Pin
+	 * 0x03: Enter Old Pin, New Pin, Confirm Pin
+	 */
+	pin_modify->bConfirmPIN = data->flags & SC_PIN_CMD_IMPLICIT_CHANGE ? 0x01 : 0x03;
+	pin_modify->bEntryValidationCondition = 0x02;	/* bEntryValidationCondition, keypress only */
+
+	/* bNumberMessage flags
+	 * 0x02: Messages seen on Pinpad display: New Pin, Confirm Pin
+	 * 0x03: Messages seen on Pinpad display: Enter Old Pin, New Pin, Confirm Pin
+	 * Could be 0xFF too.
+	 */
+	if (reader->capabilities & SC_READER_CAP_DISPLAY)
+		pin_modify->bNumberMessage = data->flags & SC_PIN_CMD_IMPLICIT_CHANGE ? 0x02 : 0x03;
+	else
+		pin_modify->bNumberMessage = 0x00; /* No messages */
+
+	/* Ignore language and T=1 parameters. */
+	pin_modify->wLangId = HOST_TO_CCID_16(0x0000);
+	pin_modify->bMsgIndex1 = 0x00; /* Default message indexes */
+	pin_modify->bMsgIndex2 = 0x01;
+	pin_modify->bMsgIndex3 = 0x02;
+	pin_modify->bTeoPrologue[0] = 0x00;
+	pin_modify->bTeoPrologue[1] = 0x00;
+	pin_modify->bTeoPrologue[2] = 0x00;
+
+	/* APDU itself */
+	pin_modify->abData[offset++] = apdu->cla;
+	pin_modify->abData[offset++] = apdu->ins;
+	pin_modify->abData[offset++] = apdu->p1;
+	pin_modify->abData[offset++] = apdu->p2;
+
+	/* Copy data if not Case 1 */
+	if (pin_ref->length_offset != 4) {
+		pin_modify->abData[offset++] = apdu->lc;
+		memcpy(&pin_modify->abData[offset], apdu->data, apdu->datalen);
+		offset += apdu->datalen;
+	}
+
+	pin_modify->ulDataLength = HOST_TO_CCID_32(offset); /* APDU size */
+
+	count = sizeof(PIN_MODIFY_STRUCTURE) + offset -1;
+	*size = count;
+	return SC_SUCCESS;
+}
+
+#endif	/* ENABLE_PCSC */
@@ -0,0 +1,39 @@
+/*
+ * part10.h: PIN blocks of PC/SC v2 Part 10
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _OPENSC_PART10_H
+#define _OPENSC_PART10_H
+
+#include "libopensc/opensc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A PIN_VERIFY_STRUCTURE or PIN_MODIFY_STRUCTURE followed by the APDU of
+ * the PIN command, *size is set to the length of both */
+int part10_build_verify_pin_block(struct sc_reader *reader, u8 *buf, size_t *size,
+		struct sc_pin_cmd_data *data);
+int part10_build_modify_pin_block(struct sc_reader *reader, u8 *buf, size_t *size,
+		struct sc_pin_cmd_data *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
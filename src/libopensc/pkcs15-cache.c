@@ -27,139 +27,1164 @@
 #include <unistd.h>
 #endif
 #include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
 
 #include "internal.h"
 #include "pkcs15.h"
+#include "cardctl.h"
+
+/*
+ * All the cached files of a token are kept in one file,
+ * "<cache_dir>/<serial>.p15cache":
+ *
+ *   "OSCP15C2"          magic and version
+ *   u32 len, bytes      last update of the token the files belong to
+ *   u32 count           number of entries
+ *   count times:        index of the entries
+ *     u8 kind           CACHE_FILE, CACHE_OBJECTS or CACHE_ABSENT
+ *     u8 len, bytes     path (without a leading 3F00)
+ *     u32 offset        of the content, from the end of the index
+ *     u32 len           of the content
+ *   contents
+ *
+ * All numbers are big endian. The file is read once per PKCS #15 card
+ * and written to a temporary file that is renamed over the old one.
+ * Where it can, the file is mapped read-only instead of read: the entries
+ * point into the mapping, and the processes using the same token share
+ * its pages rather than each keeping a copy. A rename from another
+ * process does not change a mapped file. The image is also shared, by
+ * reference, with the certificates parsed in place in it, see
+ * sc_pkcs15_read_certificate_shared().
+ */
+#define CACHE_DB_MAGIC		"OSCP15C2"
+#define CACHE_DB_MAGIC_LEN	8
+
+/* content of the file at the path */
+#define CACHE_FILE		0
+/* objects decoded from the DF at the path */
+#define CACHE_OBJECTS		1
+/* there is no file at the path, no content */
+#define CACHE_ABSENT		2
+
+struct sc_pkcs15_cache_entry {
+	int kind;
+	u8 path[SC_MAX_PATH_SIZE];
+	size_t path_len;
+	u8 *data;
+	size_t len;
+	int in_image;		/* data points into the image of the file */
+};
+
+struct sc_pkcs15_shared_buf {
+	unsigned int refs;
+	u8 *value;
+	size_t len;
+	int mapped;
+};
+
+struct sc_pkcs15_cache_db {
+	char *last_update;
+	struct sc_pkcs15_cache_entry *entries;
+	size_t count;
+	struct sc_pkcs15_shared_buf *image;	/* content of the file read in */
+};
 
 static int generate_cache_filename(struct sc_pkcs15_card *p15card,
-				   const sc_path_t *path,
 				   char *buf, size_t bufsize)
 {
 	char dir[PATH_MAX];
-        char pathname[SC_MAX_PATH_SIZE*2+1];
 	int  r;
-        const u8 *pathptr;
-        size_t i, pathlen;
 
-	if (path->type != SC_PATH_TYPE_PATH)
-                return SC_ERROR_INVALID_ARGUMENTS;
-	assert(path->len <= SC_MAX_PATH_SIZE);
+	if (p15card->tokeninfo->serial_number == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	r = snprintf(buf, bufsize, "%s/%s.p15cache", dir, p15card->tokeninfo->serial_number);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/* Name of the one-file-per-path cache of earlier versions */
+static int generate_legacy_filename(struct sc_pkcs15_card *p15card,
+				   const u8 *path, size_t pathlen,
+				   char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	char pathname[SC_MAX_PATH_SIZE*2+1];
+	char *last_update;
+	size_t i;
+	int r;
+
 	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
 	if (r)
 		return r;
-	pathptr = path->value;
-	pathlen = path->len;
-	if (pathlen > 2 && memcmp(pathptr, "\x3F\x00", 2) == 0) {
-                pathptr += 2;
-		pathlen -= 2;
-	}
 	for (i = 0; i < pathlen; i++)
-		sprintf(pathname + 2*i, "%02X", pathptr[i]);
-	if (p15card->tokeninfo->serial_number != NULL) {
-		char *last_update = sc_pkcs15_get_lastupdate(p15card);
-		if (last_update != NULL)
-			r = snprintf(buf, bufsize, "%s/%s_%s_%s", dir, p15card->tokeninfo->serial_number,
-					last_update, pathname);
-		else
-			r = snprintf(buf, bufsize, "%s/%s_DATE_%s", dir,
-					p15card->tokeninfo->serial_number, pathname);
-		if (r < 0)
-			return SC_ERROR_BUFFER_TOO_SMALL;
-	} else
+		sprintf(pathname + 2*i, "%02X", path[i]);
+	pathname[2*pathlen] = '\0';
+	last_update = sc_pkcs15_get_lastupdate(p15card);
+	r = snprintf(buf, bufsize, "%s/%s_%s_%s", dir, p15card->tokeninfo->serial_number,
+			last_update ? last_update : "DATE", pathname);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/* The path of a cached file, without the leading 3F00 */
+static int cache_key(const sc_path_t *path, const u8 **key, size_t *key_len)
+{
+	if (path->type != SC_PATH_TYPE_PATH)
 		return SC_ERROR_INVALID_ARGUMENTS;
-        return SC_SUCCESS;
+	assert(path->len <= SC_MAX_PATH_SIZE);
+	*key = path->value;
+	*key_len = path->len;
+	if (*key_len > 2 && memcmp(*key, "\x3F\x00", 2) == 0) {
+		*key += 2;
+		*key_len -= 2;
+	}
+	return SC_SUCCESS;
+}
+
+static void free_entry_data(struct sc_pkcs15_cache_entry *e)
+{
+	if (!e->in_image)
+		free(e->data);
+	e->data = NULL;
+	e->in_image = 0;
+}
+
+void sc_pkcs15_shared_buf_release(struct sc_pkcs15_shared_buf *buf)
+{
+	if (buf == NULL || --buf->refs > 0)
+		return;
+#ifdef HAVE_SYS_MMAN_H
+	if (buf->mapped)
+		munmap(buf->value, buf->len);
+	else
+#endif
+		free(buf->value);
+	free(buf);
+}
+
+/* The entries in the image go with it, the certificates keep it */
+static void free_image(struct sc_pkcs15_cache_db *db)
+{
+	sc_pkcs15_shared_buf_release(db->image);
+	db->image = NULL;
+}
+
+void sc_pkcs15_free_cache(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_cache_db *db = p15card->cache_db;
+	size_t i;
+
+	if (db == NULL)
+		return;
+	for (i = 0; i < db->count; i++)
+		free_entry_data(&db->entries[i]);
+	free(db->entries);
+	free_image(db);
+	free(db->last_update);
+	free(db);
+	p15card->cache_db = NULL;
+}
+
+static unsigned long get_u32(const u8 *p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16)
+		| ((unsigned long)p[2] << 8) | p[3];
+}
+
+static void put_u32(u8 *p, unsigned long v)
+{
+	p[0] = (v >> 24) & 0xFF;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+/* Parses the cache file image; drops what does not belong to 'last_update'.
+ * The entries point into the image. */
+static int parse_cache_db(struct sc_pkcs15_cache_db *db, u8 *buf, size_t len,
+		const char *last_update)
+{
+	u8 *p = buf, *end = buf + len, *data;
+	unsigned long lu_len, count, i;
+
+	if (len < CACHE_DB_MAGIC_LEN + 8 || memcmp(p, CACHE_DB_MAGIC, CACHE_DB_MAGIC_LEN))
+		return SC_ERROR_INVALID_DATA;
+	p += CACHE_DB_MAGIC_LEN;
+	lu_len = get_u32(p);
+	p += 4;
+	if (lu_len > (size_t)(end - p) - 4)
+		return SC_ERROR_INVALID_DATA;
+	if (lu_len != strlen(last_update) || memcmp(p, last_update, lu_len))
+		return SC_ERROR_OBJECT_NOT_VALID;
+	p += lu_len;
+	count = get_u32(p);
+	p += 4;
+	if (count > (size_t)(end - p) / 10)
+		return SC_ERROR_INVALID_DATA;
+
+	/* find the end of the index first */
+	for (data = p, i = 0; i < count; i++) {
+		if (end - data < 10 || data[1] > SC_MAX_PATH_SIZE || (size_t)(end - data) < 10 + data[1])
+			return SC_ERROR_INVALID_DATA;
+		data += 10 + data[1];
+	}
+
+	db->entries = calloc(count ? count : 1, sizeof(*db->entries));
+	if (db->entries == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (i = 0; i < count; i++) {
+		struct sc_pkcs15_cache_entry *e = &db->entries[i];
+		unsigned long offset, elen;
+
+		e->kind = p[0];
+		e->path_len = p[1];
+		memcpy(e->path, p + 2, e->path_len);
+		p += 2 + e->path_len;
+		offset = get_u32(p);
+		elen = get_u32(p + 4);
+		p += 8;
+		if (offset > (size_t)(end - data) || elen > (size_t)(end - data) - offset)
+			return SC_ERROR_INVALID_DATA;
+		e->data = data + offset;
+		e->len = elen;
+		e->in_image = 1;
+		db->count++;
+	}
+	return SC_SUCCESS;
+}
+
+/* Reads the cache file of the token on first use */
+static struct sc_pkcs15_cache_db *get_cache_db(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_cache_db *db;
+	char fname[PATH_MAX];
+	const char *last_update;
+	struct stat stbuf;
+	FILE *f;
+	int r;
+
+	if (p15card->cache_db != NULL)
+		return p15card->cache_db;
+	if (generate_cache_filename(p15card, fname, sizeof(fname)) != SC_SUCCESS)
+		return NULL;
+
+	db = calloc(1, sizeof(*db));
+	if (db == NULL)
+		return NULL;
+	last_update = sc_pkcs15_get_lastupdate(p15card);
+	db->last_update = strdup(last_update ? last_update : "");
+	if (db->last_update == NULL) {
+		free(db);
+		return NULL;
+	}
+	p15card->cache_db = db;
+
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return db;
+	if (fstat(fileno(f), &stbuf) == 0 && stbuf.st_size > 0
+			&& (db->image = calloc(1, sizeof(*db->image))) != NULL) {
+		struct sc_pkcs15_shared_buf *image = db->image;
+
+		image->refs = 1;
+		image->len = (size_t)stbuf.st_size;
+#ifdef HAVE_SYS_MMAN_H
+		image->value = mmap(NULL, image->len, PROT_READ, MAP_SHARED, fileno(f), 0);
+		if (image->value != MAP_FAILED)
+			image->mapped = 1;
+		else
+			image->value = NULL;
+#endif
+		if (image->value == NULL) {
+			image->value = malloc(image->len);
+			if (image->value == NULL || fread(image->value, 1, image->len, f) != image->len)
+				free_image(db);
+		}
+	}
+	if (db->image != NULL) {
+		r = parse_cache_db(db, db->image->value, db->image->len, db->last_update);
+		if (r != SC_SUCCESS) {
+			/* stale or broken: start over, it is rewritten on the next update */
+			sc_log(ctx, "ignoring cache file %s: %s", fname, sc_strerror(r));
+			db->count = 0;
+			free_image(db);
+		}
+	}
+	fclose(f);
+	if (db->image != NULL)
+		_sc_cache_used(ctx, fname);
+	return db;
+}
+
+static int write_cache_db(struct sc_pkcs15_card *p15card, struct sc_pkcs15_cache_db *db)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	char fname[PATH_MAX], tmpname[PATH_MAX + 8];
+	size_t i, lu_len = strlen(db->last_update), offset = 0;
+	u8 head[CACHE_DB_MAGIC_LEN + 4];
+	u8 ent[2 + SC_MAX_PATH_SIZE + 8];
+	FILE *f;
+	int r, ok;
+
+	r = generate_cache_filename(p15card, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+	if (r < 0 || (size_t)r >= sizeof(tmpname))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+
+	f = fopen(tmpname, "wb");
+	/* If the open failed because the cache directory does
+	 * not exist, create it and a re-try the fopen() call.
+	 */
+	if (f == NULL && errno == ENOENT) {
+		if ((r = sc_make_cache_dir(ctx)) < 0)
+			return r;
+		f = fopen(tmpname, "wb");
+	}
+	if (f == NULL)
+		return 0;
+
+	memcpy(head, CACHE_DB_MAGIC, CACHE_DB_MAGIC_LEN);
+	put_u32(head + CACHE_DB_MAGIC_LEN, lu_len);
+	ok = fwrite(head, 1, sizeof(head), f) == sizeof(head)
+		&& fwrite(db->last_update, 1, lu_len, f) == lu_len;
+	put_u32(head, db->count);
+	ok = ok && fwrite(head, 1, 4, f) == 4;
+	for (i = 0; ok && i < db->count; i++) {
+		const struct sc_pkcs15_cache_entry *e = &db->entries[i];
+
+		ent[0] = (u8)e->kind;
+		ent[1] = (u8)e->path_len;
+		memcpy(ent + 2, e->path, e->path_len);
+		put_u32(ent + 2 + e->path_len, offset);
+		put_u32(ent + 6 + e->path_len, e->len);
+		ok = fwrite(ent, 1, 10 + e->path_len, f) == 10 + e->path_len;
+		offset += e->len;
+	}
+	for (i = 0; ok && i < db->count; i++)
+		ok = fwrite(db->entries[i].data, 1, db->entries[i].len, f) == db->entries[i].len;
+	if (fclose(f) != 0)
+		ok = 0;
+
+	if (ok) {
+#ifdef _WIN32
+		/* rename() does not replace an existing file here */
+		remove(fname);
+#endif
+		ok = rename(tmpname, fname) == 0;
+	}
+	if (!ok) {
+		sc_log(ctx, "cannot write cache file %s", fname);
+		remove(tmpname);
+		return SC_ERROR_INTERNAL;
+	}
+	_sc_cache_used(ctx, fname);
+	return SC_SUCCESS;
+}
+
+static struct sc_pkcs15_cache_entry *find_entry(struct sc_pkcs15_cache_db *db, int kind,
+		const u8 *key, size_t key_len)
+{
+	size_t i;
+
+	for (i = 0; i < db->count; i++)
+		if (db->entries[i].kind == kind && db->entries[i].path_len == key_len
+				&& !memcmp(db->entries[i].path, key, key_len))
+			return &db->entries[i];
+	return NULL;
+}
+
+/* Replaces the entry, taking 'data', and writes the cache file */
+static int store_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_cache_db *db,
+		int kind, const u8 *key, size_t key_len, u8 *data, size_t len)
+{
+	struct sc_pkcs15_cache_entry *e;
+
+	e = find_entry(db, kind, key, key_len);
+	if (e != NULL) {
+		free_entry_data(e);
+	}
+	else {
+		struct sc_pkcs15_cache_entry *entries;
+
+		entries = realloc(db->entries, (db->count + 1) * sizeof(*entries));
+		if (entries == NULL) {
+			free(data);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		db->entries = entries;
+		e = &db->entries[db->count++];
+		e->kind = kind;
+		memcpy(e->path, key, key_len);
+		e->path_len = key_len;
+	}
+	e->data = data;
+	e->len = len;
+	e->in_image = 0;
+
+	return write_cache_db(p15card, db);
 }
 
 int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 			       const sc_path_t *path,
 			       u8 **buf, size_t *bufsize)
 {
-	char fname[PATH_MAX];
+	struct sc_pkcs15_cache_db *db;
+	const struct sc_pkcs15_cache_entry *e;
+	const u8 *key;
+	size_t key_len, count, offset;
 	int r;
-	FILE *f;
-	size_t count, offset, got;
-	struct stat stbuf;
-	u8 *data = NULL;
 
-	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
-	if (r != 0)
+	r = cache_key(path, &key, &key_len);
+	if (r != SC_SUCCESS)
 		return r;
-	r = stat(fname, &stbuf);
-	if (r)
+	db = get_cache_db(p15card);
+	if (db == NULL)
 		return SC_ERROR_FILE_NOT_FOUND;
+	e = find_entry(db, CACHE_FILE, key, key_len);
+	if (e == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+
 	if (path->count < 0) {
-		count = stbuf.st_size;
+		count = e->len;
 		offset = 0;
 	} else {
 		count = path->count;
 		offset = path->index;
-		if (offset + count > (size_t)stbuf.st_size)
+		if (offset + count > e->len)
 			return SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
 	}
 	if (*buf == NULL) {
-		data = malloc((size_t)stbuf.st_size);
-		if (data == NULL)
+		*buf = malloc(count ? count : 1);
+		if (*buf == NULL)
 			return SC_ERROR_OUT_OF_MEMORY;
 	} else
 		if (count > *bufsize)
 			return SC_ERROR_BUFFER_TOO_SMALL;
-	f = fopen(fname, "rb");
-	if (f == NULL) {
-		if (data)
-			free(data);
-		return SC_ERROR_FILE_NOT_FOUND;
-	}
-	if (offset)
-		fseek(f, (long)offset, SEEK_SET);
-	if (data)
-		*buf = data;
-	got = fread(*buf, 1, count, f);
-        fclose(f);
-	if (got != count) {
-		if (data)
-			free(data);
-		return SC_ERROR_BUFFER_TOO_SMALL;
-	}
+	memcpy(*buf, e->data + offset, count);
 	*bufsize = count;
-	if (data)
-		*buf = data;
 	return 0;
 }
 
+/* Like sc_pkcs15_read_cached_file(), without the copy: the content is left
+ * in the image of the cache file and a reference to the image is returned.
+ * Only for the entries read from the cache file, the others are replaced
+ * with the updates. */
+int sc_pkcs15_read_cached_file_shared(struct sc_pkcs15_card *p15card,
+			       const sc_path_t *path, const u8 **data, size_t *len,
+			       struct sc_pkcs15_shared_buf **image)
+{
+	struct sc_pkcs15_cache_db *db;
+	const struct sc_pkcs15_cache_entry *e;
+	const u8 *key;
+	size_t key_len;
+	int r;
+
+	r = cache_key(path, &key, &key_len);
+	if (r != SC_SUCCESS)
+		return r;
+	db = get_cache_db(p15card);
+	if (db == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	e = find_entry(db, CACHE_FILE, key, key_len);
+	if (e == NULL || !e->in_image)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	if (path->count < 0) {
+		*data = e->data;
+		*len = e->len;
+	} else {
+		if ((size_t)path->index + path->count > e->len)
+			return SC_ERROR_FILE_NOT_FOUND;
+		*data = e->data + path->index;
+		*len = path->count;
+	}
+	db->image->refs++;
+	*image = db->image;
+	return SC_SUCCESS;
+}
+
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const sc_path_t *path,
 			 const u8 *buf, size_t bufsize)
+{
+	struct sc_pkcs15_cache_db *db;
+	char legacy[PATH_MAX];
+	const u8 *key;
+	size_t key_len;
+	u8 *data;
+	int r;
+
+	r = cache_key(path, &key, &key_len);
+	if (r != SC_SUCCESS)
+		return r;
+	db = get_cache_db(p15card);
+	if (db == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	data = malloc(bufsize ? bufsize : 1);
+	if (data == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(data, buf, bufsize);
+	r = store_entry(p15card, db, CACHE_FILE, key, key_len, data, bufsize);
+	if (r == SC_SUCCESS)
+		sc_pkcs15_forget_absent_file(p15card, path);
+
+	/* drop what earlier versions cached for this path */
+	if (r == SC_SUCCESS
+			&& generate_legacy_filename(p15card, key, key_len, legacy, sizeof(legacy)) == SC_SUCCESS)
+		unlink(legacy);
+	return r;
+}
+
+int sc_pkcs15_is_absent_file(struct sc_pkcs15_card *p15card, const sc_path_t *path)
+{
+	struct sc_pkcs15_cache_db *db;
+	const u8 *key;
+	size_t key_len;
+
+	if (cache_key(path, &key, &key_len) != SC_SUCCESS)
+		return 0;
+	db = get_cache_db(p15card);
+	return db != NULL && find_entry(db, CACHE_ABSENT, key, key_len) != NULL;
+}
+
+void sc_pkcs15_cache_absent_file(struct sc_pkcs15_card *p15card, const sc_path_t *path)
+{
+	struct sc_pkcs15_cache_db *db;
+	const u8 *key;
+	size_t key_len;
+	u8 *data;
+
+	if (cache_key(path, &key, &key_len) != SC_SUCCESS)
+		return;
+	db = get_cache_db(p15card);
+	if (db == NULL || find_entry(db, CACHE_ABSENT, key, key_len) != NULL)
+		return;
+	data = malloc(1);
+	if (data != NULL)
+		store_entry(p15card, db, CACHE_ABSENT, key, key_len, data, 0);
+}
+
+/* Removes the entry, if there is one, and writes the cache file */
+static void drop_entry(struct sc_pkcs15_card *p15card, int kind, const sc_path_t *path)
+{
+	struct sc_pkcs15_cache_db *db = p15card->cache_db;
+	struct sc_pkcs15_cache_entry *e;
+	const u8 *key;
+	size_t key_len;
+
+	if (db == NULL || cache_key(path, &key, &key_len) != SC_SUCCESS)
+		return;
+	e = find_entry(db, kind, key, key_len);
+	if (e == NULL)
+		return;
+	free_entry_data(e);
+	*e = db->entries[--db->count];
+	write_cache_db(p15card, db);
+}
+
+void sc_pkcs15_forget_absent_file(struct sc_pkcs15_card *p15card, const sc_path_t *path)
+{
+	drop_entry(p15card, CACHE_ABSENT, path);
+}
+
+/* The file at the path was written */
+void sc_pkcs15_drop_cached_file(struct sc_pkcs15_card *p15card, const sc_path_t *path)
+{
+	drop_entry(p15card, CACHE_FILE, path);
+}
+
+/* Forgets all that is cached for the token, for a change that lastUpdate
+ * does not tell the other readers about */
+void sc_pkcs15_remove_cache(struct sc_pkcs15_card *p15card)
 {
 	char fname[PATH_MAX];
+
+	if (!p15card->opts.use_file_cache)
+		return;
+	sc_pkcs15_free_cache(p15card);
+	if (generate_cache_filename(p15card, fname, sizeof(fname)) == SC_SUCCESS)
+		remove(fname);
+	sc_pkcs15_drop_bind_cache(p15card);
+}
+
+/*
+ * Decoded objects of a DF. The structures are stored as they are in
+ * memory, followed by what their pointers point to, so the entry only
+ * fits the build that wrote it: it starts with the sizes of the
+ * structures and is ignored when they differ.
+ */
+struct cache_buf {
+	u8 *data;
+	size_t len, size;
+	int error;
+};
+
+static void buf_put(struct cache_buf *b, const void *data, size_t len)
+{
+	if (b->error || len == 0)
+		return;
+	if (b->len + len > b->size) {
+		size_t size = (b->size ? b->size * 2 : 1024) + len;
+		u8 *p = realloc(b->data, size);
+
+		if (p == NULL) {
+			b->error = SC_ERROR_OUT_OF_MEMORY;
+			return;
+		}
+		b->data = p;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void buf_put_u32(struct cache_buf *b, unsigned long v)
+{
+	u8 tmp[4];
+
+	put_u32(tmp, v);
+	buf_put(b, tmp, 4);
+}
+
+static void buf_put_blob(struct cache_buf *b, const void *data, size_t len)
+{
+	buf_put_u32(b, data ? len : 0xFFFFFFFFUL);
+	if (data)
+		buf_put(b, data, len);
+}
+
+struct cache_reader {
+	const u8 *p;
+	size_t left;
+	int error;
+};
+
+static const u8 *read_bytes(struct cache_reader *rd, size_t len)
+{
+	const u8 *p = rd->p;
+
+	if (rd->error || len > rd->left) {
+		rd->error = SC_ERROR_INVALID_DATA;
+		return NULL;
+	}
+	rd->p += len;
+	rd->left -= len;
+	return p;
+}
+
+static unsigned long read_u32(struct cache_reader *rd)
+{
+	const u8 *p = read_bytes(rd, 4);
+
+	return p ? get_u32(p) : 0;
+}
+
+/* Allocates and returns a copy of the next blob, NULL for a NULL pointer */
+static u8 *read_blob(struct cache_reader *rd, size_t *len)
+{
+	unsigned long n = read_u32(rd);
+	const u8 *p;
+	u8 *copy;
+
+	*len = 0;
+	if (rd->error || n == 0xFFFFFFFFUL)
+		return NULL;
+	p = read_bytes(rd, n);
+	if (p == NULL)
+		return NULL;
+	copy = malloc(n ? n : 1);
+	if (copy == NULL) {
+		rd->error = SC_ERROR_OUT_OF_MEMORY;
+		return NULL;
+	}
+	memcpy(copy, p, n);
+	*len = n;
+	return copy;
+}
+
+static size_t object_data_size(unsigned int type)
+{
+	switch (type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		return sizeof(struct sc_pkcs15_prkey_info);
+	case SC_PKCS15_TYPE_PUBKEY:
+		return sizeof(struct sc_pkcs15_pubkey_info);
+	case SC_PKCS15_TYPE_CERT:
+		return sizeof(struct sc_pkcs15_cert_info);
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		return sizeof(struct sc_pkcs15_data_info);
+	case SC_PKCS15_TYPE_AUTH:
+		return sizeof(struct sc_pkcs15_auth_info);
+	case SC_PKCS15_TYPE_SKEY:
+		return sizeof(struct sc_pkcs15_skey_info);
+	default:
+		return 0;
+	}
+}
+
+static void put_layout(struct cache_buf *b)
+{
+	buf_put_u32(b, sizeof(struct sc_pkcs15_object));
+	buf_put_u32(b, sizeof(struct sc_pkcs15_prkey_info));
+	buf_put_u32(b, sizeof(struct sc_pkcs15_pubkey_info));
+	buf_put_u32(b, sizeof(struct sc_pkcs15_cert_info));
+	buf_put_u32(b, sizeof(struct sc_pkcs15_data_info));
+	buf_put_u32(b, sizeof(struct sc_pkcs15_auth_info));
+	buf_put_u32(b, sizeof(struct sc_pkcs15_skey_info));
+}
+
+static int put_object(struct cache_buf *b, const struct sc_pkcs15_object *obj)
+{
+	size_t size = object_data_size(obj->type);
+
+	if (size == 0 || obj->data == NULL || obj->emulated != NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	buf_put(b, obj, sizeof(*obj));
+	buf_put_blob(b, obj->content.value, obj->content.len);
+	buf_put_blob(b, obj->guid, obj->guid ? strlen(obj->guid) + 1 : 0);
+	buf_put(b, obj->data, size);
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY: {
+		const struct sc_pkcs15_prkey_info *info = obj->data;
+
+		/* only parameters that are plain data */
+		if (info->params.free_params != NULL)
+			return SC_ERROR_NOT_SUPPORTED;
+		buf_put_blob(b, info->subject.value, info->subject.len);
+		buf_put_blob(b, info->params.data, info->params.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_PUBKEY: {
+		const struct sc_pkcs15_pubkey_info *info = obj->data;
+
+		if (info->params.free_params != NULL)
+			return SC_ERROR_NOT_SUPPORTED;
+		buf_put_blob(b, info->subject.value, info->subject.len);
+		buf_put_blob(b, info->params.data, info->params.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_CERT: {
+		const struct sc_pkcs15_cert_info *info = obj->data;
+
+		buf_put_blob(b, info->value.value, info->value.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_DATA_OBJECT: {
+		const struct sc_pkcs15_data_info *info = obj->data;
+
+		buf_put_blob(b, info->data.value, info->data.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_SKEY: {
+		const struct sc_pkcs15_skey_info *info = obj->data;
+
+		/* key values are not freed with the object, nor cached */
+		if (info->data.value != NULL)
+			return SC_ERROR_NOT_SUPPORTED;
+		break;
+	}
+	}
+	return b->error;
+}
+
+static struct sc_pkcs15_object *get_object(struct sc_pkcs15_card *p15card, struct cache_reader *rd)
+{
+	struct sc_pkcs15_object *obj;
+	const u8 *p;
+	size_t size, len;
+
+	p = read_bytes(rd, sizeof(*obj));
+	if (p == NULL)
+		return NULL;
+	obj = sc_pkcs15_new_object(p15card);
+	if (obj == NULL) {
+		rd->error = SC_ERROR_OUT_OF_MEMORY;
+		return NULL;
+	}
+	memcpy(obj, p, sizeof(*obj));
+	obj->in_arena = 1;
+	obj->data = obj->emulated = NULL;
+	obj->df = NULL;
+	obj->next = obj->prev = NULL;
+	obj->content.value = read_blob(rd, &obj->content.len);
+	if (obj->content.len == 0) {
+		free(obj->content.value);
+		obj->content.value = NULL;
+	}
+	obj->guid = (char *)read_blob(rd, &len);
+	if (obj->guid != NULL && (len == 0 || obj->guid[len - 1] != '\0'))
+		rd->error = SC_ERROR_INVALID_DATA;
+
+	size = object_data_size(obj->type);
+	p = read_bytes(rd, size);
+	if (size == 0 || p == NULL || (obj->data = malloc(size)) == NULL) {
+		if (!rd->error)
+			rd->error = SC_ERROR_INVALID_DATA;
+		/* not a known type: free() will do */
+		obj->type = 0;
+		return obj;
+	}
+	memcpy(obj->data, p, size);
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY: {
+		struct sc_pkcs15_prkey_info *info = obj->data;
+
+		info->subject.value = read_blob(rd, &info->subject.len);
+		info->params.data = read_blob(rd, &info->params.len);
+		info->params.free_params = NULL;
+		break;
+	}
+	case SC_PKCS15_TYPE_PUBKEY: {
+		struct sc_pkcs15_pubkey_info *info = obj->data;
+
+		info->subject.value = read_blob(rd, &info->subject.len);
+		info->params.data = read_blob(rd, &info->params.len);
+		info->params.free_params = NULL;
+		break;
+	}
+	case SC_PKCS15_TYPE_CERT: {
+		struct sc_pkcs15_cert_info *info = obj->data;
+
+		info->value.value = read_blob(rd, &info->value.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_DATA_OBJECT: {
+		struct sc_pkcs15_data_info *info = obj->data;
+
+		info->data.value = read_blob(rd, &info->data.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_SKEY: {
+		struct sc_pkcs15_skey_info *info = obj->data;
+
+		info->data.value = NULL;
+		info->data.len = 0;
+		break;
+	}
+	}
+	return obj;
+}
+
+int sc_pkcs15_read_cached_objects(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_cache_db *db;
+	const struct sc_pkcs15_cache_entry *e;
+	struct sc_pkcs15_object *list = NULL, **tail = &list, *obj;
+	struct cache_buf layout = { NULL, 0, 0, 0 };
+	struct cache_reader rd;
+	const u8 *key, *p;
+	size_t key_len;
+	unsigned long count, i;
 	int r;
-        FILE *f;
-        size_t c;
 
-	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
-	if (r != 0)
+	r = cache_key(&df->path, &key, &key_len);
+	if (r != SC_SUCCESS)
 		return r;
+	db = get_cache_db(p15card);
+	if (db == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	e = find_entry(db, CACHE_OBJECTS, key, key_len);
+	if (e == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
 
-	f = fopen(fname, "wb");
-	/* If the open failed because the cache directory does
-	 * not exist, create it and a re-try the fopen() call.
-	 */
-	if (f == NULL && errno == ENOENT) {
-		if ((r = sc_make_cache_dir(p15card->card->ctx)) < 0)
-			return r;
-		f = fopen(fname, "wb");
+	rd.p = e->data;
+	rd.left = e->len;
+	rd.error = 0;
+	put_layout(&layout);
+	p = read_bytes(&rd, layout.len);
+	if (layout.error || p == NULL || memcmp(p, layout.data, layout.len)) {
+		free(layout.data);
+		sc_log(ctx, "cached objects of %s are from another build", sc_print_path(&df->path));
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	free(layout.data);
+
+	count = read_u32(&rd);
+	for (i = 0; i < count && !rd.error; i++) {
+		obj = get_object(p15card, &rd);
+		if (obj == NULL)
+			break;
+		*tail = obj;
+		tail = &obj->next;
+	}
+	if (rd.error) {
+		sc_log(ctx, "cannot use cached objects of %s", sc_print_path(&df->path));
+		while (list != NULL) {
+			obj = list;
+			list = obj->next;
+			sc_pkcs15_free_object(obj);
+		}
+		return SC_ERROR_FILE_NOT_FOUND;
 	}
+
+	while (list != NULL) {
+		obj = list;
+		list = obj->next;
+		obj->df = df;
+		sc_pkcs15_add_object(p15card, obj);
+	}
+	sc_log(ctx, "%lu objects of %s from cache", count, sc_print_path(&df->path));
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_cache_objects(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+{
+	struct sc_pkcs15_cache_db *db;
+	struct sc_pkcs15_object *obj;
+	struct cache_buf b = { NULL, 0, 0, 0 };
+	unsigned long count = 0;
+	const u8 *key;
+	size_t key_len, count_pos;
+	int r;
+
+	r = cache_key(&df->path, &key, &key_len);
+	if (r != SC_SUCCESS)
+		return r;
+	db = get_cache_db(p15card);
+	if (db == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	put_layout(&b);
+	count_pos = b.len;
+	buf_put_u32(&b, 0);
+	for (obj = p15card->obj_list; obj != NULL && r == SC_SUCCESS; obj = obj->next) {
+		if (obj->df != df)
+			continue;
+		/* The GUIDs of the key containers are derived once and kept
+		 * with the objects */
+		if ((obj->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_PRKEY
+				&& obj->guid == NULL && !obj->guid_cache_id_len) {
+			char guid[40];
+
+			sc_pkcs15_get_guid(p15card, obj, 0, guid, sizeof(guid));
+		}
+		r = put_object(&b, obj);
+		count++;
+	}
+	if (r == SC_SUCCESS)
+		r = b.error;
+	if (r != SC_SUCCESS) {
+		free(b.data);
+		return r;
+	}
+	put_u32(b.data + count_pos, count);
+	return store_entry(p15card, db, CACHE_OBJECTS, key, key_len, b.data, b.len);
+}
+
+void sc_pkcs15_drop_cached_objects(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+{
+	drop_entry(p15card, CACHE_OBJECTS, &df->path);
+}
+
+/*
+ * What a bind read from EF(ODF) and EF(TokenInfo) is kept per card, not
+ * per token, so that it can be found before EF(TokenInfo) is read:
+ * "<cache_dir>/<ATR>.<card serial>.p15bind" holds
+ *
+ *   "OSCP15B1"          magic and version
+ *   then as blobs (u32 len, bytes):
+ *     application path, path of EF(ODF), its content,
+ *     path of EF(TokenInfo), its content, lastUpdate
+ *
+ * A path is its type byte followed by its value. The card serial comes
+ * from the driver (SC_CARDCTL_GET_SERIALNR), most of them keep it after
+ * the first time.
+ */
+#define BIND_CACHE_MAGIC	"OSCP15B1"
+#define BIND_CACHE_MAGIC_LEN	8
+
+static int bind_cache_filename(struct sc_pkcs15_card *p15card, char *buf, size_t bufsize)
+{
+	struct sc_card *card = p15card->card;
+	struct sc_serial_number serial;
+	char suffix[SC_MAX_SERIALNR * 2 + 10];
+	int r;
+
+	memset(&serial, 0, sizeof(serial));
+	if (card->serialnr.len)
+		serial = card->serialnr;
+	else if (sc_card_ctl(card, SC_CARDCTL_GET_SERIALNR, &serial) != SC_SUCCESS)
+		return SC_ERROR_NOT_SUPPORTED;
+	if (serial.len == 0 || serial.len > SC_MAX_SERIALNR)
+		return SC_ERROR_NOT_SUPPORTED;
+	r = sc_bin_to_hex(serial.value, serial.len, suffix, sizeof(suffix) - 9, 0);
+	if (r != SC_SUCCESS)
+		return r;
+	strcat(suffix, ".p15bind");
+	return _sc_card_cache_filename(card, suffix, buf, bufsize);
+}
+
+static void buf_put_path(struct cache_buf *b, const sc_path_t *path)
+{
+	u8 tmp[1 + SC_MAX_PATH_SIZE];
+
+	tmp[0] = (u8)path->type;
+	memcpy(tmp + 1, path->value, path->len);
+	buf_put_blob(b, tmp, 1 + path->len);
+}
+
+static void read_path(struct cache_reader *rd, sc_path_t *path)
+{
+	unsigned long n = read_u32(rd);
+	const u8 *p;
+
+	memset(path, 0, sizeof(*path));
+	if (rd->error || n < 1 || n > 1 + SC_MAX_PATH_SIZE) {
+		rd->error = SC_ERROR_INVALID_DATA;
+		return;
+	}
+	p = read_bytes(rd, n);
+	if (p == NULL)
+		return;
+	path->type = p[0];
+	memcpy(path->value, p + 1, n - 1);
+	path->len = n - 1;
+	path->count = -1;
+}
+
+int sc_pkcs15_read_bind_cache(struct sc_pkcs15_card *p15card, struct sc_pkcs15_bind_cache *bc)
+{
+	const sc_path_t *app_path = &p15card->file_app->path;
+	struct cache_reader rd;
+	char fname[PATH_MAX];
+	sc_path_t path;
+	u8 *image = NULL;
+	size_t len;
+	long size;
+	FILE *f;
+	int r;
+
+	memset(bc, 0, sizeof(*bc));
+	r = bind_cache_filename(p15card, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
+		return r;
+	f = fopen(fname, "rb");
 	if (f == NULL)
-		return 0;
+		return SC_ERROR_FILE_NOT_FOUND;
+	r = SC_ERROR_FILE_NOT_FOUND;
+	if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= BIND_CACHE_MAGIC_LEN
+			&& fseek(f, 0, SEEK_SET) == 0
+			&& (image = malloc(size)) != NULL
+			&& fread(image, 1, size, f) == (size_t)size)
+		r = SC_SUCCESS;
+	fclose(f);
+	if (r != SC_SUCCESS || memcmp(image, BIND_CACHE_MAGIC, BIND_CACHE_MAGIC_LEN) != 0) {
+		free(image);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+
+	rd.p = image + BIND_CACHE_MAGIC_LEN;
+	rd.left = size - BIND_CACHE_MAGIC_LEN;
+	rd.error = 0;
+	read_path(&rd, &path);
+	read_path(&rd, &bc->odf_path);
+	bc->odf = read_blob(&rd, &bc->odf_len);
+	read_path(&rd, &bc->tokeninfo_path);
+	bc->tokeninfo = read_blob(&rd, &bc->tokeninfo_len);
+	bc->last_update = (char *) read_blob(&rd, &len);
+	if (bc->last_update != NULL && (len == 0 || bc->last_update[len - 1] != '\0'))
+		rd.error = SC_ERROR_INVALID_DATA;
+	free(image);
+
+	/* the application may have been chosen differently, by AID */
+	if (!rd.error && (path.type != app_path->type || path.len != app_path->len
+			|| memcmp(path.value, app_path->value, path.len) != 0))
+		rd.error = SC_ERROR_FILE_NOT_FOUND;
+	if (!rd.error && (bc->odf == NULL || bc->tokeninfo == NULL))
+		rd.error = SC_ERROR_INVALID_DATA;
+	if (rd.error) {
+		sc_pkcs15_free_bind_cache(bc);
+		return rd.error;
+	}
+	_sc_cache_used(p15card->card->ctx, fname);
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_write_bind_cache(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_bind_cache *bc)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct cache_buf b = { NULL, 0, 0, 0 };
+	char fname[PATH_MAX], tmpname[PATH_MAX + 8];
+	FILE *f;
+	int r, ok;
 
-	c = fwrite(buf, 1, bufsize, f);
-        fclose(f);
-	if (c != bufsize) {
-		sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "fwrite() wrote only %d bytes", c);
-		unlink(fname);
+	r = bind_cache_filename(p15card, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+	if (r < 0 || (size_t)r >= sizeof(tmpname))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+
+	buf_put(&b, BIND_CACHE_MAGIC, BIND_CACHE_MAGIC_LEN);
+	buf_put_path(&b, &p15card->file_app->path);
+	buf_put_path(&b, &bc->odf_path);
+	buf_put_blob(&b, bc->odf, bc->odf_len);
+	buf_put_path(&b, &bc->tokeninfo_path);
+	buf_put_blob(&b, bc->tokeninfo, bc->tokeninfo_len);
+	buf_put_blob(&b, bc->last_update, bc->last_update ? strlen(bc->last_update) + 1 : 0);
+	if (b.error) {
+		free(b.data);
+		return b.error;
+	}
+
+	f = fopen(tmpname, "wb");
+	if (f == NULL && errno == ENOENT && sc_make_cache_dir(ctx) == SC_SUCCESS)
+		f = fopen(tmpname, "wb");
+	if (f == NULL) {
+		free(b.data);
+		return SC_SUCCESS;
+	}
+	ok = fwrite(b.data, 1, b.len, f) == b.len;
+	if (fclose(f) != 0)
+		ok = 0;
+	free(b.data);
+	if (ok) {
+#ifdef _WIN32
+		remove(fname);
+#endif
+		ok = rename(tmpname, fname) == 0;
+	}
+	if (!ok) {
+		sc_log(ctx, "cannot write cache file %s", fname);
+		remove(tmpname);
 		return SC_ERROR_INTERNAL;
 	}
-        return 0;
+	_sc_cache_used(ctx, fname);
+	return SC_SUCCESS;
+}
+
+void sc_pkcs15_free_bind_cache(struct sc_pkcs15_bind_cache *bc)
+{
+	free(bc->odf);
+	free(bc->tokeninfo);
+	free(bc->last_update);
+	memset(bc, 0, sizeof(*bc));
+}
+
+/* Called before EF(ODF) or EF(TokenInfo) is written */
+void sc_pkcs15_drop_bind_cache(struct sc_pkcs15_card *p15card)
+{
+	char fname[PATH_MAX];
+
+	if (p15card->opts.use_file_cache
+			&& bind_cache_filename(p15card, fname, sizeof(fname)) == SC_SUCCESS)
+		remove(fname);
 }
@@ -33,8 +33,49 @@
 #include "asn1.h"
 #include "pkcs15.h"
 
+/* The next element of a DER sequence, with its tag and length */
+static const u8 *
+next_tlv(const u8 **p, size_t *left, size_t *tlv_len)
+{
+	const u8 *start = *p, *obj = *p;
+	unsigned int cla, tag;
+	size_t len;
+
+	if (sc_asn1_read_tag(&obj, *left, &cla, &tag, &len) != SC_SUCCESS || obj == NULL)
+		return NULL;
+	*tlv_len = (obj - start) + len;
+	if (*tlv_len > *left)
+		return NULL;
+	*p += *tlv_len;
+	*left -= *tlv_len;
+	return start;
+}
+
+/* Points serial, issuer and subject to their elements in tbsCertificate,
+ * which the decoder has checked already */
 static int
-parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_cert *cert)
+slice_x509_cert(struct sc_pkcs15_cert *cert, const u8 *tbs, size_t tbslen)
+{
+	const u8 *p = tbs;
+	size_t left = tbslen, len;
+
+	if (left && *p == 0xA0)			/* version, [0] */
+		next_tlv(&p, &left, &len);
+	cert->serial = (u8 *) next_tlv(&p, &left, &cert->serial_len);
+	next_tlv(&p, &left, &len);			/* signature */
+	cert->issuer = (u8 *) next_tlv(&p, &left, &cert->issuer_len);
+	next_tlv(&p, &left, &len);			/* validity */
+	cert->subject = (u8 *) next_tlv(&p, &left, &cert->subject_len);
+	if (!cert->serial || !cert->issuer || !cert->subject)
+		return SC_ERROR_INVALID_ASN1_OBJECT;
+	return SC_SUCCESS;
+}
+
+/* With in_place, the certificate is not copied from der, which it takes,
+ * and serial, issuer and subject are slices of it */
+static int
+parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_cert *cert,
+		int in_place)
 {
 	int r;
 	struct sc_algorithm_id sig_alg;
@@ -92,16 +133,26 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 	size_t objlen;
 
 	memset(cert, 0, sizeof(*cert));
+	if (in_place) {
+		cert->in_place = 1;
+		cert->data = *der;
+		/* the issuer, subject and serial are not kept apart */
+		asn1_tbscert[1].parm = asn1_tbscert[3].parm = asn1_tbscert[5].parm = NULL;
+	}
 	obj = sc_asn1_verify_tag(ctx, buf, buflen, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &objlen);
 	if (obj == NULL)
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "X.509 certificate not found");
 
 	data_len = objlen + (obj - buf);
-	cert->data.value = malloc(data_len);
-	if (!cert->data.value)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-	memcpy(cert->data.value, buf, data_len);
-	cert->data.len = data_len;
+	if (in_place) {
+		cert->data.len = data_len;
+	} else {
+		cert->data.value = malloc(data_len);
+		if (!cert->data.value)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		memcpy(cert->data.value, buf, data_len);
+		cert->data.len = data_len;
+	}
 
 	r = sc_asn1_decode(ctx, asn1_cert, obj, objlen, NULL, NULL);
 	LOG_TEST_RET(ctx, r, "ASN.1 parsing of certificate failed");
@@ -114,6 +165,16 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 
 	sc_asn1_clear_algorithm_id(&sig_alg);
 
+	if (in_place)   {
+		const u8 *tbs;
+		size_t tbslen;
+
+		tbs = sc_asn1_verify_tag(ctx, obj, objlen, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &tbslen);
+		r = tbs ? slice_x509_cert(cert, tbs, tbslen) : SC_ERROR_INVALID_ASN1_OBJECT;
+		LOG_TEST_RET(ctx, r, "Cannot find serial, issuer or subject");
+		return SC_SUCCESS;
+	}
+
 	if (serial && serial_len)   {
 		sc_format_asn1_entry(asn1_serial_number + 0, serial, &serial_len, 1);
 		r = sc_asn1_encode(ctx, asn1_serial_number, &cert->serial, &cert->serial_len);
@@ -150,7 +211,7 @@ sc_pkcs15_pubkey_from_cert(struct sc_context *ctx,
 	if (cert == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 
-	rv = parse_x509_cert(ctx, cert_blob, cert);
+	rv = parse_x509_cert(ctx, cert_blob, cert, 0);
 
 	*out = cert->key;
 	cert->key = NULL;
@@ -160,42 +221,125 @@ sc_pkcs15_pubkey_from_cert(struct sc_context *ctx,
 }
 
 
+/* Only reads the card; the value is parsed by sc_pkcs15_parse_certificate() */
 int
-sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
-		struct sc_pkcs15_cert **cert_out)
+sc_pkcs15_read_certificate_data(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
+		struct sc_pkcs15_der *der)
 {
 	struct sc_context *ctx = NULL;
-	struct sc_pkcs15_cert *cert = NULL;
-	struct sc_pkcs15_der der;
 	int r;
 
-	assert(p15card != NULL && info != NULL && cert_out != NULL);
+	assert(p15card != NULL && info != NULL && der != NULL);
 	ctx = p15card->card->ctx;
 	LOG_FUNC_CALLED(ctx);
 
 	if (info->value.len && info->value.value)   {
-		sc_der_copy(&der, &info->value);
+		r = sc_der_copy(der, &info->value);
+		LOG_TEST_RET(ctx, r, "Cannot copy certificate value");
 	}
 	else if (info->path.len) {
-		r = sc_pkcs15_read_file(p15card, &info->path, &der.value, &der.len);
+		SC_TRACE_BEGIN(ctx, "read certificate", info->path.len);
+		r = sc_pkcs15_read_file(p15card, &info->path, &der->value, &der->len);
+		SC_TRACE_END(ctx, "read certificate", r);
 		LOG_TEST_RET(ctx, r, "Unable to read certificate file.");
 	}
 	else   {
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OBJECT_NOT_FOUND);
 	}
 
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+/* Does not use the card, so it can run in any thread */
+int
+sc_pkcs15_parse_certificate(struct sc_context *ctx, struct sc_pkcs15_der *der,
+		struct sc_pkcs15_cert **cert_out)
+{
+	struct sc_pkcs15_cert *cert = NULL;
+
+	assert(der != NULL && cert_out != NULL);
 	cert = malloc(sizeof(struct sc_pkcs15_cert));
-	if (cert == NULL) {
-		free(der.value);
+	if (cert == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memset(cert, 0, sizeof(struct sc_pkcs15_cert));
+	if (parse_x509_cert(ctx, der, cert, 0)) {
+		sc_pkcs15_free_certificate(cert);
+		return SC_ERROR_INVALID_ASN1_OBJECT;
+	}
+
+	*cert_out = cert;
+	return SC_SUCCESS;
+}
+
+
+int
+sc_pkcs15_read_certificate(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
+		struct sc_pkcs15_cert **cert_out)
+{
+	struct sc_context *ctx = NULL;
+	struct sc_pkcs15_der der;
+	int r;
+
+	assert(p15card != NULL && info != NULL && cert_out != NULL);
+	ctx = p15card->card->ctx;
+	LOG_FUNC_CALLED(ctx);
+
+	r = sc_pkcs15_read_certificate_data(p15card, info, &der);
+	LOG_TEST_RET(ctx, r, "Unable to read certificate");
+
+	r = sc_pkcs15_parse_certificate(ctx, &der, cert_out);
+	free(der.value);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
+/* Like sc_pkcs15_read_certificate(), without the copies: the certificate is
+ * parsed in the file as read from the card, or in the image of the file
+ * cache if the file is in there. A direct value is copied, it belongs to
+ * the info. */
+int
+sc_pkcs15_read_certificate_shared(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_cert_info *info,
+		struct sc_pkcs15_cert **cert_out)
+{
+	struct sc_context *ctx = NULL;
+	struct sc_pkcs15_shared_buf *shared = NULL;
+	struct sc_pkcs15_cert *cert = NULL;
+	struct sc_pkcs15_der der;
+	const u8 *data;
+	int r;
+
+	assert(p15card != NULL && info != NULL && cert_out != NULL);
+	ctx = p15card->card->ctx;
+	LOG_FUNC_CALLED(ctx);
+
+	if ((info->value.len && info->value.value) || !info->path.len)
+		LOG_FUNC_RETURN(ctx, sc_pkcs15_read_certificate(p15card, info, cert_out));
+
+	cert = malloc(sizeof(struct sc_pkcs15_cert));
+	if (cert == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+
+	if (p15card->opts.use_file_cache
+			&& sc_pkcs15_read_cached_file_shared(p15card, &info->path, &data, &der.len, &shared) == SC_SUCCESS) {
+		der.value = (u8 *) data;
 	}
-	memset(cert, 0, sizeof(struct sc_pkcs15_cert));
-	if (parse_x509_cert(ctx, &der, cert)) {
-		free(der.value);
+	else {
+		SC_TRACE_BEGIN(ctx, "read certificate", info->path.len);
+		r = sc_pkcs15_read_file(p15card, &info->path, &der.value, &der.len);
+		SC_TRACE_END(ctx, "read certificate", r);
+		if (r < 0) {
+			free(cert);
+			LOG_TEST_RET(ctx, r, "Unable to read certificate file.");
+		}
+	}
+
+	r = parse_x509_cert(ctx, &der, cert, 1);
+	cert->shared = shared;
+	if (r < 0) {
 		sc_pkcs15_free_certificate(cert);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ASN1_OBJECT);
 	}
-	free(der.value);
 
 	*cert_out = cert;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
@@ -344,10 +488,18 @@ sc_pkcs15_free_certificate(struct sc_pkcs15_cert *cert)
 
 	if (cert->key)
 		sc_pkcs15_free_pubkey(cert->key);
-	free(cert->subject);
-	free(cert->issuer);
-	free(cert->serial);
-	free(cert->data.value);
+	if (cert->in_place) {
+		if (cert->shared)
+			sc_pkcs15_shared_buf_release(cert->shared);
+		else
+			free(cert->data.value);
+	}
+	else {
+		free(cert->subject);
+		free(cert->issuer);
+		free(cert->serial);
+		free(cert->data.value);
+	}
 	free(cert->crl);
 	free(cert);
 }
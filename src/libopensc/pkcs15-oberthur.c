@@ -118,6 +118,19 @@ struct container {
 
 struct container *Containers = NULL;
 
+/* the IDs of the containers, sorted, for sc_oberthur_get_friends() */
+struct container_ref {
+	unsigned id;
+	struct crypto_container *ccont;
+};
+
+static struct container_ref *ContainerRefs = NULL;
+static size_t ContainerRefsCount = 0;
+
+/* the index files are the same as the cached ones,
+ * the public object files can be taken from the file cache */
+static int CachedViewValid = 0;
+
 static struct {
 	const char *name;
 	const char *path;
@@ -162,26 +175,70 @@ sc_oberthur_decode_usage(unsigned flags)
 }
 
 
-static int 
-sc_oberthur_get_friends (unsigned int id, struct crypto_container *ccont)
+static int
+sc_oberthur_cmp_refs(const void *a, const void *b)
+{
+	const struct container_ref *ra = a, *rb = b;
+
+	return ra->id < rb->id ? -1 : ra->id > rb->id;
+}
+
+
+static int
+sc_oberthur_index_containers(void)
 {
 	struct container *cont;
+	size_t count = 0;
+
+	free(ContainerRefs);
+	ContainerRefs = NULL;
+	ContainerRefsCount = 0;
+
+	for (cont = Containers; cont; cont = cont->next)
+		count += 6;
+	if (!count)
+		return SC_SUCCESS;
+
+	ContainerRefs = calloc(count, sizeof(struct container_ref));
+	if (!ContainerRefs)
+		return SC_ERROR_OUT_OF_MEMORY;
 
 	for (cont = Containers; cont; cont = cont->next)   {
-		if (cont->exchange.id_pub == id || cont->exchange.id_prv == id || cont->exchange.id_cert == id)   {
-			if (ccont)
-				memcpy(ccont, &cont->exchange, sizeof(struct crypto_container));
-			break;
-		}
-		
-		if (cont->sign.id_pub == id || cont->sign.id_prv == id || cont->sign.id_cert == id)   {
-			if (ccont)
-				memcpy(ccont, &cont->sign, sizeof(struct crypto_container));
-			break;
+		struct crypto_container *cc[2] = {&cont->exchange, &cont->sign};
+		int ii;
+
+		for (ii = 0; ii < 2; ii++)   {
+			unsigned ids[3] = {cc[ii]->id_pub, cc[ii]->id_prv, cc[ii]->id_cert};
+			int jj;
+
+			for (jj = 0; jj < 3; jj++)   {
+				if (!ids[jj])
+					continue;
+				ContainerRefs[ContainerRefsCount].id = ids[jj];
+				ContainerRefs[ContainerRefsCount].ccont = cc[ii];
+				ContainerRefsCount++;
+			}
 		}
 	}
-	
-	return cont ? 0 : SC_ERROR_TEMPLATE_NOT_FOUND;
+
+	qsort(ContainerRefs, ContainerRefsCount, sizeof(struct container_ref), sc_oberthur_cmp_refs);
+	return SC_SUCCESS;
+}
+
+
+static int 
+sc_oberthur_get_friends (unsigned int id, struct crypto_container *ccont)
+{
+	struct container_ref key, *ref;
+
+	key.id = id;
+	ref = bsearch(&key, ContainerRefs, ContainerRefsCount, sizeof(struct container_ref), sc_oberthur_cmp_refs);
+	if (!ref)
+		return SC_ERROR_TEMPLATE_NOT_FOUND;
+
+	if (ccont)
+		memcpy(ccont, ref->ccont, sizeof(struct crypto_container));
+	return 0;
 }
 
 
@@ -249,6 +306,16 @@ sc_oberthur_read_file(struct sc_pkcs15_card *p15card, const char *in_path,
 	*out_len = 0;
 	
 	sc_format_path(in_path, &path);
+	if (CachedViewValid && p15card->opts.use_file_cache)   {
+		rv = sc_pkcs15_read_cached_file(p15card, &path, out, out_len);
+		if (!rv)   {
+			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "file '%s' taken from cache", in_path);
+			SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, rv);
+		}
+		*out = NULL;
+		*out_len = 0;
+	}
+
 	rv = sc_select_file(card, &path, &file);
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, rv, "Cannot select oberthur file to read");
 
@@ -316,8 +383,16 @@ sc_oberthur_read_file(struct sc_pkcs15_card *p15card, const char *in_path,
 			rv = sc_pkcs15_verify_pin(p15card, pin_obj, pin_obj->content.value, pin_obj->content.len);
 			if (!rv)
 				rv = sc_oberthur_read_file(p15card, in_path, out, out_len, 0);
+			sz = *out_len;
 		}
-	};
+	}
+	else if (rv >= 0 && p15card->opts.use_file_cache)   {
+		const struct sc_acl_entry *acl = sc_file_get_acl_entry(file, SC_AC_OP_READ);
+
+		/* only what anybody can read goes to the cache */
+		if (acl && acl->method == SC_AC_NONE)
+			sc_pkcs15_cache_file(p15card, &path, *out, sz);
+	}
 			
 	sc_file_free(file);
 
@@ -325,6 +400,7 @@ sc_oberthur_read_file(struct sc_pkcs15_card *p15card, const char *in_path,
 		free(*out);
 		*out = NULL;
 		*out_len = 0;
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, rv);
 	}
 
 	*out_len = sz;
@@ -421,7 +497,7 @@ sc_oberthur_parse_containers (struct sc_pkcs15_card *p15card,
 		offs += *(buff + offs + 1) + 2;
 	}
 
-	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, SC_SUCCESS);
+	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, sc_oberthur_index_containers());
 }
 
 
@@ -914,7 +990,7 @@ sc_pkcs15emu_oberthur_init(struct sc_pkcs15_card * p15card)
 	struct sc_pkcs15_object   obj;
 	struct sc_card *card = p15card->card;
 	struct sc_path path;
-	int rv, ii, tries_left;
+	int rv, ii, tries_left, valid;
 	char serial[0x10];
 	unsigned char sopin_reference = 0x04;
 	
@@ -1007,12 +1083,37 @@ sc_pkcs15emu_oberthur_init(struct sc_pkcs15_card * p15card)
 		SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, rv, "Oberthur init failed: cannot verify PIN");
 	}
 
+	/* The index files are always read from the card. While they are the same
+	 * as their cached copies, the object files they list did not change. */
+	CachedViewValid = 0;
+	valid = p15card->opts.use_file_cache;
 	for (ii=0; oberthur_infos[ii].name; ii++)   {
+		unsigned char *cached = NULL;
+		size_t cached_len = 0;
+
+		if (valid)   {
+			sc_format_path(oberthur_infos[ii].path, &path);
+			if (sc_pkcs15_read_cached_file(p15card, &path, &cached, &cached_len))
+				valid = 0;
+		}
+
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Oberthur init: read %s file", oberthur_infos[ii].name);
+		free(oberthur_infos[ii].content);
 		rv = sc_oberthur_read_file(p15card, oberthur_infos[ii].path,
 				&oberthur_infos[ii].content, &oberthur_infos[ii].len, 1);
+		if (rv < 0)
+			free(cached);
 		SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, rv, "Oberthur init failed: read oberthur file error");
-		
+
+		if (valid && (cached_len != oberthur_infos[ii].len
+					|| memcmp(cached, oberthur_infos[ii].content, cached_len)))
+			valid = 0;
+		free(cached);
+	}
+	CachedViewValid = valid;
+	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Oberthur init: cached object files %s", valid ? "valid" : "not used");
+
+	for (ii=0; oberthur_infos[ii].name; ii++)   {
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Oberthur init: parse %s file, content length %i", 
 				oberthur_infos[ii].name, oberthur_infos[ii].len);
 		rv = oberthur_infos[ii].parser(p15card, oberthur_infos[ii].content, oberthur_infos[ii].len, 
@@ -1093,4 +1194,5 @@ static void
 sc_awp_clear(struct sc_pkcs15_card *p15card)
 {
 	SC_FUNC_CALLED(p15card->card->ctx, SC_LOG_DEBUG_VERBOSE);
+	CachedViewValid = 0;
 }
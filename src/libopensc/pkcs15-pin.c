@@ -273,6 +273,77 @@ static int _validate_pin(struct sc_pkcs15_card *p15card,
 	return SC_SUCCESS;
 }
 
+/* Remember whether the card holds the security status of a PIN, which
+ * any VERIFY of it, right or wrong, changes. Called with the card locked. */
+static void pin_status_set(struct sc_pkcs15_card *p15card,
+		const struct sc_pkcs15_object *pin_obj, int verified)
+{
+	struct sc_pkcs15_pin_status *entry = NULL;
+	unsigned int serial = p15card->card->cache.security_serial;
+	size_t i;
+
+	for (i = 0; i < SC_PKCS15_MAX_PINS; i++)
+		if (p15card->pin_status[i].pin_obj == pin_obj) {
+			entry = &p15card->pin_status[i];
+			break;
+		}
+	if (!verified) {
+		if (entry)
+			entry->pin_obj = NULL;
+		return;
+	}
+	/* otherwise take a free or stale entry, or the first one */
+	for (i = 0; entry == NULL && i < SC_PKCS15_MAX_PINS; i++)
+		if (p15card->pin_status[i].pin_obj == NULL
+				|| p15card->pin_status[i].serial != serial)
+			entry = &p15card->pin_status[i];
+	if (entry == NULL)
+		entry = &p15card->pin_status[0];
+	entry->pin_obj = pin_obj;
+	entry->serial = serial;
+}
+
+/*
+ * Tell whether verifying the PIN with this code could be skipped: the same
+ * code was verified and cached, and the card was neither reset nor logged
+ * out since. The card may still have dropped the status, e.g. when someone
+ * else used it in between, but then the operation fails and the cached PIN
+ * is verified again, see sc_pkcs15_pincache_revalidate().
+ */
+int sc_pkcs15_pin_still_verified(struct sc_pkcs15_card *p15card,
+			 const struct sc_pkcs15_object *pin_obj,
+			 const unsigned char *pincode, size_t pinlen)
+{
+	struct sc_pkcs15_auth_info *auth_info = (struct sc_pkcs15_auth_info *)pin_obj->data;
+	int verified = 0;
+	size_t i;
+
+	if (!p15card->opts.use_pin_cache || !pincode || !pinlen)
+		return 0;
+	if (auth_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN)
+		return 0;
+	if (pin_obj->content.value == NULL || pin_obj->content.len != pinlen
+			|| memcmp(pin_obj->content.value, pincode, pinlen) != 0)
+		return 0;
+	if (pin_obj->usage_counter >= p15card->opts.pin_cache_counter)
+		return 0;
+
+	/* locking notices a reset meanwhile */
+	if (sc_lock(p15card->card) != SC_SUCCESS)
+		return 0;
+	for (i = 0; i < SC_PKCS15_MAX_PINS; i++)
+		if (p15card->pin_status[i].pin_obj == pin_obj) {
+			verified = p15card->pin_status[i].serial
+				== p15card->card->cache.security_serial;
+			break;
+		}
+	sc_unlock(p15card->card);
+
+	if (verified)
+		sc_log(p15card->card->ctx, "PIN(%s) is still verified", pin_obj->label);
+	return verified;
+}
+
 /*
  * Verify a PIN.
  *
@@ -365,6 +436,7 @@ int sc_pkcs15_verify_pin(struct sc_pkcs15_card *p15card,
 
 	r = sc_pin_cmd(card, &data, &auth_info->tries_left);
 	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "PIN cmd result %i", r);
+	pin_status_set(p15card, pin_obj, r == SC_SUCCESS);
 	if (r == SC_SUCCESS)
 		sc_pkcs15_pincache_add(p15card, pin_obj, pincode, pinlen);
 out:
@@ -449,6 +521,7 @@ int sc_pkcs15_change_pin(struct sc_pkcs15_card *p15card,
 	}
 
 	r = sc_pin_cmd(card, &data, &auth_info->tries_left);
+	pin_status_set(p15card, pin_obj, 0);
 	if (r == SC_SUCCESS)
 		sc_pkcs15_pincache_add(p15card, pin_obj, newpin, newpinlen);
 
@@ -564,6 +637,7 @@ int sc_pkcs15_unblock_pin(struct sc_pkcs15_card *p15card,
 	}
 
 	r = sc_pin_cmd(card, &data, &auth_info->tries_left);
+	pin_status_set(p15card, pin_obj, 0);
 	if (r == SC_SUCCESS)
 		sc_pkcs15_pincache_add(p15card, pin_obj, newpin, newpinlen);
 
@@ -620,6 +694,11 @@ void sc_pkcs15_pincache_add(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obj
 		obj = obj->next;
 	}
 
+	/* The age of the PIN counts from its entry, not from the last
+	 * revalidation, which caches the cached value again */
+	if (pin != pin_obj->content.value)
+		pin_obj->pin_cached_us = _sc_time_us();
+
 	r = sc_pkcs15_allocate_object_content(ctx, pin_obj, pin, pinlen);
 	if (r != SC_SUCCESS)   {
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Failed to allocate object content");
@@ -630,12 +709,37 @@ void sc_pkcs15_pincache_add(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obj
 	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "PIN(%s) cached", pin_obj->label);
 }
 
+/* The cache policy of a PIN: the pin_cache_policy block named after its
+ * label, else pin_cache_counter and pin_cache_timeout */
+static void
+pincache_policy(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_object *pin_obj,
+		int *counter, int *timeout)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	scconf_block *conf_block, **blocks;
+
+	*counter = p15card->opts.pin_cache_counter;
+	*timeout = p15card->opts.pin_cache_timeout;
+
+	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
+	if (conf_block == NULL || pin_obj->label[0] == '\0')
+		return;
+	blocks = scconf_find_blocks(ctx->conf, conf_block, "pin_cache_policy", pin_obj->label);
+	if (blocks == NULL)
+		return;
+	if (blocks[0] != NULL) {
+		*counter = scconf_get_int(blocks[0], "counter", *counter);
+		*timeout = scconf_get_int(blocks[0], "timeout", *timeout);
+	}
+	free(blocks);
+}
+
 /* Validate the PIN code associated with an object */
 int sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card, const sc_pkcs15_object_t *obj)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	sc_pkcs15_object_t *pin_obj;
-	int r;
+	int r, counter, timeout;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
 
@@ -657,16 +761,22 @@ int sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card, const sc_pkcs1
 		return SC_ERROR_SECURITY_STATUS_NOT_SATISFIED;
 	}
 
-	if (pin_obj->usage_counter >= p15card->opts.pin_cache_counter) {
-		sc_pkcs15_free_object_content(pin_obj);
+	if (!pin_obj->content.value || !pin_obj->content.len)
 		return SC_ERROR_SECURITY_STATUS_NOT_SATISFIED;
-	}
 
-	if (!pin_obj->content.value || !pin_obj->content.len)
+	pincache_policy(p15card, pin_obj, &counter, &timeout);
+	if ((counter >= 0 && pin_obj->usage_counter >= counter)
+			|| (timeout > 0 && pin_obj->pin_cached_us
+				&& _sc_time_us() - pin_obj->pin_cached_us >= timeout * 1000000ULL)) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "cached PIN(%s) expired", pin_obj->label);
+		sc_pkcs15_free_object_content(pin_obj);
 		return SC_ERROR_SECURITY_STATUS_NOT_SATISFIED;
+	}
 
 	pin_obj->usage_counter++;
+	SC_TRACE_BEGIN(ctx, "revalidate", pin_obj->usage_counter);
 	r = sc_pkcs15_verify_pin(p15card, pin_obj, pin_obj->content.value, pin_obj->content.len);
+	SC_TRACE_END(ctx, "revalidate", r);
 	if (r != SC_SUCCESS) {
 		/* Ensure that wrong PIN isn't used again */
 		sc_pkcs15_free_object_content(pin_obj);
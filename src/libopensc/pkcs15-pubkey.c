@@ -688,10 +688,120 @@ sc_pkcs15_decode_pubkey(sc_context_t *ctx, struct sc_pkcs15_pubkey *key,
 /*
  * Read public key.
  */
+/*
+ * The encoding of the public keys that had to be read from the card is
+ * kept with the card, so that asking for a key again does not cost any
+ * APDUs. Decoding it again is cheap.
+ */
+struct sc_pkcs15_cached_pubkey {
+	struct sc_pkcs15_id id;
+	struct sc_path path;
+	int algorithm;
+	u8 *data;
+	size_t len;
+	struct sc_pkcs15_cached_pubkey *next;
+};
+
+static struct sc_pkcs15_cached_pubkey *
+find_cached_pubkey(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_pubkey_info *info, int algorithm)
+{
+	struct sc_pkcs15_cached_pubkey *c;
+
+	for (c = p15card->pubkey_cache; c != NULL; c = c->next)
+		if (c->algorithm == algorithm && sc_pkcs15_compare_id(&c->id, &info->id)
+				&& sc_compare_path(&c->path, &info->path))
+			return c;
+	return NULL;
+}
+
+static void
+cache_pubkey(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_pubkey_info *info, int algorithm,
+		const u8 *data, size_t len)
+{
+	struct sc_pkcs15_cached_pubkey *c;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return;
+	c->data = malloc(len);
+	if (c->data == NULL) {
+		free(c);
+		return;
+	}
+	memcpy(c->data, data, len);
+	c->len = len;
+	c->id = info->id;
+	c->path = info->path;
+	c->algorithm = algorithm;
+	c->next = p15card->pubkey_cache;
+	p15card->pubkey_cache = c;
+	_sc_memcache_add(p15card->card->ctx, &p15card->pubkey_account, (long) (sizeof(*c) + len), 1);
+
+	/* the oldest keys are at the end, drop them for cache_memory_max_size */
+	while (p15card->pubkey_cache->next != NULL
+			&& _sc_memcache_trim(p15card->card->ctx, &p15card->pubkey_account)) {
+		struct sc_pkcs15_cached_pubkey **pc = &p15card->pubkey_cache;
+
+		while ((*pc)->next != NULL)
+			pc = &(*pc)->next;
+		c = *pc;
+		*pc = NULL;
+		_sc_memcache_evicted(p15card->card->ctx, &p15card->pubkey_account, sizeof(*c) + c->len);
+		free(c->data);
+		free(c);
+	}
+}
+
+void
+sc_pkcs15_free_pubkey_cache(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_cached_pubkey *c, *next;
+	long bytes = 0, count = 0;
+
+	for (c = p15card->pubkey_cache; c != NULL; c = next) {
+		next = c->next;
+		bytes += sizeof(*c) + c->len;
+		count++;
+		free(c->data);
+		free(c);
+	}
+	p15card->pubkey_cache = NULL;
+	if (count && p15card->card != NULL)
+		_sc_memcache_add(p15card->card->ctx, &p15card->pubkey_account, -bytes, -count);
+}
+
+/* The key of a certificate with the same ID whose value is in the CDF */
+static int
+pubkey_from_direct_cert(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_pubkey_info *info,
+		int algorithm, struct sc_pkcs15_pubkey **out)
+{
+	struct sc_pkcs15_object *obj;
+	struct sc_pkcs15_cert_info *cert_info;
+	struct sc_pkcs15_pubkey *pubkey = NULL;
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+		if ((obj->type & SC_PKCS15_TYPE_CLASS_MASK) != SC_PKCS15_TYPE_CERT)
+			continue;
+		cert_info = (struct sc_pkcs15_cert_info *) obj->data;
+		if (!cert_info->value.value || !cert_info->value.len
+				|| !sc_pkcs15_compare_id(&cert_info->id, &info->id))
+			continue;
+		if (sc_pkcs15_pubkey_from_cert(p15card->card->ctx, &cert_info->value, &pubkey) == SC_SUCCESS
+				&& pubkey != NULL && pubkey->algorithm == algorithm) {
+			*out = pubkey;
+			return SC_SUCCESS;
+		}
+		sc_pkcs15_free_pubkey(pubkey);
+		pubkey = NULL;
+	}
+	return SC_ERROR_OBJECT_NOT_FOUND;
+}
+
 int
 sc_pkcs15_read_pubkey(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_object *obj,
 		struct sc_pkcs15_pubkey **out)
 {
+	struct sc_pkcs15_cached_pubkey *cached;
 	struct sc_context *ctx = p15card->card->ctx;
 	const struct sc_pkcs15_pubkey_info *info = NULL;
 	struct sc_pkcs15_pubkey *pubkey = NULL;
@@ -729,18 +839,36 @@ sc_pkcs15_read_pubkey(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_obj
 		memcpy(data, obj->content.value, obj->content.len);
 		len = obj->content.len;
 	}
-	else if (p15card->card->ops->read_public_key)   {
-		r = p15card->card->ops->read_public_key(p15card->card, algorithm,
-				&info->path, info->key_reference, info->modulus_length,
-				&data, &len);
-		LOG_TEST_RET(ctx, r, "Card specific 'read-public' procedure failed.");
+	else if ((cached = find_cached_pubkey(p15card, info, algorithm)) != NULL)   {
+		_sc_memcache_lookup(ctx, &p15card->pubkey_account, 1);
+		sc_log(ctx, "Using the public key read before");
+		data = malloc(cached->len);
+		if (!data)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		memcpy(data, cached->data, cached->len);
+		len = cached->len;
 	}
-	else if (info->path.len)   {
-		r = sc_pkcs15_read_file(p15card, &info->path, &data, &len);
-		LOG_TEST_RET(ctx, r, "Failed to read public key file.");
+	else if (pubkey_from_direct_cert(p15card, info, algorithm, out) == SC_SUCCESS)   {
+		sc_log(ctx, "Public key taken from the certificate");
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 	}
-	else    {
-		LOG_TEST_RET(ctx, SC_ERROR_NOT_IMPLEMENTED, "No way to get public key");
+	else {
+		_sc_memcache_lookup(ctx, &p15card->pubkey_account, 0);
+		if (p15card->card->ops->read_public_key)   {
+			r = p15card->card->ops->read_public_key(p15card->card, algorithm,
+					&info->path, info->key_reference, info->modulus_length,
+					&data, &len);
+			LOG_TEST_RET(ctx, r, "Card specific 'read-public' procedure failed.");
+		}
+		else if (info->path.len)   {
+			r = sc_pkcs15_read_file(p15card, &info->path, &data, &len);
+			LOG_TEST_RET(ctx, r, "Failed to read public key file.");
+		}
+		else    {
+			LOG_TEST_RET(ctx, SC_ERROR_NOT_IMPLEMENTED, "No way to get public key");
+		}
+		if (data && len)
+			cache_pubkey(p15card, info, algorithm, data, len);
 	}
 
 	if (!data || !len)
@@ -1098,26 +1226,29 @@ sc_pkcs15_pubkey_from_spki_filename(sc_context_t *ctx, char * filename,
 }
 
 
-static struct ec_curve_info {
+/* The DER encoding of the OIDs is given with them, so that the parameters
+ * of a key are recognised without encoding each OID of the table */
+static const struct ec_curve_info {
 	const char *name;
 	const char *oid_str;
-	const char *oid_encoded;
+	const char *oid_der;
+	size_t oid_der_len;
 	size_t size;
 } ec_curve_infos[] = {
-	{"secp192r1",		"1.2.840.10045.3.1.1", "06082A8648CE3D030101", 192},
-	{"prime192r1",		"1.2.840.10045.3.1.1", "06082A8648CE3D030101", 192},
-	{"ansiX9p192r1",	"1.2.840.10045.3.1.1", "06082A8648CE3D030101", 192},
-	{"prime256v1",		"1.2.840.10045.3.1.7", "06082A8648CE3D030107", 256},
-	{"secp256r1",		"1.2.840.10045.3.1.7", "06082A8648CE3D030107", 256},
-	{"ansiX9p256r1",	"1.2.840.10045.3.1.7", "06082A8648CE3D030107", 256},
-	{"secp384r1",		"1.3.132.0.34", "06052B81040022", 384},
-	{"prime384v1",		"1.3.132.0.34", "06052B81040022", 384},
-	{"ansiX9p384r1",	"1.3.132.0.34", "06052B81040022", 384},
-	{"brainpoolP192r1",	"1.3.36.3.3.2.8.1.1.3", "06092B2403030208010103", 192},
-	{"brainpoolP224r1",	"1.3.36.3.3.2.8.1.1.5", "06092B2403030208010105", 224},
-	{"brainpoolP256r1",	"1.3.36.3.3.2.8.1.1.7", "06092B2403030208010107", 256},
-	{"brainpoolP320r1",	"1.3.36.3.3.2.8.1.1.9", "06092B2403030208010109", 320},
-	{NULL, NULL, NULL, 0},
+	{"secp192r1",		"1.2.840.10045.3.1.1", "\x06\x08\x2A\x86\x48\xCE\x3D\x03\x01\x01", 10, 192},
+	{"prime192r1",		"1.2.840.10045.3.1.1", "\x06\x08\x2A\x86\x48\xCE\x3D\x03\x01\x01", 10, 192},
+	{"ansiX9p192r1",	"1.2.840.10045.3.1.1", "\x06\x08\x2A\x86\x48\xCE\x3D\x03\x01\x01", 10, 192},
+	{"prime256v1",		"1.2.840.10045.3.1.7", "\x06\x08\x2A\x86\x48\xCE\x3D\x03\x01\x07", 10, 256},
+	{"secp256r1",		"1.2.840.10045.3.1.7", "\x06\x08\x2A\x86\x48\xCE\x3D\x03\x01\x07", 10, 256},
+	{"ansiX9p256r1",	"1.2.840.10045.3.1.7", "\x06\x08\x2A\x86\x48\xCE\x3D\x03\x01\x07", 10, 256},
+	{"secp384r1",		"1.3.132.0.34", "\x06\x05\x2B\x81\x04\x00\x22", 7, 384},
+	{"prime384v1",		"1.3.132.0.34", "\x06\x05\x2B\x81\x04\x00\x22", 7, 384},
+	{"ansiX9p384r1",	"1.3.132.0.34", "\x06\x05\x2B\x81\x04\x00\x22", 7, 384},
+	{"brainpoolP192r1",	"1.3.36.3.3.2.8.1.1.3", "\x06\x09\x2B\x24\x03\x03\x02\x08\x01\x01\x03", 11, 192},
+	{"brainpoolP224r1",	"1.3.36.3.3.2.8.1.1.5", "\x06\x09\x2B\x24\x03\x03\x02\x08\x01\x01\x05", 11, 224},
+	{"brainpoolP256r1",	"1.3.36.3.3.2.8.1.1.7", "\x06\x09\x2B\x24\x03\x03\x02\x08\x01\x01\x07", 11, 256},
+	{"brainpoolP320r1",	"1.3.36.3.3.2.8.1.1.9", "\x06\x09\x2B\x24\x03\x03\x02\x08\x01\x01\x09", 11, 320},
+	{NULL, NULL, NULL, 0, 0},
 };
 
 
@@ -1130,21 +1261,10 @@ sc_pkcs15_fix_ec_parameters(struct sc_context *ctx, struct sc_pkcs15_ec_paramete
 
 	/* In PKCS#11 EC parameters arrives in DER encoded form */
 	if (ecparams->der.value && ecparams->der.len)   {
-		for (ii=0; ec_curve_infos[ii].name; ii++)   {
-			struct sc_object_id id;
-			unsigned char *buf = NULL;
-			size_t len = 0;
-
-			sc_format_oid(&id, ec_curve_infos[ii].oid_str);
-			sc_encode_oid (ctx, &id, &buf, &len);
-
-			if (ecparams->der.len == len && !memcmp(ecparams->der.value, buf, len))   {
-				free(buf);
+		for (ii=0; ec_curve_infos[ii].name; ii++)
+			if (ecparams->der.len == ec_curve_infos[ii].oid_der_len
+					&& !memcmp(ecparams->der.value, ec_curve_infos[ii].oid_der, ecparams->der.len))
 				break;
-			}
-
-			free(buf);
-		}
 
 		/* TODO: support of explicit EC parameters form */
 		if (!ec_curve_infos[ii].name)
@@ -1181,8 +1301,11 @@ sc_pkcs15_fix_ec_parameters(struct sc_context *ctx, struct sc_pkcs15_ec_paramete
 		ecparams->field_length = ec_curve_infos[ii].size;
 
 		if (!ecparams->der.value || !ecparams->der.len)   {
-			rv = sc_encode_oid (ctx, &ecparams->id, &ecparams->der.value, &ecparams->der.len);
-			LOG_TEST_RET(ctx, rv, "Cannot encode object ID");
+			ecparams->der.value = malloc(ec_curve_infos[ii].oid_der_len);
+			if (!ecparams->der.value)
+				LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+			memcpy(ecparams->der.value, ec_curve_infos[ii].oid_der, ec_curve_infos[ii].oid_der_len);
+			ecparams->der.len = ec_curve_infos[ii].oid_der_len;
 		}
 	}
 	else if (sc_valid_oid(&ecparams->id))  {
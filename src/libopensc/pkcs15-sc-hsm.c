@@ -36,6 +36,7 @@ extern struct sc_aid sc_hsm_aid;
 
 
 void sc_hsm_set_serialnr(sc_card_t *card, char *serial);
+int sc_hsm_read_ef(sc_card_t *card, int fid, unsigned int idx, u8 *buf, size_t count);
 
 
 
@@ -261,26 +262,89 @@ void sc_pkcs15emu_sc_hsm_free_cvc(sc_cvc_t *cvc)
 
 
 
-static int sc_pkcs15emu_sc_hsm_add_pubkey(sc_pkcs15_card_t *p15card, sc_pkcs15_prkey_info_t *key_info, char *label) {
+/* The files of the token, as listed by ENUMERATE OBJECTS */
+typedef struct sc_hsm_filelist {
+	const u8 *fids;
+	size_t len;
+	/* the list at the bind the file cache was filled, or NULL */
+	const u8 *cached;
+	size_t cached_len;
+	int use_cache;
+} sc_hsm_filelist_t;
+
+
+
+static int sc_hsm_filelist_has(const u8 *fids, size_t len, u8 prefix, u8 id)
+{
+	size_t i;
+
+	if (fids == NULL)
+		return 0;
+	for (i = 0; i + 1 < len; i += 2)
+		if (fids[i] == prefix && fids[i + 1] == id)
+			return 1;
+	return 0;
+}
+
+
+
+/* The PKCS#15 file cache only takes paths from the MF */
+static void sc_hsm_cache_path(sc_path_t *path, u8 prefix, u8 id)
+{
+	u8 value[4] = { 0x3F, 0x00, prefix, id };
+
+	sc_path_set(path, SC_PATH_TYPE_PATH, value, sizeof(value), 0, -1);
+}
+
+
+
+/*
+ * Read an EF the token has listed. With the file cache, a file that was
+ * already listed at the bind the cache was filled is taken from it, and
+ * a file read completely from the token is put in it. FFFF, reserved
+ * in ISO 7816-4, holds the list in the cache.
+ * Returns the length read, or SC_ERROR_FILE_NOT_FOUND.
+ */
+static int sc_pkcs15emu_sc_hsm_read_ef(sc_pkcs15_card_t * p15card, const sc_hsm_filelist_t *fl,
+		u8 prefix, u8 id, u8 *buf, size_t buflen)
+{
+	sc_path_t path;
+	u8 *ptr = buf;
+	size_t len = buflen;
+	int r;
+
+	if (!sc_hsm_filelist_has(fl->fids, fl->len, prefix, id))
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	sc_hsm_cache_path(&path, prefix, id);
+	if (fl->use_cache && sc_hsm_filelist_has(fl->cached, fl->cached_len, prefix, id)
+			&& sc_pkcs15_read_cached_file(p15card, &path, &ptr, &len) == SC_SUCCESS)
+		return len;
+
+	r = sc_hsm_read_ef(p15card->card, (prefix << 8) | id, 0, buf, buflen);
+	if (r > 0 && (size_t)r < buflen && fl->use_cache)
+		sc_pkcs15_cache_file(p15card, &path, buf, r);
+	return r;
+}
+
+
+
+static int sc_pkcs15emu_sc_hsm_add_pubkey(sc_pkcs15_card_t *p15card, sc_pkcs15_prkey_info_t *key_info, char *label,
+		const u8 *efbin, size_t efbinlen) {
 	sc_card_t *card = p15card->card;
 	sc_pkcs15_pubkey_info_t pubkey_info;
 	sc_pkcs15_object_t pubkey_obj;
 	struct sc_pkcs15_pubkey pubkey;
-	u8 efbin[1024];
 	sc_cvc_t cvc;
-	u8 *cvcpo;
+	const u8 *cvcpo;
 	size_t cvclen;
 	int r;
 
-	/* EF.CERT is selected */
-	r = sc_read_binary(p15card->card, 0, efbin, sizeof(efbin), 0);
-	LOG_TEST_RET(card->ctx, r, "Could not read CSR from EF");
-
 	cvcpo = efbin;
-	cvclen = r;
+	cvclen = efbinlen;
 
 	memset(&cvc, 0, sizeof(cvc));
-	r = sc_pkcs15emu_sc_hsm_decode_cvc(p15card, (const u8 **)&cvcpo, &cvclen, &cvc);
+	r = sc_pkcs15emu_sc_hsm_decode_cvc(p15card, &cvcpo, &cvclen, &cvc);
 	LOG_TEST_RET(card->ctx, r, "Could decode certificate signing request");
 
 	if (cvc.publicPoint || cvc.publicPointlen) {
@@ -315,34 +379,26 @@ static int sc_pkcs15emu_sc_hsm_add_pubkey(sc_pkcs15_card_t *p15card, sc_pkcs15_p
 /*
  * Add a key and the key description in PKCS#15 format to the framework
  */
-static int sc_pkcs15emu_sc_hsm_add_prkd(sc_pkcs15_card_t * p15card, u8 keyid) {
+static int sc_pkcs15emu_sc_hsm_add_prkd(sc_pkcs15_card_t * p15card, const sc_hsm_filelist_t *fl, u8 keyid) {
 
 	sc_card_t *card = p15card->card;
 	sc_pkcs15_cert_info_t cert_info;
 	sc_pkcs15_object_t cert_obj;
 	struct sc_pkcs15_object prkd;
 	sc_pkcs15_prkey_info_t *key_info;
-	sc_file_t *file = NULL;
 	sc_path_t path;
 	u8 fid[2];
 	u8 efbin[512];
+	u8 certbin[4096];
 	u8 *ptr;
 	size_t len;
 	int r;
 
-	fid[0] = PRKD_PREFIX;
-	fid[1] = keyid;
-
-	/* Try to select a related EF containing the PKCS#15 description of the key */
-	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, 0);
-	r = sc_select_file(card, &path, &file);
-
-	if (r != SC_SUCCESS) {
+	/* Read the related EF containing the PKCS#15 description of the key */
+	r = sc_pkcs15emu_sc_hsm_read_ef(p15card, fl, PRKD_PREFIX, keyid, efbin, sizeof(efbin));
+	if (r == SC_ERROR_FILE_NOT_FOUND) {
 		return SC_SUCCESS;
 	}
-
-	sc_file_free(file);
-	r = sc_read_binary(p15card->card, 0, efbin, sizeof(efbin), 0);
 	LOG_TEST_RET(card->ctx, r, "Could not read EF.PRKD");
 
 	memset(&prkd, 0, sizeof(prkd));
@@ -372,40 +428,50 @@ static int sc_pkcs15emu_sc_hsm_add_prkd(sc_pkcs15_card_t * p15card, u8 keyid) {
 
 	LOG_TEST_RET(card->ctx, r, "Could not add private key to framework");
 
-	/* Check if we also have a certificate for the private key */
-	fid[0] = EE_CERTIFICATE_PREFIX;
+	/* Check if we also have a certificate for the private key. Without
+	 * the file cache, the first byte tells what it is. */
+	len = fl->use_cache ? sizeof(certbin) : 1;
+	r = sc_pkcs15emu_sc_hsm_read_ef(p15card, fl, EE_CERTIFICATE_PREFIX, keyid, certbin, len);
 
-	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, 0);
-	r = sc_select_file(card, &path, &file);
-
-	if (r != SC_SUCCESS) {
-		return SC_SUCCESS;
-	}
-
-	sc_file_free(file);
-
-	/* Check if the certificate is a X.509 certificate */
-	r = sc_read_binary(p15card->card, 0, efbin, 1, 0);
-
-	if (r < 0) {
+	if (r <= 0) {
 		return SC_SUCCESS;
 	}
+	len = r;
 
-	if (efbin[0] == 0x67) {		/* Decode CSR and create public key object */
-		sc_pkcs15emu_sc_hsm_add_pubkey(p15card, key_info, prkd.label);
+	if (certbin[0] == 0x67) {		/* Decode CSR and create public key object */
+		if (len == 1) {
+			r = sc_pkcs15emu_sc_hsm_read_ef(p15card, fl, EE_CERTIFICATE_PREFIX, keyid, certbin, 1024);
+			if (r <= 0) {
+				return SC_SUCCESS;
+			}
+			len = r;
+		}
+		sc_pkcs15emu_sc_hsm_add_pubkey(p15card, key_info, prkd.label, certbin, len);
 		return SC_SUCCESS;		/* Ignore any errors */
 	}
 
-	if (efbin[0] != 0x30) {
+	if (certbin[0] != 0x30) {
 		return SC_SUCCESS;
 	}
 
 	memset(&cert_info, 0, sizeof(cert_info));
 	memset(&cert_obj, 0, sizeof(cert_obj));
 
+	fid[0] = EE_CERTIFICATE_PREFIX;
+	fid[1] = keyid;
+	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, 0);
+
 	cert_info.id = key_info->id;
 	cert_info.path = path;
 	cert_info.path.count = -1;
+	if (len > 1 && len < sizeof(certbin)) {
+		/* read completely, use it from memory */
+		cert_info.value.value = malloc(len);
+		if (cert_info.value.value != NULL) {
+			memcpy(cert_info.value.value, certbin, len);
+			cert_info.value.len = len;
+		}
+	}
 
 	strlcpy(cert_obj.label, prkd.label, sizeof(cert_obj.label));
 	r = sc_pkcs15emu_add_x509_cert(p15card, &cert_obj, &cert_info);
@@ -419,32 +485,21 @@ static int sc_pkcs15emu_sc_hsm_add_prkd(sc_pkcs15_card_t * p15card, u8 keyid) {
 /*
  * Add a data object and description in PKCS#15 format to the framework
  */
-static int sc_pkcs15emu_sc_hsm_add_dcod(sc_pkcs15_card_t * p15card, u8 id) {
+static int sc_pkcs15emu_sc_hsm_add_dcod(sc_pkcs15_card_t * p15card, const sc_hsm_filelist_t *fl, u8 id) {
 
 	sc_card_t *card = p15card->card;
 	sc_pkcs15_data_info_t *data_info;
 	sc_pkcs15_object_t data_obj;
-	sc_file_t *file = NULL;
-	sc_path_t path;
-	u8 fid[2];
 	u8 efbin[512];
 	const u8 *ptr;
 	size_t len;
 	int r;
 
-	fid[0] = DCOD_PREFIX;
-	fid[1] = id;
-
-	/* Try to select a related EF containing the PKCS#15 description of the data */
-	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, 0);
-	r = sc_select_file(card, &path, &file);
-
-	if (r != SC_SUCCESS) {
+	/* Read the related EF containing the PKCS#15 description of the data */
+	r = sc_pkcs15emu_sc_hsm_read_ef(p15card, fl, DCOD_PREFIX, id, efbin, sizeof(efbin));
+	if (r == SC_ERROR_FILE_NOT_FOUND) {
 		return SC_SUCCESS;
 	}
-
-	sc_file_free(file);
-	r = sc_read_binary(p15card->card, 0, efbin, sizeof(efbin), 0);
 	LOG_TEST_RET(card->ctx, r, "Could not read EF.DCOD");
 
 	memset(&data_obj, 0, sizeof(data_obj));
@@ -468,32 +523,21 @@ static int sc_pkcs15emu_sc_hsm_add_dcod(sc_pkcs15_card_t * p15card, u8 id) {
 /*
  * Add a unrelated certificate object and description in PKCS#15 format to the framework
  */
-static int sc_pkcs15emu_sc_hsm_add_cd(sc_pkcs15_card_t * p15card, u8 id) {
+static int sc_pkcs15emu_sc_hsm_add_cd(sc_pkcs15_card_t * p15card, const sc_hsm_filelist_t *fl, u8 id) {
 
 	sc_card_t *card = p15card->card;
 	sc_pkcs15_cert_info_t *cert_info;
 	sc_pkcs15_object_t obj;
-	sc_file_t *file = NULL;
-	sc_path_t path;
-	u8 fid[2];
 	u8 efbin[512];
 	const u8 *ptr;
 	size_t len;
 	int r;
 
-	fid[0] = CD_PREFIX;
-	fid[1] = id;
-
-	/* Try to select a related EF containing the PKCS#15 description of the data */
-	sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, sizeof(fid), 0, 0);
-	r = sc_select_file(card, &path, &file);
-
-	if (r != SC_SUCCESS) {
+	/* Read the related EF containing the PKCS#15 description of the data */
+	r = sc_pkcs15emu_sc_hsm_read_ef(p15card, fl, CD_PREFIX, id, efbin, sizeof(efbin));
+	if (r == SC_ERROR_FILE_NOT_FOUND) {
 		return SC_SUCCESS;
 	}
-
-	sc_file_free(file);
-	r = sc_read_binary(p15card->card, 0, efbin, sizeof(efbin), 0);
 	LOG_TEST_RET(card->ctx, r, "Could not read EF.DCOD");
 
 	memset(&obj, 0, sizeof(obj));
@@ -533,6 +577,8 @@ static int sc_pkcs15emu_sc_hsm_init (sc_pkcs15_card_t * p15card)
 	u8 efbin[512];
 	u8 *ptr;
 	size_t len;
+	sc_hsm_filelist_t fl;
+	u8 *cached = NULL;
 
 	LOG_FUNC_CALLED(card->ctx);
 
@@ -646,22 +692,48 @@ static int sc_pkcs15emu_sc_hsm_init (sc_pkcs15_card_t * p15card)
 	filelistlength = sc_list_files(card, filelist, sizeof(filelist));
 	LOG_TEST_RET(card->ctx, filelistlength, "Could not enumerate file and key identifier");
 
+	memset(&fl, 0, sizeof(fl));
+	fl.fids = filelist;
+	fl.len = filelistlength;
+	fl.use_cache = p15card->opts.use_file_cache;
+	if (fl.use_cache) {
+		sc_hsm_cache_path(&path, 0xFF, 0xFF);
+		if (sc_pkcs15_read_cached_file(p15card, &path, &cached, &len) == SC_SUCCESS) {
+			fl.cached = cached;
+			fl.cached_len = len;
+		}
+	}
+
+	/* Only the files that are listed are read, without selecting them */
+	r = sc_lock(card);
+	if (r != SC_SUCCESS) {
+		free(cached);
+		LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+	}
 	for (i = 0; i < filelistlength; i += 2) {
 		switch(filelist[i]) {
 		case KEY_PREFIX:
-			r = sc_pkcs15emu_sc_hsm_add_prkd(p15card, filelist[i + 1]);
+			r = sc_pkcs15emu_sc_hsm_add_prkd(p15card, &fl, filelist[i + 1]);
 			break;
 		case DCOD_PREFIX:
-			r = sc_pkcs15emu_sc_hsm_add_dcod(p15card, filelist[i + 1]);
+			r = sc_pkcs15emu_sc_hsm_add_dcod(p15card, &fl, filelist[i + 1]);
 			break;
 		case CD_PREFIX:
-			r = sc_pkcs15emu_sc_hsm_add_cd(p15card, filelist[i + 1]);
+			r = sc_pkcs15emu_sc_hsm_add_cd(p15card, &fl, filelist[i + 1]);
 			break;
 		}
 		if (r != SC_SUCCESS) {
 			sc_log(card->ctx, "Error %d adding elements to framework", r);
 		}
 	}
+	sc_unlock(card);
+
+	if (fl.use_cache && (fl.cached_len != (size_t)filelistlength
+			|| memcmp(fl.cached, filelist, filelistlength))) {
+		sc_hsm_cache_path(&path, 0xFF, 0xFF);
+		sc_pkcs15_cache_file(p15card, &path, filelist, filelistlength);
+	}
+	free(cached);
 
 	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 }
@@ -32,7 +32,7 @@
 #include "pkcs15.h"
 
 static int select_key_file(struct sc_pkcs15_card *p15card,
-			   const struct sc_pkcs15_prkey_info *prkey,
+			   const sc_path_t *key_path,
 			   sc_security_env_t *senv)
 {
 	sc_context_t *ctx = p15card->card->ctx;
@@ -48,21 +48,21 @@ static int select_key_file(struct sc_pkcs15_card *p15card,
 	 * Check validity of the following assumption. */
 	/* For pkcs15-emulated cards, the file_app may be NULL,
 	   in that case we allways assume an absolute path */
-	if (!prkey->path.len && prkey->path.aid.len)   {
+	if (!key_path->len && key_path->aid.len)   {
 		/* Private key is a SDO allocated in application DF */
-		path = prkey->path;
+		path = *key_path;
 	}
-	else if (prkey->path.len == 2 && p15card->file_app != NULL) {
+	else if (key_path->len == 2 && p15card->file_app != NULL) {
 		/* Path is relative to app. DF */
 		path = p15card->file_app->path;
-		file_id = prkey->path;
+		file_id = *key_path;
 		sc_append_path(&path, &file_id);
 		senv->file_ref = file_id;
 		senv->flags |= SC_SEC_ENV_FILE_REF_PRESENT;
 	}
-	else if (prkey->path.len > 2)   {
-		path = prkey->path;
-		memcpy(file_id.value, prkey->path.value + prkey->path.len - 2, 2);
+	else if (key_path->len > 2)   {
+		path = *key_path;
+		memcpy(file_id.value, key_path->value + key_path->len - 2, 2);
 		file_id.len = 2;
 		file_id.type = SC_PATH_TYPE_FILE_ID;
 		senv->file_ref = file_id;
@@ -77,8 +77,60 @@ static int select_key_file(struct sc_pkcs15_card *p15card,
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
+
+/* Selects the key file and sets the security environment, unless the card
+ * still has the one set for the same key and operation: the card lock was
+ * held since and nothing else was selected or set meanwhile. Called with
+ * the card locked. */
+static int set_key_security_env(struct sc_pkcs15_card *p15card,
+		const struct sc_pkcs15_object *obj, sc_security_env_t *senv)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	const sc_path_t *key_path;
+	struct sc_pkcs15_sec_env_cache *cache = p15card->sec_env_cache;
+	int r;
+
+	if ((obj->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_SKEY)
+		key_path = &((const struct sc_pkcs15_skey_info *) obj->data)->path;
+	else
+		key_path = &((const struct sc_pkcs15_prkey_info *) obj->data)->path;
+
+	if (cache && cache->obj == obj && cache->serial == p15card->card->cache.sec_env_serial
+			&& memcmp(&cache->senv, senv, sizeof(*senv)) == 0) {
+		sc_log(ctx, "Security environment is still set");
+		return SC_SUCCESS;
+	}
+
+	if (cache == NULL && p15card->opts.reuse_sec_env)
+		cache = p15card->sec_env_cache = calloc(1, sizeof(struct sc_pkcs15_sec_env_cache));
+	if (cache) {
+		cache->obj = NULL;
+		memcpy(&cache->senv, senv, sizeof(*senv));
+	}
+
+	if (key_path->len != 0 || key_path->aid.len != 0) {
+		r = select_key_file(p15card, key_path, senv);
+		LOG_TEST_RET(ctx, r, "Unable to select key file");
+	}
+
+	r = sc_set_security_env(p15card->card, senv, 0);
+	LOG_TEST_RET(ctx, r, "sc_set_security_env() failed");
+
+	if (cache) {
+		cache->obj = obj;
+		cache->serial = p15card->card->cache.sec_env_serial;
+	}
+	return SC_SUCCESS;
+}
+
+/* The operation failed: set everything up again the next time */
+static void forget_key_security_env(struct sc_pkcs15_card *p15card)
+{
+	if (p15card->sec_env_cache)
+		p15card->sec_env_cache->obj = NULL;
+}
  
-int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
+static int pkcs15_decipher(struct sc_pkcs15_card *p15card,
 		       const struct sc_pkcs15_object *obj,
 		       unsigned long flags,
 		       const u8 * in, size_t inlen, u8 *out, size_t outlen)
@@ -145,24 +197,18 @@ int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 	r = sc_lock(p15card->card);
 	LOG_TEST_RET(ctx, r, "sc_lock() failed");
 
-	if (prkey->path.len != 0 || prkey->path.aid.len != 0) {
-		r = select_key_file(p15card, prkey, &senv);
-		if (r < 0) {
-			sc_unlock(p15card->card);
-			LOG_TEST_RET(ctx, r,"Unable to select private key file");
-		}
-	}
-
-	r = sc_set_security_env(p15card->card, &senv, 0);
+	r = set_key_security_env(p15card, obj, &senv);
 	if (r < 0) {
 		sc_unlock(p15card->card);
-		LOG_TEST_RET(ctx, r, "sc_set_security_env() failed");
+		LOG_FUNC_RETURN(ctx, r);
 	}
 	r = sc_decipher(p15card->card, in, inlen, out, outlen);
 	if (r == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED) {
 		if (sc_pkcs15_pincache_revalidate(p15card, obj) == SC_SUCCESS)
 			r = sc_decipher(p15card->card, in, inlen, out, outlen);
 	}
+	if (r < 0)
+		forget_key_security_env(p15card);
 	sc_unlock(p15card->card);
 	LOG_TEST_RET(ctx, r, "sc_decipher() failed");
 
@@ -176,6 +222,113 @@ int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
+		       const struct sc_pkcs15_object *obj,
+		       unsigned long flags,
+		       const u8 * in, size_t inlen, u8 *out, size_t outlen)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	int r;
+
+	SC_TRACE_BEGIN(ctx, "sc_pkcs15_decipher", flags);
+	r = pkcs15_decipher(p15card, obj, flags, in, inlen, out, outlen);
+	SC_TRACE_END(ctx, "sc_pkcs15_decipher", r);
+	return r;
+}
+
+/* Enciphers or deciphers with a secret key of the card. Nothing is padded:
+ * <inlen> has to be a multiple of the block size. The security environment
+ * stays set between calls, so the parts of a long message only cost the
+ * cipher commands themselves. */
+static int pkcs15_crypt_sym(struct sc_pkcs15_card *p15card,
+		const struct sc_pkcs15_object *obj, int encrypt,
+		const u8 *in, size_t inlen, u8 *out, size_t outlen)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	const struct sc_pkcs15_skey_info *skey = (const struct sc_pkcs15_skey_info *) obj->data;
+	sc_security_env_t senv;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+
+	if ((obj->type & SC_PKCS15_TYPE_CLASS_MASK) != SC_PKCS15_TYPE_SKEY)
+		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "Not a secret key");
+	if (!skey->native)
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "This key is not native, cannot operate with it");
+	if (!(skey->usage & (encrypt ? SC_PKCS15_PRKEY_USAGE_ENCRYPT|SC_PKCS15_PRKEY_USAGE_WRAP
+				: SC_PKCS15_PRKEY_USAGE_DECRYPT|SC_PKCS15_PRKEY_USAGE_UNWRAP)))
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_ALLOWED, "This key cannot be used for this operation");
+
+	memset(&senv, 0, sizeof(senv));
+	memcpy(&senv.supported_algos, &p15card->tokeninfo->supported_algos, sizeof(senv.supported_algos));
+	switch (obj->type) {
+	case SC_PKCS15_TYPE_SKEY_DES:
+		senv.algorithm = SC_ALGORITHM_DES;
+		break;
+	case SC_PKCS15_TYPE_SKEY_2DES:
+	case SC_PKCS15_TYPE_SKEY_3DES:
+		senv.algorithm = SC_ALGORITHM_3DES;
+		break;
+	case SC_PKCS15_TYPE_SKEY_GENERIC:
+		/* the only block cipher with these key lengths */
+		if (skey->value_len != 128 && skey->value_len != 192 && skey->value_len != 256)
+			LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Generic secret key is not an AES key");
+		senv.algorithm = SC_ALGORITHM_AES;
+		break;
+	default:
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Key type not supported");
+	}
+
+	senv.operation = encrypt ? SC_SEC_OPERATION_ENCRYPT_SYM : SC_SEC_OPERATION_DECRYPT_SYM;
+	senv.flags = SC_SEC_ENV_ALG_PRESENT;
+	if (skey->key_reference >= 0) {
+		senv.key_ref_len = 1;
+		senv.key_ref[0] = skey->key_reference & 0xFF;
+		/* tag 83h, the reference of a secret key */
+		senv.flags |= SC_SEC_ENV_KEY_REF_PRESENT | SC_SEC_ENV_KEY_REF_ASYMMETRIC;
+	}
+
+	r = sc_lock(p15card->card);
+	LOG_TEST_RET(ctx, r, "sc_lock() failed");
+
+	r = set_key_security_env(p15card, obj, &senv);
+	if (r < 0) {
+		sc_unlock(p15card->card);
+		LOG_FUNC_RETURN(ctx, r);
+	}
+	if (encrypt)
+		r = sc_encrypt_sym(p15card->card, in, inlen, out, outlen);
+	else
+		r = sc_decrypt_sym(p15card->card, in, inlen, out, outlen);
+	if (r == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED
+			&& sc_pkcs15_pincache_revalidate(p15card, obj) == SC_SUCCESS) {
+		if (encrypt)
+			r = sc_encrypt_sym(p15card->card, in, inlen, out, outlen);
+		else
+			r = sc_decrypt_sym(p15card->card, in, inlen, out, outlen);
+	}
+	if (r < 0)
+		forget_key_security_env(p15card);
+	sc_unlock(p15card->card);
+	LOG_TEST_RET(ctx, r, "Symmetric cipher operation failed");
+
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+int sc_pkcs15_encrypt_sym(struct sc_pkcs15_card *p15card,
+		const struct sc_pkcs15_object *obj,
+		const u8 *in, size_t inlen, u8 *out, size_t outlen)
+{
+	return pkcs15_crypt_sym(p15card, obj, 1, in, inlen, out, outlen);
+}
+
+int sc_pkcs15_decrypt_sym(struct sc_pkcs15_card *p15card,
+		const struct sc_pkcs15_object *obj,
+		const u8 *in, size_t inlen, u8 *out, size_t outlen)
+{
+	return pkcs15_crypt_sym(p15card, obj, 0, in, inlen, out, outlen);
+}
+
 /* derive one key from another. RSA can use decipher, so this is for only ECDH
  * Since the value may be returned, and the call is expected to provide
  * the buffer, we used the PKCS#11 convention of outlen == 0 and out == NULL
@@ -249,18 +402,10 @@ int sc_pkcs15_derive(struct sc_pkcs15_card *p15card,
 	r = sc_lock(p15card->card);
 	LOG_TEST_RET(ctx, r, "sc_lock() failed");
 
-	if (prkey->path.len != 0 || prkey->path.aid.len != 0)   {
-		r = select_key_file(p15card, prkey, &senv);
-		if (r < 0) {
-			sc_unlock(p15card->card);
-			LOG_TEST_RET(ctx, r,"Unable to select private key file");
-		}
-	}
-
-	r = sc_set_security_env(p15card->card, &senv, 0);
+	r = set_key_security_env(p15card, obj, &senv);
 	if (r < 0) {
 		sc_unlock(p15card->card);
-		LOG_TEST_RET(ctx, r, "sc_set_security_env() failed");
+		LOG_FUNC_RETURN(ctx, r);
 	}
 /* TODO Do we need a sc_derive? PIV at least can use the decipher,
  * senv.operation       = SC_SEC_OPERATION_DERIVE;
@@ -270,6 +415,8 @@ int sc_pkcs15_derive(struct sc_pkcs15_card *p15card,
 		if (sc_pkcs15_pincache_revalidate(p15card, obj) == SC_SUCCESS)
 			r = sc_decipher(p15card->card, in, inlen, out, *poutlen);
 	}
+	if (r < 0)
+		forget_key_security_env(p15card);
 	sc_unlock(p15card->card);
 	LOG_TEST_RET(ctx, r, "sc_decipher/derive() failed");
 
@@ -293,7 +440,7 @@ out:
 #define USAGE_ANY_DECIPHER      (SC_PKCS15_PRKEY_USAGE_DECRYPT|\
                                  SC_PKCS15_PRKEY_USAGE_UNWRAP)
 
-int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
+static int pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 				const struct sc_pkcs15_object *obj,
 				unsigned long flags, const u8 *in, size_t inlen,
 				u8 *out, size_t outlen)
@@ -477,24 +624,18 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 	LOG_TEST_RET(ctx, r, "sc_lock() failed");
 
 	sc_log(ctx, "Private key path '%s'", sc_print_path(&prkey->path));
-	if (prkey->path.len != 0 || prkey->path.aid.len != 0) {
-		r = select_key_file(p15card, prkey, &senv);
-		if (r < 0) {
-			sc_unlock(p15card->card);
-			LOG_TEST_RET(ctx, r,"Unable to select private key file");
-		}
-	}
-
-	r = sc_set_security_env(p15card->card, &senv, 0);
+	r = set_key_security_env(p15card, obj, &senv);
 	if (r < 0) {
 		sc_unlock(p15card->card);
-		LOG_TEST_RET(ctx, r, "sc_set_security_env() failed");
+		LOG_FUNC_RETURN(ctx, r);
 	}
 
 	r = sc_compute_signature(p15card->card, tmp, inlen, out, outlen);
 	if (r == SC_ERROR_SECURITY_STATUS_NOT_SATISFIED)
 		if (sc_pkcs15_pincache_revalidate(p15card, obj) == SC_SUCCESS)
 			r = sc_compute_signature(p15card->card, tmp, inlen, out, outlen);
+	if (r < 0)
+		forget_key_security_env(p15card);
 
 	sc_mem_clear(buf, sizeof(buf));
 	sc_unlock(p15card->card);
@@ -502,3 +643,41 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 
 	LOG_FUNC_RETURN(ctx, r);
 }
+
+int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *obj,
+				unsigned long flags, const u8 *in, size_t inlen,
+				u8 *out, size_t outlen)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	int r;
+
+	SC_TRACE_BEGIN(ctx, "sc_pkcs15_compute_signature", flags);
+	r = pkcs15_compute_signature(p15card, obj, flags, in, inlen, out, outlen);
+	SC_TRACE_END(ctx, "sc_pkcs15_compute_signature", r);
+	return r;
+}
+
+int sc_pkcs15_hold_security_env(struct sc_pkcs15_card *p15card, int hold)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (!hold) {
+		if (p15card->sec_env_held) {
+			p15card->sec_env_held = 0;
+			sc_unlock(p15card->card);
+		}
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	if (p15card->sec_env_held)
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_ALLOWED, "Security environment is held already");
+
+	/* The environment stays valid as long as the card lock is held */
+	r = sc_lock(p15card->card);
+	LOG_TEST_RET(ctx, r, "sc_lock() failed");
+	p15card->sec_env_held = 1;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "common/libscdl.h"
 #include "internal.h"
@@ -74,25 +75,63 @@ static struct {
 	const char *		name;
 	int			(*handler)(sc_pkcs15_card_t *, sc_pkcs15emu_opt_t *);
 } builtin_emulators[] = {
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_westcos)
 	{ "westcos",	sc_pkcs15emu_westcos_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_openpgp)
 	{ "openpgp",	sc_pkcs15emu_openpgp_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_infocamere)
 	{ "infocamere",	sc_pkcs15emu_infocamere_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_starcert)
 	{ "starcert",	sc_pkcs15emu_starcert_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_tcos)
 	{ "tcos",	sc_pkcs15emu_tcos_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_esteid)
 	{ "esteid",	sc_pkcs15emu_esteid_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_itacns)
 	{ "itacns",	sc_pkcs15emu_itacns_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_postecert)
 	{ "postecert",	sc_pkcs15emu_postecert_init_ex  },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_PIV_II)
 	{ "PIV-II",     sc_pkcs15emu_piv_init_ex        },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_gemsafeGPK)
 	{ "gemsafeGPK",	sc_pkcs15emu_gemsafeGPK_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_gemsafeV1)
 	{ "gemsafeV1",	sc_pkcs15emu_gemsafeV1_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_actalis)
 	{ "actalis",	sc_pkcs15emu_actalis_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_atrust_acos)
 	{ "atrust-acos",sc_pkcs15emu_atrust_acos_init_ex},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_tccardos)
 	{ "tccardos",	sc_pkcs15emu_tccardos_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_entersafe)
 	{ "entersafe",  sc_pkcs15emu_entersafe_init_ex  },
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_pteid)
 	{ "pteid",	sc_pkcs15emu_pteid_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_oberthur)
 	{ "oberthur",   sc_pkcs15emu_oberthur_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_sc_hsm)
 	{ "sc-hsm",   sc_pkcs15emu_sc_hsm_init_ex	},
+#endif
+#if !defined(SC_ONLY_CARD_DRIVERS) || defined(SC_CARD_DRIVER_dnie)
 	{ "dnie",       sc_pkcs15emu_dnie_init_ex   },
+#endif
 	{ NULL, NULL }
 };
 
@@ -127,13 +166,123 @@ int sc_pkcs15_is_emulation_only(sc_card_t *card)
 	}
 }
 
-int
-sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
+/* The emulators that handle the card types set by their card drivers */
+static const struct {
+	int			first_type, last_type;
+	const char *		name;
+} emulator_card_types[] = {
+	{ SC_CARD_TYPE_MCRD_ESTEID_V10,	SC_CARD_TYPE_MCRD_ESTEID_V30,	"esteid"	},
+	{ SC_CARD_TYPE_TCOS_V2,		SC_CARD_TYPE_TCOS_V3,		"tcos"		},
+	{ SC_CARD_TYPE_OPENPGP_V1,	SC_CARD_TYPE_OPENPGP_V2,	"openpgp"	},
+	{ SC_CARD_TYPE_OBERTHUR_64K,	SC_CARD_TYPE_OBERTHUR_64K,	"oberthur"	},
+	{ SC_CARD_TYPE_PIV_II_GENERIC,	SC_CARD_TYPE_PIV_II_BASE + 999,	"PIV-II"	},
+	{ SC_CARD_TYPE_GEMSAFEV1_PTEID,	SC_CARD_TYPE_GEMSAFEV1_PTEID,	"pteid"		},
+	{ SC_CARD_TYPE_IAS_PTEID,	SC_CARD_TYPE_IAS_PTEID,		"pteid"		},
+	{ SC_CARD_TYPE_SC_HSM,		SC_CARD_TYPE_SC_HSM,		"sc-hsm"	},
+	{ SC_CARD_TYPE_DNIE_BASE,	SC_CARD_TYPE_DNIE_TERMINATED,	"dnie"		},
+	{ 0, 0, NULL }
+};
+
+/* The emulator that took the ATR the last time, from "<cache_dir>/<ATR>.emu";
+ * SC_PKCS15_EMU_NONE if the card was bound without emulation */
+int sc_pkcs15_get_cached_emulator(sc_card_t *card, char *name, size_t len)
+{
+	char fname[PATH_MAX];
+	char buf[64];
+	FILE *f;
+
+	if (!card->ctx->use_driver_cache
+			|| _sc_card_cache_filename(card, "emu", fname, sizeof(fname)) != SC_SUCCESS)
+		return SC_ERROR_FILE_NOT_FOUND;
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fscanf(f, "%63s", buf) != 1)
+		buf[0] = '\0';
+	fclose(f);
+	_sc_cache_used(card->ctx, fname);
+	if (buf[0] == '\0' || strlen(buf) >= len)
+		return SC_ERROR_FILE_NOT_FOUND;
+	strcpy(name, buf);
+	return SC_SUCCESS;
+}
+
+void sc_pkcs15_set_cached_emulator(sc_card_t *card, const char *name)
+{
+	sc_context_t *ctx = card->ctx;
+	char fname[PATH_MAX];
+	char old[64];
+	FILE *f;
+
+	if (!ctx->use_driver_cache
+			|| _sc_card_cache_filename(card, "emu", fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	if (sc_pkcs15_get_cached_emulator(card, old, sizeof(old)) == SC_SUCCESS && !strcmp(old, name))
+		return;
+
+	f = fopen(fname, "w");
+	if (f == NULL && sc_make_cache_dir(ctx) == SC_SUCCESS)
+		f = fopen(fname, "w");
+	if (f == NULL) {
+		sc_log(ctx, "cannot write '%s'", fname);
+		return;
+	}
+	fprintf(f, "%s\n", name);
+	fclose(f);
+	_sc_cache_used(ctx, fname);
+}
+
+static int builtin_emulator_index(const char *name)
+{
+	int i;
+
+	for (i = 0; builtin_emulators[i].name; i++)
+		if (!strcmp(builtin_emulators[i].name, name))
+			return i;
+	return -1;
+}
+
+/* Index of the builtin emulator to try before the others, or -1 */
+static int preferred_emulator(sc_card_t *card)
+{
+	char name[64];
+	int i;
+
+	if (sc_pkcs15_get_cached_emulator(card, name, sizeof(name)) == SC_SUCCESS
+			&& (i = builtin_emulator_index(name)) >= 0)
+		return i;
+	for (i = 0; emulator_card_types[i].name; i++)
+		if (card->type >= emulator_card_types[i].first_type
+				&& card->type <= emulator_card_types[i].last_type)
+			return builtin_emulator_index(emulator_card_types[i].name);
+	return -1;
+}
+
+/* Is the builtin emulator enabled by the configuration? */
+static int builtin_emulator_enabled(scconf_block *conf_block, const char *name)
+{
+	const scconf_list *item;
+
+	if (!conf_block)
+		return 1;
+	if (!scconf_get_bool(conf_block, "enable_builtin_emulation", 1))
+		return 0;
+	item = scconf_find_list(conf_block, "builtin_emulators");
+	if (!item)
+		return 1;
+	for (; item; item = item->next)
+		if (!strcmp(item->data, name))
+			return 1;
+	return 0;
+}
+
+static int
+pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 {
 	sc_context_t		*ctx = p15card->card->ctx;
 	scconf_block		*conf_block, **blocks, *blk;
 	sc_pkcs15emu_opt_t	opts;
-	int			i, r = SC_ERROR_WRONG_CARD;
+	int			i, r = SC_ERROR_WRONG_CARD, hit = -1, tried;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
 	memset(&opts, 0, sizeof(opts));
@@ -141,15 +290,34 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 
 	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
 
+	/* the emulator for the card type, or that took this ATR before,
+	 * usually saves trying all the others */
+	tried = preferred_emulator(p15card->card);
+	if (tried >= 0 && builtin_emulator_enabled(conf_block, builtin_emulators[tried].name)) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s first\n", builtin_emulators[tried].name);
+		r = builtin_emulators[tried].handler(p15card, &opts);
+		if (r == SC_SUCCESS) {
+			hit = tried;
+			goto out;
+		}
+	}
+	else {
+		tried = -1;
+	}
+
 	if (!conf_block) {
 		/* no conf file found => try bultin drivers  */
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "no conf file (or section), trying all builtin emulators\n");
 		for (i = 0; builtin_emulators[i].name; i++) {
+			if (i == tried)
+				continue;
 			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s\n", builtin_emulators[i].name);
 			r = builtin_emulators[i].handler(p15card, &opts);
-			if (r == SC_SUCCESS)
+			if (r == SC_SUCCESS) {
 				/* we got a hit */
+				hit = i;
 				goto out;
+			}
 		}
 	} else {
 		/* we have a conf file => let's use it */
@@ -167,22 +335,28 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 
 				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s\n", name);
 				for (i = 0; builtin_emulators[i].name; i++)
-					if (!strcmp(builtin_emulators[i].name, name)) {
+					if (i != tried && !strcmp(builtin_emulators[i].name, name)) {
 						r = builtin_emulators[i].handler(p15card, &opts);
-						if (r == SC_SUCCESS)
+						if (r == SC_SUCCESS) {
 							/* we got a hit */
+							hit = i;
 							goto out;
+						}
 					}
 			}	
 		}
 		else if (builtin_enabled) {
 			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "no emulator list in config file, trying all builtin emulators\n");
 			for (i = 0; builtin_emulators[i].name; i++) {
+				if (i == tried)
+					continue;
 				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "trying %s\n", builtin_emulators[i].name);
 				r = builtin_emulators[i].handler(p15card, &opts);
-				if (r == SC_SUCCESS)
+				if (r == SC_SUCCESS) {
 					/* we got a hit */
+					hit = i;
 					goto out;
+				}
 			}
 		}
 
@@ -208,6 +382,8 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
 out:	if (r == SC_SUCCESS) {
 		p15card->magic  = SC_PKCS15_CARD_MAGIC;
 		p15card->flags |= SC_PKCS15_CARD_FLAG_EMULATED;
+		if (hit >= 0)
+			sc_pkcs15_set_cached_emulator(p15card->card, builtin_emulators[hit].name);
 	} else if (r != SC_ERROR_WRONG_CARD) {
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Failed to load card emulator: %s\n",
 				sc_strerror(r));
@@ -216,6 +392,17 @@ out:	if (r == SC_SUCCESS) {
 	return r;
 }
 
+int
+sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card)
+{
+	int r;
+
+	SC_TRACE_BEGIN(p15card->card->ctx, "sc_pkcs15_bind_synthetic", 0);
+	r = pkcs15_bind_synthetic(p15card);
+	SC_TRACE_END(p15card->card->ctx, "sc_pkcs15_bind_synthetic", r);
+	return r;
+}
+
 static int parse_emu_block(sc_pkcs15_card_t *p15card, scconf_block *conf)
 {
 	sc_card_t	*card = p15card->card;
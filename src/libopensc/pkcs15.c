@@ -23,6 +23,7 @@
 #endif
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
@@ -109,6 +110,10 @@ static const struct sc_asn1_entry c_asn1_tokeninfo[] = {
 static void sc_pkcs15_free_unusedspace(struct sc_pkcs15_card *p15card);
 static void sc_pkcs15_remove_dfs(struct sc_pkcs15_card *p15card);
 static void sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card);
+static void sc_pkcs15_free_prefetched(struct sc_pkcs15_card *p15card);
+static int sc_pkcs15_read_file_acl(struct sc_pkcs15_card *p15card, const sc_path_t *in_path,
+		u8 **buf, size_t *buflen, int public_only);
+static void sc_pkcs15_free_arena(struct sc_pkcs15_card *p15card);
 
 int sc_pkcs15_parse_tokeninfo(sc_context_t *ctx,
 	sc_pkcs15_tokeninfo_t *ti, const u8 *buf, size_t blen)
@@ -723,34 +728,40 @@ struct sc_pkcs15_card * sc_pkcs15_card_new(void)
 	}
 
 	sc_init_oid(&p15card->tokeninfo->profile_indication.oid);
+	_sc_memcache_init(&p15card->pubkey_account, "pubkey", 1);
 
 	p15card->magic = SC_PKCS15_CARD_MAGIC;
 	return p15card;
 }
 
+static void free_tokeninfo_fields(struct sc_pkcs15_tokeninfo *ti)
+{
+	if (ti->label != NULL)
+		free(ti->label);
+	if (ti->serial_number != NULL)
+		free(ti->serial_number);
+	if (ti->manufacturer_id != NULL)
+		free(ti->manufacturer_id);
+	if (ti->last_update.gtime != NULL)
+		free(ti->last_update.gtime);
+	if (ti->preferred_language != NULL)
+		free(ti->preferred_language);
+	if (ti->profile_indication.name != NULL)
+		free(ti->profile_indication.name);
+	if (ti->seInfo != NULL) {
+		unsigned i;
+		for (i = 0; i < ti->num_seInfo; i++)
+			free(ti->seInfo[i]);
+		free(ti->seInfo);
+	}
+}
+
 void sc_pkcs15_free_tokeninfo(struct sc_pkcs15_card *p15card)
 {
 	if (!p15card || !p15card->tokeninfo)
 		return;
 
-	if (p15card->tokeninfo->label != NULL)
-		free(p15card->tokeninfo->label);
-	if (p15card->tokeninfo->serial_number != NULL)
-		free(p15card->tokeninfo->serial_number);
-	if (p15card->tokeninfo->manufacturer_id != NULL)
-		free(p15card->tokeninfo->manufacturer_id);
-	if (p15card->tokeninfo->last_update.gtime != NULL)
-		free(p15card->tokeninfo->last_update.gtime);
-	if (p15card->tokeninfo->preferred_language != NULL)
-		free(p15card->tokeninfo->preferred_language);
-	if (p15card->tokeninfo->profile_indication.name != NULL)
-		free(p15card->tokeninfo->profile_indication.name);
-	if (p15card->tokeninfo->seInfo != NULL) {
-		unsigned i;
-		for (i = 0; i < p15card->tokeninfo->num_seInfo; i++)
-			free(p15card->tokeninfo->seInfo[i]);
-		free(p15card->tokeninfo->seInfo);
-	}
+	free_tokeninfo_fields(p15card->tokeninfo);
 	free(p15card->tokeninfo);
 
 	p15card->tokeninfo = NULL;
@@ -779,9 +790,14 @@ void sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 		p15card->ops.clear(p15card);
 
 	sc_pkcs15_remove_objects(p15card);
+	sc_pkcs15_free_arena(p15card);
+	sc_pkcs15_free_pubkey_cache(p15card);
 	sc_pkcs15_remove_dfs(p15card);
 	sc_pkcs15_free_unusedspace(p15card);
 	p15card->unusedspace_read = 0;
+	sc_pkcs15_free_prefetched(p15card);
+	sc_pkcs15_free_cache(p15card);
+	free(p15card->sec_env_cache);
 
 	if (p15card->file_app != NULL)
 		sc_file_free(p15card->file_app);
@@ -811,7 +827,16 @@ void sc_pkcs15_card_clear(sc_pkcs15_card_t *p15card)
 	p15card->tokeninfo->flags   = 0;
 
 	sc_pkcs15_remove_objects(p15card);
+	sc_pkcs15_free_arena(p15card);
+	sc_pkcs15_free_pubkey_cache(p15card);
 	sc_pkcs15_remove_dfs(p15card);
+	sc_pkcs15_free_prefetched(p15card);
+	sc_pkcs15_free_cache(p15card);
+	if (p15card->sec_env_cache)
+		/* the key objects are gone */
+		p15card->sec_env_cache->obj = NULL;
+	/* and so are the PIN objects */
+	memset(p15card->pin_status, 0, sizeof(p15card->pin_status));
 
 	p15card->df_list = NULL;
 	if (p15card->file_app != NULL) {
@@ -950,6 +975,229 @@ sc_pkcs15_get_application_by_type(struct sc_card * card, char *app_type)
 	return out;
 }
 
+static void
+sc_pkcs15_free_prefetched(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_prefetched_file *cur, *next;
+
+	for (cur = p15card->prefetched; cur; cur = next)   {
+		next = cur->next;
+		free(cur->data);
+		free(cur);
+	}
+	p15card->prefetched = NULL;
+}
+
+/* Take the read ahead content of 'path' out of the prefetch store */
+static int
+sc_pkcs15_get_prefetched(struct sc_pkcs15_card *p15card, const struct sc_path *path,
+		unsigned char **data, size_t *len)
+{
+	struct sc_pkcs15_prefetched_file **pp, *cur;
+
+	if (path->count >= 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	for (pp = &p15card->prefetched; *pp; pp = &(*pp)->next)   {
+		cur = *pp;
+		if (cur->path.type != path->type || !sc_compare_path(&cur->path, path))
+			continue;
+		*pp = cur->next;
+		*data = cur->data;
+		*len = cur->len;
+		free(cur);
+		return SC_SUCCESS;
+	}
+	return SC_ERROR_FILE_NOT_FOUND;
+}
+
+static int
+sc_pkcs15_df_path_cmp(const void *a, const void *b)
+{
+	const struct sc_path *pa = &(*(struct sc_pkcs15_df * const *)a)->path;
+	const struct sc_path *pb = &(*(struct sc_pkcs15_df * const *)b)->path;
+	size_t len = pa->len < pb->len ? pa->len : pb->len;
+	int r = memcmp(pa->value, pb->value, len);
+
+	if (r)
+		return r;
+	return (int)pa->len - (int)pb->len;
+}
+
+/* Read all the DFs listed in ODF in one locked session, sorted by path so
+ * that the files of the same DF follow each other. They are kept in memory
+ * until sc_pkcs15_parse_df() asks for them. Errors are not fatal here: the
+ * file is then read again, and the error reported, when it is really needed.
+ * With SC_CARD_CAP_FCI_READ_ACL, the files needing a login are left for then. */
+static void
+sc_pkcs15_prefetch_dfs(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_df *df, **dfs = NULL;
+	struct sc_pkcs15_prefetched_file *pf;
+	size_t count = 0, ii;
+	int r;
+
+	for (df = p15card->df_list; df; df = df->next)
+		if (!df->enumerated && df->path.count < 0)
+			count++;
+	if (count == 0)
+		return;
+
+	dfs = calloc(count, sizeof(*dfs));
+	if (dfs == NULL)
+		return;
+	for (ii = 0, df = p15card->df_list; df; df = df->next)
+		if (!df->enumerated && df->path.count < 0)
+			dfs[ii++] = df;
+	qsort(dfs, count, sizeof(*dfs), sc_pkcs15_df_path_cmp);
+
+	if (sc_lock(p15card->card) != SC_SUCCESS)   {
+		free(dfs);
+		return;
+	}
+
+	for (ii = 0; ii < count; ii++)   {
+		if (ii && !sc_pkcs15_df_path_cmp(&dfs[ii - 1], &dfs[ii]))
+			continue;
+
+		pf = calloc(1, sizeof(*pf));
+		if (pf == NULL)
+			break;
+		pf->path = dfs[ii]->path;
+		r = sc_pkcs15_read_file_acl(p15card, &pf->path, &pf->data, &pf->len, 1);
+		if (r != SC_SUCCESS)   {
+			sc_log(ctx, "prefetch of %s failed: %s", sc_print_path(&pf->path), sc_strerror(r));
+			free(pf);
+			continue;
+		}
+		pf->next = p15card->prefetched;
+		p15card->prefetched = pf;
+	}
+
+	sc_unlock(p15card->card);
+	free(dfs);
+}
+
+/* Without a serial number in EF(TokenInfo), the one of the card is used */
+static void sc_pkcs15_serial_from_card(struct sc_pkcs15_card *p15card)
+{
+	sc_card_t *card = p15card->card;
+
+	if (!p15card->tokeninfo->serial_number && card->serialnr.len)   {
+		char *serial = calloc(1, card->serialnr.len*2 + 1);
+		size_t ii;
+
+		if (serial == NULL)
+			return;
+		for(ii=0;ii<card->serialnr.len;ii++)
+			sprintf(serial + ii*2, "%02X", *(card->serialnr.value + ii));
+
+		p15card->tokeninfo->serial_number = serial;
+		sc_log(card->ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
+	}
+}
+
+/* Is the EF(TokenInfo) on the card still the one that was cached? */
+static int sc_pkcs15_tokeninfo_unchanged(struct sc_pkcs15_card *p15card,
+		const struct sc_pkcs15_bind_cache *bc)
+{
+	sc_file_t *file = NULL;
+	u8 *buf;
+	int r, same;
+
+	if (sc_select_file(p15card->card, &bc->tokeninfo_path, &file) != SC_SUCCESS || file == NULL)
+		return 0;
+	same = file->size == bc->tokeninfo_len || file->size == 0;
+	sc_file_free(file);
+	if (!same)
+		return 0;
+	buf = malloc(bc->tokeninfo_len);
+	if (buf == NULL)
+		return 0;
+	r = sc_read_binary(p15card->card, 0, buf, bc->tokeninfo_len, 0);
+	same = r == (int)bc->tokeninfo_len && !memcmp(buf, bc->tokeninfo, bc->tokeninfo_len);
+	free(buf);
+	return same;
+}
+
+/*
+ * The warm bind, with EF(ODF) and EF(TokenInfo) as an earlier bind of the
+ * same card read them. Where lastUpdate is in a file of its own, only
+ * that file is read to see if the token changed; otherwise EF(TokenInfo)
+ * is read and compared, and EF(ODF) is not read.
+ */
+static int sc_pkcs15_bind_cached(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_bind_cache bc;
+	sc_pkcs15_tokeninfo_t tokeninfo;
+	sc_file_t *odf_file = NULL, *ti_file = NULL;
+	const char *last_update;
+	int r;
+
+	r = sc_pkcs15_read_bind_cache(p15card, &bc);
+	if (r != SC_SUCCESS)
+		return r;
+
+	memset(&tokeninfo, 0, sizeof(tokeninfo));
+	r = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, bc.tokeninfo, bc.tokeninfo_len);
+	if (r != SC_SUCCESS) {
+		free_tokeninfo_fields(&tokeninfo);
+		goto out;
+	}
+	*(p15card->tokeninfo) = tokeninfo;
+
+	r = SC_ERROR_FILE_NOT_FOUND;
+	if (tokeninfo.last_update.path.len)   {
+		last_update = sc_pkcs15_get_lastupdate(p15card);
+		if (last_update == NULL || bc.last_update == NULL || strcmp(last_update, bc.last_update))
+			goto fail;
+	}
+	else if (!sc_pkcs15_tokeninfo_unchanged(p15card, &bc))   {
+		goto fail;
+	}
+
+	odf_file = sc_file_new();
+	ti_file = sc_file_new();
+	if (odf_file == NULL || ti_file == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto fail;
+	}
+	r = parse_odf(bc.odf, bc.odf_len, p15card);
+	if (r != SC_SUCCESS) {
+		sc_pkcs15_remove_dfs(p15card);
+		goto fail;
+	}
+
+	odf_file->path = bc.odf_path;
+	odf_file->size = bc.odf_len;
+	ti_file->path = bc.tokeninfo_path;
+	ti_file->size = bc.tokeninfo_len;
+	if (p15card->file_odf)
+		sc_file_free(p15card->file_odf);
+	if (p15card->file_tokeninfo)
+		sc_file_free(p15card->file_tokeninfo);
+	p15card->file_odf = odf_file;
+	p15card->file_tokeninfo = ti_file;
+
+	sc_pkcs15_serial_from_card(p15card);
+	sc_log(ctx, "EF(ODF) and EF(TokenInfo) from the cache");
+	goto out;
+
+fail:
+	sc_log(ctx, "cached EF(TokenInfo) not used: %s", sc_strerror(r));
+	if (odf_file)
+		sc_file_free(odf_file);
+	if (ti_file)
+		sc_file_free(ti_file);
+	free_tokeninfo_fields(p15card->tokeninfo);
+	memset(p15card->tokeninfo, 0, sizeof(*p15card->tokeninfo));
+out:
+	sc_pkcs15_free_bind_cache(&bc);
+	return r;
+}
+
 static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid)
 {
 	sc_path_t tmppath;
@@ -958,9 +1206,10 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 	sc_pkcs15_tokeninfo_t tokeninfo;
 	sc_pkcs15_df_t *df;
 	const sc_app_info_t *info = NULL;
-	unsigned char *buf = NULL;
-	size_t len;
+	unsigned char *buf = NULL, *odf = NULL;
+	size_t len, odf_len = 0;
 	int    err, ok = 0;
+	const char *span = NULL;	/* the open one of sc_set_trace_callback() */
 
 	LOG_FUNC_CALLED(ctx);
 	/* Enumerate apps now */
@@ -1014,6 +1263,18 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 	if (err < 0)
 		goto end;
 
+	if (p15card->opts.use_file_cache)   {
+		SC_TRACE_BEGIN(ctx, "file cache", 0);
+		err = sc_pkcs15_bind_cached(p15card);
+		SC_TRACE_END(ctx, "file cache", err);
+		if (err == SC_SUCCESS)   {
+			ok = 1;
+			goto end;
+		}
+	}
+
+	span = "read ODF";
+	SC_TRACE_BEGIN(ctx, span, 0);
 	if (p15card->file_odf == NULL) {
 		/* check if an ODF is present; we don't know yet whether we have a pkcs15 card */
 		sc_format_path("5031", &tmppath);
@@ -1043,8 +1304,10 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		goto end;
 	}
 	buf = malloc(len);
-	if(buf == NULL)
-		return SC_ERROR_OUT_OF_MEMORY;
+	if(buf == NULL) {
+		err = SC_ERROR_OUT_OF_MEMORY;
+		goto end;
+	}
 
 	err = sc_read_binary(card, 0, buf, len, 0);
 	if (err < 0)
@@ -1059,14 +1322,25 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		sc_log(ctx, "Unable to parse ODF");
 		goto end;
 	}
-	free(buf);
+	odf = buf;
+	odf_len = len;
 	buf = NULL;
+	SC_TRACE_END(ctx, span, SC_SUCCESS);
+	span = NULL;
 
 	sc_log(ctx, "The following DFs were found:");
 	for (df = p15card->df_list; df; df = df->next)
 		sc_log(ctx, "  DF type %u, path %s, index %u, count %d", df->type,
 				sc_print_path(&df->path), df->path.index, df->path.count);
 
+	if (p15card->opts.use_prefetch)   {
+		SC_TRACE_BEGIN(ctx, "sc_pkcs15_prefetch_dfs", 0);
+		sc_pkcs15_prefetch_dfs(p15card);
+		SC_TRACE_END(ctx, "sc_pkcs15_prefetch_dfs", 0);
+	}
+
+	span = "read TokenInfo";
+	SC_TRACE_BEGIN(ctx, span, 0);
 	if (p15card->file_tokeninfo == NULL) {
 		sc_format_path("5032", &tmppath);
 		err = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &tmppath);
@@ -1090,8 +1364,10 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		goto end;
 	}
 	buf = malloc(len);
-	if(buf == NULL)
-		return SC_ERROR_OUT_OF_MEMORY;
+	if(buf == NULL) {
+		err = SC_ERROR_OUT_OF_MEMORY;
+		goto end;
+	}
 
 	err = sc_read_binary(card, 0, buf, len, 0);
 	if (err < 0)
@@ -1101,33 +1377,54 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		goto end;
 	}
 
+	len = err;
 	memset(&tokeninfo, 0, sizeof(tokeninfo));
-	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, (size_t)err);
+	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, len);
 	if (err != SC_SUCCESS)
 		goto end;
 
 	*(p15card->tokeninfo) = tokeninfo;
+	SC_TRACE_END(ctx, span, SC_SUCCESS);
+	span = NULL;
 
-	if (!p15card->tokeninfo->serial_number && card->serialnr.len)   {
-		char *serial = calloc(1, card->serialnr.len*2 + 1);
-		size_t ii;
+	if (p15card->opts.use_file_cache)   {
+		struct sc_pkcs15_bind_cache bc;
 
-		for(ii=0;ii<card->serialnr.len;ii++)
-			sprintf(serial + ii*2, "%02X", *(card->serialnr.value + ii));
-
-		p15card->tokeninfo->serial_number = serial;
-		sc_log(ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
+		memset(&bc, 0, sizeof(bc));
+		bc.odf_path = p15card->file_odf->path;
+		bc.odf = odf;
+		bc.odf_len = odf_len;
+		bc.tokeninfo_path = p15card->file_tokeninfo->path;
+		bc.tokeninfo = buf;
+		bc.tokeninfo_len = len;
+		if (tokeninfo.last_update.path.len)
+			bc.last_update = sc_pkcs15_get_lastupdate(p15card);
+		sc_pkcs15_write_bind_cache(p15card, &bc);
 	}
 
+	sc_pkcs15_serial_from_card(p15card);
+
 	ok = 1;
 end:
+	if (span != NULL)
+		SC_TRACE_END(ctx, span, err);
 	if(buf != NULL)
 		free(buf);
+	if (odf != NULL)
+		free(odf);
 	if (!ok) {
 		sc_pkcs15_card_clear(p15card);
 		return err;
 	}
 
+	/* A change by another host shows only in lastUpdate; without it the
+	 * cached files could be stale at any time */
+	if (p15card->opts.use_file_cache && p15card->tokeninfo->last_update.gtime == NULL
+			&& p15card->tokeninfo->last_update.path.len == 0)   {
+		sc_log(ctx, "No lastUpdate in EF(TokenInfo), file cache not used");
+		p15card->opts.use_file_cache = 0;
+	}
+
 	return SC_SUCCESS;
 }
 
@@ -1148,20 +1445,26 @@ int sc_pkcs15_bind(sc_card_t *card, struct sc_aid *aid, struct sc_pkcs15_card **
 
 	p15card->card = card;
 	p15card->opts.use_file_cache = 0;
+	p15card->opts.use_prefetch = 1;
 	p15card->opts.use_pin_cache = 1;
 	p15card->opts.pin_cache_counter = 10;
+	p15card->opts.pin_cache_timeout = 0;
 	p15card->opts.pin_cache_ignore_user_consent = 0;
+	p15card->opts.reuse_sec_env = 1;
 
 	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
 
 	if (conf_block) {
 		p15card->opts.use_file_cache = scconf_get_bool(conf_block, "use_file_caching", p15card->opts.use_file_cache);
+		p15card->opts.use_prefetch = scconf_get_bool(conf_block, "use_prefetch", p15card->opts.use_prefetch);
 		p15card->opts.use_pin_cache = scconf_get_bool(conf_block, "use_pin_caching", p15card->opts.use_pin_cache);
 		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
+		p15card->opts.pin_cache_timeout = scconf_get_int(conf_block, "pin_cache_timeout", p15card->opts.pin_cache_timeout);
 		p15card->opts.pin_cache_ignore_user_consent =  scconf_get_bool(conf_block, "pin_cache_ignore_user_consent", p15card->opts.pin_cache_ignore_user_consent);
+		p15card->opts.reuse_sec_env = scconf_get_bool(conf_block, "reuse_security_env", p15card->opts.reuse_sec_env);
 	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d",
-	         p15card->opts.use_file_cache, p15card->opts.use_pin_cache, p15card->opts.pin_cache_counter, p15card->opts.pin_cache_ignore_user_consent);
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_prefetch=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_timeout=%d pin_cache_ignore_user_consent=%d",
+	         p15card->opts.use_file_cache, p15card->opts.use_prefetch, p15card->opts.use_pin_cache, p15card->opts.pin_cache_counter, p15card->opts.pin_cache_timeout, p15card->opts.pin_cache_ignore_user_consent);
 
 	r = sc_lock(card);
 	if (r) {
@@ -1172,14 +1475,28 @@ int sc_pkcs15_bind(sc_card_t *card, struct sc_aid *aid, struct sc_pkcs15_card **
 
 	enable_emu = scconf_get_bool(conf_block, "enable_pkcs15_emulation", 1);
 	if (enable_emu) {
+		char cached[64];
+
 		emu_first = scconf_get_bool(conf_block, "try_emulation_first", 0);
-		if (emu_first || sc_pkcs15_is_emulation_only(card)) {
+		if (emu_first && !sc_pkcs15_is_emulation_only(card)
+				&& sc_pkcs15_get_cached_emulator(card, cached, sizeof(cached)) == SC_SUCCESS
+				&& !strcmp(cached, SC_PKCS15_EMU_NONE)) {
+			/* no emulator took this ATR the last time */
+			r = sc_pkcs15_bind_internal(p15card, aid);
+			if (r == SC_SUCCESS)
+				goto done;
+			r = sc_pkcs15_bind_synthetic(p15card);
+			if (r < 0)
+				goto error;
+		} else if (emu_first || sc_pkcs15_is_emulation_only(card)) {
 			r = sc_pkcs15_bind_synthetic(p15card);
 			if (r == SC_SUCCESS)
 				goto done;
 			r = sc_pkcs15_bind_internal(p15card, aid);
 			if (r < 0)
 				goto error;
+			if (!sc_pkcs15_is_emulation_only(card))
+				sc_pkcs15_set_cached_emulator(card, SC_PKCS15_EMU_NONE);
 		} else {
 			r = sc_pkcs15_bind_internal(p15card, aid);
 			if (r == SC_SUCCESS)
@@ -1216,119 +1533,49 @@ int sc_pkcs15_unbind(struct sc_pkcs15_card *p15card)
 	return 0;
 }
 
-static int
-__sc_pkcs15_search_objects(sc_pkcs15_card_t *p15card,
-			unsigned int class_mask, unsigned int type,
-			int (*func)(sc_pkcs15_object_t *, void *),
-			void *func_arg,
-			sc_pkcs15_object_t **ret, size_t ret_size)
-{
-	sc_pkcs15_object_t *obj;
-	sc_pkcs15_df_t	*df;
-	unsigned int	df_mask = 0;
-	size_t		match_count = 0;
-	int		r = 0;
-
-	if (type)
-		class_mask |= SC_PKCS15_TYPE_TO_CLASS(type);
-
-	/* Make sure the class mask we have makes sense */
-	if (class_mask == 0
-	 || (class_mask & ~(SC_PKCS15_SEARCH_CLASS_PRKEY |
-			    SC_PKCS15_SEARCH_CLASS_PUBKEY |
-			    SC_PKCS15_SEARCH_CLASS_SKEY |
-			    SC_PKCS15_SEARCH_CLASS_CERT |
-			    SC_PKCS15_SEARCH_CLASS_DATA |
-			    SC_PKCS15_SEARCH_CLASS_AUTH))) {
-		LOG_FUNC_RETURN(p15card->card->ctx, SC_ERROR_INVALID_ARGUMENTS);
-	}
-
-	if (class_mask & SC_PKCS15_SEARCH_CLASS_PRKEY)
-		df_mask |= (1 << SC_PKCS15_PRKDF);
-	if (class_mask & SC_PKCS15_SEARCH_CLASS_PUBKEY)
-		df_mask |= (1 << SC_PKCS15_PUKDF) | (1 << SC_PKCS15_PUKDF_TRUSTED);
-	if (class_mask & SC_PKCS15_SEARCH_CLASS_CERT)
-		df_mask |= (1 << SC_PKCS15_CDF) | (1 << SC_PKCS15_CDF_TRUSTED) | (1 << SC_PKCS15_CDF_USEFUL);
-	if (class_mask & SC_PKCS15_SEARCH_CLASS_DATA)
-		df_mask |= (1 << SC_PKCS15_DODF);
-	if (class_mask & SC_PKCS15_SEARCH_CLASS_AUTH)
-		df_mask |= (1 << SC_PKCS15_AODF);
-	if (class_mask & SC_PKCS15_SEARCH_CLASS_SKEY)
-		df_mask |= (1 << SC_PKCS15_SKDF);
-
-	/* Make sure all the DFs we want to search have been
-	 * enumerated. */
-	for (df = p15card->df_list; df != NULL; df = df->next) {
-		if (!(df_mask & (1 << df->type)))   {
-			continue;
-		}
-		if (df->enumerated)
-			continue;
-		/* Enumerate the DF's, so p15card->obj_list is
-		 * populated. */
-		r = sc_pkcs15_parse_df(p15card, df);
-	}
-
-	/* And now loop over all objects */
-	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
-		/* Check object type */
-		if (!(class_mask & SC_PKCS15_TYPE_TO_CLASS(obj->type)))
-			continue;
-		if (type != 0
-		 && obj->type != type
-		 && (obj->type & SC_PKCS15_TYPE_CLASS_MASK) != type)
-			continue;
-
-		/* Potential candidate, apply search function */
-		if (func != NULL && func(obj, func_arg) <= 0)
-			continue;
-		/* Okay, we have a match. */
-		match_count++;
-		if (!ret || ret_size <= 0)
-			continue;
-		ret[match_count-1] = obj;
-		if (ret_size <= match_count)
-			break;
-	}
-
-	return match_count;
-}
-
 int sc_pkcs15_get_objects(struct sc_pkcs15_card *p15card, unsigned int type,
 			  struct sc_pkcs15_object **ret, size_t ret_size)
 {
 	return sc_pkcs15_get_objects_cond(p15card, type, NULL, NULL, ret, ret_size);
 }
 
-static int compare_obj_id(struct sc_pkcs15_object *obj, const sc_pkcs15_id_t *id)
+static const sc_pkcs15_id_t *obj_id(const struct sc_pkcs15_object *obj)
 {
-	void *data = obj->data;
+	const void *data = obj->data;
 
 	switch (obj->type) {
 	case SC_PKCS15_TYPE_CERT_X509:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_cert_info *) data)->id, id);
+		return &((const struct sc_pkcs15_cert_info *) data)->id;
 	case SC_PKCS15_TYPE_PRKEY_RSA:
 	case SC_PKCS15_TYPE_PRKEY_DSA:
 	case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
 	case SC_PKCS15_TYPE_PRKEY_EC:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_prkey_info *) data)->id, id);
+		return &((const struct sc_pkcs15_prkey_info *) data)->id;
 	case SC_PKCS15_TYPE_PUBKEY_RSA:
 	case SC_PKCS15_TYPE_PUBKEY_DSA:
 	case SC_PKCS15_TYPE_PUBKEY_GOSTR3410:
 	case SC_PKCS15_TYPE_PUBKEY_EC:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_pubkey_info *) data)->id, id);
+		return &((const struct sc_pkcs15_pubkey_info *) data)->id;
+	case SC_PKCS15_TYPE_SKEY_GENERIC:
 	case SC_PKCS15_TYPE_SKEY_DES:
 	case SC_PKCS15_TYPE_SKEY_2DES:
 	case SC_PKCS15_TYPE_SKEY_3DES:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_skey_info *) data)->id, id);
+		return &((const struct sc_pkcs15_skey_info *) data)->id;
 	case SC_PKCS15_TYPE_AUTH_PIN:
 	case SC_PKCS15_TYPE_AUTH_BIO:
 	case SC_PKCS15_TYPE_AUTH_AUTHKEY:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_auth_info *) data)->auth_id, id);
+		return &((const struct sc_pkcs15_auth_info *) data)->auth_id;
 	case SC_PKCS15_TYPE_DATA_OBJECT:
-		return sc_pkcs15_compare_id(&((struct sc_pkcs15_data_info *) data)->id, id);
+		return &((const struct sc_pkcs15_data_info *) data)->id;
 	}
-	return 0;
+	return NULL;
+}
+
+static int compare_obj_id(struct sc_pkcs15_object *obj, const sc_pkcs15_id_t *id)
+{
+	const sc_pkcs15_id_t *oid = obj_id(obj);
+
+	return oid != NULL && sc_pkcs15_compare_id(oid, id);
 }
 
 static int sc_obj_app_oid(struct sc_pkcs15_object *obj, const struct sc_object_id *app_oid)
@@ -1405,29 +1652,36 @@ static int compare_obj_reference(sc_pkcs15_object_t *obj, int value)
 	return reference == value;
 }
 
-static int compare_obj_path(sc_pkcs15_object_t *obj, const sc_path_t *path)
+static const sc_path_t *obj_path(const struct sc_pkcs15_object *obj)
 {
-	void *data = obj->data;
+	const void *data = obj->data;
 
 	switch (obj->type) {
 	case SC_PKCS15_TYPE_CERT_X509:
-		return sc_compare_path(&((struct sc_pkcs15_cert_info *) data)->path, path);
+		return &((const struct sc_pkcs15_cert_info *) data)->path;
 	case SC_PKCS15_TYPE_PRKEY_RSA:
 	case SC_PKCS15_TYPE_PRKEY_DSA:
 	case SC_PKCS15_TYPE_PRKEY_GOSTR3410:
 	case SC_PKCS15_TYPE_PRKEY_EC:
-		return sc_compare_path(&((struct sc_pkcs15_prkey_info *) data)->path, path);
+		return &((const struct sc_pkcs15_prkey_info *) data)->path;
 	case SC_PKCS15_TYPE_PUBKEY_RSA:
 	case SC_PKCS15_TYPE_PUBKEY_DSA:
 	case SC_PKCS15_TYPE_PUBKEY_GOSTR3410:
 	case SC_PKCS15_TYPE_PUBKEY_EC:
-		return sc_compare_path(&((struct sc_pkcs15_pubkey_info *) data)->path, path);
+		return &((const struct sc_pkcs15_pubkey_info *) data)->path;
 	case SC_PKCS15_TYPE_AUTH_PIN:
-		return sc_compare_path(&((struct sc_pkcs15_auth_info *) data)->path, path);
+		return &((const struct sc_pkcs15_auth_info *) data)->path;
 	case SC_PKCS15_TYPE_DATA_OBJECT:
-		return sc_compare_path(&((struct sc_pkcs15_data_info *) data)->path, path);
+		return &((const struct sc_pkcs15_data_info *) data)->path;
 	}
-	return 0;
+	return NULL;
+}
+
+static int compare_obj_path(sc_pkcs15_object_t *obj, const sc_path_t *path)
+{
+	const sc_path_t *opath = obj_path(obj);
+
+	return opath != NULL && sc_compare_path(opath, path);
 }
 
 static int compare_obj_data_name(sc_pkcs15_object_t *obj, const char *app_label, const char *label)
@@ -1457,6 +1711,8 @@ static int compare_obj_key(struct sc_pkcs15_object *obj, void *arg)
 		return 0;
 	if (sk->path && !compare_obj_path(obj, sk->path))
 		return 0;
+	if (sk->auth_id && !sc_pkcs15_compare_id(&obj->auth_id, sk->auth_id))
+		return 0;
 	if (
 		sk->app_label && sk->label &&
 		!compare_obj_data_name(obj, sk->app_label, sk->label)
@@ -1467,6 +1723,331 @@ static int compare_obj_key(struct sc_pkcs15_object *obj, void *arg)
 	return 1;
 }
 
+/*
+ * Objects are indexed by class and ID (the auth_id for authentication
+ * objects) and by path, with the keys compare_obj_id() and
+ * compare_obj_path() use. The chains keep the order of obj_list, so a
+ * search through the index finds the same objects a walk of the list
+ * does.
+ */
+#define SC_PKCS15_OBJ_INDEX_SIZE	256
+
+struct sc_pkcs15_obj_index_node {
+	struct sc_pkcs15_object *obj;
+	struct sc_pkcs15_obj_index_node *next;
+};
+
+struct sc_pkcs15_obj_index {
+	struct sc_pkcs15_obj_index_node *by_id[SC_PKCS15_OBJ_INDEX_SIZE];
+	struct sc_pkcs15_obj_index_node *by_path[SC_PKCS15_OBJ_INDEX_SIZE];
+};
+
+static unsigned int index_hash(unsigned int seed, const u8 *value, size_t len)
+{
+	unsigned int h = 2166136261U ^ seed;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ value[i]) * 16777619U;
+	return h % SC_PKCS15_OBJ_INDEX_SIZE;
+}
+
+static unsigned int id_hash(unsigned int class_mask, const sc_pkcs15_id_t *id)
+{
+	return index_hash(class_mask, id->value, id->len);
+}
+
+static unsigned int path_hash(const sc_path_t *path)
+{
+	return index_hash(0, path->value, path->len);
+}
+
+static int index_append(struct sc_pkcs15_obj_index_node **chain, struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_obj_index_node *node;
+
+	node = calloc(1, sizeof(*node));
+	if (node == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	node->obj = obj;
+	while (*chain != NULL)
+		chain = &(*chain)->next;
+	*chain = node;
+	return SC_SUCCESS;
+}
+
+static int index_unlink(struct sc_pkcs15_obj_index_node **chain, struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_obj_index_node *node;
+
+	for (; *chain != NULL; chain = &(*chain)->next) {
+		if ((*chain)->obj == obj) {
+			node = *chain;
+			*chain = node->next;
+			free(node);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int index_add_object(struct sc_pkcs15_obj_index *index, struct sc_pkcs15_object *obj)
+{
+	const sc_pkcs15_id_t *id = obj_id(obj);
+	const sc_path_t *path = obj_path(obj);
+	int r = SC_SUCCESS;
+
+	if (id != NULL)
+		r = index_append(&index->by_id[id_hash(SC_PKCS15_TYPE_TO_CLASS(obj->type), id)], obj);
+	if (r == SC_SUCCESS && path != NULL)
+		r = index_append(&index->by_path[path_hash(path)], obj);
+	return r;
+}
+
+/* Fails if the object is not where its keys say, i.e. they were changed */
+static int index_remove_object(struct sc_pkcs15_obj_index *index, struct sc_pkcs15_object *obj)
+{
+	const sc_pkcs15_id_t *id = obj_id(obj);
+	const sc_path_t *path = obj_path(obj);
+	int found = 1;
+
+	if (id != NULL)
+		found &= index_unlink(&index->by_id[id_hash(SC_PKCS15_TYPE_TO_CLASS(obj->type), id)], obj);
+	if (path != NULL)
+		found &= index_unlink(&index->by_path[path_hash(path)], obj);
+	return found ? SC_SUCCESS : SC_ERROR_OBJECT_NOT_FOUND;
+}
+
+void sc_pkcs15_drop_object_index(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_obj_index *index = p15card->obj_index;
+	struct sc_pkcs15_obj_index_node *node, *next;
+	size_t i;
+
+	if (index == NULL)
+		return;
+	for (i = 0; i < SC_PKCS15_OBJ_INDEX_SIZE; i++) {
+		for (node = index->by_id[i]; node != NULL; node = next) {
+			next = node->next;
+			free(node);
+		}
+		for (node = index->by_path[i]; node != NULL; node = next) {
+			next = node->next;
+			free(node);
+		}
+	}
+	free(index);
+	p15card->obj_index = NULL;
+}
+
+static struct sc_pkcs15_obj_index *get_obj_index(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_object *obj;
+
+	if (p15card->obj_index != NULL)
+		return p15card->obj_index;
+
+	p15card->obj_index = calloc(1, sizeof(struct sc_pkcs15_obj_index));
+	if (p15card->obj_index == NULL)
+		return NULL;
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+		if (index_add_object(p15card->obj_index, obj) != SC_SUCCESS) {
+			sc_pkcs15_drop_object_index(p15card);
+			return NULL;
+		}
+	}
+	return p15card->obj_index;
+}
+
+static int match_object(struct sc_pkcs15_object *obj,
+			unsigned int class_mask, unsigned int type,
+			int (*func)(sc_pkcs15_object_t *, void *), void *func_arg)
+{
+	/* Check object type */
+	if (!(class_mask & SC_PKCS15_TYPE_TO_CLASS(obj->type)))
+		return 0;
+	if (type != 0
+	 && obj->type != type
+	 && (obj->type & SC_PKCS15_TYPE_CLASS_MASK) != type)
+		return 0;
+
+	/* Potential candidate, apply search function */
+	return func == NULL || func(obj, func_arg) > 0;
+}
+
+/* Checks the class mask of a search, and makes sure all the DFs it
+ * searches have been enumerated */
+static int prepare_search(struct sc_pkcs15_card *p15card, unsigned int *class_mask,
+			unsigned int type)
+{
+	sc_pkcs15_df_t	*df;
+	unsigned int	df_mask = 0;
+
+	if (type)
+		*class_mask |= SC_PKCS15_TYPE_TO_CLASS(type);
+
+	/* Make sure the class mask we have makes sense */
+	if (*class_mask == 0
+	 || (*class_mask & ~(SC_PKCS15_SEARCH_CLASS_PRKEY |
+			    SC_PKCS15_SEARCH_CLASS_PUBKEY |
+			    SC_PKCS15_SEARCH_CLASS_SKEY |
+			    SC_PKCS15_SEARCH_CLASS_CERT |
+			    SC_PKCS15_SEARCH_CLASS_DATA |
+			    SC_PKCS15_SEARCH_CLASS_AUTH))) {
+		LOG_FUNC_RETURN(p15card->card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+	}
+
+	if (*class_mask & SC_PKCS15_SEARCH_CLASS_PRKEY)
+		df_mask |= (1 << SC_PKCS15_PRKDF);
+	if (*class_mask & SC_PKCS15_SEARCH_CLASS_PUBKEY)
+		df_mask |= (1 << SC_PKCS15_PUKDF) | (1 << SC_PKCS15_PUKDF_TRUSTED);
+	if (*class_mask & SC_PKCS15_SEARCH_CLASS_CERT)
+		df_mask |= (1 << SC_PKCS15_CDF) | (1 << SC_PKCS15_CDF_TRUSTED) | (1 << SC_PKCS15_CDF_USEFUL);
+	if (*class_mask & SC_PKCS15_SEARCH_CLASS_DATA)
+		df_mask |= (1 << SC_PKCS15_DODF);
+	if (*class_mask & SC_PKCS15_SEARCH_CLASS_AUTH)
+		df_mask |= (1 << SC_PKCS15_AODF);
+	if (*class_mask & SC_PKCS15_SEARCH_CLASS_SKEY)
+		df_mask |= (1 << SC_PKCS15_SKDF);
+
+	/* Make sure all the DFs we want to search have been
+	 * enumerated. */
+	for (df = p15card->df_list; df != NULL; df = df->next) {
+		if (!(df_mask & (1 << df->type)))   {
+			continue;
+		}
+		if (df->enumerated)
+			continue;
+		/* Enumerate the DF's, so p15card->obj_list is
+		 * populated. */
+		sc_pkcs15_parse_df(p15card, df);
+	}
+	return SC_SUCCESS;
+}
+
+/* The index chain that holds all the objects a search for an ID or a path
+ * can find, or NULL if the whole list has to be walked */
+static struct sc_pkcs15_obj_index_node *
+index_chain(struct sc_pkcs15_card *p15card, unsigned int class_mask,
+		const struct sc_pkcs15_search_key *sk, int *indexed)
+{
+	struct sc_pkcs15_obj_index *index;
+
+	*indexed = 0;
+	if (!sk->id && !sk->path)
+		return NULL;
+	index = get_obj_index(p15card);
+	if (index == NULL)
+		return NULL;
+
+	*indexed = 1;
+	/* the ID chains are per class */
+	if (sk->id != NULL && (class_mask & (class_mask - 1)) == 0)
+		return index->by_id[id_hash(class_mask, sk->id)];
+	if (sk->path != NULL)
+		return index->by_path[path_hash(sk->path)];
+	*indexed = 0;
+	return NULL;
+}
+
+static int
+__sc_pkcs15_search_objects(sc_pkcs15_card_t *p15card,
+			unsigned int class_mask, unsigned int type,
+			int (*func)(sc_pkcs15_object_t *, void *),
+			void *func_arg,
+			sc_pkcs15_object_t **ret, size_t ret_size)
+{
+	sc_pkcs15_object_t *obj;
+	size_t		match_count = 0;
+	int		r;
+
+	r = prepare_search(p15card, &class_mask, type);
+	if (r < 0)
+		return r;
+
+	/* Searches for an ID or a path only need to look at the objects
+	 * with that key */
+	if (func == compare_obj_key) {
+		struct sc_pkcs15_obj_index_node *node;
+		int indexed;
+
+		node = index_chain(p15card, class_mask,
+				(const struct sc_pkcs15_search_key *) func_arg, &indexed);
+		if (indexed) {
+			for (; node != NULL; node = node->next) {
+				if (!match_object(node->obj, class_mask, type, func, func_arg))
+					continue;
+				match_count++;
+				if (!ret || ret_size <= 0)
+					continue;
+				ret[match_count-1] = node->obj;
+				if (ret_size <= match_count)
+					break;
+			}
+			return match_count;
+		}
+	}
+
+	/* And now loop over all objects */
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+		if (!match_object(obj, class_mask, type, func, func_arg))
+			continue;
+		/* Okay, we have a match. */
+		match_count++;
+		if (!ret || ret_size <= 0)
+			continue;
+		ret[match_count-1] = obj;
+		if (ret_size <= match_count)
+			break;
+	}
+
+	return match_count;
+}
+
+int sc_pkcs15_iter_init(struct sc_pkcs15_card *p15card, sc_pkcs15_object_iter_t *it,
+			const sc_pkcs15_search_key_t *sk)
+{
+	int r;
+
+	if (p15card == NULL || it == NULL || sk == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	memset(it, 0, sizeof(*it));
+	it->p15card = p15card;
+	it->key = *sk;
+	r = prepare_search(p15card, &it->key.class_mask, it->key.type);
+	if (r < 0)
+		return r;
+
+	it->node = index_chain(p15card, it->key.class_mask, &it->key, &it->indexed);
+	if (!it->indexed)
+		it->next = p15card->obj_list;
+	return SC_SUCCESS;
+}
+
+struct sc_pkcs15_object *sc_pkcs15_iter_next(sc_pkcs15_object_iter_t *it)
+{
+	struct sc_pkcs15_object *obj;
+
+	/* the next one is taken before the object is returned, so that the
+	 * caller can remove it */
+	if (it->indexed) {
+		while (it->node != NULL) {
+			obj = it->node->obj;
+			it->node = it->node->next;
+			if (match_object(obj, it->key.class_mask, it->key.type, compare_obj_key, &it->key))
+				return obj;
+		}
+		return NULL;
+	}
+	while ((obj = it->next) != NULL) {
+		it->next = obj->next;
+		if (match_object(obj, it->key.class_mask, it->key.type, compare_obj_key, &it->key))
+			return obj;
+	}
+	return NULL;
+}
+
 static int find_by_key(struct sc_pkcs15_card *p15card,
 		       unsigned int type, struct sc_pkcs15_search_key *sk,
 		       struct sc_pkcs15_object **out)
@@ -1736,7 +2317,16 @@ int sc_pkcs15_add_object(struct sc_pkcs15_card *p15card,
 
 	if (!obj)
 		return 0;
+	/* the cached objects of an enumerated DF are out of date now,
+	 * and so may be the public keys read for the old objects */
+	if (obj->df && obj->df->enumerated) {
+		sc_pkcs15_drop_cached_objects(p15card, obj->df);
+		sc_pkcs15_free_pubkey_cache(p15card);
+	}
 	obj->next = obj->prev = NULL;
+	if (p15card->obj_index != NULL
+			&& index_add_object(p15card->obj_index, obj) != SC_SUCCESS)
+		sc_pkcs15_drop_object_index(p15card);
 	if (p15card->obj_list == NULL) {
 		p15card->obj_list = obj;
 		return 0;
@@ -1754,7 +2344,14 @@ void sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card,
 {
 	if (!obj)
 		return;
-	else if (obj->prev == NULL)
+	if (obj->df && obj->df->enumerated) {
+		sc_pkcs15_drop_cached_objects(p15card, obj->df);
+		sc_pkcs15_free_pubkey_cache(p15card);
+	}
+	if (p15card->obj_index != NULL
+			&& index_remove_object(p15card->obj_index, obj) != SC_SUCCESS)
+		sc_pkcs15_drop_object_index(p15card);
+	if (obj->prev == NULL)
 		p15card->obj_list = obj->next;
 	else
 		obj->prev->next = obj->next;
@@ -1767,7 +2364,10 @@ sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card)
 {
 	struct sc_pkcs15_object *cur = NULL, *next = NULL;
 
-	if (!p15card || !p15card->obj_list)
+	if (!p15card)
+		return;
+	sc_pkcs15_drop_object_index(p15card);
+	if (!p15card->obj_list)
 		return;
 	for (cur = p15card->obj_list; cur; cur = next)   {
 		next = cur->next;
@@ -1806,7 +2406,62 @@ void sc_pkcs15_free_object(struct sc_pkcs15_object *obj)
 
 	sc_pkcs15_free_object_content(obj);
 
-	free(obj);
+	/* the arena is freed with the card */
+	if (!obj->in_arena)
+		free(obj);
+}
+
+/*
+ * Objects read from the DFs of a card live as long as the card, so they
+ * are cut from larger blocks that are only freed when all the objects
+ * are, in sc_pkcs15_card_clear() and sc_pkcs15_card_free().
+ * An object takes some 2.7 kB; the blocks start small and double, so
+ * that the many tokens with a few objects do not hold a large block each.
+ */
+#define SC_PKCS15_ARENA_FIRST	4
+#define SC_PKCS15_ARENA_MAX	64
+
+struct sc_pkcs15_arena {
+	struct sc_pkcs15_arena *next;
+	size_t used, size;
+	struct sc_pkcs15_object objects[1];
+};
+
+struct sc_pkcs15_object *sc_pkcs15_new_object(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_arena *arena = p15card->arena;
+	struct sc_pkcs15_object *obj;
+	size_t size;
+
+	if (arena == NULL || arena->used == arena->size) {
+		size = arena == NULL ? SC_PKCS15_ARENA_FIRST : arena->size * 2;
+		if (size > SC_PKCS15_ARENA_MAX)
+			size = SC_PKCS15_ARENA_MAX;
+		/* only the used objects are zeroed */
+		arena = malloc(offsetof(struct sc_pkcs15_arena, objects)
+				+ size * sizeof(struct sc_pkcs15_object));
+		if (arena == NULL)
+			return NULL;
+		arena->next = p15card->arena;
+		arena->used = 0;
+		arena->size = size;
+		p15card->arena = arena;
+	}
+	obj = &arena->objects[arena->used++];
+	memset(obj, 0, sizeof(*obj));
+	obj->in_arena = 1;
+	return obj;
+}
+
+static void sc_pkcs15_free_arena(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_arena *arena, *next;
+
+	for (arena = p15card->arena; arena != NULL; arena = next) {
+		next = arena->next;
+		free(arena);
+	}
+	p15card->arena = NULL;
 }
 
 int sc_pkcs15_add_df(struct sc_pkcs15_card *p15card, unsigned int type, const sc_path_t *path)
@@ -1914,7 +2569,7 @@ int sc_pkcs15_encode_df(sc_context_t *ctx,
 	return 0;
 }
 
-int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
+static int pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		       struct sc_pkcs15_df *df)
 {
 	sc_context_t *ctx = p15card->card->ctx;
@@ -1936,6 +2591,16 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 	if (df->enumerated)
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 
+	if (p15card->opts.use_file_cache) {
+		SC_TRACE_BEGIN(ctx, "file cache", df->type);
+		r = sc_pkcs15_read_cached_objects(p15card, df);
+		SC_TRACE_END(ctx, "file cache", r);
+		if (r == SC_SUCCESS) {
+			df->enumerated = 1;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+	}
+
 	switch (df->type) {
 	case SC_PKCS15_PRKDF:
 		func = sc_pkcs15_decode_prkdf_entry;
@@ -1968,14 +2633,14 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 	p = buf;
 	while (bufsize && *p != 0x00) {
 
-		obj = calloc(1, sizeof(struct sc_pkcs15_object));
+		obj = sc_pkcs15_new_object(p15card);
 		if (obj == NULL) {
 			r = SC_ERROR_OUT_OF_MEMORY;
 			goto ret;
 		}
 		r = func(p15card, obj, &p, &bufsize);
 		if (r) {
-			free(obj);
+			/* the arena takes the object back with the card */
 			if (r == SC_ERROR_ASN1_END_OF_CONTENTS) {
 				r = 0;
 				break;
@@ -1989,7 +2654,6 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		if (r) {
 			if (obj->data)
 				free(obj->data);
-			free(obj);
 			sc_log(ctx, "%s: Error adding object", sc_strerror(r));
 			goto ret;
 		}
@@ -1997,12 +2661,25 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 
 	if (r > 0)
 		r = 0;
+	if (r == 0 && p15card->opts.use_file_cache)
+		sc_pkcs15_cache_objects(p15card, df);
 ret:
 	df->enumerated = 1;
 	free(buf);
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
+		       struct sc_pkcs15_df *df)
+{
+	int r;
+
+	SC_TRACE_BEGIN(p15card->card->ctx, "sc_pkcs15_parse_df", df->type);
+	r = pkcs15_parse_df(p15card, df);
+	SC_TRACE_END(p15card->card->ctx, "sc_pkcs15_parse_df", r);
+	return r;
+}
+
 int sc_pkcs15_add_unusedspace(struct sc_pkcs15_card *p15card,
 		     const sc_path_t *path, const sc_pkcs15_id_t *auth_id)
 {
@@ -2198,6 +2875,43 @@ int sc_pkcs15_parse_unusedspace(const u8 * buf, size_t buflen, struct sc_pkcs15_
 int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 			const sc_path_t *in_path,
 			u8 **buf, size_t *buflen)
+{
+	return sc_pkcs15_read_file_acl(p15card, in_path, buf, buflen, 0);
+}
+
+#define SC_PKCS15_READ_CHUNK	1024
+
+/* Reads a transparent file a chunk at a time, letting p15card->read_yield()
+ * give the card away in between; the file is selected again if it did */
+static int
+read_binary_yielding(struct sc_pkcs15_card *p15card, const sc_path_t *path,
+		size_t offset, u8 *data, size_t len)
+{
+	size_t done = 0, n;
+	int r;
+
+	while (done < len) {
+		n = len - done > SC_PKCS15_READ_CHUNK ? SC_PKCS15_READ_CHUNK : len - done;
+		if (done && p15card->read_yield(p15card, p15card->read_yield_arg)) {
+			r = sc_select_file(p15card->card, path, NULL);
+			if (r < 0)
+				return r;
+		}
+		r = sc_read_binary(p15card->card, offset + done, data + done, n, 0);
+		if (r < 0)
+			return r;
+		done += r;
+		if ((size_t)r < n)
+			break;
+	}
+	return (int)done;
+}
+
+/* With public_only, a file the card driver tells to need a login
+ * for READ is not read, see SC_CARD_CAP_FCI_READ_ACL */
+static int sc_pkcs15_read_file_acl(struct sc_pkcs15_card *p15card,
+			const sc_path_t *in_path,
+			u8 **buf, size_t *buflen, int public_only)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	sc_file_t *file = NULL;
@@ -2211,16 +2925,34 @@ int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 	sc_log(ctx, "path=%s, index=%u, count=%d", sc_print_path(in_path), in_path->index, in_path->count);
 
 	r = -1; /* file state: not in cache */
-	if (p15card->opts.use_file_cache) {
+	if (p15card->prefetched)
+		r = sc_pkcs15_get_prefetched(p15card, in_path, &data, &len);
+	if (r && p15card->opts.use_file_cache) {
+		SC_TRACE_BEGIN(ctx, "file cache", 0);
 		r = sc_pkcs15_read_cached_file(p15card, in_path, &data, &len);
+		SC_TRACE_END(ctx, "file cache", r);
+		/* do not probe again for optional files that are not there */
+		if (r && sc_pkcs15_is_absent_file(p15card, in_path))
+			LOG_TEST_RET(ctx, SC_ERROR_FILE_NOT_FOUND, "File known to be absent");
 	}
 	if (r) {
 		r = sc_lock(p15card->card);
 		LOG_TEST_RET(ctx, r, "sc_lock() failed");
 		r = sc_select_file(p15card->card, in_path, &file);
+		if (r == SC_ERROR_FILE_NOT_FOUND && p15card->opts.use_file_cache)
+			sc_pkcs15_cache_absent_file(p15card, in_path);
 		if (r)
 			goto fail_unlock;
 
+		if (public_only && (p15card->card->caps & SC_CARD_CAP_FCI_READ_ACL) && file)   {
+			const sc_acl_entry_t *acl = sc_file_get_acl_entry(file, SC_AC_OP_READ);
+
+			if (acl && acl->method != SC_AC_NONE)   {
+				r = SC_ERROR_SECURITY_STATUS_NOT_SATISFIED;
+				goto fail_unlock;
+			}
+		}
+
 		/* Handle the case where the ASN.1 Path object specified
 		 * index and length values */
 		if (in_path->count < 0) {
@@ -2247,37 +2979,43 @@ int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 		}
 
 		if (file->ef_structure == SC_FILE_EF_LINEAR_VARIABLE_TLV) {
-			int i;
-			size_t l, record_len;
-			unsigned char *head;
-
-			head = data;
-			for (i=1;  ; i++) {
-				l = len - (head - data);
-				if (l > 256) { l = 256; }
-				r = sc_read_record(p15card->card, i, head, l, SC_RECORD_BY_REC_NR);
-				if (r == SC_ERROR_RECORD_NOT_FOUND)
-					break;
-				if (r < 0) {
-					free(data);
-					goto fail_unlock;
-				}
-				if (r < 2)
+			size_t *lengths, nrecords = len / 2 + 1, i, hlen;
+			unsigned char *head, *p;
+
+			lengths = malloc(nrecords * sizeof(*lengths));
+			if (lengths == NULL) {
+				free(data);
+				r = SC_ERROR_OUT_OF_MEMORY;
+				goto fail_unlock;
+			}
+			r = sc_read_records(p15card->card, 1, data, len, 0, lengths, &nrecords);
+			if (r < 0) {
+				free(lengths);
+				free(data);
+				goto fail_unlock;
+			}
+
+			/* strip the tag and length of each record, whatever follows
+			 * them in the record is kept as before */
+			head = p = data;
+			for (i = 0; i < nrecords; i++) {
+				size_t l = lengths[i];
+
+				/* shorter than its tag and length: the end */
+				if (l < 2 || (p[1] == 0xff && l < 4))
 					break;
-				record_len = head[1];
-				if (record_len != 0xff) {
-					memmove(head,head+2,r-2);
-					head += (r-2);
-				} else {
-					if (r < 4)
-						break;
-					memmove(head,head+4,r-4);
-					head += (r-4);
-				}
+				hlen = p[1] == 0xff ? 4 : 2;
+				memmove(head, p + hlen, l - hlen);
+				head += l - hlen;
+				p += l;
 			}
+			free(lengths);
 			len = head-data;
 		} else {
-			r = sc_read_binary(p15card->card, offset, data, len, 0);
+			if (p15card->read_yield && len > SC_PKCS15_READ_CHUNK)
+				r = read_binary_yielding(p15card, in_path, offset, data, len);
+			else
+				r = sc_read_binary(p15card->card, offset, data, len, 0);
 			if (r < 0) {
 				free(data);
 				goto fail_unlock;
@@ -2375,10 +3113,8 @@ int sc_pkcs15_make_absolute_path(const sc_path_t *parent, sc_path_t *child)
 
 void sc_pkcs15_free_object_content(struct sc_pkcs15_object *obj)
 {
-	if (obj->content.value && obj->content.len)   {
-		sc_mem_clear(obj->content.value, obj->content.len);
-		free(obj->content.value);
-	}
+	if (obj->content.value && obj->content.len)
+		sc_mem_free_secure(obj->content.value, obj->content.len);
 	obj->content.value = NULL;
 	obj->content.len = 0;
 }
@@ -2551,6 +3287,9 @@ sc_pkcs15_get_guid(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_object
 	struct sc_serial_number serialnr;
 	struct sc_pkcs15_id  id;
 	unsigned char guid_bin[SC_PKCS15_MAX_ID_SIZE + SC_MAX_SERIALNR];
+	/* the cache is not part of the value of the object */
+	struct sc_pkcs15_object *cached = (struct sc_pkcs15_object *)obj;
+	size_t len;
 	int rv;
 
 	if (p15card->ops.get_guid)
@@ -2572,6 +3311,13 @@ sc_pkcs15_get_guid(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_object
 	if (rv)
 		return rv;
 
+	/* Neither the serial number nor the hash are needed again, as long
+	 * as the ID of the object did not change */
+	if (obj->guid_cache_id_len && obj->guid_cache_id_len == id.len
+			&& !memcmp(obj->guid_cache_id, id.value, id.len))
+		return sc_pkcs15_serialize_guid(cached->guid_cache, sizeof(obj->guid_cache),
+				flags, out, out_size);
+
 	rv = sc_card_ctl(p15card->card, SC_CARDCTL_GET_SERIALNR, &serialnr);
 	if (rv)
 		return rv;
@@ -2579,16 +3325,22 @@ sc_pkcs15_get_guid(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_object
 	memset(guid_bin, 0, sizeof(guid_bin));
 	memcpy(guid_bin, id.value, id.len);
 	memcpy(guid_bin + id.len, serialnr.value, serialnr.len);
+	len = id.len + serialnr.len;
 
         // If OpenSSL is available (SHA1), then rather use the hash of the data
         // - this also protects against data being too short
 #ifdef ENABLE_OPENSSL
-        SHA1(guid_bin, id.len + serialnr.len, guid_bin);
-        id.len = SHA_DIGEST_LENGTH;
-        serialnr.len = 0;
+        SHA1(guid_bin, len, guid_bin);
+        len = SHA_DIGEST_LENGTH;
 #endif
 
-	return sc_pkcs15_serialize_guid(guid_bin, id.len + serialnr.len, flags, out, out_size);
+	rv = sc_pkcs15_serialize_guid(guid_bin, len, flags, out, out_size);
+	if (rv == SC_SUCCESS && id.len > 0 && id.len <= sizeof(obj->guid_cache_id)) {
+		memcpy(cached->guid_cache, guid_bin, sizeof(cached->guid_cache));
+		memcpy(cached->guid_cache_id, id.value, id.len);
+		cached->guid_cache_id_len = id.len;
+	}
+	return rv;
 }
 
 void sc_pkcs15_free_key_params(struct sc_pkcs15_key_params *params)
@@ -282,6 +282,9 @@ struct sc_pkcs15_enveloped_data {
 	size_t content_len;
 };
 
+/* The image of the file cache, kept by reference by what points into it */
+struct sc_pkcs15_shared_buf;
+
 struct sc_pkcs15_cert {
 	int version;
 	u8 *serial;
@@ -297,6 +300,12 @@ struct sc_pkcs15_cert {
 
 	/* DER encoded raw cert */
 	struct sc_pkcs15_der data;
+
+	/* Set by sc_pkcs15_read_certificate_shared(): serial, issuer,
+	 * subject and data point into one buffer, held by 'shared' if it
+	 * is the image of the file cache, read-only */
+	int in_place;
+	struct sc_pkcs15_shared_buf *shared;
 };
 typedef struct sc_pkcs15_cert sc_pkcs15_cert_t;
 
@@ -512,6 +521,20 @@ struct sc_pkcs15_object {
 
 	/* Used by minidriver and its on-card support */
 	char *guid;
+
+	/* set if the structure is owned by the arena of the card,
+	 * see sc_pkcs15_new_object() */
+	int in_arena;
+
+	/* the GUID derived by sc_pkcs15_get_guid() and the object ID it was
+	 * derived from; guid_cache_id_len is 0 while nothing is cached */
+	u8 guid_cache[16];
+	u8 guid_cache_id[20];
+	size_t guid_cache_id_len;
+
+	/* when the PIN of an authentication object was cached, see
+	 * sc_pkcs15_pincache_add() */
+	unsigned long long pin_cached_us;
 };
 typedef struct sc_pkcs15_object sc_pkcs15_object_t;
 
@@ -590,6 +613,29 @@ struct sc_pkcs15_operations   {
 			char *, size_t);
 };
 
+/* File content read ahead during bind, handed out once by sc_pkcs15_read_file() */
+struct sc_pkcs15_prefetched_file {
+	struct sc_path path;
+	unsigned char *data;
+	size_t len;
+
+	struct sc_pkcs15_prefetched_file *next;
+};
+
+/* The security environment last set for a private key operation, valid
+ * while card->cache.sec_env_serial stays the same */
+struct sc_pkcs15_sec_env_cache {
+	const struct sc_pkcs15_object *obj;	/* the key, NULL if none is set */
+	sc_security_env_t senv;			/* as built before the key file is selected */
+	unsigned int serial;
+};
+
+/* A PIN verified on the card, see sc_pkcs15_pin_still_verified() */
+struct sc_pkcs15_pin_status {
+	const struct sc_pkcs15_object *pin_obj;	/* NULL if the entry is free */
+	unsigned int serial;			/* card->cache.security_serial then */
+};
+
 typedef struct sc_pkcs15_card {
 	sc_card_t *card;
 	unsigned int flags;
@@ -604,12 +650,35 @@ typedef struct sc_pkcs15_card {
 	sc_pkcs15_tokeninfo_t *tokeninfo;
 	sc_pkcs15_unusedspace_t *unusedspace_list;
 	int unusedspace_read;
+	struct sc_pkcs15_prefetched_file *prefetched;
+	/* the cache file of the token, see pkcs15-cache.c */
+	struct sc_pkcs15_cache_db *cache_db;
+	/* hash index of obj_list, built on the first search */
+	struct sc_pkcs15_obj_index *obj_index;
+	/* storage of the objects read from the DFs */
+	struct sc_pkcs15_arena *arena;
+	/* encoded public keys read from the card, see sc_pkcs15_read_pubkey() */
+	struct sc_pkcs15_cached_pubkey *pubkey_cache;
+	struct sc_memcache_account pubkey_account;
+	/* security environment last set, reused while the card keeps it */
+	struct sc_pkcs15_sec_env_cache *sec_env_cache;
+	/* the card is kept locked, see sc_pkcs15_hold_security_env() */
+	int sec_env_held;
+	/* PINs verified since the card was last reset or logged out */
+	struct sc_pkcs15_pin_status pin_status[SC_PKCS15_MAX_PINS];
+	/* if set, called between the chunks of a long file read: returns 1
+	 * if the card was given to someone else meanwhile */
+	int (*read_yield)(struct sc_pkcs15_card *p15card, void *arg);
+	void *read_yield_arg;
 
 	struct sc_pkcs15_card_opts {
 		int use_file_cache;
+		int use_prefetch;
 		int use_pin_cache;
 		int pin_cache_counter;
+		int pin_cache_timeout;
 		int pin_cache_ignore_user_consent;
+		int reuse_sec_env;
 	} opts;
 
 	unsigned int magic;
@@ -658,6 +727,14 @@ int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 		       unsigned long flags,
 		       const u8 *in, size_t inlen, u8 *out, size_t outlen);
 
+/* with a secret key of the card, no padding */
+int sc_pkcs15_encrypt_sym(struct sc_pkcs15_card *p15card,
+		const struct sc_pkcs15_object *skey_obj,
+		const u8 *in, size_t inlen, u8 *out, size_t outlen);
+int sc_pkcs15_decrypt_sym(struct sc_pkcs15_card *p15card,
+		const struct sc_pkcs15_object *skey_obj,
+		const u8 *in, size_t inlen, u8 *out, size_t outlen);
+
 int sc_pkcs15_derive(struct sc_pkcs15_card *p15card,
 		       const struct sc_pkcs15_object *prkey_obj,
 		       unsigned long flags,
@@ -667,6 +744,9 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 				const struct sc_pkcs15_object *prkey_obj,
 				unsigned long alg_flags, const u8 *in,
 				size_t inlen, u8 *out, size_t outlen);
+/* While held, the card stays locked, so that the security environment
+ * set for a key can be used by the following operations with it */
+int sc_pkcs15_hold_security_env(struct sc_pkcs15_card *p15card, int hold);
 
 int sc_pkcs15_read_pubkey(struct sc_pkcs15_card *,
 		const struct sc_pkcs15_object *, struct sc_pkcs15_pubkey **);
@@ -723,6 +803,15 @@ void sc_pkcs15_free_data_object(struct sc_pkcs15_data *data_object);
 int sc_pkcs15_read_certificate(struct sc_pkcs15_card *card,
 			       const struct sc_pkcs15_cert_info *info,
 			       struct sc_pkcs15_cert **cert);
+int sc_pkcs15_read_certificate_shared(struct sc_pkcs15_card *card,
+			       const struct sc_pkcs15_cert_info *info,
+			       struct sc_pkcs15_cert **cert);
+int sc_pkcs15_read_certificate_data(struct sc_pkcs15_card *card,
+			       const struct sc_pkcs15_cert_info *info,
+			       struct sc_pkcs15_der *der);
+int sc_pkcs15_parse_certificate(struct sc_context *ctx,
+			       struct sc_pkcs15_der *der,
+			       struct sc_pkcs15_cert **cert);
 void sc_pkcs15_free_certificate(struct sc_pkcs15_cert *cert);
 int sc_pkcs15_find_cert_by_id(struct sc_pkcs15_card *card,
 			      const struct sc_pkcs15_id *id,
@@ -781,6 +870,9 @@ int sc_pkcs15_find_pin_by_flags(struct sc_pkcs15_card *p15card,
 
 void sc_pkcs15_pincache_add(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
 			const u8 *, size_t);
+int sc_pkcs15_pin_still_verified(struct sc_pkcs15_card *p15card,
+			 const struct sc_pkcs15_object *pin_obj,
+			 const unsigned char *pincode, size_t pinlen);
 int sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card,
 			const struct sc_pkcs15_object *obj);
 void sc_pkcs15_pincache_clear(struct sc_pkcs15_card *p15card);
@@ -871,6 +963,9 @@ void sc_pkcs15_free_cert_info(sc_pkcs15_cert_info_t *cert);
 void sc_pkcs15_free_data_info(sc_pkcs15_data_info_t *data);
 void sc_pkcs15_free_auth_info(sc_pkcs15_auth_info_t *auth_info);
 void sc_pkcs15_free_object(struct sc_pkcs15_object *obj);
+/* A zeroed object that is freed with the objects of the card, at the
+ * latest. sc_pkcs15_free_object() only frees what it refers to. */
+struct sc_pkcs15_object *sc_pkcs15_new_object(struct sc_pkcs15_card *p15card);
 
 /* Generic file i/o */
 int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
@@ -884,6 +979,44 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+void sc_pkcs15_free_cache(struct sc_pkcs15_card *p15card);
+int sc_pkcs15_read_cached_file_shared(struct sc_pkcs15_card *p15card,
+			 const struct sc_path *path, const u8 **data, size_t *len,
+			 struct sc_pkcs15_shared_buf **image);
+void sc_pkcs15_shared_buf_release(struct sc_pkcs15_shared_buf *buf);
+int sc_pkcs15_read_cached_objects(struct sc_pkcs15_card *p15card,
+			 struct sc_pkcs15_df *df);
+int sc_pkcs15_cache_objects(struct sc_pkcs15_card *p15card,
+			 struct sc_pkcs15_df *df);
+void sc_pkcs15_drop_cached_objects(struct sc_pkcs15_card *p15card,
+			 struct sc_pkcs15_df *df);
+void sc_pkcs15_drop_cached_file(struct sc_pkcs15_card *p15card,
+			 const struct sc_path *path);
+void sc_pkcs15_remove_cache(struct sc_pkcs15_card *p15card);
+/* EF(ODF) and EF(TokenInfo) cached per card, for the bind */
+struct sc_pkcs15_bind_cache {
+	struct sc_path odf_path, tokeninfo_path;
+	u8 *odf, *tokeninfo;
+	size_t odf_len, tokeninfo_len;
+	char *last_update;
+};
+int sc_pkcs15_read_bind_cache(struct sc_pkcs15_card *p15card,
+			 struct sc_pkcs15_bind_cache *bc);
+int sc_pkcs15_write_bind_cache(struct sc_pkcs15_card *p15card,
+			 const struct sc_pkcs15_bind_cache *bc);
+void sc_pkcs15_free_bind_cache(struct sc_pkcs15_bind_cache *bc);
+void sc_pkcs15_drop_bind_cache(struct sc_pkcs15_card *p15card);
+/* Files that were not found on the card, see sc_pkcs15_read_file() */
+int sc_pkcs15_is_absent_file(struct sc_pkcs15_card *p15card,
+			 const struct sc_path *path);
+void sc_pkcs15_cache_absent_file(struct sc_pkcs15_card *p15card,
+			 const struct sc_path *path);
+void sc_pkcs15_forget_absent_file(struct sc_pkcs15_card *p15card,
+			 const struct sc_path *path);
+
+/* To be called after changing the ID or path of an object in obj_list */
+void sc_pkcs15_drop_object_index(struct sc_pkcs15_card *p15card);
+void sc_pkcs15_free_pubkey_cache(struct sc_pkcs15_card *p15card);
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
@@ -942,11 +1075,34 @@ typedef struct sc_pkcs15_search_key {
 	int			reference;
 	const char *		app_label;
 	const char *		label;
+	/* the authentication object that protects the objects */
+	const sc_pkcs15_id_t *	auth_id;
 } sc_pkcs15_search_key_t;
 
 int sc_pkcs15_search_objects(struct sc_pkcs15_card *, sc_pkcs15_search_key_t *,
 			struct sc_pkcs15_object **, size_t);
 
+/* Walks the objects that match a search key, in the order of the object
+ * list and with no bound on their number. sc_pkcs15_iter_init() parses the
+ * DFs of the classes searched, so the walk itself reads nothing from the
+ * card; a key with an ID or a path only walks the objects indexed under it.
+ * The key is copied, what it points to is not and has to stay valid until
+ * the end of the walk. The object sc_pkcs15_iter_next() returned last may
+ * be removed from the card, no other object may be removed meanwhile. */
+struct sc_pkcs15_obj_index_node;
+
+typedef struct sc_pkcs15_object_iter {
+	struct sc_pkcs15_card *	p15card;
+	sc_pkcs15_search_key_t	key;
+	int			indexed;
+	struct sc_pkcs15_object *next;
+	struct sc_pkcs15_obj_index_node *node;
+} sc_pkcs15_object_iter_t;
+
+int sc_pkcs15_iter_init(struct sc_pkcs15_card *, sc_pkcs15_object_iter_t *,
+			const sc_pkcs15_search_key_t *);
+struct sc_pkcs15_object *sc_pkcs15_iter_next(sc_pkcs15_object_iter_t *);
+
 /* This structure is passed to the new sc_pkcs15emu_*_init functions */
 typedef struct sc_pkcs15emu_opt {
 	scconf_block *blk;
@@ -957,6 +1113,11 @@ typedef struct sc_pkcs15emu_opt {
 
 extern int sc_pkcs15_bind_synthetic(struct sc_pkcs15_card *);
 extern int sc_pkcs15_is_emulation_only(sc_card_t *);
+/* What bound the card with this ATR the last time: the name of a builtin
+ * emulator, or SC_PKCS15_EMU_NONE for the PKCS#15 application */
+#define SC_PKCS15_EMU_NONE	"-"
+extern int sc_pkcs15_get_cached_emulator(sc_card_t *, char *, size_t);
+extern void sc_pkcs15_set_cached_emulator(sc_card_t *, const char *);
 
 int sc_pkcs15emu_object_add(struct sc_pkcs15_card *, unsigned int,
 			const struct sc_pkcs15_object *, const void *);
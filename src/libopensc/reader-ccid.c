@@ -0,0 +1,1054 @@
+/*
+ * reader-ccid.c: Reader driver for USB CCID readers, used without pcscd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef ENABLE_CCID	/* empty file without the ccid reader */
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <libusb.h>
+
+#include "internal.h"
+#include "internal-winscard.h"
+#include "part10.h"
+
+/*
+ * The driver talks to the bulk endpoints of the USB CCID readers itself,
+ * for hosts where OpenSC is the only user of the readers. Only the first
+ * slot of a reader is used.
+ *
+ * Readers exchanging short or extended APDUs are given the APDUs as they
+ * are. With readers exchanging TPDUs the driver runs the T=1 protocol; T=0
+ * needs a reader exchanging APDUs.
+ *
+ * In exclusive mode the interface of a reader is claimed from its
+ * detection on, else only while the card is locked or the reader is used,
+ * so that other programs may use the reader in between.
+ */
+#define CCID_CLASS			0x0B
+#define CCID_DESC_TYPE			0x21
+#define CCID_DESC_LEN			54
+
+#define CCID_HEADER_LEN			10
+#define CCID_MAX_MESSAGE		(CCID_HEADER_LEN + SC_MAX_EXT_APDU_BUFFER_SIZE)
+
+#define PC_TO_RDR_SETPARAMETERS		0x61
+#define PC_TO_RDR_ICCPOWERON		0x62
+#define PC_TO_RDR_ICCPOWEROFF		0x63
+#define PC_TO_RDR_GETSLOTSTATUS		0x65
+#define PC_TO_RDR_SECURE		0x69
+#define PC_TO_RDR_XFRBLOCK		0x6F
+#define RDR_TO_PC_DATABLOCK		0x80
+#define RDR_TO_PC_SLOTSTATUS		0x81
+#define RDR_TO_PC_PARAMETERS		0x82
+#define RDR_TO_PC_NOTIFYSLOTCHANGE	0x50
+
+/* bStatus of the replies */
+#define CCID_ICC_MASK			0x03
+#define CCID_ICC_ABSENT			0x02
+#define CCID_CMD_MASK			0xC0
+#define CCID_CMD_FAILED			0x40
+#define CCID_CMD_TIME_EXTENSION		0x80
+
+/* bError of failed commands */
+#define CCID_ERR_ICC_MUTE		0xFE
+#define CCID_ERR_PIN_TIMEOUT		0xF0
+#define CCID_ERR_PIN_CANCELLED		0xEF
+
+/* dwFeatures */
+#define CCID_FEAT_AUTO_PARAMS		0x00000002
+#define CCID_FEAT_AUTO_PPS		0x000000C0
+#define CCID_FEAT_AUTO_IFSD		0x00000400
+#define CCID_FEAT_LEVEL_MASK		0x00070000
+#define CCID_FEAT_LEVEL_TPDU		0x00010000
+#define CCID_FEAT_LEVEL_SHORT		0x00020000
+#define CCID_FEAT_LEVEL_EXTENDED	0x00040000
+
+/* bPINSupport */
+#define CCID_PIN_VERIFY			0x01
+#define CCID_PIN_MODIFY			0x02
+
+/* T=1 blocks */
+#define T1_MAX_INF			254
+#define T1_MAX_BLOCK			(T1_MAX_INF + 4)
+#define T1_I_NS				0x40
+#define T1_I_MORE			0x20
+#define T1_R_BLOCK			0x80
+#define T1_R_ERROR			0x01
+#define T1_S_BLOCK			0xC0
+#define T1_S_RESPONSE			0x20
+#define T1_S_IFS			0x01
+#define T1_S_ABORT			0x02
+#define T1_S_WTX			0x03
+#define T1_RETRIES			3
+#define T1_IS_R(pcb)			(((pcb) & 0xC0) == T1_R_BLOCK)
+#define T1_IS_S(pcb)			(((pcb) & 0xC0) == T1_S_BLOCK)
+
+#define CCID_DEFAULT_TIMEOUT		60
+
+#define GET_PRIV_DATA(r) ((struct ccid_private_data *) (r)->drv_data)
+
+struct ccid_global_private_data {
+	libusb_context *usb;
+	int exclusive;
+	unsigned int timeout;		/* of a USB transfer, in ms */
+};
+
+struct ccid_private_data {
+	struct ccid_global_private_data *gpriv;
+	libusb_device_handle *handle;
+	int interface;
+	unsigned char ep_in, ep_out, ep_intr;
+	unsigned long features;
+	size_t max_message;
+	unsigned int pin_support;
+	unsigned int claimed;		/* the interface is claimed that often */
+	int absent_seen;		/* the card was missing since the last connect */
+	u8 seq;
+	/* T=1 state with readers exchanging TPDUs */
+	u8 ns, nr;
+	size_t ifsc;
+	u8 buf[CCID_MAX_MESSAGE];
+};
+
+/* What the driver needs of the ATR */
+struct ccid_atr {
+	int inverse;
+	unsigned int protocols;		/* SC_PROTO_T0 | SC_PROTO_T1 */
+	int ta1, tc1, tc2;		/* -1 if absent */
+	int t1_ifsc, t1_bwi_cwi, t1_crc;
+};
+
+static struct sc_reader_operations ccid_ops;
+
+static struct sc_reader_driver ccid_drv = {
+	"CCID reader",
+	"ccid",
+	&ccid_ops,
+	0, 0, NULL
+};
+
+static void ccid_put_u32(u8 *p, unsigned long v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+}
+
+static unsigned long ccid_get_u32(const u8 *p)
+{
+	return p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16)
+		| ((unsigned long)p[3] << 24);
+}
+
+static int ccid_usb_error(sc_context_t *ctx, int r)
+{
+	sc_log(ctx, "libusb: %s", libusb_error_name(r));
+	switch (r) {
+	case LIBUSB_ERROR_NO_DEVICE:
+		return SC_ERROR_READER_DETACHED;
+	case LIBUSB_ERROR_BUSY:
+	case LIBUSB_ERROR_ACCESS:
+		return SC_ERROR_READER_LOCKED;
+	case LIBUSB_ERROR_NO_MEM:
+		return SC_ERROR_OUT_OF_MEMORY;
+	default:
+		return SC_ERROR_TRANSMIT_FAILED;
+	}
+}
+
+static int ccid_claim(sc_reader_t *reader)
+{
+	struct ccid_private_data *priv = GET_PRIV_DATA(reader);
+	int r;
+
+	if (priv->claimed++ > 0)
+		return SC_SUCCESS;
+	r = libusb_claim_interface(priv->handle, priv->interface);
+	if (r != 0) {
+		priv->claimed = 0;
+		return ccid_usb_error(reader->ctx, r);
+	}
+	return SC_SUCCESS;
+}
+
+static void ccid_release_claim(sc_reader_t *reader)
+{
+	struct ccid_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (priv->claimed > 0 && --priv->claimed == 0)
+		libusb_release_interface(priv->handle, priv->interface);
+}
+
+/* Sends a message and returns the data of its reply, which stays in
+ * priv->buf up to the next message */
+static int ccid_command(sc_reader_t *reader, u8 type, u8 p1, u8 p2, u8 p3,
+		const u8 *data, size_t len, const u8 **rdata, size_t *rlen)
+{
+	struct ccid_private_data *priv = GET_PRIV_DATA(reader);
+	unsigned int timeout = priv->gpriv->timeout;
+	size_t got, want;
+	u8 seq = priv->seq++;
+	int r, n;
+
+	if (len + CCID_HEADER_LEN > priv->max_message)
+		return SC_ERROR_WRONG_LENGTH;
+
+	priv->buf[0] = type;
+	ccid_put_u32(priv->buf + 1, len);
+	priv->buf[5] = 0;		/* bSlot */
+	priv->buf[6] = seq;
+	priv->buf[7] = p1;
+	priv->buf[8] = p2;
+	priv->buf[9] = p3;
+	if (len)
+		memcpy(priv->buf + CCID_HEADER_LEN, data, len);
+	r = libusb_bulk_transfer(priv->handle, priv->ep_out, priv->buf,
+			(int) (len + CCID_HEADER_LEN), &n, timeout);
+	if (r != 0)
+		return ccid_usb_error(reader->ctx, r);
+
+	for (;;) {
+		/* a reply may take several transfers */
+		got = 0;
+		want = CCID_HEADER_LEN;
+		while (got < want) {
+			r = libusb_bulk_transfer(priv->handle, priv->ep_in, priv->buf + got,
+					(int) (priv->max_message - got), &n, timeout);
+			if (r != 0)
+				return ccid_usb_error(reader->ctx, r);
+			got += n;
+			if (got >= CCID_HEADER_LEN)
+				want = CCID_HEADER_LEN + ccid_get_u32(priv->buf + 1);
+			if (want > priv->max_message)
+				return SC_ERROR_UNKNOWN_DATA_RECEIVED;
+		}
+		if (priv->buf[6] != seq)
+			/* the reply of an earlier message that timed out */
+			continue;
+		if ((priv->buf[7] & CCID_CMD_MASK) != CCID_CMD_TIME_EXTENSION)
+			break;
+		sc_log(reader->ctx, "%s: time extension", reader->name);
+	}
+
+	if ((priv->buf[7] & CCID_CMD_MASK) == CCID_CMD_FAILED) {
+		sc_log(reader->ctx, "%s: command 0x%02X failed, status 0x%02X error 0x%02X",
+				reader->name, type, priv->buf[7], priv->buf[8]);
+		if ((priv->buf[7] & CCID_ICC_MASK) == CCID_ICC_ABSENT)
+			return SC_ERROR_CARD_REMOVED;
+		switch (priv->buf[8]) {
+		case CCID_ERR_ICC_MUTE:
+			return SC_ERROR_CARD_UNRESPONSIVE;
+		case CCID_ERR_PIN_TIMEOUT:
+			return SC_ERROR_KEYPAD_TIMEOUT;
+		case CCID_ERR_PIN_CANCELLED:
+			return SC_ERROR_KEYPAD_CANCELLED;
+		default:
+			return SC_ERROR_TRANSMIT_FAILED;
+		}
+	}
+
+	if (rdata)
+		*rdata = priv->buf + CCID_HEADER_LEN;
+	if (rlen)
+		*rlen = want - CCID_HEADER_LEN;
+	return SC_SUCCESS;
+}
+
+static void ccid_parse_atr(const u8 *atr, size_t len, struct ccid_atr *out)
+{
+	size_t i = 2;
+	unsigned int y, k, n = 1, proto = 0;
+
+	memset(out, 0, sizeof(*out));
+	out->ta1 = out->tc1 = out->tc2 = out->t1_ifsc = out->t1_bwi_cwi = -1;
+	if (len < 2)
+		return;
+	out->inverse = atr[0] == 0x3F;
+	y = atr[1] >> 4;
+	k = atr[1] & 0x0F;
+
+	/* the interface bytes of level n are given for protocol 'proto' */
+	while (i <= len) {
+		if ((y & 1) && i < len) {
+			if (n == 1)
+				out->ta1 = atr[i];
+			else if (proto == 1 && n > 2 && out->t1_ifsc < 0)
+				out->t1_ifsc = atr[i];
+			i++;
+		}
+		if ((y & 2) && i < len) {
+			if (proto == 1 && n > 2 && out->t1_bwi_cwi < 0)
+				out->t1_bwi_cwi = atr[i];
+			i++;
+		}
+		if ((y & 4) && i < len) {
+			if (n == 1)
+				out->tc1 = atr[i];
+			else if (n == 2)
+				out->tc2 = atr[i];
+			else if (proto == 1 && n > 2)
+				out->t1_crc = atr[i] & 0x01;
+			i++;
+		}
+		if (!(y & 8) || i >= len)
+			break;
+		proto = atr[i] & 0x0F;
+		y = atr[i] >> 4;
+		out->protocols |= proto == 0 ? SC_PROTO_T0 : proto == 1 ? SC_PROTO_T1 : 0;
+		i++;
+		n++;
+	}
+	(void) k;
+	if (!out->protocols)
+		out->protocols = SC_PROTO_T0;
+}
+
+/* Sets the protocol parameters of the card from its ATR, unless the
+ * reader does it itself */
+static int ccid_set_parameters(sc_reader_t *reader, const struct ccid_atr *atr)
+{
+	struct ccid_private_data *priv = GET_PRIV_DATA(reader);
+	u8 params[7];
+	size_t len;
+	int r;
+
+	if (priv->features & CCID_FEAT_AUTO_PARAMS)
+		return SC_SUCCESS;
+
+	/* without PPS by the reader the card stays at the default speed */
+	params[0] = atr->ta1 >= 0 && (priv->features & CCID_FEAT_AUTO_PPS) ? atr->ta1 : 0x11;
+	if (reader->active_protocol == SC_PROTO_T1) {
+		params[1] = 0x10 | (atr->inverse ? 0x02 : 0x00) | (atr->t1_crc ? 0x01 : 0x00);
+		params[2] = atr->tc1 >= 0 ? atr->tc1 : 0x00;
+		params[3] = atr->t1_bwi_cwi >= 0 ? atr->t1_bwi_cwi : 0x4D;
+		params[4] = 0x00;	/* no clock stop */
+		params[5] = atr->t1_ifsc >= 0 ? atr->t1_ifsc : 0x20;
+		params[6] = 0x00;	/* NAD */
+		len = 7;
+	} else {
+		params[1] = atr->inverse ? 0x02 : 0x00;
+		params[2] = atr->tc1 >= 0 ? atr->tc1 : 0x00;
+		params[3] = atr->tc2 >= 0 ? atr->tc2 : 0x0A;
+		params[4] = 0x00;
+		len = 5;
+	}
+	r = ccid_command(reader, PC_TO_RDR_SETPARAMETERS,
+			reader->active_protocol == SC_PROTO_T1 ? 1 : 0, 0, 0,
+			params, len, NULL, NULL);
+	if (r != SC_SUCCESS)
+		sc_log(reader->ctx, "%s: cannot set the protocol parameters", reader->name);
+	return r;
+}
+
+static size_t ccid_t1_build(u8 *block, u8 pcb, const u8 *inf, size_t len)
+{
+	size_t i;
+	u8 lrc = 0;
+
+	block[0] = 0x00;	/* NAD */
+	block[1] = pcb;
+	block[2] = (u8) len;
+	if (len)
+		memcpy(block + 3, inf, len);
+	for (i = 0; i < len + 3; i++)
+		lrc ^= block[i];
+	block[len + 3] = lrc;
+	return len + 4;
+}
+
+/* Sends a T=1 block and checks the block of the reply. SC_ERROR_INVALID_DATA
+ * and SC_ERROR_CARD_UNRESPONSIVE ask for the block to be sent again. */
+static int ccid_t1_xfer(sc_reader_t *reader, const u8 *block, size_t len, u8 bwi,
+		u8 *rpcb, const u8 **inf, size_t *inf_len)
+{
+	const u8 *p;
+	size_t plen, i;
+	u8 lrc = 0;
+	int r;
+
+	r = ccid_command(reader, PC_TO_RDR_XFRBLOCK, bwi, 0, 0, block, len, &p, &plen);
+	if (r != SC_SUCCESS)
+		return r;
+	if (plen < 4 || p[0] != 0x00 || (size_t) p[2] + 4 != plen)
+		return SC_ERROR_INVALID_DATA;
+	for (i = 0; i < plen; i++)
+		lrc ^= p[i];
+	if (lrc != 0)
+		return SC_ERROR_INVALID_DATA;
+	*rpcb = p[1];
+	*inf = p + 3;
+	*inf_len = p[2];
+	return SC_SUCCESS;
+}
+
+/* Exchanges an APDU with T=1 blocks, chained in both directions */
+static int ccid_t1_transceive(sc_reader_t *reader, const u8 *sbuf, size_t slen,
+		u8 *rbuf, size_t *rlen)
+{
+	struct ccid_private_data *priv = GET_PRIV_DATA(reader);
+	u8 iblock[T1_MAX_BLOCK], block[T1_MAX_BLOCK], rpcb, bwi = 0;
+	size_t off = 0, chunk, ilen, blen, rcount = 0, inf_len;
+	const u8 *inf;
+	int retries = T1_RETRIES, sending = 1, r;
+
+	chunk = slen < priv->ifsc ? slen : priv->ifsc;
+	ilen = ccid_t1_build(iblock, (priv->ns ? T1_I_NS : 0) | (chunk < slen ? T1_I_MORE : 0),
+			sbuf, chunk);
+	memcpy(block, iblock, ilen);
+	blen = ilen;
+
+	for (;;) {
+		r = ccid_t1_xfer(reader, block, blen, bwi, &rpcb, &inf, &inf_len);
+		bwi = 0;
+		if (r == SC_ERROR_INVALID_DATA || r == SC_ERROR_CARD_UNRESPONSIVE) {
+			if (retries-- == 0)
+				return SC_ERROR_TRANSMIT_FAILED;
+			blen = ccid_t1_build(block, T1_R_BLOCK | (priv->nr << 4) | T1_R_ERROR, NULL, 0);
+			continue;
+		}
+		if (r != SC_SUCCESS)
+			return r;
+
+		if (T1_IS_S(rpcb)) {
+			switch (rpcb & 0x1F) {
+			case T1_S_WTX:
+				if (inf_len != 1)
+					return SC_ERROR_TRANSMIT_FAILED;
+				bwi = inf[0];
+				break;
+			case T1_S_IFS:
+				if (inf_len != 1 || inf[0] == 0 || inf[0] == 0xFF)
+					return SC_ERROR_TRANSMIT_FAILED;
+				priv->ifsc = inf[0];
+				break;
+			default:
+				sc_log(reader->ctx, "%s: T=1 S-block 0x%02X", reader->name, rpcb);
+				return SC_ERROR_TRANSMIT_FAILED;
+			}
+			blen = ccid_t1_build(block, rpcb | T1_S_RESPONSE, inf, inf_len);
+			continue;
+		}
+		retries = T1_RETRIES;
+
+		if (T1_IS_R(rpcb)) {
+			if (sending && off + chunk < slen && ((rpcb >> 4) & 1) != priv->ns) {
+				/* the chained block was taken, send the next one */
+				priv->ns ^= 1;
+				off += chunk;
+				chunk = slen - off < priv->ifsc ? slen - off : priv->ifsc;
+				ilen = ccid_t1_build(iblock, (priv->ns ? T1_I_NS : 0)
+						| (off + chunk < slen ? T1_I_MORE : 0), sbuf + off, chunk);
+			}
+			/* else the card asks for our last block again */
+			if (sending) {
+				memcpy(block, iblock, ilen);
+				blen = ilen;
+			}
+			continue;
+		}
+
+		/* an I-block of the response, which confirms our last I-block */
+		if (sending) {
+			sending = 0;
+			priv->ns ^= 1;
+		}
+		if (((rpcb & T1_I_NS) ? 1 : 0) == priv->nr) {
+			priv->nr ^= 1;
+			if (rcount + inf_len > *rlen)
+				return SC_ERROR_BUFFER_TOO_SMALL;
+			memcpy(rbuf + rcount, inf, inf_len);
+			rcount += inf_len;
+			if (!(rpcb & T1_I_MORE))
+				break;
+		}
+		blen = ccid_t1_build(block, T1_R_BLOCK | (priv->nr << 4), NULL, 0);
+	}
+
+	*rlen = rcount;
+	return SC_SUCCESS;
+}
+
+/* Exchanges an APDU with a reader exchanging APDUs, chained in both
+ * directions with the extended APDU level */
+static int ccid_apdu_transceive(sc_reader_t *reader, const u8 *sbuf, size_t slen,
+		u8 *rbuf, size_t *rlen)
+{
+	struct ccid_private_data *priv = GET_PRIV_DATA(reader);
+	size_t max = priv->max_message - CCID_HEADER_LEN, off = 0, n, rcount = 0, plen;
+	int extended = (priv->features & CCID_FEAT_LEVEL_MASK) == CCID_FEAT_LEVEL_EXTENDED;
+	unsigned int level;
+	const u8 *p;
+	u8 chain;
+	int r;
+
+	if (slen > max && !extended)
+		return SC_ERROR_WRONG_LENGTH;
+	do {
+		n = slen - off > max ? max : slen - off;
+		if (off == 0)
+			level = off + n < slen ? 0x0001 : 0x0000;
+		else
+			level = off + n < slen ? 0x0003 : 0x0002;
+		r = ccid_command(reader, PC_TO_RDR_XFRBLOCK, 0, level & 0xFF, level >> 8,
+				sbuf + off, n, &p, &plen);
+		if (r != SC_SUCCESS)
+			return r;
+		off += n;
+	} while (off < slen);
+
+	for (;;) {
+		chain = priv->buf[9];
+		if (rcount + plen > *rlen)
+			return SC_ERROR_BUFFER_TOO_SMALL;
+		memcpy(rbuf + rcount, p, plen);
+		rcount += plen;
+		if (!extended || (chain != 0x01 && chain != 0x03))
+			break;
+		r = ccid_command(reader, PC_TO_RDR_XFRBLOCK, 0, 0x10, 0x00, NULL, 0, &p, &plen);
+		if (r != SC_SUCCESS)
+			return r;
+	}
+
+	*rlen = rcount;
+	return SC_SUCCESS;
+}
+
+static int ccid_is_tpdu(struct ccid_private_data *priv)
+{
+	return (priv->features & CCID_FEAT_LEVEL_MASK) == CCID_FEAT_LEVEL_TPDU;
+}
+
+static int ccid_init(sc_context_t *ctx)
+{
+	struct ccid_global_private_data *gpriv;
+	scconf_block *conf_block;
+	int r;
+
+	gpriv = calloc(1, sizeof(*gpriv));
+	if (gpriv == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "ccid", 1);
+	gpriv->exclusive = scconf_get_bool(conf_block, "exclusive", 1);
+	gpriv->timeout = 1000 * scconf_get_int(conf_block, "timeout", CCID_DEFAULT_TIMEOUT);
+
+	r = libusb_init(&gpriv->usb);
+	if (r != 0) {
+		free(gpriv);
+		return ccid_usb_error(ctx, r);
+	}
+	ctx->reader_drv_data = gpriv;
+	return SC_SUCCESS;
+}
+
+static int ccid_finish(sc_context_t *ctx)
+{
+	struct ccid_global_private_data *gpriv = (struct ccid_global_private_data *) ctx->reader_drv_data;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+	if (gpriv) {
+		libusb_exit(gpriv->usb);
+		free(gpriv);
+		ctx->reader_drv_data = NULL;
+	}
+	return SC_SUCCESS;
+}
+
+/* Finds the CCID interface of a device, returns its number or -1 */
+static int ccid_find_interface(libusb_device *dev, struct ccid_private_data *priv)
+{
+	struct libusb_config_descriptor *config;
+	int i, j, found = -1;
+
+	if (libusb_get_active_config_descriptor(dev, &config) != 0)
+		return -1;
+	for (i = 0; i < config->bNumInterfaces && found < 0; i++) {
+		const struct libusb_interface_descriptor *alt;
+		const u8 *desc;
+
+		if (config->interface[i].num_altsetting < 1)
+			continue;
+		alt = &config->interface[i].altsetting[0];
+		desc = alt->extra;
+		if (alt->bInterfaceClass != CCID_CLASS || alt->extra_length < CCID_DESC_LEN
+				|| desc[0] != CCID_DESC_LEN || desc[1] != CCID_DESC_TYPE)
+			continue;
+
+		priv->ep_in = priv->ep_out = priv->ep_intr = 0;
+		for (j = 0; j < alt->bNumEndpoints; j++) {
+			const struct libusb_endpoint_descriptor *ep = &alt->endpoint[j];
+			int type = ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+
+			if (type == LIBUSB_TRANSFER_TYPE_BULK && (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN))
+				priv->ep_in = ep->bEndpointAddress;
+			else if (type == LIBUSB_TRANSFER_TYPE_BULK)
+				priv->ep_out = ep->bEndpointAddress;
+			else if (type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+				priv->ep_intr = ep->bEndpointAddress;
+		}
+		if (!priv->ep_in || !priv->ep_out)
+			continue;
+
+		priv->interface = alt->bInterfaceNumber;
+		priv->features = ccid_get_u32(desc + 40);
+		priv->max_message = ccid_get_u32(desc + 44);
+		if (priv->max_message > CCID_MAX_MESSAGE)
+			priv->max_message = CCID_MAX_MESSAGE;
+		priv->pin_support = desc[52];
+		found = priv->interface;
+	}
+	libusb_free_config_descriptor(config);
+	return found;
+}
+
+static int ccid_detect_readers(sc_context_t *ctx)
+{
+	struct ccid_global_private_data *gpriv = (struct ccid_global_private_data *) ctx->reader_drv_data;
+	libusb_device **devs;
+	ssize_t count, i;
+	int r = SC_SUCCESS;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
+	if (gpriv == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_NO_READERS_FOUND);
+
+	count = libusb_get_device_list(gpriv->usb, &devs);
+	if (count < 0)
+		LOG_FUNC_RETURN(ctx, ccid_usb_error(ctx, (int) count));
+
+	for (i = 0; i < count; i++) {
+		struct libusb_device_descriptor desc;
+		struct ccid_private_data *priv;
+		sc_reader_t *reader;
+		char product[128] = "CCID reader", name[192];
+		u8 ports[8];
+		int nports, k, len;
+
+		priv = calloc(1, sizeof(*priv));
+		if (priv == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		if (libusb_get_device_descriptor(devs[i], &desc) != 0
+				|| ccid_find_interface(devs[i], priv) < 0
+				|| priv->max_message < CCID_HEADER_LEN + 4) {
+			free(priv);
+			continue;
+		}
+
+		/* the name stays the same while the reader is in the same port */
+		if (libusb_open(devs[i], &priv->handle) != 0) {
+			sc_log(ctx, "cannot open the CCID reader %04X:%04X",
+					desc.idVendor, desc.idProduct);
+			free(priv);
+			continue;
+		}
+		if (desc.iProduct)
+			libusb_get_string_descriptor_ascii(priv->handle, desc.iProduct,
+					(unsigned char *) product, sizeof(product));
+		len = snprintf(name, sizeof(name), "%s [ccid %u", product,
+				libusb_get_bus_number(devs[i]));
+		nports = libusb_get_port_numbers(devs[i], ports, sizeof(ports));
+		for (k = 0; k < nports && len > 0 && (size_t) len < sizeof(name); k++)
+			len += snprintf(name + len, sizeof(name) - len, "%c%u", k ? '.' : '-', ports[k]);
+		if (len > 0 && (size_t) len < sizeof(name))
+			snprintf(name + len, sizeof(name) - len, "]");
+
+		/* Reader already available, skip */
+		if (sc_ctx_get_reader_by_name(ctx, name) != NULL) {
+			libusb_close(priv->handle);
+			free(priv);
+			continue;
+		}
+
+		reader = calloc(1, sizeof(*reader));
+		if (reader)
+			reader->name = strdup(name);
+		if (reader == NULL || reader->name == NULL) {
+			free(reader);
+			libusb_close(priv->handle);
+			free(priv);
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		priv->gpriv = gpriv;
+		priv->ifsc = 0x20;
+		reader->drv_data = priv;
+		reader->ops = &ccid_ops;
+		reader->driver = &ccid_drv;
+
+		libusb_set_auto_detach_kernel_driver(priv->handle, 1);
+		if (gpriv->exclusive && ccid_claim(reader) != SC_SUCCESS) {
+			sc_log(ctx, "CCID reader '%s' is in use", name);
+			libusb_close(priv->handle);
+			free(reader->name);
+			free(reader);
+			free(priv);
+			continue;
+		}
+
+		if (priv->pin_support & CCID_PIN_VERIFY)
+			reader->capabilities |= SC_READER_CAP_PIN_PAD;
+		reader->supported_protocols = ccid_is_tpdu(priv) ? SC_PROTO_T1 : SC_PROTO_T0 | SC_PROTO_T1;
+		if ((priv->features & CCID_FEAT_LEVEL_MASK) == CCID_FEAT_LEVEL_SHORT) {
+			reader->max_send_size = 255;
+			reader->max_recv_size = 256;
+		} else {
+			/* extended APDUs, chained by the reader or by ccid_t1_transceive() */
+			reader->capabilities |= SC_READER_CAP_EXT_APDU;
+		}
+
+		sc_log(ctx, "Found new CCID reader '%s', features 0x%08lX", name, priv->features);
+		if (_sc_add_reader(ctx, reader)) {
+			ccid_release_claim(reader);
+			libusb_close(priv->handle);
+			free(reader->name);
+			free(reader);
+			free(priv);
+		}
+	}
+
+	libusb_free_device_list(devs, 1);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+static int ccid_release(sc_reader_t *reader)
+{
+	struct ccid_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (priv) {
+		if (priv->claimed)
+			libusb_release_interface(priv->handle, priv->interface);
+		libusb_close(priv->handle);
+		free(priv);
+	}
+	reader->drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+static int ccid_detect_card_presence(sc_reader_t *reader)
+{
+	struct ccid_private_data *priv = GET_PRIV_DATA(reader);
+	u8 notify[8];
+	int r, n;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	r = ccid_claim(reader);
+	if (r != SC_SUCCESS)
+		LOG_FUNC_RETURN(reader->ctx, r);
+
+	/* a change of the card since the last look is reported on the
+	 * interrupt endpoint */
+	if (priv->ep_intr
+			&& libusb_interrupt_transfer(priv->handle, priv->ep_intr, notify,
+				sizeof(notify), &n, 1) == 0
+			&& n >= 2 && notify[0] == RDR_TO_PC_NOTIFYSLOTCHANGE && (notify[1] & 0x02))
+		priv->absent_seen = 1;
+
+	r = ccid_command(reader, PC_TO_RDR_GETSLOTSTATUS, 0, 0, 0, NULL, 0, NULL, NULL);
+	ccid_release_claim(reader);
+	if (r != SC_SUCCESS && r != SC_ERROR_CARD_REMOVED)
+		LOG_FUNC_RETURN(reader->ctx, r);
+
+	reader->flags &= ~SC_READER_CARD_PRESENT;
+	if ((priv->buf[7] & CCID_ICC_MASK) == CCID_ICC_ABSENT) {
+		priv->absent_seen = 1;
+	} else {
+		reader->flags |= SC_READER_CARD_PRESENT;
+		if (priv->absent_seen)
+			reader->flags |= SC_READER_CARD_CHANGED;
+	}
+	LOG_FUNC_RETURN(reader->ctx, reader->flags);
+}
+
+/* Powers the card on and sets up the protocol */
+static int ccid_power_on(sc_reader_t *reader)
+{
+	struct ccid_private_data *priv = GET_PRIV_DATA(reader);
+	struct ccid_atr atr;
+	const u8 *p;
+	size_t len;
+	int r;
+
+	r = ccid_command(reader, PC_TO_RDR_ICCPOWERON, 0, 0, 0, NULL, 0, &p, &len);
+	if (r != SC_SUCCESS)
+		return r;
+	if (len < 2 || len > SC_MAX_ATR_SIZE)
+		return SC_ERROR_UNKNOWN_DATA_RECEIVED;
+	memcpy(reader->atr.value, p, len);
+	reader->atr.len = len;
+
+	ccid_parse_atr(reader->atr.value, reader->atr.len, &atr);
+	if ((atr.protocols & SC_PROTO_T1) && (reader->supported_protocols & SC_PROTO_T1))
+		reader->active_protocol = SC_PROTO_T1;
+	else if (!ccid_is_tpdu(priv))
+		reader->active_protocol = SC_PROTO_T0;
+	else {
+		sc_log(reader->ctx, "%s: T=0 needs a reader exchanging APDUs", reader->name);
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+	if (ccid_is_tpdu(priv) && atr.t1_crc) {
+		sc_log(reader->ctx, "%s: T=1 with CRC is not supported", reader->name);
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+
+	r = ccid_set_parameters(reader, &atr);
+	if (r != SC_SUCCESS)
+		return r;
+
+	priv->ns = priv->nr = 0;
+	priv->ifsc = atr.t1_ifsc > 0 && atr.t1_ifsc < 0xFF ? (size_t) atr.t1_ifsc : 0x20;
+	if (ccid_is_tpdu(priv) && !(priv->features & CCID_FEAT_AUTO_IFSD)) {
+		u8 block[T1_MAX_BLOCK], ifsd = T1_MAX_INF, rpcb;
+		const u8 *inf;
+		size_t blen, inf_len;
+
+		blen = ccid_t1_build(block, T1_S_BLOCK | T1_S_IFS, &ifsd, 1);
+		r = ccid_t1_xfer(reader, block, blen, 0, &rpcb, &inf, &inf_len);
+		if (r != SC_SUCCESS || rpcb != (T1_S_BLOCK | T1_S_RESPONSE | T1_S_IFS))
+			sc_log(reader->ctx, "%s: IFSD not taken, the card sends short blocks", reader->name);
+	}
+	return SC_SUCCESS;
+}
+
+static int ccid_connect(sc_reader_t *reader)
+{
+	struct ccid_private_data *priv = GET_PRIV_DATA(reader);
+	int r;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	r = ccid_claim(reader);
+	if (r != SC_SUCCESS)
+		LOG_FUNC_RETURN(reader->ctx, r);
+	r = ccid_power_on(reader);
+	ccid_release_claim(reader);
+	if (r != SC_SUCCESS)
+		LOG_FUNC_RETURN(reader->ctx, r);
+
+	priv->absent_seen = 0;
+	reader->flags |= SC_READER_CARD_PRESENT;
+	reader->flags &= ~SC_READER_CARD_CHANGED;
+	LOG_FUNC_RETURN(reader->ctx, SC_SUCCESS);
+}
+
+static int ccid_disconnect(sc_reader_t *reader)
+{
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	if (ccid_claim(reader) == SC_SUCCESS) {
+		ccid_command(reader, PC_TO_RDR_ICCPOWEROFF, 0, 0, 0, NULL, 0, NULL, NULL);
+		ccid_release_claim(reader);
+	}
+	reader->flags = 0;
+	return SC_SUCCESS;
+}
+
+static int ccid_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct ccid_private_data *priv = GET_PRIV_DATA(reader);
+	u8 *sbuf = NULL, *rbuf = NULL;
+	size_t ssize = 0, rsize, rbuflen;
+	int r;
+
+	rsize = rbuflen = apdu->resplen + 2;
+	rbuf = malloc(rbuflen);
+	if (rbuf == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	/* readers exchanging APDUs take them in the T=1 form for either protocol */
+	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, SC_PROTO_T1);
+	if (r != SC_SUCCESS)
+		goto out;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	r = ccid_claim(reader);
+	if (r != SC_SUCCESS)
+		goto out;
+	if (ccid_is_tpdu(priv))
+		r = ccid_t1_transceive(reader, sbuf, ssize, rbuf, &rsize);
+	else
+		r = ccid_apdu_transceive(reader, sbuf, ssize, rbuf, &rsize);
+	ccid_release_claim(reader);
+	if (r != SC_SUCCESS) {
+		sc_log(reader->ctx, "unable to transmit");
+		goto out;
+	}
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+out:
+	if (sbuf != NULL) {
+		sc_mem_clear(sbuf, ssize);
+		free(sbuf);
+	}
+	if (rbuf != NULL) {
+		sc_mem_clear(rbuf, rbuflen);
+		free(rbuf);
+	}
+	return r;
+}
+
+/* The PIN block of PC/SC v2 Part 10 without bTimerOut2 and ulDataLength,
+ * after bPINOperation, is the one of PC_to_RDR_Secure */
+static int ccid_pin_cmd(sc_reader_t *reader, struct sc_pin_cmd_data *data)
+{
+	struct ccid_private_data *priv = GET_PRIV_DATA(reader);
+	u8 part10[sizeof(PIN_MODIFY_STRUCTURE) + SC_MAX_APDU_BUFFER_SIZE];
+	u8 sbuf[sizeof(PIN_MODIFY_STRUCTURE) + SC_MAX_APDU_BUFFER_SIZE];
+	size_t count = 0, slen = 0, head, plen;
+	sc_apdu_t *apdu = data->apdu;
+	const u8 *p;
+	int r;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
+	if (!apdu) {
+		sc_log(reader->ctx, "No APDU provided for CCID pinpad verification!");
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+
+	switch (data->cmd) {
+	case SC_PIN_CMD_VERIFY:
+		if (!(priv->pin_support & CCID_PIN_VERIFY))
+			return SC_ERROR_NOT_SUPPORTED;
+		r = part10_build_verify_pin_block(reader, part10, &count, data);
+		if (r != SC_SUCCESS)
+			LOG_FUNC_RETURN(reader->ctx, r);
+		head = offsetof(PIN_VERIFY_STRUCTURE, ulDataLength);
+		sbuf[slen++] = 0x00;	/* bPINOperation: verification */
+		break;
+	case SC_PIN_CMD_CHANGE:
+	case SC_PIN_CMD_UNBLOCK:
+		if (!(priv->pin_support & CCID_PIN_MODIFY))
+			return SC_ERROR_NOT_SUPPORTED;
+		r = part10_build_modify_pin_block(reader, part10, &count, data);
+		if (r != SC_SUCCESS)
+			LOG_FUNC_RETURN(reader->ctx, r);
+		head = offsetof(PIN_MODIFY_STRUCTURE, ulDataLength);
+		sbuf[slen++] = 0x01;	/* bPINOperation: modification */
+		break;
+	default:
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+
+	sbuf[slen++] = part10[0];	/* bTimeOut */
+	memcpy(sbuf + slen, part10 + 2, head - 2);
+	slen += head - 2;
+	if (ccid_is_tpdu(priv)) {
+		/* bTeoPrologue, the reader sends the APDU in an I-block */
+		sbuf[slen - 3] = 0x00;
+		sbuf[slen - 2] = priv->ns ? T1_I_NS : 0;
+		sbuf[slen - 1] = (u8) (count - head - 4);
+	}
+	memcpy(sbuf + slen, part10 + head + 4, count - head - 4);
+	slen += count - head - 4;
+
+	r = ccid_claim(reader);
+	if (r != SC_SUCCESS)
+		LOG_FUNC_RETURN(reader->ctx, r);
+	r = ccid_command(reader, PC_TO_RDR_SECURE, 0, 0, 0, sbuf, slen, &p, &plen);
+	ccid_release_claim(reader);
+	if (r != SC_SUCCESS)
+		LOG_FUNC_RETURN(reader->ctx, r);
+
+	if (ccid_is_tpdu(priv)) {
+		/* the I-block of the response */
+		if (plen < 6 || T1_IS_R(p[1]) || T1_IS_S(p[1]) || (size_t) p[2] + 4 != plen)
+			LOG_FUNC_RETURN(reader->ctx, SC_ERROR_UNKNOWN_DATA_RECEIVED);
+		priv->ns ^= 1;
+		priv->nr ^= 1;
+		p += 3;
+		plen -= 4;
+	}
+	if (plen != 2)
+		LOG_FUNC_RETURN(reader->ctx, SC_ERROR_UNKNOWN_DATA_RECEIVED);
+
+	apdu->sw1 = p[0];
+	apdu->sw2 = p[1];
+	switch ((apdu->sw1 << 8) | apdu->sw2) {
+	case 0x6400: /* Input timed out */
+		r = SC_ERROR_KEYPAD_TIMEOUT;
+		break;
+	case 0x6401: /* Input cancelled */
+		r = SC_ERROR_KEYPAD_CANCELLED;
+		break;
+	case 0x6402: /* PINs don't match */
+		r = SC_ERROR_KEYPAD_PIN_MISMATCH;
+		break;
+	case 0x6403: /* Entered PIN is not in length limits */
+		r = SC_ERROR_INVALID_PIN_LENGTH;
+		break;
+	case 0x6B80: /* Wrong data in the buffer, rejected by firmware */
+		r = SC_ERROR_READER;
+		break;
+	}
+	LOG_FUNC_RETURN(reader->ctx, r);
+}
+
+static int ccid_lock(sc_reader_t *reader)
+{
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	return ccid_claim(reader);
+}
+
+static int ccid_unlock(sc_reader_t *reader)
+{
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	ccid_release_claim(reader);
+	return SC_SUCCESS;
+}
+
+static int ccid_reset(sc_reader_t *reader, int do_cold_reset)
+{
+	int r;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	r = ccid_claim(reader);
+	if (r != SC_SUCCESS)
+		LOG_FUNC_RETURN(reader->ctx, r);
+	/* a power on of a powered card is a warm reset */
+	if (do_cold_reset)
+		ccid_command(reader, PC_TO_RDR_ICCPOWEROFF, 0, 0, 0, NULL, 0, NULL, NULL);
+	r = ccid_power_on(reader);
+	ccid_release_claim(reader);
+	LOG_FUNC_RETURN(reader->ctx, r);
+}
+
+struct sc_reader_driver *sc_get_ccid_driver(void)
+{
+	ccid_ops.init = ccid_init;
+	ccid_ops.finish = ccid_finish;
+	ccid_ops.detect_readers = ccid_detect_readers;
+	ccid_ops.release = ccid_release;
+	ccid_ops.detect_card_presence = ccid_detect_card_presence;
+	ccid_ops.connect = ccid_connect;
+	ccid_ops.disconnect = ccid_disconnect;
+	ccid_ops.transmit = ccid_transmit;
+	ccid_ops.lock = ccid_lock;
+	ccid_ops.unlock = ccid_unlock;
+	ccid_ops.reset = ccid_reset;
+	ccid_ops.perform_verify = ccid_pin_cmd;
+	ccid_ops.perform_pace = NULL;
+	ccid_ops.use_reader = NULL;
+
+	return &ccid_drv;
+}
+
+#endif	/* ENABLE_CCID */
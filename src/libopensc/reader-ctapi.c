@@ -70,19 +70,38 @@ struct ctapi_functions {
 #define CTAPI_FU_BIOMETRIC	0x4
 #define CTAPI_FU_PRINTER	0x8
 
+/* CT_data() takes and returns at most 65535 bytes */
+#define CTAPI_MAX_DATA_SIZE	0xFFFF
+
 struct ctapi_private_data {
 	struct ctapi_functions funcs;
 	unsigned short ctn;
 	int ctapi_functional_units;
 	int slot;
+	/* serializes the CT_data() calls of this port only, the other ports
+	 * are used concurrently */
+	void *mutex;
 };
 
+static char ctapi_data(sc_reader_t *reader, u8 dad, unsigned short lc,
+		const u8 *cmd, unsigned short *lr, u8 *rsp)
+{
+	struct ctapi_private_data *priv = GET_PRIV_DATA(reader);
+	u8 sad = 2;
+	char rv;
+
+	sc_mutex_lock(reader->ctx, priv->mutex);
+	rv = priv->funcs.CT_data(priv->ctn, &dad, &sad, lc, (u8 *) cmd, lr, rsp);
+	sc_mutex_unlock(reader->ctx, priv->mutex);
+	return rv;
+}
+
 /* Reset reader */
 static int ctapi_reset(sc_reader_t *reader)
 {
 	struct ctapi_private_data *priv = GET_PRIV_DATA(reader);
 	char rv;
-	u8 cmd[5], rbuf[256], sad, dad;
+	u8 cmd[5], rbuf[256];
 	unsigned short lr;
 
 	cmd[0] = CTBCS_CLA;
@@ -90,11 +109,9 @@ static int ctapi_reset(sc_reader_t *reader)
 	cmd[2] = priv->slot ? CTBCS_P1_INTERFACE1 + priv->slot : CTBCS_P1_CT_KERNEL;
 	cmd[3] = 0x00; /* No response. We might also use 0x01 (return ATR) or 0x02 (return historical bytes) here */
 	cmd[4] = 0x00;
-	dad = 1;
-	sad = 2;
 	lr = 256;
 
-	rv = priv->funcs.CT_data(priv->ctn, &dad, &sad, 5, cmd, &lr, rbuf);
+	rv = ctapi_data(reader, 1, 5, cmd, &lr, rbuf);
 	if (rv || (lr < 2)) {
 		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "Error getting status of terminal: %d, using defaults\n", rv);
 		return SC_ERROR_TRANSMIT_FAILED;
@@ -109,9 +126,8 @@ static int ctapi_reset(sc_reader_t *reader)
 
 static int refresh_attributes(sc_reader_t *reader)
 {
-	struct ctapi_private_data *priv = GET_PRIV_DATA(reader);
 	char rv;
-	u8 cmd[5], rbuf[256], sad, dad;
+	u8 cmd[5], rbuf[256];
 	unsigned short lr;
 
 	cmd[0] = CTBCS_CLA;
@@ -119,15 +135,13 @@ static int refresh_attributes(sc_reader_t *reader)
 	cmd[2] = CTBCS_P1_CT_KERNEL;
 	cmd[3] = CTBCS_P2_STATUS_ICC;
 	cmd[4] = 0x00;
-	dad = 1;
-	sad = 2;
 	lr = 256;
 
 	reader->flags = 0;
 
-	rv = priv->funcs.CT_data(priv->ctn, &dad, &sad, 5, cmd, &lr, rbuf);
+	rv = ctapi_data(reader, 1, 5, cmd, &lr, rbuf);
 	if (rv || (lr < 3) || (rbuf[lr-2] != 0x90)) {
-		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "Error getting status of terminal: %d/%d/0x%x\n", rv, lr, rbuf[lr-2]);
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "Error getting status of terminal: %d/%d\n", rv, lr);
 		return SC_ERROR_TRANSMIT_FAILED;
 	}
 	if (lr < 4) {
@@ -152,20 +166,14 @@ static int ctapi_internal_transmit(sc_reader_t *reader,
 			 u8 *recvbuf, size_t *recvsize,
 			 unsigned long control)
 {
-	struct ctapi_private_data *priv = GET_PRIV_DATA(reader);
-	u8 dad, sad;
 	unsigned short lr;
 	char rv;
-	
-	if (control)
-		dad = 1;
-	else
-		dad = 0;
 
-	sad = 2;
-	lr = *recvsize;
-	
-	rv = priv->funcs.CT_data(priv->ctn, &dad, &sad, (unsigned short)sendsize, (u8 *) sendbuf, &lr, recvbuf);
+	if (sendsize > CTAPI_MAX_DATA_SIZE)
+		return SC_ERROR_WRONG_LENGTH;
+	lr = *recvsize > CTAPI_MAX_DATA_SIZE ? CTAPI_MAX_DATA_SIZE : *recvsize;
+
+	rv = ctapi_data(reader, control ? 1 : 0, (unsigned short)sendsize, sendbuf, &lr, recvbuf);
 	if (rv != 0) {
 		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "Error transmitting APDU: %d\n", rv);
 		return SC_ERROR_TRANSMIT_FAILED;
@@ -227,9 +235,8 @@ static int ctapi_detect_card_presence(sc_reader_t *reader)
 
 static int ctapi_connect(sc_reader_t *reader)
 {
-	struct ctapi_private_data *priv = GET_PRIV_DATA(reader);
 	char rv;
-	u8 cmd[9], rbuf[256], sad, dad;
+	u8 cmd[9], rbuf[256];
 	unsigned short lr;
 	int r;
 
@@ -238,17 +245,15 @@ static int ctapi_connect(sc_reader_t *reader)
 	cmd[2] = CTBCS_P1_INTERFACE1;
 	cmd[3] = CTBCS_P2_REQUEST_GET_ATR;
 	cmd[4] = 0x00;
-	dad = 1;
-	sad = 2;
 	lr = 256;
 
-	rv = priv->funcs.CT_data(priv->ctn, &dad, &sad, 5, cmd, &lr, rbuf);
+	rv = ctapi_data(reader, 1, 5, cmd, &lr, rbuf);
+	if (rv == 0 && lr < 2)
+		SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INTERNAL);
 	if (rv || rbuf[lr-2] != 0x90) {
 		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "Error activating card: %d\n", rv);
 		return SC_ERROR_TRANSMIT_FAILED;
 	}
-	if (lr < 2)
-		SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INTERNAL);
 	lr -= 2;
 	if (lr > SC_MAX_ATR_SIZE)
 		return SC_ERROR_INTERNAL;
@@ -265,11 +270,9 @@ static int ctapi_connect(sc_reader_t *reader)
 		cmd[6] = 0x10;
 		cmd[7] = (reader->atr_info.FI << 4) | reader->atr_info.DI;
 		cmd[8] = 0x00;
-		dad = 1;
-		sad = 2;
 		lr = 256;
 
-		rv = priv->funcs.CT_data(priv->ctn, &dad, &sad, 9, cmd, &lr, rbuf);
+		rv = ctapi_data(reader, 1, 9, cmd, &lr, rbuf);
 		if (rv) {
 			sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "Error negotiating PPS: %d\n", rv);
 			return SC_ERROR_TRANSMIT_FAILED;
@@ -300,6 +303,7 @@ static int ctapi_release(sc_reader_t *reader)
 
 	priv->funcs.CT_close(priv->ctn);
 
+	sc_mutex_destroy(reader->ctx, priv->mutex);
 	free(priv);
 	return 0;
 }
@@ -337,12 +341,10 @@ static int ctapi_load_module(sc_context_t *ctx,
 	struct ctapi_module *mod;
 	const scconf_list *list;
 	void *dlh;
-	int r, i, NumUnits;
-	u8 cmd[5], rbuf[256], sad, dad;
+	int r, i, NumUnits, extended_length;
+	u8 cmd[5], rbuf[256];
 	unsigned short lr;
 
-	
-	
 	list = scconf_find_list(conf, "ports");
 	if (list == NULL) {
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "No ports configured.\n");
@@ -366,6 +368,8 @@ static int ctapi_load_module(sc_context_t *ctx,
 	if (!funcs.CT_data)
 		goto symerr;
 
+	extended_length = scconf_get_bool(conf, "extended_length", 0);
+
 	mod = add_module(gpriv, val, dlh);
 	for (; list != NULL; list = list->next) {
 		int port;
@@ -398,9 +402,18 @@ static int ctapi_load_module(sc_context_t *ctx,
 		reader->name = strdup(namebuf);
 		priv->funcs = funcs;
 		priv->ctn = mod->ctn_count;
-		r = _sc_add_reader(ctx, reader);
+		if (extended_length) {
+			/* extended Lc and Le, within what CT_data() can pass */
+			reader->max_send_size = CTAPI_MAX_DATA_SIZE - 9;
+			reader->max_recv_size = CTAPI_MAX_DATA_SIZE - 2;
+			reader->capabilities |= SC_READER_CAP_EXT_APDU;
+		}
+		r = sc_mutex_create(ctx, &priv->mutex);
+		if (r == SC_SUCCESS)
+			r = _sc_add_reader(ctx, reader);
 		if (r) {
 			funcs.CT_close((unsigned short)mod->ctn_count);
+			sc_mutex_destroy(ctx, priv->mutex);
 			free(priv);
 			free(reader->name);
 			free(reader);
@@ -414,11 +427,9 @@ static int ctapi_load_module(sc_context_t *ctx,
 		cmd[2] = CTBCS_P1_CT_KERNEL;
 		cmd[3] = CTBCS_P2_STATUS_TFU;
 		cmd[4] = 0x00;
-		dad = 1;
-		sad = 2;
 		lr = 256;
 		
-		rv = priv->funcs.CT_data(priv->ctn, &dad, &sad, 5, cmd, &lr, rbuf);
+		rv = ctapi_data(reader, 1, 5, cmd, &lr, rbuf);
 		if (rv || (lr < 4) || (rbuf[lr-2] != 0x90)) {
 			sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "Error getting status of terminal: %d, using defaults\n", rv);
 		}
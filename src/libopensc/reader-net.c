@@ -0,0 +1,622 @@
+/*
+ * reader-net.c: Reader driver for cards served over the network
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef ENABLE_NET_READER	/* empty file without the network reader */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "internal.h"
+
+/*
+ * The driver keeps one TCP connection to the server given in the
+ * 'reader_driver net' block, and exchanges frames over it:
+ *
+ *   length (4)  type (1)  id (4)  payload (length - 5)
+ *
+ * All numbers are big endian. The server answers every request, in the
+ * order of the requests, with a frame of type (request type | NET_REPLY)
+ * and the same id. A reply payload starts with a 4 byte status, 0 or an
+ * OpenSC error code, followed by the data of the reply. Requests about a
+ * reader start their payload with the index of the reader in the NET_LIST
+ * reply.
+ *
+ *   NET_LIST        -> count (1), then per reader name length (2), name
+ *   NET_STATUS      slot -> flags (1): NET_CARD_PRESENT, NET_CARD_CHANGED
+ *   NET_CONNECT     slot, protocols (4) -> active protocol (4), ATR
+ *   NET_DISCONNECT  slot
+ *   NET_LOCK        slot
+ *   NET_UNLOCK      slot
+ *   NET_TRANSMIT    slot, APDU -> response APDU with SW1 SW2
+ *   NET_RESET       slot, cold (1)
+ *
+ * Since the server handles the requests in order, NET_LOCK, NET_UNLOCK
+ * and NET_DISCONNECT are sent without waiting for their reply: they take
+ * no round trip of their own, and their replies are read with the reply of
+ * the next request. A failed lock is reported by that request.
+ */
+#define NET_LIST		0x01
+#define NET_STATUS		0x02
+#define NET_CONNECT		0x03
+#define NET_DISCONNECT		0x04
+#define NET_LOCK		0x05
+#define NET_UNLOCK		0x06
+#define NET_TRANSMIT		0x07
+#define NET_RESET		0x08
+#define NET_REPLY		0x80
+
+#define NET_CARD_PRESENT	0x01
+#define NET_CARD_CHANGED	0x02
+
+#define NET_HEADER_LEN		9
+#define NET_MAX_FRAME		(SC_MAX_EXT_APDU_BUFFER_SIZE + 64)
+#define NET_DEFAULT_PORT	"7716"
+#define NET_DEFAULT_TIMEOUT	30
+
+#define GET_PRIV_DATA(r) ((struct net_private_data *) (r)->drv_data)
+
+struct net_global_private_data {
+	char *host, *port;
+	unsigned int timeout;
+	int fd;
+	void *mutex;
+	unsigned int next_id;
+	/* replies of requests sent without waiting, not read yet */
+	unsigned int deferred;
+	/* id of the last NET_LOCK sent without waiting, and its result */
+	unsigned int lock_id;
+	int lock_error;
+	u8 frame[NET_MAX_FRAME];
+};
+
+struct net_private_data {
+	struct net_global_private_data *gpriv;
+	unsigned int slot;
+};
+
+static struct sc_reader_operations net_ops;
+
+static struct sc_reader_driver net_drv = {
+	"Network reader",
+	"net",
+	&net_ops,
+	0, 0, NULL
+};
+
+static void net_put_u32(u8 *p, unsigned long v)
+{
+	p[0] = (v >> 24) & 0xFF;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+static unsigned long net_get_u32(const u8 *p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16)
+		| ((unsigned long)p[2] << 8) | p[3];
+}
+
+static void net_close(struct net_global_private_data *gpriv)
+{
+	if (gpriv->fd >= 0)
+		close(gpriv->fd);
+	gpriv->fd = -1;
+	gpriv->deferred = 0;
+	gpriv->lock_id = 0;
+	gpriv->lock_error = 0;
+}
+
+static int net_open(sc_context_t *ctx, struct net_global_private_data *gpriv)
+{
+	struct addrinfo hints, *res, *ai;
+	struct timeval tv;
+	int fd = -1, one = 1, rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	rc = getaddrinfo(gpriv->host, gpriv->port, &hints, &res);
+	if (rc != 0) {
+		sc_log(ctx, "cannot resolve '%s': %s", gpriv->host, gai_strerror(rc));
+		return SC_ERROR_NO_READERS_FOUND;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		sc_log(ctx, "cannot connect to %s:%s: %s", gpriv->host, gpriv->port, strerror(errno));
+		return SC_ERROR_NO_READERS_FOUND;
+	}
+
+	/* small frames are sent as they are, without waiting for a full segment */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (gpriv->timeout) {
+		tv.tv_sec = gpriv->timeout;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+	sc_log(ctx, "connected to %s:%s", gpriv->host, gpriv->port);
+	gpriv->fd = fd;
+	return SC_SUCCESS;
+}
+
+static int net_write_all(int fd, const u8 *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int net_read_all(int fd, u8 *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(fd, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Sends a request and returns its id, or an error */
+static int net_send(sc_context_t *ctx, struct net_global_private_data *gpriv,
+		int type, const struct net_private_data *priv,
+		const u8 *data, size_t len)
+{
+	u8 *p = gpriv->frame;
+	size_t payload = (priv ? 1 : 0) + len;
+	unsigned int id;
+	int r;
+
+	if (NET_HEADER_LEN + payload > sizeof(gpriv->frame))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	if (gpriv->fd < 0) {
+		r = net_open(ctx, gpriv);
+		if (r != SC_SUCCESS)
+			return r;
+	}
+
+	/* ids stay positive as return values */
+	gpriv->next_id = (gpriv->next_id + 1) & 0x7FFFFFFF;
+	if (gpriv->next_id == 0)
+		gpriv->next_id = 1;
+	id = gpriv->next_id;
+	net_put_u32(p, 5 + payload);
+	p[4] = type;
+	net_put_u32(p + 5, id);
+	p += NET_HEADER_LEN;
+	if (priv)
+		*p++ = priv->slot;
+	if (len)
+		memcpy(p, data, len);
+
+	if (net_write_all(gpriv->fd, gpriv->frame, NET_HEADER_LEN + payload) != 0) {
+		sc_log(ctx, "cannot send to %s:%s: %s", gpriv->host, gpriv->port, strerror(errno));
+		net_close(gpriv);
+		return SC_ERROR_TRANSMIT_FAILED;
+	}
+	return (int)id;
+}
+
+/* Reads replies up to the one of request 'id'. Its data is left in
+ * gpriv->frame, at *data. */
+static int net_recv(sc_context_t *ctx, struct net_global_private_data *gpriv,
+		unsigned int id, const u8 **data, size_t *len)
+{
+	unsigned long frame_len, frame_id;
+	int status;
+
+	while (1) {
+		if (net_read_all(gpriv->fd, gpriv->frame, NET_HEADER_LEN) != 0) {
+			sc_log(ctx, "cannot receive from %s:%s: %s", gpriv->host, gpriv->port, strerror(errno));
+			net_close(gpriv);
+			return SC_ERROR_TRANSMIT_FAILED;
+		}
+		frame_len = net_get_u32(gpriv->frame);
+		frame_id = net_get_u32(gpriv->frame + 5);
+		if (frame_len < 5 + 4 || frame_len - 5 > sizeof(gpriv->frame) - NET_HEADER_LEN
+				|| !(gpriv->frame[4] & NET_REPLY)
+				|| net_read_all(gpriv->fd, gpriv->frame + NET_HEADER_LEN, frame_len - 5) != 0) {
+			sc_log(ctx, "invalid reply from %s:%s", gpriv->host, gpriv->port);
+			net_close(gpriv);
+			return SC_ERROR_TRANSMIT_FAILED;
+		}
+		status = (int)net_get_u32(gpriv->frame + NET_HEADER_LEN);
+
+		if (frame_id == id)
+			break;
+
+		/* the reply of a request that was not waited for */
+		if (gpriv->deferred == 0) {
+			sc_log(ctx, "unexpected reply %lu from %s:%s", frame_id, gpriv->host, gpriv->port);
+			net_close(gpriv);
+			return SC_ERROR_TRANSMIT_FAILED;
+		}
+		gpriv->deferred--;
+		if (status != SC_SUCCESS) {
+			sc_log(ctx, "request %lu (type %02X) failed: %s", frame_id,
+					gpriv->frame[4] & ~NET_REPLY, sc_strerror(status));
+			if (frame_id == gpriv->lock_id)
+				gpriv->lock_error = status;
+		}
+	}
+
+	if (data)
+		*data = gpriv->frame + NET_HEADER_LEN + 4;
+	if (len)
+		*len = frame_len - 5 - 4;
+	if (gpriv->lock_error != SC_SUCCESS && status == SC_SUCCESS)
+		status = gpriv->lock_error;
+	gpriv->lock_error = SC_SUCCESS;
+	return status;
+}
+
+/* Sends a request and waits for its reply, copied to 'reply' of
+ * '*reply_len' bytes */
+static int net_request(sc_reader_t *reader, int type, const u8 *data, size_t len,
+		u8 *reply, size_t *reply_len)
+{
+	struct net_private_data *priv = GET_PRIV_DATA(reader);
+	struct net_global_private_data *gpriv = priv->gpriv;
+	const u8 *p;
+	size_t plen;
+	int r;
+
+	sc_mutex_lock(reader->ctx, gpriv->mutex);
+	r = net_send(reader->ctx, gpriv, type, priv, data, len);
+	if (r > 0)
+		r = net_recv(reader->ctx, gpriv, (unsigned int)r, &p, &plen);
+	if (r == SC_SUCCESS && reply_len) {
+		if (plen > *reply_len)
+			r = SC_ERROR_BUFFER_TOO_SMALL;
+		else
+			memcpy(reply, p, plen);
+		*reply_len = plen;
+	}
+	sc_mutex_unlock(reader->ctx, gpriv->mutex);
+	return r;
+}
+
+/* Sends a request without waiting for its reply */
+static int net_request_deferred(sc_reader_t *reader, int type)
+{
+	struct net_private_data *priv = GET_PRIV_DATA(reader);
+	struct net_global_private_data *gpriv = priv->gpriv;
+	int r;
+
+	sc_mutex_lock(reader->ctx, gpriv->mutex);
+	r = net_send(reader->ctx, gpriv, type, priv, NULL, 0);
+	if (r > 0) {
+		gpriv->deferred++;
+		if (type == NET_LOCK)
+			gpriv->lock_id = (unsigned int)r;
+		r = SC_SUCCESS;
+	}
+	sc_mutex_unlock(reader->ctx, gpriv->mutex);
+	return r;
+}
+
+static int net_init(sc_context_t *ctx)
+{
+	struct net_global_private_data *gpriv;
+	scconf_block *conf_block;
+	const char *server = NULL;
+	char *sep;
+	int r;
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "net", 1);
+	if (conf_block) {
+		server = scconf_get_str(conf_block, "server", NULL);
+	}
+	if (server == NULL) {
+		sc_log(ctx, "no server configured for the network reader");
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+
+	gpriv = calloc(1, sizeof(*gpriv));
+	if (gpriv == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	gpriv->fd = -1;
+	gpriv->timeout = scconf_get_int(conf_block, "timeout", NET_DEFAULT_TIMEOUT);
+
+	/* "host:port", "[v6 address]:port" or "host" */
+	gpriv->host = strdup(server[0] == '[' ? server + 1 : server);
+	if (gpriv->host == NULL) {
+		free(gpriv);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	sep = server[0] == '[' ? strchr(gpriv->host, ']') : strrchr(gpriv->host, ':');
+	if (sep && server[0] == '[') {
+		*sep++ = '\0';
+		sep = *sep == ':' ? sep : NULL;
+	}
+	if (sep)
+		*sep++ = '\0';
+	gpriv->port = strdup(sep && *sep ? sep : NET_DEFAULT_PORT);
+
+	r = gpriv->port ? sc_mutex_create(ctx, &gpriv->mutex) : SC_ERROR_OUT_OF_MEMORY;
+	if (r != SC_SUCCESS) {
+		free(gpriv->port);
+		free(gpriv->host);
+		free(gpriv);
+		return r;
+	}
+	ctx->reader_drv_data = gpriv;
+	return SC_SUCCESS;
+}
+
+static int net_finish(sc_context_t *ctx)
+{
+	struct net_global_private_data *gpriv = (struct net_global_private_data *) ctx->reader_drv_data;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+	if (gpriv) {
+		net_close(gpriv);
+		sc_mutex_destroy(ctx, gpriv->mutex);
+		free(gpriv->host);
+		free(gpriv->port);
+		free(gpriv);
+		ctx->reader_drv_data = NULL;
+	}
+	return SC_SUCCESS;
+}
+
+static int net_detect_readers(sc_context_t *ctx)
+{
+	struct net_global_private_data *gpriv = (struct net_global_private_data *) ctx->reader_drv_data;
+	const u8 *p, *end;
+	size_t len;
+	unsigned int count, slot;
+	int r;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
+	if (gpriv == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_NO_READERS_FOUND);
+
+	sc_mutex_lock(ctx, gpriv->mutex);
+	r = net_send(ctx, gpriv, NET_LIST, NULL, NULL, 0);
+	if (r > 0)
+		r = net_recv(ctx, gpriv, (unsigned int)r, &p, &len);
+	if (r != SC_SUCCESS)
+		goto out;
+
+	end = p + len;
+	count = p < end ? *p++ : 0;
+	for (slot = 0; slot < count; slot++) {
+		struct net_private_data *priv;
+		sc_reader_t *reader;
+		size_t name_len;
+
+		if (end - p < 2 || (size_t)(end - p - 2) < (name_len = (p[0] << 8) | p[1])) {
+			r = SC_ERROR_UNKNOWN_DATA_RECEIVED;
+			goto out;
+		}
+		p += 2;
+		reader = calloc(1, sizeof(*reader));
+		priv = calloc(1, sizeof(*priv));
+		if (reader)
+			reader->name = malloc(name_len + 1);
+		if (reader == NULL || priv == NULL || reader->name == NULL) {
+			if (reader)
+				free(reader->name);
+			free(reader);
+			free(priv);
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
+		}
+		memcpy(reader->name, p, name_len);
+		reader->name[name_len] = '\0';
+		p += name_len;
+
+		/* Reader already available, skip */
+		if (sc_ctx_get_reader_by_name(ctx, reader->name) != NULL) {
+			free(reader->name);
+			free(reader);
+			free(priv);
+			continue;
+		}
+
+		sc_log(ctx, "Found new network reader '%s'", reader->name);
+		priv->gpriv = gpriv;
+		priv->slot = slot;
+		reader->drv_data = priv;
+		reader->ops = &net_ops;
+		reader->driver = &net_drv;
+		if (_sc_add_reader(ctx, reader)) {
+			free(reader->name);
+			free(reader);
+			free(priv);
+		}
+	}
+
+out:
+	sc_mutex_unlock(ctx, gpriv->mutex);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+static int net_release(sc_reader_t *reader)
+{
+	struct net_private_data *priv = GET_PRIV_DATA(reader);
+
+	free(priv);
+	reader->drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+static int net_detect_card_presence(sc_reader_t *reader)
+{
+	u8 reply[1];
+	size_t len = sizeof(reply);
+	int r;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	r = net_request(reader, NET_STATUS, NULL, 0, reply, &len);
+	if (r != SC_SUCCESS)
+		LOG_FUNC_RETURN(reader->ctx, r);
+	if (len < 1)
+		LOG_FUNC_RETURN(reader->ctx, SC_ERROR_UNKNOWN_DATA_RECEIVED);
+
+	reader->flags &= ~(SC_READER_CARD_PRESENT | SC_READER_CARD_CHANGED);
+	if (reply[0] & NET_CARD_PRESENT)
+		reader->flags |= SC_READER_CARD_PRESENT;
+	if (reply[0] & NET_CARD_CHANGED)
+		reader->flags |= SC_READER_CARD_CHANGED;
+	LOG_FUNC_RETURN(reader->ctx, reader->flags);
+}
+
+static int net_connect(sc_reader_t *reader)
+{
+	u8 protocols[4], reply[4 + SC_MAX_ATR_SIZE];
+	size_t len = sizeof(reply);
+	int r;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	net_put_u32(protocols, reader->supported_protocols ? reader->supported_protocols
+			: SC_PROTO_T0 | SC_PROTO_T1);
+	r = net_request(reader, NET_CONNECT, protocols, sizeof(protocols), reply, &len);
+	if (r != SC_SUCCESS)
+		LOG_FUNC_RETURN(reader->ctx, r);
+	if (len < 4)
+		LOG_FUNC_RETURN(reader->ctx, SC_ERROR_UNKNOWN_DATA_RECEIVED);
+
+	reader->active_protocol = net_get_u32(reply);
+	reader->atr.len = len - 4;
+	memcpy(reader->atr.value, reply + 4, reader->atr.len);
+	reader->flags |= SC_READER_CARD_PRESENT;
+	LOG_FUNC_RETURN(reader->ctx, SC_SUCCESS);
+}
+
+static int net_disconnect(sc_reader_t *reader)
+{
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	reader->flags = 0;
+	return net_request_deferred(reader, NET_DISCONNECT);
+}
+
+static int net_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	u8 *sbuf = NULL, *rbuf = NULL;
+	size_t ssize = 0, rsize, rbuflen;
+	int r;
+
+	rsize = rbuflen = apdu->resplen + 2;
+	rbuf = malloc(rbuflen);
+	if (rbuf == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	/* encode and log the APDU */
+	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol);
+	if (r != SC_SUCCESS)
+		goto out;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	r = net_request(reader, NET_TRANSMIT, sbuf, ssize, rbuf, &rsize);
+	if (r != SC_SUCCESS) {
+		sc_log(reader->ctx, "unable to transmit");
+		goto out;
+	}
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+out:
+	if (sbuf != NULL) {
+		sc_mem_clear(sbuf, ssize);
+		free(sbuf);
+	}
+	if (rbuf != NULL) {
+		sc_mem_clear(rbuf, rbuflen);
+		free(rbuf);
+	}
+	return r;
+}
+
+static int net_lock(sc_reader_t *reader)
+{
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	return net_request_deferred(reader, NET_LOCK);
+}
+
+static int net_unlock(sc_reader_t *reader)
+{
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	return net_request_deferred(reader, NET_UNLOCK);
+}
+
+static int net_reset(sc_reader_t *reader, int do_cold_reset)
+{
+	u8 cold = do_cold_reset ? 1 : 0;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	return net_request(reader, NET_RESET, &cold, 1, NULL, NULL);
+}
+
+struct sc_reader_driver *sc_get_net_driver(void)
+{
+	net_ops.init = net_init;
+	net_ops.finish = net_finish;
+	net_ops.detect_readers = net_detect_readers;
+	net_ops.release = net_release;
+	net_ops.detect_card_presence = net_detect_card_presence;
+	net_ops.connect = net_connect;
+	net_ops.disconnect = net_disconnect;
+	net_ops.transmit = net_transmit;
+	net_ops.lock = net_lock;
+	net_ops.unlock = net_unlock;
+	net_ops.reset = net_reset;
+	net_ops.perform_verify = NULL;
+	net_ops.perform_pace = NULL;
+	net_ops.use_reader = NULL;
+
+	return &net_drv;
+}
+
+#endif	/* ENABLE_NET_READER */
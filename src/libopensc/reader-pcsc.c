@@ -23,22 +23,39 @@
 
 #ifdef ENABLE_PCSC	/* empty file without pcsc */
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <limits.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
 #else
 #include <arpa/inet.h>
+#include <sys/time.h>
 #endif
 
 #include "common/libscdl.h"
 #include "internal.h"
 #include "internal-winscard.h"
+#include "part10.h"
 
 #include "pace.h"
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+static pthread_mutex_t feature_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define FEATURE_CACHE_LOCK()	pthread_mutex_lock(&feature_cache_lock)
+#define FEATURE_CACHE_UNLOCK()	pthread_mutex_unlock(&feature_cache_lock)
+#ifndef __APPLE__ /* OS X 10.6.2 does not support PnP notification */
+#define PCSC_MONITOR
+#endif
+#else
+#define FEATURE_CACHE_LOCK()
+#define FEATURE_CACHE_UNLOCK()
+#endif
+
 /* Logging */
 #define PCSC_TRACE(reader, desc, rv) do { sc_log(reader->ctx, "%s:" desc ": 0x%08lx\n", reader->name, rv); } while (0)
 #define PCSC_LOG(ctx, desc, rv) do { sc_log(ctx, desc ": 0x%08lx\n", rv); } while (0)
@@ -48,12 +65,19 @@
 
 #define GET_PRIV_DATA(r) ((struct pcsc_private_data *) (r)->drv_data)
 
+#define PCSC_PNP_NOTIFICATION "\\\\?PnP?\\Notification"
+
 struct pcsc_global_private_data {
 	SCARDCONTEXT pcsc_ctx;
 	SCARDCONTEXT pcsc_wait_ctx;
 	int enable_pinpad;
 	int enable_pace;
 	int connect_exclusive;
+	int warm_handoff;
+	int presence_monitor;
+	unsigned int presence_cache_time;
+	unsigned int transaction_linger_time;
+	unsigned int hotplug_settle_time;
 	DWORD disconnect_action;
 	DWORD transaction_end_action;
 	DWORD reconnect_action;
@@ -74,6 +98,15 @@ struct pcsc_global_private_data {
 	SCardTransmit_t SCardTransmit;
 	SCardListReaders_t SCardListReaders;
 	SCardGetAttrib_t SCardGetAttrib;
+
+	/* the states of the readers seen by the last pcsc_wait_for_event(),
+	 * followed by the one of the PnP notification */
+	SCARD_READERSTATE *wait_states;
+	size_t wait_states_count;
+#ifdef PCSC_MONITOR
+	/* see presence_monitor */
+	struct pcsc_monitor *monitor;
+#endif
 };
 
 struct pcsc_private_data {
@@ -95,9 +128,43 @@ struct pcsc_private_data {
 	DWORD get_tlv_properties;
 
 	int locked;
+	/* unlocked by OpenSC, but the PC/SC transaction is still held */
+	int lingering;
+	/* connected exclusively: sc_lock() is enough, no PC/SC transactions;
+	 * a reset or removal seen by a transmission is reported by the next
+	 * pcsc_lock() instead of SCardBeginTransaction() */
+	int exclusive;
+	LONG pending_rv;
+	unsigned long linger_start;
+
+	/* reader_state was refreshed together with the other readers */
+	int state_fresh;
+	LONG state_rv;
+	unsigned long state_time;
 };
 
 static int pcsc_detect_card_presence(sc_reader_t *reader);
+static int pcsc_end_lingering(sc_reader_t *reader);
+
+/*
+ * Features found by detect_reader_features(), by reader name. They are kept
+ * for the life of the process, so that a reader seen by another context or
+ * before a re-established PC/SC context is not probed again. The capabilities
+ * depend on the pinpad and PACE settings they were detected with.
+ */
+struct pcsc_reader_features {
+	char *name;
+	int enable_pinpad, enable_pace;
+	unsigned long capabilities;
+	DWORD verify_ioctl, verify_ioctl_start, verify_ioctl_finish;
+	DWORD modify_ioctl, modify_ioctl_start, modify_ioctl_finish;
+	DWORD pace_ioctl, pin_properties_ioctl, get_tlv_properties;
+	struct pcsc_reader_features *next;
+};
+
+static struct pcsc_reader_features *feature_cache = NULL;
+static int pcsc_lingering_expired(sc_reader_t *reader);
+static struct sc_reader_operations pcsc_ops;
 
 static DWORD pcsc_reset_action(const char *str)
 {
@@ -206,6 +273,11 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 
 	if (rv != SCARD_S_SUCCESS) {
 		PCSC_TRACE(reader, "SCardTransmit/Control failed", rv);
+		if (priv->exclusive && (rv == SCARD_W_RESET_CARD
+					|| rv == SCARD_W_REMOVED_CARD
+					|| rv == SCARD_E_INVALID_HANDLE
+					|| rv == SCARD_E_READER_UNAVAILABLE))
+			priv->pending_rv = rv;
 		switch (rv) {
 		case SCARD_W_REMOVED_CARD:
 			return SC_ERROR_CARD_REMOVED;
@@ -224,12 +296,55 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 	return SC_SUCCESS;
 }
 
+/* Encodes the APDU and receives the response in the reader's scratch buffer.
+ * Returns SC_ERROR_OUT_OF_MEMORY if the buffer cannot be allocated, so that
+ * the caller can fall back to the allocating path. */
+static int pcsc_transmit_scratch(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	size_t       ssize, rsize, slen;
+	u8           *buf;
+	int          r;
+
+	slen = sc_apdu_get_octets_len(apdu, reader->active_protocol);
+	if (slen == 0)
+		return SC_ERROR_INTERNAL;
+	/* see pcsc_transmit() for the size of the return buffer */
+	rsize = apdu->resplen <= 256 ? 258 : apdu->resplen + 2;
+
+	buf = _sc_reader_get_apdu_buf(reader, slen + rsize);
+	if (buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	r = sc_apdu_get_octets_buf(reader->ctx, apdu, buf, slen, &ssize, reader->active_protocol);
+	if (r != SC_SUCCESS)
+		return r;
+	if (reader->name)
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "reader '%s'", reader->name);
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, buf, ssize, 1);
+
+	r = pcsc_internal_transmit(reader, buf, ssize, buf + slen, &rsize, apdu->control);
+	if (r < 0) {
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit");
+		sc_mem_clear(buf, slen);
+		return r;
+	}
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, buf + slen, rsize, 0);
+	r = sc_apdu_set_resp(reader->ctx, apdu, buf + slen, rsize);
+
+	sc_mem_clear(buf, slen + rsize);
+	return r;
+}
+
 static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
 	size_t       ssize, rsize, rbuflen = 0;
 	u8           *sbuf = NULL, *rbuf = NULL;
 	int          r;
 
+	r = pcsc_transmit_scratch(reader, apdu);
+	if (r != SC_ERROR_OUT_OF_MEMORY)
+		return r;
+
 	/* we always use a at least 258 byte size big return buffer
 	 * to mimic the behaviour of the old implementation (some readers
 	 * seems to require a larger than necessary return buffer).
@@ -273,14 +388,21 @@ out:
 }
 
 /* Calls SCardGetStatusChange on the reader to set ATR and associated flags (card present/changed) */
-static int refresh_attributes(sc_reader_t *reader)
+static unsigned long pcsc_time_ms(void)
 {
-	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
-	int old_flags = reader->flags;
-	DWORD state, prev_state;
-	LONG rv;
+#ifdef _WIN32
+	return GetTickCount();
+#else
+	struct timeval tv;
 
-	sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "%s check", reader->name);
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+#endif
+}
+
+static void pcsc_prepare_reader_state(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
 	if (priv->reader_state.szReader == NULL) {
 		priv->reader_state.szReader = reader->name;
@@ -289,8 +411,298 @@ static int refresh_attributes(sc_reader_t *reader)
 	} else {
 		priv->reader_state.dwCurrentState = priv->reader_state.dwEventState;
 	}
+}
 
-	rv = priv->gpriv->SCardGetStatusChange(priv->gpriv->pcsc_ctx, 0, &priv->reader_state, 1);
+#ifdef PCSC_MONITOR
+/* Bound of each wait of the monitor, so that a SCardCancel() sent just
+ * before the call does not leave pcsc_monitor_stop() waiting forever */
+#define PCSC_MONITOR_TIMEOUT	1000
+
+/* With presence_monitor, a thread waits for the changes of all the readers
+ * with a blocking SCardGetStatusChange() on a PC/SC context of its own and
+ * keeps the last states seen. refresh_attributes() takes the state of a
+ * reader from there instead of asking the resource manager. */
+struct pcsc_monitor {
+	struct pcsc_global_private_data *gpriv;
+	SCARDCONTEXT hctx;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int stop;
+	/* the states last seen, valid from the first answer after the
+	 * readers were listed until an error */
+	int valid;
+	SCARD_READERSTATE *states;
+	size_t count;
+	/* the names of the readers, used by states and by the thread */
+	char *names;
+};
+
+/* Lists the readers into a new states array, followed by the PnP
+ * notification, whose state last seen is kept */
+static int pcsc_monitor_list(struct pcsc_monitor *mon, SCARD_READERSTATE **states, size_t *count)
+{
+	struct pcsc_global_private_data *gpriv = mon->gpriv;
+	SCARD_READERSTATE *rs, *snapshot;
+	DWORD len = 0;
+	char *names = NULL, *p, *old_names;
+	size_t i, n = 0;
+	LONG rv;
+
+	rv = gpriv->SCardListReaders(mon->hctx, NULL, NULL, &len);
+	if (rv == SCARD_S_SUCCESS && len > 0) {
+		names = malloc(len);
+		if (names == NULL)
+			return -1;
+		rv = gpriv->SCardListReaders(mon->hctx, NULL, names, &len);
+	}
+	if (rv == (LONG)SCARD_E_NO_READERS_AVAILABLE) {
+		free(names);
+		names = NULL;
+	} else if (rv != SCARD_S_SUCCESS) {
+		free(names);
+		return -1;
+	}
+
+	for (p = names; p != NULL && *p != '\0'; p += strlen(p) + 1)
+		n++;
+	rs = calloc(n + 1, sizeof(SCARD_READERSTATE));
+	snapshot = calloc(n + 1, sizeof(SCARD_READERSTATE));
+	if (rs == NULL || snapshot == NULL) {
+		free(rs);
+		free(snapshot);
+		free(names);
+		return -1;
+	}
+	for (i = 0, p = names; i < n; i++, p += strlen(p) + 1) {
+		rs[i].szReader = p;
+		rs[i].dwCurrentState = SCARD_STATE_UNAWARE;
+	}
+	rs[n].szReader = PCSC_PNP_NOTIFICATION;
+	rs[n].dwCurrentState = *states != NULL ? (*states)[*count].dwCurrentState : SCARD_STATE_UNAWARE;
+
+	pthread_mutex_lock(&mon->lock);
+	old_names = mon->names;
+	free(mon->states);
+	mon->names = names;
+	mon->states = snapshot;
+	mon->count = n;
+	mon->valid = 0;
+	pthread_mutex_unlock(&mon->lock);
+
+	free(old_names);
+	free(*states);
+	*states = rs;
+	*count = n;
+	return 0;
+}
+
+static void *pcsc_monitor_main(void *arg)
+{
+	struct pcsc_monitor *mon = arg;
+	SCARD_READERSTATE *states = NULL;
+	size_t i, count = 0;
+	int stop = 0;
+	LONG rv;
+
+	while (!stop) {
+		if (states == NULL || (states[count].dwEventState & SCARD_STATE_CHANGED)) {
+			/* a reader was attached or detached */
+			if (pcsc_monitor_list(mon, &states, &count) != 0)
+				break;
+		}
+		rv = mon->gpriv->SCardGetStatusChange(mon->hctx, PCSC_MONITOR_TIMEOUT, states, count + 1);
+		if (rv == (LONG)SCARD_E_TIMEOUT || rv == (LONG)SCARD_E_CANCELLED) {
+			states[count].dwEventState = 0;
+			pthread_mutex_lock(&mon->lock);
+			stop = mon->stop;
+			pthread_mutex_unlock(&mon->lock);
+			continue;
+		}
+		if (rv != SCARD_S_SUCCESS)
+			break;
+
+		pthread_mutex_lock(&mon->lock);
+		memcpy(mon->states, states, count * sizeof(SCARD_READERSTATE));
+		mon->valid = 1;
+		stop = mon->stop;
+		pthread_mutex_unlock(&mon->lock);
+		for (i = 0; i <= count; i++)
+			states[i].dwCurrentState = states[i].dwEventState & ~SCARD_STATE_CHANGED;
+	}
+
+	/* after an error, the presence is checked without the monitor */
+	pthread_mutex_lock(&mon->lock);
+	mon->valid = 0;
+	pthread_mutex_unlock(&mon->lock);
+	free(states);
+	return NULL;
+}
+
+static void pcsc_monitor_start(sc_context_t *ctx, struct pcsc_global_private_data *gpriv)
+{
+	struct pcsc_monitor *mon;
+	LONG rv;
+
+	mon = calloc(1, sizeof(struct pcsc_monitor));
+	if (mon == NULL)
+		return;
+	mon->gpriv = gpriv;
+	rv = gpriv->SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &mon->hctx);
+	if (rv != SCARD_S_SUCCESS) {
+		PCSC_LOG(ctx, "SCardEstablishContext(monitor) failed", rv);
+		free(mon);
+		return;
+	}
+	pthread_mutex_init(&mon->lock, NULL);
+	if (pthread_create(&mon->thread, NULL, pcsc_monitor_main, mon) != 0) {
+		sc_log(ctx, "cannot start the reader monitor thread");
+		gpriv->SCardReleaseContext(mon->hctx);
+		pthread_mutex_destroy(&mon->lock);
+		free(mon);
+		return;
+	}
+	gpriv->monitor = mon;
+	sc_log(ctx, "reader monitor thread started");
+}
+
+static void pcsc_monitor_stop(struct pcsc_global_private_data *gpriv)
+{
+	struct pcsc_monitor *mon = gpriv->monitor;
+
+	if (mon == NULL)
+		return;
+	pthread_mutex_lock(&mon->lock);
+	mon->stop = 1;
+	pthread_mutex_unlock(&mon->lock);
+	gpriv->SCardCancel(mon->hctx);
+	pthread_join(mon->thread, NULL);
+
+	gpriv->monitor = NULL;
+	gpriv->SCardReleaseContext(mon->hctx);
+	pthread_mutex_destroy(&mon->lock);
+	free(mon->states);
+	free(mon->names);
+	free(mon);
+}
+
+static int pcsc_monitor_valid(struct pcsc_global_private_data *gpriv)
+{
+	struct pcsc_monitor *mon = gpriv->monitor;
+	int valid;
+
+	if (mon == NULL)
+		return 0;
+	pthread_mutex_lock(&mon->lock);
+	valid = mon->valid;
+	pthread_mutex_unlock(&mon->lock);
+	return valid;
+}
+
+/* Sets the reader state from the one last seen by the monitor, as
+ * SCardGetStatusChange() would. 0 if the monitor has none. */
+static int pcsc_monitor_get_state(struct pcsc_global_private_data *gpriv, sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	struct pcsc_monitor *mon = gpriv->monitor;
+	size_t i;
+	int found = 0;
+
+	if (mon == NULL)
+		return 0;
+	pthread_mutex_lock(&mon->lock);
+	for (i = 0; mon->valid && i < mon->count; i++) {
+		const SCARD_READERSTATE *rs = &mon->states[i];
+
+		if (strcmp(rs->szReader, reader->name) != 0)
+			continue;
+		pcsc_prepare_reader_state(reader);
+		priv->reader_state.dwEventState = rs->dwEventState & ~SCARD_STATE_CHANGED;
+		if (priv->reader_state.dwEventState
+				!= (priv->reader_state.dwCurrentState & ~SCARD_STATE_CHANGED))
+			priv->reader_state.dwEventState |= SCARD_STATE_CHANGED;
+		priv->reader_state.cbAtr = MIN(rs->cbAtr, sizeof(priv->reader_state.rgbAtr));
+		memcpy(priv->reader_state.rgbAtr, rs->rgbAtr, priv->reader_state.cbAtr);
+		found = 1;
+		break;
+	}
+	pthread_mutex_unlock(&mon->lock);
+	return found;
+}
+#else
+#define pcsc_monitor_valid(gpriv)		0
+#define pcsc_monitor_get_state(gpriv, reader)	0
+#endif
+
+/* Ask for the state of all the PC/SC readers with one SCardGetStatusChange().
+ * Each reader then uses its part of the result once in refresh_attributes(),
+ * so a sweep over all the readers costs one round trip to the resource manager. */
+static void pcsc_refresh_all_states(sc_context_t *ctx, struct pcsc_global_private_data *gpriv)
+{
+	SCARD_READERSTATE *states;
+	sc_reader_t **readers;
+	unsigned int i, count = 0, nreaders = sc_ctx_get_reader_count(ctx);
+	unsigned long now;
+	LONG rv;
+
+	if (nreaders == 0)
+		return;
+	states = calloc(nreaders, sizeof(SCARD_READERSTATE));
+	readers = calloc(nreaders, sizeof(sc_reader_t *));
+	if (states == NULL || readers == NULL)
+		goto out;
+
+	for (i = 0; i < nreaders; i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+
+		if (reader == NULL || reader->ops != &pcsc_ops || GET_PRIV_DATA(reader) == NULL)
+			continue;
+		pcsc_prepare_reader_state(reader);
+		states[count] = GET_PRIV_DATA(reader)->reader_state;
+		readers[count++] = reader;
+	}
+	if (count == 0)
+		goto out;
+
+	rv = gpriv->SCardGetStatusChange(gpriv->pcsc_ctx, 0, states, count);
+	if (rv != SCARD_S_SUCCESS && rv != (LONG)SCARD_E_TIMEOUT) {
+		PCSC_LOG(ctx, "SCardGetStatusChange failed", rv);
+		goto out;
+	}
+
+	now = pcsc_time_ms();
+	for (i = 0; i < count; i++) {
+		struct pcsc_private_data *priv = GET_PRIV_DATA(readers[i]);
+
+		if (rv == SCARD_S_SUCCESS)
+			priv->reader_state = states[i];
+		priv->state_rv = rv;
+		priv->state_time = now;
+		priv->state_fresh = 1;
+	}
+out:
+	free(states);
+	free(readers);
+}
+
+static int refresh_attributes(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	int old_flags = reader->flags;
+	DWORD state, prev_state;
+	LONG rv;
+
+	sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "%s check", reader->name);
+
+	if (pcsc_monitor_get_state(priv->gpriv, reader)) {
+		rv = SCARD_S_SUCCESS;
+	} else if (priv->state_fresh
+			&& pcsc_time_ms() - priv->state_time <= priv->gpriv->presence_cache_time) {
+		rv = priv->state_rv;
+	} else {
+		pcsc_prepare_reader_state(reader);
+		rv = priv->gpriv->SCardGetStatusChange(priv->gpriv->pcsc_ctx, 0, &priv->reader_state, 1);
+	}
+	priv->state_fresh = 0;
 
 	if (rv != SCARD_S_SUCCESS) {
 		if (rv == (LONG)SCARD_E_TIMEOUT) {
@@ -318,6 +730,9 @@ static int refresh_attributes(sc_reader_t *reader)
 
 	reader->flags &= ~(SC_READER_CARD_CHANGED|SC_READER_CARD_INUSE|SC_READER_CARD_EXCLUSIVE);
 
+	/* the upper 16 bits count the card insertions and removals */
+	reader->card_events = (state >> 16) & 0xFFFF;
+
 	if (state & SCARD_STATE_PRESENT) {
 		reader->flags |= SC_READER_CARD_PRESENT;
 
@@ -366,9 +781,17 @@ static int refresh_attributes(sc_reader_t *reader)
 
 static int pcsc_detect_card_presence(sc_reader_t *reader)
 {
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 	int rv;
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+	if (priv->lingering && pcsc_lingering_expired(reader))
+		pcsc_end_lingering(reader);
+
+	if (priv->gpriv->presence_cache_time && !priv->state_fresh
+			&& !pcsc_monitor_valid(priv->gpriv))
+		pcsc_refresh_all_states(reader->ctx, priv->gpriv);
+
 	rv = refresh_attributes(reader);
 	if (rv != SC_SUCCESS)
 		SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_VERBOSE, rv);
@@ -425,6 +848,8 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 
 	/* reconnect always unlocks transaction */
 	priv->locked = 0;
+	priv->lingering = 0;
+	priv->pending_rv = SCARD_S_SUCCESS;
 
 	rv = priv->gpriv->SCardReconnect(priv->pcsc_card,
 			    priv->gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
@@ -439,6 +864,42 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 	return pcsc_to_opensc_error(rv);
 }
 
+/* Ask the reader for the largest APDU it accepts (e.g. dwMaxCCIDMessageLength
+ * of the CCID driver). Without an answer the reader limits stay unknown. */
+static void pcsc_detect_max_sizes(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	DWORD max_input = 0;
+	DWORD attr_len = sizeof(max_input);
+	LONG rv;
+
+	reader->max_send_size = 0;
+	reader->max_recv_size = 0;
+	reader->capabilities &= ~SC_READER_CAP_EXT_APDU;
+
+	if (priv->gpriv->SCardGetAttrib == NULL)
+		return;
+
+	rv = priv->gpriv->SCardGetAttrib(priv->pcsc_card, SCARD_ATTR_MAXINPUT,
+			(LPBYTE)&max_input, &attr_len);
+	if (rv != SCARD_S_SUCCESS || attr_len != sizeof(max_input)) {
+		PCSC_TRACE(reader, "SCardGetAttrib(SCARD_ATTR_MAXINPUT) failed", rv);
+		return;
+	}
+
+	/* command: header, 3 bytes Lc and 2 bytes Le; response: SW1 SW2 */
+	if (max_input > 9) {
+		reader->max_send_size = max_input - 9;
+		reader->max_recv_size = max_input - 2;
+	}
+	/* the IFD handler passes extended APDUs as a whole */
+	if (reader->max_send_size > 255)
+		reader->capabilities |= SC_READER_CAP_EXT_APDU;
+	sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "Reader max input %lu, max_send/recv_size %lu/%lu",
+			(unsigned long)max_input, (unsigned long)reader->max_send_size,
+			(unsigned long)reader->max_recv_size);
+}
+
 static int pcsc_connect(sc_reader_t *reader)
 {
 	DWORD active_proto, tmp, protocol = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
@@ -493,16 +954,48 @@ static int pcsc_connect(sc_reader_t *reader)
 
 	/* After connect reader is not locked yet */
 	priv->locked = 0;
+	priv->exclusive = priv->gpriv->connect_exclusive
+		&& priv->gpriv->transaction_end_action == SCARD_LEAVE_CARD;
+	priv->pending_rv = SCARD_S_SUCCESS;
+
+	pcsc_detect_max_sizes(reader);
 
 	return SC_SUCCESS;
 }
 
+/* End the transaction kept after the last pcsc_unlock(), if any */
+static int pcsc_end_lingering(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	LONG rv;
+
+	if (!priv->lingering)
+		return SC_SUCCESS;
+
+	priv->lingering = 0;
+	priv->locked = 0;
+	rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
+	if (rv != SCARD_S_SUCCESS) {
+		PCSC_TRACE(reader, "SCardEndTransaction failed", rv);
+		return pcsc_to_opensc_error(rv);
+	}
+	return SC_SUCCESS;
+}
+
+static int pcsc_lingering_expired(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+
+	return pcsc_time_ms() - priv->linger_start > priv->gpriv->transaction_linger_time;
+}
+
 static int pcsc_disconnect(sc_reader_t * reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+	pcsc_end_lingering(reader);
 	priv->gpriv->SCardDisconnect(priv->pcsc_card, priv->gpriv->disconnect_action);
 	reader->flags = 0;
 	return SC_SUCCESS;
@@ -516,7 +1009,22 @@ static int pcsc_lock(sc_reader_t *reader)
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
-	rv = priv->gpriv->SCardBeginTransaction(priv->pcsc_card);
+	if (priv->lingering) {
+		if (!pcsc_lingering_expired(reader)) {
+			/* still in the transaction of the previous lock */
+			priv->lingering = 0;
+			return SC_SUCCESS;
+		}
+		pcsc_end_lingering(reader);
+	}
+
+	if (priv->exclusive) {
+		/* nobody else has the card, sc_lock() serializes this process */
+		rv = priv->pending_rv;
+		priv->pending_rv = SCARD_S_SUCCESS;
+	} else {
+		rv = priv->gpriv->SCardBeginTransaction(priv->pcsc_card);
+	}
 
 	switch (rv) {
 		case SCARD_E_INVALID_HANDLE:
@@ -553,6 +1061,18 @@ static int pcsc_unlock(sc_reader_t *reader)
 
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
+	if (priv->exclusive) {
+		priv->locked = 0;
+		return SC_SUCCESS;
+	}
+
+	/* keep the transaction for a following pcsc_lock(), see transaction_linger_time */
+	if (priv->gpriv->transaction_linger_time && priv->locked) {
+		priv->lingering = 1;
+		priv->linger_start = pcsc_time_ms();
+		return SC_SUCCESS;
+	}
+
 	rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
 
 	priv->locked = 0;
@@ -575,7 +1095,7 @@ static int pcsc_reset(sc_reader_t *reader, int do_cold_reset)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 	int r;
-	int old_locked = priv->locked;
+	int old_locked = priv->locked && !priv->lingering;
 
 	r = pcsc_reconnect(reader, do_cold_reset ? SCARD_UNPOWER_CARD : SCARD_RESET_CARD);
 	if(r != SC_SUCCESS)
@@ -598,9 +1118,12 @@ static int pcsc_cancel(sc_context_t *ctx)
 #ifndef _WIN32
 	if (gpriv->pcsc_wait_ctx != -1) {
 		rv = gpriv->SCardCancel(gpriv->pcsc_wait_ctx);
-		if (rv == SCARD_S_SUCCESS)
-			 /* Also close and clear the waiting context */
-			 rv = gpriv->SCardReleaseContext(gpriv->pcsc_wait_ctx);
+		if (rv == SCARD_S_SUCCESS) {
+			/* Also close and clear the waiting context */
+			rv = gpriv->SCardReleaseContext(gpriv->pcsc_wait_ctx);
+			if (rv == SCARD_S_SUCCESS)
+				gpriv->pcsc_wait_ctx = -1;
+		}
 	}
 #else
 	rv = gpriv->SCardCancel(gpriv->pcsc_ctx);
@@ -641,6 +1164,8 @@ static int pcsc_init(sc_context_t *ctx)
 	gpriv->reconnect_action = SCARD_LEAVE_CARD;
 	gpriv->enable_pinpad = 1;
 	gpriv->enable_pace = 1;
+	gpriv->presence_cache_time = 500;
+	gpriv->hotplug_settle_time = 200;
 	gpriv->provider_library = DEFAULT_PCSC_PROVIDER;
 	gpriv->pcsc_ctx = -1;
 	gpriv->pcsc_wait_ctx = -1;
@@ -649,8 +1174,11 @@ static int pcsc_init(sc_context_t *ctx)
 	if (conf_block) {
 		gpriv->connect_exclusive =
 		    scconf_get_bool(conf_block, "connect_exclusive", gpriv->connect_exclusive);
+		gpriv->warm_handoff =
+		    scconf_get_bool(conf_block, "warm_handoff", gpriv->warm_handoff);
 		gpriv->disconnect_action =
-		    pcsc_reset_action(scconf_get_str(conf_block, "disconnect_action", "reset"));
+		    pcsc_reset_action(scconf_get_str(conf_block, "disconnect_action",
+				    gpriv->warm_handoff ? "leave" : "reset"));
 		gpriv->transaction_end_action =
 		    pcsc_reset_action(scconf_get_str(conf_block, "transaction_end_action", "leave"));
 		gpriv->reconnect_action =
@@ -659,11 +1187,25 @@ static int pcsc_init(sc_context_t *ctx)
 		    scconf_get_bool(conf_block, "enable_pinpad", gpriv->enable_pinpad);
 		gpriv->enable_pace =
 		    scconf_get_bool(conf_block, "enable_pace", gpriv->enable_pace);
+		gpriv->presence_monitor =
+		    scconf_get_bool(conf_block, "presence_monitor", gpriv->presence_monitor);
+		gpriv->presence_cache_time =
+		    scconf_get_int(conf_block, "presence_cache_time", gpriv->presence_cache_time);
+		gpriv->transaction_linger_time =
+		    scconf_get_int(conf_block, "transaction_linger_time", gpriv->transaction_linger_time);
+		gpriv->hotplug_settle_time =
+		    scconf_get_int(conf_block, "hotplug_settle_time", gpriv->hotplug_settle_time);
 		gpriv->provider_library =
 		    scconf_get_str(conf_block, "provider_library", gpriv->provider_library);
 	}
-	sc_log(ctx, "PC/SC options: connect_exclusive=%d disconnect_action=%d transaction_end_action=%d reconnect_action=%d enable_pinpad=%d enable_pace=%d",
-		gpriv->connect_exclusive, gpriv->disconnect_action, gpriv->transaction_end_action, gpriv->reconnect_action, gpriv->enable_pinpad, gpriv->enable_pace);
+	/* a lingering transaction would skip the reset at the end of each transaction */
+	if (gpriv->transaction_end_action != SCARD_LEAVE_CARD)
+		gpriv->transaction_linger_time = 0;
+	/* the next process takes over only a card nobody reset */
+	if (gpriv->disconnect_action != SCARD_LEAVE_CARD)
+		gpriv->warm_handoff = 0;
+	sc_log(ctx, "PC/SC options: connect_exclusive=%d warm_handoff=%d disconnect_action=%d transaction_end_action=%d reconnect_action=%d enable_pinpad=%d enable_pace=%d presence_monitor=%d presence_cache_time=%u transaction_linger_time=%u hotplug_settle_time=%u",
+		gpriv->connect_exclusive, gpriv->warm_handoff, gpriv->disconnect_action, gpriv->transaction_end_action, gpriv->reconnect_action, gpriv->enable_pinpad, gpriv->enable_pace, gpriv->presence_monitor, gpriv->presence_cache_time, gpriv->transaction_linger_time, gpriv->hotplug_settle_time);
 
 	gpriv->dlhandle = sc_dlopen(gpriv->provider_library);
 	if (gpriv->dlhandle == NULL) {
@@ -694,7 +1236,8 @@ static int pcsc_init(sc_context_t *ctx)
 		gpriv->SCardListReaders = (SCardListReaders_t)sc_dlsym(gpriv->dlhandle, "SCardListReadersA");
 
 	/* If we have SCardGetAttrib it is correct API */
-	if (sc_dlsym(gpriv->dlhandle, "SCardGetAttrib") != NULL) {
+	gpriv->SCardGetAttrib = (SCardGetAttrib_t)sc_dlsym(gpriv->dlhandle, "SCardGetAttrib");
+	if (gpriv->SCardGetAttrib != NULL) {
 #ifdef __APPLE__
 		gpriv->SCardControl = (SCardControl_t)sc_dlsym(gpriv->dlhandle, "SCardControl132");
 #endif
@@ -724,6 +1267,10 @@ static int pcsc_init(sc_context_t *ctx)
 		goto out;
 	}
 
+#ifdef PCSC_MONITOR
+	if (gpriv->presence_monitor)
+		pcsc_monitor_start(ctx, gpriv);
+#endif
 	ctx->reader_drv_data = gpriv;
 	gpriv = NULL;
 	ret = SC_SUCCESS;
@@ -732,6 +1279,7 @@ out:
 	if (gpriv != NULL) {
 		if (gpriv->dlhandle != NULL)
 			sc_dlclose(gpriv->dlhandle);
+		free(gpriv->wait_states);
 		free(gpriv);
 	}
 
@@ -745,6 +1293,9 @@ static int pcsc_finish(sc_context_t *ctx)
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
 
 	if (gpriv) {
+#ifdef PCSC_MONITOR
+		pcsc_monitor_stop(gpriv);
+#endif
 		if (gpriv->pcsc_ctx != -1)
 			gpriv->SCardReleaseContext(gpriv->pcsc_ctx);
 		if (gpriv->dlhandle != NULL)
@@ -810,7 +1361,7 @@ err:
     return flags;
 }
 
-static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle) {
+static int detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle) {
 	sc_context_t *ctx = reader->ctx;
 	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
@@ -824,17 +1375,17 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
 
 	if (gpriv->SCardControl == NULL)
-		return;
+		return SC_ERROR_NOT_SUPPORTED;
 
 	rv = gpriv->SCardControl(card_handle, CM_IOCTL_GET_FEATURE_REQUEST, NULL, 0, feature_buf, sizeof(feature_buf), &feature_len);
 	if (rv != (LONG)SCARD_S_SUCCESS) {
 		PCSC_TRACE(reader, "SCardControl failed", rv);
-		return;
+		return pcsc_to_opensc_error(rv);
 	}
 
 	if ((feature_len % sizeof(PCSC_TLV_STRUCTURE)) != 0) {
 		sc_log(ctx, "Inconsistent TLV from reader!");
-		return;
+		return SC_ERROR_INVALID_DATA;
 	}
 
 	/* get the number of elements instead of the complete size */
@@ -933,6 +1484,194 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 			sc_log(ctx, "%s %s", log_text, log_disabled);
 		}
 	}
+
+	return SC_SUCCESS;
+}
+
+static int get_cached_features(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	struct pcsc_reader_features *f;
+
+	FEATURE_CACHE_LOCK();
+	for (f = feature_cache; f != NULL; f = f->next) {
+		if (f->enable_pinpad == priv->gpriv->enable_pinpad
+				&& f->enable_pace == priv->gpriv->enable_pace
+				&& !strcmp(f->name, reader->name))
+			break;
+	}
+	if (f != NULL) {
+		reader->capabilities |= f->capabilities;
+		priv->verify_ioctl = f->verify_ioctl;
+		priv->verify_ioctl_start = f->verify_ioctl_start;
+		priv->verify_ioctl_finish = f->verify_ioctl_finish;
+		priv->modify_ioctl = f->modify_ioctl;
+		priv->modify_ioctl_start = f->modify_ioctl_start;
+		priv->modify_ioctl_finish = f->modify_ioctl_finish;
+		priv->pace_ioctl = f->pace_ioctl;
+		priv->pin_properties_ioctl = f->pin_properties_ioctl;
+		priv->get_tlv_properties = f->get_tlv_properties;
+	}
+	FEATURE_CACHE_UNLOCK();
+	return f != NULL;
+}
+
+static void set_cached_features(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	struct pcsc_reader_features *f;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return;
+	f->name = strdup(reader->name);
+	if (f->name == NULL) {
+		free(f);
+		return;
+	}
+	f->enable_pinpad = priv->gpriv->enable_pinpad;
+	f->enable_pace = priv->gpriv->enable_pace;
+	f->capabilities = reader->capabilities;
+	f->verify_ioctl = priv->verify_ioctl;
+	f->verify_ioctl_start = priv->verify_ioctl_start;
+	f->verify_ioctl_finish = priv->verify_ioctl_finish;
+	f->modify_ioctl = priv->modify_ioctl;
+	f->modify_ioctl_start = priv->modify_ioctl_start;
+	f->modify_ioctl_finish = priv->modify_ioctl_finish;
+	f->pace_ioctl = priv->pace_ioctl;
+	f->pin_properties_ioctl = priv->pin_properties_ioctl;
+	f->get_tlv_properties = priv->get_tlv_properties;
+
+	FEATURE_CACHE_LOCK();
+	f->next = feature_cache;
+	feature_cache = f;
+	FEATURE_CACHE_UNLOCK();
+}
+
+/*
+ * The features are also kept in "<cache_dir>/pcsc-<reader>.features", so
+ * that a new process does not ask the reader again. The reader name of
+ * pcsc-lite holds the model and the serial number of the device; the
+ * firmware can only be asked for with a connection, which is what the file
+ * saves. Needs use_driver_cache.
+ */
+#define PCSC_FEATURES_MAGIC	"OSCPCSC1"
+
+static int features_filename(sc_reader_t *reader, char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	size_t i, len;
+	int r;
+
+	if (!reader->ctx->use_driver_cache)
+		return SC_ERROR_NOT_SUPPORTED;
+	r = sc_get_cache_dir(reader->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/pcsc-", dir);
+	if (r < 0 || (size_t)r + strlen(reader->name) + sizeof(".features") > bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	len = r;
+	for (i = 0; reader->name[i]; i++) {
+		char c = reader->name[i];
+
+		buf[len++] = ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+				|| (c >= '0' && c <= '9') || c == '-') ? c : '_';
+	}
+	strcpy(buf + len, ".features");
+	return SC_SUCCESS;
+}
+
+static int load_features_file(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	char fname[PATH_MAX], magic[9];
+	unsigned long v[12];
+	FILE *f;
+	int n;
+
+	if (features_filename(reader, fname, sizeof(fname)) != SC_SUCCESS)
+		return 0;
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return 0;
+	n = fscanf(f, "%8s %lu %lu %lx %lx %lx %lx %lx %lx %lx %lx %lx %lx", magic,
+			&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9], &v[10], &v[11]);
+	fclose(f);
+	if (n != 13 || strcmp(magic, PCSC_FEATURES_MAGIC)
+			|| v[0] != (unsigned long)priv->gpriv->enable_pinpad
+			|| v[1] != (unsigned long)priv->gpriv->enable_pace)
+		return 0;
+	_sc_cache_used(reader->ctx, fname);
+
+	reader->capabilities |= v[2];
+	priv->verify_ioctl = v[3];
+	priv->verify_ioctl_start = v[4];
+	priv->verify_ioctl_finish = v[5];
+	priv->modify_ioctl = v[6];
+	priv->modify_ioctl_start = v[7];
+	priv->modify_ioctl_finish = v[8];
+	priv->pace_ioctl = v[9];
+	priv->pin_properties_ioctl = v[10];
+	priv->get_tlv_properties = v[11];
+	return 1;
+}
+
+static void save_features_file(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+	char fname[PATH_MAX];
+	FILE *f;
+
+	if (features_filename(reader, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	f = fopen(fname, "w");
+	if (f == NULL && sc_make_cache_dir(reader->ctx) == SC_SUCCESS)
+		f = fopen(fname, "w");
+	if (f == NULL) {
+		sc_log(reader->ctx, "cannot write '%s'", fname);
+		return;
+	}
+	fprintf(f, "%s %d %d %lx %lx %lx %lx %lx %lx %lx %lx %lx %lx\n", PCSC_FEATURES_MAGIC,
+			priv->gpriv->enable_pinpad, priv->gpriv->enable_pace,
+			reader->capabilities & (SC_READER_CAP_DISPLAY | SC_READER_CAP_PIN_PAD
+				| SC_READER_CAP_PACE_EID | SC_READER_CAP_PACE_ESIGN
+				| SC_READER_CAP_PACE_DESTROY_CHANNEL | SC_READER_CAP_PACE_GENERIC),
+			(unsigned long)priv->verify_ioctl, (unsigned long)priv->verify_ioctl_start,
+			(unsigned long)priv->verify_ioctl_finish, (unsigned long)priv->modify_ioctl,
+			(unsigned long)priv->modify_ioctl_start, (unsigned long)priv->modify_ioctl_finish,
+			(unsigned long)priv->pace_ioctl, (unsigned long)priv->pin_properties_ioctl,
+			(unsigned long)priv->get_tlv_properties);
+	fclose(f);
+	_sc_cache_used(reader->ctx, fname);
+}
+
+/* Waits until no reader was attached or detached for hotplug_settle_time,
+ * at most ten times that, so that a burst of PnP events (a hub with many
+ * readers resetting) is taken in as one change of the reader list.
+ * pnp is the state of the PnP notification, as last seen by the caller. */
+static void pcsc_wait_hotplug_settled(sc_context_t *ctx,
+		struct pcsc_global_private_data *gpriv, SCARDCONTEXT hctx,
+		SCARD_READERSTATE *pnp)
+{
+#ifndef __APPLE__ /* OS X 10.6.2 does not support PnP notification */
+	unsigned long start = pcsc_time_ms();
+	unsigned int events = 0;
+	LONG rv;
+
+	if (!gpriv->hotplug_settle_time)
+		return;
+
+	while (pcsc_time_ms() - start < 10UL * gpriv->hotplug_settle_time) {
+		rv = gpriv->SCardGetStatusChange(hctx, gpriv->hotplug_settle_time, pnp, 1);
+		if (rv != SCARD_S_SUCCESS)
+			break;
+		pnp->dwCurrentState = pnp->dwEventState & ~SCARD_STATE_CHANGED;
+		events++;
+	}
+	if (events)
+		sc_log(ctx, "%u more hotplug events in %lu ms", events, pcsc_time_ms() - start);
+#endif
 }
 
 static int pcsc_detect_readers(sc_context_t *ctx)
@@ -1001,25 +1740,49 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 		ret = pcsc_to_opensc_error(rv);
 		goto out;
 	}
-	for (reader_name = reader_buf; *reader_name != '\x0'; reader_name += strlen(reader_name) + 1) {
-		sc_reader_t *reader = NULL;
-		struct pcsc_private_data *priv = NULL;
-		unsigned int i;
-		int found = 0;
-
-		for (i=0;i < sc_ctx_get_reader_count(ctx) && !found;i++) {
-			sc_reader_t *reader2 = sc_ctx_get_reader(ctx, i);
-			if (reader2 == NULL) {
-				ret = SC_ERROR_INTERNAL;
-				goto err1;
+
+	/* A reader appeared while others are known: let the hotplug settle
+	 * and list again, to add all of the readers at once instead of
+	 * probing the intermediate states */
+	if (gpriv->hotplug_settle_time && sc_ctx_get_reader_count(ctx) > 0) {
+		for (reader_name = reader_buf; *reader_name != '\x0'; reader_name += strlen(reader_name) + 1)
+			if (sc_ctx_get_reader_by_name(ctx, reader_name) == NULL)
+				break;
+		if (*reader_name != '\x0') {
+			SCARD_READERSTATE pnp;
+			char *settled_buf;
+
+			memset(&pnp, 0, sizeof(pnp));
+			pnp.szReader = PCSC_PNP_NOTIFICATION;
+			pnp.dwCurrentState = SCARD_STATE_UNAWARE;
+			if (gpriv->SCardGetStatusChange(gpriv->pcsc_ctx, 0, &pnp, 1) == SCARD_S_SUCCESS) {
+				pnp.dwCurrentState = pnp.dwEventState & ~SCARD_STATE_CHANGED;
+				pcsc_wait_hotplug_settled(ctx, gpriv, gpriv->pcsc_ctx, &pnp);
 			}
-			if (!strcmp(reader2->name, reader_name)) {
-				found = 1;
+
+			/* keep the first list if the readers cannot be listed again */
+			reader_buf_size = 0;
+			rv = gpriv->SCardListReaders(gpriv->pcsc_ctx, mszGroups, NULL,
+					(LPDWORD) &reader_buf_size);
+			settled_buf = rv == SCARD_S_SUCCESS ? malloc(reader_buf_size) : NULL;
+			if (settled_buf != NULL
+					&& gpriv->SCardListReaders(gpriv->pcsc_ctx, mszGroups, settled_buf,
+						(LPDWORD) &reader_buf_size) == SCARD_S_SUCCESS) {
+				free(reader_buf);
+				reader_buf = settled_buf;
+			} else {
+				free(settled_buf);
 			}
 		}
+	}
+
+	for (reader_name = reader_buf; *reader_name != '\x0'; reader_name += strlen(reader_name) + 1) {
+		sc_reader_t *reader = NULL;
+		struct pcsc_private_data *priv = NULL;
+		int r;
 
 		/* Reader already available, skip */
-		if (found) {
+		if (sc_ctx_get_reader_by_name(ctx, reader_name) != NULL) {
 			continue;
 		}
 
@@ -1037,6 +1800,8 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 		reader->drv_data = priv;
 		reader->ops = &pcsc_ops;
 		reader->driver = &pcsc_drv;
+		if (gpriv->warm_handoff)
+			reader->capabilities |= SC_READER_CAP_WARM_HANDOFF;
 		if ((reader->name = strdup(reader_name)) == NULL) {
 			ret = SC_ERROR_OUT_OF_MEMORY;
 			goto err1;
@@ -1050,7 +1815,12 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 		refresh_attributes(reader);
 
 		/* check for pinpad support early, to allow opensc-tool -l display accurate information */
-		if (gpriv->SCardControl != NULL) {
+		if (gpriv->SCardControl != NULL && get_cached_features(reader)) {
+			sc_log(ctx, "Using the known features of the reader");
+		} else if (gpriv->SCardControl != NULL && load_features_file(reader)) {
+			sc_log(ctx, "Using the features of the reader from the cache");
+			set_cached_features(reader);
+		} else if (gpriv->SCardControl != NULL) {
 			if (priv->reader_state.dwEventState & SCARD_STATE_EXCLUSIVE)
 				continue;
 
@@ -1072,8 +1842,12 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 			}
 
 			if (rv == SCARD_S_SUCCESS) {
-				detect_reader_features(reader, card_handle);
+				r = detect_reader_features(reader, card_handle);
 				gpriv->SCardDisconnect(card_handle, SCARD_LEAVE_CARD);
+				if (r == SC_SUCCESS) {
+					set_cached_features(reader);
+					save_features_file(reader);
+				}
 			}
 		}
 
@@ -1102,7 +1876,58 @@ out:
 }
 
 
+/* Brings the reader states kept for pcsc_wait_for_event() in line with the
+ * readers of the context. The states of the known readers are kept, so that
+ * a wait resumes from what the last one saw; new readers start unaware.
+ * The names are those of the readers, which stay with the context until
+ * it is released. */
+static int pcsc_update_wait_states(sc_context_t *ctx, struct pcsc_global_private_data *gpriv)
+{
+	SCARD_READERSTATE *states;
+	size_t count = sc_ctx_get_reader_count(ctx), i, j;
+
+	if (gpriv->wait_states && gpriv->wait_states_count == count) {
+		for (i = 0; i < count; i++)
+			if (gpriv->wait_states[i].szReader != sc_ctx_get_reader(ctx, i)->name)
+				break;
+		if (i == count)
+			return SC_SUCCESS;
+	}
+
+	states = calloc(count + 1, sizeof(SCARD_READERSTATE));
+	if (!states)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (i = 0; i < count; i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+
+		states[i].dwCurrentState = SCARD_STATE_UNAWARE;
+		states[i].dwEventState = SCARD_STATE_UNAWARE;
+		for (j = 0; gpriv->wait_states && j < gpriv->wait_states_count; j++)
+			if (!strcmp(gpriv->wait_states[j].szReader, reader->name)) {
+				states[i] = gpriv->wait_states[j];
+				break;
+			}
+		states[i].szReader = reader->name;
+		sc_log(ctx, "%s reader '%s'", j < gpriv->wait_states_count ? "re-use" : "watch",
+				reader->name);
+	}
+	if (gpriv->wait_states) {
+		states[count] = gpriv->wait_states[gpriv->wait_states_count];
+	} else {
+		states[count].dwCurrentState = SCARD_STATE_UNAWARE;
+		states[count].dwEventState = SCARD_STATE_UNAWARE;
+	}
+	states[count].szReader = PCSC_PNP_NOTIFICATION;
+
+	free(gpriv->wait_states);
+	gpriv->wait_states = states;
+	gpriv->wait_states_count = count;
+	return SC_SUCCESS;
+}
+
 /* Wait for an event to occur.
+ * The reader states are kept by the context between the calls, 'reader_states'
+ * is not used any more.
  */
 static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_reader_t **event_reader, unsigned int *event,
 			       int timeout, void **reader_states)
@@ -1117,40 +1942,22 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
 
-	if (!event_reader && !event && reader_states)   {
-		sc_log(ctx, "free allocated reader states");
-		free(*reader_states);
-		*reader_states = NULL;
+	if (!event_reader && !event)
 		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
-	}
-
-	if (reader_states == NULL || *reader_states == NULL) {
-		rgReaderStates = calloc(sc_ctx_get_reader_count(ctx) + 2, sizeof(SCARD_READERSTATE));
-		if (!rgReaderStates)
-			SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY);
+	if (!event_reader || !event)
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_INTERNAL);
 
-		/* Find out the current status */
-		num_watch = sc_ctx_get_reader_count(ctx);
-		sc_log(ctx, "Trying to watch %d readers", num_watch);
-		for (i = 0; i < num_watch; i++) {
-			rgReaderStates[i].szReader = sc_ctx_get_reader(ctx, i)->name;
-			rgReaderStates[i].dwCurrentState = SCARD_STATE_UNAWARE;
-			rgReaderStates[i].dwEventState = SCARD_STATE_UNAWARE;
-		}
+	r = pcsc_update_wait_states(ctx, gpriv);
+	if (r != SC_SUCCESS)
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, r);
+	rgReaderStates = gpriv->wait_states;
+	num_watch = gpriv->wait_states_count;
+	sc_log(ctx, "Trying to watch %d readers", num_watch);
 #ifndef __APPLE__ /* OS X 10.6.2 does not support PnP notification */
-		if (event_mask & SC_EVENT_READER_ATTACHED) {
-			rgReaderStates[i].szReader = "\\\\?PnP?\\Notification";
-			rgReaderStates[i].dwCurrentState = SCARD_STATE_UNAWARE;
-			rgReaderStates[i].dwEventState = SCARD_STATE_UNAWARE;
-			num_watch++;
-		}
+	if (event_mask & SC_EVENT_READER_ATTACHED)
+		num_watch++;
 #endif
-	}
-	else {
-		rgReaderStates = (SCARD_READERSTATE *)(*reader_states);
-		for (num_watch = 0; rgReaderStates[num_watch].szReader; num_watch++)
-			sc_log(ctx, "re-use reader '%s'", rgReaderStates[num_watch].szReader);
-	}
+	r = SC_ERROR_INTERNAL;
 #ifndef _WIN32
 	/* Establish a new context, assuming that it is called from a different thread with pcsc-lite */
 	if (gpriv->pcsc_wait_ctx == -1) {
@@ -1164,12 +1971,6 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 #else
 	gpriv->pcsc_wait_ctx = gpriv->pcsc_ctx;
 #endif
-	if (!event_reader || !event)
-	{
-		r = SC_ERROR_INTERNAL;
-		goto out;
-	}
-
 	if (num_watch == 0) {
 		sc_log(ctx, "No readers available, PnP notification not supported");
 		*event_reader = NULL;
@@ -1201,14 +2002,19 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 					rsp->dwCurrentState, rsp->dwEventState);
 			prev_state = rsp->dwCurrentState;
 			state = rsp->dwEventState;
+			/* the change is seen, the next wait starts from here */
+			rsp->dwEventState &= ~SCARD_STATE_CHANGED;
 			rsp->dwCurrentState = rsp->dwEventState;
 			if (state & SCARD_STATE_CHANGED) {
 
 				/* check for hotplug events  */
-				if (!strcmp(rgReaderStates[i].szReader, "\\\\?PnP?\\Notification")) {
+				if (!strcmp(rgReaderStates[i].szReader, PCSC_PNP_NOTIFICATION)) {
 					sc_log(ctx, "detected hotplug event");
 					*event |= SC_EVENT_READER_ATTACHED;
 					*event_reader = NULL;
+					/* report a burst of them as one */
+					if (event_mask & SC_EVENT_READER_ATTACHED)
+						pcsc_wait_hotplug_settled(ctx, gpriv, gpriv->pcsc_wait_ctx, rsp);
 				}
 
 				if ((state & SCARD_STATE_PRESENT) && !(prev_state & SCARD_STATE_PRESENT)) {
@@ -1277,246 +2083,15 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 		}
 	}
 out:
-	if (!reader_states)   {
-		free(rgReaderStates);
-	}
-	else if (*reader_states == NULL)   {
-		sc_log(ctx, "return allocated 'reader states'");
-		*reader_states = rgReaderStates;
-	}
-
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
 
 
 /*
- * Pinpad support, based on PC/SC v2 Part 10 interface
- * Similar to CCID in spirit.
+ * Pinpad support, based on PC/SC v2 Part 10 interface, see part10.c
  */
 
-/* Local definitions */
-#define SC_CCID_PIN_TIMEOUT	30
-
-/* CCID definitions */
-#define SC_CCID_PIN_ENCODING_BIN   0x00
-#define SC_CCID_PIN_ENCODING_BCD   0x01
-#define SC_CCID_PIN_ENCODING_ASCII 0x02
-
-#define SC_CCID_PIN_UNITS_BYTES    0x80
-
-/* Build a PIN verification block + APDU */
-static int part10_build_verify_pin_block(struct sc_reader *reader, u8 * buf, size_t * size, struct sc_pin_cmd_data *data)
-{
-	int offset = 0, count = 0;
-	sc_apdu_t *apdu = data->apdu;
-	u8 tmp;
-	unsigned int tmp16;
-	PIN_VERIFY_STRUCTURE *pin_verify  = (PIN_VERIFY_STRUCTURE *)buf;
-
-	/* PIN verification control message */
-	pin_verify->bTimerOut = SC_CCID_PIN_TIMEOUT;
-	pin_verify->bTimerOut2 = SC_CCID_PIN_TIMEOUT;
-
-	/* bmFormatString */
-	tmp = 0x00;
-	if (data->pin1.encoding == SC_PIN_ENCODING_ASCII) {
-		tmp |= SC_CCID_PIN_ENCODING_ASCII;
-
-		/* if the effective PIN length offset is specified, use it */
-		if (data->pin1.length_offset > 4) {
-			tmp |= SC_CCID_PIN_UNITS_BYTES;
-			tmp |= (data->pin1.length_offset - 5) << 3;
-		}
-	} else if (data->pin1.encoding == SC_PIN_ENCODING_BCD) {
-		tmp |= SC_CCID_PIN_ENCODING_BCD;
-		tmp |= SC_CCID_PIN_UNITS_BYTES;
-	} else if (data->pin1.encoding == SC_PIN_ENCODING_GLP) {
-		/* see comment about GLP PINs in sec.c */
-		tmp |= SC_CCID_PIN_ENCODING_BCD;
-		tmp |= 0x08 << 3;
-	} else
-		return SC_ERROR_NOT_SUPPORTED;
-
-	pin_verify->bmFormatString = tmp;
-
-	/* bmPINBlockString */
-	tmp = 0x00;
-	if (data->pin1.encoding == SC_PIN_ENCODING_GLP) {
-		/* GLP PIN length is encoded in 4 bits and block size is always 8 bytes */
-		tmp |= 0x40 | 0x08;
-	} else if (data->pin1.encoding == SC_PIN_ENCODING_ASCII && data->flags & SC_PIN_CMD_NEED_PADDING) {
-		tmp |= data->pin1.pad_length;
-	}
-	pin_verify->bmPINBlockString = tmp;
-
-	/* bmPINLengthFormat */
-	tmp = 0x00;
-	if (data->pin1.encoding == SC_PIN_ENCODING_GLP) {
-		/* GLP PINs expect the effective PIN length from bit 4 */
-		tmp |= 0x04;
-	}
-	pin_verify->bmPINLengthFormat = tmp;	/* bmPINLengthFormat */
-
-	if (!data->pin1.min_length || !data->pin1.max_length)
-		return SC_ERROR_INVALID_ARGUMENTS;
-
-	tmp16 = (data->pin1.min_length << 8 ) + data->pin1.max_length;
-	pin_verify->wPINMaxExtraDigit = HOST_TO_CCID_16(tmp16); /* Min Max */
-
-	pin_verify->bEntryValidationCondition = 0x02; /* Keypress only */
-
-	if (reader->capabilities & SC_READER_CAP_DISPLAY)
-		pin_verify->bNumberMessage = 0xFF; /* Default message */
-	else
-		pin_verify->bNumberMessage = 0x00; /* No messages */
-
-	/* Ignore language and T=1 parameters. */
-	pin_verify->wLangId = HOST_TO_CCID_16(0x0000);
-	pin_verify->bMsgIndex = 0x00;
-	pin_verify->bTeoPrologue[0] = 0x00;
-	pin_verify->bTeoPrologue[1] = 0x00;
-	pin_verify->bTeoPrologue[2] = 0x00;
-
-	/* APDU itself */
-	pin_verify->abData[offset++] = apdu->cla;
-	pin_verify->abData[offset++] = apdu->ins;
-	pin_verify->abData[offset++] = apdu->p1;
-	pin_verify->abData[offset++] = apdu->p2;
-
-	/* Copy data if not Case 1 */
-	if (data->pin1.length_offset != 4) {
-		pin_verify->abData[offset++] = apdu->lc;
-		memcpy(&pin_verify->abData[offset], apdu->data, apdu->datalen);
-		offset += apdu->datalen;
-	}
-
-	pin_verify->ulDataLength = HOST_TO_CCID_32(offset); /* APDU size */
-
-	count = sizeof(PIN_VERIFY_STRUCTURE) + offset -1;
-	*size = count;
-	return SC_SUCCESS;
-}
-
-
-
-/* Build a PIN modification block + APDU */
-static int part10_build_modify_pin_block(struct sc_reader *reader, u8 * buf, size_t * size, struct sc_pin_cmd_data *data)
-{
-	int offset = 0, count = 0;
-	sc_apdu_t *apdu = data->apdu;
-	u8 tmp;
-	unsigned int tmp16;
-	PIN_MODIFY_STRUCTURE *pin_modify  = (PIN_MODIFY_STRUCTURE *)buf;
-	struct sc_pin_cmd_pin *pin_ref =
-	   	data->flags & SC_PIN_CMD_IMPLICIT_CHANGE ?
-	   	&data->pin2 : &data->pin1;
-
-	/* PIN verification control message */
-	pin_modify->bTimerOut = SC_CCID_PIN_TIMEOUT;	/* bTimeOut */
-	pin_modify->bTimerOut2 = SC_CCID_PIN_TIMEOUT;	/* bTimeOut2 */
-
-	/* bmFormatString */
-	tmp = 0x00;
-	if (pin_ref->encoding == SC_PIN_ENCODING_ASCII) {
-		tmp |= SC_CCID_PIN_ENCODING_ASCII;
-
-		/* if the effective PIN length offset is specified, use it */
-		if (pin_ref->length_offset > 4) {
-			tmp |= SC_CCID_PIN_UNITS_BYTES;
-			tmp |= (pin_ref->length_offset - 5) << 3;
-		}
-	} else if (pin_ref->encoding == SC_PIN_ENCODING_BCD) {
-		tmp |= SC_CCID_PIN_ENCODING_BCD;
-		tmp |= SC_CCID_PIN_UNITS_BYTES;
-	} else if (pin_ref->encoding == SC_PIN_ENCODING_GLP) {
-		/* see comment about GLP PINs in sec.c */
-		tmp |= SC_CCID_PIN_ENCODING_BCD;
-		tmp |= 0x08 << 3;
-	} else
-		return SC_ERROR_NOT_SUPPORTED;
-
-	pin_modify->bmFormatString = tmp;	/* bmFormatString */
-
-	/* bmPINBlockString */
-	tmp = 0x00;
-	if (pin_ref->encoding == SC_PIN_ENCODING_GLP) {
-		/* GLP PIN length is encoded in 4 bits and block size is always 8 bytes */
-		tmp |= 0x40 | 0x08;
-	} else if (pin_ref->encoding == SC_PIN_ENCODING_ASCII && pin_ref->pad_length) {
-		tmp |= pin_ref->pad_length;
-	}
-	pin_modify->bmPINBlockString = tmp; /* bmPINBlockString */
-
-	/* bmPINLengthFormat */
-	tmp = 0x00;
-	if (pin_ref->encoding == SC_PIN_ENCODING_GLP) {
-		/* GLP PINs expect the effective PIN length from bit 4 */
-		tmp |= 0x04;
-	}
-	pin_modify->bmPINLengthFormat = tmp;	/* bmPINLengthFormat */
-
-	/* Set offsets if not Case 1 APDU */
-	if (pin_ref->length_offset != 4) {
-		pin_modify->bInsertionOffsetOld = data->pin1.offset - 5;
-		pin_modify->bInsertionOffsetNew = data->pin2.offset - 5;
-	} else {
-		pin_modify->bInsertionOffsetOld = 0x00;
-		pin_modify->bInsertionOffsetNew = 0x00;
-	}
-
-	if (!pin_ref->min_length || !pin_ref->max_length)
-		return SC_ERROR_INVALID_ARGUMENTS;
-
-	tmp16 = (pin_ref->min_length << 8 ) + pin_ref->max_length;
-	pin_modify->wPINMaxExtraDigit = HOST_TO_CCID_16(tmp16); /* Min Max */
-
-	/* bConfirmPIN flags
-	 * 0x01: New Pin, Confirm Pin
-	 * 0x03: Enter Old Pin, New Pin, Confirm Pin
-	 */
-	pin_modify->bConfirmPIN = data->flags & SC_PIN_CMD_IMPLICIT_CHANGE ? 0x01 : 0x03;
-	pin_modify->bEntryValidationCondition = 0x02;	/* bEntryValidationCondition, keypress only */
-
-	/* bNumberMessage flags
-	 * 0x02: Messages seen on Pinpad display: New Pin, Confirm Pin
-	 * 0x03: Messages seen on Pinpad display: Enter Old Pin, New Pin, Confirm Pin
-	 * Could be 0xFF too.
-	 */
-	if (reader->capabilities & SC_READER_CAP_DISPLAY)
-		pin_modify->bNumberMessage = data->flags & SC_PIN_CMD_IMPLICIT_CHANGE ? 0x02 : 0x03;
-	else
-		pin_modify->bNumberMessage = 0x00; /* No messages */
-
-	/* Ignore language and T=1 parameters. */
-	pin_modify->wLangId = HOST_TO_CCID_16(0x0000);
-	pin_modify->bMsgIndex1 = 0x00; /* Default message indexes */
-	pin_modify->bMsgIndex2 = 0x01;
-	pin_modify->bMsgIndex3 = 0x02;
-	pin_modify->bTeoPrologue[0] = 0x00;
-	pin_modify->bTeoPrologue[1] = 0x00;
-	pin_modify->bTeoPrologue[2] = 0x00;
-
-	/* APDU itself */
-	pin_modify->abData[offset++] = apdu->cla;
-	pin_modify->abData[offset++] = apdu->ins;
-	pin_modify->abData[offset++] = apdu->p1;
-	pin_modify->abData[offset++] = apdu->p2;
-
-	/* Copy data if not Case 1 */
-	if (pin_ref->length_offset != 4) {
-		pin_modify->abData[offset++] = apdu->lc;
-		memcpy(&pin_modify->abData[offset], apdu->data, apdu->datalen);
-		offset += apdu->datalen;
-	}
-
-	pin_modify->ulDataLength = HOST_TO_CCID_32(offset); /* APDU size */
-
-	count = sizeof(PIN_MODIFY_STRUCTURE) + offset -1;
-	*size = count;
-	return SC_SUCCESS;
-}
-
 /* Find a given PCSC v2 part 10 property */
 static int
 part10_find_property_by_tag(unsigned char buffer[], int length,
@@ -1965,21 +2540,52 @@ struct sc_reader_driver * sc_get_pcsc_driver(void)
 #ifdef ENABLE_MINIDRIVER
 
 #define SCARD_CLASS_SYSTEM     0x7fff
-#define SCARD_ATTR_VALUE(Class, Tag) ((((ULONG)(Class)) << 16) | ((ULONG)(Tag)))
 #define SCARD_ATTR_DEVICE_FRIENDLY_NAME_A SCARD_ATTR_VALUE(SCARD_CLASS_SYSTEM, 0x0003)
 #define SCARD_ATTR_DEVICE_SYSTEM_NAME_A SCARD_ATTR_VALUE(SCARD_CLASS_SYSTEM, 0x0004)
 
-static int cardmod_connect(sc_reader_t *reader)
+/* Base CSP hands over a connected card and owns it, including the
+ * transactions, for the whole minidriver context. So the card is taken as
+ * SCardStatus() describes it in cardmod_use_reader(), without polling the
+ * reader state on every entry point. */
+static int cardmod_refresh_status(sc_reader_t *reader)
 {
-	DWORD active_proto, protocol;
-	SCARDHANDLE card_handle;
-	LONG rv;
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
-	int r;
+	DWORD readers_len = 0, state, prot, atr_len = SC_MAX_ATR_SIZE;
+	unsigned char atr[SC_MAX_ATR_SIZE];
+	LONG rv;
 
-	r = refresh_attributes(reader);
-	if (r)
-		return r;
+	rv = priv->gpriv->SCardStatus(priv->pcsc_card, NULL, &readers_len,
+			&state, &prot, atr, &atr_len);
+	if (rv != SCARD_S_SUCCESS) {
+		PCSC_TRACE(reader, "SCardStatus failed", rv);
+		reader->flags &= ~SC_READER_CARD_PRESENT;
+		return pcsc_to_opensc_error(rv);
+	}
+	if (atr_len > SC_MAX_ATR_SIZE)
+		return SC_ERROR_INTERNAL;
+
+	reader->active_protocol = pcsc_proto_to_opensc(prot);
+	if (!(reader->flags & SC_READER_CARD_PRESENT) || reader->atr.len != atr_len
+			|| memcmp(reader->atr.value, atr, atr_len) != 0)
+		reader->flags |= SC_READER_CARD_CHANGED;
+	reader->flags |= SC_READER_CARD_PRESENT;
+	reader->atr.len = atr_len;
+	memcpy(reader->atr.value, atr, atr_len);
+
+	return SC_SUCCESS;
+}
+
+static int cardmod_detect_card_presence(sc_reader_t *reader)
+{
+	int flags = reader->flags;
+
+	/* a change is reported once, as refresh_attributes() does */
+	reader->flags &= ~SC_READER_CARD_CHANGED;
+	return flags;
+}
+
+static int cardmod_connect(sc_reader_t *reader)
+{
 	if (!(reader->flags & SC_READER_CARD_PRESENT))
 		return SC_ERROR_CARD_NOT_PRESENT;
 
@@ -2110,27 +2716,45 @@ int cardmod_use_reader(sc_context_t *ctx, void * pcsc_context_handle, void * pcs
 		goto out;
 	}
 
-	/* if we already had a reader, delete it */
+	gpriv->pcsc_ctx = *(SCARDCONTEXT *)pcsc_context_handle;
+	card_handle =  *(SCARDHANDLE *)pcsc_card_handle;
+
+	sc_log(ctx, "gpriv->pcsc_ctx = %X, card_handle = %X", gpriv->pcsc_ctx, card_handle);
+
+	/* if we already had a reader, only change the handle of the same reader,
+	 * so that a card bound to it stays usable, else delete it */
 	if (sc_ctx_get_reader_count(ctx) > 0) {
-		sc_reader_t *oldrdr = list_extract_at(&ctx->readers, 0);
+		sc_reader_t *oldrdr = sc_ctx_get_reader(ctx, 0);
+		char old_name[128];
+		DWORD old_name_size = sizeof(old_name);
+
+		if (oldrdr && oldrdr->name
+				&& gpriv->SCardGetAttrib(card_handle, SCARD_ATTR_DEVICE_SYSTEM_NAME_A,
+					old_name, &old_name_size) == SCARD_S_SUCCESS
+				&& !strcmp(oldrdr->name, old_name)) {
+			struct pcsc_private_data *priv = GET_PRIV_DATA(oldrdr);
+
+			sc_log(ctx, "New handle for reader '%s'", oldrdr->name);
+			priv->pcsc_card = card_handle;
+			cardmod_refresh_status(oldrdr);
+			ret = SC_SUCCESS;
+			goto out;
+		}
+
+		sc_rwlock_lock(ctx, ctx->readers_lock, 1);
+		oldrdr = list_extract_at(&ctx->readers, 0);
+		sc_rwlock_unlock(ctx, ctx->readers_lock, 1);
 		if (oldrdr)
 			_sc_delete_reader(ctx, oldrdr);
 	}
 
 	sc_log(ctx, "Probing pcsc readers");
 
-	gpriv->pcsc_ctx = *(SCARDCONTEXT *)pcsc_context_handle;
-	card_handle =  *(SCARDHANDLE *)pcsc_card_handle;
-
-	sc_log(ctx, "gpriv->pcsc_ctx = %X, card_handle = %X", gpriv->pcsc_ctx, card_handle);
-
 	if(gpriv->SCardGetAttrib(card_handle, SCARD_ATTR_DEVICE_SYSTEM_NAME_A, \
 			reader_name, &reader_name_size) == SCARD_S_SUCCESS)
 	{
 		sc_reader_t *reader = NULL;
 		struct pcsc_private_data *priv = NULL;
-		DWORD readers_len = 0, state, prot, atr_len = SC_MAX_ATR_SIZE;
-		unsigned char atr[SC_MAX_ATR_SIZE];
 
 		if(1)
 		{
@@ -2157,24 +2781,18 @@ int cardmod_use_reader(sc_context_t *ctx, void * pcsc_context_handle, void * pcs
 		}
 		priv->gpriv = gpriv;
 
-		/* attempt to detect protocol in use T0/T1/RAW */
-		rv = priv->gpriv->SCardStatus(card_handle, NULL, &readers_len,
-			&state, &prot, atr, &atr_len);
-		if (rv != SCARD_S_SUCCESS)
-		{
-			sc_log(ctx, "SCardStatus failed %08x", rv);
-			prot = SCARD_PROTOCOL_T0;
-		}
-		sc_log(ctx, "Set protocole to %s", \
-			(prot==SCARD_PROTOCOL_T0)?"T0":((prot==SCARD_PROTOCOL_T1)?"T1":"RAW"));
-		reader->active_protocol = pcsc_proto_to_opensc(prot);
-
 		if (_sc_add_reader(ctx, reader)) {
 			ret = SC_SUCCESS;	/* silent ignore */
 			goto err1;
 		}
 		priv->pcsc_card = card_handle;
 
+		/* attempt to detect protocol in use T0/T1/RAW, and the ATR */
+		if (cardmod_refresh_status(reader) != SC_SUCCESS)
+			reader->active_protocol = SC_PROTO_T0;
+		sc_log(ctx, "Set protocole to %s", \
+			(reader->active_protocol==SC_PROTO_T0)?"T0":((reader->active_protocol==SC_PROTO_T1)?"T1":"RAW"));
+
 		/* check for pinpad support */
 		if (gpriv->SCardControl != NULL)
 		{
@@ -2296,9 +2914,6 @@ int cardmod_use_reader(sc_context_t *ctx, void * pcsc_context_handle, void * pcs
 			}
 		}
 
-
-		refresh_attributes(reader);
-
 		ret = SC_SUCCESS;
 
 		goto out;
@@ -2340,6 +2955,7 @@ struct sc_reader_driver * sc_get_cardmod_driver(void)
 	cardmod_ops.finish = cardmod_finish;
 	cardmod_ops.detect_readers = NULL;
 	/* cardmod_ops.transmit = ; */
+	cardmod_ops.detect_card_presence = cardmod_detect_card_presence;
 	cardmod_ops.lock = NULL;
 	cardmod_ops.unlock = NULL;
 	cardmod_ops.release = cardmod_release;
@@ -0,0 +1,411 @@
+/*
+ * reader-replay.c: Reader driver replaying an APDU trace
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+/*
+ * Every reader of an APDU trace (see apdu_trace_file) becomes a virtual
+ * reader with the last ATR recorded for it. A command is answered with the
+ * response recorded for the same command, looked up from the one after the
+ * previous answer, so that repeated commands get their responses in the
+ * recorded order. Commands that were not recorded as they are (random
+ * challenges, cryptograms) get the response of the next command with the
+ * same header. Connecting to the card starts again from the first command.
+ */
+
+#define GET_PRIV_DATA(r) ((struct replay_reader *) (r)->drv_data)
+/* as many reader ids as a trace session uses */
+#define REPLAY_MAX_READERS 16
+
+struct replay_apdu {
+	const u8 *cmd;
+	size_t cmd_len;
+	/* response data followed by SW1 SW2 */
+	u8 *resp;
+	size_t resp_len;
+	int rv;
+};
+
+struct replay_reader {
+	char *name;
+	u8 atr[SC_MAX_ATR_SIZE];
+	size_t atr_len;
+	struct replay_apdu *apdus;
+	size_t count, alloc;
+	size_t next;
+};
+
+struct replay_global_private_data {
+	u8 *trace;
+	struct replay_reader *readers;
+	size_t reader_count;
+};
+
+static struct sc_reader_operations replay_ops;
+
+static struct sc_reader_driver replay_drv = {
+	"Replayed APDU trace",
+	"replay",
+	&replay_ops,
+	0, 0, NULL
+};
+
+static unsigned long long replay_get(const u8 *p, size_t n)
+{
+	unsigned long long x = 0;
+
+	while (n--)
+		x = (x << 8) | *p++;
+	return x;
+}
+
+static struct replay_reader *replay_find_reader(struct replay_global_private_data *gpriv,
+		const char *name, size_t name_len)
+{
+	struct replay_reader *tmp;
+	size_t i;
+
+	for (i = 0; i < gpriv->reader_count; i++)
+		if (strlen(gpriv->readers[i].name) == name_len
+				&& !memcmp(gpriv->readers[i].name, name, name_len))
+			return &gpriv->readers[i];
+
+	tmp = realloc(gpriv->readers, (gpriv->reader_count + 1) * sizeof(*tmp));
+	if (tmp == NULL)
+		return NULL;
+	gpriv->readers = tmp;
+	tmp = &gpriv->readers[gpriv->reader_count];
+	memset(tmp, 0, sizeof(*tmp));
+	tmp->name = malloc(name_len + 1);
+	if (tmp->name == NULL)
+		return NULL;
+	memcpy(tmp->name, name, name_len);
+	tmp->name[name_len] = '\0';
+	gpriv->reader_count++;
+	return tmp;
+}
+
+static int replay_add_apdu(struct replay_reader *rdr, const u8 *rec)
+{
+	struct replay_apdu *a;
+	size_t cmd_len = replay_get(rec + 26, 2), resp_len = replay_get(rec + 28, 4);
+	unsigned int sw = replay_get(rec + 24, 2);
+
+	if (rdr->count == rdr->alloc) {
+		size_t alloc = rdr->alloc ? 2 * rdr->alloc : 64;
+
+		a = realloc(rdr->apdus, alloc * sizeof(*a));
+		if (a == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		rdr->apdus = a;
+		rdr->alloc = alloc;
+	}
+	a = &rdr->apdus[rdr->count];
+	a->cmd = rec + SC_APDU_TRACE_APDU_HEADER_LEN;
+	a->cmd_len = cmd_len;
+	a->rv = (int)(unsigned int)replay_get(rec + 20, 4);
+	a->resp_len = resp_len + 2;
+	a->resp = malloc(a->resp_len);
+	if (a->resp == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(a->resp, a->cmd + cmd_len, resp_len);
+	a->resp[resp_len] = sw >> 8;
+	a->resp[resp_len + 1] = sw & 0xFF;
+	rdr->count++;
+	return SC_SUCCESS;
+}
+
+static int replay_load(sc_context_t *ctx, struct replay_global_private_data *gpriv,
+		const char *filename)
+{
+	/* reader ids are given per session */
+	struct replay_reader *ids[REPLAY_MAX_READERS] = { NULL };
+	u8 *p, *end;
+	size_t len, rec_len;
+	long size;
+	FILE *f;
+	int r;
+
+	f = fopen(filename, "rb");
+	if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0) {
+		sc_log(ctx, "cannot open APDU trace '%s'", filename);
+		if (f)
+			fclose(f);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	rewind(f);
+	len = size;
+	gpriv->trace = malloc(len ? len : 1);
+	if (gpriv->trace == NULL || fread(gpriv->trace, 1, len, f) != len) {
+		fclose(f);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	fclose(f);
+
+	p = gpriv->trace;
+	end = p + len;
+	while (p + SC_APDU_TRACE_MAGIC_LEN <= end) {
+		unsigned int id;
+
+		if (memcmp(p, SC_APDU_TRACE_MAGIC, SC_APDU_TRACE_MAGIC_LEN) == 0) {
+			memset(ids, 0, sizeof(ids));
+			p += SC_APDU_TRACE_MAGIC_LEN;
+			continue;
+		}
+		rec_len = replay_get(p + 4, 4);
+		if (rec_len == 0) {
+			p += 8;
+			continue;
+		}
+		if (rec_len < SC_APDU_TRACE_HEADER_LEN || rec_len % 8 || rec_len > (size_t)(end - p)) {
+			sc_log(ctx, "invalid record at offset %lu of '%s'",
+					(unsigned long)(p - gpriv->trace), filename);
+			return SC_ERROR_INVALID_DATA;
+		}
+		id = replay_get(p + 2, 2);
+
+		if (p[0] == SC_APDU_TRACE_READER && id < REPLAY_MAX_READERS) {
+			const char *name = (const char *)p + SC_APDU_TRACE_HEADER_LEN;
+
+			ids[id] = replay_find_reader(gpriv, name,
+					strnlen(name, rec_len - SC_APDU_TRACE_HEADER_LEN));
+			if (ids[id] == NULL)
+				return SC_ERROR_OUT_OF_MEMORY;
+		}
+		else if (p[0] == SC_APDU_TRACE_ATR && id < REPLAY_MAX_READERS && ids[id] != NULL
+				&& rec_len > SC_APDU_TRACE_HEADER_LEN
+				&& p[SC_APDU_TRACE_HEADER_LEN] < rec_len - SC_APDU_TRACE_HEADER_LEN
+				&& p[SC_APDU_TRACE_HEADER_LEN] <= SC_MAX_ATR_SIZE) {
+			ids[id]->atr_len = p[SC_APDU_TRACE_HEADER_LEN];
+			memcpy(ids[id]->atr, p + SC_APDU_TRACE_HEADER_LEN + 1, ids[id]->atr_len);
+		}
+		else if (p[0] == SC_APDU_TRACE_APDU && id < REPLAY_MAX_READERS && ids[id] != NULL
+				&& rec_len >= SC_APDU_TRACE_APDU_HEADER_LEN
+				&& SC_APDU_TRACE_APDU_HEADER_LEN + replay_get(p + 26, 2)
+					+ replay_get(p + 28, 4) <= rec_len) {
+			r = replay_add_apdu(ids[id], p);
+			if (r != SC_SUCCESS)
+				return r;
+		}
+		p += rec_len;
+	}
+	return SC_SUCCESS;
+}
+
+static int replay_finish(sc_context_t *ctx)
+{
+	struct replay_global_private_data *gpriv = (struct replay_global_private_data *) ctx->reader_drv_data;
+	size_t i, j;
+
+	if (gpriv == NULL)
+		return SC_SUCCESS;
+	for (i = 0; i < gpriv->reader_count; i++) {
+		for (j = 0; j < gpriv->readers[i].count; j++)
+			free(gpriv->readers[i].apdus[j].resp);
+		free(gpriv->readers[i].apdus);
+		free(gpriv->readers[i].name);
+	}
+	free(gpriv->readers);
+	free(gpriv->trace);
+	free(gpriv);
+	ctx->reader_drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+static int replay_init(sc_context_t *ctx)
+{
+	struct replay_global_private_data *gpriv;
+	scconf_block *conf_block;
+	const char *filename = NULL;
+	int r;
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "replay", 1);
+	if (conf_block)
+		filename = scconf_get_str(conf_block, "trace_file", NULL);
+	if (filename == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	gpriv = calloc(1, sizeof(*gpriv));
+	if (gpriv == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	ctx->reader_drv_data = gpriv;
+	r = replay_load(ctx, gpriv, filename);
+	if (r != SC_SUCCESS) {
+		replay_finish(ctx);
+		return r;
+	}
+	sc_log(ctx, "replaying %lu readers of '%s'", (unsigned long)gpriv->reader_count, filename);
+	return SC_SUCCESS;
+}
+
+static int replay_detect_readers(sc_context_t *ctx)
+{
+	struct replay_global_private_data *gpriv = (struct replay_global_private_data *) ctx->reader_drv_data;
+	size_t i;
+
+	if (gpriv == NULL)
+		return SC_ERROR_NO_READERS_FOUND;
+	for (i = 0; i < gpriv->reader_count; i++) {
+		struct replay_reader *rdr = &gpriv->readers[i];
+		sc_reader_t *reader;
+
+		if (sc_ctx_get_reader_by_name(ctx, rdr->name) != NULL)
+			continue;
+		reader = calloc(1, sizeof(*reader));
+		if (reader == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		reader->name = strdup(rdr->name);
+		if (reader->name == NULL) {
+			free(reader);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		reader->drv_data = rdr;
+		reader->ops = &replay_ops;
+		reader->driver = &replay_drv;
+		if (_sc_add_reader(ctx, reader)) {
+			free(reader->name);
+			free(reader);
+		}
+	}
+	return SC_SUCCESS;
+}
+
+static int replay_release(sc_reader_t *reader)
+{
+	/* the recorded data belongs to the driver */
+	reader->drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+static int replay_detect_card_presence(sc_reader_t *reader)
+{
+	struct replay_reader *rdr = GET_PRIV_DATA(reader);
+
+	reader->flags &= ~SC_READER_CARD_PRESENT;
+	if (rdr->atr_len)
+		reader->flags |= SC_READER_CARD_PRESENT;
+	return reader->flags;
+}
+
+static int replay_connect(sc_reader_t *reader)
+{
+	struct replay_reader *rdr = GET_PRIV_DATA(reader);
+
+	if (rdr->atr_len == 0)
+		return SC_ERROR_CARD_NOT_PRESENT;
+	memcpy(reader->atr.value, rdr->atr, rdr->atr_len);
+	reader->atr.len = rdr->atr_len;
+	reader->active_protocol = SC_PROTO_T1;
+	reader->flags |= SC_READER_CARD_PRESENT;
+	rdr->next = 0;
+	return SC_SUCCESS;
+}
+
+static int replay_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+/* The first recorded APDU from 'next' on, and around, that begins with
+ * the 'len' bytes of 'cmd' and has 'cmd_len' bytes if that is not 0 */
+static const struct replay_apdu *replay_match(struct replay_reader *rdr,
+		const u8 *cmd, size_t len, size_t cmd_len)
+{
+	size_t i, idx;
+
+	for (i = 0; i < rdr->count; i++) {
+		idx = (rdr->next + i) % rdr->count;
+		if (rdr->apdus[idx].cmd_len < len || memcmp(rdr->apdus[idx].cmd, cmd, len))
+			continue;
+		if (cmd_len && rdr->apdus[idx].cmd_len != cmd_len)
+			continue;
+		rdr->next = idx + 1;
+		return &rdr->apdus[idx];
+	}
+	return NULL;
+}
+
+static int replay_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct replay_reader *rdr = GET_PRIV_DATA(reader);
+	static const u8 not_recorded[2] = { 0x6D, 0x00 };
+	const struct replay_apdu *a;
+	u8 *sbuf = NULL;
+	size_t ssize = 0;
+	int r;
+
+	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol);
+	if (r != SC_SUCCESS)
+		return r;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	a = replay_match(rdr, sbuf, ssize, ssize);
+	if (a == NULL && ssize >= 4)
+		a = replay_match(rdr, sbuf, 4, 0);
+	free(sbuf);
+
+	if (a == NULL) {
+		sc_log(reader->ctx, "command not recorded in the trace");
+		return sc_apdu_set_resp(reader->ctx, apdu, not_recorded, sizeof(not_recorded));
+	}
+	if (a->rv < 0)
+		return a->rv;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, a->resp, a->resp_len, 0);
+	return sc_apdu_set_resp(reader->ctx, apdu, a->resp, a->resp_len);
+}
+
+static int replay_lock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int replay_unlock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int replay_reset(sc_reader_t *reader, int do_cold_reset)
+{
+	return replay_connect(reader);
+}
+
+struct sc_reader_driver *sc_get_replay_driver(void)
+{
+	replay_ops.init = replay_init;
+	replay_ops.finish = replay_finish;
+	replay_ops.detect_readers = replay_detect_readers;
+	replay_ops.release = replay_release;
+	replay_ops.detect_card_presence = replay_detect_card_presence;
+	replay_ops.connect = replay_connect;
+	replay_ops.disconnect = replay_disconnect;
+	replay_ops.transmit = replay_transmit;
+	replay_ops.lock = replay_lock;
+	replay_ops.unlock = replay_unlock;
+	replay_ops.reset = replay_reset;
+	replay_ops.perform_verify = NULL;
+	replay_ops.perform_pace = NULL;
+	replay_ops.use_reader = NULL;
+
+	return &replay_drv;
+}
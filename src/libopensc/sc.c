@@ -25,6 +25,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #ifdef HAVE_SYS_MMAN_H
 #include <sys/mman.h>
 #endif
@@ -45,37 +48,51 @@ const char *sc_get_version(void)
     return sc_version;
 }
 
+/* value of a hex digit, 0xFF for anything else */
+static const u8 hex_value[256] = {
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0x0A,0x0B,0x0C,0x0D,0x0E,0x0F,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0x0A,0x0B,0x0C,0x0D,0x0E,0x0F,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
 int sc_hex_to_bin(const char *in, u8 *out, size_t *outlen)
 {
+	const unsigned char *p = (const unsigned char *) in;
 	int err = 0;
 	size_t left, count = 0;
 
 	assert(in != NULL && out != NULL && outlen != NULL);
         left = *outlen;
 
-	while (*in != '\0') {
+	while (*p != '\0') {
 		int byte = 0, nybbles = 2;
 
-		while (nybbles-- && *in && *in != ':' && *in != ' ') {
-			char c;
-			byte <<= 4;
-			c = *in++;
-			if ('0' <= c && c <= '9')
-				c -= '0';
-			else
-			if ('a' <= c && c <= 'f')
-				c = c - 'a' + 10;
-			else
-			if ('A' <= c && c <= 'F')
-				c = c - 'A' + 10;
-			else {
+		while (nybbles-- && *p && *p != ':' && *p != ' ') {
+			u8 c = hex_value[*p++];
+
+			if (c == 0xFF) {
 				err = SC_ERROR_INVALID_ARGUMENTS;
 				goto out;
 			}
-			byte |= c;
+			byte = (byte << 4) | c;
 		}
-		if (*in == ':' || *in == ' ')
-			in++;
+		if (*p == ':' || *p == ' ')
+			p++;
 		if (left <= 0) {
                         err = SC_ERROR_BUFFER_TOO_SMALL;
 			break;
@@ -104,8 +121,10 @@ int sc_bin_to_hex(const u8 *in, size_t in_len, char *out, size_t out_len,
 			return SC_ERROR_BUFFER_TOO_SMALL;
 		if (n && sep_len)
 			*pos++ = sep;
-		sprintf(pos, "%02x", in[n]);
-		pos += 2;
+		*pos++ = hex_digits[in[n] >> 4];
+		*pos++ = hex_digits[in[n] & 0x0F];
+		/* a short buffer keeps what was written so far, terminated */
+		*pos = '\0';
 	}
 	*pos = '\0';
 	return 0;
@@ -736,11 +755,149 @@ int _sc_parse_atr(sc_reader_t *reader)
 	return 0;
 }
 
+/*
+ * Pool of locked memory. The small blocks are taken from a few arenas that
+ * are locked once, each with an inaccessible page on both sides, and a
+ * block freed goes to the free list of its size class once wiped. Larger
+ * blocks, and all blocks when the arenas are used up, are locked one by one.
+ */
+#define SC_SECURE_ARENA_SIZE	(64 * 1024)
+#define SC_SECURE_MAX_ARENAS	4
+#define SC_SECURE_MIN_BLOCK	16
+#define SC_SECURE_CLASSES	8	/* blocks of 16 to 2048 bytes */
+
+#ifdef HAVE_SYS_MMAN_H
+struct sc_secure_block {
+	struct sc_secure_block *next;
+};
+
+static struct {
+	unsigned char *arenas[SC_SECURE_MAX_ARENAS];
+	size_t count;
+	size_t used;		/* in the last arena */
+	struct sc_secure_block *free_list[SC_SECURE_CLASSES];
+	int failed;		/* no more arenas can be mapped or locked */
+} sc_secure_pool;
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+static pthread_mutex_t secure_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#define SECURE_POOL_LOCK()	pthread_mutex_lock(&secure_pool_lock)
+#define SECURE_POOL_UNLOCK()	pthread_mutex_unlock(&secure_pool_lock)
+#else
+#define SECURE_POOL_LOCK()
+#define SECURE_POOL_UNLOCK()
+#endif
+
+static int sc_secure_class(size_t len)
+{
+	size_t size = SC_SECURE_MIN_BLOCK;
+	int cls = 0;
+
+	while (size < len) {
+		size <<= 1;
+		cls++;
+	}
+	return cls < SC_SECURE_CLASSES ? cls : -1;
+}
+
+static unsigned char *sc_secure_new_arena(void)
+{
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	unsigned char *map, *arena;
+
+	map = mmap(NULL, SC_SECURE_ARENA_SIZE + 2 * page, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	arena = map + page;
+	if (mprotect(arena, SC_SECURE_ARENA_SIZE, PROT_READ | PROT_WRITE) != 0
+			|| mlock(arena, SC_SECURE_ARENA_SIZE) != 0) {
+		munmap(map, SC_SECURE_ARENA_SIZE + 2 * page);
+		return NULL;
+	}
+	return arena;
+}
+
+static void *sc_secure_pool_alloc(size_t len)
+{
+	struct sc_secure_block *block;
+	size_t size;
+	void *pointer = NULL;
+	int cls;
+
+	cls = sc_secure_class(len);
+	if (cls < 0)
+		return NULL;
+	size = (size_t) SC_SECURE_MIN_BLOCK << cls;
+
+	SECURE_POOL_LOCK();
+	block = sc_secure_pool.free_list[cls];
+	if (block != NULL) {
+		sc_secure_pool.free_list[cls] = block->next;
+		block->next = NULL;
+		pointer = block;
+	}
+	else if (!sc_secure_pool.failed) {
+		if (sc_secure_pool.count == 0 || sc_secure_pool.used + size > SC_SECURE_ARENA_SIZE) {
+			unsigned char *arena = NULL;
+
+			if (sc_secure_pool.count < SC_SECURE_MAX_ARENAS)
+				arena = sc_secure_new_arena();
+			if (arena == NULL) {
+				sc_secure_pool.failed = 1;
+			}
+			else {
+				sc_secure_pool.arenas[sc_secure_pool.count++] = arena;
+				sc_secure_pool.used = 0;
+			}
+		}
+		if (!sc_secure_pool.failed) {
+			pointer = sc_secure_pool.arenas[sc_secure_pool.count - 1] + sc_secure_pool.used;
+			sc_secure_pool.used += size;
+		}
+	}
+	SECURE_POOL_UNLOCK();
+	return pointer;
+}
+
+static int sc_secure_pool_free(void *ptr, size_t len)
+{
+	struct sc_secure_block *block = ptr;
+	size_t i;
+	int cls;
+
+	SECURE_POOL_LOCK();
+	for (i = 0; i < sc_secure_pool.count; i++)
+		if ((unsigned char *) ptr >= sc_secure_pool.arenas[i]
+				&& (unsigned char *) ptr < sc_secure_pool.arenas[i] + SC_SECURE_ARENA_SIZE)
+			break;
+	if (i == sc_secure_pool.count) {
+		SECURE_POOL_UNLOCK();
+		return 0;
+	}
+
+	cls = sc_secure_class(len);
+	if (cls < 0)
+		cls = SC_SECURE_CLASSES - 1;
+	sc_mem_clear(ptr, (size_t) SC_SECURE_MIN_BLOCK << cls);
+	block->next = sc_secure_pool.free_list[cls];
+	sc_secure_pool.free_list[cls] = block;
+	SECURE_POOL_UNLOCK();
+	return 1;
+}
+#endif
+
 void *sc_mem_alloc_secure(sc_context_t *ctx, size_t len)
 {
     void *pointer;
     int locked = 0;
 
+#ifdef HAVE_SYS_MMAN_H
+    pointer = sc_secure_pool_alloc(len);
+    if (pointer)
+        return pointer;
+#endif
     pointer = calloc(len, sizeof(unsigned char));
     if (!pointer)
         return NULL;
@@ -762,6 +919,19 @@ void *sc_mem_alloc_secure(sc_context_t *ctx, size_t len)
     return pointer;
 }
 
+void sc_mem_free_secure(void *ptr, size_t len)
+{
+	if (ptr == NULL)
+		return;
+#ifdef HAVE_SYS_MMAN_H
+	if (sc_secure_pool_free(ptr, len))
+		return;
+#endif
+	/* not unlocked: the page may hold other locked blocks */
+	sc_mem_clear(ptr, len);
+	free(ptr);
+}
+
 void sc_mem_clear(void *ptr, size_t len)
 {
 #ifdef ENABLE_OPENSSL
@@ -773,6 +943,18 @@ void sc_mem_clear(void *ptr, size_t len)
 #endif
 }
 
+int sc_mem_cmp_ct(const void *a, const void *b, size_t len)
+{
+	const unsigned char *pa = a, *pb = b;
+	unsigned char diff = 0;
+	size_t ii;
+
+	for (ii = 0; ii < len; ii++)
+		diff |= pa[ii] ^ pb[ii];
+
+	return diff != 0;
+}
+
 int sc_mem_reverse(unsigned char *buf, size_t len)
 {
 	unsigned char ch;
@@ -794,12 +976,15 @@ static int
 sc_remote_apdu_allocate(struct sc_remote_data *rdata,
 		struct sc_remote_apdu **new_rapdu)
 {
-	struct sc_remote_apdu *rapdu = NULL, *rr;
+	struct sc_remote_apdu *rapdu = NULL;
 
 	if (!rdata)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
-	rapdu = calloc(1, sizeof(struct sc_remote_apdu));
+	if (rdata->pool_used < rdata->pool_size)
+		rapdu = &rdata->pool[rdata->pool_used++];
+	else
+		rapdu = calloc(1, sizeof(struct sc_remote_apdu));
 	if (rapdu == NULL)
 		return SC_ERROR_OUT_OF_MEMORY;
 
@@ -813,13 +998,31 @@ sc_remote_apdu_allocate(struct sc_remote_data *rdata,
 	if (rdata->data == NULL)   {
 		rdata->data = rapdu;
 		rdata->length = 1;
-		return SC_SUCCESS;
 	}
+	else   {
+		rdata->last->next = rapdu;
+		rdata->length++;
+	}
+	rdata->last = rapdu;
+
+	return SC_SUCCESS;
+}
+
+static int
+sc_remote_apdu_reserve(struct sc_remote_data *rdata, int count)
+{
+	if (!rdata || count < 0)
+		return SC_ERROR_INVALID_ARGUMENTS;
 
-	for (rr = rdata->data; rr->next; rr = rr->next)
-		;
-	rr->next = rapdu;
-	rdata->length++;
+	/* only one block: the following members are allocated one by one */
+	if (rdata->pool || count < 2)
+		return SC_SUCCESS;
+
+	rdata->pool = calloc(count, sizeof(struct sc_remote_apdu));
+	if (rdata->pool == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	rdata->pool_size = count;
+	rdata->pool_used = 0;
 
 	return SC_SUCCESS;
 }
@@ -836,9 +1039,15 @@ sc_remote_apdu_free (struct sc_remote_data *rdata)
 	while(rapdu)   {
 		struct sc_remote_apdu *rr = rapdu->next;
 
-		free(rapdu);
+		if (rapdu < rdata->pool || rapdu >= rdata->pool + rdata->pool_size)
+			free(rapdu);
 		rapdu = rr;
 	}
+	if (rdata->pool)
+		free(rdata->pool);
+
+	rdata->data = rdata->last = rdata->pool = NULL;
+	rdata->length = rdata->pool_size = rdata->pool_used = 0;
 }
 
 void sc_remote_data_init(struct sc_remote_data *rdata)
@@ -849,36 +1058,45 @@ void sc_remote_data_init(struct sc_remote_data *rdata)
 
 	rdata->alloc = sc_remote_apdu_allocate;
 	rdata->free = sc_remote_apdu_free;
+	rdata->reserve = sc_remote_apdu_reserve;
 }
 
-static unsigned long  sc_CRC_tab32[256];
+/* sc_CRC_tab32[k][b]: CRC of the byte b followed by k zero bytes,
+ * to take four bytes per step */
+static unsigned int  sc_CRC_tab32[4][256];
 static int sc_CRC_tab32_initialized = 0;
 unsigned sc_crc32(unsigned char *value, size_t len)
 {
 	size_t ii, jj;
-	unsigned long crc;
-	unsigned long index, long_c;
+	unsigned int crc;
 
 	if (!sc_CRC_tab32_initialized)   {
 		for (ii=0; ii<256; ii++) {
-			crc = (unsigned long) ii;
+			crc = (unsigned int) ii;
 			for (jj=0; jj<8; jj++) {
-				if ( crc & 0x00000001L )
-					crc = ( crc >> 1 ) ^ 0xEDB88320l;
+				if ( crc & 0x00000001 )
+					crc = ( crc >> 1 ) ^ 0xEDB88320;
 				else
 					crc =   crc >> 1;
 			}
-			sc_CRC_tab32[ii] = crc;
+			sc_CRC_tab32[0][ii] = crc;
 		}
+		for (ii=0; ii<256; ii++)
+			for (jj=1; jj<4; jj++)
+				sc_CRC_tab32[jj][ii] = (sc_CRC_tab32[jj - 1][ii] >> 8)
+					^ sc_CRC_tab32[0][sc_CRC_tab32[jj - 1][ii] & 0xff];
 		sc_CRC_tab32_initialized = 1;
 	}
 
-	crc = 0xffffffffL;
-	for (ii=0; ii<len; ii++)   {
-		long_c = 0x000000ffL & (unsigned long) (*(value + ii));
-		index = crc ^ long_c;
-		crc = (crc >> 8) ^ sc_CRC_tab32[ index & 0xff ];
+	crc = 0xffffffff;
+	for (ii=0; ii + 4 <= len; ii += 4)   {
+		crc ^= value[ii] | (value[ii + 1] << 8) | (value[ii + 2] << 16)
+			| ((unsigned int) value[ii + 3] << 24);
+		crc = sc_CRC_tab32[3][crc & 0xff] ^ sc_CRC_tab32[2][(crc >> 8) & 0xff]
+			^ sc_CRC_tab32[1][(crc >> 16) & 0xff] ^ sc_CRC_tab32[0][crc >> 24];
 	}
+	for (; ii<len; ii++)
+		crc = (crc >> 8) ^ sc_CRC_tab32[0][(crc ^ value[ii]) & 0xff];
 
 	crc ^= 0xffffffff;
 	return  crc%0xffff;
@@ -926,6 +1144,89 @@ int sc_mutex_destroy(const sc_context_t *ctx, void *mutex)
 		return SC_SUCCESS;
 }
 
+struct sc_rwlock {
+	void *lock;
+	/* a mutex of a thread context without rwlock functions */
+	int mutex;
+};
+
+int sc_rwlock_create(const sc_context_t *ctx, void **rwlock)
+{
+	const sc_thread_context_t *tc;
+	struct sc_rwlock *l;
+	int r = SC_ERROR_NOT_SUPPORTED;
+
+	if (ctx == NULL || rwlock == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	*rwlock = NULL;
+	tc = ctx->thread_ctx;
+	if (tc == NULL || tc->create_mutex == NULL)
+		return SC_SUCCESS;
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (tc->ver >= 1 && tc->create_rwlock != NULL)
+		r = tc->create_rwlock(&l->lock);
+	if (r == SC_ERROR_NOT_SUPPORTED) {
+		l->mutex = 1;
+		r = tc->create_mutex(&l->lock);
+	}
+	if (r != SC_SUCCESS) {
+		free(l);
+		return r;
+	}
+	*rwlock = l;
+	return SC_SUCCESS;
+}
+
+int sc_rwlock_lock(const sc_context_t *ctx, void *rwlock, int exclusive)
+{
+	struct sc_rwlock *l = rwlock;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (l == NULL)
+		return SC_SUCCESS;
+	if (l->mutex)
+		return sc_mutex_lock(ctx, l->lock);
+	if (exclusive)
+		return ctx->thread_ctx->lock_exclusive(l->lock);
+	return ctx->thread_ctx->lock_shared(l->lock);
+}
+
+int sc_rwlock_unlock(const sc_context_t *ctx, void *rwlock, int exclusive)
+{
+	struct sc_rwlock *l = rwlock;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (l == NULL)
+		return SC_SUCCESS;
+	if (l->mutex)
+		return sc_mutex_unlock(ctx, l->lock);
+	if (exclusive)
+		return ctx->thread_ctx->unlock_exclusive(l->lock);
+	return ctx->thread_ctx->unlock_shared(l->lock);
+}
+
+int sc_rwlock_destroy(const sc_context_t *ctx, void *rwlock)
+{
+	struct sc_rwlock *l = rwlock;
+	int r;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (l == NULL)
+		return SC_SUCCESS;
+	if (l->mutex)
+		r = sc_mutex_destroy(ctx, l->lock);
+	else
+		r = ctx->thread_ctx->destroy_rwlock(l->lock);
+	free(l);
+	return r;
+}
+
 unsigned long sc_thread_id(const sc_context_t *ctx)
 {
 	if (ctx == NULL || ctx->thread_ctx == NULL ||
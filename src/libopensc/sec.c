@@ -38,7 +38,9 @@ int sc_decipher(sc_card_t *card,
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->decipher == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	SC_TRACE_BEGIN(card->ctx, "sc_decipher", crgram_len);
 	r = card->ops->decipher(card, crgram, crgram_len, out, outlen);
+	SC_TRACE_END(card->ctx, "sc_decipher", r);
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -52,10 +54,38 @@ int sc_compute_signature(sc_card_t *card,
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->compute_signature == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	SC_TRACE_BEGIN(card->ctx, "sc_compute_signature", datalen);
 	r = card->ops->compute_signature(card, data, datalen, out, outlen);
+	SC_TRACE_END(card->ctx, "sc_compute_signature", r);
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
+int sc_encrypt_sym(sc_card_t *card,
+		const u8 *in, size_t inlen, u8 *out, size_t outlen)
+{
+	int r;
+
+	assert(card != NULL && in != NULL && out != NULL);
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
+	if (card->ops->encrypt_sym == NULL)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	r = card->ops->encrypt_sym(card, in, inlen, out, outlen);
+	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
+}
+
+int sc_decrypt_sym(sc_card_t *card,
+		const u8 *in, size_t inlen, u8 *out, size_t outlen)
+{
+	int r;
+
+	assert(card != NULL && in != NULL && out != NULL);
+	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
+	if (card->ops->decrypt_sym == NULL)
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	r = card->ops->decrypt_sym(card, in, inlen, out, outlen);
+	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
+}
+
 int sc_set_security_env(sc_card_t *card,
 			const sc_security_env_t *env,
 			int se_num)
@@ -66,7 +96,10 @@ int sc_set_security_env(sc_card_t *card,
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->set_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	card->cache.sec_env_serial++;
+	SC_TRACE_BEGIN(card->ctx, "sc_set_security_env", env->operation);
 	r = card->ops->set_security_env(card, env, se_num);
+	SC_TRACE_END(card->ctx, "sc_set_security_env", r);
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -78,6 +111,7 @@ int sc_restore_security_env(sc_card_t *card, int se_num)
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->restore_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	card->cache.sec_env_serial++;
 	r = card->ops->restore_security_env(card, se_num);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
@@ -101,6 +135,7 @@ int sc_logout(sc_card_t *card)
 {
 	if (card->ops->logout == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
+	card->cache.security_serial++;
 	return card->ops->logout(card);
 }
 
@@ -155,6 +190,7 @@ int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 
 	assert(card != NULL);
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
+	SC_TRACE_BEGIN(card->ctx, "sc_pin_cmd", data->cmd);
 	if (card->ops->pin_cmd) {
 		r = card->ops->pin_cmd(card, data, tries_left);
 	} else if (!(data->flags & SC_PIN_CMD_USE_PINPAD)) {
@@ -201,6 +237,7 @@ int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "Use of pin pad not supported by card driver");
 		r = SC_ERROR_NOT_SUPPORTED;
 	}
+	SC_TRACE_END(card->ctx, "sc_pin_cmd", r);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
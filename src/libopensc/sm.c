@@ -121,6 +121,49 @@ sc_sm_update_apdu_response(struct sc_card *card, unsigned char *resp_data, size_
 	return SC_SUCCESS;
 }
 
+/**  get an APDU for 'get_sm_apdu' to wrap the plain one into
+ *  @param  card 'sc_card' smartcard object
+ *  @return APDU with data and response buffers of SC_MAX_EXT_APDU_BUFFER_SIZE
+ *  bytes, or NULL if out of memory. The buffers are not cleared.
+ *  The card keeps the storage for the next APDU: nothing is allocated once
+ *  the first one is sent, unless another SM APDU is being used meanwhile.
+ *  Release with sc_sm_free_apdu().
+ */
+struct sc_apdu *
+sc_sm_alloc_apdu(struct sc_card *card)
+{
+	struct sm_apdu_buffer *buf = card->sm_ctx.apdu_buffer;
+
+	if (buf == NULL)
+		buf = card->sm_ctx.apdu_buffer = calloc(1, sizeof(struct sm_apdu_buffer));
+	else if (buf->in_use)
+		buf = calloc(1, sizeof(struct sm_apdu_buffer));
+	if (buf == NULL)
+		return NULL;
+
+	buf->in_use = 1;
+	memset(&buf->apdu, 0, sizeof(buf->apdu));
+	buf->apdu.data = buf->data;
+	buf->apdu.datalen = sizeof(buf->data);
+	buf->apdu.resp = buf->resp;
+	buf->apdu.resplen = sizeof(buf->resp);
+	return &buf->apdu;
+}
+
+void
+sc_sm_free_apdu(struct sc_card *card, struct sc_apdu *apdu)
+{
+	struct sm_apdu_buffer *buf = card->sm_ctx.apdu_buffer;
+
+	if (apdu == NULL)
+		return;
+	if (buf && apdu == &buf->apdu)
+		buf->in_use = 0;
+	else
+		/* the APDU is the first member of its storage */
+		free(apdu);
+}
+
 int
 sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
@@ -138,7 +181,7 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 	if (rv == SC_ERROR_SM_NOT_APPLIED)   {
 		/* SM wrap of this APDU is ignored by card driver.
 		 * Send plain APDU to the reader driver */
-		rv = card->reader->ops->transmit(card->reader, apdu);
+		rv = _sc_reader_transmit(card->reader, apdu);
 		LOG_FUNC_RETURN(ctx, rv);
 	}
 	LOG_TEST_RET(ctx, rv, "get SM APDU error");
@@ -151,8 +194,11 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 	}
 
 	/* send APDU to the reader driver */
-	rv = card->reader->ops->transmit(card->reader, sm_apdu);
-	LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
+	rv = _sc_reader_transmit(card->reader, sm_apdu);
+	if (rv < 0)   {
+		card->sm_ctx.ops.free_sm_apdu(card, NULL, &sm_apdu);
+		LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
+	}
 
 	/* decode SM answer and free temporary SM related data */
 	rv = card->sm_ctx.ops.free_sm_apdu(card, apdu, &sm_apdu);
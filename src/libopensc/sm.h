@@ -327,6 +327,17 @@ typedef struct sm_module {
 	struct sm_module_operations ops;
 } sm_module_t;
 
+/* @struct sm_apdu_buffer
+ *	SM wrapped APDU with its data and response buffers, kept by the card
+ *	and reused from one APDU to the next, see sc_sm_alloc_apdu()
+ */
+struct sm_apdu_buffer {
+	struct sc_apdu apdu;
+	unsigned char data[SC_MAX_EXT_APDU_BUFFER_SIZE];
+	unsigned char resp[SC_MAX_EXT_APDU_BUFFER_SIZE];
+	int in_use;
+};
+
 /* @struct sm_context
  *	SM context -- top level of the SM data type
  *	- SM mode ('ACL' or 'APDU TRANSMIT'), flags;
@@ -345,6 +356,8 @@ typedef struct sm_context   {
 
 	struct sm_module module;
 
+	struct sm_apdu_buffer *apdu_buffer;
+
 	unsigned long (*app_lock)(void);
 	void (*app_unlock)(void);
 } sm_context_t;
@@ -354,6 +367,8 @@ int iasecc_sm_external_authentication(struct sc_card *, unsigned, int *);
 int sc_sm_parse_answer(struct sc_card *, unsigned char *, size_t, struct sm_card_response *);
 int sc_sm_update_apdu_response(struct sc_card *, unsigned char *, size_t, int, struct sc_apdu *);
 int sc_sm_single_transmit(struct sc_card *, struct sc_apdu *);
+struct sc_apdu *sc_sm_alloc_apdu(struct sc_card *);
+void sc_sm_free_apdu(struct sc_card *, struct sc_apdu *);
 
 #ifdef __cplusplus
 }
@@ -271,6 +271,10 @@ typedef struct sc_file {
  * returns 0x6Cxx (wrong length)
  */
 #define SC_APDU_FLAGS_NO_RETRY_WL	0x00000004UL
+/* the command only reads data that no one can change, not even another
+ * process: its response may be served from the card's response cache
+ * until the card is reset */
+#define SC_APDU_FLAGS_CACHEABLE		0x00000008UL
 
 #define SC_APDU_ALLOCATE_FLAG		0x01
 #define SC_APDU_ALLOCATE_FLAG_DATA	0x02
@@ -360,6 +364,12 @@ struct sc_remote_data {
 	struct sc_remote_apdu *data;
 	int length;
 
+	/* last member of the list, where the next one is added */
+	struct sc_remote_apdu *last;
+	/* members allocated at once by @c reserve */
+	struct sc_remote_apdu *pool;
+	int pool_size, pool_used;
+
 	/**
          * Handler to allocate a new @c sc_remote_apdu data and add it to the list.
  	 * @param rdata Self pointer to the @c sc_remote_data
@@ -371,6 +381,12 @@ struct sc_remote_data {
  	 * @param rdata Self pointer to the @c sc_remote_data
   	 */
 	void (*free)(struct sc_remote_data *rdata);
+	/**
+	 * Handler to allocate in one block the next @c count members taken by @c alloc.
+	 * @param rdata Self pointer to the @c sc_remote_data
+	 * @param count Number of members about to be allocated
+	 */
+	int (*reserve)(struct sc_remote_data *rdata, int count);
 };
 
 
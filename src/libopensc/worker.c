@@ -0,0 +1,246 @@
+/*
+ * worker.c: Worker threads of the readers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "internal.h"
+
+/*
+ * With reader_workers, every reader gets a thread of its own and a queue of
+ * jobs: the APDUs sent to its card (see _sc_reader_transmit()) and the reads
+ * of sc_read_binary_async() are done by that thread, one after the other, so
+ * a slow card only holds up the callers of its own reader. The changes of
+ * the reader list and the waits for reader events stay with the callers,
+ * under the context mutex.
+ *
+ * Without pthreads, or without reader_workers, the jobs are done in the
+ * calling thread.
+ */
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define SC_READER_WORKERS
+#endif
+
+#ifdef SC_READER_WORKERS
+struct sc_worker_job {
+	int (*fn)(void *);
+	void (*done)(void *, int);	/* NULL for _sc_reader_worker_run() */
+	void *arg;
+	int result;
+	int finished;
+	struct sc_worker_job *next;
+};
+
+struct sc_reader_worker {
+	pthread_mutex_t lock;
+	pthread_cond_t queued;		/* a job was queued, or stop was set */
+	pthread_cond_t finished;	/* a job was done */
+	pthread_t thread;
+	int stop;
+	int busy;
+	struct sc_worker_job *head, *tail;
+};
+
+static void *sc_reader_worker_main(void *arg)
+{
+	struct sc_reader_worker *worker = arg;
+	struct sc_worker_job *job;
+	int r;
+
+	pthread_mutex_lock(&worker->lock);
+	for (;;) {
+		while (worker->head == NULL && !worker->stop)
+			pthread_cond_wait(&worker->queued, &worker->lock);
+		/* the queue is emptied before stopping */
+		if (worker->head == NULL)
+			break;
+		job = worker->head;
+		worker->head = job->next;
+		if (worker->head == NULL)
+			worker->tail = NULL;
+		worker->busy = 1;
+		pthread_mutex_unlock(&worker->lock);
+
+		r = job->fn(job->arg);
+		if (job->done != NULL) {
+			job->done(job->arg, r);
+			free(job);
+			job = NULL;
+		}
+
+		pthread_mutex_lock(&worker->lock);
+		worker->busy = 0;
+		if (job != NULL) {
+			/* the caller of _sc_reader_worker_run() owns the job */
+			job->result = r;
+			job->finished = 1;
+		}
+		pthread_cond_broadcast(&worker->finished);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+static void sc_reader_worker_queue(struct sc_reader_worker *worker, struct sc_worker_job *job)
+{
+	job->next = NULL;
+	if (worker->tail != NULL)
+		worker->tail->next = job;
+	else
+		worker->head = job;
+	worker->tail = job;
+	pthread_cond_signal(&worker->queued);
+}
+
+/* The worker of the reader, unless the caller is that worker */
+static struct sc_reader_worker *sc_reader_worker_of(sc_reader_t *reader)
+{
+	struct sc_reader_worker *worker = reader->worker;
+
+	if (worker == NULL || pthread_equal(worker->thread, pthread_self()))
+		return NULL;
+	return worker;
+}
+#endif
+
+int _sc_reader_worker_start(sc_reader_t *reader)
+{
+#ifdef SC_READER_WORKERS
+	struct sc_reader_worker *worker;
+
+	if (reader->worker != NULL)
+		return SC_SUCCESS;
+
+	worker = calloc(1, sizeof(struct sc_reader_worker));
+	if (worker == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->queued, NULL);
+	pthread_cond_init(&worker->finished, NULL);
+	if (pthread_create(&worker->thread, NULL, sc_reader_worker_main, worker) != 0) {
+		pthread_cond_destroy(&worker->finished);
+		pthread_cond_destroy(&worker->queued);
+		pthread_mutex_destroy(&worker->lock);
+		free(worker);
+		return SC_ERROR_INTERNAL;
+	}
+	reader->worker = worker;
+	sc_log(reader->ctx, "worker thread started for reader '%s'", reader->name);
+	return SC_SUCCESS;
+#else
+	return SC_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+void _sc_reader_worker_stop(sc_reader_t *reader)
+{
+#ifdef SC_READER_WORKERS
+	struct sc_reader_worker *worker = reader->worker;
+
+	if (worker == NULL)
+		return;
+	pthread_mutex_lock(&worker->lock);
+	worker->stop = 1;
+	pthread_cond_signal(&worker->queued);
+	pthread_mutex_unlock(&worker->lock);
+	pthread_join(worker->thread, NULL);
+
+	reader->worker = NULL;
+	pthread_cond_destroy(&worker->finished);
+	pthread_cond_destroy(&worker->queued);
+	pthread_mutex_destroy(&worker->lock);
+	free(worker);
+#endif
+}
+
+void _sc_reader_worker_forked(sc_reader_t *reader)
+{
+	/* the thread was not copied into the child, and its locks may have
+	 * been held by it: leave them alone */
+	reader->worker = NULL;
+}
+
+int _sc_reader_worker_run(sc_reader_t *reader, int (*fn)(void *), void *arg)
+{
+#ifdef SC_READER_WORKERS
+	struct sc_reader_worker *worker = sc_reader_worker_of(reader);
+	struct sc_worker_job job;
+
+	if (worker == NULL)
+		return fn(arg);
+
+	memset(&job, 0, sizeof(job));
+	job.fn = fn;
+	job.arg = arg;
+	pthread_mutex_lock(&worker->lock);
+	sc_reader_worker_queue(worker, &job);
+	while (!job.finished)
+		pthread_cond_wait(&worker->finished, &worker->lock);
+	pthread_mutex_unlock(&worker->lock);
+	return job.result;
+#else
+	return fn(arg);
+#endif
+}
+
+int _sc_reader_worker_submit(sc_reader_t *reader, int (*fn)(void *),
+		void (*done)(void *, int), void *arg)
+{
+#ifdef SC_READER_WORKERS
+	struct sc_reader_worker *worker = reader->worker;
+	struct sc_worker_job *job;
+
+	if (worker == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+	job = calloc(1, sizeof(struct sc_worker_job));
+	if (job == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	job->fn = fn;
+	job->done = done;
+	job->arg = arg;
+	pthread_mutex_lock(&worker->lock);
+	sc_reader_worker_queue(worker, job);
+	pthread_mutex_unlock(&worker->lock);
+	return SC_SUCCESS;
+#else
+	return SC_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+int _sc_reader_worker_wait(sc_reader_t *reader)
+{
+#ifdef SC_READER_WORKERS
+	struct sc_reader_worker *worker = reader->worker;
+
+	if (worker == NULL)
+		return SC_SUCCESS;
+	/* the jobs behind the current one would never be done */
+	if (pthread_equal(worker->thread, pthread_self()))
+		return SC_ERROR_NOT_ALLOWED;
+	pthread_mutex_lock(&worker->lock);
+	while (worker->head != NULL || worker->busy)
+		pthread_cond_wait(&worker->finished, &worker->lock);
+	pthread_mutex_unlock(&worker->lock);
+#endif
+	return SC_SUCCESS;
+}
@@ -78,43 +78,6 @@
 			 *((c)++)=(unsigned char)(((l)>>24L)&0xff))
 
 
-/*
- * Inspired by or taken from OpenSSL crypto/des/cbc3_enc.c
- */
-static void
-DES_3cbc_encrypt(DES_cblock *input, DES_cblock *output, long length,
-		 DES_key_schedule *ks1, DES_key_schedule *ks2, DES_cblock *iv,
-		 int enc)
-	{
-	int off=((int)length-1)/8;
-	long l8=((length+7)/8)*8;
-	DES_cblock icv_out;
-
-	memset(&icv_out, 0, sizeof(icv_out));
-	if (enc == DES_ENCRYPT)   {
-		DES_cbc_encrypt((unsigned char*)input,
-				(unsigned char*)output,length,ks1,iv,enc);
-		DES_cbc_encrypt((unsigned char*)output,
-				(unsigned char*)output,l8,ks2,iv,!enc);
-		DES_cbc_encrypt((unsigned char*)output,
-				(unsigned char*)output,l8,ks1,iv,enc);
-		if ((unsigned)length >= sizeof(DES_cblock))
-			memcpy(icv_out,output[off],sizeof(DES_cblock));
-	}
-	else   {
-		if ((unsigned)length >= sizeof(DES_cblock))
-			memcpy(icv_out,input[off],sizeof(DES_cblock));
-		DES_cbc_encrypt((unsigned char*)input,
-				(unsigned char*)output,l8,ks1,iv,enc);
-		DES_cbc_encrypt((unsigned char*)output,
-				(unsigned char*)output,l8,ks2,iv,!enc);
-		DES_cbc_encrypt((unsigned char*)output,
-				(unsigned char*)output,length,ks1,iv,enc);
-	}
-	memcpy(*iv,icv_out,sizeof(DES_cblock));
-}
-
-
 DES_LONG
 DES_cbc_cksum_3des_emv96(const unsigned char *in, DES_cblock *output,
 			   long length, DES_key_schedule *schedule, DES_key_schedule *schedule2,
@@ -227,13 +190,63 @@ DES_cbc_cksum_3des(const unsigned char *in, DES_cblock *output,
 }
 
 
+void
+sm_des3_set_key(struct sm_des3_key *dkey, const unsigned char *key)
+{
+	DES_cblock kk,k2;
+
+	memcpy(&kk, key, 8);
+	memcpy(&k2, key + 8, 8);
+
+	DES_set_key_unchecked(&kk, &dkey->ks1);
+	DES_set_key_unchecked(&k2, &dkey->ks2);
+}
+
+
+/*
+ * CBC-MAC of 'in' padded as ISO 9797-1 method 2; the padding is applied to a
+ * copy of the last block only. With 'retail' all but the last block are
+ * chained with single DES, as done by DES_cbc_cksum_3des_emv96().
+ */
+void
+sm_des3_mac(struct sm_des3_key *dkey, const_DES_cblock *icv, const unsigned char *in,
+		size_t in_len, int force_pad, int retail, DES_cblock *out)
+{
+	size_t rem = in_len % 8;
+	size_t len = in_len - rem;
+	DES_cblock chain, last;
+	int ii;
+
+	memset(last, 0, sizeof(last));
+	if (rem || force_pad || !in_len)   {
+		memcpy(last, in + len, rem);
+		if (rem || force_pad)
+			last[rem] = 0x80;
+	}
+	else   {
+		len -= 8;
+		memcpy(last, in + len, 8);
+	}
+
+	if (!len)
+		memcpy(chain, *icv, 8);
+	else if (retail)
+		DES_cbc_cksum(in, &chain, len, &dkey->ks1, icv);
+	else
+		DES_cbc_cksum_3des(in, &chain, len, &dkey->ks1, &dkey->ks2, icv);
+
+	for (ii = 0; ii < 8; ii++)
+		last[ii] ^= chain[ii];
+	DES_ecb3_encrypt(&last, out, &dkey->ks1, &dkey->ks2, &dkey->ks1, DES_ENCRYPT);
+}
+
+
 int
 sm_encrypt_des_ecb3(unsigned char *key, unsigned char *data, int data_len,
 		unsigned char **out, int *out_len)
 {
 	int ii;
-	DES_cblock kk,k2;
-	DES_key_schedule ks,ks2;
+	struct sm_des3_key dkey;
 
 
 	if (!out || !out_len)
@@ -247,15 +260,11 @@ sm_encrypt_des_ecb3(unsigned char *key, unsigned char *data, int data_len,
 	if (!(*out))
 		return -1;
 
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
+	sm_des3_set_key(&dkey, key);
 
 	for (ii=0; ii<data_len; ii+=8)
 		DES_ecb2_encrypt( (DES_cblock *)(data + ii),
-				(DES_cblock *)(*out + ii), &ks, &ks2, DES_ENCRYPT);
+				(DES_cblock *)(*out + ii), &dkey.ks1, &dkey.ks2, DES_ENCRYPT);
 
 	return 0;
 }
@@ -266,10 +275,8 @@ sm_decrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 		unsigned char *data, size_t data_len,
 		unsigned char **out, size_t *out_len)
 {
-	DES_cblock kk,k2;
-	DES_key_schedule ks,ks2;
+	struct sm_des3_key dkey;
 	DES_cblock icv={0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
-	size_t st;
 
 	LOG_FUNC_CALLED(ctx);
 	if (!out || !out_len)
@@ -282,30 +289,23 @@ sm_decrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 	if (!(*out))
 		LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "SM decrypt_des_cbc3: allocation error");
 
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
-
-	for (st=0; st<data_len; st+=8)
-		DES_3cbc_encrypt((DES_cblock *)(data + st),
-				(DES_cblock *)(*out + st), 8, &ks, &ks2, &icv, DES_DECRYPT);
+	sm_des3_set_key(&dkey, key);
+	DES_ede2_cbc_encrypt(data, *out, data_len, &dkey.ks1, &dkey.ks2, &icv, DES_DECRYPT);
 
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
 
+/* The full blocks are encrypted straight from 'in', only the padded tail is copied */
 int
 sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 		const unsigned char *in, size_t in_len,
 		unsigned char **out, size_t *out_len, int not_force_pad)
 {
-	DES_cblock kk,k2;
-	DES_key_schedule ks,ks2;
+	struct sm_des3_key dkey;
 	DES_cblock icv={0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
-	unsigned char *data;
-	size_t data_len, st;
+	unsigned char last[8];
+	size_t data_len, len;
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "SM encrypt_des_cbc3: not_force_pad:%i,in_len:%i", not_force_pad, in_len);
@@ -318,33 +318,27 @@ sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 	*out = NULL;
 	*out_len = 0;
 
-	data = malloc(in_len + 8);
-	if (data == NULL)
-		LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "SM encrypt_des_cbc3: allocation error");
-
-	if (in)
-		memcpy(data, in, in_len);
-
-	memcpy(data + in_len, "\x80\0\0\0\0\0\0\0", 8);
+	len = in_len - (in_len % 8);
 	data_len = in_len + (not_force_pad ? 7 : 8);
 	data_len -= (data_len%8);
-	sc_log(ctx, "SM encrypt_des_cbc3: data to encrypt (len:%i,%s)", data_len, sc_dump_hex(data, data_len));
+	sc_log(ctx, "SM encrypt_des_cbc3: data to encrypt (len:%i,%s)", in_len, sc_dump_hex(in, in_len));
 
-	*out_len = data_len;
 	*out = malloc(data_len + 8);
 	if (*out == NULL)
 		LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "SM encrypt_des_cbc3: failure");
+	*out_len = data_len;
 
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
+	sm_des3_set_key(&dkey, key);
+	if (len)
+		DES_ede2_cbc_encrypt(in, *out, len, &dkey.ks1, &dkey.ks2, &icv, DES_ENCRYPT);
 
-	for (st=0; st<data_len; st+=8)
-		DES_3cbc_encrypt((DES_cblock *)(data + st), (DES_cblock *)(*out + st), 8, &ks, &ks2, &icv, DES_ENCRYPT);
+	if (data_len > len)   {
+		memset(last, 0, sizeof(last));
+		memcpy(last, in + len, in_len - len);
+		last[in_len - len] = 0x80;
+		DES_ede2_cbc_encrypt(last, *out + len, 8, &dkey.ks1, &dkey.ks2, &icv, DES_ENCRYPT);
+	}
 
-	free(data);
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
@@ -357,7 +351,7 @@ sm_incr_ssc(unsigned char *ssc, size_t ssc_len)
 	if (!ssc)
 		return;
 
-	for (ii = ssc_len - 1;ii >= 0; ii++)   {
+	for (ii = ssc_len - 1;ii >= 0; ii--)   {
 		*(ssc + ii) += 1;
 		if (*(ssc + ii) != 0)
 			break;
@@ -30,11 +30,19 @@ extern "C" {
 
 #include "libopensc/sm.h"
 
+/* 2-key 3DES key, set up once and used for all the blocks of an operation */
+struct sm_des3_key {
+	DES_key_schedule ks1, ks2;
+};
+
 DES_LONG DES_cbc_cksum_3des(const unsigned char *in, DES_cblock *output, long length,
 		DES_key_schedule *schedule, DES_key_schedule *schedule2, const_DES_cblock *ivec);
 DES_LONG DES_cbc_cksum_3des_emv96(const unsigned char *in, DES_cblock *output,
 		long length, DES_key_schedule *schedule, DES_key_schedule *schedule2,
 		const_DES_cblock *ivec);
+void sm_des3_set_key(struct sm_des3_key *dkey, const unsigned char *key);
+void sm_des3_mac(struct sm_des3_key *dkey, const_DES_cblock *icv, const unsigned char *in,
+		size_t in_len, int force_pad, int retail, DES_cblock *out);
 int sm_encrypt_des_ecb3(unsigned char *key, unsigned char *data, int data_len,
 		unsigned char **out, int *out_len);
 int sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
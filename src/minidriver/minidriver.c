@@ -31,6 +31,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <time.h>
 
 #include <windows.h>
@@ -63,6 +64,11 @@
 #define NULLWSTR(a) (a == NULL ? L"<NULL>" : a)
 
 #define MD_MAX_KEY_CONTAINERS 12
+#define MD_MAX_DH_AGREEMENTS 16
+/* size of a coordinate of a point of P-521 */
+#define MD_EC_FIELD_BYTES_MAX 66
+/* size of the RSA_CSP_PUBLICKEYBLOB of a 8192 bit key */
+#define MD_RSA_BLOB_SIZE_MAX (sizeof(PUBLICKEYSTRUC) + sizeof(RSAPUBKEY) + 8192 / 8)
 #define MD_CARDID_SIZE 16
 
 #define MD_UTC_TIME_LENGTH_MAX	16
@@ -132,6 +138,21 @@ struct md_pkcs15_container {
 	unsigned size_key_exchange, size_sign;
 
 	struct sc_pkcs15_object *cert_obj, *prkey_obj, *pubkey_obj;
+
+	/* X || Y of the public key of an EC key, once read */
+	unsigned char ec_point[2 * MD_EC_FIELD_BYTES_MAX];
+	size_t ec_point_len;
+
+	/* RSA_CSP_PUBLICKEYBLOB of the public key of a RSA key, once decoded */
+	unsigned char rsa_blob[MD_RSA_BLOB_SIZE_MAX];
+	DWORD rsa_blob_len;
+};
+
+/* secret of CardConstructDHAgreement(), until CardDestroyDHAgreement() */
+struct md_dh_agreement {
+	BYTE bContainerIndex;
+	DWORD dwSize;
+	PBYTE pbAgreement;
 };
 
 typedef struct _VENDOR_SPECIFIC
@@ -144,8 +165,21 @@ typedef struct _VENDOR_SPECIFIC
 	struct sc_pkcs15_card *p15card;
 
 	struct md_pkcs15_container p15_containers[MD_MAX_KEY_CONTAINERS];
+	struct md_dh_agreement dh_agreements[MD_MAX_DH_AGREEMENTS];
 
 	struct md_directory root;
+	/* 'cmapfile' and the key container files are set on first use */
+	int cmapfile_ready;
+
+	/* md_shared_cache section of the card, once opened */
+	HANDLE shared_map, shared_mutex;
+	void *shared_view;
+
+	/* serial number of the card when it was bound, to recognize it */
+	struct sc_serial_number serialnr;
+
+	/* PINs verified through these handles and not deauthenticated since */
+	PIN_SET pins_verified;
 
 	SCARDCONTEXT hSCardCtx;
 	SCARDHANDLE hScard;
@@ -198,12 +232,47 @@ static int disassociate_card(PCARD_DATA pCardData);
 static DWORD md_get_cardcf(PCARD_DATA pCardData, CARD_CACHE_FILE_FORMAT **out);
 static DWORD md_pkcs15_delete_object(PCARD_DATA pCardData, struct sc_pkcs15_object *obj);
 static DWORD md_fs_init(PCARD_DATA pCardData);
+static DWORD md_fs_load_cmapfile(PCARD_DATA pCardData);
+static void md_read_public_keys(PCARD_DATA pCardData);
+static void md_cache_save(PCARD_DATA pCardData);
+static void md_cache_remove(PCARD_DATA pCardData);
+static int md_cache_is_fresh(PCARD_DATA pCardData);
+
+/* Debug level of the card context, -1 when there is none yet */
+static int md_log_level(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs;
+
+	if (pCardData == NULL)
+		return -1;
+	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+	if (vs == NULL || vs->ctx == NULL)
+		return -1;
+	return vs->ctx->debug;
+}
+
+/* The level is checked before the arguments are evaluated and formatted.
+ * Levels above SC_MAX_LOG_LEVEL (--with-max-log-level) are compiled out. */
+#ifdef CARDMOD_LOW_LEVEL_DEBUG
+#define MD_LOG_ENABLED(pCardData, level) ((level) <= SC_MAX_LOG_LEVEL)
+#else
+#define MD_LOG_ENABLED(pCardData, level) \
+	((level) <= SC_MAX_LOG_LEVEL && md_log_level(pCardData) >= (level))
+#endif
 
-static void logprintf(PCARD_DATA pCardData, int level, const char* format, ...)
+#define logprintf(pCardData, level, ...) do { \
+	if (MD_LOG_ENABLED((pCardData), (level))) \
+		md_logprintf((pCardData), (level), __VA_ARGS__); \
+} while (0)
+#define loghex(pCardData, level, data, len) do { \
+	if (MD_LOG_ENABLED((pCardData), (level))) \
+		md_loghex((pCardData), (level), (data), (len)); \
+} while (0)
+
+static void md_logprintf(PCARD_DATA pCardData, int level, const char* format, ...)
 {
 	va_list arg;
 	VENDOR_SPECIFIC *vs;
-#define CARDMOD_LOW_LEVEL_DEBUG 1
 #ifdef CARDMOD_LOW_LEVEL_DEBUG
 /* Use a simplied log to get all messages including messages
  * before opensc is loaded. The file must be modifiable by all
@@ -211,6 +280,8 @@ static void logprintf(PCARD_DATA pCardData, int level, const char* format, ...)
  * multiple process and threads may get intermingled.
  * flush to get last message before ann crash
  * close so as the file is not left open during any wait.
+ * Enabled with -DCARDMOD_LOW_LEVEL_DEBUG only: it opens the file
+ * for every message, whatever the debug level.
  */
 	{
 		FILE* lldebugfp = NULL;
@@ -227,31 +298,28 @@ static void logprintf(PCARD_DATA pCardData, int level, const char* format, ...)
 	}
 #endif
 
+	if (md_log_level(pCardData) < level)
+		return;
+	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+
 	va_start(arg, format);
-	if(pCardData != NULL)   {
-		vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
-		if(vs != NULL && vs->ctx != NULL)   {
 #ifdef _MSC_VER
-			sc_do_log_noframe(vs->ctx, level, format, arg);
+	sc_do_log_noframe(vs->ctx, level, format, arg);
 #else
-			/* FIXME: trouble in vsprintf with %S arg under mingw32 */
-			if(vs->ctx->debug>=level) {
-				vfprintf(vs->ctx->debug_file, format, arg);
-			}
+	/* FIXME: trouble in vsprintf with %S arg under mingw32 */
+	vfprintf(vs->ctx->debug_file, format, arg);
 #endif
-		}
-	}
 	va_end(arg);
 }
 
-static void loghex(PCARD_DATA pCardData, int level, PBYTE data, int len)
+static void md_loghex(PCARD_DATA pCardData, int level, PBYTE data, int len)
 {
 	char line[74];
 	char *c;
 	int i, a;
 	unsigned char * p;
 
-	logprintf(pCardData, level, "--- %p:%d\n", data, len);
+	md_logprintf(pCardData, level, "--- %p:%d\n", data, len);
 
 	if (data == NULL || len <= 0) return;
 
@@ -267,7 +335,7 @@ static void loghex(PCARD_DATA pCardData, int level, PBYTE data, int len)
 		c += 2;
 		i++;
 		if (i%32 == 0) {
-			logprintf(pCardData, level, " %04X  %s\n", a, line);
+			md_logprintf(pCardData, level, " %04X  %s\n", a, line);
 			a +=32;
 			memset(line, 0, sizeof(line));
 			c = line;
@@ -277,7 +345,7 @@ static void loghex(PCARD_DATA pCardData, int level, PBYTE data, int len)
 		}
 	}
 	if (i%32 != 0)
-		logprintf(pCardData, level, " %04X  %s\n", a, line);
+		md_logprintf(pCardData, level, " %04X  %s\n", a, line);
 }
 
 static void print_werror(PCARD_DATA pCardData, char *str)
@@ -291,6 +359,63 @@ static void print_werror(PCARD_DATA pCardData, char *str)
 	LocalFree(buf);
 }
 
+/*
+ * The caller has changed the handles, often only because another process
+ * had a transaction with the card. Keep the bound card if it is the same:
+ * same reader and ATR, same serial number, and, when the cache file is
+ * used, 'cmapfile' not changed by another process since.
+ */
+static int
+md_is_same_card(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+	struct sc_serial_number serialnr;
+	struct sc_reader *reader;
+	unsigned char atr[SC_MAX_ATR_SIZE];
+	DWORD reader_len = 0, atr_len = sizeof(atr), state, prot;
+	int r;
+
+	if (!vs->reader || !vs->card || !vs->p15card)
+		return 0;
+
+	/* ATR of the new handle, without APDU */
+	if (SCardStatusA(pCardData->hScard, NULL, &reader_len, &state, &prot, atr, &atr_len) != SCARD_S_SUCCESS)
+		return 0;
+	if (atr_len != vs->card->atr.len || memcmp(atr, vs->card->atr.value, atr_len))
+		return 0;
+
+	/* for the same reader, the reader driver only changes its handles */
+	vs->hSCardCtx = pCardData->hSCardCtx;
+	vs->hScard = pCardData->hScard;
+	r = sc_ctx_use_reader(vs->ctx, &vs->hSCardCtx, &vs->hScard);
+	reader = sc_ctx_get_reader(vs->ctx, 0);
+	if (reader != vs->reader)   {
+		/* the old reader is deleted: the card is disconnected from the new
+		 * one, or dropped without unbinding when there is no reader left */
+		vs->reader = reader;
+		if (reader)   {
+			vs->card->reader = reader;
+		}
+		else   {
+			vs->card = NULL;
+			vs->p15card = NULL;
+		}
+		return 0;
+	}
+	if (r != SC_SUCCESS)
+		return 0;
+
+	if (vs->serialnr.len)   {
+		memset(&vs->card->serialnr, 0, sizeof(vs->card->serialnr));
+		r = sc_card_ctl(vs->card, SC_CARDCTL_GET_SERIALNR, &serialnr);
+		if (r != SC_SUCCESS || serialnr.len != vs->serialnr.len
+				|| memcmp(serialnr.value, vs->serialnr.value, serialnr.len))
+			return 0;
+	}
+
+	return md_cache_is_fresh(pCardData);
+}
+
 /*
  * check if the card has been removed, or the
  * caller has changed the handles.
@@ -314,7 +439,13 @@ check_reader_status(PCARD_DATA pCardData)
 	logprintf(pCardData, 7, "pCardData->hSCardCtx:0x%08X hScard:0x%08X\n",
 			pCardData->hSCardCtx, pCardData->hScard);
 
-	if (pCardData->hSCardCtx != vs->hSCardCtx || pCardData->hScard != vs->hScard) {
+	if ((pCardData->hSCardCtx != vs->hSCardCtx || pCardData->hScard != vs->hScard)
+			&& md_is_same_card(pCardData)) {
+		logprintf(pCardData, 1, "HANDLES CHANGED, same card\n");
+		/* a reset seen by the other handles only is not reported to the new ones */
+		vs->pins_verified = 0;
+	}
+	else if (pCardData->hSCardCtx != vs->hSCardCtx || pCardData->hScard != vs->hScard) {
 		logprintf (pCardData, 1, "HANDLES CHANGED from 0x%08X 0x%08X\n", vs->hSCardCtx, vs->hScard);
 
 		// Basically a mini AcquireContext
@@ -468,6 +599,37 @@ md_is_supports_X509_enrollment(PCARD_DATA pCardData)
 	return ret;
 }
 
+/*
+ * Check if a VERIFY of the PIN can be skipped: it was verified with the
+ * same code through these handles, not deauthenticated since, and the card
+ * still holds it as verified (see sc_pkcs15_pin_still_verified()).
+ * A PIN that protects a user consent key is always verified.
+ */
+static BOOL
+md_pin_still_verified(PCARD_DATA pCardData, PIN_ID role, struct sc_pkcs15_object *pin_obj,
+		const BYTE *pin, DWORD pin_len)
+{
+	VENDOR_SPECIFIC *vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+	struct sc_pkcs15_auth_info *auth_info = (struct sc_pkcs15_auth_info *)pin_obj->data;
+	struct sc_pkcs15_object *prkey_objs[MD_MAX_KEY_CONTAINERS];
+	int ii, rv;
+
+	if (!IS_PIN_SET(vs->pins_verified, role))
+		return FALSE;
+
+	rv = sc_pkcs15_get_objects(vs->p15card, SC_PKCS15_TYPE_PRKEY, prkey_objs, MD_MAX_KEY_CONTAINERS);
+	for (ii = 0; ii < rv; ii++)
+		if (prkey_objs[ii]->user_consent
+				&& sc_pkcs15_compare_id(&prkey_objs[ii]->auth_id, &auth_info->auth_id))
+			return FALSE;
+
+	if (!sc_pkcs15_pin_still_verified(vs->p15card, pin_obj, pin, pin_len))
+		return FALSE;
+
+	logprintf(pCardData, 3, "PIN %d is still verified\n", role);
+	return TRUE;
+}
+
 /* Check if specified PIN has been verified */
 static BOOL
 md_is_pin_set(PCARD_DATA pCardData, DWORD role)
@@ -587,6 +749,12 @@ md_fs_find_file(PCARD_DATA pCardData, char *parent, char *name, struct md_file *
 		return SCARD_E_INVALID_PARAMETER;
 	}
 
+	if (!strcmp(dir->name, "mscp"))   {
+		dwret = md_fs_load_cmapfile(pCardData);
+		if (dwret != SCARD_S_SUCCESS)
+			return dwret;
+	}
+
 	for (file = dir->files; file!=NULL;)   {
 		if (!strcmp(file->name, name))
 			break;
@@ -1153,6 +1321,9 @@ md_fs_read_content(PCARD_DATA pCardData, char *parent, struct md_file *file)
 			file->blob = pCardData->pfnCspAlloc(cert->data.len);
 			CopyMemory(file->blob, cert->data.value, cert->data.len);
 			sc_pkcs15_free_certificate(cert);
+
+			/* keep the certificate for the next context */
+			md_cache_save(pCardData);
 		}
 	}
 	else   {
@@ -1285,7 +1456,7 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 		return SCARD_E_NO_MEMORY;
 	memset(cmap_buf, 0, cmap_len);
 
-	rv = sc_pkcs15_get_objects(vs->p15card, SC_PKCS15_TYPE_PRKEY_RSA, prkey_objs, MD_MAX_KEY_CONTAINERS);
+	rv = sc_pkcs15_get_objects(vs->p15card, SC_PKCS15_TYPE_PRKEY, prkey_objs, MD_MAX_KEY_CONTAINERS);
 	if (rv < 0)   {
 		logprintf(pCardData, 0, "Private key enumeration failed: %s\n", sc_strerror(rv));
 		return SCARD_F_UNKNOWN_ERROR;
@@ -1299,9 +1470,16 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 		struct sc_pkcs15_object *key_obj = prkey_objs[ii], *cert_obj = NULL;
 		struct sc_pkcs15_prkey_info *prkey_info = (struct sc_pkcs15_prkey_info *)key_obj->data;
 		struct md_pkcs15_container *cont = &vs->p15_containers[ii];
+		size_t key_size;
 
-		if(key_obj->type != SC_PKCS15_TYPE_PRKEY_RSA)   {
-			logprintf(pCardData, 7, "Non 'RSA' key (type:%X) are ignored\n", key_obj->type);
+		if (key_obj->type == SC_PKCS15_TYPE_PRKEY_RSA)   {
+			key_size = prkey_info->modulus_length;
+		}
+		else if (key_obj->type == SC_PKCS15_TYPE_PRKEY_EC)   {
+			key_size = prkey_info->field_length;
+		}
+		else   {
+			logprintf(pCardData, 7, "Non 'RSA' or 'EC' key (type:%X) are ignored\n", key_obj->type);
 			continue;
 		}
 
@@ -1317,14 +1495,22 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 		/* AT_KEYEXCHANGE is more general key usage,
 		 * 	it allows 'decryption' as well as 'signature' key usage.
 		 * AT_SIGNATURE allows only 'signature' usage.
+		 * An EC key is an ECDH key when it can derive, and an ECDSA one
+		 * when it can sign.
 		 */
 		cont->size_key_exchange = cont->size_sign = 0;
-		if (prkey_info->usage & USAGE_ANY_DECIPHER)
-			cont->size_key_exchange = prkey_info->modulus_length;
+		if (key_obj->type == SC_PKCS15_TYPE_PRKEY_EC)   {
+			if (prkey_info->usage & SC_PKCS15_PRKEY_USAGE_DERIVE)
+				cont->size_key_exchange = key_size;
+			if ((prkey_info->usage & USAGE_ANY_SIGN) || !cont->size_key_exchange)
+				cont->size_sign = key_size;
+		}
+		else if (prkey_info->usage & USAGE_ANY_DECIPHER)
+			cont->size_key_exchange = key_size;
 		else if (prkey_info->usage & USAGE_ANY_SIGN)
-			cont->size_sign = prkey_info->modulus_length;
+			cont->size_sign = key_size;
 		else
-			cont->size_key_exchange = prkey_info->modulus_length;
+			cont->size_key_exchange = key_size;
 		logprintf(pCardData, 7, "Container[%i]'s key-exchange:%i, sign:%i\n", ii, cont->size_key_exchange, cont->size_sign);
 
 		cont->id = prkey_info->id;
@@ -1340,31 +1526,31 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 
 	if (conts_num)   {
 		/* Read 'CMAPFILE' and update the attributes of P15 containers */
-		struct sc_pkcs15_object *dobjs[MD_MAX_KEY_CONTAINERS + 1], *default_cont = NULL;
-		int num_dobjs = MD_MAX_KEY_CONTAINERS + 1;
+		struct sc_pkcs15_search_key sk;
+		struct sc_pkcs15_object_iter it;
+		struct sc_pkcs15_object *dobj, *default_cont = NULL;
 
-		rv = sc_pkcs15_get_objects(vs->p15card, SC_PKCS15_TYPE_DATA_OBJECT, dobjs, num_dobjs);
+		memset(&sk, 0, sizeof(sk));
+		sk.type = SC_PKCS15_TYPE_DATA_OBJECT;
+		rv = sc_pkcs15_iter_init(vs->p15card, &it, &sk);
 		if (rv < 0)   {
 			logprintf(pCardData, 0, "'DATA' object enumeration failed: %s\n", sc_strerror(rv));
 			return SCARD_F_UNKNOWN_ERROR;
 		}
 
-		num_dobjs = rv;
-		logprintf(pCardData, 2, "Found %d 'DATA' objects.\n", num_dobjs);
-
-		for (ii=0;ii<num_dobjs;ii++)   {
-			struct sc_pkcs15_data_info *dinfo = (struct sc_pkcs15_data_info *)dobjs[ii]->data;
+		while ((dobj = sc_pkcs15_iter_next(&it)) != NULL)   {
+			struct sc_pkcs15_data_info *dinfo = (struct sc_pkcs15_data_info *)dobj->data;
 
 			if (strcmp(dinfo->app_label, MD_DATA_APPLICAITON_NAME))
 				continue;
 
-			logprintf(pCardData, 2, "Found 'DATA' object '%s'\n", dobjs[ii]->label);
-			if (!strcmp(dobjs[ii]->label, MD_DATA_DEFAULT_CONT_LABEL))   {
-				default_cont = dobjs[ii];
+			logprintf(pCardData, 2, "Found 'DATA' object '%s'\n", dobj->label);
+			if (!strcmp(dobj->label, MD_DATA_DEFAULT_CONT_LABEL))   {
+				default_cont = dobj;
 				continue;
 			}
 
-			dwret = md_pkcs15_update_container_from_do(pCardData, dobjs[ii]);
+			dwret = md_pkcs15_update_container_from_do(pCardData, dobj);
 			if (dwret != SCARD_S_SUCCESS)   {
 				logprintf(pCardData, 2, "Cannot update container from DO: %li", dwret);
 				return dwret;
@@ -1430,6 +1616,558 @@ md_set_cmapfile(PCARD_DATA pCardData, struct md_file *file)
 	return SCARD_S_SUCCESS;
 }
 
+/*
+ * Persistent cache of the 'soft' file system of a card, so that a new
+ * context on an unchanged card does not rebuild 'cmapfile' nor read the
+ * certificates again. "<cache_dir>/<serial>.mdcache" holds
+ *   "OSCMDC01"		magic and version
+ *   u32 len, bytes	'lastUpdate' of the tokenInfo
+ *   u16, u16		containers and files freshness of 'cardcf'
+ *   MD_MAX_KEY_CONTAINERS times:
+ *     u8 len, bytes	ID of the private key of the container, 0 if unused
+ *     u16 len, bytes	RSA public key blob, none if not decoded
+ *     u8 len, bytes	EC public point, none if not read
+ *   u32 len, bytes	content of 'cmapfile'
+ *   u8 count		number of 'kxc'/'ksc' files
+ *   count times:
+ *     u8 len, bytes	file name
+ *     u32 len, bytes	content, none if not read yet
+ * All numbers are big endian. 'cardcf' is built from 'lastUpdate', so the
+ * cache is only used for a token with a 'lastUpdate', and is checked
+ * against both. Changes through the minidriver remove the cache.
+ * Like the PKCS#15 file cache, the file needs use_file_caching.
+ */
+#define MD_CACHE_MAGIC		"OSCMDC02"
+#define MD_CACHE_MAGIC_LEN	8
+#define MD_CACHE_MAX_FILES	(2 * MD_MAX_KEY_CONTAINERS)
+
+struct md_cache_reader {
+	const unsigned char *p, *end;
+	int error;
+};
+
+static size_t
+md_cache_get_num(struct md_cache_reader *rd, size_t n)
+{
+	size_t val = 0;
+
+	if (rd->error || (size_t)(rd->end - rd->p) < n)   {
+		rd->error = 1;
+		return 0;
+	}
+	while (n--)
+		val = (val << 8) | *rd->p++;
+	return val;
+}
+
+static const unsigned char *
+md_cache_get_bytes(struct md_cache_reader *rd, size_t n)
+{
+	const unsigned char *p = rd->p;
+
+	if (rd->error || (size_t)(rd->end - rd->p) < n)   {
+		rd->error = 1;
+		return NULL;
+	}
+	rd->p += n;
+	return p;
+}
+
+struct md_cache_writer {
+	unsigned char *buf;
+	size_t len, size;
+	int error;
+};
+
+static void
+md_cache_put_bytes(struct md_cache_writer *wr, const void *p, size_t n)
+{
+	if (wr->error)
+		return;
+	if (wr->len + n > wr->size)   {
+		size_t size = wr->size ? 2 * wr->size : 4096;
+		unsigned char *buf;
+
+		while (size < wr->len + n)
+			size *= 2;
+		buf = realloc(wr->buf, size);
+		if (!buf)   {
+			wr->error = 1;
+			return;
+		}
+		wr->buf = buf;
+		wr->size = size;
+	}
+	memcpy(wr->buf + wr->len, p, n);
+	wr->len += n;
+}
+
+static void
+md_cache_put_num(struct md_cache_writer *wr, size_t val, size_t n)
+{
+	unsigned char c;
+
+	while (n--)   {
+		c = (unsigned char)((val >> (8 * n)) & 0xFF);
+		md_cache_put_bytes(wr, &c, 1);
+	}
+}
+
+/* the cache is kept per serial number, and checked against 'lastUpdate' */
+static int
+md_cache_usable(VENDOR_SPECIFIC *vs)
+{
+	return vs->p15card && vs->p15card->tokeninfo->serial_number
+		&& sc_pkcs15_get_lastupdate(vs->p15card);
+}
+
+static int
+md_cache_path(PCARD_DATA pCardData, char *buf, size_t size)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	char dir[MAX_PATH];
+	int r;
+
+	if (!md_cache_usable(vs) || !vs->p15card->opts.use_file_cache)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	r = sc_get_cache_dir(vs->ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	r = snprintf(buf, size, "%s/%s.mdcache", dir, vs->p15card->tokeninfo->serial_number);
+	if (r < 0 || (size_t)r >= size)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/*
+ * With md_shared_cache, the same content is also kept in a named shared
+ * memory section per serial number, for the other processes of the logon
+ * session (Base CSP of the browsers, Outlook, ...) that load the
+ * minidriver. The section starts with the DWORD length of the content,
+ * 0 when empty; a named mutex protects it. It lives while a process has
+ * it open, and does not need use_file_caching.
+ */
+#define MD_SHARED_CACHE_SIZE	(256 * 1024)
+#define MD_SHARED_CACHE_TIMEOUT	2000
+
+static void
+md_shared_cache_close(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+
+	if (vs->shared_view)
+		UnmapViewOfFile(vs->shared_view);
+	if (vs->shared_map)
+		CloseHandle(vs->shared_map);
+	if (vs->shared_mutex)
+		CloseHandle(vs->shared_mutex);
+	vs->shared_view = NULL;
+	vs->shared_map = NULL;
+	vs->shared_mutex = NULL;
+}
+
+static int
+md_shared_cache_open(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	scconf_block *conf_block;
+	const char *serial;
+	char name[128];
+	size_t ii, n;
+
+	if (vs->shared_view)
+		return SC_SUCCESS;
+	if (!md_cache_usable(vs))
+		return SC_ERROR_INVALID_ARGUMENTS;
+	conf_block = sc_get_conf_block(vs->ctx, "framework", "pkcs15", 1);
+	if (!conf_block || !scconf_get_bool(conf_block, "md_shared_cache", 0))
+		return SC_ERROR_NOT_SUPPORTED;
+
+	/* no backslash in the name of a kernel object */
+	serial = vs->p15card->tokeninfo->serial_number;
+	n = strlen(strcpy(name, "Local\\OpenSC-md-"));
+	for (ii = 0; serial[ii] && n < sizeof(name) - sizeof("-lock"); ii++)
+		name[n++] = isalnum((unsigned char)serial[ii]) ? serial[ii] : '_';
+	name[n] = '\0';
+
+	vs->shared_map = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+			0, MD_SHARED_CACHE_SIZE, name);
+	if (vs->shared_map)
+		vs->shared_view = MapViewOfFile(vs->shared_map, FILE_MAP_ALL_ACCESS, 0, 0, MD_SHARED_CACHE_SIZE);
+	strcpy(name + n, "-lock");
+	vs->shared_mutex = CreateMutexA(NULL, FALSE, name);
+	if (!vs->shared_view || !vs->shared_mutex)   {
+		logprintf(pCardData, 2, "cannot open MD shared cache '%s': %u\n", name, GetLastError());
+		md_shared_cache_close(pCardData);
+		return SC_ERROR_INTERNAL;
+	}
+	return SC_SUCCESS;
+}
+
+static int
+md_shared_cache_lock(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	DWORD rv;
+
+	if (md_shared_cache_open(pCardData) != SC_SUCCESS)
+		return 0;
+	rv = WaitForSingleObject(vs->shared_mutex, MD_SHARED_CACHE_TIMEOUT);
+	if (rv != WAIT_OBJECT_0 && rv != WAIT_ABANDONED)   {
+		logprintf(pCardData, 2, "MD shared cache is locked\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* store the content, or empty the section when 'buf' is NULL */
+static void
+md_shared_cache_put(PCARD_DATA pCardData, const unsigned char *buf, size_t len)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	DWORD *shared_len;
+
+	if (!md_shared_cache_lock(pCardData))
+		return;
+	shared_len = (DWORD *)vs->shared_view;
+	if (buf && len <= MD_SHARED_CACHE_SIZE - sizeof(DWORD))   {
+		memcpy(shared_len + 1, buf, len);
+		*shared_len = (DWORD)len;
+	}
+	else   {
+		*shared_len = 0;
+	}
+	ReleaseMutex(vs->shared_mutex);
+}
+
+/* a copy of the content, to be freed */
+static unsigned char *
+md_shared_cache_get(PCARD_DATA pCardData, size_t *len)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	unsigned char *buf = NULL;
+	DWORD *shared_len;
+
+	if (!md_shared_cache_lock(pCardData))
+		return NULL;
+	shared_len = (DWORD *)vs->shared_view;
+	if (*shared_len && *shared_len <= MD_SHARED_CACHE_SIZE - sizeof(DWORD))   {
+		buf = malloc(*shared_len);
+		if (buf)   {
+			memcpy(buf, shared_len + 1, *shared_len);
+			*len = *shared_len;
+		}
+	}
+	ReleaseMutex(vs->shared_mutex);
+	return buf;
+}
+
+static unsigned char *
+md_cache_read_file(const char *path, size_t *len)
+{
+	unsigned char *buf = NULL;
+	long size = 0;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return NULL;
+	if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0)
+		buf = malloc(size);
+	if (buf && fread(buf, 1, size, f) != (size_t)size)   {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	*len = size;
+	return buf;
+}
+
+static void
+md_cache_remove(PCARD_DATA pCardData)
+{
+	char path[MAX_PATH];
+
+	if (md_cache_path(pCardData, path, sizeof(path)) == SC_SUCCESS)
+		remove(path);
+	md_shared_cache_put(pCardData, NULL, 0);
+}
+
+static void
+md_cache_save(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	CARD_CACHE_FILE_FORMAT *cardcf = NULL;
+	struct md_cache_writer wr;
+	struct md_file *cmapfile = NULL, *file;
+	char path[MAX_PATH], tmp[MAX_PATH + 4], *last_update;
+	size_t count = 0;
+	int ii, ok;
+	FILE *f;
+
+	if (!md_cache_usable(vs))
+		return;
+	md_fs_find_file(pCardData, "mscp", "cmapfile", &cmapfile);
+	if (!cmapfile || !cmapfile->blob || md_get_cardcf(pCardData, &cardcf) != SCARD_S_SUCCESS)
+		return;
+	last_update = sc_pkcs15_get_lastupdate(vs->p15card);
+
+	memset(&wr, 0, sizeof(wr));
+	md_cache_put_bytes(&wr, MD_CACHE_MAGIC, MD_CACHE_MAGIC_LEN);
+	md_cache_put_num(&wr, strlen(last_update), 4);
+	md_cache_put_bytes(&wr, last_update, strlen(last_update));
+	md_cache_put_num(&wr, cardcf->wContainersFreshness, 2);
+	md_cache_put_num(&wr, cardcf->wFilesFreshness, 2);
+	for (ii = 0; ii < MD_MAX_KEY_CONTAINERS; ii++)   {
+		struct md_pkcs15_container *cont = &vs->p15_containers[ii];
+		size_t len = cont->prkey_obj ? cont->id.len : 0;
+
+		md_cache_put_num(&wr, len, 1);
+		md_cache_put_bytes(&wr, cont->id.value, len);
+		len = cont->prkey_obj ? cont->rsa_blob_len : 0;
+		md_cache_put_num(&wr, len, 2);
+		md_cache_put_bytes(&wr, cont->rsa_blob, len);
+		len = cont->prkey_obj ? cont->ec_point_len : 0;
+		md_cache_put_num(&wr, len, 1);
+		md_cache_put_bytes(&wr, cont->ec_point, len);
+	}
+	md_cache_put_num(&wr, cmapfile->size, 4);
+	md_cache_put_bytes(&wr, cmapfile->blob, cmapfile->size);
+	for (file = cmapfile->next; file; file = file->next)
+		count++;
+	md_cache_put_num(&wr, count, 1);
+	for (file = cmapfile->next; file; file = file->next)   {
+		size_t len = strlen((char *)file->name);
+
+		md_cache_put_num(&wr, len, 1);
+		md_cache_put_bytes(&wr, file->name, len);
+		md_cache_put_num(&wr, file->blob ? file->size : 0, 4);
+		if (file->blob)
+			md_cache_put_bytes(&wr, file->blob, file->size);
+	}
+	if (wr.error)   {
+		free(wr.buf);
+		return;
+	}
+
+	md_shared_cache_put(pCardData, wr.buf, wr.len);
+
+	if (md_cache_path(pCardData, path, sizeof(path)) != SC_SUCCESS)   {
+		free(wr.buf);
+		return;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	f = fopen(tmp, "wb");
+	if (f == NULL && sc_make_cache_dir(vs->ctx) == SC_SUCCESS)
+		f = fopen(tmp, "wb");
+	if (f == NULL)   {
+		free(wr.buf);
+		return;
+	}
+	ok = fwrite(wr.buf, 1, wr.len, f) == wr.len;
+	free(wr.buf);
+	if (fclose(f) != 0)
+		ok = 0;
+
+	/* rename() does not replace an existing file here */
+	if (!ok || !MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING))   {
+		logprintf(pCardData, 2, "cannot write MD cache '%s'\n", path);
+		remove(tmp);
+		return;
+	}
+	logprintf(pCardData, 3, "MD cache '%s' written\n", path);
+}
+
+/*
+ * Set 'cmapfile', the containers and the certificate files from a cached
+ * content. Returns SCARD_E_FILE_NOT_FOUND when it is not valid for the card.
+ */
+static DWORD
+md_cache_parse(PCARD_DATA pCardData, struct md_file *cmapfile, const unsigned char *buf, size_t size)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	CARD_CACHE_FILE_FORMAT *cardcf = NULL;
+	struct md_cache_reader rd;
+	struct {
+		char name[9];
+		const unsigned char *blob;
+		size_t size;
+	} files[MD_CACHE_MAX_FILES];
+	const unsigned char *p, *cmap;
+	char *last_update;
+	size_t len, cmap_len, count, ii;
+	DWORD dwret = SCARD_E_FILE_NOT_FOUND;
+
+	if (md_get_cardcf(pCardData, &cardcf) != SCARD_S_SUCCESS)
+		return SCARD_E_FILE_NOT_FOUND;
+	last_update = sc_pkcs15_get_lastupdate(vs->p15card);
+
+	rd.p = buf;
+	rd.end = buf + size;
+	rd.error = 0;
+
+	p = md_cache_get_bytes(&rd, MD_CACHE_MAGIC_LEN);
+	if (!p || memcmp(p, MD_CACHE_MAGIC, MD_CACHE_MAGIC_LEN))
+		goto out;
+	len = md_cache_get_num(&rd, 4);
+	p = md_cache_get_bytes(&rd, len);
+	if (!p || len != strlen(last_update) || memcmp(p, last_update, len))
+		goto out;
+	if (md_cache_get_num(&rd, 2) != cardcf->wContainersFreshness
+			|| md_cache_get_num(&rd, 2) != cardcf->wFilesFreshness)   {
+		logprintf(pCardData, 2, "MD cache is not fresh\n");
+		goto out;
+	}
+
+	/* the keys must still be there */
+	memset(vs->p15_containers, 0, sizeof(vs->p15_containers));
+	for (ii = 0; ii < MD_MAX_KEY_CONTAINERS; ii++)   {
+		struct md_pkcs15_container *cont = &vs->p15_containers[ii];
+
+		len = md_cache_get_num(&rd, 1);
+		p = md_cache_get_bytes(&rd, len);
+		if (!p || len > sizeof(cont->id.value))
+			goto out;
+		memcpy(cont->id.value, p, len);
+		cont->id.len = len;
+		len = md_cache_get_num(&rd, 2);
+		p = md_cache_get_bytes(&rd, len);
+		if (!p || len > sizeof(cont->rsa_blob))
+			goto out;
+		memcpy(cont->rsa_blob, p, len);
+		cont->rsa_blob_len = (DWORD)len;
+		len = md_cache_get_num(&rd, 1);
+		p = md_cache_get_bytes(&rd, len);
+		if (!p || len > sizeof(cont->ec_point))
+			goto out;
+		memcpy(cont->ec_point, p, len);
+		cont->ec_point_len = len;
+		if (!cont->id.len)
+			continue;
+		if (sc_pkcs15_find_prkey_by_id(vs->p15card, &cont->id, &cont->prkey_obj))
+			goto out;
+		sc_pkcs15_find_cert_by_id(vs->p15card, &cont->id, &cont->cert_obj);
+		sc_pkcs15_find_pubkey_by_id(vs->p15card, &cont->id, &cont->pubkey_obj);
+	}
+
+	cmap_len = md_cache_get_num(&rd, 4);
+	cmap = md_cache_get_bytes(&rd, cmap_len);
+	count = md_cache_get_num(&rd, 1);
+	if (!cmap || !cmap_len || count > MD_CACHE_MAX_FILES)
+		goto out;
+	for (ii = 0; ii < count; ii++)   {
+		len = md_cache_get_num(&rd, 1);
+		p = md_cache_get_bytes(&rd, len);
+		if (!p || len >= sizeof(files[ii].name))
+			goto out;
+		memcpy(files[ii].name, p, len);
+		files[ii].name[len] = '\0';
+		files[ii].size = md_cache_get_num(&rd, 4);
+		files[ii].blob = md_cache_get_bytes(&rd, files[ii].size);
+	}
+	if (rd.error || rd.p != rd.end)
+		goto out;
+
+	dwret = md_fs_set_content(pCardData, cmapfile, (unsigned char *)cmap, cmap_len);
+	for (ii = 0; dwret == SCARD_S_SUCCESS && ii < count; ii++)
+		dwret = md_fs_add_file(pCardData, &(cmapfile->next), files[ii].name, cmapfile->acl,
+				(unsigned char *)files[ii].blob, files[ii].size, NULL);
+
+out:
+	if (dwret == SCARD_E_FILE_NOT_FOUND)
+		memset(vs->p15_containers, 0, sizeof(vs->p15_containers));
+	return dwret;
+}
+
+/*
+ * Set 'cmapfile', the containers and the certificate files from the shared
+ * cache, else from the cache file. Returns SCARD_E_FILE_NOT_FOUND when
+ * there is no valid cache for the card.
+ */
+static DWORD
+md_cache_load(PCARD_DATA pCardData, struct md_file *cmapfile)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	unsigned char *buf;
+	char path[MAX_PATH];
+	size_t size = 0;
+	DWORD dwret = SCARD_E_FILE_NOT_FOUND;
+
+	if (!md_cache_usable(vs))
+		return SCARD_E_FILE_NOT_FOUND;
+
+	buf = md_shared_cache_get(pCardData, &size);
+	if (buf)   {
+		dwret = md_cache_parse(pCardData, cmapfile, buf, size);
+		free(buf);
+		if (dwret == SCARD_S_SUCCESS)
+			logprintf(pCardData, 3, "MD virtual file system loaded from the shared cache\n");
+		if (dwret != SCARD_E_FILE_NOT_FOUND)
+			return dwret;
+	}
+
+	if (md_cache_path(pCardData, path, sizeof(path)) != SC_SUCCESS)
+		return SCARD_E_FILE_NOT_FOUND;
+	buf = md_cache_read_file(path, &size);
+	if (!buf)
+		return SCARD_E_FILE_NOT_FOUND;
+	dwret = md_cache_parse(pCardData, cmapfile, buf, size);
+	if (dwret == SCARD_S_SUCCESS)   {
+		logprintf(pCardData, 3, "MD virtual file system loaded from '%s'\n", path);
+		md_shared_cache_put(pCardData, buf, size);
+	}
+	free(buf);
+	return dwret;
+}
+
+/*
+ * Check that the cached content is still the one of this context. Another
+ * process changing the card removes it, or writes it with a new
+ * 'lastUpdate' or 'cardcf'. True when no cache is used.
+ */
+static int
+md_cache_is_fresh(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	CARD_CACHE_FILE_FORMAT *cardcf = NULL;
+	struct md_cache_reader rd;
+	const unsigned char *p;
+	unsigned char *buf;
+	char path[MAX_PATH], *last_update;
+	size_t len, size = 0;
+	int fresh;
+
+	if (!vs->cmapfile_ready || !md_cache_usable(vs)
+			|| md_get_cardcf(pCardData, &cardcf) != SCARD_S_SUCCESS)
+		return 1;
+	last_update = sc_pkcs15_get_lastupdate(vs->p15card);
+
+	buf = md_shared_cache_get(pCardData, &size);
+	if (!buf && vs->shared_view)
+		return 0;
+	if (!buf && md_cache_path(pCardData, path, sizeof(path)) != SC_SUCCESS)
+		return 1;
+	if (!buf)
+		buf = md_cache_read_file(path, &size);
+	if (!buf)
+		return 0;
+
+	rd.p = buf;
+	rd.end = buf + size;
+	rd.error = 0;
+	p = md_cache_get_bytes(&rd, MD_CACHE_MAGIC_LEN);
+	fresh = p && !memcmp(p, MD_CACHE_MAGIC, MD_CACHE_MAGIC_LEN);
+	len = md_cache_get_num(&rd, 4);
+	p = md_cache_get_bytes(&rd, len);
+	fresh = fresh && p && len == strlen(last_update) && !memcmp(p, last_update, len)
+		&& md_cache_get_num(&rd, 2) == cardcf->wContainersFreshness
+		&& md_cache_get_num(&rd, 2) == cardcf->wFilesFreshness
+		&& !rd.error;
+	free(buf);
+	return fresh;
+}
+
 /*
  * Initialize internal 'soft' file system
  */
@@ -1471,17 +2209,65 @@ md_fs_init(PCARD_DATA pCardData)
 	if (dwret != SCARD_S_SUCCESS)
 		return dwret;
 
+	/* The content of 'cmapfile' and the key container files is only set
+	 * when the 'mscp' directory or a key container is first used */
 	dwret = md_fs_add_file(pCardData, &(mscp->files), "cmapfile", EveryoneReadUserWriteAc, NULL, 0, &cmapfile);
 	if (dwret != SCARD_S_SUCCESS)
 		return dwret;
-	dwret = md_set_cmapfile(pCardData, cmapfile);
-	if (dwret != SCARD_S_SUCCESS)
-		return dwret;
+	memset(vs->p15_containers, 0, sizeof(vs->p15_containers));
+	vs->cmapfile_ready = 0;
 
 	logprintf(pCardData, 3, "MD virtual file system initialized\n");
 	return SCARD_S_SUCCESS;
 }
 
+/*
+ * Set 'cmapfile', the key container files and the PKCS#15 containers,
+ * from the cache file if it is still valid, else from the PKCS#15 objects
+ */
+static DWORD
+md_fs_load_cmapfile(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs;
+	struct md_directory *mscp = NULL;
+	struct md_file *cmapfile;
+	DWORD dwret;
+
+	if (!pCardData || !pCardData->pvVendorSpecific)
+		return SCARD_E_INVALID_PARAMETER;
+
+	vs = pCardData->pvVendorSpecific;
+	if (vs->cmapfile_ready)
+		return SCARD_S_SUCCESS;
+
+	dwret = md_fs_find_directory(pCardData, NULL, "mscp", &mscp);
+	if (dwret != SCARD_S_SUCCESS || !mscp)
+		return SCARD_E_FILE_NOT_FOUND;
+	for (cmapfile = mscp->files; cmapfile; cmapfile = cmapfile->next)
+		if (!strcmp(cmapfile->name, "cmapfile"))
+			break;
+	if (!cmapfile)
+		return SCARD_E_FILE_NOT_FOUND;
+
+	/* set first: md_cache_save() looks up 'cmapfile' again */
+	vs->cmapfile_ready = 1;
+	dwret = md_cache_load(pCardData, cmapfile);
+	if (dwret == SCARD_E_FILE_NOT_FOUND)   {
+		dwret = md_set_cmapfile(pCardData, cmapfile);
+		if (dwret == SCARD_S_SUCCESS)   {
+			md_read_public_keys(pCardData);
+			md_cache_save(pCardData);
+		}
+	}
+	if (dwret != SCARD_S_SUCCESS)   {
+		vs->cmapfile_ready = 0;
+		return dwret;
+	}
+
+	logprintf(pCardData, 3, "MD 'cmapfile' set\n");
+	return SCARD_S_SUCCESS;
+}
+
 /* Create SC context */
 static DWORD
 md_create_context(PCARD_DATA pCardData, VENDOR_SPECIFIC *vs)
@@ -1529,6 +2315,7 @@ static DWORD
 md_free_space(PCARD_DATA pCardData, PCARD_FREE_SPACE_INFO pCardFreeSpaceInfo)
 {
 	VENDOR_SPECIFIC *vs;
+	DWORD dwret;
 	int count, idx;
 
 	if (!pCardData || !pCardFreeSpaceInfo)
@@ -1539,6 +2326,10 @@ md_free_space(PCARD_DATA pCardData, PCARD_FREE_SPACE_INFO pCardFreeSpaceInfo)
 
 	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
 
+	dwret = md_fs_load_cmapfile(pCardData);
+	if (dwret != SCARD_S_SUCCESS)
+		return dwret;
+
 	/* Count free containers */
 	for (idx=0, count=0; idx<MD_MAX_KEY_CONTAINERS; idx++)
 		if (!vs->p15_containers[idx].prkey_obj)
@@ -1695,6 +2486,8 @@ md_pkcs15_generate_key(PCARD_DATA pCardData, DWORD idx, DWORD key_type, DWORD ke
 
 	sc_pkcs15init_set_p15card(profile, vs->p15card);
 	cont = &(vs->p15_containers[idx]);
+	cont->rsa_blob_len = 0;
+	cont->ec_point_len = 0;
 	if (strlen(cont->guid))
 		keygen_args.prkey_args.guid = cont->guid;
 
@@ -1807,6 +2600,8 @@ md_pkcs15_store_key(PCARD_DATA pCardData, DWORD idx, DWORD key_type, BYTE *blob,
 
 	sc_pkcs15init_set_p15card(profile, vs->p15card);
 	cont = &(vs->p15_containers[idx]);
+	cont->rsa_blob_len = 0;
+	cont->ec_point_len = 0;
 	if (strlen(cont->guid))
 		prkey_args.guid = cont->guid;
 
@@ -1898,15 +2693,40 @@ done:
 }
 
 static DWORD
-md_query_key_sizes(CARD_KEY_SIZES *pKeySizes)
+md_query_key_sizes(DWORD dwKeySpec, CARD_KEY_SIZES *pKeySizes)
 {
+	DWORD ec_size = 0;
+
 	if (!pKeySizes)
 		return SCARD_E_INVALID_PARAMETER;
 
 	if (pKeySizes->dwVersion != CARD_KEY_SIZES_CURRENT_VERSION && pKeySizes->dwVersion != 0)
 		return ERROR_REVISION_MISMATCH;
 
+	switch (dwKeySpec)   {
+	case AT_ECDSA_P256:
+	case AT_ECDHE_P256:
+		ec_size = 256;
+		break;
+	case AT_ECDSA_P384:
+	case AT_ECDHE_P384:
+		ec_size = 384;
+		break;
+	case AT_ECDSA_P521:
+	case AT_ECDHE_P521:
+		ec_size = 521;
+		break;
+	}
+
 	pKeySizes->dwVersion = CARD_KEY_SIZES_CURRENT_VERSION;
+	if (ec_size)   {
+		pKeySizes->dwMinimumBitlen = ec_size;
+		pKeySizes->dwDefaultBitlen = ec_size;
+		pKeySizes->dwMaximumBitlen = ec_size;
+		pKeySizes->dwIncrementalBitlen = 0;
+		return SCARD_S_SUCCESS;
+	}
+
 	pKeySizes->dwMinimumBitlen = 1024;
 	pKeySizes->dwDefaultBitlen = 2048;
 	pKeySizes->dwMaximumBitlen = 2048;
@@ -2004,11 +2824,16 @@ DWORD WINAPI CardCreateContainer(__in PCARD_DATA pCardData,
 		loghex(pCardData, 7, pbKeyData, dwKeySize);
 	}
 
+	dwret = md_fs_load_cmapfile(pCardData);
+	if (dwret != SCARD_S_SUCCESS)
+		return dwret;
+
 	dwret = md_check_key_compatibility(pCardData, dwFlags, dwKeySpec, dwKeySize, pbKeyData);
 	if (dwret != SCARD_S_SUCCESS)   {
 		logprintf(pCardData, 1, "check key compatibility failed");
 		return dwret;
 	}
+	md_cache_remove(pCardData);
 
 	if (dwFlags & CARD_CREATE_CONTAINER_KEY_GEN)   {
 		dwret = md_pkcs15_generate_key(pCardData, bContainerIndex, dwKeySpec, dwKeySize);
@@ -2040,45 +2865,140 @@ typedef struct {
 	RSAPUBKEY rsapubkey;
 } PUBKEYSTRUCT_BASE;
 
-DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContainerIndex, __in DWORD dwFlags,
-	__in PCONTAINER_INFO pContainerInfo)
+/*
+ * Read the public key of an EC container once: 'ec_point' keeps X || Y
+ * for the next handshakes.
+ */
+static DWORD
+md_ec_read_point(PCARD_DATA pCardData, struct md_pkcs15_container *cont)
 {
-	VENDOR_SPECIFIC *vs = NULL;
-	DWORD sz = 0;
-	DWORD ret = SCARD_F_UNKNOWN_ERROR;
-	struct md_pkcs15_container *cont = NULL;
-	struct sc_pkcs15_der pubkey_der;
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	struct sc_pkcs15_prkey_info *prkey_info = (struct sc_pkcs15_prkey_info *)cont->prkey_obj->data;
+	struct sc_pkcs15_pubkey *pubkey = NULL;
+	struct sc_pkcs15_cert *cert = NULL;
+	struct sc_pkcs15_u8 *point = NULL;
+	size_t len = (prkey_info->field_length + 7) / 8;
+	DWORD dwret = SCARD_E_FILE_NOT_FOUND;
 	int rv;
 
-	if(!pCardData)
-		return SCARD_E_INVALID_PARAMETER;
-	if (!pContainerInfo)
-		return SCARD_E_INVALID_PARAMETER;
+	if (cont->ec_point_len)
+		return SCARD_S_SUCCESS;
+	if (!len || len > MD_EC_FIELD_BYTES_MAX)
+		return SCARD_E_UNSUPPORTED_FEATURE;
 
-	logprintf(pCardData, 1, "\nP:%d T:%d pCardData:%p ",GetCurrentProcessId(), GetCurrentThreadId(), pCardData);
-	logprintf(pCardData, 1, "CardGetContainerInfo bContainerIndex=%u, dwFlags=0x%08X, " \
-		"dwVersion=%u, cbSigPublicKey=%u, cbKeyExPublicKey=%u\n", \
-		bContainerIndex, dwFlags, pContainerInfo->dwVersion, \
-		pContainerInfo->cbSigPublicKey, pContainerInfo->cbKeyExPublicKey);
+	if (cont->pubkey_obj)   {
+		logprintf(pCardData, 1, "now read public key '%s'\n", cont->pubkey_obj->label);
+		rv = sc_pkcs15_read_pubkey(vs->p15card, cont->pubkey_obj, &pubkey);
+		if (rv)
+			logprintf(pCardData, 1, "public key read error %d\n", rv);
+		else if (pubkey->algorithm == SC_ALGORITHM_EC)
+			point = &pubkey->u.ec.ecpointQ;
+	}
 
-	if (dwFlags)
-		return SCARD_E_INVALID_PARAMETER;
-	if (bContainerIndex >= MD_MAX_KEY_CONTAINERS)
-		return SCARD_E_NO_KEY_CONTAINER;
-	if (pContainerInfo->dwVersion < 0 || pContainerInfo->dwVersion >  CONTAINER_INFO_CURRENT_VERSION)
-		return ERROR_REVISION_MISMATCH;
+	if (!point && cont->cert_obj)   {
+		logprintf(pCardData, 1, "now read certificate '%s'\n", cont->cert_obj->label);
+		rv = sc_pkcs15_read_certificate(vs->p15card, (struct sc_pkcs15_cert_info *)(cont->cert_obj->data), &cert);
+		if (rv)
+			logprintf(pCardData, 1, "certificate read error %d\n", rv);
+		else if (cert->key && cert->key->algorithm == SC_ALGORITHM_EC)
+			point = &cert->key->u.ec.ecpointQ;
+	}
 
-	pContainerInfo->dwVersion = CONTAINER_INFO_CURRENT_VERSION;
+	/* only an uncompressed point: 04 || X || Y */
+	if (point && point->len == 1 + 2 * len && point->value[0] == 0x04)   {
+		memcpy(cont->ec_point, point->value + 1, 2 * len);
+		cont->ec_point_len = 2 * len;
+		dwret = SCARD_S_SUCCESS;
+	}
+	else if (point)   {
+		logprintf(pCardData, 1, "unsupported EC point of %i bytes\n", point->len);
+		dwret = SCARD_E_UNSUPPORTED_FEATURE;
+	}
 
-	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
-	cont = &vs->p15_containers[bContainerIndex];
+	if (pubkey)
+		sc_pkcs15_free_pubkey(pubkey);
+	if (cert)
+		sc_pkcs15_free_certificate(cert);
+	return dwret;
+}
 
-	if (!cont->prkey_obj)   {
-		logprintf(pCardData, 7, "Container %i is empty\n", bContainerIndex);
-		return SCARD_E_NO_KEY_CONTAINER;
+/* BCRYPT_ECCKEY_BLOB of an EC container, for ECDSA or for ECDH */
+static DWORD
+md_ec_key_blob(PCARD_DATA pCardData, struct md_pkcs15_container *cont, int ecdh, PBYTE *out, DWORD *out_len)
+{
+	struct sc_pkcs15_prkey_info *prkey_info = (struct sc_pkcs15_prkey_info *)cont->prkey_obj->data;
+	BCRYPT_ECCKEY_BLOB *blob;
+	ULONG magic;
+	DWORD sz;
+
+	switch (prkey_info->field_length)   {
+	case 256:
+		magic = ecdh ? BCRYPT_ECDH_PUBLIC_P256_MAGIC : BCRYPT_ECDSA_PUBLIC_P256_MAGIC;
+		break;
+	case 384:
+		magic = ecdh ? BCRYPT_ECDH_PUBLIC_P384_MAGIC : BCRYPT_ECDSA_PUBLIC_P384_MAGIC;
+		break;
+	case 521:
+		magic = ecdh ? BCRYPT_ECDH_PUBLIC_P521_MAGIC : BCRYPT_ECDSA_PUBLIC_P521_MAGIC;
+		break;
+	default:
+		logprintf(pCardData, 1, "unsupported EC field length %i\n", prkey_info->field_length);
+		return SCARD_E_UNSUPPORTED_FEATURE;
 	}
 
-	check_reader_status(pCardData);
+	sz = sizeof(BCRYPT_ECCKEY_BLOB) + cont->ec_point_len;
+	blob = (BCRYPT_ECCKEY_BLOB *)pCardData->pfnCspAlloc(sz);
+	if (!blob)
+		return SCARD_E_NO_MEMORY;
+	blob->dwMagic = magic;
+	blob->cbKey = cont->ec_point_len / 2;
+	memcpy(blob + 1, cont->ec_point, cont->ec_point_len);
+
+	*out = (PBYTE)blob;
+	*out_len = sz;
+	return SCARD_S_SUCCESS;
+}
+
+static DWORD
+md_ec_container_info(PCARD_DATA pCardData, struct md_pkcs15_container *cont, PCONTAINER_INFO pContainerInfo)
+{
+	DWORD dwret;
+
+	dwret = md_ec_read_point(pCardData, cont);
+	if (dwret != SCARD_S_SUCCESS)
+		return dwret;
+
+	if (cont->size_sign)   {
+		dwret = md_ec_key_blob(pCardData, cont, 0, &pContainerInfo->pbSigPublicKey, &pContainerInfo->cbSigPublicKey);
+		if (dwret != SCARD_S_SUCCESS)
+			return dwret;
+	}
+
+	if (cont->size_key_exchange)   {
+		dwret = md_ec_key_blob(pCardData, cont, 1, &pContainerInfo->pbKeyExPublicKey, &pContainerInfo->cbKeyExPublicKey);
+		if (dwret != SCARD_S_SUCCESS)
+			return dwret;
+	}
+
+	return SCARD_S_SUCCESS;
+}
+
+/*
+ * Decode the public key of a RSA key into the RSA_CSP_PUBLICKEYBLOB of the
+ * container, once. Its 'aiKeyAlg' is set by the caller.
+ */
+static DWORD
+md_rsa_read_blob(PCARD_DATA pCardData, struct md_pkcs15_container *cont)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	struct sc_pkcs15_der pubkey_der;
+	DWORD ret = SCARD_F_UNKNOWN_ERROR;
+	DWORD sz = 0;
+	int rv;
+
+	if (cont->rsa_blob_len)
+		return SCARD_S_SUCCESS;
+
 	pubkey_der.value = NULL;
 	pubkey_der.len = 0;
 
@@ -2124,7 +3044,7 @@ DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContaine
 			sc_pkcs15_free_certificate(cert);
 		}
 		else   {
-			logprintf(pCardData, 1, "certificate '%d' read error %d\n", bContainerIndex, rv);
+			logprintf(pCardData, 1, "certificate '%s' read error %d\n", cont->cert_obj->label, rv);
 			ret = SCARD_E_FILE_NOT_FOUND;
 		}
 	}
@@ -2133,49 +3053,126 @@ DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContaine
 		logprintf(pCardData, 2, "cannot find public key\n");
 		return SCARD_F_INTERNAL_ERROR;
 	}
-
-	if (ret != SCARD_S_SUCCESS)   {
-		logprintf(pCardData, 7, "GetContainerInfo(idx:%i) failed; error %X", bContainerIndex, ret);
+	if (ret != SCARD_S_SUCCESS || !pubkey_der.value)
 		return ret;
-	}
 
 	logprintf(pCardData, 7, "SubjectPublicKeyInfo:\n");
 	loghex(pCardData, 7, pubkey_der.value, pubkey_der.len);
 
-	if (pubkey_der.len && pubkey_der.value)   {
-		sz = 0; /* get size */
-		CryptDecodeObject(X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, RSA_CSP_PUBLICKEYBLOB,
-				pubkey_der.value, pubkey_der.len, 0, NULL, &sz);
+	if (!CryptDecodeObject(X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, RSA_CSP_PUBLICKEYBLOB,
+				pubkey_der.value, pubkey_der.len, 0, NULL, &sz))
+		ret = SCARD_F_INTERNAL_ERROR;
+	else if (sz > sizeof(cont->rsa_blob))
+		ret = SCARD_E_UNSUPPORTED_FEATURE;
+	else if (!CryptDecodeObject(X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, RSA_CSP_PUBLICKEYBLOB,
+				pubkey_der.value, pubkey_der.len, 0, cont->rsa_blob, &sz))
+		ret = SCARD_F_INTERNAL_ERROR;
+	else
+		cont->rsa_blob_len = sz;
+	free(pubkey_der.value);
+	return ret;
+}
 
-		if (cont->size_sign)   {
-			PUBKEYSTRUCT_BASE *oh = (PUBKEYSTRUCT_BASE *)pCardData->pfnCspAlloc(sz);
-			if (!oh)
-				return SCARD_E_NO_MEMORY;
+/*
+ * Read the public keys of the containers when 'cmapfile' is built, so that
+ * they are saved with it in the cache. A key that cannot be read now is
+ * read again by CardGetContainerInfo().
+ */
+static void
+md_read_public_keys(PCARD_DATA pCardData)
+{
+	VENDOR_SPECIFIC *vs = pCardData->pvVendorSpecific;
+	int ii;
 
-			CryptDecodeObject(X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, RSA_CSP_PUBLICKEYBLOB,
-					pubkey_der.value, pubkey_der.len, 0, oh, &sz);
+	for (ii = 0; ii < MD_MAX_KEY_CONTAINERS; ii++)   {
+		struct md_pkcs15_container *cont = &vs->p15_containers[ii];
 
-			oh->publickeystruc.aiKeyAlg = CALG_RSA_SIGN;
-			pContainerInfo->cbSigPublicKey = sz;
-			pContainerInfo->pbSigPublicKey = (PBYTE)oh;
+		if (!cont->prkey_obj || !(cont->size_sign || cont->size_key_exchange))
+			continue;
+		if (cont->prkey_obj->type == SC_PKCS15_TYPE_PRKEY_EC)
+			md_ec_read_point(pCardData, cont);
+		else
+			md_rsa_read_blob(pCardData, cont);
+	}
+}
 
-			logprintf(pCardData, 3, "return info on SIGN_CONTAINER_INDEX %i\n", bContainerIndex);
-		}
+DWORD WINAPI CardGetContainerInfo(__in PCARD_DATA pCardData, __in BYTE bContainerIndex, __in DWORD dwFlags,
+	__in PCONTAINER_INFO pContainerInfo)
+{
+	VENDOR_SPECIFIC *vs = NULL;
+	DWORD ret = SCARD_F_UNKNOWN_ERROR;
+	struct md_pkcs15_container *cont = NULL;
 
-		if (cont->size_key_exchange)   {
-			PUBKEYSTRUCT_BASE *oh = (PUBKEYSTRUCT_BASE*)pCardData->pfnCspAlloc(sz);
-			if (!oh)
-				return SCARD_E_NO_MEMORY;
+	if(!pCardData)
+		return SCARD_E_INVALID_PARAMETER;
+	if (!pContainerInfo)
+		return SCARD_E_INVALID_PARAMETER;
 
-			CryptDecodeObject(X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, RSA_CSP_PUBLICKEYBLOB,
-					pubkey_der.value, pubkey_der.len, 0, oh, &sz);
+	logprintf(pCardData, 1, "\nP:%d T:%d pCardData:%p ",GetCurrentProcessId(), GetCurrentThreadId(), pCardData);
+	logprintf(pCardData, 1, "CardGetContainerInfo bContainerIndex=%u, dwFlags=0x%08X, " \
+		"dwVersion=%u, cbSigPublicKey=%u, cbKeyExPublicKey=%u\n", \
+		bContainerIndex, dwFlags, pContainerInfo->dwVersion, \
+		pContainerInfo->cbSigPublicKey, pContainerInfo->cbKeyExPublicKey);
 
-			oh->publickeystruc.aiKeyAlg = CALG_RSA_KEYX;
-			pContainerInfo->cbKeyExPublicKey = sz;
-			pContainerInfo->pbKeyExPublicKey = (PBYTE)oh;
+	if (dwFlags)
+		return SCARD_E_INVALID_PARAMETER;
+	if (bContainerIndex >= MD_MAX_KEY_CONTAINERS)
+		return SCARD_E_NO_KEY_CONTAINER;
+	if (pContainerInfo->dwVersion < 0 || pContainerInfo->dwVersion >  CONTAINER_INFO_CURRENT_VERSION)
+		return ERROR_REVISION_MISMATCH;
 
-			logprintf(pCardData, 3, "return info on KEYX_CONTAINER_INDEX %i\n", bContainerIndex);
-		}
+	pContainerInfo->dwVersion = CONTAINER_INFO_CURRENT_VERSION;
+
+	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+	ret = md_fs_load_cmapfile(pCardData);
+	if (ret != SCARD_S_SUCCESS)
+		return ret;
+	cont = &vs->p15_containers[bContainerIndex];
+
+	if (!cont->prkey_obj)   {
+		logprintf(pCardData, 7, "Container %i is empty\n", bContainerIndex);
+		return SCARD_E_NO_KEY_CONTAINER;
+	}
+
+	check_reader_status(pCardData);
+
+	if (cont->prkey_obj->type == SC_PKCS15_TYPE_PRKEY_EC)   {
+		ret = md_ec_container_info(pCardData, cont, pContainerInfo);
+		if (ret != SCARD_S_SUCCESS)
+			logprintf(pCardData, 7, "GetContainerInfo(idx:%i) failed; error %X", bContainerIndex, ret);
+		return ret;
+	}
+
+	ret = md_rsa_read_blob(pCardData, cont);
+	if (ret != SCARD_S_SUCCESS)   {
+		logprintf(pCardData, 7, "GetContainerInfo(idx:%i) failed; error %X", bContainerIndex, ret);
+		return ret;
+	}
+
+	if (cont->size_sign)   {
+		PUBKEYSTRUCT_BASE *oh = (PUBKEYSTRUCT_BASE *)pCardData->pfnCspAlloc(cont->rsa_blob_len);
+		if (!oh)
+			return SCARD_E_NO_MEMORY;
+
+		memcpy(oh, cont->rsa_blob, cont->rsa_blob_len);
+		oh->publickeystruc.aiKeyAlg = CALG_RSA_SIGN;
+		pContainerInfo->cbSigPublicKey = cont->rsa_blob_len;
+		pContainerInfo->pbSigPublicKey = (PBYTE)oh;
+
+		logprintf(pCardData, 3, "return info on SIGN_CONTAINER_INDEX %i\n", bContainerIndex);
+	}
+
+	if (cont->size_key_exchange)   {
+		PUBKEYSTRUCT_BASE *oh = (PUBKEYSTRUCT_BASE *)pCardData->pfnCspAlloc(cont->rsa_blob_len);
+		if (!oh)
+			return SCARD_E_NO_MEMORY;
+
+		memcpy(oh, cont->rsa_blob, cont->rsa_blob_len);
+		oh->publickeystruc.aiKeyAlg = CALG_RSA_KEYX;
+		pContainerInfo->cbKeyExPublicKey = cont->rsa_blob_len;
+		pContainerInfo->pbKeyExPublicKey = (PBYTE)oh;
+
+		logprintf(pCardData, 3, "return info on KEYX_CONTAINER_INDEX %i\n", bContainerIndex);
 	}
 
 	logprintf(pCardData, 7, "returns container(idx:%i) info", bContainerIndex);
@@ -2235,8 +3232,12 @@ DWORD WINAPI CardAuthenticatePin(__in PCARD_DATA pCardData,
 		return r;
 	}
 
-	r = sc_pkcs15_verify_pin(vs->p15card, pin_obj, (const u8 *) pbPin, cbPin);
+	if (md_pin_still_verified(pCardData, ROLE_USER, pin_obj, pbPin, cbPin))
+		r = SC_SUCCESS;
+	else
+		r = sc_pkcs15_verify_pin(vs->p15card, pin_obj, (const u8 *) pbPin, cbPin);
 	if (r)   {
+		CLEAR_PIN(vs->pins_verified, ROLE_USER);
 		logprintf(pCardData, 1, "PIN code verification failed: %s\n", sc_strerror(r));
 		tries_left = ((struct sc_pkcs15_auth_info *)pin_obj->data)->tries_left;
 		if (r == SC_ERROR_AUTH_METHOD_BLOCKED)
@@ -2249,6 +3250,7 @@ DWORD WINAPI CardAuthenticatePin(__in PCARD_DATA pCardData,
 
 	logprintf(pCardData, 3, "Pin code correct.\n");
 
+	SET_PIN(vs->pins_verified, ROLE_USER);
 	SET_PIN(cardcf->bPinsFreshness, ROLE_USER);
 	logprintf(pCardData, 3, "PinsFreshness = %d\n", cardcf->bPinsFreshness);
 	return SCARD_S_SUCCESS;
@@ -2327,12 +3329,17 @@ DWORD WINAPI CardDeauthenticate(__in PCARD_DATA pCardData,
 		return dwret;
 	logprintf(pCardData, 1, "CardDeauthenticate bPinsFreshness:%d\n", cardcf->bPinsFreshness);
 
-	if (!wcscmp(pwszUserId, wszCARD_USER_USER))
+	if (!wcscmp(pwszUserId, wszCARD_USER_USER))   {
 		CLEAR_PIN(cardcf->bPinsFreshness, ROLE_USER);
-	else if (!wcscmp(pwszUserId, wszCARD_USER_ADMIN))
+		CLEAR_PIN(vs->pins_verified, ROLE_USER);
+	}
+	else if (!wcscmp(pwszUserId, wszCARD_USER_ADMIN))   {
 		CLEAR_PIN(cardcf->bPinsFreshness, ROLE_ADMIN);
-	else
+		CLEAR_PIN(vs->pins_verified, ROLE_ADMIN);
+	}
+	else   {
 		return SCARD_E_INVALID_PARAMETER;
+	}
 	logprintf(pCardData, 5, "PinsFreshness = %d\n",  cardcf->bPinsFreshness);
 
 	/* TODO Reset PKCS#15 PIN object 'validated' flag */
@@ -2466,6 +3473,7 @@ DWORD WINAPI CardWriteFile(__in PCARD_DATA pCardData,
 
 	logprintf(pCardData, 7, "set content of '%s' to:\n",  NULLSTR(pszFileName));
 	loghex(pCardData, 7, pbData, cbData);
+	md_cache_remove(pCardData);
 
 	dwret = md_fs_set_content(pCardData, file, pbData, cbData);
 	if (dwret != SCARD_S_SUCCESS)   {
@@ -2503,6 +3511,7 @@ DWORD WINAPI CardDeleteFile(__in PCARD_DATA pCardData,
 		return SCARD_E_INVALID_PARAMETER;
 
 	check_reader_status(pCardData);
+	md_cache_remove(pCardData);
 
 	dwret = md_fs_delete_file(pCardData, pszDirectoryName, pszFileName);
 	if (dwret != SCARD_S_SUCCESS)   {
@@ -2550,6 +3559,11 @@ DWORD WINAPI CardEnumFiles(__in PCARD_DATA pCardData,
 		logprintf(pCardData, 2, "enum files() failed: directory '%s' not found\n", NULLSTR(pszDirectoryName));
 		return SCARD_E_FILE_NOT_FOUND;
 	}
+	if (!strcmp(dir->name, "mscp"))   {
+		DWORD dwret = md_fs_load_cmapfile(pCardData);
+		if (dwret != SCARD_S_SUCCESS)
+			return dwret;
+	}
 
 	file = dir->files;
 	for (offs = 0; file != NULL && offs < sizeof(mstr) - 10;)   {
@@ -2590,6 +3604,10 @@ DWORD WINAPI CardGetFileInfo(__in PCARD_DATA pCardData,
 		return SCARD_E_FILE_NOT_FOUND;
 	}
 
+	/* the size of a certificate is only known once it is read */
+	if (!file->blob)
+		md_fs_read_content(pCardData, pszDirectoryName, file);
+
 	pCardFileInfo->dwVersion = CARD_FILE_INFO_CURRENT_VERSION;
 	pCardFileInfo->cbFileSize = file->size;
 	pCardFileInfo->AccessCondition = file->acl;
@@ -2640,7 +3658,7 @@ DWORD WINAPI CardQueryKeySizes(__in PCARD_DATA pCardData,
 	if (!pCardData)
 		return SCARD_E_INVALID_PARAMETER;
 
-	dwret = md_query_key_sizes(pKeySizes);
+	dwret = md_query_key_sizes(dwKeySpec, pKeySizes);
 	if (dwret != SCARD_S_SUCCESS)
 		return dwret;
 
@@ -2659,7 +3677,7 @@ DWORD WINAPI CardRSADecrypt(__in PCARD_DATA pCardData,
 	VENDOR_SPECIFIC *vs;
 	struct sc_pkcs15_prkey_info *prkey_info;
 	BYTE *pbuf = NULL, *pbuf2 = NULL;
-	DWORD lg= 0, lg2 = 0;
+	DWORD lg= 0, lg2 = 0, dwret;
 	struct sc_pkcs15_object *pkey = NULL;
 	struct sc_algorithm_info *alg_info = NULL;
 
@@ -2680,6 +3698,10 @@ DWORD WINAPI CardRSADecrypt(__in PCARD_DATA pCardData,
 	if (pInfo->dwVersion >= CARD_RSA_KEY_DECRYPT_INFO_VERSION_TWO)
 		logprintf(pCardData, 2, "  pPaddingInfo=%p dwPaddingType=0x%08X\n", pInfo->pPaddingInfo, pInfo->dwPaddingType);
 
+	dwret = md_fs_load_cmapfile(pCardData);
+	if (dwret != SCARD_S_SUCCESS)
+		return dwret;
+
 	pkey = vs->p15_containers[pInfo->bContainerIndex].prkey_obj;
 	if (!pkey)   {
 		logprintf(pCardData, 2, "CardRSADecrypt prkey not found\n");
@@ -2814,6 +3836,8 @@ DWORD WINAPI CardSignData(__in PCARD_DATA pCardData, __in PCARD_SIGNING_INFO pIn
 	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
 	if (pInfo->bContainerIndex >= MD_MAX_KEY_CONTAINERS)
 		return SCARD_E_NO_KEY_CONTAINER;
+	if (md_fs_load_cmapfile(pCardData) != SCARD_S_SUCCESS)
+		return SCARD_E_NO_KEY_CONTAINER;
 
 	pkey = vs->p15_containers[pInfo->bContainerIndex].prkey_obj;
 	if (!pkey)
@@ -2829,7 +3853,10 @@ DWORD WINAPI CardSignData(__in PCARD_DATA pCardData, __in PCARD_SIGNING_INFO pIn
 	memcpy(dataToSign, pInfo->pbData, pInfo->cbData);
 	dataToSignLen = pInfo->cbData;
 
-	if (CARD_PADDING_INFO_PRESENT & pInfo->dwSigningFlags)   {
+	if (pkey->type == SC_PKCS15_TYPE_PRKEY_EC)   {
+		logprintf(pCardData, 3, "ECDSA signature of the hash\n");
+	}
+	else if (CARD_PADDING_INFO_PRESENT & pInfo->dwSigningFlags)   {
 		BCRYPT_PKCS1_PADDING_INFO *pinf = (BCRYPT_PKCS1_PADDING_INFO *)pInfo->pPaddingInfo;
 		if (CARD_PADDING_PKCS1 != pInfo->dwPaddingType)   {
 			logprintf(pCardData, 0, "unsupported paddingtype\n");
@@ -2896,9 +3923,14 @@ DWORD WINAPI CardSignData(__in PCARD_DATA pCardData, __in PCARD_SIGNING_INFO pIn
 			return SCARD_E_INVALID_VALUE;
 		}
 	}
-	opt_crypt_flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE;
-
-	pInfo->cbSignedData = prkey_info->modulus_length / 8;
+	if (pkey->type == SC_PKCS15_TYPE_PRKEY_EC)   {
+		opt_crypt_flags = SC_ALGORITHM_ECDSA_RAW | SC_ALGORITHM_ECDSA_HASH_NONE;
+		pInfo->cbSignedData = 2 * ((prkey_info->field_length + 7) / 8);
+	}
+	else   {
+		opt_crypt_flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE;
+		pInfo->cbSignedData = prkey_info->modulus_length / 8;
+	}
 	logprintf(pCardData, 3, "pInfo->cbSignedData = %d\n", pInfo->cbSignedData);
 
 	if(!(pInfo->dwSigningFlags&CARD_BUFFER_SIZE_ONLY))   {
@@ -2930,9 +3962,12 @@ DWORD WINAPI CardSignData(__in PCARD_DATA pCardData, __in PCARD_SIGNING_INFO pIn
 
 		pInfo->cbSignedData = r;
 
-		/*inversion donnees*/
-		for(i = 0; i < r; i++)
-			pInfo->pbSignedData[i] = pbuf[r-i-1];
+		/* inversion donnees, only for RSA: the ECDSA signature is r || s, big endian */
+		if (pkey->type == SC_PKCS15_TYPE_PRKEY_EC)
+			memcpy(pInfo->pbSignedData, pbuf, r);
+		else
+			for(i = 0; i < r; i++)
+				pInfo->pbSignedData[i] = pbuf[r-i-1];
 		pCardData->pfnCspFree(pbuf);
 
 		logprintf(pCardData, 7, "Signature (inverted): ");
@@ -2948,17 +3983,218 @@ DWORD WINAPI CardSignData(__in PCARD_DATA pCardData, __in PCARD_SIGNING_INFO pIn
 DWORD WINAPI CardConstructDHAgreement(__in PCARD_DATA pCardData,
 	__in PCARD_DH_AGREEMENT_INFO pAgreementInfo)
 {
+	VENDOR_SPECIFIC *vs;
+	struct md_pkcs15_container *cont;
+	struct sc_pkcs15_prkey_info *prkey_info;
+	struct md_dh_agreement *agreement = NULL;
+	BCRYPT_ECCKEY_BLOB *peer;
+	u8 point[1 + 2 * MD_EC_FIELD_BYTES_MAX];
+	unsigned long len;
+	DWORD dwret;
+	int ii, rv;
+
 	logprintf(pCardData, 1, "\nP:%d T:%d pCardData:%p ",GetCurrentProcessId(), GetCurrentThreadId(), pCardData);
-	logprintf(pCardData, 1, "CardConstructDHAgreement - unsupported\n");
-	return SCARD_E_UNSUPPORTED_FEATURE;
+	logprintf(pCardData, 1, "CardConstructDHAgreement\n");
+
+	if (!pCardData || !pAgreementInfo)
+		return SCARD_E_INVALID_PARAMETER;
+	if (pAgreementInfo->dwVersion > CARD_DH_AGREEMENT_INFO_VERSION)
+		return ERROR_REVISION_MISMATCH;
+	if (pAgreementInfo->bContainerIndex >= MD_MAX_KEY_CONTAINERS)
+		return SCARD_E_NO_KEY_CONTAINER;
+
+	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+
+	check_reader_status(pCardData);
+
+	dwret = md_fs_load_cmapfile(pCardData);
+	if (dwret != SCARD_S_SUCCESS)
+		return dwret;
+
+	cont = &vs->p15_containers[pAgreementInfo->bContainerIndex];
+	if (!cont->prkey_obj)
+		return SCARD_E_NO_KEY_CONTAINER;
+	if (cont->prkey_obj->type != SC_PKCS15_TYPE_PRKEY_EC || !cont->size_key_exchange)   {
+		logprintf(pCardData, 1, "container %i has no ECDH key\n", pAgreementInfo->bContainerIndex);
+		return SCARD_E_UNSUPPORTED_FEATURE;
+	}
+	prkey_info = (struct sc_pkcs15_prkey_info *)cont->prkey_obj->data;
+
+	/* the public key of the peer is a BCRYPT_ECCKEY_BLOB,
+	 * the card wants an uncompressed point */
+	peer = (BCRYPT_ECCKEY_BLOB *)pAgreementInfo->pbPublicKey;
+	if (!peer || pAgreementInfo->dwPublicKey < sizeof(*peer)
+			|| peer->cbKey != (prkey_info->field_length + 7) / 8
+			|| pAgreementInfo->dwPublicKey != sizeof(*peer) + 2 * peer->cbKey)
+		return SCARD_E_INVALID_PARAMETER;
+	point[0] = 0x04;
+	memcpy(point + 1, peer + 1, 2 * peer->cbKey);
+
+	for (ii = 0; ii < MD_MAX_DH_AGREEMENTS; ii++)   {
+		if (!vs->dh_agreements[ii].pbAgreement)   {
+			agreement = &vs->dh_agreements[ii];
+			break;
+		}
+	}
+	if (!agreement)   {
+		logprintf(pCardData, 1, "no free secret agreement\n");
+		return SCARD_E_NO_MEMORY;
+	}
+
+	len = peer->cbKey;
+	agreement->pbAgreement = pCardData->pfnCspAlloc(len);
+	if (!agreement->pbAgreement)
+		return SCARD_E_NO_MEMORY;
+
+	rv = sc_pkcs15_derive(vs->p15card, cont->prkey_obj, SC_ALGORITHM_ECDH_CDH_RAW,
+			point, 1 + 2 * peer->cbKey, agreement->pbAgreement, &len);
+	if (rv < 0)   {
+		logprintf(pCardData, 2, "sc_pkcs15_derive error %s\n", sc_strerror(rv));
+		pCardData->pfnCspFree(agreement->pbAgreement);
+		agreement->pbAgreement = NULL;
+		return SCARD_F_INTERNAL_ERROR;
+	}
+
+	agreement->dwSize = len;
+	agreement->bContainerIndex = pAgreementInfo->bContainerIndex;
+	pAgreementInfo->bSecretAgreementIndex = (BYTE)ii;
+	logprintf(pCardData, 3, "secret agreement %i of %i bytes\n", ii, len);
+	return SCARD_S_SUCCESS;
+}
+
+/*
+ * The 'HASH' and 'HMAC' key derivation functions of CNG:
+ * hash(prepend || secret || append), with the optional HMAC key
+ */
+static DWORD
+md_dh_kdf(PCARD_DATA pCardData, struct md_dh_agreement *agreement, LPCWSTR hash_alg,
+		PBYTE hmac_key, DWORD hmac_key_len, PBYTE prepend, DWORD prepend_len,
+		PBYTE append, DWORD append_len, PCARD_DERIVE_KEY pDeriveKey)
+{
+	BCRYPT_ALG_HANDLE alg = NULL;
+	BCRYPT_HASH_HANDLE hash = NULL;
+	NTSTATUS status;
+	DWORD hash_len = 0, sz;
+	PBYTE out = NULL;
+
+	status = BCryptOpenAlgorithmProvider(&alg, hash_alg, NULL, hmac_key ? BCRYPT_ALG_HANDLE_HMAC_FLAG : 0);
+	if (BCRYPT_SUCCESS(status))
+		status = BCryptGetProperty(alg, BCRYPT_HASH_LENGTH, (PUCHAR)&hash_len, sizeof(hash_len), &sz, 0);
+	if (BCRYPT_SUCCESS(status))
+		status = BCryptCreateHash(alg, &hash, NULL, 0, hmac_key, hmac_key_len, 0);
+	if (BCRYPT_SUCCESS(status) && prepend_len)
+		status = BCryptHashData(hash, prepend, prepend_len, 0);
+	if (BCRYPT_SUCCESS(status))
+		status = BCryptHashData(hash, agreement->pbAgreement, agreement->dwSize, 0);
+	if (BCRYPT_SUCCESS(status) && append_len)
+		status = BCryptHashData(hash, append, append_len, 0);
+	if (BCRYPT_SUCCESS(status))   {
+		out = pCardData->pfnCspAlloc(hash_len);
+		if (out)
+			status = BCryptFinishHash(hash, out, hash_len, 0);
+	}
+
+	if (hash)
+		BCryptDestroyHash(hash);
+	if (alg)
+		BCryptCloseAlgorithmProvider(alg, 0);
+
+	if (!BCRYPT_SUCCESS(status))   {
+		logprintf(pCardData, 1, "key derivation with '%S' failed: 0x%08X\n", NULLWSTR(hash_alg), status);
+		if (out)
+			pCardData->pfnCspFree(out);
+		return SCARD_E_INVALID_PARAMETER;
+	}
+	if (!out)
+		return SCARD_E_NO_MEMORY;
+
+	pDeriveKey->pbDerivedKey = out;
+	pDeriveKey->cbDerivedKey = hash_len;
+	return SCARD_S_SUCCESS;
 }
 
 DWORD WINAPI CardDeriveKey(__in PCARD_DATA pCardData,
 	__in PCARD_DERIVE_KEY pAgreementInfo)
 {
+	VENDOR_SPECIFIC *vs;
+	struct md_dh_agreement *agreement;
+	BCryptBufferDesc *params;
+	LPCWSTR hash_alg = BCRYPT_SHA1_ALGORITHM;
+	PBYTE hmac_key = NULL, prepend = NULL, append = NULL;
+	DWORD hmac_key_len = 0, prepend_len = 0, append_len = 0;
+	ULONG ii;
+	int hmac;
+
 	logprintf(pCardData, 1, "\nP:%d T:%d pCardData:%p ",GetCurrentProcessId(), GetCurrentThreadId(), pCardData);
-	logprintf(pCardData, 1, "CardDeriveKey - unsupported\n");
-	return SCARD_E_UNSUPPORTED_FEATURE;
+	logprintf(pCardData, 1, "CardDeriveKey\n");
+
+	if (!pCardData || !pAgreementInfo)
+		return SCARD_E_INVALID_PARAMETER;
+	if (pAgreementInfo->dwVersion > CARD_DERIVE_KEY_CURRENT_VERSION)
+		return ERROR_REVISION_MISMATCH;
+	if (pAgreementInfo->dwFlags & CARD_RETURN_KEY_HANDLE)   {
+		logprintf(pCardData, 1, "CardDeriveKey: key handles are not supported\n");
+		return SCARD_E_UNSUPPORTED_FEATURE;
+	}
+
+	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+	if (pAgreementInfo->bSecretAgreementIndex >= MD_MAX_DH_AGREEMENTS)
+		return SCARD_E_INVALID_PARAMETER;
+	agreement = &vs->dh_agreements[pAgreementInfo->bSecretAgreementIndex];
+	if (!agreement->pbAgreement)
+		return SCARD_E_INVALID_PARAMETER;
+
+	if (!pAgreementInfo->pwszKDF)
+		return SCARD_E_INVALID_PARAMETER;
+	logprintf(pCardData, 2, "CardDeriveKey KDF '%S' of agreement %i\n",
+			pAgreementInfo->pwszKDF, pAgreementInfo->bSecretAgreementIndex);
+	if (wcscmp(pAgreementInfo->pwszKDF, BCRYPT_KDF_HASH) == 0)
+		hmac = 0;
+	else if (wcscmp(pAgreementInfo->pwszKDF, BCRYPT_KDF_HMAC) == 0)
+		hmac = 1;
+	else
+		return SCARD_E_UNSUPPORTED_FEATURE;
+
+	params = (BCryptBufferDesc *)pAgreementInfo->pParameterList;
+	for (ii = 0; params && ii < params->cBuffers; ii++)   {
+		BCryptBuffer *buf = &params->pBuffers[ii];
+
+		switch (buf->BufferType)   {
+		case KDF_HASH_ALGORITHM:
+			hash_alg = (LPCWSTR)buf->pvBuffer;
+			break;
+		case KDF_SECRET_PREPEND:
+			prepend = (PBYTE)buf->pvBuffer;
+			prepend_len = buf->cbBuffer;
+			break;
+		case KDF_SECRET_APPEND:
+			append = (PBYTE)buf->pvBuffer;
+			append_len = buf->cbBuffer;
+			break;
+		case KDF_HMAC_KEY:
+			hmac_key = (PBYTE)buf->pvBuffer;
+			hmac_key_len = buf->cbBuffer;
+			break;
+		default:
+			logprintf(pCardData, 1, "KDF parameter %i is not supported\n", buf->BufferType);
+			return SCARD_E_UNSUPPORTED_FEATURE;
+		}
+	}
+	if (hmac && !hmac_key)
+		return SCARD_E_INVALID_PARAMETER;
+
+	return md_dh_kdf(pCardData, agreement, hash_alg, hmac ? hmac_key : NULL, hmac_key_len,
+			prepend, prepend_len, append, append_len, pAgreementInfo);
+}
+
+static void
+md_dh_agreement_free(PCARD_DATA pCardData, struct md_dh_agreement *agreement)
+{
+	if (agreement->pbAgreement)   {
+		SecureZeroMemory(agreement->pbAgreement, agreement->dwSize);
+		pCardData->pfnCspFree(agreement->pbAgreement);
+	}
+	memset(agreement, 0, sizeof(*agreement));
 }
 
 DWORD WINAPI CardDestroyDHAgreement(
@@ -2966,8 +4202,20 @@ DWORD WINAPI CardDestroyDHAgreement(
 	__in BYTE bSecretAgreementIndex,
 	__in DWORD dwFlags)
 {
-	logprintf(pCardData, 1, "CardDestroyDHAgreement - unsupported\n");
-	return SCARD_E_UNSUPPORTED_FEATURE;
+	VENDOR_SPECIFIC *vs;
+
+	logprintf(pCardData, 1, "\nP:%d T:%d pCardData:%p ",GetCurrentProcessId(), GetCurrentThreadId(), pCardData);
+	logprintf(pCardData, 1, "CardDestroyDHAgreement %i\n", bSecretAgreementIndex);
+
+	if (!pCardData || dwFlags)
+		return SCARD_E_INVALID_PARAMETER;
+
+	vs = (VENDOR_SPECIFIC*)(pCardData->pvVendorSpecific);
+	if (bSecretAgreementIndex >= MD_MAX_DH_AGREEMENTS || !vs->dh_agreements[bSecretAgreementIndex].pbAgreement)
+		return SCARD_E_INVALID_PARAMETER;
+
+	md_dh_agreement_free(pCardData, &vs->dh_agreements[bSecretAgreementIndex]);
+	return SCARD_S_SUCCESS;
 }
 
 DWORD WINAPI CspGetDHAgreement(__in  PCARD_DATA pCardData,
@@ -3059,8 +4307,13 @@ DWORD WINAPI CardAuthenticateEx(__in PCARD_DATA pCardData,
 		}
 }
 
-	r = sc_pkcs15_verify_pin(vs->p15card, pin_obj, (const u8 *) pbPinData, cbPinData);
+	/* a PIN pad or a session PIN has no code to compare */
+	if (dwFlags == 0 && pbPinData && md_pin_still_verified(pCardData, PinId, pin_obj, pbPinData, cbPinData))
+		r = SC_SUCCESS;
+	else
+		r = sc_pkcs15_verify_pin(vs->p15card, pin_obj, (const u8 *) pbPinData, cbPinData);
 	if (r)   {
+		CLEAR_PIN(vs->pins_verified, PinId);
 		logprintf(pCardData, 2, "PIN code verification failed: %s\n", sc_strerror(r));
 		tries_left = ((struct sc_pkcs15_auth_info *)pin_obj->data)->tries_left;
 		logprintf(pCardData, 7, "PIN retries left: %i\n", tries_left);
@@ -3077,6 +4330,7 @@ DWORD WINAPI CardAuthenticateEx(__in PCARD_DATA pCardData,
 	if (dwret != SCARD_S_SUCCESS)
 		return dwret;
 
+	SET_PIN(vs->pins_verified, PinId);
 	SET_PIN(cardcf->bPinsFreshness, PinId);
 	logprintf(pCardData, 7, "PinsFreshness = %d\n", cardcf->bPinsFreshness);
 	return SCARD_S_SUCCESS;
@@ -3122,6 +4376,8 @@ DWORD WINAPI CardDeauthenticateEx(__in PCARD_DATA pCardData,
 
 	CLEAR_PIN(cardcf->bPinsFreshness, PinId);
 	logprintf(pCardData, 1, "CardDeauthenticateEx bPinsFreshness:%d\n", cardcf->bPinsFreshness);
+	/* 'PinId' is a set of PINs: verify them all again */
+	vs->pins_verified = 0;
 
 	/* TODO Reset PKCS#15 PIN object 'validated' flag */
 	return SCARD_S_SUCCESS;
@@ -3241,7 +4497,7 @@ DWORD WINAPI CardGetProperty(__in PCARD_DATA pCardData,
 		if (cbData < sizeof(*pKeySizes))
 			return ERROR_INSUFFICIENT_BUFFER;
 
-		dwret = md_query_key_sizes(pKeySizes);
+		dwret = md_query_key_sizes(dwFlags, pKeySizes);
 		if (dwret != SCARD_S_SUCCESS)
 			return dwret;
 	}
@@ -3597,6 +4853,9 @@ static int associate_card(PCARD_DATA pCardData)
 
 		r = sc_pkcs15_bind(vs->card, aid, &(vs->p15card));
 		logprintf(pCardData, 2, "PKCS#15 initialization result: %d, %s\n", r, sc_strerror(r));
+
+		if (sc_card_ctl(vs->card, SC_CARDCTL_GET_SERIALNR, &vs->serialnr) != SC_SUCCESS)
+			memset(&vs->serialnr, 0, sizeof(vs->serialnr));
 	}
 
 	if(vs->card == NULL || vs->p15card == NULL)   {
@@ -3621,6 +4880,7 @@ static int associate_card(PCARD_DATA pCardData)
 static int disassociate_card(PCARD_DATA pCardData)
 {
 	VENDOR_SPECIFIC *vs;
+	int ii;
 
 	logprintf(pCardData, 1, "disassociate_card\n");
 	if (!pCardData)
@@ -3630,6 +4890,11 @@ static int disassociate_card(PCARD_DATA pCardData)
 
 	vs->obj_user_pin = NULL;
 	vs->obj_sopin = NULL;
+	vs->pins_verified = 0;
+
+	for (ii = 0; ii < MD_MAX_DH_AGREEMENTS; ii++)
+		md_dh_agreement_free(pCardData, &vs->dh_agreements[ii]);
+	md_shared_cache_close(pCardData);
 
 	if(vs->p15card)   {
 		logprintf(pCardData, 6, "sc_pkcs15_unbind\n");
@@ -24,8 +24,15 @@
 
 #include "libopensc/cardctl.h"
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "sc-pkcs11.h"
 #ifdef USE_PKCS15_INIT
@@ -59,6 +66,12 @@ struct pkcs15_fw_data {
 	unsigned int			locked;
 	unsigned char user_puk[64];
 	unsigned int user_puk_len;
+	/* random_pool_size bytes from the card, used from the end */
+	unsigned char *			random_pool;
+	size_t				random_avail;
+#if !defined(_WIN32)
+	pid_t				random_pid;
+#endif
 };
 
 struct pkcs15_any_object {
@@ -113,6 +126,8 @@ struct pkcs15_data_object {
 
 	struct sc_pkcs15_data_info *info;
 	struct sc_pkcs15_data *value;
+	/* value of a private object, kept for one C_GetAttributeValue() */
+	struct sc_pkcs15_data *prefetched;
 };
 #define data_flags		base.base.flags
 #define data_p15obj		base.p15_object
@@ -123,6 +138,15 @@ struct pkcs15_skey_object {
 
 	struct sc_pkcs15_skey_info *info;
 	struct sc_pkcs15_skey *valueXXXX;
+	int on_card;	/* not a session key */
+};
+
+/* A session key of C_DeriveKey() with the PKCS#15 object and info it
+ * reads from in the same allocation, see pkcs15_create_secret_key() */
+struct pkcs15_session_skey {
+	struct pkcs15_skey_object	skey;
+	struct sc_pkcs15_object		p15_object;
+	struct sc_pkcs15_skey_info	info;
 };
 
 #define skey_flags	base.base.flags
@@ -162,6 +186,7 @@ static CK_RV	get_ec_pubkey_point(struct sc_pkcs15_pubkey *, CK_ATTRIBUTE_PTR);
 static CK_RV	get_ec_pubkey_params(struct sc_pkcs15_pubkey *, CK_ATTRIBUTE_PTR);
 static int	lock_card(struct pkcs15_fw_data *);
 static int	unlock_card(struct pkcs15_fw_data *);
+static int	_pkcs15_create_typed_objects(struct pkcs15_fw_data *);
 static int	reselect_app_df(sc_pkcs15_card_t *p15card);
 
 #ifdef USE_PKCS15_INIT
@@ -209,6 +234,24 @@ get_fw_data(struct sc_pkcs11_card *p11card, struct sc_app_info *app_info, int *o
 	return out;
 }
 
+/* Lets a signature waiting for the card in between the chunks of a long read */
+static int
+pkcs15_read_yield(struct sc_pkcs15_card *p15card, void *arg)
+{
+	return sc_pkcs11_yield_slot_lock((struct sc_pkcs11_card_lock *) arg);
+}
+
+
+static void
+pkcs15_set_read_yield(struct sc_pkcs11_card *p11card, struct sc_pkcs15_card *p15card)
+{
+	if (p11card->lock == NULL || p15card == NULL)
+		return;
+	p15card->read_yield = pkcs15_read_yield;
+	p15card->read_yield_arg = p11card->lock;
+}
+
+
 /* PKCS#15 Framework */
 static CK_RV
 pkcs15_bind(struct sc_pkcs11_card *p11card, struct sc_app_info *app_info)
@@ -234,6 +277,7 @@ pkcs15_bind(struct sc_pkcs11_card *p11card, struct sc_app_info *app_info)
 		sc_log(context, "sc_pkcs15_bind failed: %d", rc);
 		return sc_to_cryptoki_error(rc, NULL);
 	}
+	pkcs15_set_read_yield(p11card, fw_data->p15_card);
 
 	ck_rv = register_mechanisms(p11card);
 	if (ck_rv != CKR_OK) {
@@ -241,14 +285,53 @@ pkcs15_bind(struct sc_pkcs11_card *p11card, struct sc_app_info *app_info)
 		return ck_rv;
 	}
 
+	/* Add PKCS#15 objects of the known types to the framework data: the
+	 * bind runs with only the lock of the slots held, the tokens are
+	 * created with the global lock */
+	rc = _pkcs15_create_typed_objects(fw_data);
+	if (rc < 0)
+		return sc_to_cryptoki_error(rc, NULL);
+	sc_log(context, "Found %d FW objects objects", fw_data->num_objects);
+
 	return CKR_OK;
 }
 
 
+static int
+pkcs15_free_fw_data(struct pkcs15_fw_data *fw_data)
+{
+	unsigned int i;
+	int rv = SC_SUCCESS;
+
+	for (i = 0; i < fw_data->num_objects; i++) {
+		struct pkcs15_any_object *obj = fw_data->objects[i];
+
+		/* use object specific release method if existing */
+		if (obj->base.ops && obj->base.ops->release)
+			obj->base.ops->release(obj);
+		else
+			__pkcs15_release_object(obj);
+	}
+
+	unlock_card(fw_data);
+
+	if (fw_data->p15_card)
+		rv = sc_pkcs15_unbind(fw_data->p15_card);
+	fw_data->p15_card = NULL;
+
+	if (fw_data->random_pool) {
+		sc_mem_clear(fw_data->random_pool, sc_pkcs11_conf.random_pool_size);
+		free(fw_data->random_pool);
+	}
+	free(fw_data);
+	return rv;
+}
+
+
 static CK_RV
 pkcs15_unbind(struct sc_pkcs11_card *p11card)
 {
-	unsigned int i, idx;
+	unsigned int idx;
 	int rv = SC_SUCCESS;
 
 	for (idx=0; idx<SC_PKCS11_FRAMEWORK_DATA_MAX_NUM; idx++)   {
@@ -256,23 +339,7 @@ pkcs15_unbind(struct sc_pkcs11_card *p11card)
 
 		if (!fw_data)
 			break;
-		for (i = 0; i < fw_data->num_objects; i++) {
-			struct pkcs15_any_object *obj = fw_data->objects[i];
-
-			/* use object specific release method if existing */
-			if (obj->base.ops && obj->base.ops->release)
-				obj->base.ops->release(obj);
-			else
-				__pkcs15_release_object(obj);
-		}
-
-		unlock_card(fw_data);
-
-		if (fw_data->p15_card)
-			rv = sc_pkcs15_unbind(fw_data->p15_card);
-		fw_data->p15_card = NULL;
-
-		free(fw_data);
+		rv = pkcs15_free_fw_data(fw_data);
 		p11card->fws_data[idx] = NULL;
 	}
 
@@ -383,6 +450,10 @@ __pkcs15_release_object(struct pkcs15_any_object *obj)
 	if (--(obj->refcount) != 0)
 		return obj->refcount;
 
+	sc_pkcs11_free_attribute_cache(&obj->base);
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_free_verify_key(&obj->base);
+#endif
 	sc_mem_clear(obj, obj->size);
 	free(obj);
 
@@ -422,13 +493,26 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_slot_id(slotID, &slot);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_GetTokenInfo(%lx)", slotID);
 
+	if (slot->bind_pending && slot->token_info_cached) {
+		/* defer_card_connect: the card is connected by the calls using
+		 * it, until then there is no label nor serial number */
+		memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
+		sc_pkcs11_unlock();
+		goto out;
+	}
+
 	rv = slot_get_token(slotID, &slot);
+	if (rv == CKR_CRYPTOKI_NOT_INITIALIZED)
+		/* finalized meanwhile, the locks are gone */
+		return rv;
+	/* The PIN info is asked from the card with only the slot locked */
+	sc_pkcs11_unlock();
 	if (rv != CKR_OK)
 		goto out;
 
@@ -468,7 +552,7 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	}
 	memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -500,27 +584,17 @@ public_key_created(struct pkcs15_fw_data *fw_data, const struct sc_pkcs15_id *id
 }
 
 
+/* Takes over the certificate and the public key parsed from it, if any */
 static int
-__pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_object *cert,
+__pkcs15_add_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_object *cert,
+		struct sc_pkcs15_cert *p15_cert, struct sc_pkcs15_pubkey *p15_pubkey,
 		struct pkcs15_any_object **cert_object)
 {
-	struct sc_pkcs15_cert_info *p15_info = NULL;
-	struct sc_pkcs15_cert *p15_cert = NULL;
+	struct sc_pkcs15_cert_info *p15_info = (struct sc_pkcs15_cert_info *) cert->data;
 	struct pkcs15_cert_object *object = NULL;
 	struct pkcs15_pubkey_object *obj2 = NULL;
 	int rv;
 
-	p15_info = (struct sc_pkcs15_cert_info *) cert->data;
-
-	if (cert->flags & SC_PKCS15_CO_FLAG_PRIVATE)  {	/* is the cert private? */
-		p15_cert = NULL;			/* will read cert when needed */
-	}
-	else    {
-		rv = sc_pkcs15_read_certificate(fw_data->p15_card, p15_info, &p15_cert);
-		if (rv < 0)
-			return rv;
-	}
-
 	/* Certificate object */
 	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &object,
 			cert, &pkcs15_cert_ops, sizeof(struct pkcs15_cert_object));
@@ -540,8 +614,13 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 
 	if (p15_cert) {
 		 /* make a copy of public key from the cert */
-		if (!obj2->pub_data)
+		if (!obj2->pub_data && p15_pubkey) {
+			obj2->pub_data = p15_pubkey;
+			p15_pubkey = NULL;
+		}
+		else if (!obj2->pub_data)
 			rv = sc_pkcs15_pubkey_from_cert(context, &p15_cert->data, &obj2->pub_data);
+		sc_pkcs15_free_pubkey(p15_pubkey);
 		if (rv < 0)
 			return rv;
 	}
@@ -556,6 +635,28 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 }
 
 
+static int
+__pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_object *cert,
+		struct pkcs15_any_object **cert_object)
+{
+	struct sc_pkcs15_cert_info *p15_info = (struct sc_pkcs15_cert_info *) cert->data;
+	struct sc_pkcs15_cert *p15_cert = NULL;
+	int rv;
+
+	if ((cert->flags & SC_PKCS15_CO_FLAG_PRIVATE)	/* is the cert private? */
+			|| sc_pkcs11_conf.lazy_object_loading)  {
+		p15_cert = NULL;			/* will read cert when needed */
+	}
+	else    {
+		rv = sc_pkcs15_read_certificate_shared(fw_data->p15_card, p15_info, &p15_cert);
+		if (rv < 0)
+			return rv;
+	}
+
+	return __pkcs15_add_cert_object(fw_data, cert, p15_cert, NULL, cert_object);
+}
+
+
 static int
 __pkcs15_create_pubkey_object(struct pkcs15_fw_data *fw_data,
 	struct sc_pkcs15_object *pubkey, struct pkcs15_any_object **pubkey_object)
@@ -578,6 +679,9 @@ __pkcs15_create_pubkey_object(struct pkcs15_fw_data *fw_data,
 			p15_key = (struct sc_pkcs15_pubkey *) pubkey->emulated;
 			sc_log(context, "Using emulated pubkey %p", p15_key);
 		}
+		else if (sc_pkcs11_conf.lazy_object_loading) {
+			p15_key = NULL;				/* will read key when needed */
+		}
 		else {
 			rv = sc_pkcs15_read_pubkey(fw_data->p15_card, pubkey, &p15_key);
 			if (rv < 0)
@@ -651,8 +755,30 @@ __pkcs15_create_secret_key_object(struct pkcs15_fw_data *fw_data,
 
 	rv = __pkcs15_create_object(fw_data, (struct pkcs15_any_object **) &skey,
 			object, &pkcs15_skey_ops, sizeof(struct pkcs15_skey_object));
-	if (rv >= 0)
+	if (rv >= 0) {
 	    skey->info = (struct sc_pkcs15_skey_info *) object->data;
+	    /* session keys have the bare class as their type, PKCS#15 gives
+	     * the key type of a key of the card in the object type */
+	    skey->on_card = object->type != SC_PKCS15_TYPE_SKEY;
+	    switch (object->type) {
+	    case SC_PKCS15_TYPE_SKEY_DES:
+		skey->info->key_type = CKK_DES;
+		break;
+	    case SC_PKCS15_TYPE_SKEY_2DES:
+		skey->info->key_type = CKK_DES2;
+		break;
+	    case SC_PKCS15_TYPE_SKEY_3DES:
+		skey->info->key_type = CKK_DES3;
+		break;
+	    case SC_PKCS15_TYPE_SKEY_GENERIC:
+		if (skey->info->value_len == 128 || skey->info->value_len == 192
+				|| skey->info->value_len == 256)
+			skey->info->key_type = CKK_AES;
+		else
+			skey->info->key_type = CKK_GENERIC_SECRET;
+		break;
+	    }
+	}
 
 	if (skey_object != NULL)
 		*skey_object = (struct pkcs15_any_object *) skey;
@@ -666,16 +792,228 @@ pkcs15_create_pkcs11_objects(struct pkcs15_fw_data *fw_data, int p15_type, const
 		int (*create)(struct pkcs15_fw_data *, struct sc_pkcs15_object *,
 			struct pkcs15_any_object **any_object))
 {
-	struct sc_pkcs15_object *p15_object[MAX_OBJECTS];
-	int i, count, rv;
+	struct sc_pkcs15_search_key sk;
+	struct sc_pkcs15_object_iter it;
+	struct sc_pkcs15_object *p15_object;
+	int count = 0, rv;
+
+	memset(&sk, 0, sizeof(sk));
+	sk.type = p15_type;
+	rv = sc_pkcs15_iter_init(fw_data->p15_card, &it, &sk);
+	if (rv < 0)
+		return rv;
 
-	rv = count = sc_pkcs15_get_objects(fw_data->p15_card, p15_type, p15_object, MAX_OBJECTS);
-	if (rv >= 0)
-		sc_log(context, "Found %d %s%s", count, name, (count == 1)? "" : "s");
+	while ((p15_object = sc_pkcs15_iter_next(&it)) != NULL) {
+		count++;
+		if (rv >= 0)
+			rv = create(fw_data, p15_object, NULL);
+	}
+	sc_log(context, "Found %d %s%s", count, name, (count == 1)? "" : "s");
+
+	return count;
+}
+
+
+/* A certificate read from the card, parsed by a worker */
+struct cert_parse_job {
+	struct sc_pkcs15_der der;
+	struct sc_pkcs15_cert *cert;
+	struct sc_pkcs15_pubkey *pubkey;
+	int rv;
+	int read;
+};
+
+static void
+parse_cert_job(struct cert_parse_job *job)
+{
+	job->rv = sc_pkcs15_parse_certificate(context, &job->der, &job->cert);
+	free(job->der.value);
+	job->der.value = NULL;
+	/* left to the caller to get again, if it fails */
+	if (job->rv == SC_SUCCESS
+			&& sc_pkcs15_pubkey_from_cert(context, &job->cert->data, &job->pubkey) < 0)
+		job->pubkey = NULL;
+}
+
+#ifdef HAVE_PTHREAD
+#define MAX_PARSE_THREADS	8
+
+struct cert_parse_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct cert_parse_job **jobs;
+	int count;		/* read from the card so far */
+	int next;		/* next one to parse */
+	int reading;
+};
+
+static void *
+cert_parse_worker(void *arg)
+{
+	struct cert_parse_queue *q = (struct cert_parse_queue *) arg;
+	struct cert_parse_job *job;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (q->next == q->count && q->reading)
+			pthread_cond_wait(&q->ready, &q->lock);
+		if (q->next == q->count)
+			break;
+		job = q->jobs[q->next++];
+		pthread_mutex_unlock(&q->lock);
+		parse_cert_job(job);
+		pthread_mutex_lock(&q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+/* The certificates are read one after the other on this thread, as the
+ * card wants it, and parsed by the workers while the next one is read.
+ * Returns 0 if no worker could be started. */
+static int
+pkcs15_read_certs_pipelined(struct pkcs15_fw_data *fw_data,
+		struct sc_pkcs15_object **p15_object, struct cert_parse_job *jobs, int count)
+{
+	struct cert_parse_queue q;
+	pthread_t threads[MAX_PARSE_THREADS];
+	unsigned int n = sc_pkcs11_conf.parse_threads, started = 0, i;
+	int j;
+
+	if (n > MAX_PARSE_THREADS)
+		n = MAX_PARSE_THREADS;
+	if (count < 2 || n == 0)
+		return 0;
+
+	memset(&q, 0, sizeof(q));
+	q.reading = 1;
+	q.jobs = calloc(count, sizeof(*q.jobs));
+	if (q.jobs == NULL)
+		return 0;
+	if (pthread_mutex_init(&q.lock, NULL) != 0) {
+		free(q.jobs);
+		return 0;
+	}
+	if (pthread_cond_init(&q.ready, NULL) != 0) {
+		pthread_mutex_destroy(&q.lock);
+		free(q.jobs);
+		return 0;
+	}
+	for (i = 0; i < n && i < (unsigned int) count; i++)
+		if (pthread_create(&threads[started], NULL, cert_parse_worker, &q) == 0)
+			started++;
+	if (started == 0) {
+		pthread_cond_destroy(&q.ready);
+		pthread_mutex_destroy(&q.lock);
+		free(q.jobs);
+		return 0;
+	}
+	sc_log(context, "parsing %d certificates in %u threads", count, started);
+
+	for (j = 0; j < count; j++) {
+		struct sc_pkcs15_object *cert = p15_object[j];
+
+		if (cert->flags & SC_PKCS15_CO_FLAG_PRIVATE)
+			continue;
+		jobs[j].read = 1;
+		jobs[j].rv = sc_pkcs15_read_certificate_data(fw_data->p15_card,
+				(struct sc_pkcs15_cert_info *) cert->data, &jobs[j].der);
+		if (jobs[j].rv < 0)
+			break;
+		pthread_mutex_lock(&q.lock);
+		q.jobs[q.count++] = &jobs[j];
+		pthread_cond_signal(&q.ready);
+		pthread_mutex_unlock(&q.lock);
+	}
+
+	pthread_mutex_lock(&q.lock);
+	q.reading = 0;
+	pthread_cond_broadcast(&q.ready);
+	pthread_mutex_unlock(&q.lock);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&q.ready);
+	pthread_mutex_destroy(&q.lock);
+	free(q.jobs);
+	return 1;
+}
+#else
+#define pkcs15_read_certs_pipelined(fw_data, p15_object, jobs, count)	0
+#endif
+
+
+static int
+pkcs15_create_cert_objects(struct pkcs15_fw_data *fw_data)
+{
+	struct sc_pkcs15_search_key sk;
+	struct sc_pkcs15_object_iter it;
+	struct sc_pkcs15_object **p15_object = NULL, *obj;
+	struct cert_parse_job *jobs = NULL;
+	int i, count = 0, size = 0, rv;
+
+	memset(&sk, 0, sizeof(sk));
+	sk.type = SC_PKCS15_TYPE_CERT_X509;
+	rv = sc_pkcs15_iter_init(fw_data->p15_card, &it, &sk);
+	if (rv < 0)
+		return rv;
+
+	if (sc_pkcs11_conf.lazy_object_loading) {
+		while ((obj = sc_pkcs15_iter_next(&it)) != NULL) {
+			count++;
+			if (rv >= 0)
+				rv = __pkcs15_create_cert_object(fw_data, obj, NULL);
+		}
+		sc_log(context, "Found %d certificate%s", count, (count == 1)? "" : "s");
+		return count;
+	}
 
-	for (i = 0; rv >= 0 && i < count; i++)
-		rv = create(fw_data, p15_object[i], NULL);
+	/* the certificates are all read before any is parsed */
+	while ((obj = sc_pkcs15_iter_next(&it)) != NULL) {
+		if (count == size) {
+			struct sc_pkcs15_object **tmp;
 
+			size = size ? 2 * size : 8;
+			tmp = realloc(p15_object, size * sizeof(*p15_object));
+			if (tmp == NULL) {
+				free(p15_object);
+				return SC_ERROR_OUT_OF_MEMORY;
+			}
+			p15_object = tmp;
+		}
+		p15_object[count++] = obj;
+	}
+	sc_log(context, "Found %d certificate%s", count, (count == 1)? "" : "s");
+
+	if (count > 0)
+		jobs = calloc(count, sizeof(*jobs));
+	if (jobs == NULL || !pkcs15_read_certs_pipelined(fw_data, p15_object, jobs, count)) {
+		for (i = 0; rv >= 0 && i < count; i++)
+			rv = __pkcs15_create_cert_object(fw_data, p15_object[i], NULL);
+		free(jobs);
+		free(p15_object);
+		return count;
+	}
+
+	for (i = 0; rv >= 0 && i < count; i++) {
+		if (!jobs[i].read) {
+			rv = __pkcs15_add_cert_object(fw_data, p15_object[i], NULL, NULL, NULL);
+			continue;
+		}
+		rv = jobs[i].rv;
+		if (rv >= 0)
+			rv = __pkcs15_add_cert_object(fw_data, p15_object[i],
+					jobs[i].cert, jobs[i].pubkey, NULL);
+		jobs[i].cert = NULL;
+		jobs[i].pubkey = NULL;
+	}
+	for (i = 0; i < count; i++) {
+		free(jobs[i].der.value);
+		if (jobs[i].cert)
+			sc_pkcs15_free_certificate(jobs[i].cert);
+		sc_pkcs15_free_pubkey(jobs[i].pubkey);
+	}
+	free(jobs);
+	free(p15_object);
 	return count;
 }
 
@@ -800,7 +1138,7 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 
 	if (cert->cert_data)
 		return 0;
-	rv = sc_pkcs15_read_certificate(fw_data->p15_card, cert->cert_info, &cert->cert_data);
+	rv = sc_pkcs15_read_certificate_shared(fw_data->p15_card, cert->cert_info, &cert->cert_data);
 	if (rv < 0)
 		return rv;
 
@@ -816,6 +1154,188 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 }
 
 
+/* The public key may not have been read yet either: the key is private,
+ * or objects are loaded lazily. Get it from the card or the certificate. */
+static int
+check_pubkey_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_pubkey_object *pubkey)
+{
+	struct sc_pkcs15_object *p15_object;
+	int rv;
+
+	if (!pubkey)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+
+	if (pubkey->pub_data)
+		return 0;
+
+	p15_object = pubkey->pub_p15obj;
+	if (p15_object && sc_pkcs11_conf.lazy_object_loading
+			&& !(p15_object->flags & SC_PKCS15_CO_FLAG_PRIVATE)) {
+		rv = sc_pkcs15_read_pubkey(fw_data->p15_card, p15_object, &pubkey->pub_data);
+		if (rv == 0) {
+			if (pubkey->pub_info->modulus_length == 0 && pubkey->pub_data->algorithm == SC_ALGORITHM_RSA)
+				pubkey->pub_info->modulus_length = 8 * pubkey->pub_data->u.rsa.modulus.len;
+			return 0;
+		}
+		pubkey->pub_data = NULL;
+	}
+
+	rv = check_cert_data_read(fw_data, pubkey->pub_genfrom);
+	if (rv < 0)
+		return rv;
+	return pubkey->pub_data ? 0 : SC_ERROR_OBJECT_NOT_FOUND;
+}
+
+
+/* Card data needed by the attributes of a template */
+#define PKCS15_PREFETCH_MAX	4
+struct pkcs15_prefetch {
+	const sc_path_t *path;
+	struct pkcs15_cert_object *cert;
+	struct pkcs15_pubkey_object *pubkey;
+	struct pkcs15_data_object *dobj;
+};
+
+static int
+prefetch_cmp(const void *a, const void *b)
+{
+	const sc_path_t *pa = ((const struct pkcs15_prefetch *) a)->path;
+	const sc_path_t *pb = ((const struct pkcs15_prefetch *) b)->path;
+	size_t len = pa->len < pb->len ? pa->len : pb->len;
+	int r = memcmp(pa->value, pb->value, len);
+
+	if (r)
+		return r;
+	return (pa->len > pb->len) - (pa->len < pb->len);
+}
+
+static void
+prefetch_add(struct pkcs15_prefetch *list, size_t *count, struct pkcs15_prefetch *load)
+{
+	static const sc_path_t no_path;
+	size_t i;
+
+	for (i = 0; i < *count; i++)
+		if (list[i].cert == load->cert && list[i].pubkey == load->pubkey
+				&& list[i].dobj == load->dobj)
+			return;
+	if (*count == PKCS15_PREFETCH_MAX)
+		return;
+	if (load->path == NULL)
+		load->path = &no_path;
+	list[(*count)++] = *load;
+}
+
+static void
+prefetch_pubkey(struct pkcs15_prefetch *list, size_t *count, struct pkcs15_pubkey_object *pubkey)
+{
+	struct pkcs15_prefetch load = { NULL, NULL, NULL, NULL };
+
+	if (pubkey == NULL || pubkey->pub_data)
+		return;
+	if (pubkey->pub_info)
+		load.path = &pubkey->pub_info->path;
+	else if (pubkey->pub_genfrom)
+		load.path = &pubkey->pub_genfrom->cert_info->path;
+	load.pubkey = pubkey;
+	prefetch_add(list, count, &load);
+}
+
+/* Reads in one go, and in the order of their paths, the files that the
+ * attributes of a template need, so that C_GetAttributeValue() takes them
+ * from memory rather than going to the card for each of them */
+static CK_RV
+pkcs15_any_prefetch(struct sc_pkcs11_session *session, void *object,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	struct sc_pkcs11_card *p11card = session->slot->card;
+	struct pkcs15_any_object *obj = (struct pkcs15_any_object *) object;
+	struct pkcs15_fw_data *fw_data;
+	struct pkcs15_prefetch list[PKCS15_PREFETCH_MAX];
+	size_t count = 0, i;
+	CK_ULONG j;
+
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
+	if (!fw_data)
+		return CKR_OK;
+
+	for (j = 0; j < ulCount; j++) {
+		struct pkcs15_prefetch load = { NULL, NULL, NULL, NULL };
+		CK_ATTRIBUTE_TYPE type = pTemplate[j].type;
+
+		if (is_cert(obj)) {
+			struct pkcs15_cert_object *cert = (struct pkcs15_cert_object *) obj;
+
+			if (cert->cert_data || (type != CKA_VALUE && type != CKA_SERIAL_NUMBER
+					&& type != CKA_SUBJECT && type != CKA_ISSUER))
+				continue;
+			load.path = &cert->cert_info->path;
+			load.cert = cert;
+			prefetch_add(list, &count, &load);
+		} else if (is_pubkey(obj)) {
+			if (type == CKA_KEY_TYPE || type == CKA_MODULUS || type == CKA_MODULUS_BITS
+					|| type == CKA_VALUE || type == CKA_PUBLIC_EXPONENT
+					|| type == CKA_EC_PARAMS || type == CKA_EC_POINT)
+				prefetch_pubkey(list, &count, (struct pkcs15_pubkey_object *) obj);
+		} else if (is_privkey(obj)) {
+			/* the public parts come from the related public key */
+			if (type == CKA_MODULUS || type == CKA_PUBLIC_EXPONENT
+					|| type == CKA_MODULUS_BITS || type == CKA_ECDSA_PARAMS)
+				prefetch_pubkey(list, &count, obj->related_pubkey);
+		} else if (is_data(obj)) {
+			struct pkcs15_data_object *dobj = (struct pkcs15_data_object *) obj;
+
+			if (type != CKA_VALUE || dobj->value || dobj->prefetched || dobj->info->data.value)
+				continue;
+			load.path = &dobj->info->path;
+			load.dobj = dobj;
+			prefetch_add(list, &count, &load);
+		}
+	}
+	if (count == 0)
+		return CKR_OK;
+
+	qsort(list, count, sizeof(list[0]), prefetch_cmp);
+	if (sc_lock(p11card->card) < 0)
+		return CKR_OK;
+	/* failures are left to the attributes, which read again */
+	for (i = 0; i < count; i++) {
+		if (list[i].cert) {
+			check_cert_data_read(fw_data, list[i].cert);
+		} else if (list[i].pubkey) {
+			check_pubkey_data_read(fw_data, list[i].pubkey);
+		} else {
+			struct pkcs15_data_object *dobj = list[i].dobj;
+			struct sc_pkcs15_data *data = NULL;
+
+			if (sc_pkcs15_read_data_object(fw_data->p15_card, dobj->info, &data) < 0)
+				continue;
+			if (dobj->base.p15_object->flags & SC_PKCS15_CO_FLAG_PRIVATE)
+				dobj->prefetched = data;
+			else
+				dobj->value = data;
+		}
+	}
+	sc_unlock(p11card->card);
+	return CKR_OK;
+}
+
+
+static void
+pkcs15_any_release_prefetched(struct sc_pkcs11_session *session, void *object)
+{
+	struct pkcs15_any_object *obj = (struct pkcs15_any_object *) object;
+
+	if (is_data(obj)) {
+		struct pkcs15_data_object *dobj = (struct pkcs15_data_object *) obj;
+
+		if (dobj->prefetched)
+			sc_pkcs15_free_data_object(dobj->prefetched);
+		dobj->prefetched = NULL;
+	}
+}
+
+
 static void
 pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 		  CK_OBJECT_HANDLE_PTR pHandle)
@@ -828,15 +1348,15 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 	if (obj->base.flags & (SC_PKCS11_OBJECT_HIDDEN | SC_PKCS11_OBJECT_RECURS))
 		return;
 
-	if (list_contains(&slot->objects, obj))
+	if (slot_find_object(slot, (CK_OBJECT_HANDLE)obj) == &obj->base)
 		return;
 
 	if (pHandle != NULL)
 		*pHandle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
 
-	list_append(&slot->objects, obj);
 	sc_log(context, "Slot:%X Setting object handle of 0x%lx to 0x%lx", slot->id, obj->base.handle, (CK_OBJECT_HANDLE)obj);
 	obj->base.handle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
+	slot_add_object(slot, &obj->base);
 	obj->base.flags |= SC_PKCS11_OBJECT_SEEN;
 	obj->refcount++;
 
@@ -999,8 +1519,7 @@ _pkcs15_create_typed_objects(struct pkcs15_fw_data *fw_data)
 	if (rv < 0)
 		return rv;
 
-	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_CERT_X509, "certificate",
-			__pkcs15_create_cert_object);
+	rv = pkcs15_create_cert_objects(fw_data);
 	if (rv < 0)
 		return rv;
 
@@ -1009,6 +1528,11 @@ _pkcs15_create_typed_objects(struct pkcs15_fw_data *fw_data)
 	if (rv < 0)
 		return rv;
 
+	rv = pkcs15_create_pkcs11_objects(fw_data, SC_PKCS15_TYPE_SKEY, "secret key",
+			__pkcs15_create_secret_key_object);
+	if (rv < 0)
+		return rv;
+
 	/* Match up related keys and certificates */
 	pkcs15_bind_related_objects(fw_data);
 	sc_log(context, "found %i FW objects", fw_data->num_objects);
@@ -1198,7 +1722,7 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 	struct pkcs15_fw_data *fw_data = NULL, *ffda = NULL;
 	struct sc_pkcs15_object *auth_user_pin = NULL, *auth_sign_pin = NULL, *fauo = NULL;
 	struct sc_pkcs11_slot *slot = NULL;
-	int i, rv, idx;
+	int rv, idx;
 
 	sc_log(context, "create PKCS#15 tokens; fws:%p,%p,%p",
 			p11card->fws_data[0], p11card->fws_data[1], p11card->fws_data[2]);
@@ -1216,47 +1740,41 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 		auth_sign_pin = _get_auth_object_by_name(fw_data->p15_card, "SignPIN");
 	sc_log(context, "Flags:0x%X; Auth User/Sign PINs %p/%p", sc_pkcs11_conf.create_slots_flags, auth_user_pin, auth_sign_pin);
 
-	/* Add PKCS#15 objects of the known types to the framework data */
-	rv = _pkcs15_create_typed_objects(fw_data);
-	if (rv < 0)
-		return sc_to_cryptoki_error(rv, NULL);
-	sc_log(context, "Found %d FW objects objects", fw_data->num_objects);
-
 	/* Create slots for all non-unblock, non-so PINs if:
 	 *  - 'UserPIN' cannot be identified (VT: for some cards with incomplete PIN flags);
 	 *  - configuration impose to create slot for all PINs.
 	 */
 	if (!auth_user_pin || sc_pkcs11_conf.create_slots_flags & SC_PKCS11_SLOT_CREATE_ALL)   {
-		struct sc_pkcs15_object *auths[MAX_OBJECTS];
-		int auth_count;
+		struct sc_pkcs15_search_key sk;
+		struct sc_pkcs15_object_iter it;
+		struct sc_pkcs15_object *auth;
 
-		memset(auths, 0, sizeof(auths));
-		/* Get authentication PKCS#15 objects present in the associated on-card application */
-		rv = sc_pkcs15_get_objects(fw_data->p15_card, SC_PKCS15_TYPE_AUTH_PIN, auths, SC_PKCS15_MAX_PINS);
+		/* Walk the authentication PKCS#15 objects present in the associated on-card application */
+		memset(&sk, 0, sizeof(sk));
+		sk.type = SC_PKCS15_TYPE_AUTH_PIN;
+		rv = sc_pkcs15_iter_init(fw_data->p15_card, &it, &sk);
 		if (rv < 0)
 			return sc_to_cryptoki_error(rv, NULL);
-		auth_count = rv;
-		sc_log(context, "Found %d authentication objects", auth_count);
 
-		for (i = 0; i < auth_count; i++) {
-			struct sc_pkcs15_auth_info *pin_info = (struct sc_pkcs15_auth_info*)auths[i]->data;
+		while ((auth = sc_pkcs15_iter_next(&it)) != NULL) {
+			struct sc_pkcs15_auth_info *pin_info = (struct sc_pkcs15_auth_info*)auth->data;
 			struct sc_pkcs11_slot *islot = NULL;
 
 			/* Check if a slot could be created with this PIN */
 			if (!_is_slot_auth_object(pin_info))
 				continue;
-			sc_log(context, "Found authentication object '%s'", auths[i]->label);
+			sc_log(context, "Found authentication object '%s'", auth->label);
 
-			rv = pkcs15_create_slot(p11card, fw_data, auths[i], app_info, &islot);
+			rv = pkcs15_create_slot(p11card, fw_data, auth, app_info, &islot);
 			if (rv != CKR_OK)
 				return CKR_OK; /* no more slots available for this card */
 			islot->fw_data_idx = idx;
-			_add_pin_related_objects(islot, auths[i], fw_data, NULL);
+			_add_pin_related_objects(islot, auth, fw_data, NULL);
 
 			/* Get slot to which the public objects will be associated */
 			if (!slot && !auth_user_pin)
 				slot = islot;
-			else if (!slot && auth_user_pin && auth_user_pin == auths[i])
+			else if (!slot && auth_user_pin && auth_user_pin == auth)
 				slot = islot;
 		}
 	}
@@ -1290,43 +1808,614 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 			_add_pin_related_objects(slot, auth_user_pin, fw_data, NULL);
 		}
 
-		/*  Create slot for SignPIN and populate it's FW data with the objects protected by SignPIN*/
-		if (auth_sign_pin && auth_user_pin)   {
-			struct sc_pkcs11_slot *sign_slot = NULL;
+		/*  Create slot for SignPIN and populate it's FW data with the objects protected by SignPIN*/
+		if (auth_sign_pin && auth_user_pin)   {
+			struct sc_pkcs11_slot *sign_slot = NULL;
+
+			sc_log(context, "Create slot for Sign PIN '%s'", auth_sign_pin->label);
+			rv = pkcs15_create_slot(p11card, fw_data, auth_sign_pin, app_info, &sign_slot);
+			if (rv != CKR_OK)
+				return CKR_OK; /* no more slots available for this card */
+			sign_slot->fw_data_idx = idx;
+			_add_pin_related_objects(sign_slot, auth_sign_pin, fw_data, NULL);
+		}
+	}
+
+	if (first_slot && *first_slot==NULL)
+		*first_slot = slot;
+
+	if (slot)
+		_add_public_objects(slot, fw_data, ffda);
+
+	if (ffda)
+		sc_log(context, "Finaly there are %i objects in first slot", ffda->num_objects);
+	sc_log(context, "All tokens created");
+	return CKR_OK;
+}
+
+
+static CK_RV
+pkcs15_release_token(struct sc_pkcs11_card *p11card, void *fw_token)
+{
+#if 0
+	unlock_card((struct pkcs15_fw_data *) p11card->fws_data[0]);
+	free(fw_token);
+	return CKR_OK;
+#else
+	sc_log(context, "pkcs15_release_token() not implemented");
+	return CKR_FUNCTION_REJECTED;
+#endif
+}
+
+
+/*
+ * The card of the slots was reset, or taken out and put back in. The
+ * sessions are closed as with a removal, but the objects stay where the
+ * card still has them: the applications are bound again, and the framework
+ * object of the new binding that has the class, ID and path of an old one
+ * hands its content over to it, so that the old handle stays valid. The
+ * other new objects are added, the other old ones retired. When it is not
+ * the same token, the caller falls back to a removal.
+ */
+struct pkcs15_resync_entry {
+	struct pkcs15_any_object *obj;
+	unsigned int idx;		/* framework data holding it */
+	unsigned int type;		/* 0 when it has no key */
+	struct sc_pkcs15_id id;
+	struct sc_path path;
+	struct pkcs15_any_object *repl;	/* new object taking over */
+};
+
+struct pkcs15_resync_slot {
+	struct sc_pkcs11_slot *slot;
+	int app;			/* index of the application, -1 for none */
+	int has_auth;
+	struct sc_pkcs15_id auth_id;
+};
+
+static int
+pkcs15_object_key(struct pkcs15_any_object *obj, unsigned int *type,
+		struct sc_pkcs15_id *id, struct sc_path *path)
+{
+	struct sc_pkcs15_object *p15_object = obj->p15_object;
+
+	/* Public keys made from a certificate have none */
+	if (p15_object == NULL)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+
+	switch (p15_object->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		*id = ((struct sc_pkcs15_prkey_info *) p15_object->data)->id;
+		*path = ((struct sc_pkcs15_prkey_info *) p15_object->data)->path;
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		*id = ((struct sc_pkcs15_pubkey_info *) p15_object->data)->id;
+		*path = ((struct sc_pkcs15_pubkey_info *) p15_object->data)->path;
+		break;
+	case SC_PKCS15_TYPE_CERT:
+		*id = ((struct sc_pkcs15_cert_info *) p15_object->data)->id;
+		*path = ((struct sc_pkcs15_cert_info *) p15_object->data)->path;
+		break;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		*id = ((struct sc_pkcs15_data_info *) p15_object->data)->id;
+		*path = ((struct sc_pkcs15_data_info *) p15_object->data)->path;
+		break;
+	case SC_PKCS15_TYPE_SKEY:
+		*id = ((struct sc_pkcs15_skey_info *) p15_object->data)->id;
+		*path = ((struct sc_pkcs15_skey_info *) p15_object->data)->path;
+		break;
+	default:
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	}
+	*type = p15_object->type;
+	return SC_SUCCESS;
+}
+
+
+/* The entry of the old object a new one takes over */
+static struct pkcs15_resync_entry *
+pkcs15_resync_replaced(struct pkcs15_resync_entry *entries, unsigned int count, void *obj)
+{
+	unsigned int i;
+
+	if (obj == NULL)
+		return NULL;
+	for (i = 0; i < count; i++)
+		if (entries[i].repl == obj)
+			return &entries[i];
+	return NULL;
+}
+
+
+static struct pkcs15_resync_entry *
+pkcs15_resync_entry_of(struct pkcs15_resync_entry *entries, unsigned int count, void *obj)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		if (entries[i].obj == obj)
+			return &entries[i];
+	return NULL;
+}
+
+
+/* The slot a new object goes to, as pkcs15_create_tokens() would place it */
+static struct sc_pkcs11_slot *
+pkcs15_resync_slot_of(struct pkcs15_resync_slot *slots, unsigned int nslots,
+		unsigned int idx, struct pkcs15_any_object *obj)
+{
+	struct sc_pkcs15_object *p15_object = obj->p15_object;
+	unsigned int i;
+
+	if (p15_object == NULL)
+		return NULL;
+
+	if (p15_object->flags & SC_PKCS15_CO_FLAG_PRIVATE)   {
+		/* private public keys come with their private key */
+		if (is_pubkey(obj))
+			return NULL;
+		for (i = 0; i < nslots; i++)
+			if (slots[i].has_auth && sc_pkcs15_compare_id(&slots[i].auth_id, &p15_object->auth_id))
+				return slots[i].slot;
+		return NULL;
+	}
+
+	if (p15_object->auth_id.len)
+		return NULL;
+	for (i = 0; i < nslots; i++)
+		if (slots[i].slot->fw_data_idx == (int) idx)
+			return slots[i].slot;
+	return nslots ? slots[0].slot : NULL;
+}
+
+
+static void
+pkcs15_resync_swap(struct pkcs15_any_object *obj, struct pkcs15_any_object *repl)
+{
+	unsigned char *p = (unsigned char *) obj + offsetof(struct pkcs15_any_object, p15_object);
+	unsigned char *q = (unsigned char *) repl + offsetof(struct pkcs15_any_object, p15_object);
+	size_t len = obj->size - offsetof(struct pkcs15_any_object, p15_object);
+	unsigned char c;
+
+	while (len--) {
+		c = *p;
+		*p++ = *q;
+		*q++ = c;
+	}
+
+	/* What was read of the old object does not hold anymore */
+	sc_pkcs11_free_attribute_cache(&obj->base);
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_free_verify_key(&obj->base);
+#endif
+}
+
+
+static void *
+pkcs15_resync_map(struct pkcs15_resync_entry *entries, unsigned int count, void *obj)
+{
+	struct pkcs15_resync_entry *entry = pkcs15_resync_replaced(entries, count, obj);
+
+	return entry ? entry->obj : obj;
+}
+
+
+static CK_RV
+pkcs15_resync(struct sc_pkcs11_card *p11card)
+{
+	struct pkcs15_fw_data *fresh[SC_PKCS11_FRAMEWORK_DATA_MAX_NUM];
+	char *serial[SC_PKCS11_FRAMEWORK_DATA_MAX_NUM];
+	int app[SC_PKCS11_FRAMEWORK_DATA_MAX_NUM];
+	struct sc_aid aid[SC_MAX_CARD_APPS];
+	struct pkcs15_resync_entry *entries = NULL;
+	struct pkcs15_resync_slot *slots = NULL;
+	struct sc_card_driver *driver = p11card->card->driver;
+	int app_count = p11card->card->app_count;
+	unsigned int nfw, nentries = 0, nslots = 0, i, j, k;
+	int rc;
+	CK_RV rv = CKR_OK;
+
+	memset(fresh, 0, sizeof(fresh));
+	memset(serial, 0, sizeof(serial));
+
+	for (nfw = 0; nfw < SC_PKCS11_FRAMEWORK_DATA_MAX_NUM && p11card->fws_data[nfw]; nfw++)
+		app[nfw] = -2;
+	entries = calloc(nfw * MAX_OBJECTS + 1, sizeof(*entries));
+	slots = calloc(list_size(&virtual_slots) + 1, sizeof(*slots));
+	if (!entries || !slots)   {
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
+
+	/* Note what tells the token, its applications and objects apart:
+	 * it goes away with the card */
+	for (i = 0; (int) i < app_count; i++)
+		aid[i] = p11card->card->app[i]->aid;
+
+	for (i = 0; i < list_size(&virtual_slots); i++)   {
+		struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *) list_get_at(&virtual_slots, i);
+		struct pkcs15_resync_slot *rs = &slots[nslots];
+		struct sc_pkcs15_auth_info *auth_info;
+
+		if (slot->card != p11card)
+			continue;
+		if (slot->fw_data_idx < 0 || slot->fw_data_idx >= (int) nfw)   {
+			rv = CKR_GENERAL_ERROR;
+			goto out;
+		}
+		rs->slot = slot;
+		rs->app = -1;
+		for (j = 0; (int) j < app_count; j++)
+			if (slot->app_info == p11card->card->app[j])
+				rs->app = j;
+		if (slot->app_info && rs->app < 0)   {
+			rv = CKR_GENERAL_ERROR;
+			goto out;
+		}
+		if (app[slot->fw_data_idx] != -2 && app[slot->fw_data_idx] != rs->app)   {
+			rv = CKR_GENERAL_ERROR;
+			goto out;
+		}
+		app[slot->fw_data_idx] = rs->app;
+
+		auth_info = slot_data_auth_info(slot->fw_data);
+		if (auth_info)   {
+			rs->has_auth = 1;
+			rs->auth_id = auth_info->auth_id;
+		}
+		nslots++;
+	}
+
+	/* The session objects go with the sessions */
+	for (i = 0; i < nslots; i++)
+		sc_pkcs11_close_all_sessions(slots[i].slot->id);
+
+	for (i = 0; i < nfw; i++)   {
+		struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) p11card->fws_data[i];
+		const char *sn = fw_data->p15_card->tokeninfo->serial_number;
+
+		/* Without a serial number, another card could pass for this one */
+		if (app[i] == -2 || sn == NULL)   {
+			rv = CKR_TOKEN_NOT_RECOGNIZED;
+			goto out;
+		}
+		serial[i] = strdup(sn);
+		if (serial[i] == NULL)   {
+			rv = CKR_HOST_MEMORY;
+			goto out;
+		}
+
+		for (j = 0; j < fw_data->num_objects; j++)   {
+			struct pkcs15_resync_entry *entry = &entries[nentries++];
+
+			entry->obj = fw_data->objects[j];
+			entry->idx = i;
+			if (pkcs15_object_key(entry->obj, &entry->type, &entry->id, &entry->path) != SC_SUCCESS)
+				entry->type = 0;
+		}
+	}
+
+	/* From here on the old binding goes: a failure is a removal */
+	for (i = 0; i < nfw; i++)   {
+		struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) p11card->fws_data[i];
+
+		unlock_card(fw_data);
+		sc_pkcs15_unbind(fw_data->p15_card);
+		fw_data->p15_card = NULL;
+	}
+
+	sc_disconnect_card(p11card->card);
+	p11card->card = NULL;
+	rc = sc_connect_card(p11card->reader, &p11card->card);
+	if (rc != SC_SUCCESS)   {
+		p11card->card = NULL;
+		rv = sc_to_cryptoki_error(rc, NULL);
+		goto out;
+	}
+	if (p11card->card->driver != driver || p11card->card->app_count != app_count)   {
+		rv = CKR_TOKEN_NOT_RECOGNIZED;
+		goto out;
+	}
+	for (i = 0; (int) i < app_count; i++)
+		if (aid[i].len != p11card->card->app[i]->aid.len
+				|| memcmp(aid[i].value, p11card->card->app[i]->aid.value, aid[i].len))   {
+			rv = CKR_TOKEN_NOT_RECOGNIZED;
+			goto out;
+		}
+
+	for (i = 0; i < nfw; i++)   {
+		struct sc_pkcs15_card *p15card;
+
+		fresh[i] = calloc(1, sizeof(struct pkcs15_fw_data));
+		if (fresh[i] == NULL)   {
+			rv = CKR_HOST_MEMORY;
+			goto out;
+		}
+		rc = sc_pkcs15_bind(p11card->card, app[i] >= 0 ? &p11card->card->app[app[i]]->aid : NULL,
+				&fresh[i]->p15_card);
+		if (rc != SC_SUCCESS)   {
+			rv = sc_to_cryptoki_error(rc, NULL);
+			goto out;
+		}
+		p15card = fresh[i]->p15_card;
+		if (!p15card->tokeninfo->serial_number || strcmp(p15card->tokeninfo->serial_number, serial[i]))   {
+			sc_log(context, "Another token is in the reader");
+			rv = CKR_TOKEN_NOT_RECOGNIZED;
+			goto out;
+		}
+
+		rc = _pkcs15_create_typed_objects(fresh[i]);
+		if (rc < 0)   {
+			rv = sc_to_cryptoki_error(rc, NULL);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nslots; i++)   {
+		struct sc_pkcs15_object *auth = NULL;
+
+		if (slots[i].has_auth && sc_pkcs15_find_pin_by_auth_id(fresh[slots[i].slot->fw_data_idx]->p15_card,
+					&slots[i].auth_id, &auth) != SC_SUCCESS)   {
+			rv = CKR_TOKEN_NOT_RECOGNIZED;
+			goto out;
+		}
+	}
+
+	/* Pair the old objects with the new ones */
+	for (i = 0; i < nfw; i++)
+		for (j = 0; j < fresh[i]->num_objects; j++)   {
+			struct pkcs15_any_object *obj = fresh[i]->objects[j];
+			struct sc_pkcs15_id id;
+			struct sc_path path;
+			unsigned int type;
+
+			if (pkcs15_object_key(obj, &type, &id, &path) != SC_SUCCESS)
+				continue;
+			for (k = 0; k < nentries; k++)   {
+				struct pkcs15_resync_entry *entry = &entries[k];
+
+				if (entry->type == type && entry->repl == NULL && entry->obj->size == obj->size
+						&& sc_pkcs15_compare_id(&entry->id, &id)
+						&& sc_compare_path(&entry->path, &path))   {
+					entry->repl = obj;
+					break;
+				}
+			}
+		}
+
+	/* The public keys made from the certificates go with them */
+	for (k = 0; k < nentries; k++)   {
+		struct pkcs15_any_object *cert = entries[k].obj, *repl = entries[k].repl;
+		struct pkcs15_any_object *pubkey, *repl_pubkey;
+		struct pkcs15_resync_entry *entry;
+
+		if (repl == NULL || !is_cert(repl))
+			continue;
+		pubkey = (struct pkcs15_any_object *) cert->related_pubkey;
+		repl_pubkey = (struct pkcs15_any_object *) repl->related_pubkey;
+		if (!pubkey || pubkey->p15_object || !repl_pubkey || repl_pubkey->p15_object)
+			continue;
+		entry = pkcs15_resync_entry_of(entries, nentries, pubkey);
+		if (entry && entry->repl == NULL && !pkcs15_resync_replaced(entries, nentries, repl_pubkey))
+			entry->repl = repl_pubkey;
+	}
+
+	/* The objects still on the card stay in the framework data they are in,
+	 * new ones go to that of their application */
+	for (i = 0; i < nfw; i++)   {
+		unsigned int count = 0;
+
+		for (k = 0; k < nentries; k++)
+			if (entries[k].idx == i && entries[k].repl)
+				count++;
+		for (j = 0; j < fresh[i]->num_objects; j++)
+			if (!pkcs15_resync_replaced(entries, nentries, fresh[i]->objects[j]))
+				count++;
+		if (count > MAX_OBJECTS)   {
+			rv = CKR_HOST_MEMORY;
+			goto out;
+		}
+	}
+
+	sc_log(context, "Resync of %u objects", nentries);
+	for (k = 0; k < nentries; k++)
+		if (entries[k].repl)
+			pkcs15_resync_swap(entries[k].obj, entries[k].repl);
+
+	for (i = 0; i < nfw; i++)   {
+		struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) p11card->fws_data[i];
+		struct pkcs15_any_object *retired[MAX_OBJECTS];
+		unsigned int nretired = 0;
+
+		for (k = 0; k < nentries; k++)   {
+			struct pkcs15_any_object *obj = entries[k].obj;
+
+			if (entries[k].idx != i)
+				continue;
+			if (entries[k].repl)   {
+				/* it carries the old content now */
+				retired[nretired++] = entries[k].repl;
+				continue;
+			}
+			sc_log(context, "Object %p is gone", obj);
+			for (j = 0; j < nslots; j++)
+				if (slot_find_object(slots[j].slot, obj->base.handle) == &obj->base)   {
+					slot_remove_object(slots[j].slot, &obj->base);
+					obj->base.ops->release(obj);
+				}
+			retired[nretired++] = obj;
+		}
+
+		fw_data->num_objects = 0;
+		for (k = 0; k < nentries; k++)
+			if (entries[k].idx == i && entries[k].repl)
+				fw_data->objects[fw_data->num_objects++] = entries[k].obj;
+		for (j = 0; j < fresh[i]->num_objects; j++)
+			if (!pkcs15_resync_replaced(entries, nentries, fresh[i]->objects[j]))
+				fw_data->objects[fw_data->num_objects++] = fresh[i]->objects[j];
+
+		for (j = 0; j < fw_data->num_objects; j++)   {
+			struct pkcs15_any_object *obj = fw_data->objects[j];
+
+			obj->related_pubkey = pkcs15_resync_map(entries, nentries, obj->related_pubkey);
+			obj->related_cert = pkcs15_resync_map(entries, nentries, obj->related_cert);
+			obj->related_privkey = pkcs15_resync_map(entries, nentries, obj->related_privkey);
+		}
+
+		for (j = 0; j < nretired; j++)
+			retired[j]->base.ops->release(retired[j]);
+
+		fw_data->p15_card = fresh[i]->p15_card;
+		pkcs15_set_read_yield(p11card, fw_data->p15_card);
+		fw_data->locked = 0;
+	}
+
+	for (i = 0; i < nslots; i++)   {
+		struct sc_pkcs11_slot *slot = slots[i].slot;
+		struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) p11card->fws_data[slot->fw_data_idx];
+
+		if (slots[i].has_auth)
+			sc_pkcs15_find_pin_by_auth_id(fw_data->p15_card, &slots[i].auth_id,
+					&slot_data(slot->fw_data)->auth_obj);
+		slot->app_info = slots[i].app >= 0 ? p11card->card->app[slots[i].app] : NULL;
+		pkcs15_init_token_info(fw_data->p15_card, &slot->token_info);
+		slot->events = SC_EVENT_CARD_INSERTED;
+	}
+
+	/* New objects, and the new ones related to those that stayed */
+	for (i = 0; i < nfw; i++)   {
+		struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) p11card->fws_data[i];
+
+		for (j = 0; j < fw_data->num_objects; j++)   {
+			struct pkcs15_any_object *obj = fw_data->objects[j];
+			struct sc_pkcs11_slot *slot;
+
+			if (pkcs15_resync_entry_of(entries, nentries, obj))   {
+				for (k = 0; k < nslots; k++)
+					if (slot_find_object(slots[k].slot, obj->base.handle) == &obj->base)   {
+						pkcs15_add_object(slots[k].slot, (struct pkcs15_any_object *) obj->related_pubkey, NULL);
+						pkcs15_add_object(slots[k].slot, (struct pkcs15_any_object *) obj->related_cert, NULL);
+					}
+				continue;
+			}
+			slot = pkcs15_resync_slot_of(slots, nslots, i, obj);
+			if (slot)
+				pkcs15_add_object(slot, obj, NULL);
+		}
+	}
+
+	for (i = 0; i < nfw; i++)   {
+		free(fresh[i]);
+		fresh[i] = NULL;
+	}
+
+out:
+	for (i = 0; i < nfw; i++)   {
+		if (fresh[i])
+			pkcs15_free_fw_data(fresh[i]);
+		free(serial[i]);
+	}
+	free(entries);
+	free(slots);
+	return rv;
+}
+
 
-			sc_log(context, "Create slot for Sign PIN '%s'", auth_sign_pin->label);
-			rv = pkcs15_create_slot(p11card, fw_data, auth_sign_pin, app_info, &sign_slot);
-			if (rv != CKR_OK)
-				return CKR_OK; /* no more slots available for this card */
-			sign_slot->fw_data_idx = idx;
-			_add_pin_related_objects(sign_slot, auth_sign_pin, fw_data, NULL);
+/* The objects of the token only found after the login with the PIN */
+static void
+pkcs15_login_objects(struct sc_pkcs11_slot *slot, struct pkcs15_fw_data *fw_data,
+		struct sc_pkcs15_auth_info *pin_info)
+{
+	struct sc_pkcs15_card *p15card = fw_data->p15_card;
+	sc_pkcs15_object_t *p15_obj = p15card->obj_list;
+	sc_pkcs15_search_key_t sk;
+
+	sc_log(context, "Check if pkcs15 object list can be completed.");
+
+	/* Ensure non empty list */
+	if (p15_obj == NULL)
+		return;
+
+	/* Select last object in list */
+	while(p15_obj->next)
+		p15_obj = p15_obj->next;
+
+	/* Trigger enumeration of EF.XXX files */
+	memset(&sk, 0, sizeof(sk));
+	sk.class_mask = SC_PKCS15_SEARCH_CLASS_PRKEY | SC_PKCS15_SEARCH_CLASS_PUBKEY |
+			SC_PKCS15_SEARCH_CLASS_CERT  | SC_PKCS15_SEARCH_CLASS_DATA;
+	sc_pkcs15_search_objects(p15card, &sk, NULL, 0);
+
+	/* Iterate over newly discovered objects */
+	while(p15_obj->next) {
+		struct pkcs15_any_object *fw_obj = NULL;
+
+		p15_obj = p15_obj->next;
+
+		if (!sc_pkcs15_compare_id(&pin_info->auth_id, &p15_obj->auth_id))
+			continue;
+
+		switch (p15_obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+		case SC_PKCS15_TYPE_PRKEY:
+			__pkcs15_create_prkey_object(fw_data, p15_obj, &fw_obj); break;
+		case SC_PKCS15_TYPE_PUBKEY:
+			__pkcs15_create_pubkey_object(fw_data, p15_obj, &fw_obj); break;
+		case SC_PKCS15_TYPE_CERT:
+			__pkcs15_create_cert_object(fw_data, p15_obj, &fw_obj); break;
+		case SC_PKCS15_TYPE_DATA_OBJECT:
+			__pkcs15_create_data_object(fw_data, p15_obj, &fw_obj); break;
+		default: continue;
 		}
+
+		sc_log(context, "new object found: type=0x%03X", p15_obj->type);
+		pkcs15_add_object(slot, fw_obj, NULL);
 	}
+}
 
-	if (first_slot && *first_slot==NULL)
-		*first_slot = slot;
 
-	if (slot)
-		_add_public_objects(slot, fw_data, ffda);
+/* The PIN of the peer's token is the one verified for the slot: the same
+ * object, or a global PIN (not local to an application) of the same
+ * reference */
+static int
+pkcs15_same_pin(struct sc_pkcs15_object *a, struct sc_pkcs15_object *b)
+{
+	struct sc_pkcs15_auth_info *ia, *ib;
 
-	if (ffda)
-		sc_log(context, "Finaly there are %i objects in first slot", ffda->num_objects);
-	sc_log(context, "All tokens created");
-	return CKR_OK;
+	if (a == NULL || b == NULL)
+		return 0;
+	if (a == b)
+		return 1;
+	ia = (struct sc_pkcs15_auth_info *) a->data;
+	ib = (struct sc_pkcs15_auth_info *) b->data;
+	if (ia->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN || ib->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN)
+		return 0;
+	if ((ia->attrs.pin.flags | ib->attrs.pin.flags) & SC_PKCS15_PIN_FLAG_LOCAL)
+		return 0;
+	return ia->attrs.pin.reference == ib->attrs.pin.reference;
 }
 
 
 static CK_RV
-pkcs15_release_token(struct sc_pkcs11_card *p11card, void *fw_token)
+pkcs15_login_shared(struct sc_pkcs11_slot *slot, struct sc_pkcs11_slot *peer,
+		CK_USER_TYPE userType, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 {
-#if 0
-	unlock_card((struct pkcs15_fw_data *) p11card->fws_data[0]);
-	free(fw_token);
+	struct sc_pkcs15_object *auth_object = slot_data_auth(peer->fw_data);
+	struct pkcs15_fw_data *fw_data;
+	int rc;
+
+	if (userType != CKU_USER || !pkcs15_same_pin(slot_data_auth(slot->fw_data), auth_object))
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	fw_data = (struct pkcs15_fw_data *) peer->card->fws_data[peer->fw_data_idx];
+	if (!fw_data)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	if (sc_pkcs11_conf.lock_login && (rc = lock_card(fw_data)) < 0)
+		return sc_to_cryptoki_error(rc, "C_Login");
+	/* for when the peer has to verify the PIN again */
+	if (pPin != NULL && ulPinLen != 0)
+		sc_pkcs15_pincache_add(fw_data->p15_card, auth_object, pPin, ulPinLen);
+	pkcs15_login_objects(peer, fw_data, (struct sc_pkcs15_auth_info *) auth_object->data);
 	return CKR_OK;
-#else
-	sc_log(context, "pkcs15_release_token() not implemented");
-	return CKR_FUNCTION_REJECTED;
-#endif
 }
 
 
@@ -1461,57 +2550,20 @@ pkcs15_login(struct sc_pkcs11_slot *slot, CK_USER_TYPE userType,
 		return sc_to_cryptoki_error(rc, "C_Login");
 	}
 
-	rc = sc_pkcs15_verify_pin(p15card, auth_object, pPin, ulPinLen);
+	/* A new login with the PIN the card still holds as verified needs no
+	 * VERIFY. The context specific one always asserts it again. */
+	if (userType != CKU_CONTEXT_SPECIFIC
+			&& sc_pkcs15_pin_still_verified(p15card, auth_object, pPin, ulPinLen))
+		rc = SC_SUCCESS;
+	else
+		rc = sc_pkcs15_verify_pin(p15card, auth_object, pPin, ulPinLen);
 	sc_log(context, "PKCS15 verify PIN returned %d", rc);
 
 	if (rc != SC_SUCCESS)
 		return sc_to_cryptoki_error(rc, "C_Login");
 
-	if (userType == CKU_USER)   {
-		sc_pkcs15_object_t *p15_obj = p15card->obj_list;
-		sc_pkcs15_search_key_t sk;
-
-		sc_log(context, "Check if pkcs15 object list can be completed.");
-
-		/* Ensure non empty list */
-		if (p15_obj == NULL)
-			return CKR_OK;
-
-		/* Select last object in list */
-		while(p15_obj->next)
-			p15_obj = p15_obj->next;
-
-		/* Trigger enumeration of EF.XXX files */
-		memset(&sk, 0, sizeof(sk));
-		sk.class_mask = SC_PKCS15_SEARCH_CLASS_PRKEY | SC_PKCS15_SEARCH_CLASS_PUBKEY |
-				SC_PKCS15_SEARCH_CLASS_CERT  | SC_PKCS15_SEARCH_CLASS_DATA;
-		sc_pkcs15_search_objects(p15card, &sk, NULL, 0);
-
-		/* Iterate over newly discovered objects */
-		while(p15_obj->next) {
-			struct pkcs15_any_object *fw_obj;
-
-			p15_obj = p15_obj->next;
-
-			if (!sc_pkcs15_compare_id(&pin_info->auth_id, &p15_obj->auth_id))
-				continue;
-
-			switch (p15_obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
-			case SC_PKCS15_TYPE_PRKEY:
-				__pkcs15_create_prkey_object(fw_data, p15_obj, &fw_obj); break;
-			case SC_PKCS15_TYPE_PUBKEY:
-				__pkcs15_create_pubkey_object(fw_data, p15_obj, &fw_obj); break;
-			case SC_PKCS15_TYPE_CERT:
-				__pkcs15_create_cert_object(fw_data, p15_obj, &fw_obj); break;
-			case SC_PKCS15_TYPE_DATA_OBJECT:
-				__pkcs15_create_data_object(fw_data, p15_obj, &fw_obj); break;
-			default: continue;
-			}
-
-			sc_log(context, "new object found: type=0x%03X", p15_obj->type);
-			pkcs15_add_object(slot, fw_obj, NULL);
-		}
-	}
+	if (userType == CKU_USER)
+		pkcs15_login_objects(slot, fw_data, pin_info);
 
 	return CKR_OK;
 }
@@ -1612,24 +2664,23 @@ pkcs15_change_pin(struct sc_pkcs11_slot *slot,
 		rc = sc_pkcs15_change_pin(fw_data->p15_card, pin_obj, pOldPin, ulOldLen, pNewPin, ulNewLen);
 	}
 	else if (login_user == CKU_SO)   {
-		struct sc_pkcs15_object *auths[SC_PKCS15_MAX_PINS];
-		int i, auth_count;
+		struct sc_pkcs15_search_key sk;
+		struct sc_pkcs15_object_iter it;
+		struct sc_pkcs15_object *auth;
 
-		rc = sc_pkcs15_get_objects(fw_data->p15_card, SC_PKCS15_TYPE_AUTH_PIN, auths, SC_PKCS15_MAX_PINS);
+		memset(&sk, 0, sizeof(sk));
+		sk.type = SC_PKCS15_TYPE_AUTH_PIN;
+		sk.flags_mask = sk.flags_value = SC_PKCS15_PIN_FLAG_SO_PIN;
+		rc = sc_pkcs15_iter_init(fw_data->p15_card, &it, &sk);
 		if (rc < 0)
 			return sc_to_cryptoki_error(rc, "C_SetPIN");
-		auth_count = rc;
-		for (i = 0; i < auth_count; i++)   {
-			auth_info = (struct sc_pkcs15_auth_info*) auths[i]->data;
-			if ((auth_info->attrs.pin.flags & SC_PKCS15_PIN_FLAG_SO_PIN))
-	                        break;
-		}
-		if (i == auth_count)   {
+		auth = sc_pkcs15_iter_next(&it);
+		if (auth == NULL)   {
 			sc_log(context, "Change SoPIN non supported");
 			return CKR_FUNCTION_NOT_SUPPORTED;
 		}
 
-		rc = sc_pkcs15_change_pin(fw_data->p15_card, auths[i], pOldPin, ulOldLen, pNewPin, ulNewLen);
+		rc = sc_pkcs15_change_pin(fw_data->p15_card, auth, pOldPin, ulOldLen, pNewPin, ulNewLen);
 	}
 	else   {
 		sc_log(context, "cannot change PIN: non supported login type: %i", login_user);
@@ -1649,6 +2700,7 @@ pkcs15_initialize(struct sc_pkcs11_card *p11card, void *ptr,
 		CK_UTF8CHAR_PTR pLabel)
 {
 	struct sc_cardctl_pkcs11_init_token args;
+	sc_reader_t *reader;
 	int rv;
 
 	memset(&args, 0, sizeof(args));
@@ -1664,11 +2716,13 @@ pkcs15_initialize(struct sc_pkcs11_card *p11card, void *ptr,
 	if (rv < 0)
 		return sc_to_cryptoki_error(rv, "C_InitToken");
 
-	rv = card_removed(p11card->reader);
+	/* C_InitToken() holds the slot lock of this reader only */
+	reader = p11card->reader;
+	rv = card_removed(reader);
 	if (rv != SC_SUCCESS)
 		return rv;
 
-	rv = card_detect_all();
+	rv = card_detect(reader);
 	if (rv != SC_SUCCESS)
 		return rv;
 
@@ -2024,20 +3078,18 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 		}
 	}
 
-	/* If creating a PKCS#11 session object, i.e. one that is only in memory */
+	/* If creating a PKCS#11 session object, i.e. one that is only in memory.
+	 * It is kept out of the objects of the slot and of fw_data, as there
+	 * is one for every ECDH of C_DeriveKey(): only the handle table of the
+	 * slot and the session know it, see slot_add_session_object() */
 	if (_token == FALSE) {
+	    struct pkcs15_session_skey *skey = calloc(1, sizeof(*skey));
 
-	    /* TODO Have 3 choices as to how to create the object.
-	     * (1)create a sc_pkcs15init_store_secret_key routine like the others
-	     * (2)use the sc_pkcs15emu_ routines
-	     * (3)do it inline here (Will do this for now)
-	     */
-
-	    key_obj = calloc(1, sizeof(sc_pkcs15_object_t));
-	    if (key_obj == NULL) {
+	    if (skey == NULL) {
 		rv = CKR_HOST_MEMORY;
 		goto out;
 	    }
+	    key_obj = &skey->p15_object;
 	    key_obj->type = SC_PKCS15_TYPE_SKEY;
 
 	    if (args.id.len)
@@ -2045,11 +3097,7 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 
 	    key_obj->flags = 2; /* TODO not sure what these mean */
 
-	    skey_info = calloc(1, sizeof(sc_pkcs15_skey_info_t));
-	    if (skey_info == NULL) {
-		rv = CKR_HOST_MEMORY;
-		goto out;
-	    }
+	    skey_info = &skey->info;
 	    key_obj->data = skey_info;
 	    skey_info->usage = args.usage;
 	    skey_info->native = 0; /* card can not use this */
@@ -2059,10 +3107,26 @@ pkcs15_create_secret_key(struct sc_pkcs11_slot *slot, struct sc_profile *profile
 	    skey_info->data.len = args.data_value.len;
 	    skey_info->value_len = args.value_len; /* callers prefered length */
 
+	    skey->skey.base.base.ops = &pkcs15_skey_ops;
+	    skey->skey.base.base.handle = (CK_OBJECT_HANDLE) skey; /* cast pointer to long */
+	    skey->skey.base.p15_object = key_obj;
+	    skey->skey.base.refcount = 1;
+	    skey->skey.base.size = sizeof(*skey);
+	    skey->skey.info = skey_info;
+
+	    rv = slot_add_session_object(slot, &skey->skey.base.base);
+	    if (rv != CKR_OK) {
+		free(skey_info->data.value);
+		free(skey);
+		return rv;
+	    }
+	    *phObject = skey->skey.base.base.handle;
+	    return CKR_OK;
 	}
 	else {
 #if 1
 	    rv = CKR_FUNCTION_NOT_SUPPORTED;
+	    free(args.data_value.value);
 	    goto out;
 #else
 		/* TODO add support for secret key on the card with something like this: */
@@ -2732,17 +3796,32 @@ pkcs15_skey_destroy(struct sc_pkcs11_session *session, void *object)
 	struct pkcs15_fw_data *fw_data = NULL;
 	int rv;
 
+	/* only session keys, those of the card are not deleted */
+	if (((struct pkcs15_skey_object *) object)->on_card)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	/* nothing to do on the card, nor in the objects of the slot */
+	if (any_obj->base.flags & SC_PKCS11_OBJECT_SESSION) {
+		struct sc_pkcs15_skey_info *info = ((struct pkcs15_skey_object *) object)->info;
+
+		slot_remove_session_object(session->slot, &any_obj->base);
+		if (info->data.value) {
+			sc_mem_clear(info->data.value, info->data.len);
+			free(info->data.value);
+		}
+		__pkcs15_release_object(any_obj);
+		return CKR_OK;
+	}
+
 	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GenerateKeyPair");
-	/* TODO assuming this is a session only object. */
 	rv = sc_lock(p11card->card);
 	if (rv < 0)
 		return sc_to_cryptoki_error(rv, "C_DestroyObject");
 
 	/* Oppose to pkcs15_add_object */
 	--any_obj->refcount; /* correct refcont */
-	list_delete(&session->slot->objects, any_obj);
+	slot_remove_object(session->slot, &any_obj->base);
 	/* Delete object in pkcs15 */
 	rv = __pkcs15_delete_object(fw_data, any_obj);
 
@@ -2803,7 +3882,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 			/* Unlink related public key FW object if it has no corresponding PKCS#15 object
 			 * and was created from certificate. */
 			--ao_pubkey->refcount;
-			list_delete(&session->slot->objects, ao_pubkey);
+			slot_remove_object(session->slot, &ao_pubkey->base);
 			/* Delete public key object in pkcs15 */
 			if (pubkey->pub_data)   {
 				sc_pkcs15_free_pubkey(pubkey->pub_data);
@@ -2819,7 +3898,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 	if (rv >= 0) {
 		/* Oppose to pkcs15_add_object */
 		--any_obj->refcount; /* correct refcont */
-		list_delete(&session->slot->objects, any_obj);
+		slot_remove_object(session->slot, &any_obj->base);
 		/* Delete object in pkcs15 */
 		rv = __pkcs15_delete_object(fw_data, any_obj);
 	}
@@ -2835,6 +3914,54 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 }
 
 
+/* Small requests are served from a pool filled with one GET CHALLENGE
+ * call; each byte of the card is given out once and then wiped. */
+static int
+get_pooled_random(struct pkcs15_fw_data *fw_data, unsigned char *p, size_t len)
+{
+	struct sc_card *card = fw_data->p15_card->card;
+	size_t size = sc_pkcs11_conf.random_pool_size, n;
+	unsigned char *src;
+	int rc;
+
+	if (len >= size)
+		return sc_get_challenge(card, p, len);
+#if !defined(_WIN32)
+	/* the bytes of the parent are not for a forked child */
+	if (fw_data->random_pid != getpid()) {
+		if (fw_data->random_pool)
+			sc_mem_clear(fw_data->random_pool, size);
+		fw_data->random_avail = 0;
+		fw_data->random_pid = getpid();
+	}
+#endif
+	if (fw_data->random_pool == NULL) {
+		fw_data->random_pool = malloc(size);
+		if (fw_data->random_pool == NULL)
+			return sc_get_challenge(card, p, len);
+	}
+
+	while (len > 0) {
+		if (fw_data->random_avail == 0) {
+			rc = sc_get_challenge(card, fw_data->random_pool, size);
+			if (rc < 0) {
+				sc_log(context, "Cannot fill the random pool: %s", sc_strerror(rc));
+				return sc_get_challenge(card, p, len);
+			}
+			fw_data->random_avail = size;
+		}
+		n = len < fw_data->random_avail ? len : fw_data->random_avail;
+		src = fw_data->random_pool + fw_data->random_avail - n;
+		memcpy(p, src, n);
+		sc_mem_clear(src, n);
+		fw_data->random_avail -= n;
+		p += n;
+		len -= n;
+	}
+	return SC_SUCCESS;
+}
+
+
 static CK_RV
 pkcs15_get_random(struct sc_pkcs11_slot *slot, CK_BYTE_PTR p, CK_ULONG len)
 {
@@ -2846,11 +3973,67 @@ pkcs15_get_random(struct sc_pkcs11_slot *slot, CK_BYTE_PTR p, CK_ULONG len)
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GenerateRandom");
 
-	rc = sc_get_challenge(fw_data->p15_card->card, p, (size_t)len);
+	if (sc_pkcs11_conf.random_pool_size)
+		rc = get_pooled_random(fw_data, p, (size_t)len);
+	else
+		rc = sc_get_challenge(fw_data->p15_card->card, p, (size_t)len);
 	return sc_to_cryptoki_error(rc, "C_GenerateRandom");
 }
 
 
+static CK_RV
+pkcs15_hold_security_env(struct sc_pkcs11_slot *slot, int hold)
+{
+	struct sc_pkcs11_card *p11card = slot->card;
+	struct pkcs15_fw_data *fw_data = NULL;
+	int rc;
+
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[slot->fw_data_idx];
+	if (!fw_data)
+		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_SignBatch");
+
+	rc = sc_pkcs15_hold_security_env(fw_data->p15_card, hold);
+	return sc_to_cryptoki_error(rc, "C_SignBatch");
+}
+
+
+/* The same private key, by ID, type and size, on the token of the
+ * other slot; keys needing a login for each signature stay on theirs */
+static CK_RV
+pkcs15_find_pool_key(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *key,
+		struct sc_pkcs11_slot *peer, struct sc_pkcs11_object **peer_key)
+{
+	struct pkcs15_prkey_object *prkey = (struct pkcs15_prkey_object *) key;
+	struct pkcs15_fw_data *fw_data;
+	unsigned int i;
+
+	if (key->ops != &pkcs15_prkey_ops || prkey->prv_p15obj->user_consent)
+		return CKR_KEY_FUNCTION_NOT_PERMITTED;
+
+	fw_data = (struct pkcs15_fw_data *) peer->card->fws_data[peer->fw_data_idx];
+	if (!fw_data)
+		return CKR_KEY_HANDLE_INVALID;
+
+	for (i = 0; i < fw_data->num_objects; i++) {
+		struct pkcs15_any_object *obj = fw_data->objects[i];
+		struct pkcs15_prkey_object *other = (struct pkcs15_prkey_object *) obj;
+
+		if (!is_privkey(obj) || obj->p15_object->type != prkey->prv_p15obj->type
+				|| other->prv_p15obj->user_consent
+				|| !sc_pkcs15_compare_id(&other->prv_info->id, &prkey->prv_info->id)
+				|| other->prv_info->modulus_length != prkey->prv_info->modulus_length
+				|| other->prv_info->field_length != prkey->prv_info->field_length)
+			continue;
+		/* of a PIN of the other slot */
+		if (slot_find_object(peer, obj->base.handle) != &obj->base)
+			continue;
+		*peer_key = &obj->base;
+		return CKR_OK;
+	}
+	return CKR_KEY_HANDLE_INVALID;
+}
+
+
 struct sc_pkcs11_framework_ops framework_pkcs15 = {
 	pkcs15_bind,
 	pkcs15_unbind,
@@ -2870,7 +4053,11 @@ struct sc_pkcs11_framework_ops framework_pkcs15 = {
 	NULL,
 	NULL,
 #endif
-	pkcs15_get_random
+	pkcs15_get_random,
+	pkcs15_hold_security_env,
+	pkcs15_resync,
+	pkcs15_find_pool_key,
+	pkcs15_login_shared
 };
 
 
@@ -3128,7 +4315,9 @@ struct sc_pkcs11_object_ops pkcs15_cert_ops = {
 	NULL,	/* unwrap_key */
 	NULL,	/* decrypt */
 	NULL,	/* derive */
-	NULL	/* can_do */
+	NULL,	/* can_do */
+	pkcs15_any_prefetch,
+	pkcs15_any_release_prefetched
 };
 
 /*
@@ -3179,7 +4368,7 @@ pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 		((attr->type == CKA_MODULUS_BITS) && (prkey->prv_p15obj->type == SC_PKCS15_TYPE_PRKEY_EC)) ||
 		(attr->type == CKA_ECDSA_PARAMS)) {
 		/* First see if we have a associated public key */
-		if (prkey->prv_pubkey && prkey->prv_pubkey->pub_data)   {
+		if (prkey->prv_pubkey && check_pubkey_data_read(fw_data, prkey->prv_pubkey) == 0)   {
 			key = prkey->prv_pubkey->pub_data;
 			sc_log(context, "use friend public key data %p", key);
 		}
@@ -3205,10 +4394,11 @@ pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 				else if (is_pubkey(obj)) {
 					struct pkcs15_pubkey_object *pubkey = (struct pkcs15_pubkey_object *) obj;
 
-					if (!pubkey->pub_data)
+					if (!pubkey->pub_info
+							|| !sc_pkcs15_compare_id(&pubkey->pub_info->id, &prkey->prv_info->id))
 						continue;
 
-					if (sc_pkcs15_compare_id(&pubkey->pub_info->id, &prkey->prv_info->id))   {
+					if (check_pubkey_data_read(fw_data, pubkey) == 0)   {
 						prkey->prv_pubkey = pubkey;
 						key = pubkey->pub_data;
 						sc_log(context, "found friend public key %p", key);
@@ -3340,14 +4530,16 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 			CK_ULONG_PTR pulDataLen)
 {
 	struct pkcs15_prkey_object *prkey = (struct pkcs15_prkey_object *) obj;
-	struct sc_pkcs11_card *p11card = session->slot->card;
+	/* the key may be that of another token of the key pool */
+	struct sc_pkcs11_slot *slot = session->sign_slot ? session->sign_slot : session->slot;
+	struct sc_pkcs11_card *p11card = slot->card;
 	struct pkcs15_fw_data *fw_data = NULL;
 	int rv, flags = 0, prkey_has_path = 0;
 	unsigned sign_flags = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_SIGNRECOVER
 			| SC_PKCS15_PRKEY_USAGE_NONREPUDIATION;
 
 	sc_log(context, "Initiating signing operation, mechanism 0x%x.",pMechanism->mechanism);
-	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[slot->fw_data_idx];
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_Sign");
 
@@ -3417,9 +4609,12 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 		return CKR_MECHANISM_INVALID;
 	}
 
+	SC_TRACE_BEGIN(context, "pkcs15_prkey_sign", pMechanism->mechanism);
 	rv = sc_lock(p11card->card);
-	if (rv < 0)
+	if (rv < 0) {
+		SC_TRACE_END(context, "pkcs15_prkey_sign", rv);
 		return sc_to_cryptoki_error(rv, "C_Sign");
+	}
 
 	sc_log(context, "Selected flags %X. Now computing signature for %d bytes. %d bytes reserved.", flags, ulDataLen, *pulDataLen);
 	rv = sc_pkcs15_compute_signature(fw_data->p15_card, prkey->prv_p15obj, flags,
@@ -3437,6 +4632,7 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 	}
 
 	sc_unlock(p11card->card);
+	SC_TRACE_END(context, "pkcs15_prkey_sign", rv);
 
 	sc_log(context, "Sign complete. Result %d.", rv);
 
@@ -3489,9 +4685,12 @@ pkcs15_prkey_decrypt(struct sc_pkcs11_session *session, void *obj,
 		return CKR_MECHANISM_INVALID;
 	}
 
+	SC_TRACE_BEGIN(context, "pkcs15_prkey_decrypt", pMechanism->mechanism);
 	rv = sc_lock(p11card->card);
-	if (rv < 0)
+	if (rv < 0) {
+		SC_TRACE_END(context, "pkcs15_prkey_decrypt", rv);
 		return sc_to_cryptoki_error(rv, "C_Decrypt");
+	}
 
 	rv = sc_pkcs15_decipher(fw_data->p15_card, prkey->prv_p15obj, flags,
 			pEncryptedData, ulEncryptedDataLen, decrypted, sizeof(decrypted));
@@ -3502,6 +4701,7 @@ pkcs15_prkey_decrypt(struct sc_pkcs11_session *session, void *obj,
 					pEncryptedData, ulEncryptedDataLen, decrypted, sizeof(decrypted));
 
 	sc_unlock(p11card->card);
+	SC_TRACE_END(context, "pkcs15_prkey_decrypt", rv);
 
 	sc_log(context, "Decryption complete. Result %d.", rv);
 
@@ -3654,7 +4854,9 @@ struct sc_pkcs11_object_ops pkcs15_prkey_ops = {
 	NULL,	/* unwrap */
 	pkcs15_prkey_decrypt,
         pkcs15_prkey_derive,
-        pkcs15_prkey_can_do
+        pkcs15_prkey_can_do,
+	pkcs15_any_prefetch,
+	pkcs15_any_release_prefetched
 };
 
 /*
@@ -3696,6 +4898,7 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session,
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GetAttributeValue");
 	/* We may need to get these from cert */
 	switch (attr->type) {
+		case CKA_KEY_TYPE:
 		case CKA_MODULUS:
 		case CKA_MODULUS_BITS:
 		case CKA_VALUE:
@@ -3704,7 +4907,7 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session,
 		case CKA_EC_POINT:
 			if (pubkey->pub_data == NULL)
 				/* FIXME: check the return value? */
-				check_cert_data_read(fw_data, cert);
+				check_pubkey_data_read(fw_data, pubkey);
 			break;
 	}
 
@@ -3845,7 +5048,9 @@ struct sc_pkcs11_object_ops pkcs15_pubkey_ops = {
 	NULL,	/* unwrap_key */
 	NULL,	/* decrypt */
 	NULL,	/* derive */
-	NULL	/* can_do */
+	NULL,	/* can_do */
+	pkcs15_any_prefetch,
+	pkcs15_any_release_prefetched
 };
 
 
@@ -3853,7 +5058,16 @@ struct sc_pkcs11_object_ops pkcs15_pubkey_ops = {
 static void
 pkcs15_dobj_release(void *object)
 {
-	__pkcs15_release_object((struct pkcs15_any_object *) object);
+	struct pkcs15_data_object *dobj = (struct pkcs15_data_object *) object;
+	struct sc_pkcs15_data *value = dobj->value;
+	struct sc_pkcs15_data *prefetched = dobj->prefetched;
+
+	if (__pkcs15_release_object((struct pkcs15_any_object *) object) == 0) {
+		if (value)
+			sc_pkcs15_free_data_object(value);
+		if (prefetched)
+			sc_pkcs15_free_data_object(prefetched);
+	}
 }
 
 
@@ -3977,13 +5191,24 @@ pkcs15_dobj_get_attribute(struct sc_pkcs11_session *session, void *object, CK_AT
 		free(buf);
 		break;
 	case CKA_VALUE:
+		/* The content of a public object is read once for the binding */
+		if (dobj->value || dobj->prefetched)   {
+			rv = data_value_to_attr(attr, dobj->value ? dobj->value : dobj->prefetched);
+			if (rv != CKR_OK)
+				return rv;
+			break;
+		}
+		if (attr->pValue == NULL_PTR && dobj->info->data.value)   {
+			attr->ulValueLen = dobj->info->data.len;
+			break;
+		}
 		rv = pkcs15_dobj_get_value(session, dobj, &data);
 		if (rv == CKR_OK)
 			rv = data_value_to_attr(attr, data);
-		if (data) {
-			free(data->data);
-			free(data);
-		}
+		if (data && !(dobj->base.p15_object->flags & SC_PKCS15_CO_FLAG_PRIVATE))
+			dobj->value = data;
+		else if (data)
+			sc_pkcs15_free_data_object(data);
 		if (rv != CKR_OK)
 			return rv;
 		break;
@@ -4005,7 +5230,9 @@ struct sc_pkcs11_object_ops pkcs15_dobj_ops = {
 	NULL,	/* unwrap_key */
 	NULL,	/* decrypt */
 	NULL,	/* derive */
-	NULL	/* can_do */
+	NULL,	/* can_do */
+	pkcs15_any_prefetch,
+	pkcs15_any_release_prefetched
 };
 
 
@@ -4032,10 +5259,15 @@ pkcs15_skey_set_attribute(struct sc_pkcs11_session *session,
 	switch (attr->type) {
 	case CKA_VALUE:
 		if (attr->pValue) {
-			skey->info->data.value = calloc(1,attr->ulValueLen);
-			if (!skey->info->data.value)
+			u8 *value = calloc(1,attr->ulValueLen);
+			if (!value)
 				return CKR_HOST_MEMORY;
-			memcpy(skey->info->data.value, attr->pValue, attr->ulValueLen);
+			memcpy(value, attr->pValue, attr->ulValueLen);
+			if (skey->info->data.value && (skey->skey_flags & SC_PKCS11_OBJECT_SESSION)) {
+				sc_mem_clear(skey->info->data.value, skey->info->data.len);
+				free(skey->info->data.value);
+			}
+			skey->info->data.value = value;
 			skey->info->data.len = attr->ulValueLen;
 		}
 		break;
@@ -4096,9 +5328,8 @@ pkcs15_skey_get_attribute(struct sc_pkcs11_session *session,
 		*(CK_OBJECT_CLASS*)attr->pValue = CKO_SECRET_KEY;
 		break;
 	case CKA_TOKEN:
-		/*TODO DEE change if on card skeys are supported */
 		check_attribute_buffer(attr, sizeof(CK_BBOOL));
-		*(CK_BBOOL*)attr->pValue = FALSE;
+		*(CK_BBOOL*)attr->pValue = skey->on_card;
 		break;
 	case CKA_PRIVATE:
 		check_attribute_buffer(attr, sizeof(CK_BBOOL));
@@ -4142,9 +5373,15 @@ pkcs15_skey_get_attribute(struct sc_pkcs11_session *session,
 		break;
 	case CKA_VALUE_LEN:
 		check_attribute_buffer(attr, sizeof(CK_ULONG));
-		*(CK_ULONG*)attr->pValue = skey->info->data.len;
+		if (skey->on_card)
+			*(CK_ULONG*)attr->pValue = skey->info->value_len / 8;
+		else
+			*(CK_ULONG*)attr->pValue = skey->info->data.len;
 		break;
 	case CKA_VALUE:
+		/* the card does not give it out */
+		if (skey->on_card)
+			return CKR_ATTRIBUTE_SENSITIVE;
 		check_attribute_buffer(attr, skey->info->data.len);
 		memcpy(attr->pValue, skey->info->data.value, skey->info->data.len);
 		break;
@@ -4156,8 +5393,79 @@ pkcs15_skey_get_attribute(struct sc_pkcs11_session *session,
 }
 
 
+static CK_RV
+pkcs15_skey_crypt(struct sc_pkcs11_session *session, void *obj, int encrypt,
+		CK_MECHANISM_PTR pMechanism,
+		CK_BYTE_PTR pIn, CK_ULONG ulInLen,
+		CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	struct sc_pkcs11_card *p11card = session->slot->card;
+	struct pkcs15_fw_data *fw_data = NULL;
+	struct pkcs15_skey_object *skey = (struct pkcs15_skey_object *) obj;
+	int rv;
+
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
+	if (!fw_data)
+		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, encrypt ? "C_Encrypt" : "C_Decrypt");
+
+	/* session keys are only kept for C_DeriveKey() */
+	if (!skey->on_card || !skey->info->native)
+		return CKR_KEY_FUNCTION_NOT_PERMITTED;
+
+	switch (pMechanism->mechanism) {
+	case CKM_AES_ECB:
+	case CKM_DES3_ECB:
+		break;
+	default:
+		return CKR_MECHANISM_INVALID;
+	}
+
+	if (*pulOutLen < ulInLen)
+		return CKR_BUFFER_TOO_SMALL;
+
+	rv = sc_lock(p11card->card);
+	if (rv < 0)
+		return sc_to_cryptoki_error(rv, encrypt ? "C_Encrypt" : "C_Decrypt");
+	if (encrypt)
+		rv = sc_pkcs15_encrypt_sym(fw_data->p15_card, skey->skey_p15obj,
+				pIn, ulInLen, pOut, *pulOutLen);
+	else
+		rv = sc_pkcs15_decrypt_sym(fw_data->p15_card, skey->skey_p15obj,
+				pIn, ulInLen, pOut, *pulOutLen);
+	sc_unlock(p11card->card);
+
+	if (rv < 0)
+		return sc_to_cryptoki_error(rv, encrypt ? "C_Encrypt" : "C_Decrypt");
+	*pulOutLen = rv;
+	return CKR_OK;
+}
+
+
+static CK_RV
+pkcs15_skey_encrypt(struct sc_pkcs11_session *session, void *obj,
+		CK_MECHANISM_PTR pMechanism,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	return pkcs15_skey_crypt(session, obj, 1, pMechanism, pData, ulDataLen,
+			pEncryptedData, pulEncryptedDataLen);
+}
+
+
+static CK_RV
+pkcs15_skey_decrypt(struct sc_pkcs11_session *session, void *obj,
+		CK_MECHANISM_PTR pMechanism,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen,
+		CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	return pkcs15_skey_crypt(session, obj, 0, pMechanism, pEncryptedData, ulEncryptedDataLen,
+			pData, pulDataLen);
+}
+
+
 /*
- *  Secret key objects, currently used only to retrieve derived session key
+ *  Secret key objects: derived session keys, and keys of the card that
+ *  encrypt and decrypt on the card
  */
 struct sc_pkcs11_object_ops pkcs15_skey_ops = {
 	pkcs15_skey_release,
@@ -4168,9 +5476,12 @@ struct sc_pkcs11_object_ops pkcs15_skey_ops = {
 	NULL,	/* get_size */
 	NULL,	/* sign */
 	NULL,	/* unwrap_key */
-	NULL,	/* decrypt */
+	pkcs15_skey_decrypt,
 	NULL,	/* derive */
-	NULL	/* can_do */
+	NULL,	/* can_do */
+	NULL,	/* prefetch_attributes */
+	NULL,	/* release_prefetched */
+	pkcs15_skey_encrypt
 };
 
 /*
@@ -4471,13 +5782,124 @@ static int register_ec_mechanisms(struct sc_pkcs11_card *p11card, int flags,
 	return CKR_OK;
 }
 
+#define SYM_MECH_AES	0x01
+#define SYM_MECH_DES3	0x02
+
+/* The block ciphers the card declares, and those of the native secret keys
+ * it has */
+static unsigned int
+sym_mechanisms_wanted(struct sc_pkcs11_card *p11card)
+{
+	sc_card_t *card = p11card->card;
+	struct sc_pkcs15_search_key sk;
+	struct sc_pkcs15_object_iter it;
+	struct sc_pkcs15_object *obj;
+	unsigned int sym = 0;
+	int i;
+
+	for (i = 0; i < card->algorithm_count; i++) {
+		if (card->algorithms[i].algorithm == SC_ALGORITHM_AES)
+			sym |= SYM_MECH_AES;
+		else if (card->algorithms[i].algorithm == SC_ALGORITHM_3DES)
+			sym |= SYM_MECH_DES3;
+	}
+	for (i = 0; i < SC_PKCS11_FRAMEWORK_DATA_MAX_NUM; i++) {
+		struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) p11card->fws_data[i];
+
+		if (fw_data == NULL || fw_data->p15_card == NULL)
+			continue;
+		memset(&sk, 0, sizeof(sk));
+		sk.type = SC_PKCS15_TYPE_SKEY;
+		if (sc_pkcs15_iter_init(fw_data->p15_card, &it, &sk) < 0)
+			continue;
+		while ((obj = sc_pkcs15_iter_next(&it)) != NULL) {
+			struct sc_pkcs15_skey_info *info = (struct sc_pkcs15_skey_info *) obj->data;
+
+			if (!info->native)
+				continue;
+			if (obj->type == SC_PKCS15_TYPE_SKEY_3DES)
+				sym |= SYM_MECH_DES3;
+			else if (obj->type == SC_PKCS15_TYPE_SKEY_GENERIC
+					&& (info->value_len == 128 || info->value_len == 192
+						|| info->value_len == 256))
+				sym |= SYM_MECH_AES;
+		}
+	}
+	return sym;
+}
+
+
+/* ECB, whole blocks, done on the card */
+static CK_RV
+register_sym_mechanisms(struct sc_pkcs11_card *p11card, unsigned int sym)
+{
+	CK_MECHANISM_INFO mech_info;
+	sc_pkcs11_mechanism_type_t *mt;
+	CK_RV rc;
+
+	mech_info.flags = CKF_HW | CKF_ENCRYPT | CKF_DECRYPT;
+	if (sym & SYM_MECH_AES) {
+		mech_info.ulMinKeySize = 16;
+		mech_info.ulMaxKeySize = 32;
+		mt = sc_pkcs11_new_fw_mechanism(CKM_AES_ECB, &mech_info, CKK_AES, NULL);
+		rc = sc_pkcs11_register_mechanism(p11card, mt);
+		if (rc != CKR_OK)
+			return rc;
+	}
+	if (sym & SYM_MECH_DES3) {
+		mech_info.ulMinKeySize = 24;
+		mech_info.ulMaxKeySize = 24;
+		mt = sc_pkcs11_new_fw_mechanism(CKM_DES3_ECB, &mech_info, CKK_DES3, NULL);
+		rc = sc_pkcs11_register_mechanism(p11card, mt);
+		if (rc != CKR_OK)
+			return rc;
+	}
+	return CKR_OK;
+}
+
+
+/* What the mechanisms of a card are computed from: its driver, its
+ * algorithms and the block ciphers of its keys */
+static u8 *
+mechanism_cache_key(struct sc_pkcs11_card *p11card, unsigned int sym, size_t *keylen)
+{
+	sc_card_t *card = p11card->card;
+	const char *driver = card->driver ? card->driver->short_name : "";
+	size_t len, off;
+	u8 *key;
+	int i;
+
+	len = strlen(driver) + 1;
+	off = len;
+	len += sizeof(sym) + card->algorithm_count * 4 * sizeof(unsigned long);
+	if (!(key = calloc(1, len)))
+		return NULL;
+	memcpy(key, driver, off);
+	memcpy(key + off, &sym, sizeof(sym));
+	off += sizeof(sym);
+	for (i = 0; i < card->algorithm_count; i++) {
+		const sc_algorithm_info_t *alg = &card->algorithms[i];
+		unsigned long v[4];
+
+		v[0] = alg->algorithm;
+		v[1] = alg->key_length;
+		v[2] = alg->flags;
+		v[3] = alg->algorithm == SC_ALGORITHM_EC ? alg->u._ec.ext_flags : 0;
+		memcpy(key + off, v, sizeof(v));
+		off += sizeof(v);
+	}
+	*keylen = len;
+	return key;
+}
+
+
 /*
  * Mechanism handling
  * FIXME: We should consult the card's algorithm list to
  * find out what operations it supports
  */
 static CK_RV
-register_mechanisms(struct sc_pkcs11_card *p11card)
+register_card_mechanisms(struct sc_pkcs11_card *p11card, unsigned int sym)
 {
 	sc_card_t *card = p11card->card;
 	sc_algorithm_info_t *alg_info;
@@ -4488,9 +5910,6 @@ register_mechanisms(struct sc_pkcs11_card *p11card)
 	unsigned int num;
 	int rc, flags = 0;
 
-	/* Register generic mechanisms */
-	sc_pkcs11_register_generic_mechanisms(p11card);
-
 	mech_info.flags = CKF_HW | CKF_SIGN | CKF_DECRYPT;
 #ifdef ENABLE_OPENSSL
 	/* That practise definitely conflicts with CKF_HW -- andre 2010-11-28 */
@@ -4541,6 +5960,10 @@ register_mechanisms(struct sc_pkcs11_card *p11card)
 	if (flags & SC_ALGORITHM_ECDSA_RAW)
 		rc = register_ec_mechanisms(p11card, flags, ec_ext_flags, ec_min_key_size, ec_max_key_size);
 
+	rc = register_sym_mechanisms(p11card, sym);
+	if (rc != CKR_OK)
+		return rc;
+
 	if (flags & (SC_ALGORITHM_GOSTR3410_RAW
 				| SC_ALGORITHM_GOSTR3410_HASH_NONE
 				| SC_ALGORITHM_GOSTR3410_HASH_GOSTR3411)) {
@@ -4623,6 +6046,35 @@ register_mechanisms(struct sc_pkcs11_card *p11card)
 }
 
 
+/* Cards of one kind get the same mechanisms: the table computed for the
+ * first one is kept and given to the next ones */
+static CK_RV
+register_mechanisms(struct sc_pkcs11_card *p11card)
+{
+	unsigned int sym, first;
+	size_t keylen = 0;
+	u8 *key;
+	CK_RV rv;
+
+	/* Register generic mechanisms */
+	sc_pkcs11_register_generic_mechanisms(p11card);
+
+	sym = sym_mechanisms_wanted(p11card);
+	key = mechanism_cache_key(p11card, sym, &keylen);
+	if (key && sc_pkcs11_register_cached_mechanisms(p11card, key, keylen)) {
+		free(key);
+		return CKR_OK;
+	}
+
+	first = p11card->nmechanisms;
+	rv = register_card_mechanisms(p11card, sym);
+	if (rv == CKR_OK && key)
+		sc_pkcs11_cache_mechanisms(p11card, first, key, keylen);
+	free(key);
+	return rv;
+}
+
+
 static int
 lock_card(struct pkcs15_fw_data *fw_data)
 {
@@ -180,7 +180,11 @@ struct sc_pkcs11_framework_ops framework_pkcs15init = {
 	NULL, /* init_pin */
 	NULL, /* create_object */
 	NULL, /* gen_keypair */
-	NULL  /* get_random */
+	NULL, /* get_random */
+	NULL, /* hold_security_env */
+	NULL, /* resync */
+	NULL, /* find_pool_key */
+	NULL  /* login_shared */
 };
 
 #else /* ifdef USE_PKCS15_INIT */
@@ -197,7 +201,11 @@ struct sc_pkcs11_framework_ops framework_pkcs15init = {
 	NULL,	/* init_pin */
 	NULL,	/* create_object */
 	NULL,	/* gen_keypair */
-	NULL	/* get_random */
+	NULL,	/* get_random */
+	NULL,	/* hold_security_env */
+	NULL,	/* resync */
+	NULL,	/* find_pool_key */
+	NULL	/* login_shared */
 };
 
 #endif
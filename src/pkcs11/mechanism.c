@@ -29,6 +29,8 @@ struct signature_data {
 	unsigned int		buffer_len;
 };
 
+static CK_RV sc_pkcs11_signature_init(sc_pkcs11_operation_t *, struct sc_pkcs11_object *);
+
 /*
  * Register a mechanism
  */
@@ -48,6 +50,50 @@ sc_pkcs11_register_mechanism(struct sc_pkcs11_card *p11card,
 	p11card->mechanisms = p;
 	p[p11card->nmechanisms++] = mt;
 	p[p11card->nmechanisms] = NULL;
+
+	/* rebuilt by the next lookup */
+	free(p11card->mech_index);
+	p11card->mech_index = NULL;
+	return CKR_OK;
+}
+
+static unsigned int
+mechanism_hash(CK_MECHANISM_TYPE mech)
+{
+	unsigned long h = (unsigned long) mech;
+
+	/* vendor mechanisms differ in the high bits */
+	h ^= h >> 16;
+	return (unsigned int) (h * 0x9E3779B1UL);
+}
+
+/*
+ * Build the hash of the registered mechanisms. The entries are inserted
+ * in the order of registration, so with linear probing the entries of
+ * the same type are found in that order, as in the list.
+ */
+static CK_RV
+build_mechanism_index(struct sc_pkcs11_card *p11card)
+{
+	unsigned int n, h, size = 8;
+
+	while (size < 2 * p11card->nmechanisms)
+		size <<= 1;
+	p11card->mech_index = calloc(size, sizeof(*p11card->mech_index));
+	if (p11card->mech_index == NULL)
+		return CKR_HOST_MEMORY;
+	p11card->mech_index_mask = size - 1;
+
+	for (n = 0; n < p11card->nmechanisms; n++) {
+		sc_pkcs11_mechanism_type_t *mt = p11card->mechanisms[n];
+
+		if (mt == NULL)
+			continue;
+		h = mechanism_hash(mt->mech) & p11card->mech_index_mask;
+		while (p11card->mech_index[h] != NULL)
+			h = (h + 1) & p11card->mech_index_mask;
+		p11card->mech_index[h] = mt;
+	}
 	return CKR_OK;
 }
 
@@ -60,14 +106,132 @@ sc_pkcs11_find_mechanism(struct sc_pkcs11_card *p11card, CK_MECHANISM_TYPE mech,
 	sc_pkcs11_mechanism_type_t *mt;
 	unsigned int n;
 
-	for (n = 0; n < p11card->nmechanisms; n++) {
-		mt = p11card->mechanisms[n];
-		if (mt && mt->mech == mech && ((mt->mech_info.flags & flags) == flags))
+	if (p11card->mech_index == NULL && p11card->nmechanisms
+			&& build_mechanism_index(p11card) != CKR_OK) {
+		/* out of memory: scan the list */
+		for (n = 0; n < p11card->nmechanisms; n++) {
+			mt = p11card->mechanisms[n];
+			if (mt && mt->mech == mech && ((mt->mech_info.flags & flags) == flags))
+				return mt;
+		}
+		return NULL;
+	}
+	if (p11card->mech_index == NULL)
+		return NULL;
+
+	n = mechanism_hash(mech) & p11card->mech_index_mask;
+	while ((mt = p11card->mech_index[n]) != NULL) {
+		if (mt->mech == mech && ((mt->mech_info.flags & flags) == flags))
 			return mt;
+		n = (n + 1) & p11card->mech_index_mask;
 	}
 	return NULL;
 }
 
+/*
+ * Mechanism tables kept by the framework for the cards of one kind, see
+ * sc_pkcs11_cache_mechanisms(). They live until C_Finalize() and are
+ * used under the global lock.
+ */
+struct mechanism_cache {
+	struct mechanism_cache *next;
+	u8 *key;
+	size_t keylen;
+	sc_pkcs11_mechanism_type_t **mechanisms;
+	unsigned int nmechanisms;
+};
+
+static struct mechanism_cache *mechanism_cache = NULL;
+
+/*
+ * Registers the table kept for <key>, unless the card has it already, as
+ * for another application of the card. Returns 0 if there is none.
+ */
+int
+sc_pkcs11_register_cached_mechanisms(struct sc_pkcs11_card *p11card,
+		const u8 *key, size_t keylen)
+{
+	struct mechanism_cache *c;
+	sc_pkcs11_mechanism_type_t **p;
+	unsigned int n;
+
+	for (c = mechanism_cache; c != NULL; c = c->next)
+		if (c->keylen == keylen && memcmp(c->key, key, keylen) == 0)
+			break;
+	if (c == NULL)
+		return 0;
+
+	if (c->nmechanisms == 0)
+		return 1;
+	for (n = 0; n < p11card->nmechanisms; n++)
+		if (p11card->mechanisms[n] == c->mechanisms[0])
+			return 1;
+
+	p = (sc_pkcs11_mechanism_type_t **) realloc(p11card->mechanisms,
+			(p11card->nmechanisms + c->nmechanisms + 1) * sizeof(*p));
+	if (p == NULL)
+		return 0;
+	memcpy(p + p11card->nmechanisms, c->mechanisms, c->nmechanisms * sizeof(*p));
+	p11card->mechanisms = p;
+	p11card->nmechanisms += c->nmechanisms;
+	p[p11card->nmechanisms] = NULL;
+
+	free(p11card->mech_index);
+	p11card->mech_index = NULL;
+	return 1;
+}
+
+/*
+ * Keeps the mechanisms registered from <first> on for the next card with
+ * the same <key>. They are shared from then on and only freed by
+ * sc_pkcs11_free_mechanism_cache().
+ */
+void
+sc_pkcs11_cache_mechanisms(struct sc_pkcs11_card *p11card, unsigned int first,
+		const u8 *key, size_t keylen)
+{
+	struct mechanism_cache *c;
+	unsigned int n = p11card->nmechanisms - first;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return;
+	c->key = malloc(keylen);
+	c->mechanisms = calloc(n ? n : 1, sizeof(*c->mechanisms));
+	if (c->key == NULL || c->mechanisms == NULL) {
+		free(c->key);
+		free(c->mechanisms);
+		free(c);
+		return;
+	}
+	memcpy(c->key, key, keylen);
+	c->keylen = keylen;
+	memcpy(c->mechanisms, p11card->mechanisms + first, n * sizeof(*c->mechanisms));
+	c->nmechanisms = n;
+	c->next = mechanism_cache;
+	mechanism_cache = c;
+}
+
+void
+sc_pkcs11_free_mechanism_cache(void)
+{
+	struct mechanism_cache *c;
+	unsigned int n;
+
+	while ((c = mechanism_cache) != NULL) {
+		mechanism_cache = c->next;
+		/* all from sc_pkcs11_new_fw_mechanism(), the data of the
+		 * sign+hash ones too */
+		for (n = 0; n < c->nmechanisms; n++) {
+			free((void *) c->mechanisms[n]->mech_data);
+			free(c->mechanisms[n]);
+		}
+		free(c->mechanisms);
+		free(c->key);
+		free(c);
+	}
+}
+
 /*
  * Query mechanisms.
  * All of this is greatly simplified by having the framework
@@ -120,7 +284,7 @@ sc_pkcs11_new_operation(sc_pkcs11_session_t *session,
 {
 	sc_pkcs11_operation_t *res;
 
-	res = calloc(1, type->obj_size);
+	res = session_alloc(session, type->obj_size);
 	if (res) {
 		res->session = session;
 		res->type = type;
@@ -132,13 +296,19 @@ void
 sc_pkcs11_release_operation(sc_pkcs11_operation_t **ptr)
 {
 	sc_pkcs11_operation_t *operation = *ptr;
+	sc_pkcs11_session_t *session = NULL;
+	size_t size = 0;
 
 	if (!operation)
 		return;
-	if (operation->type && operation->type->release)
-		operation->type->release(operation);
+	if (operation->type) {
+		if (operation->type->release)
+			operation->type->release(operation);
+		session = operation->session;
+		size = operation->type->obj_size;
+	}
 	memset(operation, 0, sizeof(*operation));
-	free(operation);
+	session_free(session, operation, size);
 	*ptr = NULL;
 }
 
@@ -309,6 +479,134 @@ done:
 	LOG_FUNC_RETURN(context, rv);
 }
 
+/*
+ * Sign each of the inputs as with C_Sign() using the mechanism and key
+ * of the active operation; the framework keeps the security environment
+ * of the card set between them. Ends the operation.
+ */
+CK_RV
+sc_pkcs11_sign_batch(struct sc_pkcs11_session *session, CK_ULONG ulCount,
+		CK_BYTE_PTR *pData, CK_ULONG_PTR pulDataLen,
+		CK_BYTE_PTR *pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	struct sc_pkcs11_framework_ops *framework = session->slot->card->framework;
+	struct sc_pkcs11_object *key;
+	sc_pkcs11_operation_t *op;
+	CK_ULONG i;
+	int held = 0;
+	int rv;
+
+	LOG_FUNC_CALLED(context);
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_SIGN, &op);
+	if (rv != CKR_OK)
+		LOG_FUNC_RETURN(context, rv);
+
+	if (op->type->sign_init != sc_pkcs11_signature_init
+			|| op->type->sign_update == NULL || op->type->sign_final == NULL) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto done;
+	}
+	key = ((struct signature_data *) op->priv_data)->key;
+
+	if (framework->hold_security_env)
+		held = framework->hold_security_env(session->slot, 1) == CKR_OK;
+
+	for (i = 0; i < ulCount; i++) {
+		if (i > 0) {
+			/* Start over for the next input */
+			op->type->release(op);
+			op->priv_data = NULL;
+			rv = op->type->sign_init(op, key);
+			if (rv != CKR_OK)
+				break;
+		}
+		rv = op->type->sign_update(op, pData[i], pulDataLen[i]);
+		if (rv == CKR_OK)
+			rv = op->type->sign_final(op, pSignature[i], &pulSignatureLen[i]);
+		if (rv != CKR_OK)
+			break;
+	}
+
+	if (held)
+		framework->hold_security_env(session->slot, 0);
+
+done:
+	session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
+	LOG_FUNC_RETURN(context, rv);
+}
+
+/*
+ * C_Sign() with the key pool, see slot_pool_pick(). Called with the lock
+ * of the session's slot held, which it gives up: while the signature is
+ * made on the token of another slot, the session's own token is free for
+ * the next signer.
+ */
+CK_RV
+sc_pkcs11_sign_pooled(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	struct sc_pkcs11_slot *slot = session->slot, *pool_slot = slot;
+	struct sc_pkcs11_object *pool_key = NULL;
+	struct signature_data *data = NULL;
+	sc_pkcs11_operation_t *op;
+	CK_OBJECT_HANDLE handle = 0;
+	unsigned int generation = 0;
+	int picked = 0;
+	CK_RV rv;
+
+	LOG_FUNC_CALLED(context);
+	if (session_get_operation(session, SC_PKCS11_OPERATION_SIGN, &op) == CKR_OK
+			&& op->type->sign_init == sc_pkcs11_signature_init) {
+		data = (struct signature_data *) op->priv_data;
+		picked = slot_pool_pick(session, data->key, &pool_slot, &handle, &generation) == CKR_OK;
+	}
+
+	if (pool_slot != slot) {
+		sc_pkcs11_unlock_slot(slot);
+		sc_pkcs11_lock_slot(pool_slot);
+		/* the key stays if the token did */
+		rv = sc_pkcs11_lock();
+		if (rv == CKR_OK) {
+			if (pool_slot->card && pool_slot->objects_generation == generation)
+				pool_key = slot_find_object(pool_slot, handle);
+			sc_pkcs11_unlock();
+		}
+		if (pool_key == NULL) {
+			/* back to the session's own token */
+			sc_pkcs11_unlock_slot(pool_slot);
+			sc_pkcs11_lock_slot(slot);
+			rv = sc_pkcs11_lock();
+			if (rv == CKR_OK) {
+				if (session->handle == CK_INVALID_HANDLE)
+					rv = CKR_SESSION_CLOSED;
+				sc_pkcs11_unlock();
+			}
+		}
+		else {
+			data->key = pool_key;
+			session->sign_slot = pool_slot;
+		}
+	}
+	else {
+		rv = CKR_OK;
+	}
+
+	if (rv == CKR_OK) {
+		rv = sc_pkcs11_sign_update(session, pData, ulDataLen);
+		if (rv == CKR_OK)
+			rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
+	}
+	session->sign_slot = NULL;
+
+	sc_pkcs11_unlock_slot(pool_key ? pool_slot : slot);
+	if (picked)
+		slot_pool_leave(pool_slot);
+	if (pool_slot != slot)
+		sc_pkcs11_release_session(session);
+	LOG_FUNC_RETURN(context, rv);
+}
+
 CK_RV
 sc_pkcs11_sign_size(struct sc_pkcs11_session *session, CK_ULONG_PTR pLength)
 {
@@ -334,6 +632,214 @@ done:
 	LOG_FUNC_RETURN(context, rv);
 }
 
+/*
+ * Operation state, see C_GetOperationState(). Only what is still on the
+ * host is saved: digests, and signatures that did not reach the card yet.
+ * The state is a version byte, then for each operation the operation type
+ * (one byte), the mechanism and the length of the rest (4 bytes each, big
+ * endian) and the rest: for a digest the state of the digest, for a
+ * signature 1 and the state of its digest, or 0 and the data collected.
+ */
+#define SC_PKCS11_STATE_VERSION	1
+#define SC_PKCS11_STATE_HEADER	9
+
+static CK_RV
+save_digest(sc_pkcs11_operation_t *md, CK_BYTE_PTR pState, CK_ULONG_PTR pulStateLen)
+{
+	if (md->type->md_get_state == NULL)
+		return CKR_STATE_UNSAVEABLE;
+	return md->type->md_get_state(md, pState, pulStateLen);
+}
+
+/* Without pState only the length is given back */
+static CK_RV
+save_operation(sc_pkcs11_operation_t *op, int type, CK_BYTE_PTR pState, CK_ULONG_PTR pulStateLen)
+{
+	struct signature_data *data;
+	CK_ULONG len;
+	CK_RV rv;
+
+	if (op->mechanism.pParameter != NULL || op->mechanism.ulParameterLen != 0)
+		return CKR_STATE_UNSAVEABLE;
+	if (type == SC_PKCS11_OPERATION_DIGEST)
+		return save_digest(op, pState, pulStateLen);
+	if (type != SC_PKCS11_OPERATION_SIGN || op->type->sign_init != sc_pkcs11_signature_init)
+		return CKR_STATE_UNSAVEABLE;
+
+	data = (struct signature_data *) op->priv_data;
+	if (data->md) {
+		len = pState ? *pulStateLen - 1 : 0;
+		rv = save_digest(data->md, pState ? pState + 1 : NULL, &len);
+		if (rv != CKR_OK)
+			return rv;
+	} else {
+		len = data->buffer_len;
+		if (pState)
+			memcpy(pState + 1, data->buffer, len);
+	}
+	if (pState)
+		pState[0] = data->md != NULL;
+	*pulStateLen = 1 + len;
+	return CKR_OK;
+}
+
+static void
+put_u32(CK_BYTE_PTR p, CK_ULONG value)
+{
+	p[0] = (value >> 24) & 0xFF;
+	p[1] = (value >> 16) & 0xFF;
+	p[2] = (value >> 8) & 0xFF;
+	p[3] = value & 0xFF;
+}
+
+static CK_ULONG
+get_u32(const CK_BYTE *p)
+{
+	return (CK_ULONG) p[0] << 24 | (CK_ULONG) p[1] << 16 | (CK_ULONG) p[2] << 8 | p[3];
+}
+
+CK_RV
+sc_pkcs11_get_operation_state(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pState, CK_ULONG_PTR pulStateLen)
+{
+	sc_pkcs11_operation_t *op;
+	CK_ULONG total = 1, len;
+	int i, count = 0;
+	CK_RV rv;
+
+	LOG_FUNC_CALLED(context);
+	/* the length first, and whether all of it can be saved */
+	for (i = 0; i < SC_PKCS11_OPERATION_MAX; i++) {
+		if (i == SC_PKCS11_OPERATION_FIND || !(op = session->operation[i]))
+			continue;
+		rv = save_operation(op, i, NULL, &len);
+		if (rv != CKR_OK)
+			LOG_FUNC_RETURN(context, rv);
+		total += SC_PKCS11_STATE_HEADER + len;
+		count++;
+	}
+	if (count == 0)
+		LOG_FUNC_RETURN(context, CKR_OPERATION_NOT_INITIALIZED);
+
+	if (pState == NULL) {
+		*pulStateLen = total;
+		LOG_FUNC_RETURN(context, CKR_OK);
+	}
+	if (*pulStateLen < total) {
+		*pulStateLen = total;
+		LOG_FUNC_RETURN(context, CKR_BUFFER_TOO_SMALL);
+	}
+
+	total = 0;
+	pState[total++] = SC_PKCS11_STATE_VERSION;
+	for (i = 0; i < SC_PKCS11_OPERATION_MAX; i++) {
+		if (i == SC_PKCS11_OPERATION_FIND || !(op = session->operation[i]))
+			continue;
+		len = *pulStateLen - total - SC_PKCS11_STATE_HEADER;
+		rv = save_operation(op, i, pState + total + SC_PKCS11_STATE_HEADER, &len);
+		if (rv != CKR_OK)
+			LOG_FUNC_RETURN(context, rv);
+		pState[total] = i;
+		put_u32(pState + total + 1, op->mechanism.mechanism);
+		put_u32(pState + total + 5, len);
+		total += SC_PKCS11_STATE_HEADER + len;
+	}
+	*pulStateLen = total;
+	LOG_FUNC_RETURN(context, CKR_OK);
+}
+
+static CK_RV
+restore_operation(struct sc_pkcs11_session *session, int type, CK_MECHANISM_PTR pMechanism,
+		CK_BYTE_PTR pState, CK_ULONG ulStateLen,
+		struct sc_pkcs11_object *key, CK_KEY_TYPE key_type)
+{
+	struct signature_data *data;
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	if (type == SC_PKCS11_OPERATION_DIGEST) {
+		rv = sc_pkcs11_md_init(session, pMechanism);
+		if (rv != CKR_OK)
+			return rv;
+		op = session->operation[type];
+		if (op->type->md_set_state == NULL)
+			return CKR_SAVED_STATE_INVALID;
+		return op->type->md_set_state(op, pState, ulStateLen);
+	}
+
+	rv = sc_pkcs11_sign_init(session, pMechanism, key, key_type);
+	if (rv != CKR_OK)
+		return rv;
+	op = session->operation[type];
+	if (op->type->sign_init != sc_pkcs11_signature_init || ulStateLen < 1)
+		return CKR_SAVED_STATE_INVALID;
+	data = (struct signature_data *) op->priv_data;
+	/* the key must hash the same way as the one the state was saved with */
+	if (pState[0] != (data->md != NULL))
+		return CKR_SAVED_STATE_INVALID;
+	if (data->md) {
+		if (data->md->type->md_set_state == NULL)
+			return CKR_SAVED_STATE_INVALID;
+		return data->md->type->md_set_state(data->md, pState + 1, ulStateLen - 1);
+	}
+	if (ulStateLen - 1 > sizeof(data->buffer))
+		return CKR_SAVED_STATE_INVALID;
+	memcpy(data->buffer, pState + 1, ulStateLen - 1);
+	data->buffer_len = ulStateLen - 1;
+	return CKR_OK;
+}
+
+/* Replaces the digest and signature operations of the session with the
+ * saved ones, the key of a signature is given again */
+CK_RV
+sc_pkcs11_set_operation_state(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pState, CK_ULONG ulStateLen,
+		struct sc_pkcs11_object *key, CK_KEY_TYPE key_type)
+{
+	CK_MECHANISM mech = { 0, NULL_PTR, 0 };
+	CK_ULONG pos, len;
+	int type, seen = 0;
+	CK_RV rv = CKR_OK;
+
+	LOG_FUNC_CALLED(context);
+	if (ulStateLen < 1 || pState[0] != SC_PKCS11_STATE_VERSION)
+		LOG_FUNC_RETURN(context, CKR_SAVED_STATE_INVALID);
+	for (pos = 1; pos < ulStateLen; pos += SC_PKCS11_STATE_HEADER + len) {
+		if (ulStateLen - pos < SC_PKCS11_STATE_HEADER)
+			LOG_FUNC_RETURN(context, CKR_SAVED_STATE_INVALID);
+		type = pState[pos];
+		len = get_u32(pState + pos + 5);
+		if ((type != SC_PKCS11_OPERATION_DIGEST && type != SC_PKCS11_OPERATION_SIGN)
+				|| (seen & (1 << type))
+				|| len > ulStateLen - pos - SC_PKCS11_STATE_HEADER)
+			LOG_FUNC_RETURN(context, CKR_SAVED_STATE_INVALID);
+		seen |= 1 << type;
+	}
+	if ((seen & (1 << SC_PKCS11_OPERATION_SIGN)) && key == NULL)
+		LOG_FUNC_RETURN(context, CKR_KEY_NEEDED);
+	if (!(seen & (1 << SC_PKCS11_OPERATION_SIGN)) && key != NULL)
+		LOG_FUNC_RETURN(context, CKR_KEY_NOT_NEEDED);
+
+	session_stop_operation(session, SC_PKCS11_OPERATION_DIGEST);
+	session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
+	for (pos = 1; pos < ulStateLen && rv == CKR_OK; pos += SC_PKCS11_STATE_HEADER + len) {
+		type = pState[pos];
+		mech.mechanism = get_u32(pState + pos + 1);
+		len = get_u32(pState + pos + 5);
+		rv = restore_operation(session, type, &mech, pState + pos + SC_PKCS11_STATE_HEADER, len,
+				key, key_type);
+		if (rv == CKR_MECHANISM_INVALID)
+			rv = CKR_SAVED_STATE_INVALID;
+		else if (rv == CKR_KEY_TYPE_INCONSISTENT)
+			rv = CKR_KEY_CHANGED;
+	}
+	if (rv != CKR_OK) {
+		session_stop_operation(session, SC_PKCS11_OPERATION_DIGEST);
+		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
+	}
+	LOG_FUNC_RETURN(context, rv);
+}
+
 /*
  * Initialize a signature operation
  */
@@ -347,7 +853,7 @@ sc_pkcs11_signature_init(sc_pkcs11_operation_t *operation,
 	int can_do_it = 0;
 
 	LOG_FUNC_CALLED(context);
-	if (!(data = calloc(1, sizeof(*data))))
+	if (!(data = session_alloc(operation->session, sizeof(*data))))
 		LOG_FUNC_RETURN(context, CKR_HOST_MEMORY);
 	data->info = NULL;
 	data->key = key;
@@ -364,7 +870,7 @@ sc_pkcs11_signature_init(sc_pkcs11_operation_t *operation,
 		}
 		else  {
 			/* Mechanism recognised but cannot be performed by pkcs#15 card, or some general error. */
-			free(data);
+			session_free(operation->session, data, sizeof(*data));
 			LOG_FUNC_RETURN(context, rv);
 		}
 	}
@@ -383,7 +889,7 @@ sc_pkcs11_signature_init(sc_pkcs11_operation_t *operation,
 			rv = info->hash_type->md_init(data->md);
 		if (rv != CKR_OK) {
 			sc_pkcs11_release_operation(&data->md);
-			free(data);
+			session_free(operation->session, data, sizeof(*data));
 			LOG_FUNC_RETURN(context, rv);
 		}
 		data->info = info;
@@ -403,7 +909,11 @@ sc_pkcs11_signature_update(sc_pkcs11_operation_t *operation,
 	sc_log(context, "data part length %li", ulPartLen);
 	data = (struct signature_data *) operation->priv_data;
 	if (data->md) {
-		CK_RV rv = data->md->type->md_update(data->md, pPart, ulPartLen);
+		CK_RV rv;
+
+		SC_TRACE_BEGIN(context, "digest", ulPartLen);
+		rv = data->md->type->md_update(data->md, pPart, ulPartLen);
+		SC_TRACE_END(context, "digest", rv);
 		LOG_FUNC_RETURN(context, rv);
 	}
 
@@ -430,7 +940,9 @@ sc_pkcs11_signature_final(sc_pkcs11_operation_t *operation,
 		sc_pkcs11_operation_t	*md = data->md;
 		CK_ULONG len = sizeof(data->buffer);
 
+		SC_TRACE_BEGIN(context, "digest final", len);
 		rv = md->type->md_final(md, data->buffer, &len);
+		SC_TRACE_END(context, "digest final", rv);
 		if (rv == CKR_BUFFER_TOO_SMALL)
 			rv = CKR_FUNCTION_FAILED;
 		if (rv != CKR_OK)
@@ -497,7 +1009,7 @@ sc_pkcs11_signature_release(sc_pkcs11_operation_t *operation)
 	    return;
 	sc_pkcs11_release_operation(&data->md);
 	memset(data, 0, sizeof(*data));
-	free(data);
+	session_free(operation->session, data, sizeof(*data));
 }
 
 #ifdef ENABLE_OPENSSL
@@ -600,7 +1112,7 @@ sc_pkcs11_verify_init(sc_pkcs11_operation_t *operation,
 	struct signature_data *data;
 	int rv;
 
-	if (!(data = calloc(1, sizeof(*data))))
+	if (!(data = session_alloc(operation->session, sizeof(*data))))
 		return CKR_HOST_MEMORY;
 
 	data->info = NULL;
@@ -619,7 +1131,7 @@ sc_pkcs11_verify_init(sc_pkcs11_operation_t *operation,
 			rv = info->hash_type->md_init(data->md);
 		if (rv != CKR_OK) {
 			sc_pkcs11_release_operation(&data->md);
-			free(data);
+			session_free(operation->session, data, sizeof(*data));
 			return rv;
 		}
 		data->info = info;
@@ -686,7 +1198,7 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 			goto done;
 	}
 
-	rv = sc_pkcs11_verify_data(pubkey_value, attr.ulValueLen,
+	rv = sc_pkcs11_verify_data(key, pubkey_value, attr.ulValueLen,
 		params, sizeof(params),
 		operation->mechanism.mechanism, data->md,
 		data->buffer, data->buffer_len, pSignature, ulSignatureLen);
@@ -696,6 +1208,167 @@ done:
 
 	return rv;
 }
+
+#endif
+
+/*
+ * Initialize an encryption context. Encryption with a public key is
+ * done by OpenSSL and never sent to the card, with a secret key of the
+ * card it is done on the card.
+ */
+CK_RV
+sc_pkcs11_encr_init(struct sc_pkcs11_session *session,
+			CK_MECHANISM_PTR pMechanism,
+			struct sc_pkcs11_object *key,
+			CK_MECHANISM_TYPE key_type)
+{
+	struct sc_pkcs11_card *p11card;
+	sc_pkcs11_operation_t *operation;
+	sc_pkcs11_mechanism_type_t *mt;
+	CK_RV rv;
+
+	if (!session || !session->slot
+	 || !(p11card = session->slot->card))
+		return CKR_ARGUMENTS_BAD;
+
+	/* See if we support this mechanism type */
+	mt = sc_pkcs11_find_mechanism(p11card, pMechanism->mechanism, CKF_ENCRYPT);
+	if (mt == NULL || mt->encrypt_init == NULL)
+		return CKR_MECHANISM_INVALID;
+
+	/* See if compatible with key type */
+	if (mt->key_type != key_type)
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	rv = session_start_operation(session, SC_PKCS11_OPERATION_ENCRYPT, mt, &operation);
+	if (rv != CKR_OK)
+		return rv;
+
+	memcpy(&operation->mechanism, pMechanism, sizeof(CK_MECHANISM));
+	rv = mt->encrypt_init(operation, key);
+
+	if (rv != CKR_OK)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_encr(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	sc_pkcs11_operation_t *op;
+	int rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_ENCRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = op->type->encrypt(op, pData, ulDataLen,
+			pEncryptedData, pulEncryptedDataLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && pEncryptedData != NULL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_encr_update(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen)
+{
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_ENCRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (op->type->encrypt_update == NULL)
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+	else
+		rv = op->type->encrypt_update(op, pPart, ulPartLen,
+				pEncryptedPart, pulEncryptedPartLen);
+
+	if (rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_encr_final(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pLastEncryptedPart, CK_ULONG_PTR pulLastEncryptedPartLen)
+{
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_ENCRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (op->type->encrypt_final == NULL)
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+	else
+		rv = op->type->encrypt_final(op, pLastEncryptedPart, pulLastEncryptedPartLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && (rv != CKR_OK || pLastEncryptedPart != NULL))
+		session_stop_operation(session, SC_PKCS11_OPERATION_ENCRYPT);
+
+	return rv;
+}
+
+#ifdef ENABLE_OPENSSL
+static CK_RV
+sc_pkcs11_encrypt_init(sc_pkcs11_operation_t *operation,
+			struct sc_pkcs11_object *key)
+{
+	struct signature_data *data;
+
+	if (!(data = session_alloc(operation->session, sizeof(*data))))
+		return CKR_HOST_MEMORY;
+
+	data->key = key;
+
+	operation->priv_data = data;
+	return CKR_OK;
+}
+
+static CK_RV
+sc_pkcs11_encrypt(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	struct signature_data *data;
+	struct sc_pkcs11_object *key;
+	unsigned char *pubkey_value;
+	CK_ATTRIBUTE attr = {CKA_VALUE, NULL, 0};
+	int rv;
+
+	data = (struct signature_data *) operation->priv_data;
+
+	if (pData == NULL || pulEncryptedDataLen == NULL)
+		return CKR_ARGUMENTS_BAD;
+
+	key = data->key;
+	rv = key->ops->get_attribute(operation->session, key, &attr);
+	if (rv != CKR_OK)
+		return rv;
+	pubkey_value = calloc(1, attr.ulValueLen);
+	if (pubkey_value == NULL)
+		return CKR_HOST_MEMORY;
+	attr.pValue = pubkey_value;
+	rv = key->ops->get_attribute(operation->session, key, &attr);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_encrypt_data(key, pubkey_value, attr.ulValueLen,
+			operation->mechanism.mechanism, pData, ulDataLen,
+			pEncryptedData, pulEncryptedDataLen);
+
+	free(pubkey_value);
+	return rv;
+}
 #endif
 
 /*
@@ -760,6 +1433,52 @@ sc_pkcs11_decr(struct sc_pkcs11_session *session,
 	return rv;
 }
 
+CK_RV
+sc_pkcs11_decr_update(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen,
+		CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen)
+{
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_DECRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (op->type->decrypt_update == NULL)
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+	else
+		rv = op->type->decrypt_update(op, pEncryptedPart, ulEncryptedPartLen,
+				pPart, pulPartLen);
+
+	if (rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL)
+		session_stop_operation(session, SC_PKCS11_OPERATION_DECRYPT);
+
+	return rv;
+}
+
+CK_RV
+sc_pkcs11_decr_final(struct sc_pkcs11_session *session,
+		CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen)
+{
+	sc_pkcs11_operation_t *op;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_DECRYPT, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (op->type->decrypt_final == NULL)
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+	else
+		rv = op->type->decrypt_final(op, pLastPart, pulLastPartLen);
+
+	if (rv != CKR_BUFFER_TOO_SMALL && (rv != CKR_OK || pLastPart != NULL))
+		session_stop_operation(session, SC_PKCS11_OPERATION_DECRYPT);
+
+	return rv;
+}
+
 /* Derive one key from another, and return results in created object */
 CK_RV
 sc_pkcs11_deri(struct sc_pkcs11_session *session,
@@ -867,7 +1586,7 @@ sc_pkcs11_decrypt_init(sc_pkcs11_operation_t *operation,
 {
 	struct signature_data *data;
 
-	if (!(data = calloc(1, sizeof(*data))))
+	if (!(data = session_alloc(operation->session, sizeof(*data))))
 		return CKR_HOST_MEMORY;
 
 	data->key = key;
@@ -893,6 +1612,190 @@ sc_pkcs11_decrypt(sc_pkcs11_operation_t *operation,
 				pData, pulDataLen);
 }
 
+/*
+ * Block ciphers with a secret key of the card. The parts given to
+ * C_EncryptUpdate() and C_DecryptUpdate() are sent on in whole blocks,
+ * what is left of a block waits for the next part.
+ */
+struct sym_crypt_data {
+	struct sc_pkcs11_object *key;
+	CK_ULONG block_size;
+	CK_BYTE partial[16];
+	CK_ULONG partial_len;
+};
+
+static void
+sc_pkcs11_sym_release(sc_pkcs11_operation_t *operation)
+{
+	struct sym_crypt_data *data;
+
+	data = (struct sym_crypt_data *) operation->priv_data;
+	if (!data)
+		return;
+	sc_mem_clear(data, sizeof(*data));
+	session_free(operation->session, data, sizeof(*data));
+}
+
+static CK_RV
+sc_pkcs11_sym_init(sc_pkcs11_operation_t *operation,
+			struct sc_pkcs11_object *key)
+{
+	struct sym_crypt_data *data;
+
+	/* ECB, no IV */
+	if (operation->mechanism.ulParameterLen != 0)
+		return CKR_MECHANISM_PARAM_INVALID;
+
+	if (!(data = session_alloc(operation->session, sizeof(*data))))
+		return CKR_HOST_MEMORY;
+
+	data->key = key;
+	data->block_size = operation->type->key_type == CKK_AES ? 16 : 8;
+
+	operation->priv_data = data;
+	return CKR_OK;
+}
+
+static CK_RV
+sc_pkcs11_sym_update(sc_pkcs11_operation_t *operation, int encrypt,
+		CK_BYTE_PTR pIn, CK_ULONG ulInLen,
+		CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	struct sym_crypt_data *data;
+	struct sc_pkcs11_object *key;
+	CK_BYTE_PTR in, buf = NULL;
+	CK_ULONG len, take, outlen;
+	CK_RV rv;
+
+	data = (struct sym_crypt_data *) operation->priv_data;
+	key = data->key;
+
+	if ((pIn == NULL && ulInLen != 0) || pulOutLen == NULL)
+		return CKR_ARGUMENTS_BAD;
+
+	len = data->partial_len + ulInLen;
+	len -= len % data->block_size;
+	if (pOut == NULL) {
+		*pulOutLen = len;
+		return CKR_OK;
+	}
+	if (*pulOutLen < len) {
+		*pulOutLen = len;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	if (len == 0) {
+		memcpy(data->partial + data->partial_len, pIn, ulInLen);
+		data->partial_len += ulInLen;
+		*pulOutLen = 0;
+		return CKR_OK;
+	}
+
+	take = len - data->partial_len;
+	in = pIn;
+	if (data->partial_len != 0) {
+		if (!(buf = malloc(len)))
+			return CKR_HOST_MEMORY;
+		memcpy(buf, data->partial, data->partial_len);
+		memcpy(buf + data->partial_len, pIn, take);
+		in = buf;
+	}
+
+	outlen = *pulOutLen;
+	if (encrypt)
+		rv = key->ops->encrypt(operation->session, key, &operation->mechanism,
+				in, len, pOut, &outlen);
+	else
+		rv = key->ops->decrypt(operation->session, key, &operation->mechanism,
+				in, len, pOut, &outlen);
+	if (buf) {
+		sc_mem_clear(buf, len);
+		free(buf);
+	}
+	if (rv != CKR_OK)
+		return rv;
+
+	data->partial_len = ulInLen - take;
+	memcpy(data->partial, pIn + take, data->partial_len);
+	*pulOutLen = outlen;
+	return CKR_OK;
+}
+
+static CK_RV
+sc_pkcs11_sym_final(sc_pkcs11_operation_t *operation, int encrypt,
+		CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	struct sym_crypt_data *data;
+
+	data = (struct sym_crypt_data *) operation->priv_data;
+
+	if (pulOutLen == NULL)
+		return CKR_ARGUMENTS_BAD;
+	/* no padding */
+	if (data->partial_len != 0)
+		return encrypt ? CKR_DATA_LEN_RANGE : CKR_ENCRYPTED_DATA_LEN_RANGE;
+	*pulOutLen = 0;
+	return CKR_OK;
+}
+
+static CK_RV
+sc_pkcs11_sym_encrypt(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	struct sym_crypt_data *data = (struct sym_crypt_data *) operation->priv_data;
+
+	if (ulDataLen % data->block_size)
+		return CKR_DATA_LEN_RANGE;
+	return sc_pkcs11_sym_update(operation, 1, pData, ulDataLen,
+			pEncryptedData, pulEncryptedDataLen);
+}
+
+static CK_RV
+sc_pkcs11_sym_encrypt_update(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen)
+{
+	return sc_pkcs11_sym_update(operation, 1, pPart, ulPartLen,
+			pEncryptedPart, pulEncryptedPartLen);
+}
+
+static CK_RV
+sc_pkcs11_sym_encrypt_final(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pLastEncryptedPart, CK_ULONG_PTR pulLastEncryptedPartLen)
+{
+	return sc_pkcs11_sym_final(operation, 1, pLastEncryptedPart, pulLastEncryptedPartLen);
+}
+
+static CK_RV
+sc_pkcs11_sym_decrypt(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen,
+		CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	struct sym_crypt_data *data = (struct sym_crypt_data *) operation->priv_data;
+
+	if (ulEncryptedDataLen % data->block_size)
+		return CKR_ENCRYPTED_DATA_LEN_RANGE;
+	return sc_pkcs11_sym_update(operation, 0, pEncryptedData, ulEncryptedDataLen,
+			pData, pulDataLen);
+}
+
+static CK_RV
+sc_pkcs11_sym_decrypt_update(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen,
+		CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen)
+{
+	return sc_pkcs11_sym_update(operation, 0, pEncryptedPart, ulEncryptedPartLen,
+			pPart, pulPartLen);
+}
+
+static CK_RV
+sc_pkcs11_sym_decrypt_final(sc_pkcs11_operation_t *operation,
+		CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen)
+{
+	return sc_pkcs11_sym_final(operation, 0, pLastPart, pulLastPartLen);
+}
+
 static CK_RV
 sc_pkcs11_derive(sc_pkcs11_operation_t *operation,
 	    struct sc_pkcs11_object *basekey,
@@ -929,6 +1832,23 @@ sc_pkcs11_new_fw_mechanism(CK_MECHANISM_TYPE mech,
 
 	mt->release = sc_pkcs11_signature_release;
 
+	if (key_type == CKK_AES || key_type == CKK_DES || key_type == CKK_DES3) {
+		mt->release = sc_pkcs11_sym_release;
+		if (pInfo->flags & CKF_ENCRYPT) {
+			mt->encrypt_init = sc_pkcs11_sym_init;
+			mt->encrypt = sc_pkcs11_sym_encrypt;
+			mt->encrypt_update = sc_pkcs11_sym_encrypt_update;
+			mt->encrypt_final = sc_pkcs11_sym_encrypt_final;
+		}
+		if (pInfo->flags & CKF_DECRYPT) {
+			mt->decrypt_init = sc_pkcs11_sym_init;
+			mt->decrypt = sc_pkcs11_sym_decrypt;
+			mt->decrypt_update = sc_pkcs11_sym_decrypt_update;
+			mt->decrypt_final = sc_pkcs11_sym_decrypt_final;
+		}
+		return mt;
+	}
+
 	if (pInfo->flags & CKF_SIGN) {
 		mt->sign_init = sc_pkcs11_signature_init;
 		mt->sign_update = sc_pkcs11_signature_update;
@@ -949,6 +1869,14 @@ sc_pkcs11_new_fw_mechanism(CK_MECHANISM_TYPE mech,
 	if (pInfo->flags & CKF_DECRYPT) {
 		mt->decrypt_init = sc_pkcs11_decrypt_init;
 		mt->decrypt = sc_pkcs11_decrypt;
+#ifdef ENABLE_OPENSSL
+		/* The public half is done on the host, like the verification */
+		if (key_type == CKK_RSA && (mech == CKM_RSA_PKCS || mech == CKM_RSA_X_509)) {
+			mt->mech_info.flags |= CKF_ENCRYPT;
+			mt->encrypt_init = sc_pkcs11_encrypt_init;
+			mt->encrypt = sc_pkcs11_encrypt;
+		}
+#endif
 	}
 
 	return mt;
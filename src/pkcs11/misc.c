@@ -183,6 +183,55 @@ CK_RV session_stop_operation(struct sc_pkcs11_session * session, int type)
 	return CKR_OK;
 }
 
+/*
+ * Zeroed memory for the state of an operation. The operations of a session
+ * come and go with every C_xxxInit() and final call, so the blocks they
+ * free are kept with the session and given back to the next ones of the
+ * same size.
+ */
+void *session_alloc(struct sc_pkcs11_session *session, size_t size)
+{
+	unsigned int i;
+
+	if (session)
+		for (i = 0; i < SC_PKCS11_SESSION_SPARES; i++)
+			if (session->spare[i].ptr && session->spare[i].size == size) {
+				void *ptr = session->spare[i].ptr;
+
+				session->spare[i].ptr = NULL;
+				memset(ptr, 0, size);
+				return ptr;
+			}
+	return calloc(1, size);
+}
+
+void session_free(struct sc_pkcs11_session *session, void *ptr, size_t size)
+{
+	unsigned int i;
+
+	if (!ptr)
+		return;
+	if (session)
+		for (i = 0; i < SC_PKCS11_SESSION_SPARES; i++)
+			if (session->spare[i].ptr == NULL) {
+				session->spare[i].ptr = ptr;
+				session->spare[i].size = size;
+				return;
+			}
+	free(ptr);
+}
+
+/* Called when the session itself is freed */
+void session_free_spares(struct sc_pkcs11_session *session)
+{
+	unsigned int i;
+
+	for (i = 0; i < SC_PKCS11_SESSION_SPARES; i++) {
+		free(session->spare[i].ptr);
+		session->spare[i].ptr = NULL;
+	}
+}
+
 CK_RV attr_extract(CK_ATTRIBUTE_PTR pAttr, void *ptr, size_t * sizep)
 {
 	unsigned int size;
@@ -299,6 +348,12 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	conf->create_puk_slot = 0;
 	conf->zero_ckaid_for_ca_certs = 0;
 	conf->create_slots_flags = 0;
+	conf->lazy_object_loading = 0;
+	conf->bind_in_background = 0;
+	conf->defer_card_connect = 0;
+	conf->key_pool = 0;
+	conf->parse_threads = 0;
+	conf->random_pool_size = 0;
 
 	conf_block = sc_get_conf_block(ctx, "pkcs11", NULL, 1);
 	if (!conf_block)
@@ -321,6 +376,14 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 
 	conf->create_puk_slot = scconf_get_bool(conf_block, "create_puk_slot", conf->create_puk_slot);
 	conf->zero_ckaid_for_ca_certs = scconf_get_bool(conf_block, "zero_ckaid_for_ca_certs", conf->zero_ckaid_for_ca_certs);
+	conf->lazy_object_loading = scconf_get_bool(conf_block, "lazy_object_loading", conf->lazy_object_loading);
+	conf->bind_in_background = scconf_get_bool(conf_block, "bind_in_background", conf->bind_in_background);
+	conf->defer_card_connect = scconf_get_bool(conf_block, "defer_card_connect", conf->defer_card_connect);
+	conf->key_pool = scconf_get_bool(conf_block, "key_pool", conf->key_pool);
+	conf->parse_threads = scconf_get_int(conf_block, "parse_threads", conf->parse_threads);
+	conf->random_pool_size = scconf_get_int(conf_block, "random_pool_size", conf->random_pool_size);
+	if (conf->random_pool_size > 4096)
+		conf->random_pool_size = 4096;
 
 	create_slots_for_pins = (char *)scconf_get_str(conf_block, "create_slots_for_pins", "all");
 	tmp = strdup(create_slots_for_pins);
@@ -340,8 +403,13 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 
 	sc_log(ctx, "PKCS#11 options: plug_and_play=%d max_virtual_slots=%d slots_per_card=%d "
 		 "hide_empty_tokens=%d lock_login=%d pin_unblock_style=%d "
-		 "zero_ckaid_for_ca_certs=%d create_slots_flags=0x%X",
+		 "zero_ckaid_for_ca_certs=%d create_slots_flags=0x%X lazy_object_loading=%d "
+		 "bind_in_background=%d defer_card_connect=%d key_pool=%d "
+		 "parse_threads=%d random_pool_size=%d",
 		 conf->plug_and_play, conf->max_virtual_slots, conf->slots_per_card,
 		 conf->hide_empty_tokens, conf->lock_login, conf->pin_unblock_style,
-		 conf->zero_ckaid_for_ca_certs, conf->create_slots_flags);
+		 conf->zero_ckaid_for_ca_certs, conf->create_slots_flags,
+		 conf->lazy_object_loading, conf->bind_in_background,
+		 conf->defer_card_connect, conf->key_pool,
+		 conf->parse_threads, conf->random_pool_size);
 }
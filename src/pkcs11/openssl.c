@@ -33,6 +33,10 @@ static CK_RV	sc_pkcs11_openssl_md_update(sc_pkcs11_operation_t *,
 					CK_BYTE_PTR, CK_ULONG);
 static CK_RV	sc_pkcs11_openssl_md_final(sc_pkcs11_operation_t *,
 					CK_BYTE_PTR, CK_ULONG_PTR);
+static CK_RV	sc_pkcs11_openssl_md_get_state(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+static CK_RV	sc_pkcs11_openssl_md_set_state(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG);
 static void	sc_pkcs11_openssl_md_release(sc_pkcs11_operation_t *);
 
 static sc_pkcs11_mechanism_type_t openssl_sha1_mech = {
@@ -44,6 +48,8 @@ static sc_pkcs11_mechanism_type_t openssl_sha1_mech = {
 	sc_pkcs11_openssl_md_init,
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
+	sc_pkcs11_openssl_md_get_state,
+	sc_pkcs11_openssl_md_set_state,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
@@ -61,6 +67,8 @@ static sc_pkcs11_mechanism_type_t openssl_sha256_mech = {
 	sc_pkcs11_openssl_md_init,
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
+	sc_pkcs11_openssl_md_get_state,
+	sc_pkcs11_openssl_md_set_state,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
@@ -77,6 +85,8 @@ static sc_pkcs11_mechanism_type_t openssl_sha384_mech = {
 	sc_pkcs11_openssl_md_init,
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
+	sc_pkcs11_openssl_md_get_state,
+	sc_pkcs11_openssl_md_set_state,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
@@ -93,6 +103,8 @@ static sc_pkcs11_mechanism_type_t openssl_sha512_mech = {
 	sc_pkcs11_openssl_md_init,
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
+	sc_pkcs11_openssl_md_get_state,
+	sc_pkcs11_openssl_md_set_state,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
@@ -111,6 +123,7 @@ static sc_pkcs11_mechanism_type_t openssl_gostr3411_mech = {
 	sc_pkcs11_openssl_md_init,
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
+	NULL, NULL,		/* md_*_state, the engine's state has pointers */
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
@@ -128,6 +141,8 @@ static sc_pkcs11_mechanism_type_t openssl_md5_mech = {
 	sc_pkcs11_openssl_md_init,
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
+	sc_pkcs11_openssl_md_get_state,
+	sc_pkcs11_openssl_md_set_state,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
@@ -144,6 +159,8 @@ static sc_pkcs11_mechanism_type_t openssl_ripemd160_mech = {
 	sc_pkcs11_openssl_md_init,
 	sc_pkcs11_openssl_md_update,
 	sc_pkcs11_openssl_md_final,
+	sc_pkcs11_openssl_md_get_state,
+	sc_pkcs11_openssl_md_set_state,
 	NULL, NULL, NULL, NULL,	/* sign_* */
 	NULL, NULL, NULL,	/* verif_* */
 	NULL, NULL,		/* decrypt_* */
@@ -227,7 +244,7 @@ static CK_RV sc_pkcs11_openssl_md_init(sc_pkcs11_operation_t *op)
 	if (!op || !(mt = op->type) || !(md = (EVP_MD *) mt->mech_data))
 		return CKR_ARGUMENTS_BAD;
 
-	if (!(md_ctx = calloc(1, sizeof(*md_ctx))))
+	if (!(md_ctx = session_alloc(op->session, sizeof(*md_ctx))))
 		return CKR_HOST_MEMORY;
 	EVP_DigestInit(md_ctx, md);
 	op->priv_data = md_ctx;
@@ -258,12 +275,62 @@ static CK_RV sc_pkcs11_openssl_md_final(sc_pkcs11_operation_t *op,
 	return CKR_OK;
 }
 
+/* The state is the digest's own context, as the built-in digests keep
+ * it in a flat structure without pointers */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define DIGEST_STATE(ctx)	EVP_MD_CTX_md_data(ctx)
+#define DIGEST_STATE_SIZE(ctx)	EVP_MD_meth_get_app_datasize(EVP_MD_CTX_md(ctx))
+#else
+#define DIGEST_STATE(ctx)	((ctx)->md_data)
+#define DIGEST_STATE_SIZE(ctx)	((ctx)->digest->ctx_size)
+#endif
+
+static CK_RV sc_pkcs11_openssl_md_get_state(sc_pkcs11_operation_t *op,
+				CK_BYTE_PTR pState, CK_ULONG_PTR pulStateLen)
+{
+	EVP_MD_CTX *md_ctx = DIGEST_CTX(op);
+	void *md_data = DIGEST_STATE(md_ctx);
+	int size = DIGEST_STATE_SIZE(md_ctx);
+
+	if (md_data == NULL || size <= 0)
+		return CKR_STATE_UNSAVEABLE;
+	if (pState != NULL) {
+		if (*pulStateLen < (CK_ULONG) size) {
+			*pulStateLen = size;
+			return CKR_BUFFER_TOO_SMALL;
+		}
+		memcpy(pState, md_data, size);
+	}
+	*pulStateLen = size;
+	return CKR_OK;
+}
+
+static CK_RV sc_pkcs11_openssl_md_set_state(sc_pkcs11_operation_t *op,
+				CK_BYTE_PTR pState, CK_ULONG ulStateLen)
+{
+	EVP_MD_CTX *md_ctx = DIGEST_CTX(op);
+	void *md_data = DIGEST_STATE(md_ctx);
+	int size = DIGEST_STATE_SIZE(md_ctx);
+
+	if (md_data == NULL || size <= 0 || ulStateLen != (CK_ULONG) size)
+		return CKR_SAVED_STATE_INVALID;
+	memcpy(md_data, pState, size);
+	return CKR_OK;
+}
+
 static void sc_pkcs11_openssl_md_release(sc_pkcs11_operation_t *op)
 {
 	EVP_MD_CTX	*md_ctx = DIGEST_CTX(op);
 
-	if (md_ctx)
-		free(md_ctx);
+	if (md_ctx) {
+		/* the next digest of the session resets and reuses it */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		EVP_MD_CTX_reset(md_ctx);
+#else
+		EVP_MD_CTX_cleanup(md_ctx);
+#endif
+		session_free(op->session, md_ctx, sizeof(*md_ctx));
+	}
 	op->priv_data = NULL;
 }
 
@@ -354,11 +421,66 @@ static CK_RV gostr3410_verify_data(const unsigned char *pubkey, int pubkey_len,
 }
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC) */
 
+/* The public key of an object decoded for the host side operations
+ * (verification and encryption), kept with the object for as long as
+ * its value does not change */
+struct sc_pkcs11_verify_key {
+	unsigned char *der;
+	int der_len;
+	EVP_PKEY *pkey;
+};
+
+void sc_pkcs11_free_verify_key(struct sc_pkcs11_object *key)
+{
+	struct sc_pkcs11_verify_key *vk = key->verify_key;
+
+	if (vk == NULL)
+		return;
+	if (vk->pkey)
+		EVP_PKEY_free(vk->pkey);
+	free(vk->der);
+	free(vk);
+	key->verify_key = NULL;
+}
+
+/* Returns the EVP_PKEY for the DER encoded RSA public key. It belongs
+ * to the key object and must not be freed by the caller. */
+static EVP_PKEY *get_verify_key(struct sc_pkcs11_object *key,
+			const unsigned char *pubkey, int pubkey_len)
+{
+	struct sc_pkcs11_verify_key *vk = key->verify_key;
+
+	if (vk && vk->der_len == pubkey_len && memcmp(vk->der, pubkey, pubkey_len) == 0)
+		return vk->pkey;
+
+	sc_pkcs11_free_verify_key(key);
+	vk = calloc(1, sizeof(*vk));
+	if (vk == NULL)
+		return NULL;
+	vk->der = malloc(pubkey_len);
+	if (vk->der == NULL) {
+		free(vk);
+		return NULL;
+	}
+	memcpy(vk->der, pubkey, pubkey_len);
+	vk->der_len = pubkey_len;
+
+	vk->pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &pubkey, pubkey_len);
+	if (vk->pkey == NULL) {
+		free(vk->der);
+		free(vk);
+		return NULL;
+	}
+	key->verify_key = vk;
+	return vk->pkey;
+}
+
 /* If no hash function was used, finish with RSA_public_decrypt().
  * If a hash function was used, we can make a big shortcut by
  *   finishing with EVP_VerifyFinal().
  */
-CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
+CK_RV sc_pkcs11_verify_data(struct sc_pkcs11_object *key,
+			const unsigned char *pubkey, int pubkey_len,
 			const unsigned char *pubkey_params, int pubkey_params_len,
 			CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 			unsigned char *data, int data_len,
@@ -380,7 +502,7 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 #endif
 	}
 
-	pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &pubkey, pubkey_len);
+	pkey = get_verify_key(key, pubkey, pubkey_len);
 	if (pkey == NULL)
 		return CKR_GENERAL_ERROR;
 
@@ -388,7 +510,6 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 		EVP_MD_CTX *md_ctx = DIGEST_CTX(md);
 
 		res = EVP_VerifyFinal(md_ctx, signat, signat_len, pkey);
-		EVP_PKEY_free(pkey);
 		if (res == 1)
 			return CKR_OK;
 		else if (res == 0)
@@ -411,12 +532,10 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 		 	pad = RSA_NO_PADDING;
 		 	break;
 		 default:
-			EVP_PKEY_free(pkey);
 		 	return CKR_ARGUMENTS_BAD;
 		 }
 
 		rsa = EVP_PKEY_get1_RSA(pkey);
-		EVP_PKEY_free(pkey);
 		if (rsa == NULL)
 			return CKR_DEVICE_MEMORY;
 
@@ -444,4 +563,80 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 
 	return rv;
 }
+
+/* Encrypts with the RSA public key, the card is not involved. With
+ * out == NULL only the length of the result is returned. */
+CK_RV sc_pkcs11_encrypt_data(struct sc_pkcs11_object *key,
+			const unsigned char *pubkey, int pubkey_len,
+			CK_MECHANISM_TYPE mech, unsigned char *data, int data_len,
+			unsigned char *out, CK_ULONG_PTR out_len)
+{
+	EVP_PKEY *pkey;
+	RSA *rsa;
+	unsigned char *padded = NULL;
+	int pad, rsa_size, r;
+	CK_RV rv = CKR_OK;
+
+	pkey = get_verify_key(key, pubkey, pubkey_len);
+	if (pkey == NULL)
+		return CKR_GENERAL_ERROR;
+
+	rsa = EVP_PKEY_get1_RSA(pkey);
+	if (rsa == NULL)
+		return CKR_DEVICE_MEMORY;
+	rsa_size = RSA_size(rsa);
+
+	switch (mech) {
+	case CKM_RSA_PKCS:
+		pad = RSA_PKCS1_PADDING;
+		if (data_len > rsa_size - 11)
+			rv = CKR_DATA_LEN_RANGE;
+		break;
+	case CKM_RSA_X_509:
+		pad = RSA_NO_PADDING;
+		if (data_len > rsa_size)
+			rv = CKR_DATA_LEN_RANGE;
+		break;
+	default:
+		rv = CKR_MECHANISM_INVALID;
+		break;
+	}
+	if (rv != CKR_OK)
+		goto done;
+
+	if (out == NULL) {
+		*out_len = rsa_size;
+		goto done;
+	}
+	if (*out_len < (CK_ULONG) rsa_size) {
+		*out_len = rsa_size;
+		rv = CKR_BUFFER_TOO_SMALL;
+		goto done;
+	}
+
+	/* raw RSA takes the data as a big-endian number of the modulus size */
+	if (pad == RSA_NO_PADDING && data_len < rsa_size) {
+		padded = calloc(1, rsa_size);
+		if (padded == NULL) {
+			rv = CKR_HOST_MEMORY;
+			goto done;
+		}
+		memcpy(padded + rsa_size - data_len, data, data_len);
+		data = padded;
+		data_len = rsa_size;
+	}
+
+	r = RSA_public_encrypt(data_len, data, out, rsa, pad);
+	if (r <= 0) {
+		sc_log(context, "RSA_public_encrypt() returned %d\n", r);
+		rv = pad == RSA_NO_PADDING ? CKR_DATA_INVALID : CKR_GENERAL_ERROR;
+		goto done;
+	}
+	*out_len = r;
+
+done:
+	free(padded);
+	RSA_free(rsa);
+	return rv;
+}
 #endif
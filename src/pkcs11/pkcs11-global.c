@@ -25,6 +25,9 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "sc-pkcs11.h"
 
@@ -114,6 +117,11 @@ static CK_C_INITIALIZE_ARGS _def_locks = {
 
 static CK_C_INITIALIZE_ARGS_PTR	global_locking;
 static void *			global_lock = NULL;
+/* Serializes blocking C_WaitForSlotEvent callers: the reader layer
+ * has a single wait context which only one thread can block on */
+static void *			wait_lock = NULL;
+static void sc_pkcs11_lock_wait(void);
+static void sc_pkcs11_unlock_wait(void);
 #if (defined(HAVE_PTHREAD) || defined(_WIN32)) && defined(PKCS11_THREAD_LOCKING)
 #define HAVE_OS_LOCKING
 static CK_C_INITIALIZE_ARGS_PTR default_mutex_funcs = &_def_locks;
@@ -121,6 +129,147 @@ static CK_C_INITIALIZE_ARGS_PTR default_mutex_funcs = &_def_locks;
 static CK_C_INITIALIZE_ARGS_PTR default_mutex_funcs = NULL;
 #endif
 
+#if defined(HAVE_PTHREAD) && defined(PKCS11_THREAD_LOCKING)
+/* Threads binding the cards of the readers found by C_Initialize() */
+static pthread_t *bind_threads = NULL;
+static unsigned int bind_thread_count = 0;
+
+static void *bind_thread(void *reader)
+{
+	card_detect_reader((sc_reader_t *) reader);
+	return NULL;
+}
+
+/* Threads binding the cards found later by C_GetSlotList() */
+struct pending_bind {
+	pthread_t thread;
+	sc_reader_t *reader;
+	int done;			/* Set with the global lock held */
+	struct pending_bind *next;
+};
+static struct pending_bind *pending_binds = NULL;
+static int pending_binds_allowed = 0;
+
+static void *pending_bind_thread(void *arg)
+{
+	struct pending_bind *bind = (struct pending_bind *) arg;
+
+	card_bind_pending(bind->reader);
+	if (sc_pkcs11_lock() == CKR_OK) {
+		bind->done = 1;
+		sc_pkcs11_unlock();
+	}
+	return NULL;
+}
+
+/* Binds the card of the reader in a thread, called with the global lock
+ * held. Returns 0 if the caller has to bind it itself. */
+int sc_pkcs11_bind_in_background(sc_reader_t *reader)
+{
+	struct pending_bind *bind, **p;
+
+	if (!pending_binds_allowed)
+		return 0;
+
+	/* the threads that are done are joined here, the others by C_Finalize() */
+	for (p = &pending_binds; *p != NULL; ) {
+		bind = *p;
+		if (bind->done) {
+			*p = bind->next;
+			pthread_join(bind->thread, NULL);
+			free(bind);
+		} else {
+			p = &bind->next;
+		}
+	}
+
+	bind = calloc(1, sizeof(*bind));
+	if (bind == NULL)
+		return 0;
+	bind->reader = reader;
+	if (pthread_create(&bind->thread, NULL, pending_bind_thread, bind) != 0) {
+		free(bind);
+		return 0;
+	}
+	bind->next = pending_binds;
+	pending_binds = bind;
+	return 1;
+}
+
+/* Starts the card detection of every reader in a thread of its own.
+ * Returns 0 if the caller has to detect the cards itself. */
+static int start_bind_threads(CK_C_INITIALIZE_ARGS_PTR args)
+{
+	unsigned int i, n = sc_ctx_get_reader_count(context);
+
+	pending_binds_allowed = sc_pkcs11_conf.bind_in_background && global_lock
+		&& !(args && (args->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS));
+	if (!pending_binds_allowed || n == 0)
+		return 0;
+
+	bind_threads = calloc(n, sizeof(pthread_t));
+	if (bind_threads == NULL)
+		return 0;
+	for (i = 0; i < n; i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(context, i);
+
+		if (pthread_create(&bind_threads[bind_thread_count], NULL, bind_thread, reader) == 0)
+			bind_thread_count++;
+		else
+			card_detect_reader(reader);
+	}
+	sc_log(context, "binding the cards of %u readers in the background", bind_thread_count);
+	return 1;
+}
+
+/* Called without the global lock held, the threads need it */
+static void join_bind_threads(void)
+{
+	unsigned int i;
+
+#if !defined(_WIN32)
+	/* in a forked child the threads are gone */
+	if (getpid() == initialized_pid)
+#endif
+		for (i = 0; i < bind_thread_count; i++)
+			pthread_join(bind_threads[i], NULL);
+	free(bind_threads);
+	bind_threads = NULL;
+	bind_thread_count = 0;
+
+	while (pending_binds != NULL) {
+		struct pending_bind *bind = pending_binds;
+
+		pending_binds = bind->next;
+#if !defined(_WIN32)
+		if (getpid() == initialized_pid)
+#endif
+			pthread_join(bind->thread, NULL);
+		free(bind);
+	}
+	pending_binds_allowed = 0;
+}
+
+#if !defined(_WIN32)
+static void forget_bind_threads(void)
+{
+	bind_threads = NULL;
+	bind_thread_count = 0;
+	pending_binds = NULL;
+	pending_binds_allowed = 0;
+}
+#endif
+#else
+#define start_bind_threads(args)	0
+#define join_bind_threads()
+#define forget_bind_threads()
+
+int sc_pkcs11_bind_in_background(sc_reader_t *reader)
+{
+	return 0;
+}
+#endif
+
 /* wrapper for the locking functions for libopensc */
 static int sc_create_mutex(void **m)
 {
@@ -163,20 +312,62 @@ static int sc_destroy_mutex(void *m)
 		return SC_ERROR_INTERNAL;
 }
 
+#if defined(HAVE_PTHREAD) && defined(PKCS11_THREAD_LOCKING)
+/* PKCS#11 has no shared locks: with the mutexes of the application,
+ * libopensc uses these for its read-mostly structures too */
+static int sc_create_rwlock(void **l)
+{
+	pthread_rwlock_t *rw;
+
+	if (global_locking != &_def_locks)
+		return SC_ERROR_NOT_SUPPORTED;
+	rw = calloc(1, sizeof(*rw));
+	if (rw == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (pthread_rwlock_init(rw, NULL) != 0) {
+		free(rw);
+		return SC_ERROR_INTERNAL;
+	}
+	*l = rw;
+	return SC_SUCCESS;
+}
+
+static int sc_lock_shared(void *l)
+{
+	return pthread_rwlock_rdlock((pthread_rwlock_t *) l) ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int sc_lock_exclusive(void *l)
+{
+	return pthread_rwlock_wrlock((pthread_rwlock_t *) l) ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int sc_unlock_rwlock(void *l)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) l) ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int sc_destroy_rwlock(void *l)
+{
+	pthread_rwlock_destroy((pthread_rwlock_t *) l);
+	free(l);
+	return SC_SUCCESS;
+}
+
+static sc_thread_context_t sc_thread_ctx = {
+	1, sc_create_mutex, sc_lock_mutex,
+	sc_unlock_mutex, sc_destroy_mutex, NULL,
+	sc_create_rwlock, sc_lock_shared, sc_unlock_rwlock,
+	sc_lock_exclusive, sc_unlock_rwlock, sc_destroy_rwlock
+};
+#else
 static sc_thread_context_t sc_thread_ctx = {
 	0, sc_create_mutex, sc_lock_mutex,
 	sc_unlock_mutex, sc_destroy_mutex, NULL
 };
+#endif
 
 /* simclist helpers to locate interesting objects by ID */
-static int session_list_seeker(const void *el, const void *key) {
-	const struct sc_pkcs11_session *session = (struct sc_pkcs11_session *)el;
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (session->handle == *(CK_SESSION_HANDLE*)key)
-		return 1;
-	return 0;
-}
 static int slot_list_seeker(const void *el, const void *key) {
 	const struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *)el;
 	if ((el == NULL) || (key == NULL))
@@ -188,56 +379,91 @@ static int slot_list_seeker(const void *el, const void *key) {
 
 
 
+#if !defined(_WIN32)
+/*
+ * In the child of fork(), drop what C_Initialize() built in the parent
+ * without releasing it: the locks may have been held by threads that do
+ * not exist here, and the slots, cards and sessions are tied to the
+ * parent's PC/SC handles. The context itself is kept, see sc_ctx_forked().
+ */
+static void forget_parent_state(void)
+{
+	global_lock = NULL;
+	wait_lock = NULL;
+	global_locking = NULL;
+	forget_bind_threads();
+	list_destroy(&sessions);
+	sc_pkcs11_free_session_table();
+	list_destroy(&virtual_slots);
+	sc_pkcs11_free_slot_table();
+}
+#endif
+
 CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 {
 	CK_RV rv;
 #if !defined(_WIN32)
 	pid_t current_pid = getpid();
 #endif
-	int rc;
+	int rc, forked = 0;
 	unsigned int i;
 	sc_context_param_t ctx_opts;
 
 	/* Handle fork() exception */
 #if !defined(_WIN32)
-	if (current_pid != initialized_pid) {
-		C_Finalize(NULL_PTR);
+	if (current_pid != initialized_pid && context != NULL) {
+		forget_parent_state();
+		forked = 1;
 	}
 	initialized_pid = current_pid;
 	in_finalize = 0;
 #endif
 
-	if (context != NULL) {
+	if (context != NULL && !forked) {
 		sc_log(context, "C_Initialize(): Cryptoki already initialized\n");
 		return CKR_CRYPTOKI_ALREADY_INITIALIZED;
 	}
 
 	rv = sc_pkcs11_init_lock((CK_C_INITIALIZE_ARGS_PTR) pInitArgs);
-	if (rv != CKR_OK)
+	if (rv != CKR_OK) {
+		if (forked)
+			/* still the parent's, not to be released here */
+			context = NULL;
 		goto out;
+	}
 
-	/* set context options */
-	memset(&ctx_opts, 0, sizeof(sc_context_param_t));
-	ctx_opts.ver        = 0;
-	ctx_opts.app_name   = "opensc-pkcs11";
-	ctx_opts.thread_ctx = &sc_thread_ctx;
+	/* The configuration and the drivers loaded by the parent are kept,
+	 * unless the reader driver cannot start over in the child */
+	if (forked && sc_ctx_forked(context) != SC_SUCCESS)
+		context = NULL;
+
+	if (context == NULL) {
+		/* set context options */
+		memset(&ctx_opts, 0, sizeof(sc_context_param_t));
+		ctx_opts.ver        = 0;
+		ctx_opts.app_name   = "opensc-pkcs11";
+		ctx_opts.thread_ctx = &sc_thread_ctx;
+
+		rc = sc_context_create(&context, &ctx_opts);
+		if (rc != SC_SUCCESS) {
+			rv = CKR_GENERAL_ERROR;
+			goto out;
+		}
 
-	rc = sc_context_create(&context, &ctx_opts);
-	if (rc != SC_SUCCESS) {
-		rv = CKR_GENERAL_ERROR;
-		goto out;
+		/* Load configuration */
+		load_pkcs11_parameters(&sc_pkcs11_conf, context);
 	}
-
-	/* Load configuration */
-	load_pkcs11_parameters(&sc_pkcs11_conf, context);
+	if (pInitArgs && (((CK_C_INITIALIZE_ARGS_PTR) pInitArgs)->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS))
+		sc_pkcs11_conf.parse_threads = 0;
 
 	/* List of sessions */
 	list_init(&sessions);
-	list_attributes_seeker(&sessions, session_list_seeker);
+	list_attributes_indexed(&sessions, 1);
 
 	/* List of slots */
 	list_init(&virtual_slots);
 	list_attributes_seeker(&virtual_slots, slot_list_seeker);
+	list_attributes_indexed(&virtual_slots, 1);
 
 	/* Create a slot for a future "PnP" stuff. */
 	if (sc_pkcs11_conf.plug_and_play) {
@@ -245,10 +471,16 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	}
 
 	/* Create slots for readers found on initialization, only if in 2.11 mode */
-	if (!sc_pkcs11_conf.plug_and_play) {
+	if (!sc_pkcs11_conf.plug_and_play || sc_pkcs11_conf.bind_in_background
+			|| sc_pkcs11_conf.defer_card_connect) {
 		for (i=0; i<sc_ctx_get_reader_count(context); i++) {
-			initialize_reader(sc_ctx_get_reader(context, i));
+			initialize_reader(sc_ctx_get_reader(context, i), 0);
 		}
+		if (sc_pkcs11_conf.defer_card_connect)
+			card_probe_all();
+		else if (!start_bind_threads((CK_C_INITIALIZE_ARGS_PTR) pInitArgs) && !sc_pkcs11_conf.plug_and_play)
+			for (i=0; i<sc_ctx_get_reader_count(context); i++)
+				card_detect_reader(sc_ctx_get_reader(context, i));
 	}
 
 out:
@@ -280,6 +512,8 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
+	join_bind_threads();
+
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -294,14 +528,24 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 		card_removed(sc_ctx_get_reader(context, i));
 
 	while ((p = list_fetch(&sessions)))
-		free(p);
+		sc_pkcs11_free_session(p);
 	list_destroy(&sessions);
+	sc_pkcs11_free_session_table();
 
 	while ((slot = list_fetch(&virtual_slots))) {
+		sc_pkcs11_slot_t *next = list_get_at(&virtual_slots, 0);
+
+		/* the last slot of a reader takes its lock along */
+		if (next == NULL || next->lock != slot->lock)
+			sc_pkcs11_free_slot_lock(slot->lock);
+		sc_pkcs11_drop_object_index(slot);
+		slot_free_handle_table(slot);
 		list_destroy(&slot->objects);
 		free(slot);
 	}
 	list_destroy(&virtual_slots);
+	sc_pkcs11_free_slot_table();
+	sc_pkcs11_free_mechanism_cache();
 
 	sc_release_context(context);
 	context = NULL;
@@ -381,9 +625,15 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
 		hotplug_slot->id--;
 		sc_ctx_detect_readers(context);
+		slot_reader_event();
 	}
 
-	card_detect_all();
+	/* The cards are detected with the slot locks, taken before the global
+	 * lock. New cards are bound in the background if possible. */
+	sc_pkcs11_unlock();
+	card_probe_all();
+	if ((rv = sc_pkcs11_lock()) != CKR_OK)
+		return rv;
 
 	found = calloc(list_size(&virtual_slots), sizeof(CK_SLOT_ID));
 
@@ -437,7 +687,7 @@ out:
 	return rv;
 }
 
-static sc_timestamp_t get_current_time(void)
+sc_timestamp_t get_current_time(void)
 {
 #if HAVE_GETTIMEOFDAY
 	struct timeval tv;
@@ -467,32 +717,28 @@ static sc_timestamp_t get_current_time(void)
 CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 {
 	struct sc_pkcs11_slot *slot;
-	sc_timestamp_t now;
 	CK_RV rv;
 
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_slot_id(slotID, &slot);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_GetSlotInfo(0x%lx)", slotID);
 
-	rv = slot_get_slot(slotID, &slot);
-	if (rv == CKR_OK){
-		if (slot->reader == NULL)
-			rv = CKR_TOKEN_NOT_PRESENT;
-		else {
-			now = get_current_time();
-			if (now >= slot->slot_state_expires || now == 0) {
-				/* Update slot status */
-				rv = card_detect(slot->reader);
-				/* Don't ask again within the next second */
-				slot->slot_state_expires = now + 1000;
-			}
-		}
-	}
+	if (slot->reader == NULL)
+		rv = CKR_TOKEN_NOT_PRESENT;
+	else if (slot->bind_pending)
+		/* present, the bind is left to the calls needing the token */
+		rv = CKR_OK;
+	else
+		/* Update slot status */
+		rv = card_detect_slot(slot);
+	if (rv == CKR_CRYPTOKI_NOT_INITIALIZED)
+		/* finalized meanwhile, the locks are gone */
+		return rv;
 	if (rv == CKR_TOKEN_NOT_PRESENT || rv == CKR_TOKEN_NOT_RECOGNIZED)
 		rv = CKR_OK;
 
@@ -501,6 +747,7 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 
 	sc_log(context, "C_GetSlotInfo(0x%lx) = %s", slotID, lookup_enum ( RV_T, rv ));
 	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -514,15 +761,19 @@ CK_RV C_GetMechanismList(CK_SLOT_ID slotID,
 	if (pulCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_slot_id(slotID, &slot);
 	if (rv != CKR_OK)
 		return rv;
 
 	rv = slot_get_token(slotID, &slot);
+	if (rv == CKR_CRYPTOKI_NOT_INITIALIZED)
+		/* finalized meanwhile, the locks are gone */
+		return rv;
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_get_mechanism_list(slot->card, pMechanismList, pulCount);
 
 	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -536,15 +787,19 @@ CK_RV C_GetMechanismInfo(CK_SLOT_ID slotID,
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_slot_id(slotID, &slot);
 	if (rv != CKR_OK)
 		return rv;
 
 	rv = slot_get_token(slotID, &slot);
+	if (rv == CKR_CRYPTOKI_NOT_INITIALIZED)
+		/* finalized meanwhile, the locks are gone */
+		return rv;
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_get_mechanism_info(slot->card, type, pInfo);
 
 	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -558,11 +813,14 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 	CK_RV rv;
 	unsigned int i;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_slot_id(slotID, &slot);
 	if (rv != CKR_OK)
 		return rv;
 
 	rv = slot_get_token(slotID, &slot);
+	if (rv == CKR_CRYPTOKI_NOT_INITIALIZED)
+		/* finalized meanwhile, the locks are gone */
+		return rv;
 	if (rv != CKR_OK)
 		goto out;
 
@@ -588,6 +846,7 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 	}
 
 out:	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -597,7 +856,6 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 {
 	sc_reader_t *found;
 	unsigned int mask, events;
-	void *reader_states = NULL;
 	CK_SLOT_ID slot_id;
 	CK_RV rv;
 	int r;
@@ -606,10 +864,6 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 		return  CKR_ARGUMENTS_BAD;
 
 	sc_log(context, "C_WaitForSlotEvent(block=%d)", !(flags & CKF_DONT_BLOCK));
-	/* Not all pcsc-lite versions implement consistently used functions as they are */
-	/* FIXME: add proper checking into build to check correct pcsc-lite version for SCardStatusChange/SCardCancel */
-	if (!(flags & CKF_DONT_BLOCK))
-		return CKR_FUNCTION_NOT_SUPPORTED;
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -622,13 +876,40 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 	}
 
 	rv = slot_find_changed(&slot_id, mask);
+	if (rv == CKR_CRYPTOKI_NOT_INITIALIZED)
+		/* finalized meanwhile, the locks are gone */
+		return rv;
 	if ((rv == CKR_OK) || (flags & CKF_DONT_BLOCK))
 		goto out;
 
 again:
-	sc_log(context, "C_WaitForSlotEvent() reader_states:%p", reader_states);
 	sc_pkcs11_unlock();
-	r = sc_wait_for_event(context, mask, &found, &events, -1, &reader_states);
+
+	sc_pkcs11_lock_wait();
+	if (in_finalize == 1) {
+		sc_pkcs11_unlock_wait();
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	/* The event may have been seen while another thread was waiting */
+	if ((rv = sc_pkcs11_lock()) != CKR_OK) {
+		sc_pkcs11_unlock_wait();
+		return rv;
+	}
+	rv = slot_find_changed(&slot_id, mask);
+	if (rv == CKR_CRYPTOKI_NOT_INITIALIZED) {
+		sc_pkcs11_unlock_wait();
+		return rv;
+	}
+	sc_pkcs11_unlock();
+	if (rv == CKR_OK) {
+		sc_pkcs11_unlock_wait();
+		if ((rv = sc_pkcs11_lock()) != CKR_OK)
+			return rv;
+		goto out;
+	}
+
+	r = sc_wait_for_event(context, mask, &found, &events, -1, NULL);
+	sc_pkcs11_unlock_wait();
 	if (sc_pkcs11_conf.plug_and_play && events & SC_EVENT_READER_ATTACHED) {
 		/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
 		   Change the first hotplug slot id on every call to make this happen. */
@@ -638,6 +919,7 @@ again:
 		rv = sc_pkcs11_lock();
 		if (rv != CKR_OK)
 			return rv;
+		slot_reader_event();
 
 		goto out;
 	}
@@ -647,6 +929,7 @@ again:
 
 	if ((rv = sc_pkcs11_lock()) != CKR_OK)
 		return rv;
+	slot_reader_event();
 
 	if (r != SC_SUCCESS) {
 		sc_log(context, "sc_wait_for_event() returned %d\n",  r);
@@ -657,6 +940,8 @@ again:
 	/* If no changed slot was found (maybe an unsupported card
 	 * was inserted/removed) then go waiting again */
 	rv = slot_find_changed(&slot_id, mask);
+	if (rv == CKR_CRYPTOKI_NOT_INITIALIZED)
+		return rv;
 	if (rv != CKR_OK)
 		goto again;
 
@@ -664,12 +949,6 @@ out:
 	if (pSlot)
 		*pSlot = slot_id;
 
-	/* Free allocated readers states holder */
-	if (reader_states)   {
-		sc_log(context, "free reader states");
-		sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
-	}
-
 	sc_log(context, "C_WaitForSlotEvent() = %s, event in 0x%lx", lookup_enum (RV_T, rv), *pSlot);
 	sc_pkcs11_unlock();
 	return rv;
@@ -726,6 +1005,8 @@ sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR args)
 	if (global_locking != NULL) {
 		/* create mutex */
 		rv = global_locking->CreateMutex(&global_lock);
+		if (rv == CKR_OK)
+			rv = global_locking->CreateMutex(&wait_lock);
 	}
 
 	return rv;
@@ -762,6 +1043,154 @@ void sc_pkcs11_unlock(void)
 	__sc_pkcs11_unlock(global_lock);
 }
 
+CK_RV sc_pkcs11_new_slot_lock(struct sc_pkcs11_card_lock **lock)
+{
+	struct sc_pkcs11_card_lock *l;
+
+	*lock = NULL;
+	if (!global_lock || !global_locking)
+		return CKR_OK;
+	l = calloc(1, sizeof(*l));
+	if (l == NULL)
+		return CKR_HOST_MEMORY;
+	if (global_locking->CreateMutex(&l->mutex) != CKR_OK
+			|| global_locking->CreateMutex(&l->gate) != CKR_OK
+			|| global_locking->CreateMutex(&l->count_lock) != CKR_OK) {
+		sc_pkcs11_free_slot_lock(l);
+		return CKR_CANT_LOCK;
+	}
+	*lock = l;
+	return CKR_OK;
+}
+
+void sc_pkcs11_free_slot_lock(struct sc_pkcs11_card_lock *lock)
+{
+	if (lock == NULL)
+		return;
+	if (global_locking) {
+		if (lock->mutex)
+			global_locking->DestroyMutex(lock->mutex);
+		if (lock->gate)
+			global_locking->DestroyMutex(lock->gate);
+		if (lock->count_lock)
+			global_locking->DestroyMutex(lock->count_lock);
+	}
+	free(lock);
+}
+
+static void take_mutex(void *mutex)
+{
+	while (global_locking->LockMutex(mutex) != CKR_OK)
+		;
+}
+
+static unsigned long long lock_time_us(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0 && !QueryPerformanceFrequency(&freq))
+		return 0;
+	QueryPerformanceCounter(&now);
+	return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000
+		+ (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* Returns the number of urgent callers waiting after adding delta */
+static unsigned int count_urgent(struct sc_pkcs11_card_lock *lock, int delta)
+{
+	unsigned int urgent;
+
+	take_mutex(lock->count_lock);
+	lock->urgent += delta;
+	urgent = lock->urgent;
+	__sc_pkcs11_unlock(lock->count_lock);
+	return urgent;
+}
+
+void sc_pkcs11_lock_slot(struct sc_pkcs11_slot *slot)
+{
+	sc_pkcs11_lock_slot_prio(slot, SC_LOCK_PRIO_NORMAL);
+}
+
+void sc_pkcs11_lock_slot_prio(struct sc_pkcs11_slot *slot, int prio)
+{
+	struct sc_pkcs11_card_lock *lock = slot->lock;
+	unsigned long long start;
+
+	if (!lock || !global_locking)
+		return;
+
+	start = lock_time_us();
+	if (prio == SC_LOCK_PRIO_URGENT) {
+		count_urgent(lock, 1);
+		take_mutex(lock->mutex);
+		count_urgent(lock, -1);
+	} else {
+		take_mutex(lock->gate);
+		take_mutex(lock->mutex);
+	}
+	lock->holder_prio = prio;
+	sc_count_lock_wait(slot->reader, prio, lock_time_us() - start);
+}
+
+void sc_pkcs11_unlock_slot(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_card_lock *lock = slot->lock;
+	int urgent;
+
+	if (!lock || !global_locking)
+		return;
+	urgent = lock->holder_prio == SC_LOCK_PRIO_URGENT;
+	__sc_pkcs11_unlock(lock->mutex);
+	if (!urgent)
+		__sc_pkcs11_unlock(lock->gate);
+}
+
+/* Called by the holder of the card between two chunks of a long read:
+ * a bulk caller lets the urgent callers waiting meanwhile go first.
+ * Returns 1 if the card was used by them. */
+int sc_pkcs11_yield_slot_lock(struct sc_pkcs11_card_lock *lock)
+{
+	if (!lock || !global_locking || lock->holder_prio != SC_LOCK_PRIO_BULK)
+		return 0;
+	if (count_urgent(lock, 0) == 0)
+		return 0;
+
+	__sc_pkcs11_unlock(lock->mutex);
+	/* the gate is kept: nobody else comes in meanwhile */
+	while (count_urgent(lock, 0) != 0) {
+#ifdef _WIN32
+		Sleep(1);
+#else
+		usleep(1000);
+#endif
+	}
+	take_mutex(lock->mutex);
+	lock->holder_prio = SC_LOCK_PRIO_BULK;
+	return 1;
+}
+
+static void sc_pkcs11_lock_wait(void)
+{
+	if (wait_lock && global_locking) {
+		while (global_locking->LockMutex(wait_lock) != CKR_OK)
+			;
+	}
+}
+
+static void sc_pkcs11_unlock_wait(void)
+{
+	__sc_pkcs11_unlock(wait_lock);
+}
+
 /*
  * Free the lock - note the lock must be held when
  * you come here
@@ -782,8 +1211,12 @@ void sc_pkcs11_free_lock(void)
 	 * all changed data to RAM */
 	__sc_pkcs11_unlock(tempLock);
 
-	if (global_locking)
+	if (global_locking) {
 		global_locking->DestroyMutex(tempLock);
+		if (wait_lock)
+			global_locking->DestroyMutex(wait_lock);
+	}
+	wait_lock = NULL;
 	global_locking = NULL;
 }
 
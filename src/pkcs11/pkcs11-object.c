@@ -37,6 +37,8 @@ static sc_pkcs11_mechanism_type_t find_mechanism = {
 	NULL,		/* md_init */
 	NULL,		/* md_update */
 	NULL,		/* md_final */
+	NULL,		/* md_get_state */
+	NULL,		/* md_set_state */
 	NULL,		/* sign_init */
 	NULL,		/* sign_update */
 	NULL,		/* sign_final */
@@ -56,63 +58,52 @@ sc_find_release(sc_pkcs11_operation_t *operation)
 	struct sc_pkcs11_find_operation *fop = (struct sc_pkcs11_find_operation *)operation;
 
 	sc_log(context,"freeing %d handles used %d  at %p", fop->allocated_handles, fop->num_handles, fop->handles);
-	if (fop->handles) {
+	if (fop->handles && fop->handles != fop->inline_handles)
 		free(fop->handles);
-		fop->handles = NULL;
-	}
+	fop->handles = NULL;
 }
 
 
+/* Returns with the session locked as sc_pkcs11_lock_session_prio() does */
 static CK_RV
-get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, int prio,
 		struct sc_pkcs11_session **session, struct sc_pkcs11_object **object)
 {
 	struct sc_pkcs11_session *sess;
 	CK_RV rv;
 
-	rv = get_session(hSession, &sess);
+	*session = NULL;
+	rv = sc_pkcs11_lock_session_prio(hSession, &sess, prio);
 	if (rv != CKR_OK)
 		return rv;
 
-	*object = list_seek(&sess->slot->objects, &hObject);
-	if (!*object)
+	*object = slot_find_object(sess->slot, hObject);
+	if (!*object) {
+		sc_pkcs11_unlock_session(sess);
 		return CKR_OBJECT_HANDLE_INVALID;
+	}
 	*session = sess;
 	return CKR_OK;
 }
 
 /* C_CreateObject can be called from C_DeriveKey
- * which is holding the sc_pkcs11_lock
+ * which is holding the lock of the session
  * So dont get the lock again. */
 static
-CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle */
+CK_RV sc_create_object_int(struct sc_pkcs11_session *session,	/* the locked session */
 		CK_ATTRIBUTE_PTR pTemplate,		/* the object's template */
 		CK_ULONG ulCount,			/* attributes in template */
-		CK_OBJECT_HANDLE_PTR phObject,		/* receives new object's handle. */
-		int use_lock)
+		CK_OBJECT_HANDLE_PTR phObject)		/* receives new object's handle. */
 {
 	CK_RV rv = CKR_OK;
-	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_card *card;
 
 	LOG_FUNC_CALLED(context);
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	if (use_lock) {
-	    rv = sc_pkcs11_lock();
-	    if (rv != CKR_OK)
-		return rv;
-	}
-
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 #if 0
 /* TODO DEE what should we check here */
 	if (!(session->flags & CKF_RW_SESSION)) {
@@ -126,9 +117,21 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 	else
 		rv = card->framework->create_object(session->slot, pTemplate, ulCount, phObject);
 
-out:
-	if (use_lock)
-		sc_pkcs11_unlock();
+	if (rv == CKR_OK) {
+		struct sc_pkcs11_object *object = slot_find_object(session->slot, *phObject);
+		CK_BBOOL is_token = TRUE;
+		CK_ATTRIBUTE token_attribute = {CKA_TOKEN, &is_token, sizeof(is_token)};
+
+		/* Session objects go with the session */
+		if (object && ((object->flags & SC_PKCS11_OBJECT_SESSION)
+				|| (object->ops->get_attribute(session, object, &token_attribute) == CKR_OK
+				&& is_token == FALSE))) {
+			rv = session_add_object(session, object);
+			if (rv != CKR_OK && object->ops->destroy_object)
+				object->ops->destroy_object(session, object);
+		}
+	}
+
 	LOG_FUNC_RETURN(context, rv);
 }
 
@@ -139,7 +142,20 @@ C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount,		/* attributes in template */
 		CK_OBJECT_HANDLE_PTR phObject)
 {
-	return sc_create_object_int(hSession, pTemplate, ulCount, phObject, 1);
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	if (pTemplate == NULL_PTR || ulCount == 0)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_create_object_int(session, pTemplate, ulCount, phObject);
+
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 
@@ -164,12 +180,8 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_BBOOL is_token = FALSE;
 	CK_ATTRIBUTE token_attribure = {CKA_TOKEN, &is_token, sizeof(is_token)};
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 	sc_log(context, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(hSession, hObject, SC_LOCK_PRIO_NORMAL, &session, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -179,13 +191,18 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		goto out;
 	}
 
-	if (object->ops->destroy_object == NULL)
+	if (object->ops->destroy_object == NULL) {
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
-	else
+	} else {
+		struct sc_pkcs11_session *owner = object->owner;
+
+		if (owner)
+			session_forget_object(owner, object);
 		rv = object->ops->destroy_object(session, object);
+	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -199,6 +216,180 @@ C_GetObjectSize(CK_SESSION_HANDLE hSession,	/* the session's handle */
 }
 
 
+/*
+ * The values C_GetAttributeValue() got from an object, so that the
+ * applications asking for the same attributes of every object again and
+ * again do not compute them every time. Valid for the slot they were read
+ * through as long as the generation of its objects does not change.
+ */
+struct attribute_cache_entry {
+	CK_ATTRIBUTE_TYPE type;
+	CK_RV rv;
+	CK_ULONG len;
+	void *value;
+};
+
+struct sc_pkcs11_attribute_cache {
+	struct sc_pkcs11_slot *slot;
+	unsigned int generation;
+	unsigned int count, allocated;
+	struct attribute_cache_entry *entries;
+};
+
+void
+sc_pkcs11_free_attribute_cache(struct sc_pkcs11_object *object)
+{
+	struct sc_pkcs11_attribute_cache *cache = object->attr_cache;
+	unsigned int i;
+
+	if (cache == NULL)
+		return;
+	for (i = 0; i < cache->count; i++) {
+		if (cache->entries[i].value) {
+			sc_mem_clear(cache->entries[i].value, cache->entries[i].len);
+			free(cache->entries[i].value);
+		}
+	}
+	free(cache->entries);
+	free(cache);
+	object->attr_cache = NULL;
+}
+
+static void
+cache_attribute(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object,
+		CK_ATTRIBUTE_TYPE type, CK_RV rv, void *value, CK_ULONG len)
+{
+	struct sc_pkcs11_attribute_cache *cache = object->attr_cache;
+	struct attribute_cache_entry *entry;
+
+	if (cache == NULL) {
+		cache = object->attr_cache = calloc(1, sizeof(*cache));
+		if (cache == NULL)
+			goto fail;
+		cache->slot = session->slot;
+		cache->generation = session->slot->objects_generation;
+	}
+	if (cache->count == cache->allocated) {
+		unsigned int allocated = cache->allocated ? 2 * cache->allocated : 16;
+
+		entry = realloc(cache->entries, allocated * sizeof(*entry));
+		if (entry == NULL)
+			goto fail;
+		cache->entries = entry;
+		cache->allocated = allocated;
+	}
+	entry = &cache->entries[cache->count++];
+	entry->type = type;
+	entry->rv = rv;
+	entry->value = value;
+	entry->len = len;
+	return;
+
+fail:
+	free(value);
+}
+
+static CK_RV
+get_cached_attribute(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object,
+		CK_ATTRIBUTE_PTR attr)
+{
+	struct sc_pkcs11_attribute_cache *cache = object->attr_cache;
+	CK_ATTRIBUTE tmp;
+	unsigned int i;
+	CK_RV rv;
+
+	if (cache && (cache->slot != session->slot
+				|| cache->generation != session->slot->objects_generation)) {
+		sc_pkcs11_free_attribute_cache(object);
+		cache = NULL;
+	}
+
+	for (i = 0; cache && i < cache->count; i++) {
+		struct attribute_cache_entry *entry = &cache->entries[i];
+
+		if (entry->type != attr->type)
+			continue;
+		if (entry->rv != CKR_OK)
+			return entry->rv;
+		if (attr->pValue == NULL_PTR) {
+			attr->ulValueLen = entry->len;
+			return CKR_OK;
+		}
+		if (attr->ulValueLen < entry->len) {
+			attr->ulValueLen = entry->len;
+			return CKR_BUFFER_TOO_SMALL;
+		}
+		memcpy(attr->pValue, entry->value, entry->len);
+		attr->ulValueLen = entry->len;
+		return CKR_OK;
+	}
+
+	/* Not cached yet: get the whole value once */
+	tmp.type = attr->type;
+	tmp.pValue = NULL_PTR;
+	tmp.ulValueLen = 0;
+	rv = object->ops->get_attribute(session, object, &tmp);
+	if (rv == CKR_ATTRIBUTE_TYPE_INVALID || rv == CKR_ATTRIBUTE_SENSITIVE) {
+		cache_attribute(session, object, attr->type, rv, NULL, 0);
+		return rv;
+	}
+	if (rv != CKR_OK || tmp.ulValueLen == (CK_ULONG) -1
+			|| (tmp.ulValueLen && (tmp.pValue = malloc(tmp.ulValueLen)) == NULL))
+		return object->ops->get_attribute(session, object, attr);
+
+	rv = object->ops->get_attribute(session, object, &tmp);
+	if (rv != CKR_OK) {
+		free(tmp.pValue);
+		return object->ops->get_attribute(session, object, attr);
+	}
+
+	if (attr->pValue == NULL_PTR) {
+		rv = CKR_OK;
+	} else if (attr->ulValueLen < tmp.ulValueLen) {
+		rv = CKR_BUFFER_TOO_SMALL;
+	} else {
+		if (tmp.ulValueLen)
+			memcpy(attr->pValue, tmp.pValue, tmp.ulValueLen);
+		rv = CKR_OK;
+	}
+	attr->ulValueLen = tmp.ulValueLen;
+
+	cache_attribute(session, object, attr->type, CKR_OK, tmp.pValue, tmp.ulValueLen);
+	return rv;
+}
+
+
+/* Lets the object read the card data of the attributes not cached yet in
+ * one go, rather than once per attribute */
+static void
+prefetch_attributes(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	struct sc_pkcs11_attribute_cache *cache = object->attr_cache;
+	CK_ATTRIBUTE_PTR missing;
+	CK_ULONG i, count = 0;
+	unsigned int j;
+
+	if (object->ops->prefetch_attributes == NULL)
+		return;
+	if (cache && (cache->slot != session->slot
+				|| cache->generation != session->slot->objects_generation))
+		cache = NULL;
+	missing = calloc(ulCount, sizeof(*missing));
+	if (missing == NULL)
+		return;
+	for (i = 0; i < ulCount; i++) {
+		for (j = 0; cache && j < cache->count; j++)
+			if (cache->entries[j].type == pTemplate[i].type)
+				break;
+		if (cache == NULL || j == cache->count)
+			missing[count++].type = pTemplate[i].type;
+	}
+	if (count)
+		object->ops->prefetch_attributes(session, object, missing, count);
+	free(missing);
+}
+
 CK_RV
 C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_OBJECT_HANDLE hObject,	/* the object's handle */
@@ -223,20 +414,18 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(hSession, hObject, SC_LOCK_PRIO_BULK, &session, &object);
 	if (rv != CKR_OK)
 		goto out;
 
 	/* Debug printf */
 	snprintf(object_name, sizeof(object_name), "Object %lu", (unsigned long)hObject);
 
+	prefetch_attributes(session, object, pTemplate, ulCount);
+
 	res_type = 0;
 	for (i = 0; i < ulCount; i++) {
-		res = object->ops->get_attribute(session, object, &pTemplate[i]);
+		res = get_cached_attribute(session, object, &pTemplate[i]);
 		if (res != CKR_OK)
 			pTemplate[i].ulValueLen = (CK_ULONG) - 1;
 
@@ -260,10 +449,12 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			rv = res;
 		}
 	}
+	if (object->ops->release_prefetched)
+		object->ops->release_prefetched(session, object);
 
 out:	sc_log(context, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = %s",
 			hSession, hObject, lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -282,13 +473,9 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(hSession, hObject, SC_LOCK_PRIO_NORMAL, &session, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -300,6 +487,7 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (object->ops->set_attribute == NULL)
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
 	else {
+		slot_objects_changed(session->slot);
 		for (i = 0; i < ulCount; i++) {
 			rv = object->ops->set_attribute(session, object, &pTemplate[i]);
 			if (rv != CKR_OK)
@@ -308,34 +496,199 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
 
+/*
+ * Index of the objects of a slot on the attributes C_FindObjectsInit() is
+ * usually given. The entries are in the order of the objects list and
+ * chained per key by the hash of the attribute value; the values are
+ * compared by cmp_attribute() as before, the index only picks the
+ * candidates. The index is dropped whenever the objects change.
+ */
+#define OBJECT_INDEX_BUCKETS	64
+
+/* in the order they are used for the search */
+static const CK_ATTRIBUTE_TYPE object_index_keys[] = { CKA_ID, CKA_LABEL, CKA_CLASS };
+#define OBJECT_INDEX_KEYS	(sizeof(object_index_keys) / sizeof(object_index_keys[0]))
+
+struct object_index_entry {
+	struct sc_pkcs11_object *object;
+	unsigned int hash[OBJECT_INDEX_KEYS];
+	int next[OBJECT_INDEX_KEYS];		/* next entry of the bucket or -1 */
+};
+
+struct sc_pkcs11_object_index {
+	unsigned int count;
+	struct object_index_entry *entries;
+	/* a key is unusable if some value could not be read for the index */
+	int usable[OBJECT_INDEX_KEYS];
+	int head[OBJECT_INDEX_KEYS][OBJECT_INDEX_BUCKETS];
+};
+
+static unsigned int
+object_index_hash(const void *value, CK_ULONG len)
+{
+	const unsigned char *p = value;
+	unsigned int hash = 2166136261U;
+
+	while (len--)
+		hash = (hash ^ *p++) * 16777619U;
+	return hash;
+}
+
+void
+sc_pkcs11_drop_object_index(struct sc_pkcs11_slot *slot)
+{
+	if (slot->object_index) {
+		free(slot->object_index->entries);
+		free(slot->object_index);
+		slot->object_index = NULL;
+	}
+}
+
+static struct sc_pkcs11_object_index *
+get_object_index(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	struct sc_pkcs11_object_index *index;
+	struct sc_pkcs11_object *object;
+	int *tail[OBJECT_INDEX_KEYS][OBJECT_INDEX_BUCKETS];
+	unsigned char value[256];
+	unsigned int i, k, count;
+
+	if (slot->object_index)
+		return slot->object_index;
+
+	index = calloc(1, sizeof(*index));
+	count = list_size(&slot->objects);
+	if (index == NULL || (count && (index->entries = calloc(count, sizeof(*index->entries))) == NULL)) {
+		free(index);
+		return NULL;
+	}
+	for (k = 0; k < OBJECT_INDEX_KEYS; k++) {
+		index->usable[k] = 1;
+		for (i = 0; i < OBJECT_INDEX_BUCKETS; i++) {
+			index->head[k][i] = -1;
+			tail[k][i] = &index->head[k][i];
+		}
+	}
+
+	list_iterator_start(&slot->objects);
+	while (index->count < count && (object = list_iterator_next(&slot->objects))) {
+		struct object_index_entry *entry = &index->entries[index->count];
+
+		entry->object = object;
+		for (k = 0; k < OBJECT_INDEX_KEYS; k++) {
+			CK_ATTRIBUTE attr = { object_index_keys[k], value, sizeof(value) };
+			CK_RV rv;
+
+			entry->next[k] = -1;
+			rv = object->ops->get_attribute(session, object, &attr);
+			if (rv == CKR_OK) {
+				entry->hash[k] = object_index_hash(value, attr.ulValueLen);
+				*tail[k][entry->hash[k] % OBJECT_INDEX_BUCKETS] = index->count;
+				tail[k][entry->hash[k] % OBJECT_INDEX_BUCKETS] = &entry->next[k];
+			} else if (rv == CKR_BUFFER_TOO_SMALL) {
+				index->usable[k] = 0;
+			}
+			/* otherwise cmp_attribute() finds no match either */
+		}
+		index->count++;
+	}
+	list_iterator_stop(&slot->objects);
+
+	slot->object_index = index;
+	return index;
+}
+
+
+/* Adds the object to the results of the search if it matches the template;
+ * fails only if the results can not grow */
+static CK_RV
+find_object_match(struct sc_pkcs11_session *session, struct sc_pkcs11_find_operation *operation,
+		struct sc_pkcs11_object *object, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+		int hide_private)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	CK_BBOOL is_private = TRUE;
+	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
+	unsigned int j;
+
+	sc_log(context, "Object with handle 0x%lx", object->handle);
+
+	/* User not logged in and private object? */
+	if (hide_private) {
+		if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
+			return CKR_OK;
+		if (is_private) {
+			sc_log(context, "Object %d/%d: Private object and not logged in.",
+				 slot->id, object->handle);
+			return CKR_OK;
+		}
+	}
+
+	/* Try to match every attribute */
+	for (j = 0; j < ulCount; j++) {
+		if (object->ops->cmp_attribute(session, object, &pTemplate[j]) == 0) {
+			sc_log(context, "Object %d/%d: Attribute 0x%x does NOT match.",
+				 slot->id, object->handle, pTemplate[j].type);
+			return CKR_OK;
+		}
+
+		if (context->debug >= 4) {
+			sc_log(context, "Object %d/%d: Attribute 0x%x matches.",
+				 slot->id, object->handle, pTemplate[j].type);
+		}
+	}
+
+	sc_log(context, "Object %d/%d matches\n", slot->id, object->handle);
+	/* Realloc handles - remove restriction on only 32 matching objects -dee */
+	if (operation->num_handles >= operation->allocated_handles) {
+		CK_OBJECT_HANDLE *handles;
+		int allocated = operation->handles != operation->inline_handles
+			? 2 * operation->allocated_handles : SC_PKCS11_FIND_INC_HANDLES;
+
+		sc_log(context, "realloc for %d handles", allocated);
+		if (operation->handles == operation->inline_handles) {
+			handles = malloc(sizeof(CK_OBJECT_HANDLE) * allocated);
+			if (handles != NULL)
+				memcpy(handles, operation->inline_handles,
+						sizeof(operation->inline_handles));
+		} else {
+			handles = realloc(operation->handles, sizeof(CK_OBJECT_HANDLE) * allocated);
+		}
+		if (handles == NULL)
+			return CKR_HOST_MEMORY;
+		operation->handles = handles;
+		operation->allocated_handles = allocated;
+	}
+	operation->handles[operation->num_handles++] = object->handle;
+	return CKR_OK;
+}
+
+
 CK_RV
 C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ATTRIBUTE_PTR pTemplate,	/* attribute values to match */
 		CK_ULONG ulCount)		/* attributes in search template */
 {
 	CK_RV rv;
-	CK_BBOOL is_private = TRUE;
-	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
-	int match, hide_private;
-	unsigned int i, j;
+	int hide_private;
+	unsigned int i, j, k, hash = 0;
+	int e;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_find_operation *operation;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_object_index *index;
 
 	if (pTemplate == NULL_PTR && ulCount > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session_prio(hSession, &session, SC_LOCK_PRIO_BULK);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -349,8 +702,8 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	operation->current_handle = 0;
 	operation->num_handles = 0;
-	operation->allocated_handles = 0;
-	operation->handles = NULL;
+	operation->allocated_handles = SC_PKCS11_FIND_INLINE_HANDLES;
+	operation->handles = operation->inline_handles;
 	slot = session->slot;
 
 	/* Check whether we should hide private objects */
@@ -358,61 +711,62 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (slot->login_user != CKU_USER && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
 		hide_private = 1;
 
-	/* For each object in token do */
-	for (i=0; i<list_size(&slot->objects); i++) {
-		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
-		sc_log(context, "Object with handle 0x%lx", object->handle);
-
-		/* User not logged in and private object? */
-		if (hide_private) {
-			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
-			        continue;
-			if (is_private) {
-				sc_log(context, "Object %d/%d: Private object and not logged in.",
-					 slot->id, object->handle);
+	/* Walk the bucket of the first indexed key in the template, if any */
+	index = get_object_index(session);
+	k = OBJECT_INDEX_KEYS;
+	if (index) {
+		for (k = 0; k < OBJECT_INDEX_KEYS; k++) {
+			if (!index->usable[k])
 				continue;
-			}
-		}
-
-		/* Try to match every attribute */
-		match = 1;
-		for (j = 0; j < ulCount; j++) {
-			rv = object->ops->cmp_attribute(session, object, &pTemplate[j]);
-			if (rv == 0) {
-				sc_log(context, "Object %d/%d: Attribute 0x%x does NOT match.",
-					 slot->id, object->handle, pTemplate[j].type);
-				match = 0;
+			for (j = 0; j < ulCount; j++)
+				if (pTemplate[j].type == object_index_keys[k] && pTemplate[j].pValue)
+					break;
+			if (j < ulCount) {
+				hash = object_index_hash(pTemplate[j].pValue, pTemplate[j].ulValueLen);
 				break;
 			}
-
-			if (context->debug >= 4) {
-				sc_log(context, "Object %d/%d: Attribute 0x%x matches.",
-					 slot->id, object->handle, pTemplate[j].type);
-			}
 		}
+	}
+	e = index && k < OBJECT_INDEX_KEYS ? index->head[k][hash % OBJECT_INDEX_BUCKETS] : 0;
 
-		if (match) {
-			sc_log(context, "Object %d/%d matches\n", slot->id, object->handle);
-			/* Realloc handles - remove restriction on only 32 matching objects -dee */
-			if (operation->num_handles >= operation->allocated_handles) {
-				operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
-				sc_log(context, "realloc for %d handles", operation->allocated_handles);
-				operation->handles = realloc(operation->handles,
-					sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
-				if (operation->handles == NULL) {
-					rv = CKR_HOST_MEMORY;
-					break;
-				}
-			}
-			operation->handles[operation->num_handles++] = object->handle;
+	/* For each object in token do */
+	for (i = 0; ; i++) {
+		if (index && k < OBJECT_INDEX_KEYS) {
+			struct object_index_entry *entry;
+
+			if (e < 0)
+				break;
+			entry = &index->entries[e];
+			e = entry->next[k];
+			if (entry->hash[k] != hash)
+				continue;
+			object = entry->object;
+		} else if (index) {
+			if (i >= index->count)
+				break;
+			object = index->entries[i].object;
+		} else {
+			if (i >= list_size(&slot->objects))
+				break;
+			object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
 		}
+		if (find_object_match(session, operation, object, pTemplate, ulCount, hide_private) != CKR_OK)
+			goto done;
 	}
+
+	/* The session objects are not in the index */
+	i = 0;
+	while ((object = slot_next_session_object(slot, &i)) != NULL)
+		if (find_object_match(session, operation, object, pTemplate, ulCount, hide_private) != CKR_OK)
+			break;
+
+done:
 	rv = CKR_OK;
 
 	sc_log(context, "%d matching objects\n", operation->num_handles);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -431,11 +785,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (phObject == NULL_PTR || ulMaxObjectCount == 0 || pulObjectCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -453,7 +803,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	operation->current_handle += to_return;
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -464,11 +814,7 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -476,7 +822,7 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 	if (rv == CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -494,17 +840,13 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 	sc_log(context, "C_DigestInit(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_init(session, pMechanism);
 
 	sc_log(context, "C_DigestInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -519,12 +861,8 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 	sc_log(context, "C_Digest(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_use_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -533,7 +871,7 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 out:	sc_log(context, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_release_session(session);
 	return rv;
 }
 
@@ -546,16 +884,12 @@ C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_use_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_DigestUpdate() == %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_release_session(session);
 	return rv;
 }
 
@@ -576,16 +910,12 @@ C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_use_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 	sc_log(context, "C_DigestFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_release_session(session);
 	return rv;
 }
 
@@ -606,11 +936,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(hSession, hKey, SC_LOCK_PRIO_URGENT, &session, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -637,7 +963,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -653,11 +979,8 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	struct sc_pkcs11_session *session;
 	CK_ULONG length;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	SC_PKCS11_TRACE_BEGIN("C_Sign", ulDataLen);
+	rv = sc_pkcs11_lock_session_prio(hSession, &session, SC_LOCK_PRIO_URGENT);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -675,13 +998,64 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		goto out;
 	}
 
+	if (sc_pkcs11_conf.key_pool) {
+		/* gives up the lock */
+		rv = sc_pkcs11_sign_pooled(session, pData, ulDataLen, pSignature, pulSignatureLen);
+		session = NULL;
+		goto out;
+	}
+
 	rv = sc_pkcs11_sign_update(session, pData, ulDataLen);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
 
 out:
+	SC_PKCS11_TRACE_END("C_Sign", rv);
 	sc_log(context, "C_Sign() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
+	return rv;
+}
+
+
+CK_RV
+C_SignBatch(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_ULONG ulCount,		/* number of inputs */
+		CK_BYTE_PTR *pData,		/* the data (digests) to be signed */
+		CK_ULONG_PTR pulDataLen,	/* count of bytes of each input */
+		CK_BYTE_PTR *pSignature,	/* receive the signatures */
+		CK_ULONG_PTR pulSignatureLen)	/* receive byte counts of the signatures */
+{
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	CK_ULONG length, i;
+
+	if (ulCount == 0 || pData == NULL_PTR || pulDataLen == NULL_PTR || pulSignatureLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session_prio(hSession, &session, SC_LOCK_PRIO_URGENT);
+	if (rv != CKR_OK)
+		goto out;
+
+	/* As with C_Sign(), a length inquiry or a buffer too small
+	 * does not end the operation */
+	if ((rv = sc_pkcs11_sign_size(session, &length)) != CKR_OK)
+		goto out;
+
+	for (i = 0; i < ulCount; i++)
+		if (pSignature == NULL || pSignature[i] == NULL || length > pulSignatureLen[i])
+			break;
+	if (i < ulCount) {
+		for (i = 0; i < ulCount; i++)
+			pulSignatureLen[i] = length;
+		rv = pSignature ? CKR_BUFFER_TOO_SMALL : CKR_OK;
+		goto out;
+	}
+
+	rv = sc_pkcs11_sign_batch(session, ulCount, pData, pulDataLen, pSignature, pulSignatureLen);
+
+out:
+	sc_log(context, "C_SignBatch(%lu) = %s", ulCount, lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -694,16 +1068,12 @@ C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_use_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_release_session(session);
 	return rv;
 }
 
@@ -717,11 +1087,8 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	CK_ULONG length;
 	CK_RV rv;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	SC_PKCS11_TRACE_BEGIN("C_SignFinal", 0);
+	rv = sc_pkcs11_lock_session_prio(hSession, &session, SC_LOCK_PRIO_URGENT);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -741,8 +1108,9 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	}
 
 out:
+	SC_PKCS11_TRACE_END("C_SignFinal", rv);
 	sc_log(context, "C_SignFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -766,11 +1134,7 @@ C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(hSession, hKey, SC_LOCK_PRIO_URGENT, &session, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -801,7 +1165,7 @@ C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_SignRecoverInit() = %sn", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -822,7 +1186,50 @@ C_EncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_MECHANISM_PTR pMechanism,	/* the encryption mechanism */
 		CK_OBJECT_HANDLE hKey)		/* handle of encryption key */
 {
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	CK_BBOOL can_encrypt;
+	CK_OBJECT_CLASS key_class;
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE encrypt_attribute = { CKA_ENCRYPT,	&can_encrypt,	sizeof(can_encrypt) };
+	CK_ATTRIBUTE class_attr = { CKA_CLASS,	&key_class,	sizeof(key_class) };
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE,	&key_type,	sizeof(key_type) };
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *object;
+	CK_RV rv;
+
+	if (pMechanism == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = get_object_from_session(hSession, hKey, SC_LOCK_PRIO_NORMAL, &session, &object);
+	if (rv != CKR_OK) {
+		if (rv == CKR_OBJECT_HANDLE_INVALID)
+			rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+
+	/* Public keys, the encryption is done on the host, or secret keys
+	 * of the card */
+	rv = object->ops->get_attribute(session, object, &class_attr);
+	if (rv != CKR_OK || (key_class != CKO_PUBLIC_KEY
+				&& (key_class != CKO_SECRET_KEY || object->ops->encrypt == NULL))) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+	rv = object->ops->get_attribute(session, object, &encrypt_attribute);
+	if (rv != CKR_OK || !can_encrypt) {
+		rv = CKR_KEY_FUNCTION_NOT_PERMITTED;
+		goto out;
+	}
+	rv = object->ops->get_attribute(session, object, &key_type_attr);
+	if (rv != CKR_OK) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		goto out;
+	}
+
+	rv = sc_pkcs11_encr_init(session, pMechanism, object, key_type);
+
+out:	sc_log(context, "C_EncryptInit() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 
@@ -832,7 +1239,17 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_BYTE_PTR pEncryptedData,	/* receives encrypted data */
 		CK_ULONG_PTR pulEncryptedDataLen)
 {				/* receives encrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_encr(session, pData, ulDataLen,
+				pEncryptedData, pulEncryptedDataLen);
+
+	sc_log(context, "C_Encrypt() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -841,14 +1258,33 @@ CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		      CK_BYTE_PTR pEncryptedPart,	/* receives encrypted data */
 		      CK_ULONG_PTR pulEncryptedPartLen)
 {				/* receives encrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_encr_update(session, pPart, ulPartLen,
+				pEncryptedPart, pulEncryptedPartLen);
+
+	sc_log(context, "C_EncryptUpdate() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		     CK_BYTE_PTR pLastEncryptedPart,	/* receives encrypted last part */
 		     CK_ULONG_PTR pulLastEncryptedPartLen)
 {				/* receives byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_encr_final(session, pLastEncryptedPart, pulLastEncryptedPartLen);
+
+	sc_log(context, "C_EncryptFinal() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -867,11 +1303,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(hSession, hKey, SC_LOCK_PRIO_URGENT, &session, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -901,7 +1333,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_decr_init(session, pMechanism, object, key_type);
 
 out:	sc_log(context, "C_DecryptInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -914,17 +1346,15 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	SC_PKCS11_TRACE_BEGIN("C_Decrypt", ulEncryptedDataLen);
+	rv = sc_pkcs11_lock_session_prio(hSession, &session, SC_LOCK_PRIO_URGENT);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
 				pData, pulDataLen);
+	SC_PKCS11_TRACE_END("C_Decrypt", rv);
 
 	sc_log(context, "C_Decrypt() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -934,14 +1364,33 @@ CK_RV C_DecryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		      CK_BYTE_PTR pPart,	/* receives decrypted output */
 		      CK_ULONG_PTR pulPartLen)
 {				/* receives decrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_decr_update(session, pEncryptedPart, ulEncryptedPartLen,
+				pPart, pulPartLen);
+
+	sc_log(context, "C_DecryptUpdate() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 CK_RV C_DecryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		     CK_BYTE_PTR pLastPart,	/* receives decrypted output */
 		     CK_ULONG_PTR pulLastPartLen)
 {				/* receives decrypted byte count */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_decr_final(session, pLastPart, pulLastPartLen);
+
+	sc_log(context, "C_DecryptFinal() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 CK_RV C_DigestEncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -1007,14 +1456,10 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			|| (pPrivateKeyTemplate == NULL_PTR && ulPrivateKeyAttributeCount > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PrivKey attrs", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PubKey attrs", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -1033,7 +1478,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 				phPublicKey, phPrivateKey);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1081,11 +1526,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_object_from_session(hSession, hBaseKey, &session, &object);
+	rv = get_object_from_session(hSession, hBaseKey, SC_LOCK_PRIO_URGENT, &session, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1114,20 +1555,23 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	switch(key_type) {
 	    case CKK_EC:
 
-		rv = sc_create_object_int(hSession, pTemplate, ulAttributeCount, phKey, 0);
+		rv = sc_create_object_int(session, pTemplate, ulAttributeCount, phKey);
 		if (rv != CKR_OK)
 		    goto out;
 
-		rv = get_object_from_session(hSession, *phKey, &session, &key_object);
-		if (rv != CKR_OK) {
-		if (rv == CKR_OBJECT_HANDLE_INVALID)
+		key_object = slot_find_object(session->slot, *phKey);
+		if (!key_object) {
 			rv = CKR_KEY_HANDLE_INVALID;
 			goto out;
 		}
 
 		rv = sc_pkcs11_deri(session, pMechanism, object, key_type,
 			hSession, *phKey, key_object);
-		/* TODO if (rv != CK_OK) need to destroy the object */
+		if (rv != CKR_OK && key_object->ops->destroy_object) {
+			if (key_object->owner)
+				session_forget_object(key_object->owner, key_object);
+			key_object->ops->destroy_object(session, key_object);
+		}
 
 		break;
 	    default:
@@ -1135,7 +1579,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1154,11 +1598,7 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv == CKR_OK) {
 		slot = session->slot;
 		if (slot->card->framework->get_random == NULL)
@@ -1167,7 +1607,7 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			rv = slot->card->framework->get_random(slot, RandomData, ulRandomLen);
 	}
 
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1201,12 +1641,8 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(hSession, hKey, SC_LOCK_PRIO_NORMAL, &session, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1228,7 +1664,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_verif_init(session, pMechanism, object, key_type);
 
 out:	sc_log(context, "C_VerifyInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1245,11 +1681,7 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -1258,7 +1690,7 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
 out:	sc_log(context, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1273,16 +1705,12 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_use_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_VerifyUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_release_session(session);
 	return rv;
 #endif
 }
@@ -1297,16 +1725,12 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
-	if (rv != CKR_OK)
-		return rv;
-
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
 	sc_log(context, "C_VerifyFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
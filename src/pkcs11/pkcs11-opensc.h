@@ -9,4 +9,18 @@
  */
 #define CKA_OPENSC_NON_REPUDIATION      (CKA_VENDOR_DEFINED | 1UL)
 
+/*
+ * C_SignBatch() is exported by the module next to C_GetFunctionList().
+ * After C_SignInit() it signs ulCount independent inputs, each one as
+ * C_Sign() would, keeping the key selected on the card in between, and
+ * ends the signing operation. With pSignature NULL only the signature
+ * lengths are returned and the operation stays active.
+ */
+typedef CK_RV (*CK_C_SignBatch)(CK_SESSION_HANDLE hSession, CK_ULONG ulCount,
+		CK_BYTE_PTR *pData, CK_ULONG_PTR pulDataLen,
+		CK_BYTE_PTR *pSignature, CK_ULONG_PTR pulSignatureLen);
+CK_RV C_SignBatch(CK_SESSION_HANDLE hSession, CK_ULONG ulCount,
+		CK_BYTE_PTR *pData, CK_ULONG_PTR pulDataLen,
+		CK_BYTE_PTR *pSignature, CK_ULONG_PTR pulSignatureLen);
+
 #endif
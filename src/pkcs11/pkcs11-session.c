@@ -26,14 +26,318 @@
 
 #include "sc-pkcs11.h"
 
+/* The session handles index a table: the low bits are the entry plus one,
+ * the high bits the generation of the entry, which changes whenever a
+ * session is closed so that stale handles do not resolve. The table is
+ * changed and read with the global lock held. */
+#define SESSION_INDEX_BITS	16
+#define SESSION_INDEX_MASK	((1UL << SESSION_INDEX_BITS) - 1)
+
+struct session_entry {
+	struct sc_pkcs11_session *session;
+	CK_ULONG generation;
+};
+
+static struct session_entry *session_table = NULL;
+static size_t session_table_size = 0;
+static size_t session_table_free = 0;	/* lowest entry that may be free */
+
+static CK_RV session_table_add(struct sc_pkcs11_session *session)
+{
+	struct session_entry *entry;
+	size_t i;
+
+	for (i = session_table_free; i < session_table_size; i++)
+		if (session_table[i].session == NULL)
+			break;
+	if (i == session_table_size) {
+		size_t size = session_table_size ? 2 * session_table_size : 16;
+
+		if (size > SESSION_INDEX_MASK)
+			size = SESSION_INDEX_MASK;
+		if (i >= size)
+			return CKR_SESSION_COUNT;
+		entry = realloc(session_table, size * sizeof(*entry));
+		if (entry == NULL)
+			return CKR_HOST_MEMORY;
+		memset(entry + session_table_size, 0,
+				(size - session_table_size) * sizeof(*entry));
+		session_table = entry;
+		session_table_size = size;
+	}
+
+	entry = &session_table[i];
+	entry->session = session;
+	session->handle = (CK_SESSION_HANDLE) ((entry->generation << SESSION_INDEX_BITS) | (i + 1));
+	session_table_free = i + 1;
+	return CKR_OK;
+}
+
+static void session_table_remove(struct sc_pkcs11_session *session)
+{
+	size_t i = (session->handle & SESSION_INDEX_MASK) - 1;
+
+	session_table[i].session = NULL;
+	session_table[i].generation++;
+	if (i < session_table_free)
+		session_table_free = i;
+}
+
+/* Called by C_Finalize() */
+void sc_pkcs11_free_session_table(void)
+{
+	free(session_table);
+	session_table = NULL;
+	session_table_size = session_table_free = 0;
+}
+
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
 {
-	*session = list_seek(&sessions, &hSession);
-	if (!*session)
+	size_t i = hSession & SESSION_INDEX_MASK;
+
+	*session = NULL;
+	if (i == 0 || i > session_table_size)
+		return CKR_SESSION_HANDLE_INVALID;
+	*session = session_table[i - 1].session;
+	if (!*session || (*session)->handle != hSession) {
+		*session = NULL;
 		return CKR_SESSION_HANDLE_INVALID;
+	}
+	return CKR_OK;
+}
+
+/* Looks the session up and locks its slot for the card I/O. On success
+ * only the slot lock is held, release it with sc_pkcs11_unlock_session().
+ * On failure no lock is held and *session is NULL. */
+CK_RV sc_pkcs11_lock_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
+{
+	return sc_pkcs11_lock_session_prio(hSession, session, SC_LOCK_PRIO_NORMAL);
+}
+
+/* The card is given to the callers waiting with SC_LOCK_PRIO_URGENT first */
+CK_RV sc_pkcs11_lock_session_prio(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session,
+		int prio)
+{
+	struct sc_pkcs11_slot *slot;
+	CK_RV rv;
+
+	*session = NULL;
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+	rv = get_session(hSession, session);
+	slot = rv == CKR_OK ? (*session)->slot : NULL;
+	sc_pkcs11_unlock();
+	if (rv != CKR_OK)
+		return rv;
+
+	sc_pkcs11_lock_slot_prio(slot, prio);
+
+	/* The session may have been closed while the slot was busy */
+	rv = sc_pkcs11_lock();
+	if (rv == CKR_OK) {
+		rv = get_session(hSession, session);
+		if (rv == CKR_OK && (*session)->slot != slot)
+			rv = CKR_SESSION_HANDLE_INVALID;
+		sc_pkcs11_unlock();
+	}
+	if (rv != CKR_OK) {
+		*session = NULL;
+		sc_pkcs11_unlock_slot(slot);
+	}
+	return rv;
+}
+
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *session)
+{
+	if (session)
+		sc_pkcs11_unlock_slot(session->slot);
+}
+
+/* Looks the session up for work that does not touch the card, such as the
+ * hashing in the multi-part digest, sign and verify operations. No lock is
+ * held on return: the session stays allocated until it is given back with
+ * sc_pkcs11_release_session(), a close in the meantime only invalidates
+ * its handle. As with any session, the application must not use it from
+ * two threads at the same time. */
+CK_RV sc_pkcs11_use_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
+{
+	CK_RV rv;
+
+	*session = NULL;
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+	rv = get_session(hSession, session);
+	if (rv == CKR_OK)
+		(*session)->host_users++;
+	sc_pkcs11_unlock();
+	return rv;
+}
+
+void sc_pkcs11_release_session(struct sc_pkcs11_session *session)
+{
+	int closed;
+
+	if (!session || sc_pkcs11_lock() != CKR_OK)
+		return;
+	closed = --session->host_users == 0 && session->handle == CK_INVALID_HANDLE;
+	sc_pkcs11_unlock();
+	if (closed)
+		sc_pkcs11_free_session(session);
+}
+
+void sc_pkcs11_free_session(struct sc_pkcs11_session *session)
+{
+	session_free_spares(session);
+	free(session->objects);
+	free(session);
+}
+
+/* Records a session object of the session */
+CK_RV session_add_object(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object)
+{
+	CK_OBJECT_HANDLE *objects;
+
+	objects = realloc(session->objects, (session->nobjects + 1) * sizeof(*objects));
+	if (objects == NULL)
+		return CKR_HOST_MEMORY;
+	session->objects = objects;
+	object->owner_index = session->nobjects;
+	session->objects[session->nobjects++] = object->handle;
+	object->owner = session;
 	return CKR_OK;
 }
 
+/* The last object takes the place of the one forgotten */
+void session_forget_object(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object)
+{
+	struct sc_pkcs11_object *last;
+	unsigned int i = object->owner_index;
+
+	if (i >= session->nobjects || session->objects[i] != object->handle)
+		for (i = 0; i < session->nobjects; i++)
+			if (session->objects[i] == object->handle)
+				break;
+	if (i < session->nobjects) {
+		session->objects[i] = session->objects[--session->nobjects];
+		if (i < session->nobjects
+				&& (last = slot_find_object(session->slot, session->objects[i])) != NULL)
+			last->owner_index = i;
+	}
+	object->owner = NULL;
+}
+
+/* Session objects are destroyed when their session is closed */
+static void destroy_session_objects(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_object *object;
+
+	while (session->nobjects) {
+		object = slot_find_object(session->slot, session->objects[--session->nobjects]);
+		/* gone with the token already */
+		if (object == NULL || object->owner != session)
+			continue;
+		object->owner = NULL;
+		if (session->slot->card && object->ops->destroy_object)
+			object->ops->destroy_object(session, object);
+	}
+}
+
+/* C_GetSessionInfo() reads the login state with only the global lock held */
+static void set_login_user(struct sc_pkcs11_slot *slot, int login_user)
+{
+	CK_RV rv;
+
+	rv = sc_pkcs11_lock();
+	slot->login_user = login_user;
+	if (rv == CKR_OK)
+		sc_pkcs11_unlock();
+	/* the objects may read differently now */
+	slot_objects_changed(slot);
+}
+
+/* Tokens of the card logged in together, see login_shared_slots() */
+static unsigned int login_groups;
+
+/* The slots of the card, but the slot itself, with the login group given
+ * or without a login at all for a group of 0; called with the global lock */
+static struct sc_pkcs11_slot **card_peer_slots(struct sc_pkcs11_slot *slot,
+		unsigned int group, unsigned int *count)
+{
+	struct sc_pkcs11_slot **peers;
+	unsigned int i;
+
+	*count = 0;
+	peers = calloc(list_size(&virtual_slots), sizeof(*peers));
+	for (i = 0; peers && i < list_size(&virtual_slots); i++) {
+		struct sc_pkcs11_slot *peer = (struct sc_pkcs11_slot *) list_get_at(&virtual_slots, i);
+
+		if (peer == slot || peer->card != slot->card)
+			continue;
+		if (group ? peer->login_group == group : peer->login_user < 0)
+			peers[(*count)++] = peer;
+	}
+	return peers;
+}
+
+/* A login with a PIN the card knows for several applications logs in their
+ * tokens too. Called with the slot lock, shared by the slots of the card. */
+static void login_shared_slots(struct sc_pkcs11_slot *slot, CK_USER_TYPE userType,
+		CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+	struct sc_pkcs11_slot **peers;
+	unsigned int i, count, group;
+
+	if (slot->card->framework->login_shared == NULL || sc_pkcs11_lock() != CKR_OK)
+		return;
+	peers = card_peer_slots(slot, 0, &count);
+	if (++login_groups == 0)
+		login_groups = 1;
+	group = login_groups;
+	sc_pkcs11_unlock();
+
+	for (i = 0; i < count; i++) {
+		if (slot->card->framework->login_shared(slot, peers[i], userType, pPin, ulPinLen) != CKR_OK)
+			continue;
+		sc_log(context, "Slot 0x%lx logged in with slot 0x%lx", peers[i]->id, slot->id);
+		slot->login_group = peers[i]->login_group = group;
+		set_login_user(peers[i], userType);
+	}
+	free(peers);
+}
+
+/* The card forgot the PIN for the slots logged in together with the slot.
+ * Called with the slot lock held, and the global lock as well if locked. */
+static void logout_shared_slots(struct sc_pkcs11_slot *slot, int locked)
+{
+	struct sc_pkcs11_slot **peers;
+	unsigned int i, count, group = slot->login_group;
+
+	if (group == 0 || (!locked && sc_pkcs11_lock() != CKR_OK))
+		return;
+	slot->login_group = 0;
+	peers = card_peer_slots(slot, group, &count);
+	for (i = 0; i < count; i++)
+		peers[i]->login_group = 0;
+	if (!locked)
+		sc_pkcs11_unlock();
+
+	for (i = 0; i < count; i++) {
+		if (peers[i]->login_user < 0)
+			continue;
+		sc_log(context, "Slot 0x%lx logged out with slot 0x%lx", peers[i]->id, slot->id);
+		if (locked) {
+			peers[i]->login_user = -1;
+			slot_objects_changed(peers[i]);
+		} else {
+			set_login_user(peers[i], -1);
+		}
+		peers[i]->card->framework->logout(peers[i]);
+	}
+	free(peers);
+}
+
 CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 		    CK_FLAGS flags,	/* defined in CK_SESSION_INFO */
 		    CK_VOID_PTR pApplication,	/* pointer passed to callback */
@@ -50,13 +354,16 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	if (flags & ~(CKF_SERIAL_SESSION | CKF_RW_SESSION))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_slot_id(slotID, &slot);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_OpenSession(0x%lx)", slotID);
 
 	rv = slot_get_token(slotID, &slot);
+	if (rv == CKR_CRYPTOKI_NOT_INITIALIZED)
+		/* finalized meanwhile, the locks are gone */
+		return rv;
 	if (rv != CKR_OK)
 		goto out;
 
@@ -72,12 +379,17 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 		goto out;
 	}
 
+	rv = session_table_add(session);
+	if (rv != CKR_OK) {
+		free(session);
+		goto out;
+	}
+
 	session->slot = slot;
 	session->notify_callback = Notify;
 	session->notify_data = pApplication;
 	session->flags = flags;
 	slot->nsessions++;
-	session->handle = (CK_SESSION_HANDLE) session;	/* cast a pointer to long */
 	list_append(&sessions, session);
 	*phSession = session->handle;
 	sc_log(context, "C_OpenSession handle: 0x%lx", session->handle);
@@ -85,11 +397,12 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 out:
 	sc_log(context, "C_OpenSession() = %s", lookup_enum(RV_T, rv));
 	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
 /* Internal version of C_CloseSession that gets called with
- * the global lock held */
+ * the lock of the session's slot and the global lock held */
 static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 {
 	struct sc_pkcs11_slot *slot;
@@ -97,27 +410,35 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 
 	sc_log(context, "real C_CloseSession(0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session)
+	if (get_session(hSession, &session) != CKR_OK)
 		return CKR_SESSION_HANDLE_INVALID;
 
+	destroy_session_objects(session);
+
 	/* If we're the last session using this slot, make sure
 	 * we log out */
 	slot = session->slot;
 	slot->nsessions--;
 	if (slot->nsessions == 0 && slot->login_user >= 0) {
 		slot->login_user = -1;
+		slot_objects_changed(slot);
 		slot->card->framework->logout(slot);
+		logout_shared_slots(slot, 1);
 	}
 
 	if (list_delete(&sessions, session) != 0)
 		sc_log(context, "Could not delete session from list!");
-	free(session);
+	session_table_remove(session);
+	if (session->host_users)
+		/* freed by the last sc_pkcs11_release_session() */
+		session->handle = CK_INVALID_HANDLE;
+	else
+		sc_pkcs11_free_session(session);
 	return CKR_OK;
 }
 
 /* Internal version of C_CloseAllSessions that gets called with
- * the global lock held */
+ * the slot lock and the global lock held */
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 {
 	CK_RV rv = CKR_OK;
@@ -136,16 +457,23 @@ CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
+	slot = session->slot;
 
-	sc_log(context, "C_CloseSession(0x%lx)", hSession);
+	rv = sc_pkcs11_lock();
+	if (rv == CKR_OK) {
+		sc_log(context, "C_CloseSession(0x%lx)", hSession);
 
-	rv = sc_pkcs11_close_session(hSession);
+		rv = sc_pkcs11_close_session(hSession);
 
-	sc_pkcs11_unlock();
+		sc_pkcs11_unlock();
+	}
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -154,19 +482,23 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 	CK_RV rv;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_slot_id(slotID, &slot);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_CloseAllSessions(0x%lx)", slotID);
 
 	rv = slot_get_token(slotID, &slot);
+	if (rv == CKR_CRYPTOKI_NOT_INITIALIZED)
+		/* finalized meanwhile, the locks are gone */
+		return rv;
 	if (rv != CKR_OK)
 		goto out;
 
 	rv = sc_pkcs11_close_all_sessions(slotID);
 
       out:sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
 	return rv;
 }
 
@@ -180,17 +512,16 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
+	/* Only the global lock: does not wait for the card I/O on the slot */
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_GetSessionInfo(hSession:0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	sc_log(context, "C_GetSessionInfo(slot:0x%lx)", session->slot->id);
 	pInfo->slotID = session->slot->id;
@@ -218,7 +549,20 @@ CK_RV C_GetOperationState(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			  CK_BYTE_PTR pOperationState,	/* location receiving state */
 			  CK_ULONG_PTR pulOperationStateLen)
 {				/* location receiving state length */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	struct sc_pkcs11_session *session;
+	CK_RV rv;
+
+	if (pulOperationStateLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	/* the saved operations are on the host */
+	rv = sc_pkcs11_use_session(hSession, &session);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_get_operation_state(session, pOperationState, pulOperationStateLen);
+
+	sc_log(context, "C_GetOperationState() = %s", lookup_enum(RV_T, rv));
+	sc_pkcs11_release_session(session);
+	return rv;
 }
 
 CK_RV C_SetOperationState(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -227,7 +571,38 @@ CK_RV C_SetOperationState(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			  CK_OBJECT_HANDLE hEncryptionKey,	/* handle of en/decryption key */
 			  CK_OBJECT_HANDLE hAuthenticationKey)
 {				/* handle of sign/verify key */
-	return CKR_FUNCTION_NOT_SUPPORTED;
+	CK_KEY_TYPE key_type = 0;
+	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_object *key = NULL;
+	CK_RV rv;
+
+	if (pOperationState == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+	/* no en- or decryption is saved */
+	if (hEncryptionKey != CK_INVALID_HANDLE)
+		return CKR_KEY_NOT_NEEDED;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
+
+	if (hAuthenticationKey != CK_INVALID_HANDLE) {
+		key = slot_find_object(session->slot, hAuthenticationKey);
+		if (key == NULL || key->ops->sign == NULL_PTR
+				|| key->ops->get_attribute(session, key, &key_type_attr) != CKR_OK) {
+			rv = CKR_KEY_HANDLE_INVALID;
+			goto out;
+		}
+	}
+
+	rv = sc_pkcs11_set_operation_state(session, pOperationState, ulOperationStateLen,
+			key, key_type);
+
+out:
+	sc_log(context, "C_SetOperationState() = %s", lookup_enum(RV_T, rv));
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
@@ -242,20 +617,13 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	if (userType != CKU_USER && userType != CKU_SO && userType != CKU_CONTEXT_SPECIFIC)
+		return CKR_USER_TYPE_INVALID;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	if (userType != CKU_USER && userType != CKU_SO && userType != CKU_CONTEXT_SPECIFIC) {
-		rv = CKR_USER_TYPE_INVALID;
-		goto out;
-	}
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_log(context, "C_Login(0x%lx, %d)", hSession, userType);
 
 	slot = session->slot;
@@ -282,11 +650,13 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		}
 
 		rv = slot->card->framework->login(slot, userType, pPin, ulPinLen);
-		if (rv == CKR_OK)
-			slot->login_user = userType;
+		if (rv == CKR_OK) {
+			set_login_user(slot, userType);
+			login_shared_slots(slot, userType, pPin, ulPinLen);
+		}
 	}
 
-      out:sc_pkcs11_unlock();
+      out:sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -296,27 +666,22 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_log(context, "C_Logout(hSession:0x%lx)", hSession);
 
 	slot = session->slot;
 
 	if (slot->login_user >= 0) {
-		slot->login_user = -1;
+		set_login_user(slot, -1);
 		rv = slot->card->framework->logout(slot);
+		logout_shared_slots(slot, 0);
 	} else
 		rv = CKR_USER_NOT_LOGGED_IN;
 
-      out:sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -329,16 +694,10 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -353,7 +712,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 		rv = slot->card->framework->init_pin(slot, pPin, ulPinLen);
 	}
 
-      out:sc_pkcs11_unlock();
+      out:sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -367,16 +726,10 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	if ((pOldPin == NULL_PTR && ulOldLen > 0) || (pNewPin == NULL_PTR && ulNewLen > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	slot = session->slot;
 	sc_log(context, "Changing PIN (session 0x%lx; login user %d)", hSession, slot->login_user);
 
@@ -387,6 +740,6 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 
 	rv = slot->card->framework->change_pin(slot, pOldPin, ulOldLen, pNewPin, ulNewLen);
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
@@ -21,6 +21,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <signal.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -50,6 +52,179 @@ static void *modhandle = NULL;
 /* Spy module output */
 static FILE *spy_output = NULL;
 
+/*
+ * Profiling mode (PKCS11SPY_PROFILE=1): arguments are not dumped, only the
+ * number of calls, their latency and their return values are recorded per
+ * function. The summary is written at C_Finalize() and, on Unix, after
+ * SIGUSR1 at the next call into the spy.
+ */
+#define SPY_PROFILE_BUCKETS	32
+#define SPY_PROFILE_MAX_FUNCTIONS	80
+#define SPY_PROFILE_MAX_RV	8
+
+struct spy_profile_entry {
+	const char *name;
+	unsigned long calls;
+	unsigned long long total_us, min_us, max_us;
+	/* histogram[i]: calls that took less than 2^(i+1) microseconds */
+	unsigned long histogram[SPY_PROFILE_BUCKETS];
+	struct {
+		CK_RV rv;
+		unsigned long count;
+	} rv[SPY_PROFILE_MAX_RV];
+	/* return values for which the table above was full */
+	unsigned long rv_other;
+};
+
+static int spy_profile = 0;
+static struct spy_profile_entry spy_profile_table[SPY_PROFILE_MAX_FUNCTIONS];
+static unsigned int spy_profile_count = 0;
+/* the call in progress; the spy does not serialize calls */
+static struct spy_profile_entry *spy_profile_current = NULL;
+static unsigned long long spy_profile_start;
+static volatile sig_atomic_t spy_profile_requested = 0;
+
+static unsigned long long
+spy_profile_time_us(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0 && !QueryPerformanceFrequency(&freq))
+		return 0;
+	QueryPerformanceCounter(&now);
+	return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000
+		+ (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+#ifndef _WIN32
+static void
+spy_profile_request(int sig)
+{
+	spy_profile_requested = 1;
+}
+#endif
+
+static void
+spy_profile_init(void)
+{
+#ifndef _WIN32
+	void (*previous)(int);
+
+	previous = signal(SIGUSR1, spy_profile_request);
+	if (previous != SIG_DFL)
+		/* the application has its own use for it */
+		signal(SIGUSR1, previous);
+#endif
+	spy_profile = 1;
+	fprintf(spy_output, "Profiling, arguments are not dumped\n");
+}
+
+static struct spy_profile_entry *
+spy_profile_lookup(const char *function)
+{
+	unsigned int i;
+
+	/* the names are literals, one per function */
+	for (i = 0; i < spy_profile_count; i++)
+		if (spy_profile_table[i].name == function)
+			return &spy_profile_table[i];
+	if (spy_profile_count == SPY_PROFILE_MAX_FUNCTIONS)
+		return NULL;
+	spy_profile_table[spy_profile_count].name = function;
+	return &spy_profile_table[spy_profile_count++];
+}
+
+static void
+spy_profile_record(struct spy_profile_entry *entry, unsigned long long time_us, CK_RV rv)
+{
+	unsigned int i, bucket = 0;
+
+	if (entry->calls == 0 || time_us < entry->min_us)
+		entry->min_us = time_us;
+	if (time_us > entry->max_us)
+		entry->max_us = time_us;
+	entry->calls++;
+	entry->total_us += time_us;
+
+	while (time_us > 1 && bucket < SPY_PROFILE_BUCKETS - 1) {
+		time_us >>= 1;
+		bucket++;
+	}
+	entry->histogram[bucket]++;
+
+	for (i = 0; i < SPY_PROFILE_MAX_RV; i++) {
+		if (entry->rv[i].count == 0)
+			entry->rv[i].rv = rv;
+		if (entry->rv[i].rv == rv) {
+			entry->rv[i].count++;
+			return;
+		}
+	}
+	entry->rv_other++;
+}
+
+/* Upper bound of the latency of 99% of the calls, in microseconds */
+static unsigned long long
+spy_profile_p99(const struct spy_profile_entry *entry)
+{
+	unsigned long seen = 0;
+	unsigned int bucket;
+
+	for (bucket = 0; bucket < SPY_PROFILE_BUCKETS - 1; bucket++) {
+		seen += entry->histogram[bucket];
+		if (seen * 100 >= entry->calls * 99)
+			break;
+	}
+	if (bucket == SPY_PROFILE_BUCKETS - 1 || ((unsigned long long)2 << bucket) > entry->max_us)
+		return entry->max_us;
+	return (unsigned long long)2 << bucket;
+}
+
+static void
+spy_profile_dump(void)
+{
+	unsigned int i, j;
+
+	fprintf(spy_output, "\n*************** PKCS#11 spy profile ****************\n");
+	fprintf(spy_output, "%-24s %8s %12s %10s %10s %10s %10s\n", "Function", "calls",
+			"total(ms)", "min(us)", "avg(us)", "max(us)", "p99(us)");
+	for (i = 0; i < spy_profile_count; i++) {
+		const struct spy_profile_entry *entry = &spy_profile_table[i];
+
+		if (entry->calls == 0)
+			continue;
+		fprintf(spy_output, "%-24s %8lu %12.3f %10llu %10llu %10llu %10llu\n",
+				entry->name, entry->calls, entry->total_us / 1000.0,
+				entry->min_us, entry->total_us / entry->calls,
+				entry->max_us, spy_profile_p99(entry));
+		for (j = 0; j < SPY_PROFILE_MAX_RV && entry->rv[j].count; j++) {
+			const char *name = lookup_enum(RV_T, entry->rv[j].rv);
+
+			if (name)
+				fprintf(spy_output, "    %-36s %8lu\n", name, entry->rv[j].count);
+			else
+				fprintf(spy_output, "    0x%08lx %-25s %8lu\n", entry->rv[j].rv,
+						"", entry->rv[j].count);
+		}
+		if (entry->rv_other)
+			fprintf(spy_output, "    %-36s %8lu\n", "(other)", entry->rv_other);
+	}
+	fflush(spy_output);
+}
+
 /* Inits the spy. If successfull, po != NULL */
 static CK_RV
 init_spy(void)
@@ -185,6 +360,10 @@ init_spy(void)
 
 	fprintf(spy_output, "\n\n*************** OpenSC PKCS#11 spy *****************\n");
 
+	output = getenv("PKCS11SPY_PROFILE");
+	if (output && atoi(output) > 0)
+		spy_profile_init();
+
 	module = getenv("PKCS11SPY");
 #ifdef _WIN32
 	if (!module) {
@@ -247,6 +426,16 @@ enter(const char *function)
 	char time_string[40];
 #endif
 
+	if (spy_profile) {
+		if (spy_profile_requested) {
+			spy_profile_requested = 0;
+			spy_profile_dump();
+		}
+		spy_profile_current = spy_profile_lookup(function);
+		spy_profile_start = spy_profile_time_us();
+		return;
+	}
+
 	fprintf(spy_output, "\n%d: %s\n", count++, function);
 #ifdef _WIN32
         GetLocalTime(&st);
@@ -264,6 +453,13 @@ enter(const char *function)
 static CK_RV
 retne(CK_RV rv)
 {
+	if (spy_profile) {
+		if (spy_profile_current)
+			spy_profile_record(spy_profile_current,
+					spy_profile_time_us() - spy_profile_start, rv);
+		spy_profile_current = NULL;
+		return rv;
+	}
 	fprintf(spy_output, "Returned:  %ld %s\n", (unsigned long) rv, lookup_enum ( RV_T, rv ));
 	fflush(spy_output);
 	return rv;
@@ -273,6 +469,8 @@ retne(CK_RV rv)
 static void
 spy_dump_string_in(const char *name, CK_VOID_PTR data, CK_ULONG size)
 {
+	if (spy_profile)
+		return;
 	fprintf(spy_output, "[in] %s ", name);
 	print_generic(spy_output, 0, data, size, NULL);
 }
@@ -280,6 +478,8 @@ spy_dump_string_in(const char *name, CK_VOID_PTR data, CK_ULONG size)
 static void
 spy_dump_string_out(const char *name, CK_VOID_PTR data, CK_ULONG size)
 {
+	if (spy_profile)
+		return;
 	fprintf(spy_output, "[out] %s ", name);
 	print_generic(spy_output, 0, data, size, NULL);
 }
@@ -287,24 +487,32 @@ spy_dump_string_out(const char *name, CK_VOID_PTR data, CK_ULONG size)
 static void
 spy_dump_ulong_in(const char *name, CK_ULONG value)
 {
+	if (spy_profile)
+		return;
 	fprintf(spy_output, "[in] %s = 0x%lx\n", name, value);
 }
 
 static void
 spy_dump_ulong_out(const char *name, CK_ULONG value)
 {
+	if (spy_profile)
+		return;
 	fprintf(spy_output, "[out] %s = 0x%lx\n", name, value);
 }
 
 static void
 spy_dump_desc_out(const char *name)
 {
+	if (spy_profile)
+		return;
   fprintf(spy_output, "[out] %s: \n", name);
 }
 
 static void
 spy_dump_array_out(const char *name, CK_ULONG size)
 {
+	if (spy_profile)
+		return;
 	fprintf(spy_output, "[out] %s[%ld]: \n", name, size);
 }
 
@@ -312,6 +520,8 @@ static void
 spy_attribute_req_in(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 			  CK_ULONG  ulCount)
 {
+	if (spy_profile)
+		return;
 	fprintf(spy_output, "[in] %s[%ld]: \n", name, ulCount);
 	print_attribute_list_req(spy_output, pTemplate, ulCount);
 }
@@ -320,6 +530,8 @@ static void
 spy_attribute_list_in(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 			  CK_ULONG  ulCount)
 {
+	if (spy_profile)
+		return;
 	fprintf(spy_output, "[in] %s[%ld]: \n", name, ulCount);
 	print_attribute_list(spy_output, pTemplate, ulCount);
 }
@@ -328,13 +540,25 @@ static void
 spy_attribute_list_out(const char *name, CK_ATTRIBUTE_PTR pTemplate,
 			  CK_ULONG  ulCount)
 {
+	if (spy_profile)
+		return;
 	fprintf(spy_output, "[out] %s[%ld]: \n", name, ulCount);
 	print_attribute_list(spy_output, pTemplate, ulCount);
 }
 
+static void
+spy_dump_mechanism_in(CK_MECHANISM_PTR pMechanism)
+{
+	if (spy_profile)
+		return;
+	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+}
+
 static void
 print_ptr_in(const char *name, CK_VOID_PTR ptr)
 {
+	if (spy_profile)
+		return;
  	fprintf(spy_output, "[in] %s = %p\n", name, ptr);
 }
 
@@ -366,7 +590,7 @@ C_Initialize(CK_VOID_PTR pInitArgs)
 	enter("C_Initialize");
 	print_ptr_in("pInitArgs", pInitArgs);
 
-	if (pInitArgs) {
+	if (pInitArgs && !spy_profile) {
 		CK_C_INITIALIZE_ARGS *ptr = pInitArgs;
 		fprintf(spy_output, "     flags: %ld\n", ptr->flags);
 		if (ptr->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS)
@@ -386,7 +610,10 @@ C_Finalize(CK_VOID_PTR pReserved)
 
 	enter("C_Finalize");
 	rv = po->C_Finalize(pReserved);
-	return retne(rv);
+	rv = retne(rv);
+	if (spy_profile)
+		spy_profile_dump();
+	return rv;
 }
 
 CK_RV
@@ -396,7 +623,7 @@ C_GetInfo(CK_INFO_PTR pInfo)
 
 	enter("C_GetInfo");
 	rv = po->C_GetInfo(pInfo);
-	if(rv == CKR_OK) {
+	if(rv == CKR_OK && !spy_profile) {
 		spy_dump_desc_out("pInfo");
 		print_ck_info(spy_output, pInfo);
 	}
@@ -412,7 +639,7 @@ C_GetSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList,
 	enter("C_GetSlotList");
 	spy_dump_ulong_in("tokenPresent", tokenPresent);
 	rv = po->C_GetSlotList(tokenPresent, pSlotList, pulCount);
-	if(rv == CKR_OK) {
+	if(rv == CKR_OK && !spy_profile) {
 		spy_dump_desc_out("pSlotList");
 		print_slot_list(spy_output, pSlotList, *pulCount);
 		spy_dump_ulong_out("*pulCount", *pulCount);
@@ -428,7 +655,7 @@ C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 	enter("C_GetSlotInfo");
 	spy_dump_ulong_in("slotID", slotID);
 	rv = po->C_GetSlotInfo(slotID, pInfo);
-	if(rv == CKR_OK) {
+	if(rv == CKR_OK && !spy_profile) {
 		spy_dump_desc_out("pInfo");
 		print_slot_info(spy_output, pInfo);
 	}
@@ -444,7 +671,7 @@ C_GetTokenInfo(CK_SLOT_ID slotID,
 	enter("C_GetTokenInfo");
 	spy_dump_ulong_in("slotID", slotID);
 	rv = po->C_GetTokenInfo(slotID, pInfo);
-	if(rv == CKR_OK) {
+	if(rv == CKR_OK && !spy_profile) {
 		spy_dump_desc_out("pInfo");
 		print_token_info(spy_output, pInfo);
 	}
@@ -460,7 +687,7 @@ C_GetMechanismList(CK_SLOT_ID  slotID, CK_MECHANISM_TYPE_PTR pMechanismList,
 	enter("C_GetMechanismList");
 	spy_dump_ulong_in("slotID", slotID);
 	rv = po->C_GetMechanismList(slotID, pMechanismList, pulCount);
-	if(rv == CKR_OK) {
+	if(rv == CKR_OK && !spy_profile) {
 		spy_dump_array_out("pMechanismList", *pulCount);
 		print_mech_list(spy_output, pMechanismList, *pulCount);
 	}
@@ -476,13 +703,15 @@ C_GetMechanismInfo(CK_SLOT_ID  slotID, CK_MECHANISM_TYPE type,
 
 	enter("C_GetMechanismInfo");
 	spy_dump_ulong_in("slotID", slotID);
-	if (name)
-		fprintf(spy_output, "%30s \n", name);
-	else
-		fprintf(spy_output, " Unknown Mechanism (%08lx)  \n", type);
+	if (!spy_profile) {
+		if (name)
+			fprintf(spy_output, "%30s \n", name);
+		else
+			fprintf(spy_output, " Unknown Mechanism (%08lx)  \n", type);
+	}
 
 	rv = po->C_GetMechanismInfo(slotID, type, pInfo);
-	if(rv == CKR_OK) {
+	if(rv == CKR_OK && !spy_profile) {
 		spy_dump_desc_out("pInfo");
 		print_mech_info(spy_output, type, pInfo);
 	}
@@ -538,8 +767,10 @@ C_OpenSession(CK_SLOT_ID  slotID, CK_FLAGS  flags, CK_VOID_PTR  pApplication,
 	enter("C_OpenSession");
 	spy_dump_ulong_in("slotID", slotID);
 	spy_dump_ulong_in("flags", flags);
-	fprintf(spy_output, "pApplication=%p\n", pApplication);
-	fprintf(spy_output, "Notify=%p\n", (void *)Notify);
+	if (!spy_profile) {
+		fprintf(spy_output, "pApplication=%p\n", pApplication);
+		fprintf(spy_output, "Notify=%p\n", (void *)Notify);
+	}
 	rv = po->C_OpenSession(slotID, flags, pApplication, Notify, phSession);
 	spy_dump_ulong_out("*phSession", *phSession);
 	return retne(rv);
@@ -574,7 +805,7 @@ C_GetSessionInfo(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo)
 	enter("C_GetSessionInfo");
 	spy_dump_ulong_in("hSession", hSession);
 	rv = po->C_GetSessionInfo(hSession, pInfo);
-	if(rv == CKR_OK) {
+	if(rv == CKR_OK && !spy_profile) {
 		spy_dump_desc_out("pInfo");
 		print_session_info(spy_output, pInfo);
 	}
@@ -619,8 +850,9 @@ C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType,
 
 	enter("C_Login");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "[in] userType = %s\n",
-			lookup_enum(USR_T, userType));
+	if (!spy_profile)
+		fprintf(spy_output, "[in] userType = %s\n",
+				lookup_enum(USR_T, userType));
 	spy_dump_string_in("pPin[ulPinLen]", pPin, ulPinLen);
 	rv = po->C_Login(hSession, userType, pPin, ulPinLen);
 	return retne(rv);
@@ -758,7 +990,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject, CK_ULON
 	spy_dump_ulong_in("hSession", hSession);
 	spy_dump_ulong_in("ulMaxObjectCount", ulMaxObjectCount);
 	rv = po->C_FindObjects(hSession, phObject, ulMaxObjectCount, pulObjectCount);
-	if (rv == CKR_OK) {
+	if (rv == CKR_OK && !spy_profile) {
 		CK_ULONG          i;
 		spy_dump_ulong_out("ulObjectCount", *pulObjectCount);
 		for (i = 0; i < *pulObjectCount; i++)
@@ -785,7 +1017,7 @@ C_EncryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT
 
 	enter("C_EncryptInit");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_EncryptInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -843,7 +1075,7 @@ C_DecryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT
 
 	enter("C_DecryptInit");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_DecryptInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -902,7 +1134,7 @@ C_DigestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism)
 
 	enter("C_DigestInit");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	rv = po->C_DigestInit(hSession, pMechanism);
 	return retne(rv);
 }
@@ -968,7 +1200,7 @@ C_SignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HA
 
 	enter("C_SignInit");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_SignInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -1023,8 +1255,7 @@ C_SignRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OB
 
 	enter("C_SignRecoverInit");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n",
-			lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_SignRecoverInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -1052,7 +1283,7 @@ C_VerifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_
 
 	enter("C_VerifyInit");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_VerifyInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -1105,7 +1336,7 @@ C_VerifyRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 
 	enter("C_VerifyRecoverInit");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_VerifyRecoverInit(hSession, pMechanism, hKey);
 	return retne(rv);
@@ -1198,7 +1429,7 @@ C_GenerateKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 
 	enter("C_GenerateKey");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_attribute_list_in("pTemplate", pTemplate, ulCount);
 	rv = po->C_GenerateKey(hSession, pMechanism, pTemplate, ulCount, phKey);
 	if (rv == CKR_OK)
@@ -1217,7 +1448,7 @@ C_GenerateKeyPair(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 
 	enter("C_GenerateKeyPair");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_attribute_list_in("pPublicKeyTemplate", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 	spy_attribute_list_in("pPrivateKeyTemplate", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	rv = po->C_GenerateKeyPair(hSession, pMechanism,
@@ -1240,7 +1471,7 @@ C_WrapKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 
 	enter("C_WrapKey");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hWrappingKey", hWrappingKey);
 	spy_dump_ulong_in("hKey", hKey);
 	rv = po->C_WrapKey(hSession, pMechanism, hWrappingKey, hKey, pWrappedKey, pulWrappedKeyLen);
@@ -1260,7 +1491,7 @@ C_UnwrapKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 
 	enter("C_UnwrapKey");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hUnwrappingKey", hUnwrappingKey);
 	spy_dump_string_in("pWrappedKey[ulWrappedKeyLen]", pWrappedKey, ulWrappedKeyLen);
 	spy_attribute_list_in("pTemplate", pTemplate, ulAttributeCount);
@@ -1279,7 +1510,7 @@ C_DeriveKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_H
 
 	enter("C_DeriveKey");
 	spy_dump_ulong_in("hSession", hSession);
-	fprintf(spy_output, "pMechanism->type=%s\n", lookup_enum(MEC_T, pMechanism->mechanism));
+	spy_dump_mechanism_in(pMechanism);
 	spy_dump_ulong_in("hBaseKey", hBaseKey);
 	spy_attribute_list_in("pTemplate", pTemplate, ulAttributeCount);
 	rv = po->C_DeriveKey(hSession, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey);
@@ -82,6 +82,12 @@ struct sc_pkcs11_config {
 	unsigned int create_puk_slot;
 	unsigned int zero_ckaid_for_ca_certs;
 	unsigned int create_slots_flags;
+	unsigned int lazy_object_loading;
+	unsigned int bind_in_background;
+	unsigned int defer_card_connect;
+	unsigned int key_pool;
+	unsigned int parse_threads;
+	unsigned int random_pool_size;
 };
 
 /*
@@ -123,6 +129,18 @@ struct sc_pkcs11_object_ops {
 	/* Check compatibility of PKCS#15 object usage and an asked PKCS#11 mechanism. */
 	CK_RV (*can_do)(struct sc_pkcs11_session *, void *, CK_MECHANISM_TYPE, unsigned int);
 
+	/* Reads at once the card data of the attributes of a template before
+	 * C_GetAttributeValue() gets them, and drops what was kept for it */
+	CK_RV (*prefetch_attributes)(struct sc_pkcs11_session *, void *, CK_ATTRIBUTE_PTR, CK_ULONG);
+	void (*release_prefetched)(struct sc_pkcs11_session *, void *);
+
+	/* Enciphers whole blocks with a secret key of the card; they are
+	 * deciphered with decrypt() */
+	CK_RV (*encrypt)(struct sc_pkcs11_session *, void *,
+			CK_MECHANISM_PTR,
+			CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+			CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen);
+
 	/* Others to be added when implemented */
 };
 
@@ -130,10 +148,15 @@ struct sc_pkcs11_object {
 	CK_OBJECT_HANDLE handle;
 	int flags;
 	struct sc_pkcs11_object_ops *ops;
+	struct sc_pkcs11_attribute_cache *attr_cache;	/* C_GetAttributeValue() results */
+	struct sc_pkcs11_verify_key *verify_key;	/* decoded public key, see openssl.c */
+	struct sc_pkcs11_session *owner;	/* session of a session object */
+	unsigned int owner_index;	/* its place in owner->objects */
 };
 
 #define SC_PKCS11_OBJECT_SEEN	0x0001
 #define SC_PKCS11_OBJECT_HIDDEN	0x0002
+#define SC_PKCS11_OBJECT_SESSION	0x0004	/* only in the handle table, see slot_add_session_object() */
 #define SC_PKCS11_OBJECT_RECURS	0x8000
 
 
@@ -179,6 +202,21 @@ struct sc_pkcs11_framework_ops {
 				CK_OBJECT_HANDLE_PTR, CK_OBJECT_HANDLE_PTR);
 	CK_RV (*get_random)(struct sc_pkcs11_slot *,
 				CK_BYTE_PTR, CK_ULONG);
+	/* Keep the security environment of the card between the
+	 * signatures of C_SignBatch() */
+	CK_RV (*hold_security_env)(struct sc_pkcs11_slot *, int);
+	/* Bring the objects up to date after the card was reset or put
+	 * in again, keeping the handles of those still on the card */
+	CK_RV (*resync)(struct sc_pkcs11_card *);
+	/* Find the same private key on the token of another slot, for
+	 * the key pool; called with the global lock held */
+	CK_RV (*find_pool_key)(struct sc_pkcs11_slot *, struct sc_pkcs11_object *,
+				struct sc_pkcs11_slot *, struct sc_pkcs11_object **);
+	/* Log another slot of the card in along with a login to the slot,
+	 * when the card holds the PIN as verified for both; fails for a slot
+	 * behind another PIN. Called with the slot lock held. */
+	CK_RV (*login_shared)(struct sc_pkcs11_slot *, struct sc_pkcs11_slot *,
+				CK_USER_TYPE, CK_CHAR_PTR, CK_ULONG);
 };
 
 /*
@@ -192,20 +230,39 @@ typedef unsigned __int64   sc_timestamp_t;
 #endif
 
 #define SC_PKCS11_FRAMEWORK_DATA_MAX_NUM	4
+/* Card I/O lock of the slots of a reader. Urgent callers only take the
+ * mutex. The others queue on the gate first and keep it while they hold
+ * the card, so that at most one of them competes with the urgent ones,
+ * and only urgent ones get the card while a bulk caller yields it. */
+struct sc_pkcs11_card_lock {
+	void *mutex;
+	void *gate;
+	void *count_lock;		/* guards urgent, taken alone */
+	unsigned int urgent;		/* urgent callers waiting for the mutex */
+	int holder_prio;		/* SC_LOCK_PRIO_* of the holder */
+};
+
 struct sc_pkcs11_card {
 	sc_reader_t *reader;
 	sc_card_t *card;
+	struct sc_pkcs11_card_lock *lock;	/* of the slots of the reader */
 	struct sc_pkcs11_framework_ops *framework;
 	void *fws_data[SC_PKCS11_FRAMEWORK_DATA_MAX_NUM];
 
 	/* List of supported mechanisms */
 	struct sc_pkcs11_mechanism_type **mechanisms;
 	unsigned int nmechanisms;
+	/* Open addressing hash of the list above by mechanism type, built
+	 * by the first lookup after a registration; mech_index_mask + 1
+	 * is its size */
+	struct sc_pkcs11_mechanism_type **mech_index;
+	unsigned int mech_index_mask;
 };
 
 struct sc_pkcs11_slot {
 	CK_SLOT_ID id;			/* ID of the slot */
 	int login_user;			/* Currently logged in user */
+	unsigned int login_group;	/* Slots logged in together with a shared PIN, 0 if none */
 	CK_SLOT_INFO slot_info;		/* Slot specific information (information about reader) */
 	CK_TOKEN_INFO token_info;	/* Token specific information (information about card) */
 	sc_reader_t *reader;		/* same as card->reader if there's a card present */
@@ -214,7 +271,19 @@ struct sc_pkcs11_slot {
 	void *fw_data;			/* Framework specific data */  /* TODO: get know how it used */
 	list_t objects;			/* Objects in this slot */
 	unsigned int nsessions;		/* Number of sessions using this slot */
-	sc_timestamp_t slot_state_expires;
+	sc_timestamp_t slot_state_expires;	/* Until then card_detect_cached() does not ask the reader */
+	unsigned int slot_state_generation;	/* Reader events generation of that state */
+	CK_RV slot_state_rv;		/* What card_detect() returned for it */
+	struct sc_pkcs11_card_lock *lock;	/* Card I/O lock, shared by the slots of a reader */
+	struct sc_pkcs11_object_index *object_index;	/* Search index of the objects */
+	struct sc_pkcs11_object **handle_table;	/* The objects by handle, see slot_find_object() */
+	unsigned int handle_table_mask;	/* its size - 1 */
+	unsigned int handle_table_used;	/* objects and deleted entries in it */
+	unsigned int session_objects;	/* SC_PKCS11_OBJECT_SESSION objects in it */
+	unsigned int objects_generation;	/* Changes with the objects or the login state */
+	unsigned int pool_users;	/* Pooled signatures on the token or waiting for it, see slot_pool_pick() */
+	int bind_pending;		/* The card was seen by card_probe_all() and is not bound yet */
+	int token_info_cached;		/* token_info was read from the cache, see slot_load_token_info() */
 
 	int fw_data_idx;		/* Index of framework data */
 	struct sc_app_info *app_info;	/* Application assosiated to slot */
@@ -232,6 +301,7 @@ enum {
 	SC_PKCS11_OPERATION_DIGEST,
 	SC_PKCS11_OPERATION_DECRYPT,
 	SC_PKCS11_OPERATION_DERIVE,
+	SC_PKCS11_OPERATION_ENCRYPT,
 	SC_PKCS11_OPERATION_MAX
 };
 
@@ -251,6 +321,11 @@ struct sc_pkcs11_mechanism_type {
 					CK_BYTE_PTR, CK_ULONG);
 	CK_RV		  (*md_final)(sc_pkcs11_operation_t *,
 					CK_BYTE_PTR, CK_ULONG_PTR);
+	/* Saves and restores the state of a digest, see C_GetOperationState() */
+	CK_RV		  (*md_get_state)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*md_set_state)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG);
 
 	CK_RV		  (*sign_init)(sc_pkcs11_operation_t *,
 					struct sc_pkcs11_object *);
@@ -266,11 +341,26 @@ struct sc_pkcs11_mechanism_type {
 					CK_BYTE_PTR, CK_ULONG);
 	CK_RV		  (*verif_final)(sc_pkcs11_operation_t *,
 					CK_BYTE_PTR, CK_ULONG);
+	CK_RV		  (*encrypt_init)(sc_pkcs11_operation_t *,
+					struct sc_pkcs11_object *);
+	CK_RV		  (*encrypt)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*encrypt_update)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*encrypt_final)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG_PTR);
 	CK_RV		  (*decrypt_init)(sc_pkcs11_operation_t *,
 					struct sc_pkcs11_object *);
 	CK_RV		  (*decrypt)(sc_pkcs11_operation_t *,
 					CK_BYTE_PTR, CK_ULONG,
 					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*decrypt_update)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG,
+					CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV		  (*decrypt_final)(sc_pkcs11_operation_t *,
+					CK_BYTE_PTR, CK_ULONG_PTR);
 	CK_RV		  (*derive)(sc_pkcs11_operation_t *,
 					struct sc_pkcs11_object *,
 					CK_BYTE_PTR, CK_ULONG,
@@ -290,18 +380,25 @@ struct sc_pkcs11_operation {
 	void *		  priv_data;
 };
 
-/* Find Operation */
+/* Find Operation. Most searches find a single key, their handles are kept
+ * in the operation itself. */
 #define SC_PKCS11_FIND_INC_HANDLES	32
+#define SC_PKCS11_FIND_INLINE_HANDLES	8
 struct sc_pkcs11_find_operation {
 	struct sc_pkcs11_operation operation;
 	int num_handles, current_handle, allocated_handles;
-	CK_OBJECT_HANDLE *handles;
+	CK_OBJECT_HANDLE *handles;	/* inline_handles or allocated */
+	CK_OBJECT_HANDLE inline_handles[SC_PKCS11_FIND_INLINE_HANDLES];
 };
 
 /*
  * PKCS#11 Session
  */
 
+/* An operation with hashing takes four blocks: the operation, its data,
+ * the digest operation and the digest context */
+#define SC_PKCS11_SESSION_SPARES	6
+
 struct sc_pkcs11_session {
 	CK_SESSION_HANDLE handle;
 	/* Session to this slot */
@@ -312,11 +409,33 @@ struct sc_pkcs11_session {
 	CK_VOID_PTR notify_data;
 	/* Active operations - one per type */
 	struct sc_pkcs11_operation *operation[SC_PKCS11_OPERATION_MAX];
+	/* Callers working on the session without locks, see sc_pkcs11_use_session() */
+	unsigned int host_users;
+	/* Slot of the key pool the signature is made on, NULL for the session's own */
+	struct sc_pkcs11_slot *sign_slot;
+	/* Session objects created in this session, destroyed with it */
+	CK_OBJECT_HANDLE *objects;
+	unsigned int nobjects;
+	/* Memory of ended operations, reused by the next ones, see session_alloc() */
+	struct sc_pkcs11_session_spare {
+		void *ptr;
+		size_t size;
+	} spare[SC_PKCS11_SESSION_SPARES];
 };
 typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 
 /* Module variables */
 extern struct sc_context *context;
+
+/* Spans of the PKCS#11 calls, which may come before C_Initialize() */
+#define SC_PKCS11_TRACE_BEGIN(name, value) do { \
+	if (context != NULL) \
+		SC_TRACE_BEGIN(context, (name), (value)); \
+} while (0)
+#define SC_PKCS11_TRACE_END(name, value) do { \
+	if (context != NULL) \
+		SC_TRACE_END(context, (name), (value)); \
+} while (0)
 extern struct sc_pkcs11_config sc_pkcs11_conf;
 extern list_t sessions;
 extern list_t virtual_slots;
@@ -330,6 +449,8 @@ void strcpy_bp(u8 *dst, const char *src, size_t dstsize);
 CK_RV sc_to_cryptoki_error(int rc, const char *ctx);
 void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line, const char *function,
 		const char *info, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
+sc_timestamp_t get_current_time(void);
+
 #define dump_template(level, info, pTemplate, ulCount) \
 		sc_pkcs11_print_attrs(level, __FILE__, __LINE__, __FUNCTION__, \
 				info, pTemplate, ulCount)
@@ -337,23 +458,57 @@ void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line, const
 /* Slot and card handling functions */
 CK_RV card_removed(sc_reader_t *reader);
 CK_RV card_detect_all(void);
+CK_RV card_probe_all(void);
+void card_bind_pending(sc_reader_t *reader);
+int sc_pkcs11_bind_in_background(sc_reader_t *reader);
 CK_RV create_slot(sc_reader_t *reader);
-CK_RV initialize_reader(sc_reader_t *reader);
+CK_RV initialize_reader(sc_reader_t *reader, int detect);
 CK_RV card_detect(sc_reader_t *reader);
+CK_RV card_detect_reader(sc_reader_t *reader);
+CK_RV card_detect_cached(sc_reader_t *reader);
+CK_RV card_detect_slot(struct sc_pkcs11_slot *slot);
+void slot_reader_event(void);
 CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot **);
+void sc_pkcs11_free_slot_table(void);
 CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
+CK_RV sc_pkcs11_lock_slot_id(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_token_removed(CK_SLOT_ID id);
 CK_RV slot_allocate(struct sc_pkcs11_slot **, struct sc_pkcs11_card *);
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask);
+void slot_objects_changed(struct sc_pkcs11_slot *);
+void slot_add_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+void slot_remove_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+CK_RV slot_add_session_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+void slot_remove_session_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+struct sc_pkcs11_object *slot_next_session_object(struct sc_pkcs11_slot *, unsigned int *);
+struct sc_pkcs11_object *slot_find_object(struct sc_pkcs11_slot *, CK_OBJECT_HANDLE);
+CK_RV slot_pool_pick(struct sc_pkcs11_session *, struct sc_pkcs11_object *,
+		struct sc_pkcs11_slot **, CK_OBJECT_HANDLE *, unsigned int *);
+void slot_pool_leave(struct sc_pkcs11_slot *);
+void slot_free_handle_table(struct sc_pkcs11_slot *);
+void sc_pkcs11_drop_object_index(struct sc_pkcs11_slot *);
+void sc_pkcs11_free_attribute_cache(struct sc_pkcs11_object *);
 
 /* Session manipulation */
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
+CK_RV sc_pkcs11_lock_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
+CK_RV sc_pkcs11_lock_session_prio(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session, int prio);
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *session);
+CK_RV sc_pkcs11_use_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
+void sc_pkcs11_release_session(struct sc_pkcs11_session *session);
+void sc_pkcs11_free_session(struct sc_pkcs11_session *session);
+CK_RV session_add_object(struct sc_pkcs11_session *, struct sc_pkcs11_object *);
+void session_forget_object(struct sc_pkcs11_session *, struct sc_pkcs11_object *);
+void sc_pkcs11_free_session_table(void);
 CK_RV session_start_operation(struct sc_pkcs11_session *,
 			int, sc_pkcs11_mechanism_type_t *,
 			struct sc_pkcs11_operation **);
 CK_RV session_get_operation(struct sc_pkcs11_session *, int,
 			struct sc_pkcs11_operation **);
 CK_RV session_stop_operation(struct sc_pkcs11_session *, int);
+void *session_alloc(struct sc_pkcs11_session *, size_t);
+void session_free(struct sc_pkcs11_session *, void *, size_t);
+void session_free_spares(struct sc_pkcs11_session *);
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID);
 
 /* Generic secret key stuff */
@@ -388,19 +543,35 @@ CK_RV sc_pkcs11_sign_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 CK_RV sc_pkcs11_sign_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_sign_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_sign_size(struct sc_pkcs11_session *, CK_ULONG_PTR);
+CK_RV sc_pkcs11_sign_batch(struct sc_pkcs11_session *, CK_ULONG,
+			CK_BYTE_PTR *, CK_ULONG_PTR, CK_BYTE_PTR *, CK_ULONG_PTR);
+CK_RV sc_pkcs11_sign_pooled(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG,
+			CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_get_operation_state(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_set_operation_state(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG,
+			struct sc_pkcs11_object *, CK_KEY_TYPE);
 #ifdef ENABLE_OPENSSL
 CK_RV sc_pkcs11_verif_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_verif_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_verif_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 #endif
+CK_RV sc_pkcs11_encr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR, struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
+CK_RV sc_pkcs11_encr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_encr_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_encr_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_decr_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR, struct sc_pkcs11_object *, CK_MECHANISM_TYPE);
 CK_RV sc_pkcs11_decr(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_decr_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+CK_RV sc_pkcs11_decr_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_deri(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_KEY_TYPE,
 				CK_SESSION_HANDLE, CK_OBJECT_HANDLE, struct sc_pkcs11_object *);
 sc_pkcs11_mechanism_type_t *sc_pkcs11_find_mechanism(struct sc_pkcs11_card *,
 				CK_MECHANISM_TYPE, unsigned int);
+int sc_pkcs11_register_cached_mechanisms(struct sc_pkcs11_card *, const u8 *, size_t);
+void sc_pkcs11_cache_mechanisms(struct sc_pkcs11_card *, unsigned int, const u8 *, size_t);
+void sc_pkcs11_free_mechanism_cache(void);
 sc_pkcs11_mechanism_type_t *sc_pkcs11_new_fw_mechanism(CK_MECHANISM_TYPE,
 				CK_MECHANISM_INFO_PTR, CK_KEY_TYPE,
 				void *);
@@ -416,21 +587,35 @@ CK_RV sc_pkcs11_register_sign_and_hash_mechanism(struct sc_pkcs11_card *,
 				sc_pkcs11_mechanism_type_t *);
 
 #ifdef ENABLE_OPENSSL
-CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
+CK_RV sc_pkcs11_verify_data(struct sc_pkcs11_object *key,
+	const unsigned char *pubkey, int pubkey_len,
 	const unsigned char *pubkey_params, int pubkey_params_len,
 	CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 	unsigned char *inp, int inp_len,
 	unsigned char *signat, int signat_len);
+CK_RV sc_pkcs11_encrypt_data(struct sc_pkcs11_object *key,
+	const unsigned char *pubkey, int pubkey_len,
+	CK_MECHANISM_TYPE mech, unsigned char *inp, int inp_len,
+	unsigned char *out, CK_ULONG_PTR out_len);
+void sc_pkcs11_free_verify_key(struct sc_pkcs11_object *);
 #endif
 
 /* Load configuration defaults */
 void load_pkcs11_parameters(struct sc_pkcs11_config *, struct sc_context *);
 
-/* Locking primitives at the pkcs11 level */
+/* Locking primitives at the pkcs11 level: the global lock guards the slot
+ * and session tables, the slot locks the card I/O. A slot lock is always
+ * taken before the global lock, never while holding it. */
 CK_RV sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR);
 CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
+CK_RV sc_pkcs11_new_slot_lock(struct sc_pkcs11_card_lock **);
+void sc_pkcs11_free_slot_lock(struct sc_pkcs11_card_lock *);
+void sc_pkcs11_lock_slot(struct sc_pkcs11_slot *);
+void sc_pkcs11_lock_slot_prio(struct sc_pkcs11_slot *, int prio);
+void sc_pkcs11_unlock_slot(struct sc_pkcs11_slot *);
+int sc_pkcs11_yield_slot_lock(struct sc_pkcs11_card_lock *);
 
 #ifdef __cplusplus
 }
@@ -21,8 +21,10 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include "sc-pkcs11.h"
 
@@ -36,6 +38,10 @@ static struct sc_pkcs11_framework_ops *frameworks[] = {
 	NULL
 };
 
+/* Changes whenever a reader event has been seen, so that the cached
+ * state of every slot is refreshed by the next card_detect_cached() */
+static unsigned int reader_events_generation = 0;
+
 static struct sc_pkcs11_slot * reader_get_slot(sc_reader_t *reader)
 {
 	unsigned int i;
@@ -73,9 +79,81 @@ static int object_list_seeker(const void *el, const void *key)
 	return 0;
 }
 
+/* The slot IDs index a table: the low bits are the entry. In plug and play
+ * mode the entry and the high bits are derived from the name of the reader,
+ * so that a slot keeps its ID when the readers are attached in another
+ * order and the ID of a slot of another reader does not resolve. The table
+ * is changed and read with the global lock held. */
+#define SLOT_INDEX_BITS		8
+#define SLOT_INDEX_MASK		((1UL << SLOT_INDEX_BITS) - 1)
+#define SLOT_TAG_MASK		0x7FFFUL
+
+static struct sc_pkcs11_slot **slot_table = NULL;
+static size_t slot_table_size = 0;
+
+static unsigned long slot_name_hash(const char *name)
+{
+	unsigned long h = 2166136261UL;
+
+	/* FNV-1a */
+	while (*name) {
+		h ^= (unsigned char) *name++;
+		h = (h * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return h;
+}
+
+static CK_RV slot_table_add(struct sc_pkcs11_slot *slot, sc_reader_t *reader)
+{
+	unsigned long hash = 0, tag = 0;
+	size_t i, n;
+
+	if (slot_table == NULL) {
+		size_t size = sc_pkcs11_conf.max_virtual_slots;
+
+		if (size > SLOT_INDEX_MASK + 1)
+			size = SLOT_INDEX_MASK + 1;
+		slot_table = calloc(size, sizeof(*slot_table));
+		if (slot_table == NULL)
+			return CKR_HOST_MEMORY;
+		slot_table_size = size;
+	}
+
+	if (reader != NULL && sc_pkcs11_conf.plug_and_play) {
+		/* the n-th slot of the reader prefers the n-th entry after its own */
+		hash = slot_name_hash(reader->name);
+		tag = (hash >> SLOT_INDEX_BITS) & SLOT_TAG_MASK;
+		for (i = 0; i < list_size(&virtual_slots); i++)
+			if (((struct sc_pkcs11_slot *) list_get_at(&virtual_slots, i))->reader == reader)
+				hash++;
+	}
+
+	/* an entry taken by another reader moves the slot to the next free one */
+	for (n = 0; n < slot_table_size; n++) {
+		i = (hash + n) % slot_table_size;
+		if (slot_table[i] == NULL)
+			break;
+	}
+	if (n == slot_table_size)
+		return CKR_FUNCTION_FAILED;
+
+	slot_table[i] = slot;
+	slot->id = (CK_SLOT_ID) ((tag << SLOT_INDEX_BITS) | i);
+	return CKR_OK;
+}
+
+/* Called by C_Finalize() */
+void sc_pkcs11_free_slot_table(void)
+{
+	free(slot_table);
+	slot_table = NULL;
+	slot_table_size = 0;
+}
+
 CK_RV create_slot(sc_reader_t *reader)
 {
-	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_slot *slot, *reader_slot;
+	CK_RV rv;
 
 	if (list_size(&virtual_slots) >= sc_pkcs11_conf.max_virtual_slots)
 		return CKR_FUNCTION_FAILED;
@@ -84,13 +162,29 @@ CK_RV create_slot(sc_reader_t *reader)
 	if (!slot)
 		return CKR_HOST_MEMORY;
 
+	/* The slots of a reader share the card, and so its lock */
+	reader_slot = reader ? reader_get_slot(reader) : NULL;
+	if (reader_slot) {
+		slot->lock = reader_slot->lock;
+	} else if (sc_pkcs11_new_slot_lock(&slot->lock) != CKR_OK) {
+		free(slot);
+		return CKR_CANT_LOCK;
+	}
+
+	rv = slot_table_add(slot, reader);
+	if (rv != CKR_OK) {
+		if (!reader_slot)
+			sc_pkcs11_free_slot_lock(slot->lock);
+		free(slot);
+		return rv;
+	}
 	list_append(&virtual_slots, slot);
 	slot->login_user = -1;
-	slot->id = (CK_SLOT_ID) list_locate(&virtual_slots, slot);
 	sc_log(context, "Creating slot with id 0x%lx", slot->id);
 
 	list_init(&slot->objects);
 	list_attributes_seeker(&slot->objects, object_list_seeker);
+	list_attributes_indexed(&slot->objects, 1);
 
 	init_slot_info(&slot->slot_info);
 	if (reader != NULL) {
@@ -102,7 +196,9 @@ CK_RV create_slot(sc_reader_t *reader)
 
 
 /* create slots associated with a reader, called whenever a reader is seen. */
-CK_RV initialize_reader(sc_reader_t *reader)
+/* Creates the slots of a reader. With 'detect' set, the card in it is
+ * also connected and bound */
+CK_RV initialize_reader(sc_reader_t *reader, int detect)
 {
 	unsigned int i;
 	CK_RV rv;
@@ -128,7 +224,7 @@ CK_RV initialize_reader(sc_reader_t *reader)
 			return rv;
 	}
 
-	if (sc_detect_card_presence(reader)) {
+	if (detect && sc_detect_card_presence(reader)) {
 		card_detect(reader);
 	}
 
@@ -136,6 +232,31 @@ CK_RV initialize_reader(sc_reader_t *reader)
 }
 
 
+/* Releases a card that is in no slot any more, or not yet */
+static void card_free(struct sc_pkcs11_card *card, struct sc_pkcs11_framework_ops *framework)
+{
+	if (framework)
+		framework->unbind(card);
+	if (card->card)
+		sc_disconnect_card(card->card);
+	/* FIXME: free mechanisms
+	 * spaces allocated by the
+	 * sc_pkcs11_register_sign_and_hash_mechanism
+	 * and sc_pkcs11_new_fw_mechanism.
+	 * but see sc_pkcs11_register_generic_mechanisms
+	for (i=0; i < card->nmechanisms; ++i) {
+		// if 'mech_data' is a pointer earlier returned by the ?alloc
+		free(card->mechanisms[i]->mech_data);
+		// if 'mechanisms[i]' is a pointer earlier returned by the ?alloc
+		free(card->mechanisms[i]);
+	}
+	*/
+	free(card->mechanisms);
+	free(card->mech_index);
+	free(card);
+}
+
+
 CK_RV card_removed(sc_reader_t * reader)
 {
 	unsigned int i;
@@ -154,36 +275,150 @@ CK_RV card_removed(sc_reader_t * reader)
 		}
 	}
 
-	if (card) {
-		card->framework->unbind(card);
-		sc_disconnect_card(card->card);
-		/* FIXME: free mechanisms
-		 * spaces allocated by the
-		 * sc_pkcs11_register_sign_and_hash_mechanism
-		 * and sc_pkcs11_new_fw_mechanism.
-		 * but see sc_pkcs11_register_generic_mechanisms
-		for (i=0; i < card->nmechanisms; ++i) {
-			// if 'mech_data' is a pointer earlier returned by the ?alloc
-			free(card->mechanisms[i]->mech_data);
-			// if 'mechanisms[i]' is a pointer earlier returned by the ?alloc
-			free(card->mechanisms[i]);
+	if (card)
+		card_free(card, card->framework);
+
+	return CKR_OK;
+}
+
+
+/* The card in the reader was reset or put in again: the framework brings
+ * the objects of its slots up to date if it is still the same token */
+static CK_RV card_resync(sc_reader_t *reader)
+{
+	struct sc_pkcs11_card *p11card = NULL;
+	unsigned int i;
+	CK_RV rv;
+
+	for (i=0; i < list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		if (slot->reader == reader && slot->card) {
+			p11card = slot->card;
+			break;
 		}
-		*/
-		free(card->mechanisms);
-		free(card);
 	}
 
+	if (!p11card || !p11card->framework || !p11card->framework->resync)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	rv = p11card->framework->resync(p11card);
+	if (rv != CKR_OK)
+		sc_log(context, "%s: cannot resync the token, 0x%lX", reader->name, rv);
+	return rv;
+}
+
+
+/* The applications of a card bound by card_bind_apps(), for which
+ * card_create_tokens() creates the tokens */
+struct card_binding {
+	struct sc_pkcs11_card *p11card;		/* bound by card_prebind() */
+	struct sc_pkcs11_framework_ops *framework;
+	struct sc_app_info *app_generic;
+	CK_RV app_rv[SC_MAX_CARD_APPS];		/* the bind of each application */
+	int changed;				/* seen by card_prebind() */
+};
+
+/* Binds the applications of a connected card: only talks to the card */
+static CK_RV card_bind_apps(struct sc_pkcs11_card *p11card, struct card_binding *b)
+{
+	sc_reader_t *reader = p11card->reader;
+	unsigned int i, j;
+	CK_RV rv;
+
+	b->app_generic = sc_pkcs15_get_application_by_type(p11card->card, "generic");
+
+	sc_log(context, "%s: Detecting Framework. %i on-card applications", reader->name, p11card->card->app_count);
+	sc_log(context, "%s: generic application %s", reader->name, b->app_generic ? b->app_generic->label : "<none>");
+
+	for (i = 0; frameworks[i]; i++)
+		if (frameworks[i]->bind != NULL)
+			break;
+	/*TODO: only first framework is used: pkcs15init framework is not reachable here */
+	if (frameworks[i] == NULL)
+		return CKR_GENERAL_ERROR;
+	b->framework = frameworks[i];
+
+	/* Initialize framework */
+	sc_log(context, "%s: Detected framework %d. Binding applications.", reader->name, i);
+	/* Bind firstly 'generic' application or (emulated?) card without applications */
+	if (b->app_generic || !p11card->card->app_count)   {
+		sc_log(context, "%s: Try to bind 'generic' token.", reader->name);
+		rv = b->framework->bind(p11card, b->app_generic);
+		if (rv != CKR_OK)   {
+			sc_log(context, "%s: cannot bind 'generic' token.", reader->name);
+			return rv;
+		}
+	}
+
+	/* Now bind the rest of applications that are not 'generic' */
+	for (j = 0; j < (unsigned int) p11card->card->app_count && j < SC_MAX_CARD_APPS; j++)   {
+		struct sc_app_info *app_info = p11card->card->app[j];
+		char *app_name = app_info ? app_info->label : "<anonymous>";
+
+		b->app_rv[j] = CKR_OK;
+		if (b->app_generic && b->app_generic == p11card->card->app[j])
+			continue;
+
+		sc_log(context, "%s: Binding %s token.", reader->name, app_name);
+		b->app_rv[j] = b->framework->bind(p11card, app_info);
+		if (b->app_rv[j] != CKR_OK)
+			sc_log(context, "%s: cannot bind %s token.", reader->name, app_name);
+	}
 	return CKR_OK;
 }
 
+/* Creates the tokens of the applications bound by card_bind_apps() in the
+ * slots of the reader, with the global lock held */
+static CK_RV card_create_tokens(struct sc_pkcs11_card *p11card, struct card_binding *b)
+{
+	sc_reader_t *reader = p11card->reader;
+	struct sc_pkcs11_slot *first_slot = NULL;
+	unsigned int j;
+	CK_RV rv;
 
-CK_RV card_detect(sc_reader_t *reader)
+	if (b->app_generic || !p11card->card->app_count)   {
+		sc_log(context, "%s: Creating 'generic' token.", reader->name);
+		rv = b->framework->create_tokens(p11card, b->app_generic, &first_slot);
+		if (rv != CKR_OK)   {
+			sc_log(context, "%s: cannot create 'generic' token.", reader->name);
+			return rv;
+		}
+	}
+
+	for (j = 0; j < (unsigned int) p11card->card->app_count && j < SC_MAX_CARD_APPS; j++)   {
+		struct sc_app_info *app_info = p11card->card->app[j];
+		char *app_name = app_info ? app_info->label : "<anonymous>";
+
+		if (b->app_generic && b->app_generic == p11card->card->app[j])
+			continue;
+		if (b->app_rv[j] != CKR_OK)
+			continue;
+
+		sc_log(context, "%s: Creating %s token.", reader->name, app_name);
+		rv = b->framework->create_tokens(p11card, app_info, &first_slot);
+		if (rv != CKR_OK)   {
+			sc_log(context, "%s: cannot create %s token.", reader->name, app_name);
+			return rv;
+		}
+	}
+
+	p11card->framework = b->framework;
+	return CKR_OK;
+}
+
+/* card_detect(), with the card that card_prebind() connected and bound
+ * if 'pre' is given. The card is taken out of 'pre' once it is in the
+ * slots. */
+static CK_RV __card_detect(sc_reader_t *reader, struct card_binding *pre)
 {
 	struct sc_pkcs11_card *p11card = NULL;
+	struct sc_pkcs11_slot *reader_slot;
+	struct card_binding binding, *b = &binding;
 	int rc, rv;
-	unsigned int i, j;
+	unsigned int i;
 
 	rv = CKR_OK;
+	memset(&binding, 0, sizeof(binding));
 
 	sc_log(context, "%s: Detecting smart card", reader->name);
 	/* Check if someone inserted a card */
@@ -207,7 +442,8 @@ again:
 		 * So better be fussy.
 		if (!retry--)
 			return CKR_TOKEN_NOT_PRESENT; */
-		card_removed(reader);
+		if (card_resync(reader) != CKR_OK)
+			card_removed(reader);
 		goto again;
 	}
 
@@ -221,12 +457,19 @@ again:
 	}
 
 	/* Detect the card if it's not known already */
-	if (p11card == NULL) {
+	if (p11card == NULL && pre != NULL && pre->p11card != NULL) {
+		sc_log(context, "%s: First seen the card, bound already", reader->name);
+		p11card = pre->p11card;
+		pre->p11card = NULL;
+		b = pre;
+	} else if (p11card == NULL) {
 		sc_log(context, "%s: First seen the card ", reader->name);
 		p11card = (struct sc_pkcs11_card *)calloc(1, sizeof(struct sc_pkcs11_card));
 		if (!p11card)
 			return CKR_HOST_MEMORY;
 		p11card->reader = reader;
+		reader_slot = reader_get_slot(reader);
+		p11card->lock = reader_slot ? reader_slot->lock : NULL;
 	}
 
 	if (p11card->card == NULL) {
@@ -238,80 +481,424 @@ again:
 
 	/* Detect the framework */
 	if (p11card->framework == NULL) {
-		struct sc_app_info *app_generic = sc_pkcs15_get_application_by_type(p11card->card, "generic");
-		struct sc_pkcs11_slot *first_slot = NULL;
-
-		sc_log(context, "%s: Detecting Framework. %i on-card applications", reader->name, p11card->card->app_count);
-		sc_log(context, "%s: generic application %s", reader->name, app_generic ? app_generic->label : "<none>");
-
-		for (i = 0; frameworks[i]; i++)
-			if (frameworks[i]->bind != NULL)
-				break;
-		/*TODO: only first framework is used: pkcs15init framework is not reachable here */
-		if (frameworks[i] == NULL)
-			return CKR_GENERAL_ERROR;
-
-		/* Initialize framework */
-		sc_log(context, "%s: Detected framework %d. Creating tokens.", reader->name, i);
-		/* Bind firstly 'generic' application or (emulated?) card without applications */
-		if (app_generic || !p11card->card->app_count)   {
-			sc_log(context, "%s: Try to bind 'generic' token.", reader->name);
-			rv = frameworks[i]->bind(p11card, app_generic);
-			if (rv != CKR_OK)   {
-				sc_log(context, "%s: cannot bind 'generic' token.", reader->name);
+		if (b == &binding) {
+			rv = card_bind_apps(p11card, b);
+			if (rv != CKR_OK)
 				return rv;
-			}
-
-			sc_log(context, "%s: Creating 'generic' token.", reader->name);
-			rv = frameworks[i]->create_tokens(p11card, app_generic, &first_slot);
-			if (rv != CKR_OK)   {
-				sc_log(context, "%s: cannot create 'generic' token.", reader->name);
-				return rv;
-			}
 		}
+		rv = card_create_tokens(p11card, b);
+		if (rv != CKR_OK)
+			return rv;
+	}
+	sc_log(context, "%s: Detection ended", reader->name);
+	return CKR_OK;
+}
 
-		/* Now bind the rest of applications that are not 'generic' */
-		for (j = 0; j < p11card->card->app_count; j++)   {
-			struct sc_app_info *app_info = p11card->card->app[j];
-			char *app_name = app_info ? app_info->label : "<anonymous>";
-
-			if (app_generic && app_generic == p11card->card->app[j])
-				continue;
+CK_RV card_detect(sc_reader_t *reader)
+{
+	return __card_detect(reader, NULL);
+}
 
-			sc_log(context, "%s: Binding %s token.", reader->name, app_name);
-			rv = frameworks[i]->bind(p11card, app_info);
-			if (rv != CKR_OK)   {
-				sc_log(context, "%s: cannot bind %s token.", reader->name, app_name);
-				continue;
-			}
+/* The part of card_detect() that talks to a card seen for the first time
+ * in the reader: connects it and binds its applications, with the lock of
+ * the slots of the reader held but not the global lock. card_detect()
+ * then creates the tokens with the global lock held. There is no card in
+ * b->p11card if the reader has none. */
+static CK_RV card_prebind(sc_reader_t *reader, struct sc_pkcs11_card_lock *lock,
+		struct card_binding *b)
+{
+	struct sc_pkcs11_card *p11card;
+	CK_RV rv;
+	int rc;
 
-			sc_log(context, "%s: Creating %s token.", reader->name, app_name);
-			rv = frameworks[i]->create_tokens(p11card, app_info, &first_slot);
-			if (rv != CKR_OK)   {
-				sc_log(context, "%s: cannot create %s token.", reader->name, app_name);
-				return rv;
-			}
-		}
+	memset(b, 0, sizeof(*b));
+	rc = sc_detect_card_presence(reader);
+	if (rc < 0)
+		return sc_to_cryptoki_error(rc, NULL);
+	if (rc == 0)
+		return CKR_OK;
+	b->changed = (rc & SC_READER_CARD_CHANGED) != 0;
 
-		p11card->framework = frameworks[i];
+	p11card = (struct sc_pkcs11_card *)calloc(1, sizeof(struct sc_pkcs11_card));
+	if (!p11card)
+		return CKR_HOST_MEMORY;
+	p11card->reader = reader;
+	p11card->lock = lock;
+
+	sc_log(context, "%s: Connecting ... ", reader->name);
+	rc = sc_connect_card(reader, &p11card->card);
+	if (rc != SC_SUCCESS)
+		rv = sc_to_cryptoki_error(rc, NULL);
+	else
+		rv = card_bind_apps(p11card, b);
+	if (rv != CKR_OK) {
+		card_free(p11card, b->framework);
+		return rv;
 	}
-	sc_log(context, "%s: Detection ended", reader->name);
+	b->p11card = p11card;
 	return CKR_OK;
 }
 
+/* A reader event was seen: the next detection asks the readers again */
+void slot_reader_event(void)
+{
+	reader_events_generation++;
+}
+
+/* Whether the state of the reader was refreshed within the last second
+ * and no reader event has been seen since then */
+static int card_state_fresh(sc_reader_t *reader)
+{
+	struct sc_pkcs11_slot *slot = reader_get_slot(reader);
+	sc_timestamp_t now = get_current_time();
+
+	return slot && now != 0 && now < slot->slot_state_expires
+			&& slot->slot_state_generation == reader_events_generation;
+}
+
+static void card_state_set(sc_reader_t *reader, CK_RV rv)
+{
+	struct sc_pkcs11_slot *slot = reader_get_slot(reader);
+
+	if (slot) {
+		slot->slot_state_expires = get_current_time() + 1000;
+		slot->slot_state_generation = reader_events_generation;
+		slot->slot_state_rv = rv;
+	}
+}
+
+/* card_detect(), unless the state of the reader was refreshed within
+ * the last second and no reader event has been seen since then */
+CK_RV card_detect_cached(sc_reader_t *reader)
+{
+	CK_RV rv;
+
+	if (card_state_fresh(reader))
+		return reader_get_slot(reader)->slot_state_rv;
+
+	rv = card_detect(reader);
+	card_state_set(reader, rv);
+	return rv;
+}
+
+/* card_detect_cached() for the reader of a slot, called with the lock of
+ * the slot and the global lock held. A card seen for the first time is
+ * connected and bound with the global lock released, so that only the
+ * calls for the slots of this reader wait for it. Returns
+ * CKR_CRYPTOKI_NOT_INITIALIZED, with the global lock no longer held, if the
+ * module was finalized meanwhile. */
+CK_RV card_detect_slot(struct sc_pkcs11_slot *slot)
+{
+	sc_reader_t *reader = slot->reader;
+	struct card_binding binding;
+	CK_RV rv;
+
+	if (reader == NULL)
+		return CKR_TOKEN_NOT_PRESENT;
+	if (slot->card != NULL || card_state_fresh(reader))
+		return card_detect_cached(reader);
+
+	sc_pkcs11_unlock();
+	rv = card_prebind(reader, slot->lock, &binding);
+	if (sc_pkcs11_lock() != CKR_OK) {
+		if (binding.p11card)
+			card_free(binding.p11card, binding.framework);
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+
+	if (binding.changed)
+		card_removed(reader);
+	if (rv == CKR_OK)
+		rv = __card_detect(reader, &binding);
+	/* not taken if the reader has lost the card meanwhile */
+	if (binding.p11card)
+		card_free(binding.p11card, binding.framework);
+	card_state_set(reader, rv);
+	return rv;
+}
+
+/* Called without the global lock held: each reader is detected with
+ * the lock of its slots and then the global lock held */
 CK_RV card_detect_all(void) {
 	 unsigned int i;
+	 CK_RV rv;
 
 	 /* Detect cards in all initialized readers */
-	 for (i=0; i< sc_ctx_get_reader_count(context); i++) {
-		 sc_reader_t *reader = sc_ctx_get_reader(context, i);
-		 if (!reader_get_slot(reader))
-			 initialize_reader(reader);
-		 card_detect(sc_ctx_get_reader(context, i));
+	 for (i=0; ; i++) {
+		 sc_reader_t *reader;
+		 struct sc_pkcs11_slot *slot;
+
+		 rv = sc_pkcs11_lock();
+		 if (rv != CKR_OK)
+			 return rv;
+		 if (i >= sc_ctx_get_reader_count(context)) {
+			 sc_pkcs11_unlock();
+			 break;
+		 }
+		 reader = sc_ctx_get_reader(context, i);
+		 slot = reader_get_slot(reader);
+		 if (!slot) {
+			 /* No other thread knows the new slots yet */
+			 initialize_reader(reader, 1);
+			 sc_pkcs11_unlock();
+			 continue;
+		 }
+		 sc_pkcs11_unlock();
+
+		 rv = card_detect_reader(reader);
+		 if (rv != CKR_OK)
+			 return rv;
 	 }
 	 return CKR_OK;
 }
 
+/* Detects the card in one reader the same way, also called without the
+ * global lock held. The global lock is only taken around the updates of
+ * the slots, see card_detect_slot(). */
+CK_RV card_detect_reader(sc_reader_t *reader)
+{
+	struct sc_pkcs11_slot *slot;
+	CK_RV rv;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+	slot = reader_get_slot(reader);
+	sc_pkcs11_unlock();
+	if (!slot)
+		/* ignored reader */
+		return CKR_OK;
+
+	sc_pkcs11_lock_slot(slot);
+	rv = sc_pkcs11_lock();
+	if (rv == CKR_OK && card_detect_slot(slot) == CKR_CRYPTOKI_NOT_INITIALIZED)
+		rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+	else if (rv == CKR_OK)
+		sc_pkcs11_unlock();
+	sc_pkcs11_unlock_slot(slot);
+	return rv;
+}
+
+/*
+ * With defer_card_connect, the token info of a card that is not connected
+ * yet is the one of the last token bound with the same ATR in the same
+ * reader, kept in "<cache_dir>/<ATR>.p11token" if use_file_caching is set:
+ *
+ *   "OSCP11T2 <size>\n"	magic and sizeof(CK_TOKEN_INFO)
+ *   "<reader name>\n"
+ *   CK_TOKEN_INFO		as bound, see token_info_strip_card()
+ *
+ * Another card of the same type has the same ATR, so only what the ATR
+ * tells is kept: the label, serial number and PIN state of the card are
+ * not known before it is bound.
+ */
+#define TOKEN_INFO_MAGIC	"OSCP11T2"
+
+static void token_info_strip_card(CK_TOKEN_INFO *info)
+{
+	memset(info->label, ' ', sizeof(info->label));
+	memset(info->serialNumber, ' ', sizeof(info->serialNumber));
+	info->flags &= ~(CKF_USER_PIN_COUNT_LOW | CKF_USER_PIN_FINAL_TRY
+			| CKF_USER_PIN_LOCKED | CKF_USER_PIN_TO_BE_CHANGED
+			| CKF_SO_PIN_COUNT_LOW | CKF_SO_PIN_FINAL_TRY
+			| CKF_SO_PIN_LOCKED | CKF_SO_PIN_TO_BE_CHANGED);
+}
+
+static int token_info_filename(sc_reader_t *reader, char *buf, size_t bufsize)
+{
+	scconf_block *conf_block;
+	char dir[PATH_MAX];
+	char atr[SC_MAX_ATR_SIZE * 2 + 1];
+	int r;
+
+	conf_block = sc_get_conf_block(context, "framework", "pkcs15", 1);
+	if (!conf_block || !scconf_get_bool(conf_block, "use_file_caching", 0))
+		return 0;
+	if (reader->atr.len == 0
+			|| sc_get_cache_dir(context, dir, sizeof(dir)) != SC_SUCCESS
+			|| sc_bin_to_hex(reader->atr.value, reader->atr.len, atr, sizeof(atr), 0) != SC_SUCCESS)
+		return 0;
+	r = snprintf(buf, bufsize, "%s/%s.p11token", dir, atr);
+	return r > 0 && (size_t) r < bufsize;
+}
+
+static void slot_load_token_info(struct sc_pkcs11_slot *slot)
+{
+	char fname[PATH_MAX], magic[32], expected[32], name[256];
+	CK_TOKEN_INFO info;
+	FILE *f;
+
+	slot->token_info_cached = 0;
+	if (!token_info_filename(slot->reader, fname, sizeof(fname)))
+		return;
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return;
+	snprintf(expected, sizeof(expected), "%s %u\n", TOKEN_INFO_MAGIC, (unsigned int) sizeof(info));
+	if (fgets(magic, sizeof(magic), f) && !strcmp(magic, expected)
+			&& fgets(name, sizeof(name), f)
+			&& (name[strcspn(name, "\n")] = '\0', !strcmp(name, slot->reader->name))
+			&& fread(&info, sizeof(info), 1, f) == 1) {
+		memcpy(&slot->token_info, &info, sizeof(info));
+		slot->token_info_cached = 1;
+		sc_log(context, "%s: token info read from %s", slot->reader->name, fname);
+	}
+	fclose(f);
+}
+
+static void slot_store_token_info(struct sc_pkcs11_slot *slot)
+{
+	char fname[PATH_MAX];
+	CK_TOKEN_INFO info;
+	FILE *f;
+	int ok;
+
+	if (!token_info_filename(slot->reader, fname, sizeof(fname)))
+		return;
+	f = fopen(fname, "wb");
+	if (f == NULL)
+		return;
+	memcpy(&info, &slot->token_info, sizeof(info));
+	token_info_strip_card(&info);
+	ok = fprintf(f, "%s %u\n%s\n", TOKEN_INFO_MAGIC, (unsigned int) sizeof(info),
+			slot->reader->name) > 0
+		&& fwrite(&info, sizeof(info), 1, f) == 1;
+	if (fclose(f) != 0 || !ok)
+		remove(fname);
+}
+
+/* Binds the card seen by card_probe_all(), with the slot and the global
+ * lock held. The global lock is released during the bind, see
+ * card_detect_slot(). */
+static CK_RV slot_bind_pending(struct sc_pkcs11_slot *slot)
+{
+	CK_RV rv;
+
+	slot->slot_state_expires = 0;
+	rv = card_detect_slot(slot);
+	if (rv == CKR_CRYPTOKI_NOT_INITIALIZED)
+		return rv;
+	slot->bind_pending = 0;
+	slot->token_info_cached = 0;
+	if (slot->card == NULL)
+		slot->slot_info.flags &= ~CKF_TOKEN_PRESENT;
+	else if (rv == CKR_OK && sc_pkcs11_conf.defer_card_connect)
+		slot_store_token_info(slot);
+	return rv;
+}
+
+/* With defer_card_connect, only asks the reader whether the card seen by
+ * card_probe_all() is still there, with the slot and the global lock held */
+static void slot_check_pending(struct sc_pkcs11_slot *slot)
+{
+	int rc = sc_detect_card_presence(slot->reader);
+
+	if (rc == 0) {
+		card_removed(slot->reader);
+	} else if (rc > 0 && (rc & SC_READER_CARD_CHANGED)) {
+		sc_log(context, "%s: card changed, still not connected", slot->reader->name);
+		slot->events = SC_EVENT_CARD_INSERTED;
+		slot_load_token_info(slot);
+	}
+}
+
+/* Like card_detect_all(), but a card that is not bound yet is only seen in
+ * the state of its reader: the first slot of the reader presents the token
+ * at once and the card is bound in the background, if the module may use
+ * threads, or with defer_card_connect by the first call that needs the
+ * token. Called without the global lock held. */
+CK_RV card_probe_all(void)
+{
+	unsigned int i;
+	CK_RV rv;
+
+	for (i = 0; ; i++) {
+		sc_reader_t *reader;
+		struct sc_pkcs11_slot *slot;
+		int rc;
+
+		rv = sc_pkcs11_lock();
+		if (rv != CKR_OK)
+			return rv;
+		if (i >= sc_ctx_get_reader_count(context)) {
+			sc_pkcs11_unlock();
+			break;
+		}
+		reader = sc_ctx_get_reader(context, i);
+		slot = reader_get_slot(reader);
+		if (!slot) {
+			initialize_reader(reader, 0);
+			slot = reader_get_slot(reader);
+		}
+		if (!slot || (slot->bind_pending && !sc_pkcs11_conf.defer_card_connect)) {
+			sc_pkcs11_unlock();
+			continue;
+		}
+		if (slot->card != NULL) {
+			sc_pkcs11_unlock();
+			rv = card_detect_reader(reader);
+			if (rv != CKR_OK)
+				return rv;
+			continue;
+		}
+		sc_pkcs11_unlock();
+
+		sc_pkcs11_lock_slot(slot);
+		rv = sc_pkcs11_lock();
+		if (rv != CKR_OK) {
+			sc_pkcs11_unlock_slot(slot);
+			return rv;
+		}
+		if (slot->bind_pending) {
+			if (sc_pkcs11_conf.defer_card_connect)
+				slot_check_pending(slot);
+			sc_pkcs11_unlock();
+			sc_pkcs11_unlock_slot(slot);
+			continue;
+		}
+		rc = slot->card == NULL ? sc_detect_card_presence(reader) : 0;
+		if (rc > 0 && sc_pkcs11_conf.defer_card_connect) {
+			sc_log(context, "%s: card present, not connected yet", reader->name);
+			slot->bind_pending = 1;
+			slot->slot_info.flags |= CKF_TOKEN_PRESENT;
+			slot->events = SC_EVENT_CARD_INSERTED;
+			slot_load_token_info(slot);
+		} else if (rc > 0 && sc_pkcs11_bind_in_background(reader)) {
+			sc_log(context, "%s: card present, binding it in the background", reader->name);
+			slot->bind_pending = 1;
+			slot->slot_info.flags |= CKF_TOKEN_PRESENT;
+		} else if (rc >= 0 && card_detect_slot(slot) == CKR_CRYPTOKI_NOT_INITIALIZED) {
+			sc_pkcs11_unlock_slot(slot);
+			return CKR_CRYPTOKI_NOT_INITIALIZED;
+		}
+		sc_pkcs11_unlock();
+		sc_pkcs11_unlock_slot(slot);
+	}
+	return CKR_OK;
+}
+
+/* The background bind of the card seen by card_probe_all(), called
+ * without the global lock held. Only the calls for the slots of the
+ * reader wait for it. */
+void card_bind_pending(sc_reader_t *reader)
+{
+	struct sc_pkcs11_slot *slot;
+
+	if (sc_pkcs11_lock() != CKR_OK)
+		return;
+	slot = reader_get_slot(reader);
+	sc_pkcs11_unlock();
+	if (!slot)
+		return;
+
+	sc_pkcs11_lock_slot(slot);
+	if (sc_pkcs11_lock() == CKR_OK) {
+		if (!slot->bind_pending || slot_bind_pending(slot) != CKR_CRYPTOKI_NOT_INITIALIZED)
+			sc_pkcs11_unlock();
+	}
+	sc_pkcs11_unlock_slot(slot);
+}
+
 /* Allocates an existing slot to a card */
 CK_RV slot_allocate(struct sc_pkcs11_slot ** slot, struct sc_pkcs11_card * card)
 {
@@ -339,12 +926,47 @@ CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	*slot = list_seek(&virtual_slots, &id);	/* FIXME: check for null? */
+	*slot = (id & SLOT_INDEX_MASK) < slot_table_size ? slot_table[id & SLOT_INDEX_MASK] : NULL;
+	if (*slot && (*slot)->id != id)
+		*slot = NULL;
+	if (!*slot && sc_pkcs11_conf.plug_and_play) {
+		/* the ID of the hotplug slot changes, see C_GetSlotList() */
+		struct sc_pkcs11_slot *hotplug_slot = list_get_at(&virtual_slots, 0);
+
+		if (hotplug_slot && !hotplug_slot->reader && hotplug_slot->id == id)
+			*slot = hotplug_slot;
+	}
 	if (!*slot)
 		return CKR_SLOT_ID_INVALID;
 	return CKR_OK;
 }
 
+/* Locks the slot and then the global lock, for the functions that work on
+ * both the card and the slot or session tables */
+CK_RV sc_pkcs11_lock_slot_id(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
+{
+	CK_RV rv;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+	rv = slot_get_slot(id, slot);
+	sc_pkcs11_unlock();
+	if (rv != CKR_OK)
+		return rv;
+
+	/* The slots are only freed by C_Finalize() */
+	sc_pkcs11_lock_slot(*slot);
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		sc_pkcs11_unlock_slot(*slot);
+	return rv;
+}
+
+/* Called with the lock of the slot and the global lock held. A card that
+ * is not bound yet is bound with the global lock released: on
+ * CKR_CRYPTOKI_NOT_INITIALIZED it is not held any more, see
+ * card_detect_slot(). */
 CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 {
 	int rv;
@@ -353,10 +975,15 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 	if (rv != CKR_OK)
 		return rv;
 
-	if (!((*slot)->slot_info.flags & CKF_TOKEN_PRESENT)) {
+	if ((*slot)->bind_pending) {
+		/* the token contents are needed now */
+		rv = slot_bind_pending(*slot);
+		if (rv != CKR_OK)
+			return rv;
+	} else if (!((*slot)->slot_info.flags & CKF_TOKEN_PRESENT)) {
 		if ((*slot)->reader == NULL)
 			return CKR_TOKEN_NOT_PRESENT;
-		rv = card_detect((*slot)->reader);
+		rv = card_detect_slot(*slot);
 		if (rv != CKR_OK)
 			return rv;
 	}
@@ -388,6 +1015,8 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 		if (object->ops->release)
 			object->ops->release(object);
 	}
+	slot_free_handle_table(slot);
+	slot_objects_changed(slot);
 
 	/* Release framework stuff */
 	if (slot->card != NULL) {
@@ -399,7 +1028,10 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	/* Reset relevant slot properties */
 	slot->slot_info.flags &= ~CKF_TOKEN_PRESENT;
 	slot->login_user = -1;
+	slot->login_group = 0;
 	slot->card = NULL;
+	slot->bind_pending = 0;
+	slot->token_info_cached = 0;
 
 	if (token_was_present)
 		slot->events = SC_EVENT_CARD_REMOVED;
@@ -407,13 +1039,201 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	return CKR_OK;
 }
 
-/* Called from C_WaitForSlotEvent */
+/* The objects of the slot, or what they read like, have changed: drop
+ * the search index and the cached attribute values */
+void slot_objects_changed(struct sc_pkcs11_slot *slot)
+{
+	sc_pkcs11_drop_object_index(slot);
+	slot->objects_generation++;
+}
+
+/*
+ * Open addressing hash of the objects of a slot by handle, next to
+ * slot->objects, so that resolving a handle does not walk the list.
+ * Removed objects leave a marker behind until the table is rebuilt.
+ *
+ * Session objects flagged SC_PKCS11_OBJECT_SESSION, the secrets of
+ * C_DeriveKey(), are in the table only: adding and destroying them
+ * leaves the list and its search index alone.
+ */
+static struct sc_pkcs11_object handle_table_removed;
+
+static unsigned int handle_hash(CK_OBJECT_HANDLE handle)
+{
+	unsigned long h = (unsigned long) handle;
+
+	/* the handles are addresses */
+	h ^= h >> 4;
+	h ^= h >> 16;
+	return (unsigned int) (h * 0x9E3779B1UL);
+}
+
+static void handle_table_insert(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	unsigned int i = handle_hash(object->handle) & slot->handle_table_mask;
+
+	while (slot->handle_table[i] != NULL && slot->handle_table[i] != &handle_table_removed)
+		i = (i + 1) & slot->handle_table_mask;
+	if (slot->handle_table[i] == NULL)
+		slot->handle_table_used++;
+	slot->handle_table[i] = object;
+}
+
+static void handle_table_remove(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	unsigned int i;
+
+	if (slot->handle_table == NULL)
+		return;
+	i = handle_hash(object->handle) & slot->handle_table_mask;
+	while (slot->handle_table[i] != NULL) {
+		if (slot->handle_table[i] == object) {
+			slot->handle_table[i] = &handle_table_removed;
+			break;
+		}
+		i = (i + 1) & slot->handle_table_mask;
+	}
+}
+
+/* Sizes the table for the objects of the list and the session objects,
+ * dropping the markers; the old table is kept if that fails */
+static CK_RV handle_table_rebuild(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_object **table, **old = slot->handle_table;
+	struct sc_pkcs11_object *object;
+	unsigned int i, old_size = slot->handle_table_mask + 1;
+	unsigned int size = 16, count = list_size(&slot->objects) + slot->session_objects;
+
+	while (size < 4 * count)
+		size <<= 1;
+	table = calloc(size, sizeof(*table));
+	if (table == NULL)
+		return CKR_HOST_MEMORY;
+	slot->handle_table = table;
+	slot->handle_table_mask = size - 1;
+	slot->handle_table_used = 0;
+
+	list_iterator_start(&slot->objects);
+	while ((object = list_iterator_next(&slot->objects)))
+		handle_table_insert(slot, object);
+	list_iterator_stop(&slot->objects);
+
+	/* the session objects are nowhere else */
+	for (i = 0; old != NULL && i < old_size; i++)
+		if (old[i] != NULL && (old[i]->flags & SC_PKCS11_OBJECT_SESSION))
+			handle_table_insert(slot, old[i]);
+	free(old);
+	return CKR_OK;
+}
+
+void slot_free_handle_table(struct sc_pkcs11_slot *slot)
+{
+	free(slot->handle_table);
+	slot->handle_table = NULL;
+	slot->handle_table_mask = slot->handle_table_used = 0;
+	slot->session_objects = 0;
+}
+
+/* The table is grown when half full, so the old one has room left if
+ * that fails */
+static CK_RV handle_table_add(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	if (slot->handle_table && 2 * (slot->handle_table_used + 1) <= slot->handle_table_mask + 1)
+		handle_table_insert(slot, object);
+	else if (handle_table_rebuild(slot) == CKR_OK || (slot->handle_table
+			&& slot->handle_table_used + 1 <= slot->handle_table_mask))
+		handle_table_insert(slot, object);
+	else
+		return CKR_HOST_MEMORY;
+	return CKR_OK;
+}
+
+void slot_add_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	list_append(&slot->objects, object);
+	slot_objects_changed(slot);
+
+	if (handle_table_add(slot, object) != CKR_OK)
+		/* slot_find_object() walks the list */
+		slot_free_handle_table(slot);
+}
+
+void slot_remove_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	list_delete(&slot->objects, object);
+	slot_objects_changed(slot);
+	handle_table_remove(slot, object);
+}
+
+/* A session object is found by its handle and by C_FindObjects() through
+ * slot_next_session_object(), but is not one of slot->objects */
+CK_RV slot_add_session_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	CK_RV rv;
+
+	object->flags |= SC_PKCS11_OBJECT_SESSION;
+	slot->session_objects++;
+	rv = handle_table_add(slot, object);
+	if (rv != CKR_OK)
+		slot->session_objects--;
+	return rv;
+}
+
+void slot_remove_session_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	handle_table_remove(slot, object);
+	if (slot->session_objects)
+		slot->session_objects--;
+}
+
+/* Walks the session objects of the slot, *pos starting at 0 */
+struct sc_pkcs11_object *slot_next_session_object(struct sc_pkcs11_slot *slot, unsigned int *pos)
+{
+	struct sc_pkcs11_object *object;
+
+	if (slot->session_objects == 0 || slot->handle_table == NULL)
+		return NULL;
+	while (*pos <= slot->handle_table_mask) {
+		object = slot->handle_table[(*pos)++];
+		if (object != NULL && (object->flags & SC_PKCS11_OBJECT_SESSION))
+			return object;
+	}
+	return NULL;
+}
+
+struct sc_pkcs11_object *slot_find_object(struct sc_pkcs11_slot *slot, CK_OBJECT_HANDLE handle)
+{
+	struct sc_pkcs11_object *object;
+	unsigned int i;
+
+	if (slot->handle_table == NULL)
+		return list_seek(&slot->objects, &handle);
+
+	i = handle_hash(handle) & slot->handle_table_mask;
+	while ((object = slot->handle_table[i]) != NULL) {
+		if (object != &handle_table_removed && object->handle == handle)
+			return object;
+		i = (i + 1) & slot->handle_table_mask;
+	}
+	return NULL;
+}
+
+/* Called from C_WaitForSlotEvent with the global lock held, which is
+ * released while the cards are detected. Returns
+ * CKR_CRYPTOKI_NOT_INITIALIZED, with the global lock no longer held, if the
+ * module was finalized meanwhile. */
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 {
 	unsigned int i;
 	LOG_FUNC_CALLED(context);
 
-	card_detect_all();
+	sc_pkcs11_unlock();
+	if (sc_pkcs11_conf.defer_card_connect)
+		card_probe_all();
+	else
+		card_detect_all();
+	if (sc_pkcs11_lock() != CKR_OK)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
 	for (i=0; i<list_size(&virtual_slots); i++) {
 		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
 		sc_log(context, "slot 0x%lx token: %d events: 0x%02X",slot->id, (slot->slot_info.flags & CKF_TOKEN_PRESENT), slot->events);
@@ -432,3 +1252,62 @@ CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 	}
 	LOG_FUNC_RETURN(context, CKR_NO_EVENT);
 }
+
+/*
+ * The key pool: with key_pool set, C_Sign() goes to whichever of the
+ * tokens holding the same private key, in readers of their own and
+ * logged in like the session's, has the fewest pooled signatures on it
+ * or waiting for it; the session's own token wins ties. Picks that slot,
+ * counts the signature on it and tells the handle of the key there and
+ * the generation of the slot's objects the handle is good for. For
+ * another slot than the session's, the session is held as with
+ * sc_pkcs11_use_session(). Called with the lock of the session's slot.
+ */
+CK_RV slot_pool_pick(struct sc_pkcs11_session *session, struct sc_pkcs11_object *key,
+		struct sc_pkcs11_slot **pool_slot, CK_OBJECT_HANDLE *pool_key, unsigned int *generation)
+{
+	struct sc_pkcs11_slot *slot = session->slot, *best = slot;
+	struct sc_pkcs11_object *best_key = key, *peer_key;
+	unsigned int i;
+	CK_RV rv;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+	if (slot->card && slot->card->framework->find_pool_key) {
+		for (i = 0; i < list_size(&virtual_slots); i++) {
+			sc_pkcs11_slot_t *peer = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+
+			/* the slots of a reader share the card */
+			if (peer->lock == slot->lock || peer->card == NULL
+					|| peer->card->framework != slot->card->framework
+					|| peer->login_user != slot->login_user
+					|| peer->pool_users >= best->pool_users)
+				continue;
+			if (slot->card->framework->find_pool_key(slot, key, peer, &peer_key) != CKR_OK)
+				continue;
+			best = peer;
+			best_key = peer_key;
+		}
+	}
+	best->pool_users++;
+	if (best != slot)
+		session->host_users++;
+	*pool_slot = best;
+	*pool_key = best_key->handle;
+	*generation = best->objects_generation;
+	sc_pkcs11_unlock();
+
+	if (best != slot)
+		sc_log(context, "key pool: signing on slot 0x%lx instead of 0x%lx", best->id, slot->id);
+	return CKR_OK;
+}
+
+/* The pooled signature picked on the slot is done */
+void slot_pool_leave(struct sc_pkcs11_slot *slot)
+{
+	if (sc_pkcs11_lock() != CKR_OK)
+		return;
+	slot->pool_users--;
+	sc_pkcs11_unlock();
+}
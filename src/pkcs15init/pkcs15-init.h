@@ -149,6 +149,9 @@ struct sc_pkcs15init_operations {
 #define SC_PKCS15INIT_ID_STYLE_MOZILLA	1
 #define SC_PKCS15INIT_ID_STYLE_RFC2459	2
 
+/* Application name of the data object holding the pre-generated keys */
+#define SC_PKCS15INIT_KEYPOOL_APP_LABEL	"OpenSC key pool"
+
 #define SC_PKCS15INIT_SO_PIN		0
 #define SC_PKCS15INIT_SO_PUK		1
 #define SC_PKCS15INIT_USER_PIN		2
@@ -298,6 +301,11 @@ extern int	sc_pkcs15init_generate_key(struct sc_pkcs15_card *,
 				struct sc_pkcs15init_keygen_args *,
 				unsigned int keybits,
 				struct sc_pkcs15_object **);
+extern int	sc_pkcs15init_fill_key_pool(struct sc_pkcs15_card *,
+				struct sc_profile *,
+				struct sc_pkcs15init_keygen_args *,
+				unsigned int keybits,
+				unsigned int count);
 extern int	sc_pkcs15init_store_private_key(struct sc_pkcs15_card *,
 				struct sc_profile *,
 				struct sc_pkcs15init_prkeyargs *,
@@ -370,6 +378,13 @@ extern int	sc_pkcs15init_delete_by_path(struct sc_profile *,
 extern int	sc_pkcs15init_update_any_df(struct sc_pkcs15_card *, struct sc_profile *,
 			struct sc_pkcs15_df *, int);
 
+/* Between these, the directory files, ODF and TokenInfo are only marked as
+ * changed, and each of them is written once by the commit. Batches nest,
+ * the outermost commit writes; sc_pkcs15init_unbind() commits an open one.
+ */
+extern int	sc_pkcs15init_begin_batch(struct sc_profile *);
+extern int	sc_pkcs15init_commit_batch(struct sc_pkcs15_card *, struct sc_profile *);
+
 /* Erasing the card structure via rm -rf */
 extern int	sc_pkcs15init_erase_card_recursively(struct sc_pkcs15_card *,
 				struct sc_profile *);
@@ -388,6 +403,9 @@ extern int	sc_pkcs15_create_pin_domain(struct sc_profile *, struct sc_pkcs15_car
 extern int	sc_pkcs15init_get_pin_reference(struct sc_pkcs15_card *,
 				struct sc_profile *, unsigned, int);
 
+extern int	sc_pkcs15init_select_intrinsic_id(struct sc_pkcs15_card *,
+				struct sc_profile *, int, struct sc_pkcs15_id *, void *);
+
 extern int	sc_pkcs15init_sanity_check(struct sc_pkcs15_card *, struct sc_profile *);
 
 extern int	sc_pkcs15init_finalize_profile(struct sc_card *card, struct sc_profile *profile,
@@ -44,6 +44,13 @@
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#define sleep(t)	Sleep((t) * 1000)
+#endif
 #include <assert.h>
 #ifdef ENABLE_OPENSSL
 #include <openssl/bn.h>
@@ -80,6 +87,8 @@
 #define TEMPLATE_INSTANTIATE_MIN_INDEX	0x0
 #define TEMPLATE_INSTANTIATE_MAX_INDEX	0xFE
 
+#define KEYPOOL_MAX_KEYS		16
+
 /* Maximal number of access conditions that can be defined for one card operation. */
 #define SC_MAX_OP_ACS                   16
 
@@ -117,6 +126,9 @@ static int	prkey_pkcs15_algo(struct sc_pkcs15_card *, struct sc_pkcs15_prkey *);
 static int	select_intrinsic_id(struct sc_pkcs15_card *, struct sc_profile *,
 			int, struct sc_pkcs15_id *, void *);
 static int	select_id(struct sc_pkcs15_card *, int, struct sc_pkcs15_id *);
+static int	generate_new_key(struct sc_pkcs15_card *, struct sc_profile *,
+			struct sc_pkcs15init_keygen_args *, unsigned int, int,
+			struct sc_pkcs15_object **);
 static int	select_object_path(struct sc_pkcs15_card *, struct sc_profile *,
 			struct sc_pkcs15_object *, struct sc_path *);
 static int	sc_pkcs15init_get_pin_path(struct sc_pkcs15_card *,
@@ -416,11 +428,24 @@ sc_pkcs15init_unbind(struct sc_profile *profile)
 	struct sc_context *ctx = profile->card->ctx;
 
 	LOG_FUNC_CALLED(ctx);
+	if (profile->batch.depth && profile->p15_data != NULL) {
+		profile->batch.depth = 1;
+		r = sc_pkcs15init_commit_batch(profile->p15_data, profile);
+		if (r < 0)
+			sc_log(ctx, "Failed to write the changes of the batch: %s", sc_strerror(r));
+	}
 	sc_log(ctx, "Pksc15init Unbind: %i:%p:%i", profile->dirty, profile->p15_data, profile->pkcs15.do_last_update);
-	if (profile->dirty != 0 && profile->p15_data != NULL && profile->pkcs15.do_last_update) {
-		r = sc_pkcs15init_update_lastupdate(profile->p15_data, profile);
+	if (profile->dirty != 0 && profile->p15_data != NULL) {
+		r = SC_ERROR_NOT_SUPPORTED;
+		if (profile->pkcs15.do_last_update) {
+			r = sc_pkcs15init_update_lastupdate(profile->p15_data, profile);
+			if (r < 0)
+				sc_log(ctx, "Failed to update TokenInfo: %s", sc_strerror(r));
+		}
+		/* Without a new lastUpdate the file caches cannot tell that
+		 * the token changed; at least this host's copies go away */
 		if (r < 0)
-			sc_log(ctx, "Failed to update TokenInfo: %s", sc_strerror(r));
+			sc_pkcs15_remove_cache(profile->p15_data);
 	}
 	if (profile->dll)
 		sc_dlclose(profile->dll);
@@ -612,6 +637,48 @@ sc_pkcs15init_delete_by_path(struct sc_profile *profile, struct sc_pkcs15_card *
 }
 
 
+/* Delete the file itself, its contents are left to the card */
+static int
+rmdir_delete(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct sc_file *df)
+{
+	struct sc_path	path;
+	struct sc_file	*parent;
+	int		r;
+
+	/* Select the parent DF */
+	path = df->path;
+	path.len -= 2;
+	r = sc_select_file(p15card->card, &path, &parent);
+	if (r < 0)
+		return r;
+
+	r = sc_pkcs15init_authenticate(profile, p15card, df, SC_AC_OP_DELETE);
+	if (r < 0) {
+		sc_file_free(parent);
+		return r;
+	}
+	r = sc_pkcs15init_authenticate(profile, p15card, parent, SC_AC_OP_DELETE);
+	sc_file_free(parent);
+	if (r < 0)
+		return r;
+
+	memset(&path, 0, sizeof(path));
+	path.type = SC_PATH_TYPE_FILE_ID;
+	path.value[0] = df->id >> 8;
+	path.value[1] = df->id & 0xFF;
+	path.len = 2;
+
+	/* ensure that the card is in the correct lifecycle */
+	r = sc_pkcs15init_set_lifecycle(p15card->card, SC_CARDCTRL_LIFECYCLE_ADMIN);
+	if (r < 0 && r != SC_ERROR_NOT_SUPPORTED)
+		return r;
+
+	r = sc_delete_file(p15card->card, &path);
+	return r;
+}
+
+
 /*
  * Try to delete a file (and, in the DF case, its contents).
  * Note that this will not work if a pkcs#15 file's ERASE AC
@@ -624,13 +691,24 @@ sc_pkcs15init_rmdir(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
 	struct sc_context *ctx = p15card->card->ctx;
 	unsigned char buffer[1024];
 	struct sc_path	path;
-	struct sc_file	*file, *parent;
+	struct sc_file	*file;
 	int		r = 0, nfids;
 
 	if (df == NULL)
 		return SC_ERROR_INTERNAL;
 	sc_log(ctx, "sc_pkcs15init_rmdir(%s)", sc_print_path(&df->path));
 
+	if (df->type == SC_FILE_TYPE_DF
+			&& (p15card->card->caps & SC_CARD_CAP_DELETE_DF_RECURSIVE)) {
+		/* One DELETE FILE for the whole subtree; when the card
+		 * refuses it, empty the DF file by file as below */
+		r = rmdir_delete(p15card, profile, df);
+		if (r >= 0 || r == SC_ERROR_FILE_NOT_FOUND)
+			return r;
+		sc_log(ctx, "Deleting the whole DF failed (%d), deleting its files", r);
+		r = 0;
+	}
+
 	if (df->type == SC_FILE_TYPE_DF) {
 		r = sc_pkcs15init_authenticate(profile, p15card, df, SC_AC_OP_LIST_FILES);
 		if (r < 0)
@@ -660,36 +738,7 @@ sc_pkcs15init_rmdir(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
 			return r;
 	}
 
-	/* Select the parent DF */
-	path = df->path;
-	path.len -= 2;
-	r = sc_select_file(p15card->card, &path, &parent);
-	if (r < 0)
-		return r;
-
-	r = sc_pkcs15init_authenticate(profile, p15card, df, SC_AC_OP_DELETE);
-	if (r < 0) {
-		sc_file_free(parent);
-		return r;
-	}
-	r = sc_pkcs15init_authenticate(profile, p15card, parent, SC_AC_OP_DELETE);
-	sc_file_free(parent);
-	if (r < 0)
-		return r;
-
-	memset(&path, 0, sizeof(path));
-	path.type = SC_PATH_TYPE_FILE_ID;
-	path.value[0] = df->id >> 8;
-	path.value[1] = df->id & 0xFF;
-	path.len = 2;
-
-	/* ensure that the card is in the correct lifecycle */
-	r = sc_pkcs15init_set_lifecycle(p15card->card, SC_CARDCTRL_LIFECYCLE_ADMIN);
-	if (r < 0 && r != SC_ERROR_NOT_SUPPORTED)
-		return r;
-
-	r = sc_delete_file(p15card->card, &path);
-	return r;
+	return rmdir_delete(p15card, profile, df);
 }
 
 
@@ -1248,6 +1297,386 @@ sc_pkcs15init_init_prkdf(struct sc_pkcs15_card *p15card,
 }
 
 
+/*
+ * Key pool.
+ *
+ * On-card key generation is slow, so keys can be generated in advance
+ * while the card is otherwise idle, without binding them to a PrKDF entry.
+ * The pool is kept in a public data object; every entry is the encoded
+ * PrKDF entry of an unbound key followed by its encoded public key.
+ * sc_pkcs15init_generate_key() claims a matching key from the pool
+ * before falling back to generating a new one.
+ */
+struct keypool {
+	struct sc_pkcs15_object *dobj;
+	struct sc_pkcs15_object *keys[KEYPOOL_MAX_KEYS];
+	int count;
+};
+
+static void
+keypool_release(struct sc_pkcs15_card *p15card, struct keypool *pool)
+{
+	int ii;
+
+	for (ii = 0; ii < pool->count; ii++)   {
+		sc_pkcs15_remove_object(p15card, pool->keys[ii]);
+		sc_pkcs15_free_object(pool->keys[ii]);
+	}
+	pool->count = 0;
+}
+
+
+/*
+ * Read the key pool. The unbound keys are linked into the in-memory
+ * object list, so that no other key is given the same key reference,
+ * path or ID while the pool is loaded.
+ */
+static int
+keypool_load(struct sc_pkcs15_card *p15card, struct keypool *pool)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_data *data = NULL;
+	struct sc_pkcs15_object *obj;
+	const unsigned char *p, *q;
+	unsigned int cla, tag;
+	size_t left, taglen;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+	memset(pool, 0, sizeof(*pool));
+
+	r = sc_pkcs15_find_data_object_by_name(p15card, SC_PKCS15INIT_KEYPOOL_APP_LABEL, NULL, &pool->dobj);
+	if (r == SC_ERROR_OBJECT_NOT_FOUND)
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	LOG_TEST_RET(ctx, r, "Cannot find key pool data object");
+
+	r = sc_pkcs15_read_data_object(p15card, (struct sc_pkcs15_data_info *)pool->dobj->data, &data);
+	LOG_TEST_RET(ctx, r, "Cannot read key pool data object");
+
+	p = data->data;
+	left = data->data_len;
+	while (left && pool->count < KEYPOOL_MAX_KEYS)   {
+		obj = calloc(1, sizeof(*obj));
+		if (!obj)   {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+
+		r = sc_pkcs15_decode_prkdf_entry(p15card, obj, &p, &left);
+		if (r == SC_ERROR_ASN1_END_OF_CONTENTS)   {
+			free(obj);
+			r = SC_SUCCESS;
+			break;
+		}
+		if (r < 0)   {
+			free(obj);
+			break;
+		}
+
+		/* the public key follows as a single DER SEQUENCE */
+		q = p;
+		r = sc_asn1_read_tag(&q, left, &cla, &tag, &taglen);
+		if (r != SC_SUCCESS || q == NULL || taglen > left - (q - p))   {
+			sc_pkcs15_free_object(obj);
+			r = SC_ERROR_INVALID_ASN1_OBJECT;
+			break;
+		}
+		obj->content.len = (q - p) + taglen;
+		obj->content.value = malloc(obj->content.len);
+		if (!obj->content.value)   {
+			sc_pkcs15_free_object(obj);
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		memcpy(obj->content.value, p, obj->content.len);
+		p += obj->content.len;
+		left -= obj->content.len;
+
+		sc_pkcs15_add_object(p15card, obj);
+		pool->keys[pool->count++] = obj;
+	}
+	sc_pkcs15_free_data_object(data);
+
+	if (r < 0)
+		keypool_release(p15card, pool);
+	LOG_TEST_RET(ctx, r, "Cannot decode key pool");
+
+	sc_log(ctx, "%i key(s) in the key pool", pool->count);
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+/*
+ * Write the key pool back to the card. The data object is updated in place
+ * when the new content fits, and is re-created otherwise.
+ */
+static int
+keypool_store(struct sc_pkcs15_card *p15card, struct sc_profile *profile, struct keypool *pool)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15init_dataargs args;
+	struct sc_pkcs15_data_info *info;
+	struct sc_file *file = NULL;
+	unsigned char *buf = NULL, *entry = NULL, *tmp;
+	size_t len = 0, entry_len;
+	int ii, r = SC_SUCCESS;
+
+	LOG_FUNC_CALLED(ctx);
+	for (ii = 0; ii < pool->count; ii++)   {
+		struct sc_pkcs15_object *obj = pool->keys[ii];
+
+		r = sc_pkcs15_encode_prkdf_entry(ctx, obj, &entry, &entry_len);
+		if (r < 0)
+			break;
+
+		tmp = realloc(buf, len + entry_len + obj->content.len);
+		if (!tmp)   {
+			free(entry);
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		buf = tmp;
+		memcpy(buf + len, entry, entry_len);
+		memcpy(buf + len + entry_len, obj->content.value, obj->content.len);
+		len += entry_len + obj->content.len;
+		free(entry);
+	}
+	if (r < 0)   {
+		free(buf);
+		LOG_TEST_RET(ctx, r, "Cannot encode key pool");
+	}
+
+	if (!len)   {
+		/* empty pool: a single end-of-contents byte, the rest gets zeroed */
+		buf = calloc(1, 1);
+		if (!buf)
+			LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "Cannot allocate key pool");
+		len = 1;
+	}
+
+	if (pool->dobj)   {
+		info = (struct sc_pkcs15_data_info *)pool->dobj->data;
+		r = sc_select_file(p15card->card, &info->path, &file);
+		if (!r)
+			r = sc_pkcs15init_update_file(profile, p15card, file, buf, len);
+		sc_file_free(file);
+
+		if (!r)   {
+			/* keep the cached content in sync with the card */
+			free(info->data.value);
+			info->data.value = buf;
+			info->data.len = len;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+		if (r != SC_ERROR_FILE_TOO_SMALL)   {
+			free(buf);
+			LOG_TEST_RET(ctx, r, "Cannot update key pool");
+		}
+
+		r = sc_pkcs15init_delete_object(p15card, profile, pool->dobj);
+		pool->dobj = NULL;
+		if (r < 0)   {
+			free(buf);
+			LOG_TEST_RET(ctx, r, "Cannot delete old key pool");
+		}
+	}
+
+	memset(&args, 0, sizeof(args));
+	args.label = "Key pool";
+	args.app_label = SC_PKCS15INIT_KEYPOOL_APP_LABEL;
+	args.der_encoded.value = buf;
+	args.der_encoded.len = len;
+	r = sc_pkcs15init_store_data_object(p15card, profile, &args, &pool->dobj);
+	free(buf);
+	LOG_TEST_RET(ctx, r, "Cannot store key pool");
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
+/*
+ * Bind a pre-generated key of the pool to a new PrKDF entry.
+ * Returns SC_ERROR_OBJECT_NOT_FOUND if the pool holds no suitable key.
+ */
+static int
+keypool_claim(struct sc_pkcs15_card *p15card, struct sc_profile *profile, struct keypool *pool,
+		struct sc_pkcs15init_keygen_args *keygen_args, unsigned int keybits,
+		int caller_supplied_id, struct sc_pkcs15_object **res_obj)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15init_prkeyargs *keyargs = &keygen_args->prkey_args;
+	struct sc_pkcs15init_pubkeyargs pubkey_args;
+	struct sc_pkcs15_object *object = NULL;
+	struct sc_pkcs15_prkey_info *key_info;
+	unsigned int usage;
+	int ii, r;
+
+	LOG_FUNC_CALLED(ctx);
+	/* only RSA keys are pooled, as they are the slow ones to generate */
+	if (keyargs->key.algorithm != SC_ALGORITHM_RSA
+			|| (keyargs->access_flags & SC_PKCS15_PRKEY_ACCESS_EXTRACTABLE))
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OBJECT_NOT_FOUND);
+
+	for (ii = 0; ii < pool->count; ii++)   {
+		key_info = (struct sc_pkcs15_prkey_info *)pool->keys[ii]->data;
+		if (pool->keys[ii]->type == SC_PKCS15_TYPE_PRKEY_RSA
+				&& key_info->modulus_length == keybits
+				&& sc_pkcs15_compare_id(&pool->keys[ii]->auth_id, &keyargs->auth_id))
+			break;
+	}
+	if (ii == pool->count)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OBJECT_NOT_FOUND);
+
+	object = pool->keys[ii];
+	for (pool->count--; ii < pool->count; ii++)
+		pool->keys[ii] = pool->keys[ii + 1];
+	sc_pkcs15_remove_object(p15card, object);
+
+	/* Drop the key from the pool on the card first,
+	 * so that it can never be handed out twice */
+	r = keypool_store(p15card, profile, pool);
+	if (r < 0)   {
+		sc_pkcs15_free_object(object);
+		LOG_TEST_RET(ctx, r, "Cannot claim key from the key pool");
+	}
+
+	key_info = (struct sc_pkcs15_prkey_info *)object->data;
+	sc_log(ctx, "Claimed pooled key with reference %i at %s", key_info->key_reference,
+			sc_print_path(&key_info->path));
+
+	if ((usage = keyargs->usage) == 0) {
+		usage = SC_PKCS15_PRKEY_USAGE_SIGN;
+		if (keyargs->x509_usage)
+			usage = sc_pkcs15init_map_usage(keyargs->x509_usage, 1);
+	}
+	key_info->usage = usage;
+	strlcpy(object->label, keyargs->label ? keyargs->label : "Private Key", sizeof(object->label));
+	if (keyargs->guid)   {
+		object->guid = strdup(keyargs->guid);
+		if (!object->guid)
+			LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "Cannot allocate guid");
+	}
+
+	memset(&pubkey_args, 0, sizeof(pubkey_args));
+	pubkey_args.label = keygen_args->pubkey_label ? keygen_args->pubkey_label : object->label;
+	pubkey_args.usage = keyargs->usage;
+	pubkey_args.x509_usage = keyargs->x509_usage;
+	pubkey_args.key.algorithm = SC_ALGORITHM_RSA;
+	r = sc_pkcs15_decode_pubkey(ctx, &pubkey_args.key, object->content.value, object->content.len);
+	LOG_TEST_RET(ctx, r, "Cannot decode pooled public key");
+
+	if (caller_supplied_id)   {
+		key_info->id = keyargs->id;
+	}
+	else   {
+		struct sc_pkcs15_id iid;
+
+		memset(&iid, 0, sizeof(iid));
+		r = select_intrinsic_id(p15card, profile, SC_PKCS15_TYPE_PUBKEY, &iid, &pubkey_args.key);
+		LOG_TEST_RET(ctx, r, "Select intrinsic ID error");
+
+		if (iid.len)
+			key_info->id = iid;
+	}
+	pubkey_args.id = key_info->id;
+
+	r = sc_pkcs15init_add_object(p15card, profile, SC_PKCS15_PRKDF, object);
+	LOG_TEST_RET(ctx, r, "Failed to add pooled private key object");
+
+	if (profile->ops->emu_store_data)   {
+		r = profile->ops->emu_store_data(p15card, profile, object, NULL, NULL);
+		if (r == SC_ERROR_NOT_IMPLEMENTED)
+			r = SC_SUCCESS;
+		sc_pkcs15_drop_object_index(p15card);
+		LOG_TEST_RET(ctx, r, "Card specific 'store data' failed");
+	}
+
+	r = sc_pkcs15init_store_public_key(p15card, profile, &pubkey_args, NULL);
+	LOG_TEST_RET(ctx, r, "Failed to store public key");
+
+	if (res_obj)
+		*res_obj = object;
+
+	sc_pkcs15_erase_pubkey(&pubkey_args.key);
+
+	profile->dirty = 1;
+
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
+/*
+ * Pre-generate keys into the key pool
+ */
+int
+sc_pkcs15init_fill_key_pool(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct sc_pkcs15init_keygen_args *keygen_args, unsigned int keybits,
+		unsigned int count)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15init_prkeyargs keyargs;
+	struct sc_pkcs15_pubkey pubkey;
+	struct sc_pkcs15_object *object;
+	struct keypool pool;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (keygen_args->prkey_args.key.algorithm != SC_ALGORITHM_RSA)
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Only RSA keys can be pre-generated");
+	if (keygen_args->prkey_args.access_flags & SC_PKCS15_PRKEY_ACCESS_EXTRACTABLE)
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Extractable keys cannot be pre-generated");
+
+	r = check_keygen_params_consistency(p15card->card, keygen_args, keybits, &keybits);
+	LOG_TEST_RET(ctx, r, "Invalid key size");
+
+	if (check_key_compatibility(p15card, &keygen_args->prkey_args.key, keygen_args->prkey_args.x509_usage,
+			keybits, SC_ALGORITHM_ONBOARD_KEY_GEN))
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Cannot generate key with the given parameters");
+
+	if (profile->ops->generate_key == NULL)
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Key generation not supported");
+
+	r = keypool_load(p15card, &pool);
+	LOG_TEST_RET(ctx, r, "Cannot read key pool");
+
+	while (count-- && pool.count < KEYPOOL_MAX_KEYS)   {
+		keyargs = keygen_args->prkey_args;
+		keyargs.id.len = 0;
+		keyargs.label = "Pooled Key";
+
+		r = sc_pkcs15init_init_prkdf(p15card, profile, &keyargs, &keyargs.key, keybits, &object);
+		if (r < 0)
+			break;
+
+		memset(&pubkey, 0, sizeof(pubkey));
+		r = profile->ops->create_key(profile, p15card, object);
+		if (!r)
+			r = profile->ops->generate_key(profile, p15card, object, &pubkey);
+		if (!r)
+			r = sc_pkcs15_encode_pubkey(ctx, &pubkey, &object->content.value, &object->content.len);
+		sc_pkcs15_erase_pubkey(&pubkey);
+		if (r < 0)   {
+			sc_pkcs15_free_object(object);
+			break;
+		}
+
+		sc_pkcs15_add_object(p15card, object);
+		pool.keys[pool.count++] = object;
+		sc_log(ctx, "Pre-generated key %i of the key pool", pool.count);
+	}
+
+	/* Record whatever was generated, even after a failure */
+	if (r < 0)
+		keypool_store(p15card, profile, &pool);
+	else
+		r = keypool_store(p15card, profile, &pool);
+	keypool_release(p15card, &pool);
+	LOG_TEST_RET(ctx, r, "Cannot fill key pool");
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+
 /*
  * Generate a new private key
  */
@@ -1257,9 +1686,7 @@ sc_pkcs15init_generate_key(struct sc_pkcs15_card *p15card, struct sc_profile *pr
 		struct sc_pkcs15_object **res_obj)
 {
 	struct sc_context *ctx = p15card->card->ctx;
-	struct sc_pkcs15init_pubkeyargs pubkey_args;
-	struct sc_pkcs15_object *object;
-	struct sc_pkcs15_prkey_info *key_info;
+	struct keypool pool;
 	int r, caller_supplied_id = 0;
 
 	LOG_FUNC_CALLED(ctx);
@@ -1285,6 +1712,32 @@ sc_pkcs15init_generate_key(struct sc_pkcs15_card *p15card, struct sc_profile *pr
 			LOG_TEST_RET(ctx, r, "Find private key error");
 	}
 
+	r = keypool_load(p15card, &pool);
+	LOG_TEST_RET(ctx, r, "Cannot read key pool");
+
+	r = SC_ERROR_OBJECT_NOT_FOUND;
+	if (pool.count)
+		r = keypool_claim(p15card, profile, &pool, keygen_args, keybits, caller_supplied_id, res_obj);
+	if (r == SC_ERROR_OBJECT_NOT_FOUND)
+		r = generate_new_key(p15card, profile, keygen_args, keybits, caller_supplied_id, res_obj);
+
+	keypool_release(p15card, &pool);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
+static int
+generate_new_key(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		struct sc_pkcs15init_keygen_args *keygen_args, unsigned int keybits,
+		int caller_supplied_id, struct sc_pkcs15_object **res_obj)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15init_pubkeyargs pubkey_args;
+	struct sc_pkcs15_object *object;
+	struct sc_pkcs15_prkey_info *key_info;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
 	/* Set up the PrKDF object */
 	r = sc_pkcs15init_init_prkdf(p15card, profile, &keygen_args->prkey_args,
 		&keygen_args->prkey_args.key, keybits, &object);
@@ -1340,6 +1793,8 @@ sc_pkcs15init_generate_key(struct sc_pkcs15_card *p15card, struct sc_profile *pr
 		r = profile->ops->emu_store_data(p15card, profile, object, NULL, NULL);
 		if (r == SC_ERROR_NOT_IMPLEMENTED)
 			r = SC_SUCCESS;
+		/* the driver may have changed the path of the object */
+		sc_pkcs15_drop_object_index(p15card);
 		LOG_TEST_RET(ctx, r, "Card specific 'store data' failed");
 	}
 
@@ -1436,6 +1891,8 @@ sc_pkcs15init_store_private_key(struct sc_pkcs15_card *p15card,
 		r = profile->ops->emu_store_data(p15card, profile, object, NULL, NULL);
 		if (r == SC_ERROR_NOT_IMPLEMENTED)
 			r = SC_SUCCESS;
+		/* the driver may have changed the path of the object */
+		sc_pkcs15_drop_object_index(p15card);
 		LOG_TEST_RET(ctx, r, "Card specific 'store data' failed");
 	}
 
@@ -1830,6 +2287,7 @@ sc_pkcs15init_store_data(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 
 	if (profile->ops->emu_store_data)   {
 		r = profile->ops->emu_store_data(p15card, profile, object, data, path);
+		sc_pkcs15_drop_object_index(p15card);
 		if (r == SC_SUCCESS || r != SC_ERROR_NOT_IMPLEMENTED)
 			LOG_FUNC_RETURN(ctx, r);
 	}
@@ -1975,7 +2433,23 @@ check_key_compatibility(struct sc_pkcs15_card *p15card, struct sc_pkcs15_prkey *
 		unsigned int key_length, unsigned int flags)
 {
 	struct sc_algorithm_info *info;
-	unsigned int count;
+	unsigned long	exponent = 0;
+	unsigned int	count, n;
+	int		have_exponent = 0;
+
+	/* the public exponent is the same for all the card's algorithms */
+	if (key->algorithm == SC_ALGORITHM_RSA && key->u.rsa.exponent.len != 0) {
+		struct sc_pkcs15_bignum *e = &key->u.rsa.exponent;
+
+		/* too long for a card with a fixed exponent */
+		if (e->len > 4)
+			exponent = ~0UL;
+		else for (n = 0; n < e->len; n++) {
+			exponent <<= 8;
+			exponent |= e->data[n];
+		}
+		have_exponent = 1;
+	}
 
 	count = p15card->card->algorithm_count;
 	for (info = p15card->card->algorithms; count--; info++) {
@@ -1986,20 +2460,9 @@ check_key_compatibility(struct sc_pkcs15_card *p15card, struct sc_pkcs15_prkey *
 			continue;
 
 		if (key->algorithm == SC_ALGORITHM_RSA)   {
-			if (info->u._rsa.exponent != 0 && key->u.rsa.exponent.len != 0) {
-				struct sc_pkcs15_bignum *e = &key->u.rsa.exponent;
-				unsigned long	exponent = 0;
-				unsigned int	n;
-
-				if (e->len > 4)
-					continue;
-				for (n = 0; n < e->len; n++) {
-					exponent <<= 8;
-					exponent |= e->data[n];
-				}
-				if (info->u._rsa.exponent != exponent)
-					continue;
-			}
+			if (info->u._rsa.exponent != 0 && have_exponent
+					&& info->u._rsa.exponent != exponent)
+				continue;
 		}
 		else if (key->algorithm == SC_ALGORITHM_EC)   {
 		}
@@ -2261,11 +2724,22 @@ done:
 }
 
 
+/*
+ * The ID that an object stored with an empty ID would get from the key
+ * material, left empty for the 'native' ID style
+ */
+int
+sc_pkcs15init_select_intrinsic_id(struct sc_pkcs15_card *p15card, struct sc_profile *profile,
+		int type, struct sc_pkcs15_id *id, void *data)
+{
+	return select_intrinsic_id(p15card, profile, type, id, data);
+}
+
+
 static int
 select_id(struct sc_pkcs15_card *p15card, int type, struct sc_pkcs15_id *id)
 {
 	struct sc_context *ctx = p15card->card->ctx;
-	struct sc_pkcs15_id unused_id;
 	struct sc_pkcs15_object *obj;
 	unsigned int nid = DEFAULT_ID;
 	int r;
@@ -2279,38 +2753,25 @@ select_id(struct sc_pkcs15_card *p15card, int type, struct sc_pkcs15_id *id)
 		LOG_FUNC_RETURN(ctx, r);
 	}
 
-	memset(&unused_id, 0, sizeof(unused_id));
+	/* The lookups by ID go through the object index of the card, and the
+	 * first free ID is taken */
 	while (nid < 255) {
 		id->value[0] = nid++;
 		id->len = 1;
 
 		r = sc_pkcs15_find_object_by_id(p15card, type, id, &obj);
-		if (r == SC_ERROR_OBJECT_NOT_FOUND) {
-			/* We don't have an object of that type yet.
-			 * If we're allocating a PRKEY object, make
-			 * sure there's no conflicting pubkey or cert
-			 * object either. */
-			if (type == SC_PKCS15_TYPE_PRKEY) {
-				struct sc_pkcs15_search_key search_key;
-
-				memset(&search_key, 0, sizeof(search_key));
-				search_key.class_mask = SC_PKCS15_SEARCH_CLASS_PUBKEY | SC_PKCS15_SEARCH_CLASS_CERT;
-				search_key.id = id;
-
-				r = sc_pkcs15_search_objects(p15card, &search_key, NULL, 0);
-				/* If there is a pubkey or cert with
-				 * this ID, skip it. */
-				if (r > 0)
-					continue;
-			}
-			if (!unused_id.len)
-				unused_id = *id;
+		if (r != SC_ERROR_OBJECT_NOT_FOUND)
 			continue;
-		}
-	}
 
-	if (unused_id.len) {
-		*id = unused_id;
+		/* We don't have an object of that type yet.
+		 * If we're allocating a PRKEY object, make
+		 * sure there's no conflicting pubkey or cert
+		 * object either. */
+		if (type == SC_PKCS15_TYPE_PRKEY) {
+			if (sc_pkcs15_find_pubkey_by_id(p15card, id, &obj) == SC_SUCCESS
+					|| sc_pkcs15_find_cert_by_id(p15card, id, &obj) == SC_SUCCESS)
+				continue;
+		}
 		LOG_FUNC_RETURN(ctx, 0);
 	}
 
@@ -2516,8 +2977,13 @@ sc_pkcs15init_update_dir(struct sc_pkcs15_card *p15card,
 }
 
 
+/*
+ * The readers of the file cache only see a change when lastUpdate differs
+ * from what they cached, so a second update within the same second waits
+ * for the next one.
+ */
 static char *
-get_generalized_time(struct sc_context *ctx)
+get_generalized_time(struct sc_context *ctx, const char *prev)
 {
 #ifdef HAVE_GETTIMEOFDAY
 	struct timeval tv;
@@ -2526,30 +2992,39 @@ get_generalized_time(struct sc_context *ctx)
 	time_t t;
 	char*  ret;
 	size_t r;
-
-#ifdef HAVE_GETTIMEOFDAY
-	gettimeofday(&tv, NULL);
-	t = tv.tv_sec;
-#else
-	t = time(NULL);
-#endif
-	tm_time = gmtime(&t);
-	if (tm_time == NULL) {
-		sc_log(ctx, "error: gmtime failed");
-		return NULL;
-	}
+	int tries;
 
 	ret = calloc(1, 16);
 	if (ret == NULL) {
 		sc_log(ctx, "error: calloc failed");
 		return NULL;
 	}
-	/* print time in generalized time format */
-	r = strftime(ret, 16, "%Y%m%d%H%M%SZ", tm_time);
-	if (r == 0) {
-		sc_log(ctx, "error: strftime failed");
-		free(ret);
-		return NULL;
+
+	for (tries = 0; tries < 2; tries++) {
+		if (tries)
+			sleep(1);
+#ifdef HAVE_GETTIMEOFDAY
+		gettimeofday(&tv, NULL);
+		t = tv.tv_sec;
+#else
+		t = time(NULL);
+#endif
+		tm_time = gmtime(&t);
+		if (tm_time == NULL) {
+			sc_log(ctx, "error: gmtime failed");
+			free(ret);
+			return NULL;
+		}
+
+		/* print time in generalized time format */
+		r = strftime(ret, 16, "%Y%m%d%H%M%SZ", tm_time);
+		if (r == 0) {
+			sc_log(ctx, "error: strftime failed");
+			free(ret);
+			return NULL;
+		}
+		if (prev == NULL || strcmp(ret, prev) != 0)
+			break;
 	}
 
 	return ret;
@@ -2562,22 +3037,29 @@ sc_pkcs15init_update_tokeninfo(struct sc_pkcs15_card *p15card, struct sc_profile
 	struct sc_card	*card = p15card->card;
 	struct sc_pkcs15_tokeninfo tokeninfo;
 	unsigned char	*buf = NULL;
+	char		*gtime;
 	size_t		size;
 	int		r;
 
 	LOG_FUNC_CALLED(p15card->card->ctx);
+	if (profile->batch.depth) {
+		profile->batch.tokeninfo = 1;
+		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+	}
+
 	/* set lastUpdate field */
-	if (p15card->tokeninfo->last_update.gtime != NULL)
-		free(p15card->tokeninfo->last_update.gtime);
-	p15card->tokeninfo->last_update.gtime = get_generalized_time(card->ctx);
-	if (p15card->tokeninfo->last_update.gtime == NULL)
+	gtime = get_generalized_time(card->ctx, p15card->tokeninfo->last_update.gtime);
+	if (gtime == NULL)
 		return SC_ERROR_INTERNAL;
+	free(p15card->tokeninfo->last_update.gtime);
+	p15card->tokeninfo->last_update.gtime = gtime;
 
 	tokeninfo = *(p15card->tokeninfo);
 
 	if (profile->ops->emu_update_tokeninfo)
 		return profile->ops->emu_update_tokeninfo(profile, p15card, &tokeninfo);
 
+	sc_pkcs15_drop_bind_cache(p15card);
 	r = sc_pkcs15_encode_tokeninfo(card->ctx, &tokeninfo, &buf, &size);
 	if (r >= 0)
 		r = sc_pkcs15init_update_file(profile, p15card, p15card->file_tokeninfo, buf, size);
@@ -2605,13 +3087,14 @@ sc_pkcs15init_update_lastupdate(struct sc_pkcs15_card *p15card, struct sc_profil
 		struct sc_pkcs15_last_update *last_update = &p15card->tokeninfo->last_update;
 		unsigned char *buf = NULL;
 		size_t buflen;
+		char *gtime;
 
 		/* update 'lastUpdate' file */
-		if (last_update->gtime != NULL)
-			free(last_update->gtime);
-		last_update->gtime = get_generalized_time(ctx);
-		if (last_update->gtime == NULL)
+		gtime = get_generalized_time(ctx, last_update->gtime);
+		if (gtime == NULL)
 			return SC_ERROR_INTERNAL;
+		free(last_update->gtime);
+		last_update->gtime = gtime;
 
 		sc_copy_asn1_entry(c_asn1_last_update, asn1_last_update);
 		lupdate_len = strlen(last_update->gtime);
@@ -2645,6 +3128,12 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 	int		r;
 
 	LOG_FUNC_CALLED(ctx);
+	if (profile->batch.depth) {
+		profile->batch.odf = 1;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	sc_pkcs15_drop_bind_cache(p15card);
 	r = sc_pkcs15_encode_odf(ctx, p15card, &buf, &size);
 	if (r >= 0)
 		r = sc_pkcs15init_update_file(profile, p15card, p15card->file_odf, buf, size);
@@ -2653,6 +3142,69 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+/*
+ * Write a new encoding of a directory file. Only the range that differs
+ * from what is on the card is written, which is usually the entry that
+ * was appended or changed. Falls back to rewriting the whole file when
+ * the old content cannot be read.
+ */
+static int
+sc_pkcs15init_update_df_file(struct sc_profile *profile, struct sc_pkcs15_card *p15card,
+		struct sc_file *file, const unsigned char *buf, size_t bufsize)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_file	*selected_file = NULL;
+	unsigned char	*old = NULL;
+	size_t		oldlen = 0, start, end;
+	int		r;
+
+	LOG_FUNC_CALLED(ctx);
+	r = sc_select_file(p15card->card, &file->path, &selected_file);
+	if (r == SC_SUCCESS && selected_file->size >= bufsize && selected_file->size > 0)   {
+		oldlen = selected_file->size;
+		old = malloc(oldlen);
+		if (old == NULL)
+			r = SC_ERROR_OUT_OF_MEMORY;
+		else
+			r = sc_read_binary(p15card->card, 0, old, oldlen, 0);
+		if (r >= 0 && (size_t)r != oldlen)
+			r = SC_ERROR_WRONG_LENGTH;
+	}
+	else if (r == SC_SUCCESS)   {
+		r = SC_ERROR_FILE_TOO_SMALL;
+	}
+	sc_file_free(selected_file);
+	if (r < 0)   {
+		sc_log(ctx, "cannot read old content (%s), rewriting %s", sc_strerror(r), sc_print_path(&file->path));
+		free(old);
+		r = sc_pkcs15init_update_file(profile, p15card, file, (void *) buf, bufsize);
+		LOG_FUNC_RETURN(ctx, r);
+	}
+
+	/* the rest of the file is cleared, as sc_pkcs15init_update_file() does */
+	for (start = 0; start < oldlen; start++)
+		if (old[start] != (start < bufsize ? buf[start] : 0))
+			break;
+	for (end = oldlen; end > start; end--)
+		if (old[end - 1] != (end - 1 < bufsize ? buf[end - 1] : 0))
+			break;
+	sc_log(ctx, "%s: %lu of %lu bytes changed at offset %lu", sc_print_path(&file->path),
+			(unsigned long) (end - start), (unsigned long) oldlen, (unsigned long) start);
+
+	r = SC_SUCCESS;
+	if (end > start)   {
+		/* reuse the old buffer for the new content */
+		memset(old, 0, oldlen);
+		memcpy(old, buf, bufsize);
+		r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
+		if (r >= 0)
+			r = sc_update_binary(p15card->card, start, old + start, end - start, 0);
+	}
+	free(old);
+	LOG_FUNC_RETURN(ctx, r < 0 ? r : SC_SUCCESS);
+}
+
+
 /*
  * Update any PKCS15 DF file (except ODF and DIR)
  */
@@ -2668,15 +3220,38 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 	unsigned char	*buf = NULL;
 	size_t		bufsize;
 	int		update_odf = is_new, r = 0;
+	size_t		ii;
 
 	LOG_FUNC_CALLED(ctx);
+	if (profile->batch.depth && !profile->batch.flushing) {
+		for (ii = 0; ii < profile->batch.df_count; ii++)
+			if (profile->batch.df[ii] == df)
+				break;
+		if (ii == profile->batch.df_count && ii < SC_PROFILE_BATCH_MAX_DF)
+			profile->batch.df[profile->batch.df_count++] = df;
+		if (ii < profile->batch.df_count) {
+			if (is_new)
+				profile->batch.odf = 1;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+		/* no room left, written now */
+	}
+
 	sc_profile_get_file_by_path(profile, &df->path, &file);
 	if (file == NULL)
 		sc_select_file(card, &df->path, &file);
 
+	if (file == NULL)
+		LOG_TEST_RET(ctx, SC_ERROR_FILE_NOT_FOUND, "No profile template for the xDF");
+
 	r = sc_pkcs15_encode_df(card->ctx, p15card, df, &buf, &bufsize);
 	if (r >= 0) {
-		r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+		/* Should the file have to be created, it is created once at the
+		 * size of all its objects, those of a batch included, plus the
+		 * profile's headroom, instead of at the template size */
+		if (file->size < bufsize + profile->pkcs15.df_headroom)
+			file->size = bufsize + profile->pkcs15.df_headroom;
+		r = sc_pkcs15init_update_df_file(profile, p15card, file, buf, bufsize);
 
 		/* For better performance and robustness, we want
 		 * to note which portion of the file actually
@@ -2707,6 +3282,62 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 	LOG_FUNC_RETURN(ctx, r > 0 ? SC_SUCCESS : r);
 }
 
+int
+sc_pkcs15init_begin_batch(struct sc_profile *profile)
+{
+	if (profile == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	profile->batch.depth++;
+	return SC_SUCCESS;
+}
+
+
+/*
+ * Write what the batch held back: the directory files first, then the ODF
+ * with their new lengths, then TokenInfo.
+ */
+int
+sc_pkcs15init_commit_batch(struct sc_pkcs15_card *p15card, struct sc_profile *profile)
+{
+	struct sc_context *ctx;
+	size_t ii;
+	int r = SC_SUCCESS;
+
+	if (profile == NULL || profile->batch.depth == 0)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (p15card == NULL) {
+		memset(&profile->batch, 0, sizeof(profile->batch));
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+	ctx = p15card->card->ctx;
+	LOG_FUNC_CALLED(ctx);
+
+	if (--profile->batch.depth > 0)
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+	sc_log(ctx, "commit: %lu DF(s)%s%s", (unsigned long) profile->batch.df_count,
+			profile->batch.odf ? ", ODF" : "", profile->batch.tokeninfo ? ", TokenInfo" : "");
+
+	/* still held back: the ODF, which the DFs update with their lengths */
+	profile->batch.depth = 1;
+	profile->batch.flushing = 1;
+	for (ii = 0; ii < profile->batch.df_count && r >= 0; ii++)
+		r = sc_pkcs15init_update_any_df(p15card, profile, profile->batch.df[ii], 0);
+	profile->batch.flushing = 0;
+	profile->batch.depth = 0;
+
+	if (r >= 0 && profile->batch.odf)
+		r = sc_pkcs15init_update_odf(p15card, profile);
+	if (r >= 0 && profile->batch.tokeninfo)
+		r = sc_pkcs15init_update_tokeninfo(p15card, profile);
+
+	profile->batch.df_count = 0;
+	profile->batch.odf = 0;
+	profile->batch.tokeninfo = 0;
+	LOG_FUNC_RETURN(ctx, r < 0 ? r : SC_SUCCESS);
+}
+
+
 /*
  * Add an object to one of the pkcs15 directory files.
  */
@@ -2861,10 +3492,12 @@ sc_pkcs15init_change_attrib(struct sc_pkcs15_card *p15card, struct sc_profile *p
 		default:
 			LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Cannot change ID attribute");
 		}
+		sc_pkcs15_drop_object_index(p15card);
 		break;
 	default:
 		LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Only 'LABEL' or 'ID' attributes can be changed");
 	}
+	sc_pkcs15_drop_cached_objects(p15card, object->df);
 
 	if (profile->ops->emu_update_any_df)   {
 		r = profile->ops->emu_update_any_df(profile, p15card, SC_AC_OP_CREATE, object);
@@ -2878,7 +3511,7 @@ sc_pkcs15init_change_attrib(struct sc_pkcs15_card *p15card, struct sc_profile *p
 			r = sc_profile_get_file_by_path(profile, &df->path, &file);
 			LOG_TEST_RET(ctx, r, "Cannot instantiate file by path");
 
-			r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+			r = sc_pkcs15init_update_df_file(profile, p15card, file, buf, bufsize);
 			free(buf);
 			sc_file_free(file);
 		}
@@ -3463,6 +4096,7 @@ sc_pkcs15init_create_file(struct sc_profile *profile, struct sc_pkcs15_card *p15
 
 	r = sc_create_file(p15card->card, file);
 	LOG_TEST_RET(ctx, r, "Create file failed");
+	sc_pkcs15_forget_absent_file(p15card, &file->path);
 
 	if (parent)
 		sc_file_free(parent);
@@ -3525,6 +4159,11 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 	r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
 	if (r >= 0 && datalen)
 		r = sc_update_binary(p15card->card, 0, (const unsigned char *) data, datalen, 0);
+	if (r >= 0) {
+		/* lastUpdate is bumped at unbind for the other readers */
+		profile->dirty = 1;
+		sc_pkcs15_drop_cached_file(p15card, &file->path);
+	}
 
 	if (copy)
 		free(copy);
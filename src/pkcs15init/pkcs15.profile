@@ -22,6 +22,9 @@ pkcs15 {
     encode-df-length	= no;
     # Have a lastUpdate field in the EF(TokenInfo)?
     do-last-update	= yes;
+    # Bytes of room left for later objects when a PrKDF, CDF etc.
+    # is created; the file is sized for its objects plus this much
+    df-size-headroom	= 0;
     # Method to calculate ID of the crypto objects
     #     mozilla: SHA1(modulus) for RSA, SHA1(pub) for DSA
     #     rfc2459: SHA1(SequenceASN1 of public key components as ASN1 integers)
@@ -55,6 +55,9 @@
 
 #define TEMPLATE_FILEID_MIN_DIFF	0x20
 
+/* Parsed profiles, in the cache directory, see use_config_cache */
+#define SC_PROFILE_IMAGE_SUFFIX		".profile.image"
+
 /*
 #define DEBUG_PROFILE
 */
@@ -251,6 +254,8 @@ static struct file_info *	add_file(sc_profile_t *, const char *,
 				sc_file_t *, struct file_info *);
 static void		free_file_list(struct file_info **);
 static void		append_file(sc_profile_t *, struct file_info *);
+static unsigned int	name_hash(const char *);
+static unsigned int	path_hash(const sc_path_t *);
 static struct auth_info *	new_key(struct sc_profile *,
 				unsigned int, unsigned int);
 static void		set_pin_defaults(struct sc_profile *,
@@ -321,8 +326,8 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 	struct sc_context *ctx = profile->card->ctx;
 	scconf_context	*conf;
 	const char *profile_dir = NULL;
-	char path[PATH_MAX];
-	int             res = 0, i;
+	char path[PATH_MAX], image_path[PATH_MAX];
+	int             res = 0, i, use_image = 0;
 #ifdef _WIN32
 	char temp_path[PATH_MAX];
 	DWORD temp_len;
@@ -370,8 +375,34 @@ sc_profile_load(struct sc_profile *profile, const char *filename)
 
 	sc_log(ctx, "Trying profile file %s", path);
 
+	for (i = 0; ctx->conf_blocks[i]; i++)
+		if (scconf_get_bool(ctx->conf_blocks[i], "use_config_cache", 0))
+			use_image = 1;
+
+	/* With use_config_cache, the parsed profile is kept as an image
+	 * in the cache directory, which is dropped when the profile changes */
+	image_path[0] = '\0';
+	if (use_image && sc_get_cache_dir(ctx, image_path, sizeof(image_path)) == SC_SUCCESS
+			&& strlen(image_path) + strlen(filename) + sizeof(SC_PROFILE_IMAGE_SUFFIX) + 1 < sizeof(image_path)) {
+		strcat(image_path, "/");
+		strcat(image_path, filename);
+		strcat(image_path, SC_PROFILE_IMAGE_SUFFIX);
+	}
+	else {
+		image_path[0] = '\0';
+	}
+
 	conf = scconf_new(path);
-	res = scconf_parse(conf);
+	res = image_path[0] ? scconf_parse_image(conf, image_path) : -1;
+	if (res == 1) {
+		sc_log(ctx, "profile %s loaded from %s", path, image_path);
+	}
+	else {
+		res = scconf_parse(conf);
+		if (res > 0 && image_path[0] && sc_make_cache_dir(ctx) == SC_SUCCESS
+				&& scconf_write_image(conf, image_path) != 0)
+			sc_log(ctx, "cannot write profile image %s", image_path);
+	}
 
 	sc_log(ctx, "profile %s loaded ok", path);
 
@@ -682,16 +713,18 @@ sc_profile_instantiate_template(sc_profile_t *profile,
 
 	tmpl = info->data;
 	idx = id->value[id->len-1];
-	for (fi = profile->ef_list; fi; fi = fi->next) {
+	for (fi = profile->name_index[name_hash(file_name)]; fi; fi = fi->name_next) {
 		if (fi->base_template == tmpl
 		 && fi->inst_index == idx
 		 && sc_compare_path(&fi->inst_path, base_path)
-		 && !strcmp(fi->ident, file_name)) {
-			sc_file_dup(ret, fi->file);
-			if (*ret == NULL)
-				return SC_ERROR_OUT_OF_MEMORY;
-			return 0;
-		}
+		 && !strcmp(fi->ident, file_name))
+			match = fi;
+	}
+	if (match) {
+		sc_file_dup(ret, match->file);
+		if (*ret == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		return 0;
 	}
 
 	sc_log(ctx, "Instantiating template %s at %s", template_name, sc_print_path(base_path));
@@ -899,6 +932,12 @@ do_encode_update_field(struct state *cur, int argc, char **argv)
 	return get_bool(cur, argv[0], &cur->profile->pkcs15.do_last_update);
 }
 
+static int
+do_df_headroom(struct state *cur, int argc, char **argv)
+{
+	return get_uint(cur, argv[0], &cur->profile->pkcs15.df_headroom);
+}
+
 static int
 do_pkcs15_id_style(struct state *cur, int argc, char **argv)
 {
@@ -1138,12 +1177,59 @@ process_tmpl(struct state *cur, struct block *info,
  */
 static void append_file(sc_profile_t *profile, struct file_info *nfile)
 {
-	struct file_info	**list, *fi;
+	unsigned int		h;
+
+	if (profile->ef_tail)
+		profile->ef_tail->next = nfile;
+	else
+		profile->ef_list = nfile;
+	profile->ef_tail = nfile;
+
+	/* The chains hold the newest file first */
+	h = name_hash(nfile->ident);
+	nfile->name_next = profile->name_index[h];
+	profile->name_index[h] = nfile;
+	if (profile->path_index_valid) {
+		h = path_hash(&nfile->file->path);
+		nfile->path_next = profile->path_index[h];
+		profile->path_index[h] = nfile;
+	}
+}
+
+static unsigned int
+name_hash(const char *name)
+{
+	unsigned int	h = 2166136261U;
 
-	list = &profile->ef_list;
-	while ((fi = *list) != NULL)
-		list = &fi->next;
-	*list = nfile;
+	for (; name && *name; name++)
+		h = (h ^ (unsigned char) tolower((unsigned char) *name)) * 16777619U;
+	return h % SC_PROFILE_INDEX_SIZE;
+}
+
+static unsigned int
+path_hash(const sc_path_t *path)
+{
+	unsigned int	h = 2166136261U;
+	size_t		n;
+
+	for (n = 0; n < path->len; n++)
+		h = (h ^ path->value[n]) * 16777619U;
+	return h % SC_PROFILE_INDEX_SIZE;
+}
+
+static void
+build_path_index(sc_profile_t *profile)
+{
+	struct file_info	*fi;
+	unsigned int		h;
+
+	memset(profile->path_index, 0, sizeof(profile->path_index));
+	for (fi = profile->ef_list; fi; fi = fi->next) {
+		h = path_hash(&fi->file->path);
+		fi->path_next = profile->path_index[h];
+		profile->path_index[h] = fi;
+	}
+	profile->path_index_valid = 1;
 }
 
 /*
@@ -1270,6 +1356,7 @@ do_file_path(struct state *cur, int argc, char **argv)
 		return 1;
 	}
 	file->id = (path->value[path->len-2] << 8) | path->value[path->len-1];
+	cur->profile->path_index_valid = 0;
 	return 0;
 }
 
@@ -1304,6 +1391,7 @@ do_fileid(struct state *cur, int argc, char **argv)
 	path->len += 2;
 
 	file->id = (temp.value[0] << 8) | temp.value[1];
+	cur->profile->path_index_valid = 0;
 	return 0;
 }
 
@@ -1792,6 +1880,7 @@ static struct command	p15_commands[] = {
  { "direct-certificates",	1,	1,	do_direct_certificates },
  { "encode-df-length",		1,	1,	do_encode_df_length },
  { "do-last-update",		1,	1,	do_encode_update_field },
+ { "df-size-headroom",		1,	1,	do_df_headroom },
  { "pkcs15-id-style",		1,	1,	do_pkcs15_id_style },
  { "minidriver-support-style",	1,	1,	do_minidriver_support_style },
  { NULL, 0, 0, NULL }
@@ -1964,6 +2053,8 @@ process_conf(struct sc_profile *profile, scconf_context *conf)
 	memset(&state, 0, sizeof(state));
 	state.filename = conf->filename;
 	state.profile = profile;
+	/* the parser sets the paths of existing files */
+	profile->path_index_valid = 0;
 	return process_block(&state, &root_ops, "root", conf->root);
 }
 
@@ -1971,17 +2062,18 @@ static struct file_info *
 sc_profile_find_file(struct sc_profile *pro,
 		const sc_path_t *path, const char *name)
 {
-	struct file_info	*fi;
+	struct file_info	*fi, *out = NULL;
 	unsigned int		len;
 
+	/* The chain holds the newest file first, the oldest match wins */
 	len = path? path->len : 0;
-	for (fi = pro->ef_list; fi; fi = fi->next) {
+	for (fi = pro->name_index[name_hash(name)]; fi; fi = fi->name_next) {
 		sc_path_t *fpath = &fi->file->path;
 
 		if (!strcasecmp(fi->ident, name) && fpath->len >= len && !memcmp(fpath->value, path->value, len))
-			return fi;
+			out = fi;
 	}
-	return NULL;
+	return out;
 }
 
 
@@ -2007,7 +2099,11 @@ sc_profile_find_file_by_path(struct sc_profile *pro, const sc_path_t *path)
 	if (!path->len && !path->aid.len)
 		return NULL;
 
-	for (fi = pro->ef_list; fi; fi = fi->next) {
+	if (!pro->path_index_valid)
+		build_path_index(pro);
+
+	/* The chain holds the newest file first, which is the one wanted */
+	for (fi = pro->path_index[path_hash(path)]; fi; fi = fi->path_next) {
 		fp_path = &fi->file->path;
 		fpp_path = fi->parent ? &fi->parent->file->path : NULL;
 
@@ -2036,6 +2132,7 @@ sc_profile_find_file_by_path(struct sc_profile *pro, const sc_path_t *path)
 		}
 
 		out = fi;
+		break;
 	}
 
 #ifdef DEBUG_PROFILE
@@ -17,6 +17,12 @@ extern "C" {
 #define SC_PKCS15_PROFILE_SUFFIX	"profile"
 #endif
 
+/* Buckets of the file name and path indexes of a profile */
+#define SC_PROFILE_INDEX_SIZE		64
+
+/* Directory files queued by a batch, see sc_pkcs15init_begin_batch() */
+#define SC_PROFILE_BATCH_MAX_DF		16
+
 /* Obsolete */
 struct auth_info {
 	struct auth_info *	next;
@@ -43,6 +49,10 @@ struct file_info {
 	 * Sub-profile is loaded when binding to the particular application
 	 * of the multi-application PKCS#15 card. */
 	char *			profile_extension;
+
+	/* Hash chains of the profile's file indexes */
+	struct file_info *	name_next;
+	struct file_info *	path_next;
 };
 
 /* For now, we assume the PUK always resides
@@ -91,6 +101,7 @@ struct sc_profile {
 	struct file_info *	mf_info;
 	struct file_info *	df_info;
 	struct file_info *	ef_list;
+	struct file_info *	ef_tail;	/* last of ef_list, for append_file() */
 	struct sc_file *	df[SC_PKCS15_DF_TYPE_COUNT];
 
 	struct pin_info *	pin_list;
@@ -112,6 +123,8 @@ struct sc_profile {
 		unsigned int	direct_certificates;
 		unsigned int	encode_df_length;
 		unsigned int	do_last_update;
+		/* bytes added to the encoded length when an xDF is created */
+		unsigned int	df_headroom;
 	} pkcs15;
 
 	/* PKCS15 information */
@@ -127,6 +140,24 @@ struct sc_profile {
 
 	/* Minidriver support style */
 	unsigned int md_style;
+
+	/* ef_list indexed by file name, and by path. The path index is
+	 * rebuilt on demand when the parser has set paths; files added later
+	 * (template instances) come with their path and go straight in */
+	struct file_info *	name_index[SC_PROFILE_INDEX_SIZE];
+	struct file_info *	path_index[SC_PROFILE_INDEX_SIZE];
+	int			path_index_valid;
+
+	/* Changes of the directory files, ODF and TokenInfo held back
+	 * until sc_pkcs15init_commit_batch() */
+	struct {
+		int		depth;
+		int		flushing;
+		struct sc_pkcs15_df *df[SC_PROFILE_BATCH_MAX_DF];
+		size_t		df_count;
+		int		odf;
+		int		tokeninfo;
+	} batch;
 };
 
 struct sc_profile *sc_profile_new(void);
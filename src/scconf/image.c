@@ -0,0 +1,375 @@
+/*
+ * image.c: Binary image of a parsed configuration
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef _WIN32
+#include <process.h>
+#endif
+
+#include "scconf.h"
+
+/*
+ * The image starts with a header that identifies the configuration file it
+ * was made from, by name, size and modification time. The tree follows in
+ * document order: every item is a tag byte, blocks end with IMAGE_END.
+ * Strings are a 32 bit length, the bytes and a NUL; lists are a 32 bit count
+ * followed by the strings. Numbers are in host order: the image is a cache
+ * of the local machine.
+ */
+#define IMAGE_MAGIC	"SCCONFI1"
+#define IMAGE_BOM	0x01020304
+#define IMAGE_NULL	0xFFFFFFFF
+
+enum {
+	IMAGE_END = 0,
+	IMAGE_COMMENT,
+	IMAGE_BLOCK,
+	IMAGE_VALUE
+};
+
+struct image_header {
+	char magic[8];
+	unsigned int bom;
+	unsigned int path_len;
+	unsigned long long src_size;
+	long long src_mtime;
+};
+
+static int image_header_init(struct image_header *hdr, const char *filename)
+{
+	struct stat st;
+
+	if (!filename || stat(filename, &st) != 0) {
+		return -1;
+	}
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic));
+	hdr->bom = IMAGE_BOM;
+	hdr->path_len = strlen(filename);
+	hdr->src_size = st.st_size;
+	hdr->src_mtime = st.st_mtime;
+	return 0;
+}
+
+/* Writing */
+
+static void write_u32(FILE * f, unsigned int x)
+{
+	fwrite(&x, sizeof(x), 1, f);
+}
+
+static void write_str(FILE * f, const char *str)
+{
+	size_t len;
+
+	if (!str) {
+		write_u32(f, IMAGE_NULL);
+		return;
+	}
+	len = strlen(str);
+	write_u32(f, len);
+	fwrite(str, 1, len + 1, f);
+}
+
+static void write_list(FILE * f, const scconf_list * list)
+{
+	const scconf_list *l;
+	unsigned int count = 0;
+
+	for (l = list; l; l = l->next) {
+		count++;
+	}
+	write_u32(f, count);
+	for (l = list; l; l = l->next) {
+		write_str(f, l->data);
+	}
+}
+
+static void write_items(FILE * f, const scconf_item * item)
+{
+	for (; item; item = item->next) {
+		switch (item->type) {
+		case SCCONF_ITEM_TYPE_COMMENT:
+			fputc(IMAGE_COMMENT, f);
+			write_str(f, item->value.comment);
+			break;
+		case SCCONF_ITEM_TYPE_BLOCK:
+			fputc(IMAGE_BLOCK, f);
+			write_str(f, item->key);
+			write_list(f, item->value.block ? item->value.block->name : NULL);
+			if (item->value.block) {
+				write_items(f, item->value.block->items);
+			}
+			fputc(IMAGE_END, f);
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			fputc(IMAGE_VALUE, f);
+			write_str(f, item->key);
+			write_list(f, item->value.list);
+			break;
+		}
+	}
+}
+
+int scconf_write_image(const scconf_context * config, const char *filename)
+{
+	struct image_header hdr;
+	char *tmpname;
+	size_t len;
+	FILE *f;
+	int r;
+
+	if (!config || !filename || image_header_init(&hdr, config->filename) != 0) {
+		return -1;
+	}
+
+	/* Readers may map the old image: the new one is renamed over it */
+	len = strlen(filename) + 32;
+	tmpname = malloc(len);
+	if (!tmpname) {
+		return -1;
+	}
+	snprintf(tmpname, len, "%s.%lu", filename, (unsigned long)getpid());
+	f = fopen(tmpname, "wb");
+	if (!f) {
+		free(tmpname);
+		return -1;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fwrite(config->filename, 1, hdr.path_len + 1, f);
+	write_items(f, config->root->items);
+	fputc(IMAGE_END, f);
+	r = ferror(f);
+	if (fclose(f) != 0) {
+		r = -1;
+	}
+#ifdef _WIN32
+	if (r == 0) {
+		remove(filename);
+	}
+#endif
+	if (r == 0 && rename(tmpname, filename) != 0) {
+		r = -1;
+	}
+	if (r != 0) {
+		remove(tmpname);
+		r = -1;
+	}
+	free(tmpname);
+	return r;
+}
+
+/* Reading */
+
+typedef struct {
+	const unsigned char *p, *end;
+	int error;
+} image_reader;
+
+static unsigned int read_u32(image_reader * r)
+{
+	unsigned int x;
+
+	if ((size_t)(r->end - r->p) < sizeof(x)) {
+		r->error = 1;
+		return 0;
+	}
+	memcpy(&x, r->p, sizeof(x));
+	r->p += sizeof(x);
+	return x;
+}
+
+static int read_tag(image_reader * r)
+{
+	if (r->p >= r->end) {
+		r->error = 1;
+		return IMAGE_END;
+	}
+	return *r->p++;
+}
+
+static char *read_str(image_reader * r)
+{
+	unsigned int len = read_u32(r);
+	char *str;
+
+	if (r->error || len == IMAGE_NULL) {
+		return NULL;
+	}
+	if ((size_t)(r->end - r->p) <= len || r->p[len] != '\0') {
+		r->error = 1;
+		return NULL;
+	}
+	str = malloc(len + 1);
+	if (!str) {
+		r->error = 1;
+		return NULL;
+	}
+	memcpy(str, r->p, len + 1);
+	r->p += len + 1;
+	return str;
+}
+
+static scconf_list *read_list(image_reader * r)
+{
+	scconf_list *list = NULL, **tail = &list;
+	unsigned int count = read_u32(r);
+
+	while (!r->error && count--) {
+		*tail = calloc(1, sizeof(scconf_list));
+		if (!*tail) {
+			r->error = 1;
+			break;
+		}
+		(*tail)->data = read_str(r);
+		tail = &(*tail)->next;
+	}
+	return list;
+}
+
+static void read_items(image_reader * r, scconf_block * block)
+{
+	scconf_item **tail = &block->items;
+	scconf_item *item;
+	int tag;
+
+	while (!r->error && (tag = read_tag(r)) != IMAGE_END) {
+		item = calloc(1, sizeof(scconf_item));
+		if (!item) {
+			r->error = 1;
+			return;
+		}
+		*tail = item;
+		tail = &item->next;
+
+		switch (tag) {
+		case IMAGE_COMMENT:
+			item->type = SCCONF_ITEM_TYPE_COMMENT;
+			item->value.comment = read_str(r);
+			break;
+		case IMAGE_BLOCK:
+			item->type = SCCONF_ITEM_TYPE_BLOCK;
+			item->key = read_str(r);
+			item->value.block = calloc(1, sizeof(scconf_block));
+			if (!item->value.block) {
+				r->error = 1;
+				return;
+			}
+			item->value.block->parent = block;
+			item->value.block->name = read_list(r);
+			read_items(r, item->value.block);
+			break;
+		case IMAGE_VALUE:
+			item->type = SCCONF_ITEM_TYPE_VALUE;
+			item->key = read_str(r);
+			item->value.list = read_list(r);
+			break;
+		default:
+			r->error = 1;
+			return;
+		}
+	}
+}
+
+int scconf_parse_image(scconf_context * config, const char *filename)
+{
+	struct image_header hdr, expected;
+	image_reader r;
+	unsigned char *image = NULL;
+	size_t image_len;
+	long size;
+	FILE *f;
+	int mapped = 0, ret = 0;
+
+	if (!config || !filename || config->root->items) {
+		return -1;
+	}
+	f = fopen(filename, "rb");
+	if (!f) {
+		return -1;
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < (long)sizeof(hdr)) {
+		fclose(f);
+		return 0;
+	}
+	image_len = size;
+#ifdef HAVE_SYS_MMAN_H
+	image = mmap(NULL, image_len, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (image == MAP_FAILED) {
+		image = NULL;
+	} else {
+		mapped = 1;
+	}
+#endif
+	if (!image) {
+		image = malloc(image_len);
+		if (image) {
+			rewind(f);
+			if (fread(image, 1, image_len, f) != image_len) {
+				free(image);
+				image = NULL;
+			}
+		}
+	}
+	fclose(f);
+	if (!image) {
+		return 0;
+	}
+
+	/* Stale when the configuration file changed since the image was made */
+	memcpy(&hdr, image, sizeof(hdr));
+	if (image_header_init(&expected, config->filename) != 0 ||
+	    memcmp(&hdr, &expected, sizeof(hdr)) != 0 ||
+	    image_len - sizeof(hdr) <= hdr.path_len ||
+	    memcmp(image + sizeof(hdr), config->filename, hdr.path_len + 1) != 0) {
+		goto out;
+	}
+
+	r.p = image + sizeof(hdr) + hdr.path_len + 1;
+	r.end = image + image_len;
+	r.error = 0;
+	read_items(&r, config->root);
+	if (r.error) {
+		scconf_item_destroy(config->root->items);
+		config->root->items = NULL;
+		goto out;
+	}
+	scconf_block_index(config->root, 1);
+	ret = 1;
+
+out:
+#ifdef HAVE_SYS_MMAN_H
+	if (mapped) {
+		munmap(image, image_len);
+	} else
+#endif
+	free(image);
+	return ret;
+}
@@ -163,6 +163,7 @@ scconf_item *scconf_item_add(scconf_context * config, scconf_block * block, scco
 		scconf_list_copy((const scconf_list *) data, &parser.current_item->value.list);
 		break;
 	}
+	scconf_block_index(parser.block, 0);
 	return parser.current_item;
 }
 
@@ -207,6 +208,7 @@ scconf_block *scconf_block_add(scconf_context * config, scconf_block * block, co
 	parser.current_item = parser.block->items;
 
 	scconf_block_add_internal(&parser);
+	scconf_block_index(parser.block->parent, 0);
 	return parser.block;
 }
 
@@ -395,6 +397,7 @@ int scconf_parse(scconf_context * config)
 
 	if (r <= 0)
 		config->errmsg = buffer;
+	scconf_block_index(config->root, 1);
 	return r;
 }
 
@@ -422,5 +425,6 @@ int scconf_parse_string(scconf_context * config, const char *string)
 
 	if (r <= 0)
 		config->errmsg = buffer;
+	scconf_block_index(config->root, 1);
 	return r;
 }
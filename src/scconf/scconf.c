@@ -64,29 +64,212 @@ void scconf_free(scconf_context * config)
 	}
 }
 
-const scconf_block *scconf_find_block(const scconf_context * config, const scconf_block * block, const char *item_name)
+/* Blocks with fewer items are searched linearly */
+#define SCCONF_INDEX_MIN_ITEMS	8
+
+typedef struct _scconf_index_entry {
+	unsigned int hash;
+	const char *key;
+	/* the items with this key, in order, are items[first .. first+count-1] */
+	unsigned int first, count;
+} scconf_index_entry;
+
+struct _scconf_index {
+	unsigned int mask;
+	unsigned int *buckets;	/* entry number + 1, 0 when empty */
+	scconf_index_entry *entries;
+	scconf_item **items;
+};
+
+static unsigned int scconf_key_hash(const char *key)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*key) {
+		hash ^= (unsigned char) tolower((unsigned char) *key++);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static scconf_index_entry *scconf_index_lookup(const struct _scconf_index *index, const char *key, unsigned int hash)
 {
+	unsigned int i, e;
+
+	for (i = hash & index->mask; (e = index->buckets[i]) != 0; i = (i + 1) & index->mask) {
+		if (index->entries[e - 1].hash == hash &&
+		    strcasecmp(index->entries[e - 1].key, key) == 0) {
+			return &index->entries[e - 1];
+		}
+	}
+	return NULL;
+}
+
+static void scconf_index_free(struct _scconf_index *index)
+{
+	if (index) {
+		free(index->buckets);
+		free(index->entries);
+		free(index->items);
+		free(index);
+	}
+}
+
+static struct _scconf_index *scconf_index_build(const scconf_block * block)
+{
+	struct _scconf_index *index;
+	scconf_index_entry *entry;
 	scconf_item *item;
+	unsigned int count = 0, size = 1, nentries = 0, i, hash;
 
-	if (!block) {
-		block = config->root;
+	for (item = block->items; item; item = item->next) {
+		if (item->key) {
+			count++;
+		}
 	}
-	if (!item_name) {
+	if (count < SCCONF_INDEX_MIN_ITEMS) {
+		return NULL;
+	}
+	while (size < count * 2) {
+		size <<= 1;
+	}
+
+	index = calloc(1, sizeof(struct _scconf_index));
+	if (!index) {
 		return NULL;
 	}
+	index->mask = size - 1;
+	index->buckets = calloc(size, sizeof(unsigned int));
+	index->entries = calloc(count, sizeof(scconf_index_entry));
+	index->items = malloc(count * sizeof(scconf_item *));
+	if (!index->buckets || !index->entries || !index->items) {
+		scconf_index_free(index);
+		return NULL;
+	}
+
+	/* count the items of every key */
 	for (item = block->items; item; item = item->next) {
-		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
-		    strcasecmp(item_name, item->key) == 0) {
-			return item->value.block;
+		if (!item->key) {
+			continue;
+		}
+		hash = scconf_key_hash(item->key);
+		entry = scconf_index_lookup(index, item->key, hash);
+		if (!entry) {
+			for (i = hash & index->mask; index->buckets[i] != 0; i = (i + 1) & index->mask);
+			entry = &index->entries[nentries++];
+			entry->hash = hash;
+			entry->key = item->key;
+			index->buckets[i] = nentries;
+		}
+		entry->count++;
+	}
+	/* then place them in order */
+	for (i = 0, count = 0; i < nentries; i++) {
+		index->entries[i].first = count;
+		count += index->entries[i].count;
+		index->entries[i].count = 0;
+	}
+	for (item = block->items; item; item = item->next) {
+		if (item->key) {
+			entry = scconf_index_lookup(index, item->key, scconf_key_hash(item->key));
+			index->items[entry->first + entry->count++] = item;
+		}
+	}
+	return index;
+}
+
+void scconf_block_index(scconf_block * block, int recursive)
+{
+	scconf_item *item;
+
+	if (!block) {
+		return;
+	}
+	scconf_index_free(block->index);
+	block->index = scconf_index_build(block);
+	if (recursive) {
+		for (item = block->items; item; item = item->next) {
+			if (item->type == SCCONF_ITEM_TYPE_BLOCK) {
+				scconf_block_index(item->value.block, 1);
+			}
+		}
+	}
+}
+
+/* Walks the items of a given type and key in a block, through the index
+ * when the block has one */
+typedef struct {
+	const scconf_block *block;
+	int type;
+	const char *key;
+	int started;
+	scconf_item *item;			/* without index */
+	const scconf_index_entry *entry;	/* with index */
+	unsigned int pos;
+} scconf_item_iter;
+
+static void scconf_item_iter_init(scconf_item_iter * it, const scconf_block * block, int type, const char *key)
+{
+	memset(it, 0, sizeof(*it));
+	it->block = block;
+	it->type = type;
+	it->key = key;
+}
+
+static scconf_item *scconf_item_iter_next(scconf_item_iter * it)
+{
+	const struct _scconf_index *index = it->block->index;
+	scconf_item *item;
+
+	if (!index) {
+		item = it->started ? it->item->next : it->block->items;
+		it->started = 1;
+		for (; item; item = item->next) {
+			if (item->type == it->type && strcasecmp(it->key, item->key) == 0) {
+				break;
+			}
+		}
+		it->item = item;
+		return item;
+	}
+
+	if (!it->started) {
+		it->entry = scconf_index_lookup(index, it->key, scconf_key_hash(it->key));
+		it->started = 1;
+	}
+	if (!it->entry) {
+		return NULL;
+	}
+	while (it->pos < it->entry->count) {
+		item = index->items[it->entry->first + it->pos++];
+		if (item->type == it->type) {
+			return item;
 		}
 	}
 	return NULL;
 }
 
+const scconf_block *scconf_find_block(const scconf_context * config, const scconf_block * block, const char *item_name)
+{
+	scconf_item_iter it;
+	scconf_item *item;
+
+	if (!block) {
+		block = config->root;
+	}
+	if (!item_name) {
+		return NULL;
+	}
+	scconf_item_iter_init(&it, block, SCCONF_ITEM_TYPE_BLOCK, item_name);
+	item = scconf_item_iter_next(&it);
+	return item ? item->value.block : NULL;
+}
+
 scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_block * block, const char *item_name, const char *key)
 {
 	scconf_block **blocks = NULL, **tmp;
 	int alloc_size, size;
+	scconf_item_iter it;
 	scconf_item *item;
 
 	if (!block) {
@@ -104,23 +287,21 @@ scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_bl
 	}
 	blocks = tmp;
 
-	for (item = block->items; item; item = item->next) {
-		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
-		    strcasecmp(item_name, item->key) == 0) {
-			if (key && strcasecmp(key, item->value.block->name->data)) {
-				continue;
-			}
-			if (size + 1 >= alloc_size) {
-				alloc_size *= 2;
-				tmp = (scconf_block **) realloc(blocks, sizeof(scconf_block *) * alloc_size);
-				if (!tmp) {
-					free(blocks);
-					return NULL;
-				}
-				blocks = tmp;
+	scconf_item_iter_init(&it, block, SCCONF_ITEM_TYPE_BLOCK, item_name);
+	while ((item = scconf_item_iter_next(&it)) != NULL) {
+		if (key && strcasecmp(key, item->value.block->name->data)) {
+			continue;
+		}
+		if (size + 1 >= alloc_size) {
+			alloc_size *= 2;
+			tmp = (scconf_block **) realloc(blocks, sizeof(scconf_block *) * alloc_size);
+			if (!tmp) {
+				free(blocks);
+				return NULL;
 			}
-			blocks[size++] = item->value.block;
+			blocks = tmp;
 		}
+		blocks[size++] = item->value.block;
 	}
 	blocks[size] = NULL;
 	return blocks;
@@ -128,15 +309,15 @@ scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_bl
 
 const scconf_list *scconf_find_list(const scconf_block * block, const char *option)
 {
+	scconf_item_iter it;
 	scconf_item *item;
 
 	if (!block)
 		return NULL;
 
-	for (item = block->items; item; item = item->next)
-		if (item->type == SCCONF_ITEM_TYPE_VALUE && strcasecmp(option, item->key) == 0)
-			return item->value.list;
-	return NULL;
+	scconf_item_iter_init(&it, block, SCCONF_ITEM_TYPE_VALUE, option);
+	item = scconf_item_iter_next(&it);
+	return item ? item->value.list : NULL;
 }
 
 const char *scconf_get_str(const scconf_block * block, const char *option, const char *def)
@@ -292,6 +473,9 @@ scconf_block *scconf_block_copy(const scconf_block * src, scconf_block ** dst)
 		if (src->items) {
 			scconf_item_copy(src->items, &_dst->items);
 		}
+		if (src->index) {
+			scconf_block_index(_dst, 0);
+		}
 		*dst = _dst;
 		return _dst;
 	}
@@ -301,6 +485,7 @@ scconf_block *scconf_block_copy(const scconf_block * src, scconf_block ** dst)
 void scconf_block_destroy(scconf_block * block)
 {
 	if (block) {
+		scconf_index_free(block->index);
 		scconf_list_destroy(block->name);
 		scconf_item_destroy(block->items);
 		free(block);
@@ -78,6 +78,8 @@ struct _scconf_block {
 	scconf_block *parent;
 	scconf_list *name;
 	scconf_item *items;
+	/* items by key, for blocks with many items; see scconf_block_index() */
+	struct _scconf_index *index;
 };
 
 typedef struct {
@@ -106,6 +108,18 @@ extern int scconf_parse(scconf_context * config);
  */
 extern int scconf_parse_string(scconf_context * config, const char *string);
 
+/* Load a configuration image written by scconf_write_image(), without
+ * lexing the configuration file
+ * Returns 1 = ok, 0 = the image is invalid or older than the
+ * configuration file, -1 = the image can't be opened
+ */
+extern int scconf_parse_image(scconf_context * config, const char *filename);
+
+/* Write the parsed configuration to a binary image
+ * Returns 0 = ok, -1 = error
+ */
+extern int scconf_write_image(const scconf_context * config, const char *filename);
+
 /* Parse entries
  */
 extern int scconf_parse_entries(const scconf_context * config, const scconf_block * block, scconf_entry * entry);
@@ -171,6 +185,13 @@ extern scconf_block *scconf_block_add(scconf_context * config, scconf_block * bl
  */
 extern scconf_block *scconf_block_copy(const scconf_block * src, scconf_block ** dst);
 
+/* (Re)build the key index of a block, and of its sub-blocks if recursive.
+ * Lookups in the block use the index once it is built. Functions that add
+ * items keep it up to date; code that links items into a block by hand
+ * must call this again.
+ */
+extern void scconf_block_index(scconf_block * block, int recursive);
+
 /* Free block structure (recursive)
  */
 extern void scconf_block_destroy(scconf_block * block);
@@ -63,37 +63,15 @@ int
 sm_cwa_get_mac(struct sc_context *ctx, unsigned char *key, DES_cblock *icv,
 			unsigned char *in, int in_len, DES_cblock *out, int force_padding)
 {
-	DES_cblock kk, k2;
-	DES_key_schedule ks,ks2;
-	unsigned char padding[8] = {0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	unsigned char *buf;
+	struct sm_des3_key dkey;
 
 	LOG_FUNC_CALLED(ctx);
-	sc_log(ctx, "sm_cwa_get_mac() data length %i", in_len);
-
-	buf = malloc(in_len + 8);
-	if (!buf)
-		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
-
 	sc_log(ctx, "sm_cwa_get_mac() in_data(%i) %s", in_len, sc_dump_hex(in, in_len));
-	memcpy(buf, in, in_len);
-	memcpy(buf + in_len, padding, 8);
-
-	if (force_padding)
-		in_len = ((in_len + 8) / 8) * 8;
-	else
-		in_len = ((in_len + 7) / 8) * 8;
-
-	sc_log(ctx, "sm_cwa_get_mac() data to MAC(%i) %s", in_len, sc_dump_hex(buf, in_len));
 	sc_log(ctx, "sm_cwa_get_mac() ICV %s", sc_dump_hex((unsigned char *)icv, 8));
 
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
-	DES_cbc_cksum_3des_emv96(buf, out, in_len ,&ks, &ks2, icv);
+	sm_des3_set_key(&dkey, key);
+	sm_des3_mac(&dkey, (const_DES_cblock *)icv, in, in_len, force_padding, 1, out);
 
-	free(buf);
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
@@ -155,7 +133,7 @@ sm_cwa_decode_authentication_data(struct sc_context *ctx, struct sm_cwa_keyset *
 	LOG_TEST_RET(ctx, rv, "Decode authentication data:  sm_ecc_get_mac failed");
 	sc_log(ctx, "MAC:%s", sc_dump_hex(cblock, sizeof(cblock)));
 
-	if(memcmp(session_data->mdata + 0x40, cblock, 8))
+	if (sc_mem_cmp_ct(session_data->mdata + 0x40, cblock, 8))
 		LOG_FUNC_RETURN(ctx, SC_ERROR_SM_AUTHENTICATION_FAILED);
 
 	rv = sm_decrypt_des_cbc3(ctx, keyset->enc, session_data->mdata, session_data->mdata_len, &decrypted, &decrypted_len);
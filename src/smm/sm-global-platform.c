@@ -213,9 +213,8 @@ sm_gp_get_cryptogram(unsigned char *session_key,
 		unsigned char *left, unsigned char *right,
 		unsigned char *out, int out_len)
 {
-	unsigned char block[24];
-	DES_cblock kk,k2;
-	DES_key_schedule ks,ks2;
+	unsigned char block[16];
+	struct sm_des3_key dkey;
 	DES_cblock cksum={0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
 
 	if (out_len!=8)
@@ -223,13 +222,9 @@ sm_gp_get_cryptogram(unsigned char *session_key,
 
 	memcpy(block + 0, left, 8);
 	memcpy(block + 8, right, 8);
-	memcpy(block + 16, "\x80\0\0\0\0\0\0\0",8);
 
-	memcpy(&kk, session_key, 8);
-	memcpy(&k2, session_key + 8, 8);
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
-	DES_cbc_cksum_3des(block,&cksum, sizeof(block),&ks,&ks2,&cksum);
+	sm_des3_set_key(&dkey, session_key);
+	sm_des3_mac(&dkey, &cksum, block, sizeof(block), 1, 0, &cksum);
 
 	memcpy(out, cksum, 8);
 
@@ -241,28 +236,11 @@ int
 sm_gp_get_mac(unsigned char *key, DES_cblock *icv,
 		unsigned char *in, int in_len, DES_cblock *out)
 {
-	int len;
-	unsigned char *block;
-	DES_cblock kk, k2;
-	DES_key_schedule ks,ks2;
+	struct sm_des3_key dkey;
 
-	block = malloc(in_len + 8);
-	if (!block)
-		return SC_ERROR_OUT_OF_MEMORY;
+	sm_des3_set_key(&dkey, key);
+	sm_des3_mac(&dkey, (const_DES_cblock *)icv, in, in_len, 1, 0, out);
 
-	memcpy(block, in, in_len);
-	memcpy(block + in_len, "\x80\0\0\0\0\0\0\0", 8);
-	len = in_len + 8;
-	len -= (len%8);
-
-	memcpy(&kk, key, 8);
-	memcpy(&k2, key + 8, 8);
-	DES_set_key_unchecked(&kk,&ks);
-	DES_set_key_unchecked(&k2,&ks2);
-
-	DES_cbc_cksum_3des(block, out, len ,&ks, &ks2, icv);
-
-	free(block);
 	return 0;
 }
 
@@ -314,7 +292,7 @@ sm_gp_init_session(struct sc_context *ctx, struct sm_gp_session *gp_session,
 	LOG_TEST_RET(ctx, rv, "SM GP init session: cannot get cryptogram");
 
 	sc_log(ctx, "SM GP init session: cryptogram: %s", sc_dump_hex(cksum, 8));
-	if (memcmp(cksum, adata, adata_len))
+	if (sc_mem_cmp_ct(cksum, adata, adata_len))
 		LOG_FUNC_RETURN(ctx, SC_ERROR_SM_AUTHENTICATION_FAILED);
 
 	sc_log(ctx, "SM GP init session: card authenticated");
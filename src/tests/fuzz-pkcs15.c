@@ -0,0 +1,317 @@
+/*
+ * fuzz-pkcs15.c: Fuzzing harness for the ASN.1 and PKCS#15 parsers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The first byte of an input selects the parser, the rest is the card data:
+ *   0..8	sc_pkcs15_parse_df() of a DF of that type (SC_PKCS15_PRKDF...)
+ *   9		sc_pkcs15_parse_tokeninfo()
+ *   10		sc_pkcs15_read_certificate() of a direct value (parse_x509_cert)
+ *   11		sc_pkcs15_pubkey_from_spki()
+ *
+ * Built as is, the program runs the inputs given as files or directories
+ * once, as afl-fuzz wants it ("afl-fuzz -i in -o out fuzz-pkcs15 @@"), and
+ * prints the executions per second and the slowest inputs.
+ *
+ * For libFuzzer, configure with CC=clang and
+ * CFLAGS="-g -fsanitize=address,fuzzer-no-link", then
+ *   make fuzz-pkcs15 CPPFLAGS=-DFUZZ_LIBFUZZER LDFLAGS=-fsanitize=fuzzer
+ * libFuzzer gives the executions per second itself; -report_slow_units
+ * and -malloc_limit_mb catch slow inputs and huge allocations.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifndef FUZZ_LIBFUZZER
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+
+#define FUZZ_TARGET_TOKENINFO	SC_PKCS15_DF_TYPE_COUNT
+#define FUZZ_TARGET_CERT	(SC_PKCS15_DF_TYPE_COUNT + 1)
+#define FUZZ_TARGET_SPKI	(SC_PKCS15_DF_TYPE_COUNT + 2)
+#define FUZZ_TARGET_COUNT	(SC_PKCS15_DF_TYPE_COUNT + 3)
+
+static sc_context_t *ctx;
+static sc_card_t card;
+
+static struct sc_pkcs15_card *new_p15card(void)
+{
+	struct sc_pkcs15_card *p15;
+
+	p15 = sc_pkcs15_card_new();
+	if (p15 == NULL || (p15->file_app = sc_file_new()) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	p15->card = &card;
+	sc_format_path("3F005015", &p15->file_app->path);
+	return p15;
+}
+
+/* the DF is given to the parser as if read from the card during the bind */
+static void fuzz_parse_df(unsigned int type, const u8 *data, size_t len)
+{
+	struct sc_pkcs15_card *p15 = new_p15card();
+	struct sc_pkcs15_prefetched_file *pf;
+	struct sc_pkcs15_df *df;
+	sc_path_t path;
+
+	pf = calloc(1, sizeof(*pf));
+	if (pf == NULL || (pf->data = malloc(len ? len : 1)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memcpy(pf->data, data, len);
+	pf->len = len;
+	sc_format_path("3F0050154401", &path);
+	pf->path = path;
+	p15->prefetched = pf;
+
+	sc_pkcs15_add_df(p15, type, &path);
+	for (df = p15->df_list; df != NULL; df = df->next)
+		sc_pkcs15_parse_df(p15, df);
+	sc_pkcs15_card_free(p15);
+}
+
+static void fuzz_tokeninfo(const u8 *data, size_t len)
+{
+	struct sc_pkcs15_card *p15 = new_p15card();
+
+	sc_pkcs15_parse_tokeninfo(ctx, p15->tokeninfo, data, len);
+	sc_pkcs15_card_free(p15);
+}
+
+static void fuzz_cert(const u8 *data, size_t len)
+{
+	struct sc_pkcs15_card *p15 = new_p15card();
+	struct sc_pkcs15_cert_info info;
+	struct sc_pkcs15_cert *cert = NULL;
+
+	memset(&info, 0, sizeof(info));
+	info.value.value = (u8 *) data;
+	info.value.len = len;
+	if (sc_pkcs15_read_certificate(p15, &info, &cert) == SC_SUCCESS)
+		sc_pkcs15_free_certificate(cert);
+	sc_pkcs15_card_free(p15);
+}
+
+static void fuzz_spki(const u8 *data, size_t len)
+{
+	struct sc_pkcs15_pubkey *pubkey = NULL;
+	u8 *buf;
+
+	/* a copy of the exact size, so that overreads are seen by ASan */
+	buf = malloc(len ? len : 1);
+	if (buf == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memcpy(buf, data, len);
+	if (sc_pkcs15_pubkey_from_spki(ctx, &pubkey, buf, len, 0) == SC_SUCCESS)
+		sc_pkcs15_free_pubkey(pubkey);
+	free(buf);
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	sc_context_param_t ctx_param;
+	int r;
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.app_name = "fuzz-pkcs15";
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r) {
+		fprintf(stderr, "Failed to create initial context: %s", sc_strerror(r));
+		exit(1);
+	}
+	card.ctx = ctx;
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const u8 *data, size_t len)
+{
+	unsigned int target;
+
+	if (len < 1)
+		return 0;
+	target = data[0] % FUZZ_TARGET_COUNT;
+	data++;
+	len--;
+
+	switch (target) {
+	case FUZZ_TARGET_TOKENINFO:
+		fuzz_tokeninfo(data, len);
+		break;
+	case FUZZ_TARGET_CERT:
+		fuzz_cert(data, len);
+		break;
+	case FUZZ_TARGET_SPKI:
+		fuzz_spki(data, len);
+		break;
+	default:
+		fuzz_parse_df(target, data, len);
+		break;
+	}
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+#define SLOWEST_MAX	32
+
+static struct {
+	unsigned long long us;
+	char name[256];
+} slowest[SLOWEST_MAX];
+static int slowest_count = 10;
+static unsigned long runs;
+static unsigned long long total_us;
+
+static unsigned long long now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* keeps the slowest inputs sorted, the slowest first */
+static void record_time(const char *name, unsigned long long us)
+{
+	int i;
+
+	runs++;
+	total_us += us;
+	for (i = slowest_count - 1; i >= 0 && us > slowest[i].us; i--)
+		if (i + 1 < slowest_count)
+			slowest[i + 1] = slowest[i];
+	if (++i < slowest_count) {
+		slowest[i].us = us;
+		snprintf(slowest[i].name, sizeof(slowest[i].name), "%s", name);
+	}
+}
+
+static int run_file(const char *name)
+{
+	FILE *f;
+	u8 *data = NULL;
+	size_t len = 0, size = 0, n;
+	unsigned long long start;
+
+	f = fopen(name, "rb");
+	if (f == NULL) {
+		perror(name);
+		return 1;
+	}
+	do {
+		if (len == size) {
+			size = size ? 2 * size : 4096;
+			data = realloc(data, size);
+			if (data == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		n = fread(data + len, 1, size - len, f);
+		len += n;
+	} while (n > 0);
+	fclose(f);
+
+	start = now_us();
+	LLVMFuzzerTestOneInput(data, len);
+	record_time(name, now_us() - start);
+	free(data);
+	return 0;
+}
+
+static int run_path(const char *name)
+{
+	struct stat st;
+	struct dirent *ent;
+	DIR *dir;
+	char path[1024];
+	int r = 0;
+
+	if (stat(name, &st) != 0) {
+		perror(name);
+		return 1;
+	}
+	if (!S_ISDIR(st.st_mode))
+		return run_file(name);
+
+	dir = opendir(name);
+	if (dir == NULL) {
+		perror(name);
+		return 1;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", name, ent->d_name);
+		r |= run_path(path);
+	}
+	closedir(dir);
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, r = 0;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			slowest_count = atoi(optarg);
+			if (slowest_count < 0 || slowest_count > SLOWEST_MAX)
+				slowest_count = SLOWEST_MAX;
+			break;
+		default:
+			fprintf(stderr, "Usage: fuzz-pkcs15 [-n slowest] file|directory...\n");
+			return 1;
+		}
+	}
+	if (optind == argc) {
+		fprintf(stderr, "Usage: fuzz-pkcs15 [-n slowest] file|directory...\n");
+		return 1;
+	}
+
+	LLVMFuzzerInitialize(&argc, &argv);
+	for (i = optind; i < argc; i++)
+		r |= run_path(argv[i]);
+
+	printf("# %lu inputs in %llu us", runs, total_us);
+	if (total_us)
+		printf(", %.0f executions/s", runs * 1000000.0 / total_us);
+	printf("\n# us\tinput (slowest first)\n");
+	for (i = 0; i < slowest_count && slowest[i].name[0]; i++)
+		printf("%llu\t%s\n", slowest[i].us, slowest[i].name);
+
+	sc_release_context(ctx);
+	return r;
+}
+#endif
@@ -0,0 +1,379 @@
+/*
+ * microbench.c: Benchmarks of host side hot paths, without a card
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Every benchmark is repeated until it ran for the given time, and gives
+ * one line of tab separated name, iterations and nanoseconds per iteration.
+ * 'make bench' keeps the results in bench-<version>.tsv, to be compared
+ * between releases.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "libopensc/opensc.h"
+#include "libopensc/asn1.h"
+#include "libopensc/pkcs15.h"
+#include "libopensc/internal.h"
+#include "common/simclist.h"
+
+#define DF_ENTRIES	16
+#define LIST_SIZE	1000
+
+static sc_context_t *ctx;
+static sc_card_t card;
+static struct sc_pkcs15_card *p15card;
+static sc_path_t df_path;
+
+static u8 prkdf[DF_ENTRIES * 128], cdf[DF_ENTRIES * 128];
+static size_t prkdf_len, cdf_len;
+static u8 apdu_data[200], resp_data[258], out[4096];
+static char base64_text[4096], hex_text[1024];
+static list_t list;
+static int list_values[LIST_SIZE];
+
+/* as many ATRs as a card driver has, the one looked for comes last */
+static struct sc_atr_table atrs[] = {
+	{ "3b:e2:00:ff:c1:10:31:fe:55:c8:02:9c", NULL, NULL, 1, 0, NULL },
+	{ "3b:e9:00:ff:c1:10:31:fe:55:00:64:05:00:c8:02:31:80:00:47", NULL, NULL, 2, 0, NULL },
+	{ "3b:fb:98:00:ff:c1:10:31:fe:55:00:64:05:20:47:03:31:80:00:90:00:f3", NULL, NULL, 3, 0, NULL },
+	{ "3b:f4:98:00:ff:c1:10:31:fe:55:4d:34:63:76:b4", NULL, NULL, 4, 0, NULL },
+	{ "3b:f2:18:00:ff:c1:0a:31:fe:55:c8:06:8a", "ff:ff:0f:ff:00:ff:00:ff:ff:00:00:00:00", NULL, 5, 0, NULL },
+	{ "3b:d2:18:02:c1:0a:31:fe:58:c8:0d:51", NULL, NULL, 6, 0, NULL },
+	{ "3b:d2:18:00:81:31:fe:58:c9:01:14", NULL, NULL, 7, 0, NULL },
+	{ "3b:db:96:00:80:b1:fe:45:1f:83:00:31:c0:64:1a:18:01:00:07:90:00:5a", NULL, NULL, 8, 0, NULL },
+	{ NULL, NULL, NULL, 0, 0, NULL }
+};
+
+static size_t encode_entries(int type, u8 *buf, size_t bufsize)
+{
+	struct sc_pkcs15_object obj;
+	struct sc_pkcs15_prkey_info prkey;
+	struct sc_pkcs15_cert_info cert;
+	char path[32];
+	size_t len = 0, n = 0;
+	u8 *entry = NULL;
+	int i, r;
+
+	for (i = 0; i < DF_ENTRIES; i++) {
+		memset(&obj, 0, sizeof(obj));
+		snprintf(obj.label, sizeof(obj.label), "Key %d of the benchmark card", i);
+		snprintf(path, sizeof(path), "3F0050154B%02X", i);
+		if (type == SC_PKCS15_PRKDF) {
+			memset(&prkey, 0, sizeof(prkey));
+			obj.type = SC_PKCS15_TYPE_PRKEY_RSA;
+			obj.flags = SC_PKCS15_CO_FLAG_PRIVATE;
+			sc_pkcs15_format_id("01", &obj.auth_id);
+			obj.data = &prkey;
+			prkey.id.len = 1;
+			prkey.id.value[0] = 0x45 + i;
+			prkey.usage = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_DECRYPT;
+			prkey.access_flags = SC_PKCS15_PRKEY_ACCESS_SENSITIVE
+				| SC_PKCS15_PRKEY_ACCESS_NEVEREXTRACTABLE;
+			prkey.native = 1;
+			prkey.key_reference = 0x10 + i;
+			prkey.modulus_length = 2048;
+			sc_format_path(path, &prkey.path);
+			r = sc_pkcs15_encode_prkdf_entry(ctx, &obj, &entry, &n);
+		}
+		else {
+			memset(&cert, 0, sizeof(cert));
+			obj.type = SC_PKCS15_TYPE_CERT_X509;
+			obj.data = &cert;
+			cert.id.len = 1;
+			cert.id.value[0] = 0x45 + i;
+			sc_format_path(path, &cert.path);
+			r = sc_pkcs15_encode_cdf_entry(ctx, &obj, &entry, &n);
+		}
+		if (r < 0 || len + n > bufsize) {
+			fprintf(stderr, "Cannot encode the DF entries: %s\n", sc_strerror(r));
+			exit(1);
+		}
+		memcpy(buf + len, entry, n);
+		len += n;
+		free(entry);
+	}
+	return len;
+}
+
+static struct sc_pkcs15_card *new_p15card(void)
+{
+	struct sc_pkcs15_card *p15;
+
+	p15 = sc_pkcs15_card_new();
+	if (p15 == NULL || (p15->file_app = sc_file_new()) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	p15->card = &card;
+	sc_format_path("3F005015", &p15->file_app->path);
+	return p15;
+}
+
+static int seek_int(const void *el, const void *indicator)
+{
+	return *(const int *) el == *(const int *) indicator;
+}
+
+static void setup(void)
+{
+	int i;
+
+	prkdf_len = encode_entries(SC_PKCS15_PRKDF, prkdf, sizeof(prkdf));
+	cdf_len = encode_entries(SC_PKCS15_CDF, cdf, sizeof(cdf));
+	sc_format_path("3F0050154401", &df_path);
+	p15card = new_p15card();
+
+	card.ctx = ctx;
+	card.atr.len = sizeof(card.atr.value);
+	sc_hex_to_bin(atrs[7].atr, card.atr.value, &card.atr.len);
+
+	for (i = 0; i < (int) sizeof(apdu_data); i++)
+		apdu_data[i] = i;
+	for (i = 0; i < (int) sizeof(resp_data); i++)
+		resp_data[i] = i;
+	resp_data[sizeof(resp_data) - 2] = 0x90;
+	resp_data[sizeof(resp_data) - 1] = 0x00;
+	sc_base64_encode(apdu_data, sizeof(apdu_data), (u8 *) base64_text, sizeof(base64_text), 64);
+	sc_bin_to_hex(apdu_data, sizeof(apdu_data), hex_text, sizeof(hex_text), ':');
+
+	list_init(&list);
+	list_attributes_seeker(&list, seek_int);
+	for (i = 0; i < LIST_SIZE; i++) {
+		list_values[i] = i;
+		list_append(&list, &list_values[i]);
+	}
+}
+
+/* The benchmarks, one iteration each */
+
+static void bench_decode_prkdf_entry(void)
+{
+	struct sc_pkcs15_object obj;
+	const u8 *p = prkdf;
+	size_t left = prkdf_len;
+
+	memset(&obj, 0, sizeof(obj));
+	if (sc_pkcs15_decode_prkdf_entry(p15card, &obj, &p, &left) == 0)
+		sc_pkcs15_free_prkey_info(obj.data);
+}
+
+static void bench_decode_cdf_entry(void)
+{
+	struct sc_pkcs15_object obj;
+	const u8 *p = cdf;
+	size_t left = cdf_len;
+
+	memset(&obj, 0, sizeof(obj));
+	if (sc_pkcs15_decode_cdf_entry(p15card, &obj, &p, &left) == 0)
+		sc_pkcs15_free_cert_info(obj.data);
+}
+
+/* the whole PrKDF, as read during the bind */
+static void bench_parse_df(void)
+{
+	struct sc_pkcs15_card *p15 = new_p15card();
+	struct sc_pkcs15_prefetched_file *pf;
+	struct sc_pkcs15_df *df;
+
+	pf = calloc(1, sizeof(*pf));
+	if (pf == NULL || (pf->data = malloc(prkdf_len)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memcpy(pf->data, prkdf, prkdf_len);
+	pf->len = prkdf_len;
+	pf->path = df_path;
+	p15->prefetched = pf;
+
+	sc_pkcs15_add_df(p15, SC_PKCS15_PRKDF, &df_path);
+	for (df = p15->df_list; df != NULL; df = df->next)
+		sc_pkcs15_parse_df(p15, df);
+	sc_pkcs15_card_free(p15);
+}
+
+static void bench_apdu_get_octets(void)
+{
+	sc_apdu_t apdu;
+	size_t len;
+
+	sc_format_apdu(&card, &apdu, SC_APDU_CASE_4_SHORT, 0x2A, 0x9E, 0x9A);
+	apdu.data = apdu_data;
+	apdu.datalen = apdu.lc = sizeof(apdu_data);
+	apdu.le = 256;
+	sc_apdu_get_octets_buf(ctx, &apdu, out, sizeof(out), &len, SC_PROTO_T1);
+}
+
+static void bench_apdu_set_resp(void)
+{
+	sc_apdu_t apdu;
+
+	memset(&apdu, 0, sizeof(apdu));
+	apdu.resp = out;
+	apdu.resplen = sizeof(out);
+	sc_apdu_set_resp(ctx, &apdu, resp_data, sizeof(resp_data));
+}
+
+static void bench_match_atr(void)
+{
+	_sc_match_atr(&card, atrs, NULL);
+}
+
+static void bench_pkcs1_encode(void)
+{
+	size_t len = sizeof(out);
+
+	sc_pkcs1_encode(ctx, SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA256,
+			apdu_data, 32, out, &len, 256);
+}
+
+static void bench_base64_encode(void)
+{
+	sc_base64_encode(apdu_data, sizeof(apdu_data), out, sizeof(out), 64);
+}
+
+static void bench_base64_decode(void)
+{
+	sc_base64_decode(base64_text, out, sizeof(out));
+}
+
+static void bench_bin_to_hex(void)
+{
+	sc_bin_to_hex(apdu_data, sizeof(apdu_data), (char *) out, sizeof(out), ':');
+}
+
+static void bench_hex_to_bin(void)
+{
+	size_t len = sizeof(out);
+
+	sc_hex_to_bin(hex_text, out, &len);
+}
+
+static void bench_crc32(void)
+{
+	sc_crc32(resp_data, sizeof(resp_data));
+}
+
+static void bench_list_append(void)
+{
+	list_t l;
+	int i;
+
+	list_init(&l);
+	for (i = 0; i < LIST_SIZE; i++)
+		list_append(&l, &list_values[i]);
+	list_destroy(&l);
+}
+
+static void bench_list_seek(void)
+{
+	int last = LIST_SIZE - 1;
+
+	list_seek(&list, &last);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benchmarks[] = {
+	{ "asn1_decode_prkdf_entry",	bench_decode_prkdf_entry },
+	{ "asn1_decode_cdf_entry",	bench_decode_cdf_entry },
+	{ "pkcs15_parse_df",		bench_parse_df },
+	{ "apdu_get_octets",		bench_apdu_get_octets },
+	{ "apdu_set_resp",		bench_apdu_set_resp },
+	{ "match_atr",			bench_match_atr },
+	{ "pkcs1_encode",		bench_pkcs1_encode },
+	{ "base64_encode",		bench_base64_encode },
+	{ "base64_decode",		bench_base64_decode },
+	{ "bin_to_hex",			bench_bin_to_hex },
+	{ "hex_to_bin",			bench_hex_to_bin },
+	{ "crc32",			bench_crc32 },
+	{ "simclist_append",		bench_list_append },
+	{ "simclist_seek",		bench_list_seek },
+	{ NULL, NULL }
+};
+
+static unsigned long long now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int main(int argc, char *argv[])
+{
+	sc_context_param_t ctx_param;
+	unsigned long long min_us = 200000, start, elapsed;
+	unsigned long n, i;
+	int b, c, r;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			min_us = strtoul(optarg, NULL, 0) * 1000ULL;
+			break;
+		default:
+			fprintf(stderr, "Usage: microbench [-t milliseconds] [name...]\n");
+			return 1;
+		}
+	}
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.app_name = "microbench";
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r) {
+		fprintf(stderr, "Failed to create initial context: %s", sc_strerror(r));
+		return 1;
+	}
+	setup();
+
+	printf("# OpenSC %s\n", sc_get_version());
+	printf("# name\titerations\tns/iteration\n");
+	for (b = 0; benchmarks[b].name != NULL; b++) {
+		if (optind < argc) {
+			for (c = optind; c < argc; c++)
+				if (strstr(benchmarks[b].name, argv[c]))
+					break;
+			if (c == argc)
+				continue;
+		}
+		benchmarks[b].run();
+		for (n = 1; ; n *= 2) {
+			start = now_us();
+			for (i = 0; i < n; i++)
+				benchmarks[b].run();
+			elapsed = now_us() - start;
+			if (elapsed >= min_us)
+				break;
+		}
+		printf("%s\t%lu\t%.1f\n", benchmarks[b].name, n, elapsed * 1000.0 / n);
+		fflush(stdout);
+	}
+
+	list_destroy(&list);
+	sc_pkcs15_card_free(p15card);
+	sc_release_context(ctx);
+	return 0;
+}
@@ -119,6 +119,8 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 	printf("found.\n");
+	if (profile != NULL)
+		sc_trace_profile_print(profile, stdout);
 	sc_test_print_card(p15card);
 
 	dump_objects("PIN codes", SC_PKCS15_TYPE_AUTH_PIN);
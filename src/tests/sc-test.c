@@ -16,11 +16,13 @@
 
 sc_context_t *ctx;
 sc_card_t *card;
+struct sc_trace_profile *profile;
 
 static const struct option	options[] = {
 	{ "reader",             1, NULL,           'r' },
 	{ "driver",		1, NULL,           'c' },
 	{ "debug",              0, NULL,           'd' },
+	{ "profile-bind",	0, NULL,           'p' },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -29,13 +31,14 @@ const char *		option_help[] = {
 	"Uses reader number <arg> [0]",
 	"Forces the use of driver <arg> [auto-detect]",
 	"Debug output -- may be supplied several times",
+	"Profile the phases of the connect and the bind, see sc_trace_profile_start()",
 };
 #endif
 
 int sc_test_init(int *argc, char *argv[])
 {
 	char	*opt_driver = NULL, *app_name;
-	int	opt_debug = 0, opt_reader = -1;
+	int	opt_debug = 0, opt_reader = -1, opt_profile = 0;
 	int	i, c, rc;
 	sc_context_param_t ctx_param;
 
@@ -44,7 +47,7 @@ int sc_test_init(int *argc, char *argv[])
 	else
 		app_name = argv[0];
 
-	while ((c = getopt_long(*argc, argv, "r:c:d", options, NULL)) != -1) {
+	while ((c = getopt_long(*argc, argv, "r:c:dp", options, NULL)) != -1) {
 		switch (c) {
 		case 'r':
 			opt_reader = atoi(optarg);
@@ -55,9 +58,12 @@ int sc_test_init(int *argc, char *argv[])
 		case 'd':
 			opt_debug++;
 			break;
+		case 'p':
+			opt_profile = 1;
+			break;
 		default:
 			fprintf(stderr,
-				"usage: %s [-r reader] [-c driver] [-d]\n",
+				"usage: %s [-r reader] [-c driver] [-d] [-p]\n",
 				app_name);
 			exit(1);
 		}
@@ -76,6 +82,13 @@ int sc_test_init(int *argc, char *argv[])
 		return i;
 	}
 	ctx->debug = opt_debug;
+	if (opt_profile) {
+		i = sc_trace_profile_start(ctx, &profile);
+		if (i != SC_SUCCESS) {
+			printf("Failed to start the profile: %s\n", sc_strerror(i));
+			return i;
+		}
+	}
 
 	if (opt_reader >= (int) sc_ctx_get_reader_count(ctx)) {
 		fprintf(stderr, "Illegal reader number.\n"
@@ -138,6 +151,8 @@ int sc_test_init(int *argc, char *argv[])
 
 void sc_test_cleanup(void)
 {
+	sc_trace_profile_stop(profile);
+	profile = NULL;
 	sc_disconnect_card(card);
 	sc_release_context(ctx);
 }
@@ -9,6 +9,8 @@ extern "C" {
 
 extern struct sc_context *ctx;
 extern struct sc_card *card;
+/* with --profile-bind, NULL otherwise */
+extern struct sc_trace_profile *profile;
 struct sc_pkcs15_card;
 struct sc_pkcs15_object;
 
@@ -4,6 +4,7 @@ TOPDIR = ..\..
 
 TARGETS = opensc-tool.exe opensc-explorer.exe pkcs15-tool.exe pkcs15-crypt.exe \
 		pkcs11-tool.exe cardos-tool.exe eidenv.exe sc-hsm-tool.exe openpgp-tool.exe dnie-tool.exe \
+		opensc-cache-warmer.exe \
 		$(PROGRAMS_OPENSSL)
 
 $(TARGETS): $(TOPDIR)\win32\versioninfo.res util.obj 
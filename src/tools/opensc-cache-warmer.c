@@ -0,0 +1,251 @@
+/*
+ * opensc-cache-warmer.c: Fills the caches of the cards when they are inserted
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Waits for the cards to be inserted and binds each of them once, the way
+ * the applications do, so that the first application to see the card finds
+ * the caches filled: the card driver that took the ATR (use_driver_cache),
+ * the ODF, TokenInfo and decoded DFs of every PKCS #15 application, the
+ * public certificate, public key and data object files (use_file_caching)
+ * and the objects of a PIV card. The card is released as soon as that is
+ * done.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+#include "util.h"
+
+static const char *app_name = "opensc-cache-warmer";
+
+static const char *opt_reader = NULL;
+static int opt_once = 0;
+static int verbose = 0;
+
+static const struct option options[] = {
+	{ "reader",	required_argument, NULL, 'r' },
+	{ "once",	no_argument, NULL, '1' },
+	{ "verbose",	no_argument, NULL, 'v' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static const char *option_help[] = {
+	"Only warms the cards of the readers with <arg> in their name",
+	"Warms the cards present now and exits, without waiting for more",
+	"Verbose operation. Use several times to enable debug output.",
+	NULL
+};
+
+static sc_context_t *ctx = NULL;
+
+/* Reads a public file of the objects into the file cache, unless it is
+ * there already. Returns 1 if it was added. */
+static int warm_file(struct sc_pkcs15_card *p15card, const sc_path_t *in_path)
+{
+	sc_path_t path = *in_path;
+	u8 *buf = NULL;
+	size_t len = 0;
+	int r;
+
+	if (path.len == 0)
+		return 0;
+	if (path.type == SC_PATH_TYPE_FILE_ID) {
+		/* prepend application DF path in case of a file id */
+		if (sc_concatenate_path(&path, &p15card->file_app->path, &path) != SC_SUCCESS)
+			return 0;
+	}
+	if (sc_pkcs15_read_cached_file(p15card, &path, &buf, &len) == SC_SUCCESS) {
+		free(buf);
+		return 0;
+	}
+
+	buf = NULL;
+	r = sc_pkcs15_read_file(p15card, &path, &buf, &len);
+	if (r == SC_SUCCESS)
+		r = sc_pkcs15_cache_file(p15card, &path, buf, len);
+	free(buf);
+	if (r != SC_SUCCESS) {
+		if (verbose)
+			printf("  %s: %s\n", sc_print_path(&path), sc_strerror(r));
+		return 0;
+	}
+	return 1;
+}
+
+/* Binds one application and reads what the applications read first */
+static void warm_application(sc_card_t *card, struct sc_aid *aid)
+{
+	struct sc_pkcs15_card *p15card = NULL;
+	struct sc_pkcs15_search_key sk;
+	struct sc_pkcs15_object_iter it;
+	struct sc_pkcs15_object *obj;
+	int r, files = 0;
+
+	r = sc_pkcs15_bind(card, aid, &p15card);
+	if (r != SC_SUCCESS) {
+		if (verbose)
+			printf("  no PKCS #15 application: %s\n", sc_strerror(r));
+		return;
+	}
+	if (!p15card->opts.use_file_cache) {
+		static int warned = 0;
+
+		if (!warned++)
+			util_warn("use_file_caching is not set, only the card driver and the card caches are filled");
+		sc_pkcs15_unbind(p15card);
+		return;
+	}
+
+	/* every DF is parsed, and so cached, by its first search */
+	memset(&sk, 0, sizeof(sk));
+	sk.class_mask = SC_PKCS15_SEARCH_CLASS_PRKEY | SC_PKCS15_SEARCH_CLASS_SKEY
+		| SC_PKCS15_SEARCH_CLASS_AUTH | SC_PKCS15_SEARCH_CLASS_CERT
+		| SC_PKCS15_SEARCH_CLASS_PUBKEY | SC_PKCS15_SEARCH_CLASS_DATA;
+	if (sc_pkcs15_iter_init(p15card, &it, &sk) == SC_SUCCESS) {
+		while ((obj = sc_pkcs15_iter_next(&it)) != NULL) {
+			const sc_path_t *path = NULL;
+
+			switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+			case SC_PKCS15_TYPE_CERT: {
+				struct sc_pkcs15_cert_info *info = (struct sc_pkcs15_cert_info *) obj->data;
+
+				if (!(info->value.len && info->value.value))
+					path = &info->path;
+				break;
+			}
+			case SC_PKCS15_TYPE_PUBKEY: {
+				struct sc_pkcs15_pubkey_info *info = (struct sc_pkcs15_pubkey_info *) obj->data;
+
+				if (!(obj->flags & SC_PKCS15_CO_FLAG_PRIVATE) && !obj->content.value)
+					path = &info->path;
+				break;
+			}
+			case SC_PKCS15_TYPE_DATA_OBJECT: {
+				struct sc_pkcs15_data_info *info = (struct sc_pkcs15_data_info *) obj->data;
+
+				if (!(obj->flags & SC_PKCS15_CO_FLAG_PRIVATE) && !info->data.value)
+					path = &info->path;
+				break;
+			}
+			}
+			if (path != NULL)
+				files += warm_file(p15card, path);
+		}
+	}
+
+	if (verbose)
+		printf("  %s: %d file(s) added to the cache\n",
+				p15card->tokeninfo->label ? p15card->tokeninfo->label : "(no label)", files);
+	sc_pkcs15_unbind(p15card);
+}
+
+static void warm_card(sc_reader_t *reader)
+{
+	sc_card_t *card = NULL;
+	int r, i;
+
+	if (opt_reader && !strstr(reader->name, opt_reader))
+		return;
+	if (verbose)
+		printf("Warming the card in %s\n", reader->name);
+
+	/* the driver of the ATR is cached by the connect */
+	r = sc_connect_card(reader, &card);
+	if (r != SC_SUCCESS) {
+		util_warn("%s: cannot connect the card: %s", reader->name, sc_strerror(r));
+		return;
+	}
+
+	if (card->app_count < 0)
+		sc_enum_apps(card);
+	if (card->app_count > 0)
+		for (i = 0; i < card->app_count; i++)
+			warm_application(card, &card->app[i]->aid);
+	else
+		warm_application(card, NULL);
+
+	/* the card drivers store what they cache on their own at the release */
+	sc_disconnect_card(card);
+}
+
+int main(int argc, char * const argv[])
+{
+	sc_context_param_t ctx_param;
+	sc_reader_t *found;
+	unsigned int event, i;
+	int r, c, long_optind = 0;
+
+	while (1) {
+		c = getopt_long(argc, argv, "r:1v", options, &long_optind);
+		if (c == -1)
+			break;
+		if (c == '?')
+			util_print_usage_and_die(app_name, options, option_help, NULL);
+		switch (c) {
+		case 'r':
+			opt_reader = optarg;
+			break;
+		case '1':
+			opt_once = 1;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		}
+	}
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.app_name = app_name;
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Failed to establish context: %s\n", sc_strerror(r));
+		return 1;
+	}
+	if (verbose > 1 && ctx->debug == 0) {
+		ctx->debug = verbose;
+		sc_ctx_log_to_file(ctx, "stderr");
+	}
+
+	for (i = 0; i < sc_ctx_get_reader_count(ctx); i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(ctx, i);
+
+		if (sc_detect_card_presence(reader) > 0)
+			warm_card(reader);
+	}
+
+	while (!opt_once) {
+		r = sc_wait_for_event(ctx, SC_EVENT_CARD_INSERTED | SC_EVENT_READER_ATTACHED,
+				&found, &event, -1, NULL);
+		if (r < 0) {
+			fprintf(stderr, "Error while waiting for a card: %s\n", sc_strerror(r));
+			break;
+		}
+		if (event & SC_EVENT_READER_ATTACHED)
+			sc_ctx_detect_readers(ctx);
+		if ((event & SC_EVENT_CARD_INSERTED) && found != NULL)
+			warm_card(found);
+	}
+
+	sc_release_context(ctx);
+	return r < 0 ? 1 : 0;
+}
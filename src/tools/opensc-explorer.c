@@ -21,9 +21,16 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
 #ifdef ENABLE_READLINE
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -54,7 +61,7 @@ typedef struct _id2str {
 
 static const char *app_name = "opensc-explorer";
 
-static int opt_wait = 0, verbose = 0;
+static int opt_wait = 0, opt_batch = 0, verbose = 0;
 static const char *opt_driver = NULL;
 static const char *opt_reader = NULL;
 static const char *opt_startfile = NULL;
@@ -69,6 +76,7 @@ static const struct option options[] = {
 	{ "card-driver",	1, NULL, 'c' },
 	{ "mf",			1, NULL, 'm' },
 	{ "wait",		0, NULL, 'w' },
+	{ "batch",		0, NULL, 'b' },
 	{ "verbose",		0, NULL, 'v' },
 	{ NULL, 0, NULL, 0 }
 };
@@ -77,6 +85,7 @@ static const char *option_help[] = {
 	"Forces the use of driver <arg> [auto-detect]",
 	"Selects path <arg> on start-up, or none if empty [3F00]",
 	"Wait for card insertion",
+	"Run SCRIPT non-interactively, stopping at the first failing command",
 	"Verbose operation. Use several times to enable debug output.",
 };
 
@@ -95,6 +104,7 @@ static int do_verify(int argc, char **argv);
 static int do_change(int argc, char **argv);
 static int do_unblock(int argc, char **argv);
 static int do_get(int argc, char **argv);
+static int do_dump_tree(int argc, char **argv);
 static int do_update_binary(int argc, char **argv);
 static int do_update_record(int argc, char **argv);
 static int do_put(int argc, char **argv);
@@ -163,6 +173,9 @@ static struct command	cmds[] = {
 	{ do_get,
 		"get",	"<file id> [<output file>]",
 		"copy an EF to a local file"		},
+	{ do_dump_tree,
+		"dump_tree",	"[<output dir>]",
+		"copy all files below the current DF to a local directory" },
 	{ do_get_data,
 		"do_get",	"<hex tag> [<output file>]",
 		"get a data object"			},
@@ -329,6 +342,31 @@ arg_to_fid(const char *arg, u8 *fid)
 }
 
 
+static int
+child_path(const sc_path_t *parent, const u8 *fid, sc_path_t *path)
+{
+	*path = *parent;
+	if (path->type == SC_PATH_TYPE_DF_NAME)   {
+		if (path->len > sizeof(path->aid.value))   {
+			printf("Invalid length of DF_NAME path\n");
+			return -1;
+		}
+
+		memcpy(path->aid.value, path->value, path->len);
+		path->aid.len = path->len;
+
+		path->type = SC_PATH_TYPE_FILE_ID;
+		path->len = 0;
+	}
+	if (sc_append_path_id(path, fid, 2) != SC_SUCCESS)   {
+		printf("Path too long\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
 static int
 arg_to_path(const char *arg, sc_path_t *path, int is_id)
 {
@@ -356,20 +394,7 @@ arg_to_path(const char *arg, sc_path_t *path, int is_id)
 			memcpy(path->value, cbuf, 2);
 			path->type = (is_id) ? SC_PATH_TYPE_FILE_ID : SC_PATH_TYPE_PATH;
 		} else {
-			*path = current_path;
-			if (path->type == SC_PATH_TYPE_DF_NAME)   {
-				if (path->len > sizeof(path->aid.value))   {
-					printf("Invalid length of DF_NAME path\n");
-					return -1;
-				}
-
-				memcpy(path->aid.value, path->value, path->len);
-				path->aid.len = path->len;
-
-				path->type = SC_PATH_TYPE_FILE_ID;
-				path->len = 0;
-			}
-			sc_append_path_id(path, cbuf, 2);
+			return child_path(&current_path, cbuf, path);
 		}
 	}
 
@@ -1238,6 +1263,197 @@ err:
 	return -err;
 }
 
+/* Statistics of do_dump_tree() */
+struct dump_stats {
+	unsigned int	dfs, efs, failed;
+	size_t		bytes;
+};
+
+static int compare_fid(const void *a, const void *b)
+{
+	return memcmp(a, b, 2);
+}
+
+static int make_dir(const char *name)
+{
+#ifdef _WIN32
+	if (mkdir(name) < 0 && errno != EEXIST) {
+#else
+	if (mkdir(name, 0755) < 0 && errno != EEXIST) {
+#endif
+		perror(name);
+		return -1;
+	}
+	return 0;
+}
+
+static int write_dump_file(const char *name, const u8 *buf, size_t len)
+{
+	FILE *outf;
+
+	outf = fopen(name, "wb");
+	if (outf == NULL) {
+		perror(name);
+		return -1;
+	}
+	if (len)
+		fwrite(buf, len, 1, outf);
+	fclose(outf);
+	return 0;
+}
+
+/* Copy the selected EF to the local file <name>, or to <name>.<n>
+ * for every record of a record structured EF */
+static int dump_ef(sc_file_t *file, const char *name, struct dump_stats *stats)
+{
+	char recname[PATH_MAX + 16];
+	u8 *buf = NULL;
+	int r = 0, rec;
+
+	if (file->type != SC_FILE_TYPE_WORKING_EF) {
+		printf("%s: skipped, not a working EF\n", name);
+		return 0;
+	}
+
+	switch (file->ef_structure) {
+	case SC_FILE_EF_TRANSPARENT:
+		if (file->size) {
+			buf = malloc(file->size);
+			if (buf == NULL)
+				return -1;
+			r = sc_read_binary(card, 0, buf, file->size, 0);
+			if (r < 0) {
+				printf("%s: read failed: %s\n", name, sc_strerror(r));
+				free(buf);
+				return -1;
+			}
+		}
+		stats->bytes += r;
+		r = write_dump_file(name, buf, r);
+		free(buf);
+		return r;
+	case SC_FILE_EF_LINEAR_FIXED:
+	case SC_FILE_EF_LINEAR_FIXED_TLV:
+	case SC_FILE_EF_LINEAR_VARIABLE:
+	case SC_FILE_EF_LINEAR_VARIABLE_TLV:
+	case SC_FILE_EF_CYCLIC:
+	case SC_FILE_EF_CYCLIC_TLV:
+		buf = malloc(256);
+		if (buf == NULL)
+			return -1;
+		for (rec = 1; ; rec++) {
+			r = sc_read_record(card, rec, buf, 256, SC_RECORD_BY_REC_NR);
+			if (r == SC_ERROR_RECORD_NOT_FOUND) {
+				r = 0;
+				break;
+			}
+			if (r < 0) {
+				printf("%s: read of record %d failed: %s\n", name, rec, sc_strerror(r));
+				break;
+			}
+			snprintf(recname, sizeof(recname), "%s.%d", name, rec);
+			stats->bytes += r;
+			if ((r = write_dump_file(recname, buf, r)) < 0)
+				break;
+		}
+		free(buf);
+		return r < 0 ? -1 : 0;
+	default:
+		printf("%s: skipped, unknown EF structure\n", name);
+		return 0;
+	}
+}
+
+/* Walk the DF at <df_path>, which is selected, depth-first in file ID order.
+ * Files are selected by file ID relative to the DF, so only the return
+ * from a child DF costs an extra SELECT */
+static int dump_df(const sc_path_t *df_path, const char *dirname, struct dump_stats *stats)
+{
+	u8 fids[256];
+	char name[PATH_MAX];
+	sc_path_t path;
+	sc_file_t *file;
+	int r, i, count;
+
+	r = sc_list_files(card, fids, sizeof(fids));
+	if (r < 0) {
+		printf("%s: unable to receive file listing: %s\n", dirname, sc_strerror(r));
+		stats->failed++;
+		return 0;
+	}
+	count = r / 2;
+	qsort(fids, count, 2, compare_fid);
+
+	for (i = 0; i < count; i++) {
+		const u8 *fid = fids + 2 * i;
+
+		snprintf(name, sizeof(name), "%s/%02X%02X", dirname, fid[0], fid[1]);
+		if (sc_path_set(&path, SC_PATH_TYPE_FILE_ID, fid, 2, 0, 0) != SC_SUCCESS)
+			return -1;
+		r = sc_select_file(card, &path, &file);
+		if (r) {
+			printf("%s: unable to select file: %s\n", name, sc_strerror(r));
+			stats->failed++;
+			continue;
+		}
+
+		if (file->type == SC_FILE_TYPE_DF) {
+			sc_path_t sub_path;
+
+			stats->dfs++;
+			r = child_path(df_path, fid, &sub_path);
+			if (r == 0)
+				r = make_dir(name);
+			if (r == 0)
+				r = dump_df(&sub_path, name, stats);
+			sc_file_free(file);
+			if (r < 0)
+				return r;
+
+			r = sc_select_file(card, df_path, NULL);
+			if (r) {
+				printf("%s: unable to select DF again: %s\n", dirname, sc_strerror(r));
+				return -1;
+			}
+		}
+		else {
+			stats->efs++;
+			if (dump_ef(file, name, stats) < 0)
+				stats->failed++;
+			sc_file_free(file);
+		}
+	}
+	return 0;
+}
+
+static int do_dump_tree(int argc, char **argv)
+{
+	struct dump_stats stats;
+	const char *dirname;
+	int r;
+
+	if (argc > 1)
+		return usage(do_dump_tree);
+	dirname = argc ? argv[0] : path_to_filename(&current_path, '_');
+	if (*dirname == '\0')
+		dirname = "dump";
+
+	if (make_dir(dirname) < 0)
+		return -1;
+
+	memset(&stats, 0, sizeof(stats));
+	r = dump_df(&current_path, dirname, &stats);
+	select_current_path_or_die();
+
+	printf("%u DFs and %u EFs, %lu bytes, saved to %s", stats.dfs, stats.efs,
+		(unsigned long) stats.bytes, dirname);
+	if (stats.failed)
+		printf(", %u files could not be read", stats.failed);
+	printf(".\n");
+
+	return (r < 0 || stats.failed) ? -1 : 0;
+}
+
 static int do_update_binary(int argc, char **argv)
 {
 	u8 buf[240];
@@ -1794,7 +2010,7 @@ int main(int argc, char * const argv[])
 	printf("OpenSC Explorer version %s\n", sc_get_version());
 
 	while (1) {
-		c = getopt_long(argc, argv, "r:c:vwm:", options, &long_optind);
+		c = getopt_long(argc, argv, "r:c:vwbm:", options, &long_optind);
 		if (c == -1)
 			break;
 		if (c == '?')
@@ -1809,6 +2025,9 @@ int main(int argc, char * const argv[])
 		case 'w':
 			opt_wait = 1;
 			break;
+		case 'b':
+			opt_batch = 1;
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -1907,8 +2126,14 @@ int main(int argc, char * const argv[])
 		cmd = ambiguous_match(cmds, cargv[0]);
 		if (cmd == NULL) {
 			do_help(0, NULL);
+			r = -1;
 		} else {
-			cmd->func(cargc-1, cargv+1);
+			r = cmd->func(cargc-1, cargv+1);
+		}
+		if (r && opt_batch) {
+			fprintf(stderr, "Command '%s' failed, stopping.\n", cargv[0]);
+			err = 1;
+			break;
 		}
 	}
 end:
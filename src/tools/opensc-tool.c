@@ -28,6 +28,7 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <time.h>
 #include <sys/stat.h>
 
 #include "libopensc/opensc.h"
@@ -50,7 +51,9 @@ static int	verbose = 0;
 
 enum {
 	OPT_SERIAL = 0x100,
-	OPT_LIST_ALG
+	OPT_LIST_ALG,
+	OPT_STATS,
+	OPT_DECODE_TRACE
 };
 
 static const struct option options[] = {
@@ -67,6 +70,8 @@ static const struct option options[] = {
 	{ "reader",		1, NULL,		'r' },
 	{ "card-driver",	1, NULL,		'c' },
 	{ "list-algorithms",    0, NULL,	OPT_LIST_ALG },
+	{ "stats",		0, NULL,	OPT_STATS },
+	{ "decode-trace",	1, NULL,	OPT_DECODE_TRACE },
 	{ "wait",		0, NULL,		'w' },
 	{ "verbose",		0, NULL,		'v' },
 	{ NULL, 0, NULL, 0 }
@@ -86,6 +91,8 @@ static const char *option_help[] = {
 	"Uses reader number <arg> [0]",
 	"Forces the use of driver <arg> [auto-detect]",
 	"Lists algorithms supported by card",
+	"Prints the APDU statistics of the reader at the end",
+	"Prints the APDUs of the binary trace file <arg> as text",
 	"Wait for a card to be inserted",
 	"Verbose operation. Use several times to enable debug output.",
 };
@@ -539,6 +546,181 @@ static void print_serial(sc_card_t *in_card)
 		util_hex_dump_asc(stdout, serial.value, serial.len, -1);
 }
 
+static void print_transmit_counter(const char *label, const struct sc_transmit_counter *c)
+{
+	int i, last = -1;
+
+	printf("%-10s %8lu APDUs, %6lu errors, %10llu bytes sent, %10llu bytes received, %8llu us avg\n",
+		label, c->count, c->errors, c->bytes_sent, c->bytes_received,
+		c->count ? c->time_us / c->count : 0);
+	if (!verbose)
+		return;
+	for (i = 0; i < SC_TRANSMIT_STATS_BUCKETS; i++)
+		if (c->histogram[i])
+			last = i;
+	for (i = 0; i <= last; i++)
+		printf("           < %10lu us: %lu\n", 2UL << i, c->histogram[i]);
+}
+
+static int print_transmit_stats(void)
+{
+	struct sc_transmit_stats stats;
+	char label[16];
+	size_t i;
+	int r;
+
+	r = sc_get_transmit_stats(card->reader, &stats);
+	if (r) {
+		fprintf(stderr, "Failed to get APDU statistics: %s\n", sc_strerror(r));
+		return 1;
+	}
+	printf("APDU statistics for reader %s:\n", card->reader->name);
+	print_transmit_counter("total", &stats.total);
+	for (i = 0; i < stats.ins_count; i++) {
+		snprintf(label, sizeof(label), "%02X %02X", stats.ins[i].cla, stats.ins[i].ins);
+		print_transmit_counter(label, &stats.ins[i].counter);
+	}
+	if (stats.ins_overflow)
+		printf("%lu APDUs with other CLA/INS not listed\n", stats.ins_overflow);
+	for (i = 0; i < SC_LOCK_PRIO_COUNT; i++) {
+		static const char *prio_names[SC_LOCK_PRIO_COUNT] = { "normal", "urgent", "bulk" };
+		const struct sc_transmit_counter *c = &stats.lock_wait[i];
+
+		if (c->count == 0)
+			continue;
+		printf("%-10s %8lu waits for the card, %8llu us avg\n",
+			prio_names[i], c->count, c->time_us / c->count);
+	}
+	return 0;
+}
+
+static int print_cache_stats(void)
+{
+	struct sc_cache_stats stats[SC_CACHE_STATS_MAX];
+	size_t count = SC_CACHE_STATS_MAX, i;
+	int r;
+
+	r = sc_get_cache_stats(ctx, stats, &count);
+	if (r) {
+		fprintf(stderr, "Failed to get cache statistics: %s\n", sc_strerror(r));
+		return 1;
+	}
+	if (count == 0)
+		return 0;
+	printf("Caches in memory:\n");
+	for (i = 0; i < count; i++)
+		printf("%-10s %8lu bytes, %6lu entries, %8lu hits, %8lu misses, %6lu evicted\n",
+			stats[i].name, (unsigned long) stats[i].bytes, stats[i].entries,
+			stats[i].hits, stats[i].misses, stats[i].evictions);
+	return 0;
+}
+
+static unsigned long long trace_get(const unsigned char *p, size_t n)
+{
+	unsigned long long x = 0;
+
+	while (n--)
+		x = (x << 8) | *p++;
+	return x;
+}
+
+static void trace_print_hex(const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		printf("%02X", p[i]);
+}
+
+static int decode_trace(const char *filename)
+{
+	FILE *f;
+	unsigned char *buf = NULL, *p, *end;
+	size_t len, rec_len, cmd_len, resp_len;
+	long size;
+	int r = 0;
+
+	f = fopen(filename, "rb");
+	if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0) {
+		fprintf(stderr, "Cannot open trace file '%s'\n", filename);
+		if (f)
+			fclose(f);
+		return 1;
+	}
+	rewind(f);
+	len = size;
+	buf = malloc(len ? len : 1);
+	if (buf == NULL || fread(buf, 1, len, f) != len) {
+		fprintf(stderr, "Cannot read trace file '%s'\n", filename);
+		fclose(f);
+		free(buf);
+		return 1;
+	}
+	fclose(f);
+
+	p = buf;
+	end = buf + len;
+	while (p + SC_APDU_TRACE_MAGIC_LEN <= end) {
+		if (memcmp(p, SC_APDU_TRACE_MAGIC, SC_APDU_TRACE_MAGIC_LEN) == 0) {
+			printf("# session at offset %lu\n", (unsigned long)(p - buf));
+			p += SC_APDU_TRACE_MAGIC_LEN;
+			continue;
+		}
+		rec_len = trace_get(p + 4, 4);
+		if (rec_len == 0) {
+			/* end of an interrupted session */
+			p += 8;
+			continue;
+		}
+		if (rec_len < SC_APDU_TRACE_HEADER_LEN || rec_len % 8 || rec_len > (size_t)(end - p)) {
+			fprintf(stderr, "Invalid record at offset %lu\n", (unsigned long)(p - buf));
+			r = 1;
+			break;
+		}
+
+		if (p[0] == SC_APDU_TRACE_READER) {
+			printf("# reader %u: %.*s\n", (unsigned int)trace_get(p + 2, 2),
+					(int)(rec_len - SC_APDU_TRACE_HEADER_LEN), p + SC_APDU_TRACE_HEADER_LEN);
+		}
+		else if (p[0] == SC_APDU_TRACE_ATR && rec_len > SC_APDU_TRACE_HEADER_LEN
+				&& p[SC_APDU_TRACE_HEADER_LEN] < rec_len - SC_APDU_TRACE_HEADER_LEN) {
+			printf("# reader %u ATR: ", (unsigned int)trace_get(p + 2, 2));
+			trace_print_hex(p + SC_APDU_TRACE_HEADER_LEN + 1, p[SC_APDU_TRACE_HEADER_LEN]);
+			printf("\n");
+		}
+		else if (p[0] == SC_APDU_TRACE_APDU && rec_len >= SC_APDU_TRACE_APDU_HEADER_LEN) {
+			unsigned long long start = trace_get(p + 8, 8);
+			time_t sec = (time_t)(start / 1000000);
+			int rv = (int)(unsigned int)trace_get(p + 20, 4);
+			char time_string[40];
+
+			cmd_len = trace_get(p + 26, 2);
+			resp_len = trace_get(p + 28, 4);
+			if (SC_APDU_TRACE_APDU_HEADER_LEN + cmd_len + resp_len > rec_len) {
+				fprintf(stderr, "Invalid record at offset %lu\n", (unsigned long)(p - buf));
+				r = 1;
+				break;
+			}
+			strftime(time_string, sizeof(time_string), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+			printf("%s.%06lu %u %luus > ", time_string, (unsigned long)(start % 1000000),
+					(unsigned int)trace_get(p + 2, 2), (unsigned long)trace_get(p + 16, 4));
+			trace_print_hex(p + SC_APDU_TRACE_APDU_HEADER_LEN, cmd_len);
+			if (rv < 0) {
+				printf(" error %d (%s)\n", rv, sc_strerror(rv));
+			}
+			else {
+				printf(" < ");
+				trace_print_hex(p + SC_APDU_TRACE_APDU_HEADER_LEN + cmd_len, resp_len);
+				printf("%s%04X\n", resp_len ? " " : "", (unsigned int)trace_get(p + 24, 2));
+			}
+		}
+		p += rec_len;
+	}
+
+	free(buf);
+	return r;
+}
+
 static int list_algorithms(void)
 {
 	int i;
@@ -653,8 +835,10 @@ int main(int argc, char * const argv[])
 	int do_print_serial = 0;
 	int do_print_name = 0;
 	int do_list_algorithms = 0;
+	int do_print_stats = 0;
 	int action_count = 0;
 	const char *opt_driver = NULL;
+	const char *opt_trace = NULL;
 	const char *opt_conf_entry = NULL;
 	char **p;
 	sc_context_param_t ctx_param;
@@ -738,6 +922,14 @@ int main(int argc, char * const argv[])
 			do_list_algorithms = 1;
 			action_count++;
 			break;
+		case OPT_STATS:
+			do_print_stats = 1;
+			action_count++;
+			break;
+		case OPT_DECODE_TRACE:
+			opt_trace = optarg;
+			action_count++;
+			break;
 		}
 	}
 	if (action_count == 0)
@@ -747,6 +939,10 @@ int main(int argc, char * const argv[])
 		opensc_info();
 		action_count--;
 	}
+	if (opt_trace) {
+		if ((err = decode_trace(opt_trace)) || --action_count == 0)
+			return err;
+	}
 
 	memset(&ctx_param, 0, sizeof(ctx_param));
 	ctx_param.ver      = 0;
@@ -841,6 +1037,12 @@ int main(int argc, char * const argv[])
 			goto end;
 		action_count--;
 	}
+
+	if (do_print_stats) {
+		if ((err = print_transmit_stats()) || (err = print_cache_stats()))
+			goto end;
+		action_count--;
+	}
 end:
 	if (card) {
 		sc_unlock(card);
@@ -24,6 +24,10 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#include <sys/time.h>
+#endif
 #ifdef ENABLE_OPENSSL
 #include <openssl/opensslv.h>
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
@@ -55,6 +59,11 @@ extern CK_RV C_UnloadModule(void *module);
 #define NEED_SESSION_RO	0x01
 #define NEED_SESSION_RW	0x02
 
+#define BENCH_SIGN	1
+#define BENCH_DECRYPT	2
+#define BENCH_DIGEST	3
+#define BENCH_FIND	4
+
 static struct ec_curve_info {
 	const char *name;
 	const char *oid;
@@ -102,7 +111,12 @@ enum {
 	OPT_NEW_PIN,
 	OPT_LOGIN_TYPE,
 	OPT_TEST_EC,
-	OPT_DERIVE
+	OPT_DERIVE,
+	OPT_BENCHMARK,
+	OPT_THREADS,
+	OPT_DURATION,
+	OPT_DATA_SIZE,
+	OPT_BENCHMARK_ALL_SLOTS
 };
 
 static const struct option options[] = {
@@ -158,6 +172,11 @@ static const struct option options[] = {
 	{ "verbose",		0, NULL,		'v' },
 	{ "private",		0, NULL,		OPT_PRIVATE },
 	{ "test-ec",		0, NULL,		OPT_TEST_EC },
+	{ "benchmark",		1, NULL,		OPT_BENCHMARK },
+	{ "threads",		1, NULL,		OPT_THREADS },
+	{ "duration",		1, NULL,		OPT_DURATION },
+	{ "data-size",		1, NULL,		OPT_DATA_SIZE },
+	{ "benchmark-all-slots",0, NULL,		OPT_BENCHMARK_ALL_SLOTS },
 
 	{ NULL, 0, NULL, 0 }
 };
@@ -214,7 +233,12 @@ static const char *option_help[] = {
 	"Test Mozilla-like keypair gen and cert req, <arg>=certfile",
 	"Verbose operation. (Set OPENSC_DEBUG to enable OpenSC specific debugging)",
 	"Set the CKA_PRIVATE attribute (object is only viewable after a login)",
-	"Test EC (best used with the --login or --pin option)"
+	"Test EC (best used with the --login or --pin option)",
+	"Measure the throughput of 'sign', 'decrypt', 'digest' or 'find' (use with --mechanism and --id)",
+	"Number of threads, each with its own session, for --benchmark (default: 1)",
+	"Seconds to run --benchmark for (default: 10)",
+	"Size of the data to sign or digest with --benchmark, unless --input-file is given (default: 32)",
+	"Spread the --benchmark threads over all slots with a token"
 };
 
 static const char *	app_name = "pkcs11-tool"; /* for utils.c */
@@ -253,6 +277,10 @@ static int		opt_login_type = -1;
 static int		opt_key_usage_sign = 0;
 static int		opt_key_usage_decrypt = 0;
 static int		opt_key_usage_nonrepudiation = 0;
+static int		opt_threads = 1;
+static int		opt_duration = 10;
+static size_t		opt_data_size = 32;
+static int		opt_benchmark_all_slots = 0;
 
 static void *module = NULL;
 static CK_FUNCTION_LIST_PTR p11 = NULL;
@@ -345,6 +373,7 @@ static CK_MECHANISM_TYPE p11_name_to_mechanism(const char *);
 static void		p11_perror(const char *, CK_RV);
 static const char *	CKR2Str(CK_ULONG res);
 static int		p11_test(CK_SESSION_HANDLE session);
+static int		benchmark(CK_SESSION_HANDLE session, int op);
 static int test_card_detection(int);
 static int		hex_to_bin(const char *in, CK_BYTE *out, size_t *outlen);
 static void		test_kpgen_certwrite(CK_SLOT_ID slot, CK_SESSION_HANDLE session);
@@ -379,6 +408,7 @@ int main(int argc, char * argv[])
 	int do_test = 0;
 	int do_test_kpgen_certwrite = 0;
 	int do_test_ec = 0;
+	int do_benchmark = 0;
 	int need_session = 0;
 	int opt_login = 0;
 	int do_init_token = 0;
@@ -386,6 +416,7 @@ int main(int argc, char * argv[])
 	int do_change_pin = 0;
 	int do_unlock_pin = 0;
 	int action_count = 0;
+	CK_C_INITIALIZE_ARGS init_args;
 	CK_RV rv;
 
 #ifdef _WIN32
@@ -641,6 +672,38 @@ int main(int argc, char * argv[])
 			do_derive = 1;
 			action_count++;
 			break;
+		case OPT_BENCHMARK:
+			if (!strcmp(optarg, "sign"))
+				do_benchmark = BENCH_SIGN;
+			else if (!strcmp(optarg, "decrypt"))
+				do_benchmark = BENCH_DECRYPT;
+			else if (!strcmp(optarg, "digest"))
+				do_benchmark = BENCH_DIGEST;
+			else if (!strcmp(optarg, "find"))
+				do_benchmark = BENCH_FIND;
+			else {
+				printf("Unsupported benchmark \"%s\"\n", optarg);
+				util_print_usage_and_die(app_name, options, option_help, NULL);
+			}
+			need_session |= NEED_SESSION_RO;
+			action_count++;
+			break;
+		case OPT_THREADS:
+			opt_threads = atoi(optarg);
+			if (opt_threads < 1)
+				util_fatal("Invalid number of threads \"%s\"", optarg);
+			break;
+		case OPT_DURATION:
+			opt_duration = atoi(optarg);
+			if (opt_duration < 1)
+				util_fatal("Invalid duration \"%s\"", optarg);
+			break;
+		case OPT_DATA_SIZE:
+			opt_data_size = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_BENCHMARK_ALL_SLOTS:
+			opt_benchmark_all_slots = 1;
+			break;
 		default:
 			util_print_usage_and_die(app_name, options, option_help, NULL);
 		}
@@ -656,7 +719,10 @@ int main(int argc, char * argv[])
 	if (module == NULL)
 		util_fatal("Failed to load pkcs11 module");
 
-	rv = p11->C_Initialize(NULL);
+	/* the benchmark calls the module from several threads at once */
+	memset(&init_args, 0, sizeof(init_args));
+	init_args.flags = CKF_OS_LOCKING_OK;
+	rv = p11->C_Initialize(do_benchmark ? &init_args : NULL);
 	if (rv == CKR_CRYPTOKI_ALREADY_INITIALIZED)
 		printf("\n*** Cryptoki library has already been initialized ***\n");
 	else if (rv != CKR_OK)
@@ -732,7 +798,7 @@ int main(int argc, char * argv[])
 	if (do_list_mechs)
 		list_mechs(opt_slot);
 
-	if (do_sign) {
+	if (do_sign || do_benchmark == BENCH_SIGN || do_benchmark == BENCH_DECRYPT) {
 		CK_TOKEN_INFO	info;
 
 		get_token_info(opt_slot, &info);
@@ -857,6 +923,9 @@ int main(int argc, char * argv[])
 
 	if (do_test_ec)
 		test_ec(opt_slot, session);
+
+	if (do_benchmark)
+		err = benchmark(session, do_benchmark);
 end:
 	if (session != CK_INVALID_HANDLE) {
 		rv = p11->C_CloseSession(session);
@@ -4130,6 +4199,300 @@ static int p11_test(CK_SESSION_HANDLE session)
 	return errors;
 }
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+/* --benchmark: every thread opens its own session, waits until all threads
+ * are ready and then repeats the operation until the deadline, recording
+ * the latency of every call. */
+struct bench_thread {
+	pthread_t	thread;
+	CK_SLOT_ID	slot;
+	unsigned int	*latencies;	/* in microseconds */
+	size_t		count, alloc;
+	unsigned long	errors;
+	CK_RV		first_error;
+};
+
+static int		bench_op;
+static CK_MECHANISM	bench_mech;
+static CK_BYTE		*bench_data;
+static CK_ULONG		bench_data_len;
+static unsigned long long bench_deadline;
+static int		bench_ready;
+static pthread_mutex_t	bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	bench_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned long long bench_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static CK_RV bench_call(CK_SESSION_HANDLE sess, CK_OBJECT_HANDLE key)
+{
+	CK_BYTE		out[1024];
+	CK_ULONG	out_len = sizeof(out);
+	CK_OBJECT_CLASS	cls = CKO_PRIVATE_KEY;
+	CK_ATTRIBUTE	attrs[2];
+	CK_OBJECT_HANDLE obj;
+	CK_RV		rv;
+
+	switch (bench_op) {
+	case BENCH_SIGN:
+		rv = p11->C_SignInit(sess, &bench_mech, key);
+		if (rv == CKR_OK)
+			rv = p11->C_Sign(sess, bench_data, bench_data_len, out, &out_len);
+		return rv;
+	case BENCH_DECRYPT:
+		rv = p11->C_DecryptInit(sess, &bench_mech, key);
+		if (rv == CKR_OK)
+			rv = p11->C_Decrypt(sess, bench_data, bench_data_len, out, &out_len);
+		return rv;
+	case BENCH_DIGEST:
+		rv = p11->C_DigestInit(sess, &bench_mech);
+		if (rv == CKR_OK)
+			rv = p11->C_Digest(sess, bench_data, bench_data_len, out, &out_len);
+		return rv;
+	default:
+		attrs[0].type = CKA_CLASS;
+		attrs[0].pValue = &cls;
+		attrs[0].ulValueLen = sizeof(cls);
+		attrs[1].type = CKA_ID;
+		attrs[1].pValue = opt_object_id;
+		attrs[1].ulValueLen = opt_object_id_len;
+		rv = p11->C_FindObjectsInit(sess, attrs, opt_object_id_len ? 2 : 1);
+		if (rv != CKR_OK)
+			return rv;
+		rv = p11->C_FindObjects(sess, &obj, 1, &out_len);
+		p11->C_FindObjectsFinal(sess);
+		if (rv == CKR_OK && out_len == 0)
+			rv = CKR_KEY_HANDLE_INVALID;
+		return rv;
+	}
+}
+
+static void *bench_thread_main(void *arg)
+{
+	struct bench_thread *t = arg;
+	CK_SESSION_HANDLE sess = CK_INVALID_HANDLE;
+	CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+	unsigned long long start, end;
+	CK_RV rv;
+
+	rv = p11->C_OpenSession(t->slot, CKF_SERIAL_SESSION, NULL, NULL, &sess);
+	if (rv == CKR_OK && (bench_op == BENCH_SIGN || bench_op == BENCH_DECRYPT)
+			&& !find_object(sess, CKO_PRIVATE_KEY, &key,
+				opt_object_id_len ? opt_object_id : NULL, opt_object_id_len, 0))
+		rv = CKR_KEY_HANDLE_INVALID;
+
+	pthread_mutex_lock(&bench_mutex);
+	bench_ready++;
+	pthread_cond_broadcast(&bench_cond);
+	while (bench_deadline == 0)
+		pthread_cond_wait(&bench_cond, &bench_mutex);
+	pthread_mutex_unlock(&bench_mutex);
+
+	if (rv != CKR_OK) {
+		t->errors++;
+		t->first_error = rv;
+		goto out;
+	}
+
+	while ((start = bench_now()) < bench_deadline) {
+		rv = bench_call(sess, key);
+		end = bench_now();
+		if (rv != CKR_OK) {
+			if (t->errors++ == 0)
+				t->first_error = rv;
+			continue;
+		}
+		if (t->count == t->alloc) {
+			size_t alloc = t->alloc ? 2 * t->alloc : 1024;
+			unsigned int *tmp = realloc(t->latencies, alloc * sizeof(*tmp));
+
+			if (tmp == NULL)
+				break;
+			t->latencies = tmp;
+			t->alloc = alloc;
+		}
+		t->latencies[t->count++] = (unsigned int) (end - start);
+	}
+out:
+	if (sess != CK_INVALID_HANDLE)
+		p11->C_CloseSession(sess);
+	return NULL;
+}
+
+static int cmp_latency(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(const unsigned int *sorted, size_t count, int p)
+{
+	size_t idx = (count * p + 99) / 100;
+
+	return count ? sorted[idx ? idx - 1 : 0] / 1000.0 : 0;
+}
+
+static int benchmark(CK_SESSION_HANDLE session, int op)
+{
+	CK_SLOT_ID slots[64];
+	CK_SESSION_HANDLE login_sessions[64];
+	CK_ULONG num_slots = 0, i;
+	CK_OBJECT_HANDLE key;
+	struct bench_thread *threads;
+	unsigned int *all;
+	size_t total = 0, n;
+	unsigned long errors = 0;
+	unsigned long long begin;
+	double elapsed;
+	int t, r;
+	CK_RV rv;
+
+	slots[num_slots++] = opt_slot;
+	if (opt_benchmark_all_slots) {
+		CK_SLOT_ID used_slot = opt_slot;
+
+		for (i = 0; i < p11_num_slots && num_slots < 64; i++) {
+			CK_SLOT_INFO info;
+
+			if (p11_slots[i] == used_slot
+					|| p11->C_GetSlotInfo(p11_slots[i], &info) != CKR_OK
+					|| !(info.flags & CKF_TOKEN_PRESENT))
+				continue;
+			/* log in to every other token once, as for the first one */
+			rv = p11->C_OpenSession(p11_slots[i], CKF_SERIAL_SESSION, NULL, NULL,
+					&login_sessions[num_slots]);
+			if (rv != CKR_OK)
+				p11_fatal("C_OpenSession", rv);
+			opt_slot = p11_slots[i];
+			if (op != BENCH_DIGEST && login(login_sessions[num_slots], CKU_USER) != 0)
+				util_fatal("Cannot log in to slot 0x%lx", p11_slots[i]);
+			slots[num_slots++] = p11_slots[i];
+		}
+		opt_slot = used_slot;
+	}
+
+	bench_op = op;
+	memset(&bench_mech, 0, sizeof(bench_mech));
+	if (opt_mechanism_used)
+		bench_mech.mechanism = opt_mechanism;
+	else if (op == BENCH_SIGN && !find_mechanism(opt_slot, CKF_SIGN|CKF_HW, NULL, 0, &bench_mech.mechanism))
+		util_fatal("Sign mechanism not supported\n");
+	else if (op == BENCH_DECRYPT && !find_mechanism(opt_slot, CKF_DECRYPT|CKF_HW, NULL, 0, &bench_mech.mechanism))
+		util_fatal("Decrypt mechanism not supported\n");
+	else if (op == BENCH_DIGEST)
+		bench_mech.mechanism = CKM_SHA_1;
+
+	if (opt_input) {
+		FILE *f = fopen(opt_input, "rb");
+		long size = -1;
+
+		if (f != NULL && fseek(f, 0, SEEK_END) == 0)
+			size = ftell(f);
+		if (size < 0)
+			util_fatal("Cannot read %s", opt_input);
+		rewind(f);
+		bench_data_len = size;
+		bench_data = malloc(size ? size : 1);
+		if (bench_data == NULL || fread(bench_data, 1, size, f) != (size_t) size)
+			util_fatal("Cannot read %s", opt_input);
+		fclose(f);
+	}
+	else if (op == BENCH_DECRYPT) {
+		/* any value below the modulus decrypts without padding */
+		if (bench_mech.mechanism != CKM_RSA_X_509)
+			util_fatal("Decryption with %s needs a cryptogram from --input-file",
+					p11_mechanism_to_name(bench_mech.mechanism));
+		if (!find_object(session, CKO_PRIVATE_KEY, &key,
+				opt_object_id_len ? opt_object_id : NULL, opt_object_id_len, 0))
+			util_fatal("Private key not found");
+		bench_data_len = (get_private_key_length(session, key) + 7) / 8;
+		if (bench_data_len == 0)
+			util_fatal("Cannot get the length of the key");
+		bench_data = calloc(1, bench_data_len);
+		if (bench_data == NULL)
+			util_fatal("Out of memory");
+		memset(bench_data + 1, 0x5A, bench_data_len - 1);
+	}
+	else {
+		bench_data_len = opt_data_size;
+		bench_data = malloc(bench_data_len ? bench_data_len : 1);
+		if (bench_data == NULL)
+			util_fatal("Out of memory");
+		for (n = 0; n < bench_data_len; n++)
+			bench_data[n] = (CK_BYTE) n;
+	}
+
+	if (op != BENCH_FIND)
+		printf("Using mechanism %s\n", p11_mechanism_to_name(bench_mech.mechanism));
+	printf("Running %d threads on %lu slots for %d seconds\n",
+			opt_threads, num_slots, opt_duration);
+
+	threads = calloc(opt_threads, sizeof(*threads));
+	if (threads == NULL)
+		util_fatal("Out of memory");
+	for (t = 0; t < opt_threads; t++) {
+		threads[t].slot = slots[t % num_slots];
+		r = pthread_create(&threads[t].thread, NULL, bench_thread_main, &threads[t]);
+		if (r != 0)
+			util_fatal("Cannot create thread: %s", strerror(r));
+	}
+
+	pthread_mutex_lock(&bench_mutex);
+	while (bench_ready < opt_threads)
+		pthread_cond_wait(&bench_cond, &bench_mutex);
+	begin = bench_now();
+	bench_deadline = begin + (unsigned long long) opt_duration * 1000000;
+	pthread_cond_broadcast(&bench_cond);
+	pthread_mutex_unlock(&bench_mutex);
+
+	for (t = 0; t < opt_threads; t++) {
+		pthread_join(threads[t].thread, NULL);
+		total += threads[t].count;
+		errors += threads[t].errors;
+		if (threads[t].errors)
+			fprintf(stderr, "Thread %d: %lu errors, first %s\n", t,
+					threads[t].errors, CKR2Str(threads[t].first_error));
+	}
+	elapsed = (bench_now() - begin) / 1000000.0;
+
+	all = malloc((total ? total : 1) * sizeof(*all));
+	if (all == NULL)
+		util_fatal("Out of memory");
+	for (n = 0, t = 0; t < opt_threads; t++) {
+		if (threads[t].count)
+			memcpy(all + n, threads[t].latencies, threads[t].count * sizeof(*all));
+		n += threads[t].count;
+		free(threads[t].latencies);
+	}
+	qsort(all, total, sizeof(*all), cmp_latency);
+
+	printf("%lu operations, %lu errors in %.2f s: %.1f ops/s\n",
+			(unsigned long) total, errors, elapsed, total / elapsed);
+	printf("Latency (ms): p50 %.2f, p95 %.2f, p99 %.2f, max %.2f\n",
+			bench_percentile(all, total, 50), bench_percentile(all, total, 95),
+			bench_percentile(all, total, 99), bench_percentile(all, total, 100));
+
+	for (i = 1; i < num_slots; i++)
+		p11->C_CloseSession(login_sessions[i]);
+	free(all);
+	free(threads);
+	free(bench_data);
+	return errors != 0 || total == 0;
+}
+#else
+static int benchmark(CK_SESSION_HANDLE session, int op)
+{
+	util_fatal("--benchmark needs POSIX threads");
+	return 1;
+}
+#endif
+
 /* Does about the same as Mozilla does when you go to an on-line CA
  * for obtaining a certificate: key pair generation, signing the
  * cert request + some other tests, writing certs and changing
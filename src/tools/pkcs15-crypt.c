@@ -45,6 +45,7 @@ static char * opt_reader;
 static char * opt_pincode = NULL, * opt_key_id = NULL;
 static char * opt_input = NULL, * opt_output = NULL;
 static char * opt_bind_to_aid = NULL;
+static char * opt_batch = NULL;
 static int opt_crypt_flags = 0;
 
 enum {
@@ -56,6 +57,7 @@ enum {
 	OPT_MD5,
 	OPT_PKCS1,
 	OPT_BIND_TO_AID,
+	OPT_BATCH,
 };
 
 static const struct option options[] = {
@@ -75,6 +77,7 @@ static const struct option options[] = {
 	{ "pkcs1",		0, NULL,		OPT_PKCS1 },
 	{ "pin",		1, NULL,		'p' },
 	{ "aid",		1, NULL,		OPT_BIND_TO_AID },
+	{ "batch",		1, NULL,		OPT_BATCH },
 	{ "wait",		0, NULL,		'w' },
 	{ "verbose",		0, NULL,		'v' },
 	{ NULL, 0, NULL, 0 }
@@ -97,6 +100,7 @@ static const char *option_help[] = {
 	"Use PKCS #1 v1.5 padding",
 	"Uses password (PIN) <arg> (use - for reading PIN from STDIN)",
 	"Specify AID of the on-card PKCS#15 application to be binded to (in hexadecimal form)",
+	"Reads lines of input and output file names from <arg> (- for STDIN) and processes them all in one card session",
 	"Wait for card insertion",
 	"Verbose operation. Use several times to enable debug output.",
 };
@@ -148,14 +152,14 @@ static char * get_pin(struct sc_pkcs15_object *obj)
 	}
 }
 
-static int read_input(u8 *buf, int buflen)
+static int read_input(const char *input, u8 *buf, int buflen)
 {
 	FILE *inf;
 	int c;
 
-	inf = fopen(opt_input, "rb");
+	inf = fopen(input, "rb");
 	if (inf == NULL) {
-		fprintf(stderr, "Unable to open '%s' for reading.\n", opt_input);
+		fprintf(stderr, "Unable to open '%s' for reading.\n", input);
 		return -1;
 	}
 	c = fread(buf, 1, buflen, inf);
@@ -167,15 +171,15 @@ static int read_input(u8 *buf, int buflen)
 	return c;
 }
 
-static int write_output(const u8 *buf, int len)
+static int write_output(const char *output, const u8 *buf, int len)
 {
 	FILE *outf;
-	int output_binary = (opt_output == NULL && opt_raw == 0 ? 0 : 1);
+	int output_binary = (output == NULL && opt_raw == 0 ? 0 : 1);
 
-	if (opt_output != NULL) {
-		outf = fopen(opt_output, "wb");
+	if (output != NULL) {
+		outf = fopen(output, "wb");
 		if (outf == NULL) {
-			fprintf(stderr, "Unable to open '%s' for writing.\n", opt_output);
+			fprintf(stderr, "Unable to open '%s' for writing.\n", output);
 			return -1;
 		}
 	} else {
@@ -190,18 +194,18 @@ static int write_output(const u8 *buf, int len)
 	return 0;
 }
 
-static int sign(struct sc_pkcs15_object *obj)
+static int sign(struct sc_pkcs15_object *obj, const char *input, const char *output)
 {
 	u8 buf[1024], out[1024];
 	struct sc_pkcs15_prkey_info *key = (struct sc_pkcs15_prkey_info *) obj->data;
 	int r, c, len;
 
-	if (opt_input == NULL) {
+	if (input == NULL) {
 		fprintf(stderr, "No input file specified.\n");
 		return 2;
 	}
 
-	c = read_input(buf, sizeof(buf));
+	c = read_input(input, buf, sizeof(buf));
 	if (c < 0)
 		return 2;
 	len = sizeof(out);
@@ -223,21 +227,21 @@ static int sign(struct sc_pkcs15_object *obj)
 		return 1;
 	}
 
-	r = write_output(out, r);
+	r = write_output(output, out, r);
 
 	return 0;
 }
 
-static int decipher(struct sc_pkcs15_object *obj)
+static int decipher(struct sc_pkcs15_object *obj, const char *input, const char *output)
 {
 	u8 buf[1024], out[1024];
 	int r, c, len;
 
-	if (opt_input == NULL) {
+	if (input == NULL) {
 		fprintf(stderr, "No input file specified.\n");
 		return 2;
 	}
-	c = read_input(buf, sizeof(buf));
+	c = read_input(input, buf, sizeof(buf));
 	if (c < 0)
 		return 2;
 
@@ -252,11 +256,59 @@ static int decipher(struct sc_pkcs15_object *obj)
 		fprintf(stderr, "Decrypt failed: %s\n", sc_strerror(r));
 		return 1;
 	}
-	r = write_output(out, r);
+	r = write_output(output, out, r);
 
 	return 0;
 }
 
+/* Every line of the batch file names an input and an output file, separated
+ * by blanks. The card stays locked for the whole batch, so the PIN is
+ * verified once and the security environment is set once for the key. */
+static int run_batch(struct sc_pkcs15_object *obj,
+		int (*op)(struct sc_pkcs15_object *, const char *, const char *))
+{
+	char line[2048], input[1024], output[1024];
+	unsigned long count = 0, failed = 0;
+	FILE *list;
+	int r;
+
+	if (strcmp(opt_batch, "-") == 0)
+		list = stdin;
+	else if ((list = fopen(opt_batch, "r")) == NULL) {
+		fprintf(stderr, "Unable to open '%s' for reading.\n", opt_batch);
+		return 2;
+	}
+
+	r = sc_lock(card);
+	if (r < 0) {
+		fprintf(stderr, "Unable to lock the card: %s\n", sc_strerror(r));
+		if (list != stdin)
+			fclose(list);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), list) != NULL) {
+		if (sscanf(line, "%1023s %1023s", input, output) != 2) {
+			if (sscanf(line, "%1023s", input) == 1 && input[0] != '#') {
+				fprintf(stderr, "No output file for '%s'.\n", input);
+				failed++;
+			}
+			continue;
+		}
+		count++;
+		if (op(obj, input, output) != 0) {
+			fprintf(stderr, "Failed to process '%s'.\n", input);
+			failed++;
+		}
+	}
+	sc_unlock(card);
+	if (list != stdin)
+		fclose(list);
+
+	if (verbose)
+		fprintf(stderr, "Processed %lu files, %lu failed.\n", count, failed);
+	return failed ? 1 : 0;
+}
+
 static int get_key(unsigned int usage, sc_pkcs15_object_t **result)
 {
 	sc_pkcs15_object_t *key, *pin;
@@ -389,6 +441,9 @@ int main(int argc, char * const argv[])
 		case OPT_BIND_TO_AID:
 			opt_bind_to_aid = optarg;
 			break;
+		case OPT_BATCH:
+			opt_batch = optarg;
+			break;
 		case 'w':
 			opt_wait = 1;
 			break;
@@ -445,7 +500,8 @@ int main(int argc, char * const argv[])
 
 	if (do_decipher) {
 		if ((err = get_key(SC_PKCS15_PRKEY_USAGE_DECRYPT, &key))
-		 || (err = decipher(key)))
+		 || (err = opt_batch ? run_batch(key, decipher)
+				 : decipher(key, opt_input, opt_output)))
 			goto end;
 		action_count--;
 	}
@@ -454,7 +510,8 @@ int main(int argc, char * const argv[])
 		if ((err = get_key(SC_PKCS15_PRKEY_USAGE_SIGN|
 				   SC_PKCS15_PRKEY_USAGE_SIGNRECOVER|
 				   SC_PKCS15_PRKEY_USAGE_NONREPUDIATION, &key))
-		 || (err = sign(key)))
+		 || (err = opt_batch ? run_batch(key, sign)
+				 : sign(key, opt_input, opt_output)))
 			goto end;
 		action_count--;
 	}
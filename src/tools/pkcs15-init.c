@@ -38,6 +38,11 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 #include <openssl/opensslv.h>
 #if OPENSSL_VERSION_NUMBER >= 0x00907000L
 #include <openssl/conf.h>
@@ -86,12 +91,12 @@ static int	do_change_attributes(struct sc_profile *, unsigned int myopt_type);
 static int	do_init_app(struct sc_profile *);
 static int	do_store_pin(struct sc_profile *);
 static int	do_generate_key(struct sc_profile *, const char *);
-static int	do_store_private_key(struct sc_profile *);
+static int	do_store_private_key(struct sc_profile *, const char *);
 static int	do_store_public_key(struct sc_profile *, EVP_PKEY *);
 static int	do_store_certificate(struct sc_profile *);
 static int	do_update_certificate(struct sc_profile *);
 static int	do_convert_cert(sc_pkcs15_der_t *, X509 *);
-static int	is_cacert_already_present(struct sc_pkcs15init_certargs *);
+static int	is_cacert_already_present(struct sc_profile *, struct sc_pkcs15init_certargs *);
 static int	do_finalize_card(sc_card_t *, struct sc_profile *);
 
 static int	do_read_data_object(const char *name, u8 **out, size_t *outlen);
@@ -116,6 +121,7 @@ static void	parse_commandline(int argc, char **argv);
 static void	read_options_file(const char *);
 static void	ossl_print_errors(void);
 static int	verify_pin(struct sc_pkcs15_card *, char *);
+static void	fork_per_card(const char *);
 
 enum {
 	OPT_OPTIONS = 0x100,
@@ -138,6 +144,8 @@ enum {
 	OPT_UPDATE_LAST_UPDATE,
 	OPT_ERASE_APPLICATION,
 	OPT_IGNORE_CA_CERTIFICATES,
+	OPT_PARALLEL,
+	OPT_KEY_POOL,
 
 	OPT_PIN1     = 0x10000,	/* don't touch these values */
 	OPT_PUK1     = 0x10001,
@@ -177,6 +185,7 @@ const struct option	options[] = {
 	{ "label",		required_argument, NULL,	'l' },
 	{ "puk-label",		required_argument, NULL,	OPT_PUK_LABEL },
 	{ "public-key-label",	required_argument, NULL,	OPT_PUBKEY_LABEL },
+	{ "key-pool",		required_argument, NULL,	OPT_KEY_POOL },
 	{ "cert-label",		required_argument, NULL,	OPT_CERT_LABEL },
 	{ "application-name",	required_argument, NULL,	OPT_APPLICATION_NAME },
 	{ "application-id",	required_argument, NULL,	OPT_APPLICATION_ID },
@@ -199,6 +208,7 @@ const struct option	options[] = {
 	{ "profile",		required_argument, NULL,	'p' },
 	{ "card-profile",	required_argument, NULL,	'c' },
 	{ "options-file",	required_argument, NULL,	OPT_OPTIONS },
+	{ "parallel",		required_argument, NULL,	OPT_PARALLEL },
 	{ "wait",		no_argument, NULL,		'w' },
 	{ "help",		no_argument, NULL,		'h' },
 	{ "verbose",		no_argument, NULL,		'v' },
@@ -237,6 +247,7 @@ static const char *		option_help[] = {
 	"Specify label of PIN/key",
 	"Specify label of PUK",
 	"Specify public key label (use with --generate-key)",
+	"Pre-generate <arg> unbound keys into the key pool (use with --generate-key)",
 	"Specify user cert label (use with --store-private-key)",
 	"Specify application name of data object (use with --store-data-object)",
 	"Specify application id of data object (use with --store-data-object)",
@@ -258,6 +269,7 @@ static const char *		option_help[] = {
 	"Specify the general profile to use",
 	"Specify the card profile to use",
 	"Read additional command line options from file",
+	"Personalise the cards of several readers at once, as listed in <arg> (one reader and options file per line)",
 	"Wait for card insertion",
 	"Display this message",
 	"Verbose operation. Use several times to enable debug output.",
@@ -328,6 +340,7 @@ static sc_context_t *	ctx = NULL;
 static sc_card_t *		card = NULL;
 static struct sc_pkcs15_card *	p15card = NULL;
 static char *			opt_reader = NULL;
+static char *			opt_parallel = NULL;
 static unsigned int		opt_actions;
 static int			opt_extractable = 0,
 				opt_insecure = 0,
@@ -340,6 +353,9 @@ static int			opt_extractable = 0,
 static const char *		opt_profile = "pkcs15";
 static char *			opt_card_profile = NULL;
 static char *			opt_infile = NULL;
+/* more private key files after the options, stored with the first one */
+static char **			opt_more_keyfiles = NULL;
+static int			opt_more_keyfiles_count = 0;
 static char *			opt_format = NULL;
 static char *			opt_authid = NULL;
 static char *			opt_objectid = NULL;
@@ -359,6 +375,7 @@ static char *			opt_puk_authid = NULL;
 static unsigned int		opt_x509_usage = 0;
 static unsigned int		opt_delete_flags = 0;
 static unsigned int		opt_type = 0;
+static unsigned int		opt_key_pool = 0;
 static int			ignore_cmdline_pins = 0;
 static struct secret		opt_secrets[MAX_SECRETS];
 static unsigned int		opt_secret_count;
@@ -419,7 +436,7 @@ main(int argc, char **argv)
 {
 	struct sc_profile	*profile = NULL;
 	unsigned int		n;
-	int			r = 0;
+	int			r = 0, r2, i;
 
 #if OPENSSL_VERSION_NUMBER >= 0x00907000L
 	OPENSSL_config(NULL);
@@ -434,8 +451,17 @@ main(int argc, char **argv)
 
 	parse_commandline(argc, argv);
 
-	if (optind != argc)
-		util_print_usage_and_die(app_name, options, option_help, NULL);
+	if (optind != argc) {
+		if (!(opt_actions & (1 << ACTION_STORE_PRIVKEY)))
+			util_print_usage_and_die(app_name, options, option_help, NULL);
+		if (opt_objectid)
+			util_fatal("Cannot store several private keys with the same --id\n");
+		opt_more_keyfiles = argv + optind;
+		opt_more_keyfiles_count = argc - optind;
+	}
+	if (opt_parallel)
+		/* only the processes for the cards come back */
+		fork_per_card(opt_parallel);
 	if (opt_actions == 0) {
 		fprintf(stderr, "No action specified.\n");
 		util_print_usage_and_die(app_name, options, option_help, NULL);
@@ -531,7 +557,15 @@ main(int argc, char **argv)
 			r = do_store_pin(profile);
 			break;
 		case ACTION_STORE_PRIVKEY:
-			r = do_store_private_key(profile);
+			/* key, certificates or public key: each DF written once,
+			 * also for all the files given after the options */
+			sc_pkcs15init_begin_batch(profile);
+			r = do_store_private_key(profile, opt_infile);
+			for (i = 0; i < opt_more_keyfiles_count && r >= 0; i++)
+				r = do_store_private_key(profile, opt_more_keyfiles[i]);
+			r2 = sc_pkcs15init_commit_batch(p15card, profile);
+			if (r >= 0)
+				r = r2;
 			break;
 		case ACTION_STORE_PUBKEY:
 			r = do_store_public_key(profile, NULL);
@@ -552,7 +586,11 @@ main(int argc, char **argv)
 			r = do_change_attributes(profile, opt_type);
 			break;
 		case ACTION_GENERATE_KEY:
+			sc_pkcs15init_begin_batch(profile);
 			r = do_generate_key(profile, opt_newkey);
+			r2 = sc_pkcs15init_commit_batch(p15card, profile);
+			if (r >= 0)
+				r = r2;
 			break;
 		case ACTION_FINALIZE_CARD:
 			r = do_finalize_card(card, profile);
@@ -860,7 +898,7 @@ failed:	fprintf(stderr, "Failed to read PIN: %s\n", sc_strerror(r));
  * Store a private key
  */
 static int
-do_store_private_key(struct sc_profile *profile)
+do_store_private_key(struct sc_profile *profile, const char *filename)
 {
 	struct sc_pkcs15init_prkeyargs args;
 	EVP_PKEY	*pkey = NULL;
@@ -870,11 +908,14 @@ do_store_private_key(struct sc_profile *profile)
 	if ((r = init_keyargs(&args)) < 0)
 		return r;
 
-	r = do_read_private_key(opt_infile, opt_format, &pkey, cert, MAX_CERTS);
+	r = do_read_private_key(filename, opt_format, &pkey, cert, MAX_CERTS);
 	if (r < 0)
 		return r;
 	ncerts = r;
 
+	if (opt_more_keyfiles_count)
+		printf("%s:\n", filename);
+
 	if (ncerts) {
 		char	namebuf[256];
 
@@ -957,7 +998,7 @@ do_store_private_key(struct sc_profile *profile)
 			if (opt_cert_label != 0)
 				cargs.label = opt_cert_label;
 		} else {
-			if (is_cacert_already_present(&cargs)) {
+			if (is_cacert_already_present(profile, &cargs)) {
 				printf("Certificate #%d already present, not stored.\n", i);
 				goto next_cert;
 			}
@@ -980,13 +1021,31 @@ next_cert:
  * Check if the CA certificate is already present
  */
 static int
-is_cacert_already_present(struct sc_pkcs15init_certargs *args)
+is_cacert_already_present(struct sc_profile *profile, struct sc_pkcs15init_certargs *args)
 {
 	sc_pkcs15_object_t	*objs[32];
 	sc_pkcs15_cert_info_t	*cinfo;
 	sc_pkcs15_cert_t	*cert;
+	struct sc_pkcs15_id	id;
 	int			i, count, r;
 
+	/* A copy stored by pkcs15-init has the intrinsic ID of the
+	 * certificate, found through the object index; chains shared by
+	 * many key files then cost one read per CA certificate */
+	memset(&id, 0, sizeof(id));
+	if (sc_pkcs15init_select_intrinsic_id(p15card, profile, SC_PKCS15_TYPE_CERT_X509,
+				&id, &args->der_encoded) > 0
+			&& sc_pkcs15_find_cert_by_id(p15card, &id, &objs[0]) == SC_SUCCESS) {
+		cinfo = (sc_pkcs15_cert_info_t *) objs[0]->data;
+		if (sc_pkcs15_read_certificate(p15card, cinfo, &cert) == SC_SUCCESS && cert) {
+			r = cert->data.len == args->der_encoded.len
+				&& !memcmp(cert->data.value, args->der_encoded.value, cert->data.len);
+			sc_pkcs15_free_certificate(cert);
+			if (r)
+				return 1;
+		}
+	}
+
 	r = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_CERT_X509, objs, 32);
 	if (r <= 0)
 		return 0;
@@ -1526,7 +1585,10 @@ do_generate_key(struct sc_profile *profile, const char *spec)
 			}
 		}
 	}
-	r = sc_pkcs15init_generate_key(p15card, profile, &keygen_args, keybits, NULL);
+	if (opt_key_pool)
+		r = sc_pkcs15init_fill_key_pool(p15card, profile, &keygen_args, keybits, opt_key_pool);
+	else
+		r = sc_pkcs15init_generate_key(p15card, profile, &keygen_args, keybits, NULL);
 	return r;
 }
 
@@ -2444,6 +2506,12 @@ handle_option(const struct option *opt)
 	case OPT_OPTIONS:
 		read_options_file(optarg);
 		break;
+	case OPT_PARALLEL:
+		opt_parallel = optarg;
+		break;
+	case OPT_KEY_POOL:
+		opt_key_pool = strtoul(optarg, NULL, 10);
+		break;
 	case OPT_PIN1: case OPT_PUK1:
 	case OPT_PIN2: case OPT_PUK2:
 		opt_pins[opt->val & 3] = optarg;
@@ -2645,6 +2713,85 @@ read_options_file(const char *filename)
 	fclose(fp);
 }
 
+/*
+ * Personalise many cards at once: every line of the file gives a reader
+ * and an options file with the PINs, keys and certificates of the card in
+ * it. A process is started for each card, with its own context, applying
+ * the options of its file on top of the command line. The cards are not
+ * waited for one after the other, which matters most for on-card key
+ * generation. The results of all cards are reported at the end.
+ */
+#ifndef _WIN32
+static void
+fork_per_card(const char *filename)
+{
+	char		buffer[1024], *reader, *options_file;
+	struct {
+		pid_t	pid;
+		char	*reader;
+	}		*cards = NULL, *tmp;
+	unsigned int	count = 0, failed = 0, n;
+	FILE		*fp;
+	pid_t		pid;
+	int		status;
+
+	if ((fp = fopen(filename, "r")) == NULL)
+		util_fatal("Unable to open %s: %m", filename);
+	fflush(stdout);
+	fflush(stderr);
+	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+		buffer[strcspn(buffer, "\n")] = '\0';
+		reader = strtok(buffer, " \t");
+		if (reader == NULL || *reader == '#')
+			continue;
+		options_file = strtok(NULL, " \t");
+		if (options_file == NULL)
+			util_fatal("No options file for reader %s in %s", reader, filename);
+
+		pid = fork();
+		if (pid < 0)
+			util_fatal("Unable to start a process for reader %s: %m", reader);
+		if (pid == 0) {
+			fclose(fp);
+			free(cards);
+			opt_reader = strdup(reader);
+			/* nobody to answer a prompt */
+			opt_no_prompt = 1;
+			read_options_file(options_file);
+			return;
+		}
+		tmp = realloc(cards, (count + 1) * sizeof(*cards));
+		if (tmp == NULL)
+			util_fatal("Out of memory");
+		cards = tmp;
+		cards[count].pid = pid;
+		cards[count].reader = strdup(reader);
+		count++;
+	}
+	fclose(fp);
+
+	for (n = 0; n < count; n++) {
+		if (waitpid(cards[n].pid, &status, 0) < 0
+				|| !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed++;
+			printf("Reader %s: failed\n", cards[n].reader);
+		}
+		else {
+			printf("Reader %s: done\n", cards[n].reader);
+		}
+		free(cards[n].reader);
+	}
+	free(cards);
+	printf("%u of %u cards personalised.\n", count - failed, count);
+	exit(failed ? 1 : 0);
+}
+#else
+static void
+fork_per_card(const char *filename)
+{
+	util_fatal("--parallel is not supported on this platform");
+}
+#endif
 
 /*
  * OpenSSL helpers
@@ -36,6 +36,10 @@ typedef unsigned __int32 uint32_t;
 #include <openssl/crypto.h>
 #endif
 #include <limits.h>
+#include <stdarg.h>
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#endif
 
 #include "libopensc/pkcs15.h"
 #include "libopensc/asn1.h"
@@ -75,7 +79,9 @@ enum {
 	OPT_VERIFY_PIN,
 	OPT_BIND_TO_AID,
 	OPT_LIST_APPLICATIONS,
-	OPT_LIST_SKEYS
+	OPT_LIST_SKEYS,
+	OPT_ALL_READERS,
+	OPT_PROFILE_BIND
 };
 
 #define NELEMENTS(x)	(sizeof(x)/sizeof((x)[0]))
@@ -104,6 +110,8 @@ static const struct option options[] = {
 	{ "test-update",	no_argument, NULL,		'T' },
 	{ "update",		no_argument, NULL,		'U' },
 	{ "reader",		required_argument, NULL,	OPT_READER },
+	{ "all-readers",	no_argument, NULL,		OPT_ALL_READERS },
+	{ "profile-bind",	no_argument, NULL,		OPT_PROFILE_BIND },
 	{ "pin",                required_argument, NULL,	OPT_PIN },
 	{ "new-pin",		required_argument, NULL,	OPT_NEWPIN },
 	{ "puk",		required_argument, NULL,	OPT_PUK },
@@ -138,6 +146,8 @@ static const char *option_help[] = {
 	"Test if the card needs a security update",
 	"Update the card with a security update",
 	"Uses reader number <arg>",
+	"Reads certificates and public keys of the cards in all readers at once, outputs JSON",
+	"Prints the time, APDUs and cache lookups of the phases of connecting, binding and reading the certificates",
 	"Specify PIN",
 	"Specify New PIN (when changing or unblocking)",
 	"Specify Unblock PIN",
@@ -1782,6 +1792,362 @@ end:
         return 0;
 }
 
+/*
+ * --all-readers: bind the cards of all readers at once, one thread per
+ * reader, and print their certificates and public keys as JSON.
+ */
+struct json_buf {
+	char	*data;
+	size_t	len, size;
+};
+
+struct reader_scan {
+	sc_reader_t	*reader;
+	struct sc_aid	*aid;
+	struct json_buf	out;
+};
+
+static void json_printf(struct json_buf *buf, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	while (1) {
+		va_start(ap, fmt);
+		n = vsnprintf(buf->data ? buf->data + buf->len : NULL,
+				buf->size - buf->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			util_fatal("Output formatting failed");
+		if ((size_t) n < buf->size - buf->len)
+			break;
+		buf->size = buf->len + n + 1024;
+		buf->data = realloc(buf->data, buf->size);
+		if (buf->data == NULL)
+			util_fatal("Not enough memory");
+	}
+	buf->len += n;
+}
+
+static void json_string(struct json_buf *buf, const char *s)
+{
+	if (s == NULL) {
+		json_printf(buf, "null");
+		return;
+	}
+	json_printf(buf, "\"");
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			json_printf(buf, "\\%c", c);
+		else if (c < 0x20)
+			json_printf(buf, "\\u%04x", c);
+		else
+			json_printf(buf, "%c", c);
+	}
+	json_printf(buf, "\"");
+}
+
+static void json_base64(struct json_buf *buf, const u8 *data, size_t len)
+{
+	size_t b64_len = (len + 2) / 3 * 4 + 1;
+	u8 *b64 = malloc(b64_len);
+
+	if (b64 == NULL)
+		util_fatal("Not enough memory");
+	if (sc_base64_encode(data, len, b64, b64_len, 0) < 0)
+		json_printf(buf, "null");
+	else
+		json_printf(buf, "\"%s\"", b64);
+	free(b64);
+}
+
+static void json_object_common(struct json_buf *buf, const struct sc_pkcs15_object *obj,
+		const struct sc_pkcs15_id *id, const sc_path_t *path)
+{
+	char hex[SC_PKCS15_MAX_ID_SIZE * 2 + 1], tmp[SC_MAX_PATH_STRING_SIZE];
+
+	/* sc_pkcs15_print_id() and sc_print_path() use static buffers */
+	sc_bin_to_hex(id->value, id->len, hex, sizeof(hex), 0);
+	json_printf(buf, "\"id\": \"%s\", \"label\": ", hex);
+	json_string(buf, obj->label);
+	if (path->len || path->aid.len) {
+		sc_path_print(tmp, sizeof(tmp), path);
+		json_printf(buf, ", \"path\": \"%s\"", tmp);
+	}
+}
+
+static void scan_certificates(struct json_buf *buf, struct sc_pkcs15_card *p15)
+{
+	struct sc_pkcs15_object *objs[32];
+	int r, i;
+
+	json_printf(buf, ",\n    \"certificates\": [");
+	r = sc_pkcs15_get_objects(p15, SC_PKCS15_TYPE_CERT_X509, objs, 32);
+	for (i = 0; i < r; i++) {
+		struct sc_pkcs15_cert_info *info = (struct sc_pkcs15_cert_info *) objs[i]->data;
+		struct sc_pkcs15_cert *cert = NULL;
+		int rv;
+
+		json_printf(buf, "%s\n      { ", i ? "," : "");
+		json_object_common(buf, objs[i], &info->id, &info->path);
+		json_printf(buf, ", \"authority\": %s", info->authority ? "true" : "false");
+		rv = sc_pkcs15_read_certificate(p15, info, &cert);
+		if (rv < 0) {
+			json_printf(buf, ", \"error\": ");
+			json_string(buf, sc_strerror(rv));
+		} else {
+			json_printf(buf, ", \"der\": ");
+			json_base64(buf, cert->data.value, cert->data.len);
+			sc_pkcs15_free_certificate(cert);
+		}
+		json_printf(buf, " }");
+	}
+	json_printf(buf, "%s]", r > 0 ? "\n    " : "");
+}
+
+static void scan_public_keys(struct json_buf *buf, struct sc_pkcs15_card *p15)
+{
+	const char *types[] = { "", "RSA", "DSA", "GOSTR3410", "EC", "", "", "" };
+	struct sc_pkcs15_object *objs[32];
+	int r, i;
+
+	json_printf(buf, ",\n    \"public_keys\": [");
+	r = sc_pkcs15_get_objects(p15, SC_PKCS15_TYPE_PUBKEY, objs, 32);
+	for (i = 0; i < r; i++) {
+		struct sc_pkcs15_pubkey_info *info = (struct sc_pkcs15_pubkey_info *) objs[i]->data;
+		struct sc_pkcs15_pubkey *pubkey = NULL;
+		sc_pkcs15_der_t der;
+		int rv;
+
+		json_printf(buf, "%s\n      { ", i ? "," : "");
+		json_object_common(buf, objs[i], &info->id, &info->path);
+		json_printf(buf, ", \"type\": \"%s\", \"bits\": %lu", types[7 & objs[i]->type],
+				(unsigned long) (info->modulus_length ? info->modulus_length : info->field_length));
+		/* no PIN is asked for, keys that need one are reported as errors */
+		rv = sc_pkcs15_read_pubkey(p15, objs[i], &pubkey);
+		if (rv >= 0) {
+			rv = pubkey_pem_encode(pubkey, &pubkey->data, &der);
+			sc_pkcs15_free_pubkey(pubkey);
+		}
+		if (rv < 0) {
+			json_printf(buf, ", \"error\": ");
+			json_string(buf, sc_strerror(rv));
+		} else {
+			json_printf(buf, ", \"der\": ");
+			json_base64(buf, der.value, der.len);
+			free(der.value);
+		}
+		json_printf(buf, " }");
+	}
+	json_printf(buf, "%s]", r > 0 ? "\n    " : "");
+}
+
+static void *scan_reader(void *arg)
+{
+	struct reader_scan *scan = (struct reader_scan *) arg;
+	struct json_buf *buf = &scan->out;
+	struct sc_pkcs15_card *p15 = NULL;
+	sc_card_t *rcard = NULL;
+	char atr[SC_MAX_ATR_SIZE * 3];
+	int r;
+
+	json_printf(buf, "  {\n    \"reader\": ");
+	json_string(buf, scan->reader->name);
+
+	r = sc_detect_card_presence(scan->reader);
+	if (r == 0)
+		r = SC_ERROR_CARD_NOT_PRESENT;
+	if (r > 0)
+		r = sc_connect_card(scan->reader, &rcard);
+	if (r >= 0) {
+		sc_bin_to_hex(rcard->atr.value, rcard->atr.len, atr, sizeof(atr), ':');
+		json_printf(buf, ",\n    \"atr\": \"%s\"", atr);
+		r = sc_lock(rcard);
+		if (r >= 0) {
+			r = sc_pkcs15_bind(rcard, scan->aid, &p15);
+			if (r < 0)
+				sc_unlock(rcard);
+		}
+	}
+	if (r < 0) {
+		json_printf(buf, ",\n    \"error\": ");
+		json_string(buf, sc_strerror(r));
+	} else {
+		if (opt_no_cache)
+			p15->opts.use_file_cache = 0;
+		json_printf(buf, ",\n    \"label\": ");
+		json_string(buf, p15->tokeninfo->label);
+		json_printf(buf, ",\n    \"serial\": ");
+		json_string(buf, p15->tokeninfo->serial_number);
+		scan_certificates(buf, p15);
+		scan_public_keys(buf, p15);
+		sc_pkcs15_unbind(p15);
+		sc_unlock(rcard);
+	}
+	if (rcard)
+		sc_disconnect_card(rcard);
+	json_printf(buf, "\n  }");
+	return NULL;
+}
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+static int scan_mutex_create(void **mutex)
+{
+	pthread_mutex_t *m = calloc(1, sizeof(*m));
+
+	if (m == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	pthread_mutex_init(m, NULL);
+	*mutex = m;
+	return SC_SUCCESS;
+}
+
+static int scan_mutex_lock(void *mutex)
+{
+	return pthread_mutex_lock((pthread_mutex_t *) mutex) ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int scan_mutex_unlock(void *mutex)
+{
+	return pthread_mutex_unlock((pthread_mutex_t *) mutex) ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int scan_mutex_destroy(void *mutex)
+{
+	pthread_mutex_destroy((pthread_mutex_t *) mutex);
+	free(mutex);
+	return SC_SUCCESS;
+}
+
+static int scan_rwlock_create(void **rwlock)
+{
+	pthread_rwlock_t *l = calloc(1, sizeof(*l));
+
+	if (l == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	pthread_rwlock_init(l, NULL);
+	*rwlock = l;
+	return SC_SUCCESS;
+}
+
+static int scan_rwlock_rdlock(void *rwlock)
+{
+	return pthread_rwlock_rdlock((pthread_rwlock_t *) rwlock) ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int scan_rwlock_wrlock(void *rwlock)
+{
+	return pthread_rwlock_wrlock((pthread_rwlock_t *) rwlock) ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int scan_rwlock_unlock(void *rwlock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) rwlock) ? SC_ERROR_INTERNAL : SC_SUCCESS;
+}
+
+static int scan_rwlock_destroy(void *rwlock)
+{
+	pthread_rwlock_destroy((pthread_rwlock_t *) rwlock);
+	free(rwlock);
+	return SC_SUCCESS;
+}
+
+/* the scanning threads look up their readers and match the ATRs shared */
+static sc_thread_context_t scan_thread_ctx = {
+	1, scan_mutex_create, scan_mutex_lock, scan_mutex_unlock, scan_mutex_destroy, NULL,
+	scan_rwlock_create, scan_rwlock_rdlock, scan_rwlock_unlock,
+	scan_rwlock_wrlock, scan_rwlock_unlock, scan_rwlock_destroy
+};
+#endif
+
+static int scan_all_readers(void)
+{
+	struct reader_scan *scans;
+	struct sc_aid aid, *paid = NULL;
+	unsigned int i, count;
+	FILE *outf = stdout;
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	pthread_t *threads;
+#endif
+
+	if (opt_bind_to_aid) {
+		aid.len = sizeof(aid.value);
+		if (sc_hex_to_bin(opt_bind_to_aid, aid.value, &aid.len)) {
+			fprintf(stderr, "Invalid AID value: '%s'\n", opt_bind_to_aid);
+			return 1;
+		}
+		paid = &aid;
+	}
+
+	count = sc_ctx_get_reader_count(ctx);
+	if (count == 0) {
+		fprintf(stderr, "No smart card readers found.\n");
+		return 1;
+	}
+	scans = calloc(count, sizeof(*scans));
+	if (scans == NULL)
+		util_fatal("Not enough memory");
+	for (i = 0; i < count; i++) {
+		scans[i].reader = sc_ctx_get_reader(ctx, i);
+		scans[i].aid = paid;
+	}
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	threads = calloc(count, sizeof(*threads));
+	if (threads == NULL)
+		util_fatal("Not enough memory");
+	/* the scan takes as long as the slowest card, not the sum of all */
+	for (i = 0; i < count; i++)
+		if (pthread_create(&threads[i], NULL, scan_reader, &scans[i]))
+			util_fatal("Cannot create a thread for reader %u", i);
+	for (i = 0; i < count; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+#else
+	for (i = 0; i < count; i++)
+		scan_reader(&scans[i]);
+#endif
+
+	if (opt_outfile != NULL) {
+		outf = fopen(opt_outfile, "w");
+		if (outf == NULL) {
+			fprintf(stderr, "Error opening file '%s': %s\n",
+				opt_outfile, strerror(errno));
+			outf = stdout;
+		}
+	}
+	fprintf(outf, "[\n");
+	for (i = 0; i < count; i++) {
+		fprintf(outf, "%s%s", scans[i].out.data, i + 1 < count ? ",\n" : "\n");
+		free(scans[i].out.data);
+	}
+	fprintf(outf, "]\n");
+	if (outf != stdout)
+		fclose(outf);
+	free(scans);
+	return 0;
+}
+
+/* Reads the certificates, as the applications do right after the bind,
+ * and prints the phases of all that */
+static void profile_bind(struct sc_trace_profile *profile)
+{
+	struct sc_pkcs15_object *objs[32];
+	struct sc_pkcs15_cert *cert;
+	int i, count;
+
+	count = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_CERT_X509, objs, 32);
+	for (i = 0; i < count; i++)
+		if (sc_pkcs15_read_certificate(p15card,
+				(struct sc_pkcs15_cert_info *) objs[i]->data, &cert) == SC_SUCCESS)
+			sc_pkcs15_free_certificate(cert);
+
+	printf("Card '%s', driver '%s'\n", card->name, card->driver->short_name);
+	sc_trace_profile_print(profile, stdout);
+}
+
 int main(int argc, char * const argv[])
 {
 	int err = 0, r, c, long_optind = 0;
@@ -1805,8 +2171,11 @@ int main(int argc, char * const argv[])
 	int do_learn_card = 0;
 	int do_test_update = 0;
 	int do_update = 0;
+	int do_all_readers = 0;
+	int do_profile_bind = 0;
 	int action_count = 0;
 	sc_context_param_t ctx_param;
+	struct sc_trace_profile *profile = NULL;
 
 	while (1) {
 		c = getopt_long(argc, argv, "r:cuko:va:LR:CwDTU", options, &long_optind);
@@ -1889,6 +2258,14 @@ int main(int argc, char * const argv[])
 			do_update = 1;
 			action_count++;
 			break;
+		case OPT_ALL_READERS:
+			do_all_readers = 1;
+			action_count++;
+			break;
+		case OPT_PROFILE_BIND:
+			do_profile_bind = 1;
+			action_count++;
+			break;
 		case OPT_READER:
 			opt_reader = optarg;
 			break;
@@ -1931,6 +2308,13 @@ int main(int argc, char * const argv[])
 	memset(&ctx_param, 0, sizeof(ctx_param));
 	ctx_param.ver      = 0;
 	ctx_param.app_name = app_name;
+	if (do_all_readers) {
+		if (action_count > 1)
+			util_fatal("--all-readers cannot be combined with other actions");
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+		ctx_param.thread_ctx = &scan_thread_ctx;
+#endif
+	}
 
 	r = sc_context_create(&ctx, &ctx_param);
 	if (r) {
@@ -1943,6 +2327,20 @@ int main(int argc, char * const argv[])
 		sc_ctx_log_to_file(ctx, "stderr");
 	}
 
+	if (do_all_readers) {
+		err = scan_all_readers();
+		goto end;
+	}
+
+	if (do_profile_bind) {
+		r = sc_trace_profile_start(ctx, &profile);
+		if (r) {
+			fprintf(stderr, "Failed to start the profile: %s\n", sc_strerror(r));
+			err = 1;
+			goto end;
+		}
+	}
+
 	err = util_connect_card(ctx, &card, opt_reader, opt_wait, verbose);
 	if (err)
 		goto end;
@@ -1975,6 +2373,13 @@ int main(int argc, char * const argv[])
 	if (verbose)
 		fprintf(stderr, "Found %s!\n", p15card->tokeninfo->label);
 
+	if (do_profile_bind) {
+		profile_bind(profile);
+		sc_trace_profile_stop(profile);
+		profile = NULL;
+		action_count--;
+	}
+
 	if (do_verify_pin)
 		if ((err = verify_pin()))
 			goto end;
@@ -2069,6 +2474,8 @@ int main(int argc, char * const argv[])
 		}
 	}
 end:
+	if (profile)
+		sc_trace_profile_stop(profile);
 	if (p15card)
 		sc_pkcs15_unbind(p15card);
 	if (card) {